@@ -0,0 +1,279 @@
+/*
+ * batch.c - runs a file of render jobs headless, one after another.
+ *
+ * This works the way resizing the window does: when one job is done, every
+ * module is torn down and set up again at the next job's size, with the
+ * random number generator reseeded and the parameters set from the job.
+ * The OpenCL context and the programs built in it live outside of that, so
+ * only the first job pays for building them.
+ *
+ * With more than one GPU, the jobs can be spread across them.  Width and
+ * Height, like most of the state here, are global, so one process can only
+ * run one job at a time; instead, a worker process is started for each GPU,
+ * with its own context and queue on that GPU, and worker "k" of "n" takes
+ * jobs k, k + n, k + 2n, and so on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#include "batch.h"
+#include "datasrc.h"
+#include "debug.h"
+#include "image.h"
+#include "opencl.h"
+#include "param.h"
+#include "randbj.h"
+#include "record.h"
+#include "util.h"
+#include "window.h"
+
+#define	BATCH_LINELEN	512
+#define	BATCH_NAMELEN	64
+#define	BATCH_PATHLEN	256
+#define	BATCH_DUMPLEN	256
+
+typedef struct {
+	char		bj_core[BATCH_NAMELEN];
+	pix_t		bj_width;
+	pix_t		bj_height;
+	long		bj_seed;
+	int		bj_steps;
+	char		bj_output[BATCH_PATHLEN];
+	char		bj_params[BATCH_DUMPLEN];	/* "" for defaults */
+} batch_job_t;
+
+static struct {
+	batch_job_t	*jobs;		/* BATCH_MAX of them */
+	int		njobs;
+	int		cur;		/* running now, or -1 */
+	int		stride;		/* number of workers */
+	int		worker;		/* which one this is */
+
+	int		frames;		/* finished in the current job */
+	hrtime_t	start;		/* when the current job started */
+} Batch = {
+	.cur = -1
+};
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Whether a job's output is a still image, rather than a video stream.
+ */
+static bool
+batch_still(const batch_job_t *bj)
+{
+	const size_t	len = strlen(bj->bj_output);
+
+	return (len > 4 && strcmp(&bj->bj_output[len - 4], ".ppm") == 0);
+}
+
+static void
+batch_parse(const char *path)
+{
+	char		line[BATCH_LINELEN];
+	int		lineno;
+	FILE		*fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		die("Couldn't open job file \"%s\"\n", path);
+	}
+	Batch.jobs = mem_alloc(BATCH_MAX * sizeof (batch_job_t));
+
+	for (lineno = 1; fgets(line, sizeof (line), fp) != NULL; lineno++) {
+		batch_job_t	*bj = &Batch.jobs[Batch.njobs];
+		const char	*p = line + strspn(line, " \t");
+		unsigned	w, h;
+		int		n;
+
+		if (*p == '#' || *p == '\n' || *p == '\0') {
+			continue;
+		}
+		if (Batch.njobs == BATCH_MAX) {
+			die("%s: more than %d jobs\n", path, BATCH_MAX);
+		}
+
+		bj->bj_params[0] = '\0';
+		n = sscanf(p, "%63s %ux%u %ld %d %255s %255s", bj->bj_core,
+		    &w, &h, &bj->bj_seed, &bj->bj_steps, bj->bj_output,
+		    bj->bj_params);
+		if (n < 6 || w == 0 || h == 0 || bj->bj_steps <= 0) {
+			die("%s, line %d: expected \"<core> <width>x<height> "
+			    "<seed> <steps> <output> [<params>]\"\n",
+			    path, lineno);
+		}
+		bj->bj_width = w;
+		bj->bj_height = h;
+		Batch.njobs++;
+	}
+	(void) fclose(fp);
+
+	if (Batch.njobs == 0) {
+		die("%s: no jobs\n", path);
+	}
+}
+
+/*
+ * Count the GPUs.  That can't be done in this process, since the OpenCL
+ * runtime can't be relied on to work in a child after it's been used in the
+ * parent; so a child counts them, and hands back the answer as its exit
+ * status.
+ */
+static int
+batch_gpus(void)
+{
+	pid_t	pid;
+	int	status;
+
+	if ((pid = fork()) < 0) {
+		die("Couldn't fork to count GPUs");
+	} else if (pid == 0) {
+		_exit(MIN(opencl_gpu_count(), 255));
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return (1);
+	}
+	return (MAX(WEXITSTATUS(status), 1));
+}
+
+/*
+ * Start a worker for each of "n" GPUs, and wait for them.  This only
+ * returns in the workers.
+ */
+static void
+batch_fanout(int n)
+{
+	int	failed = 0;
+
+	for (int k = 0; k < n; k++) {
+		const pid_t	pid = fork();
+
+		if (pid < 0) {
+			die("Couldn't start worker %d", k);
+		} else if (pid == 0) {
+			Batch.worker = k;
+			Batch.stride = n;
+			opencl_device_pick(k);
+			return;
+		}
+	}
+
+	note("Running %d jobs on %d GPUs\n", Batch.njobs, n);
+	for (int k = 0; k < n; k++) {
+		int	status;
+
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			failed++;
+		}
+	}
+	if (failed != 0) {
+		die("%d of %d workers failed\n", failed, n);
+	}
+	exit(0);
+}
+
+void
+batch_file(const char *path, bool fanout, pix_t *widthp, pix_t *heightp,
+    long *seedp, char **paramsp)
+{
+	batch_job_t	*bj;
+
+	batch_parse(path);
+
+	Batch.worker = 0;
+	Batch.stride = 1;
+	if (fanout && Batch.njobs > 1) {
+		const int	n = MIN(batch_gpus(), Batch.njobs);
+
+		if (n > 1) {
+			batch_fanout(n);
+		}
+	}
+
+	Batch.cur = Batch.worker;
+	bj = &Batch.jobs[Batch.cur];
+
+	*widthp = bj->bj_width;
+	*heightp = bj->bj_height;
+	*seedp = bj->bj_seed;
+	*paramsp = (bj->bj_params[0] != '\0' ? bj->bj_params : NULL);
+	record_stream(batch_still(bj) ? NULL : bj->bj_output);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Called by window_restart() while everything is torn down, to get the
+ * next job's stream and seed in place before the modules start up again.
+ */
+static void
+batch_switch(void)
+{
+	const batch_job_t	*bj = &Batch.jobs[Batch.cur];
+
+	record_stream(batch_still(bj) ? NULL : bj->bj_output);
+	srandbj(bj->bj_seed);
+}
+
+static void
+batch_next(void)
+{
+	const batch_job_t	*bj;
+
+	Batch.cur += Batch.stride;
+	if (Batch.cur >= Batch.njobs) {
+		exit(0);
+	}
+	bj = &Batch.jobs[Batch.cur];
+
+	window_restart(bj->bj_width, bj->bj_height, batch_switch);
+	if (bj->bj_params[0] != '\0') {
+		param_undump(bj->bj_params);
+	} else {
+		param_reset_to_defaults();
+	}
+	Batch.frames = 0;
+}
+
+void
+batch_frame(cl_mem image)
+{
+	const batch_job_t	*bj;
+
+	if (Batch.cur < 0) {
+		return;
+	}
+	bj = &Batch.jobs[Batch.cur];
+
+	if (Batch.frames++ == 0) {
+		if (strcmp(bj->bj_core, "*") != 0 &&
+		    strcmp(bj->bj_core, datasrc_core_name()) != 0) {
+			warn("Job %d is for \"%s\", not \"%s\"; skipping it\n",
+			    Batch.cur, bj->bj_core, datasrc_core_name());
+			batch_next();
+			return;
+		}
+		Batch.start = gethrtime();
+	}
+	if (Batch.frames < bj->bj_steps) {
+		return;
+	}
+
+	if (batch_still(bj)) {
+		image_write(image, bj->bj_output);
+	}
+	kernel_wait();
+	note("Job %d: %s, %dx%d, seed %ld, %d steps in %.3f seconds -> %s\n",
+	    Batch.cur, datasrc_core_name(), (int)Width, (int)Height,
+	    bj->bj_seed, bj->bj_steps,
+	    (double)(gethrtime() - Batch.start) / 1e9, bj->bj_output);
+
+	batch_next();
+}
@@ -0,0 +1,49 @@
+/*
+ * batch.h - interfaces for running a file of render jobs headless ("-i").
+ *
+ * Each line of the job file describes one job:
+ *
+ *	<core> <width>x<height> <seed> <steps> <output> [<params>]
+ *
+ * "core" is the name the core registers under (such as "multiscale" or
+ * "life"), or "*" for whichever one this program runs; jobs for other cores
+ * are skipped.  "params" is a param_dump() string.  If "output" ends in
+ * ".ppm", the last image is saved there; otherwise every image is recorded
+ * to it, as with "-V".  Blank lines and lines starting with "#" are ignored.
+ *
+ * The jobs run one after another in the same process, so the programs that
+ * have been built and the box blur tuning carry over from one to the next;
+ * between jobs, every module is torn down and set up again at the new size.
+ */
+
+#ifndef	_BATCH_H
+#define	_BATCH_H
+
+#include "types.h"
+
+/*
+ * The most jobs in one file.
+ */
+#define	BATCH_MAX	1024
+
+/*
+ * Read the jobs in "path", and return the size, seed, and parameter string
+ * of the first one.  If "fanout" is set and there's more than one GPU, this
+ * starts a worker process for each GPU, which takes every Nth job; the
+ * original process waits for them all and exits without returning.
+ *
+ * This gets called from main() before any of the modules' preinit routines.
+ */
+extern void
+batch_file(const char *path, bool fanout, pix_t *widthp, pix_t *heightp,
+    long *seedp, char **paramsp);
+
+/*
+ * Called at the end of each frame, with the image that was just finished.
+ * Once the current job has run all of its steps, this saves its output and
+ * starts the next one, or exits if there isn't one.
+ */
+extern void
+batch_frame(cl_mem image);
+
+#endif	/* _BATCH_H */
@@ -0,0 +1,194 @@
+/*
+ * bench.c - a headless benchmark, with results that can be compared from
+ * one run to the next.
+ *
+ * The frame times come from telemetry.c, which keeps every one of them
+ * once the warmup is over.  Each run appends a line like this to the
+ * results file:
+ *
+ *	{"core":"multiscale","dir":"tc","width":1280,"height":720,"seed":1,
+ *	    "warmup":50,"steps":500,"params":"...","device":"...",
+ *	    "driver":"...","seconds":4.210,"fps":118.76,"stages":{
+ *	    "step":{"n":500,"mean":6.112,"min":5.802,"p50":6.044,...}, ...}}
+ *
+ * "dir" is the directory the run was made from, since more than one core
+ * can register under the same name.  All times are in milliseconds, and
+ * the blur, combine, and render stages are only split out of "step" by the
+ * cores that time them.
+ *
+ * When measuring the overhead ("-X"), the line also has
+ *
+ *	"overhead":{"core":0.412,"frame":1.904,"overhead":1.492,
+ *	    "handoff":0.087,"ratio":3.621,"limit":0.500}
+ *
+ * which are the mean time per frame of the core's step, of the whole frame,
+ * of the difference, and of the GL handoff within it, and the ratio of the
+ * difference to the core's step.  Every stage waits for the GPU at both
+ * ends then (see telemetry_sync()), so each asynchronous stage of the
+ * "stages" object is charged its own GPU time.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#include "bench.h"
+#include "datasrc.h"
+#include "debug.h"
+#include "module.h"
+#include "opencl.h"
+#include "param.h"
+#include "telemetry.h"
+#include "util.h"
+
+#define	BENCH_DUMPLEN	256
+
+static struct {
+	int		steps;		/* timed steps, or 0 */
+	int		warmup;		/* untimed steps before them */
+	long		seed;
+	const char	*path;		/* results file */
+	float		overhead;	/* see bench_overhead_enable() */
+
+	int		frames;		/* frames so far */
+	hrtime_t	start;		/* when the timed steps started */
+} Bench;
+
+/* ------------------------------------------------------------------ */
+
+void
+bench_enable(int steps, int warmup, long seed, const char *path)
+{
+	Bench.steps = steps;
+	Bench.warmup = MAX(warmup, 1);	/* skip building kernels, at least */
+	Bench.seed = seed;
+	Bench.path = path;
+}
+
+void
+bench_overhead_enable(float fraction)
+{
+	Bench.overhead = fraction;
+}
+
+/*
+ * The last component of the current directory.
+ */
+static const char *
+bench_dir(char *buf, size_t len)
+{
+	const char	*slash;
+
+	if (getcwd(buf, len) == NULL) {
+		return ("");
+	}
+	slash = strrchr(buf, '/');
+	return (slash != NULL ? slash + 1 : buf);
+}
+
+/*
+ * Work out how much of each frame wasn't spent in the core, and complain
+ * if it's too much.
+ */
+static void
+bench_write_overhead(FILE *fp)
+{
+	const double	core = telemetry_record_mean(TM_CORE);
+	const double	frame = telemetry_record_mean(TM_FRAME);
+	const double	handoff = telemetry_record_mean(TM_HANDOFF);
+	const double	overhead = MAX(frame - core, 0.0);
+	const double	ratio = (core > 0 ? overhead / core : 0);
+
+	(void) fprintf(fp, ",\"overhead\":{\"core\":%.3f,\"frame\":%.3f,"
+	    "\"overhead\":%.3f,\"handoff\":%.3f,\"ratio\":%.3f,"
+	    "\"limit\":%.3f}",
+	    core, frame, overhead, handoff, ratio, Bench.overhead);
+
+	note("%s: %.3f ms per frame in the core, %.3f ms around it\n",
+	    datasrc_core_name(), core, overhead);
+	if (ratio > Bench.overhead) {
+		warn("Framework overhead is %.2f times the core's step "
+		    "(the limit is %.2f)\n", ratio, Bench.overhead);
+	}
+}
+
+static void
+bench_write(hrtime_t elapsed)
+{
+	const double	seconds = (double)elapsed / 1e9;
+	char		dump[BENCH_DUMPLEN];
+	char		cwd[PATH_MAX];
+	FILE		*fp;
+
+	if ((fp = fopen(Bench.path, "a")) == NULL) {
+		die("Couldn't open benchmark results file \"%s\"\n",
+		    Bench.path);
+	}
+	param_dump(dump, sizeof (dump) - 1);
+
+	(void) fprintf(fp, "{\"core\":\"%s\",\"dir\":\"%s\","
+	    "\"width\":%d,\"height\":%d,\"seed\":%ld,"
+	    "\"warmup\":%d,\"steps\":%d,\"params\":\"%s\","
+	    "\"device\":\"%s\",\"driver\":\"%s\","
+	    "\"seconds\":%.3f,\"fps\":%.2f,\"stages\":",
+	    datasrc_core_name(), bench_dir(cwd, sizeof (cwd)),
+	    (int)Width, (int)Height, Bench.seed,
+	    Bench.warmup, Bench.steps, dump,
+	    opencl_device_name(), opencl_driver_version(),
+	    seconds, Bench.steps / seconds);
+	telemetry_record_write(fp);
+	if (Bench.overhead != 0) {
+		bench_write_overhead(fp);
+	}
+	(void) fprintf(fp, "}\n");
+	(void) fclose(fp);
+
+	note("%s: %d steps at %dx%d in %.3f seconds (%.2f fps), "
+	    "appended to %s\n", datasrc_core_name(), Bench.steps,
+	    (int)Width, (int)Height, seconds, Bench.steps / seconds,
+	    Bench.path);
+}
+
+void
+bench_frame(void)
+{
+	if (Bench.steps == 0) {
+		return;
+	}
+	Bench.frames++;
+
+	/*
+	 * Drain the GPU at either end, so none of the warmup's work gets
+	 * counted, and all of the timed steps' work does.
+	 */
+	if (Bench.frames == Bench.warmup) {
+		kernel_wait();
+		telemetry_record(Bench.steps);
+		telemetry_sync(Bench.overhead != 0);
+		Bench.start = gethrtime();
+	} else if (Bench.frames == Bench.warmup + Bench.steps) {
+		kernel_wait();
+		bench_write(gethrtime() - Bench.start);
+		exit(0);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+bench_init(void)
+{
+	if (Bench.steps != 0) {
+		verbose(DB_PERF, "Benchmark: %d steps after %d warmup steps, "
+		    "seed %ld\n", Bench.steps, Bench.warmup, Bench.seed);
+	}
+}
+
+const module_ops_t	bench_ops = {
+	NULL,
+	bench_init,
+	NULL
+};
@@ -0,0 +1,47 @@
+/*
+ * bench.h - interfaces for the headless benchmark ("-b").
+ *
+ * A benchmark runs the core headless (unless it's measuring the overhead)
+ * with a fixed seed and fixed parameters and no autopilot, so two runs on
+ * the same machine do the same work.  The
+ * first "warmup" steps aren't timed; the per-stage times of the "steps"
+ * after that are then written to the results file as one line of JSON, and
+ * the program exits.  "make bench" at the top level runs this for each core
+ * at a few resolutions.
+ */
+
+#ifndef	_BENCH_H
+#define	_BENCH_H
+
+#include "types.h"
+
+/*
+ * Run a benchmark of "steps" steps after "warmup" untimed ones, started
+ * from random seed "seed", and append the results to "path".
+ *
+ * This gets called from main() before bench_preinit().
+ */
+extern void
+bench_enable(int steps, int warmup, long seed, const char *path);
+
+/*
+ * Measure the framework's overhead: wait for the GPU on either side of
+ * every stage, so that TM_CORE is the whole cost of the core, each of the
+ * others is the whole cost of that stage, and the rest of each frame is the
+ * cost of everything around the core.  Warn if that is more than "fraction"
+ * times the core's cost.  This is meant to be used with the "map" core,
+ * which does next to nothing itself, and with a window, so that the GL
+ * handoff is counted.
+ *
+ * This also gets called from main() before bench_preinit().
+ */
+extern void
+bench_overhead_enable(float fraction);
+
+/*
+ * Called at the end of each frame.
+ */
+extern void
+bench_frame(void);
+
+#endif	/* _BENCH_H */
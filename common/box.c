@@ -1,18 +1,34 @@
 /*
  * box.c - wrapper code for invoking OpenCL box blur implementation(s).
  *
- * There are three separate implementations of box blur, since the
+ * There are five separate implementations of box blur, since the
  * performance of it is so critical to the smooth operation of this program,
  * and different blur radii have very different performance tradeoffs.
- * They are described in detail in box.cl, along with their requirements.
+ * They are described in detail in box.cl, subblock.cl, and sat.cl, along
+ * with their requirements.  The packed one is only built for 1-D data.
+ *
+ * Which implementation is fastest for a given radius depends on the GPU,
+ * the driver, and the image size, so the first time a radius is used, every
+ * reasonable configuration for it is timed and the best one is recorded in
+ * boxparams' tuning cache.  Later runs on the same system just use the
+ * cached results.
+ *
+ * "D k" turns on an experimental persistent-kernel mode, in which all of
+ * the radii of box_blur_multi() are done by a single launch; see
+ * persistent_box() in box.cl.  The first time it's used, it's timed
+ * against the usual path, and the difference is reported.
  */
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #include "common.h"
 #include "debug.h"
+#include "explore.h"
 #include "module.h"
 #include "opencl.h"
 #include "osdep.h"
@@ -27,16 +43,85 @@
 static struct {
 	kernel_data_t	manual_box_kernel;
 	kernel_data_t	direct_box_kernel;
+	kernel_data_t	direct_box_multi_kernel;
+	kernel_data_t	fused_box_kernel;
+	kernel_data_t	downsample_kernel;
 	kernel_data_t	subblock_box_kernel;
 	kernel_data_t	subblock_table_kernel;
-
-	cl_mem		scratch;		/* holding space for 1-D blur */
+	kernel_data_t	sat_rows_kernel;
+	kernel_data_t	sat_cols_kernel;
+	kernel_data_t	sat_box_kernel;
+	kernel_data_t	packed_rows_kernel;	/* 1-D data only */
+	kernel_data_t	packed_cols_kernel;
+	kernel_data_t	persistent_box_kernel;
+	kernel_data_t	persistent_reset_kernel;
+
+	cl_mem		scratch[OPENCL_MAX_STREAMS];	/* for 1-D blur */
+	cl_mem		sat_hi;			/* summed-area table, hi part */
+	cl_mem		sat_lo;			/* summed-area table, lo part */
+	cl_mem		pyramid;		/* decimated copy of source */
 	cl_mem		subblock_W_params;	/* parameter table */
 	cl_mem		subblock_H_params;	/* parameter table, transpose */
 
 	subblock_params_t *debug_params;	/* local copy for debug */
+
+	bool		notune;			/* don't tune radii on first use */
+	pix_t		pyramid_radius;		/* decimate radii >= this */
+
+	bool		persistent;		/* use persistent_box()? */
+	bool		persistent_checked;	/* ... compared to the usual? */
+	cl_mem		persistent_ctr;		/* its job and barrier counts */
 } Box;
 
+/*
+ * The number of timed runs of each configuration when tuning; the fastest
+ * one is used.  There's also one untimed warmup run.
+ */
+#define	BOX_TUNE_SAMPLES	3
+
+/*
+ * Empirically, using fewer blocks than this is never better.
+ */
+#define	BOX_TUNE_MINNBLK	4
+
+/*
+ * The most radii that direct_box_multi_1d() can do in one launch, and the
+ * most that box_blur_multi() can be handed at once.  The former has to
+ * match the definition in box.cl.
+ */
+#define	BOX_MULTI_MAX		8
+#define	BOX_MULTI_MAXN		32
+
+/*
+ * The fused kernel needs two rows' worth of local memory; leave this much
+ * of it for whatever the compiler wants to use on its own.
+ */
+#define	BOX_FUSED_SLOP		1024
+
+/*
+ * How many rows each work item of packed_box_cols() slides its window down.
+ */
+#define	BOX_PACKED_ROWS		16
+
+/*
+ * How many ints persistent_box() needs for its counters, and how far its
+ * results can be from the usual path's before they're deemed wrong.
+ */
+#define	BOX_PERSIST_NCTR	(4 * BOX_MULTI_MAX + 1)
+#define	BOX_PERSIST_TOLERANCE	1e-2
+
+/*
+ * The most workgroups persistent_box() is started with.  Nothing promises
+ * that even one per compute unit will all be running at once, so this
+ * stays small; they take rows as they go, so fewer is only slower.
+ */
+#define	BOX_PERSIST_MAXWG	8
+
+/*
+ * Decimating radii smaller than this isn't worth the loss of accuracy.
+ */
+#define	BOX_PYRAMID_MINRADIUS	8
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -60,10 +145,32 @@ box_handle_params(void)
 	}
 }
 
+/*
+ * Called for "D k".  The recorded kernel graphs have the old choice of
+ * kernels in them.
+ */
+static void
+box_toggle_persistent(void)
+{
+	Box.persistent = !Box.persistent;
+	Box.persistent_checked = false;
+	kernel_graph_invalidate_all();
+	note("Persistent box blur %s\n", Box.persistent ? "on" : "off");
+}
+
 static void
 box_preinit(void)
 {
 	debug_register_toggle('b', "box blur", DB_BOX, box_handle_params);
+	debug_register_toggle('k', "persistent box blur", 0,
+	    box_toggle_persistent);
+
+	/*
+	 * Exploration mode doesn't use the tuned settings; see box_choose().
+	 */
+	if (explore_tile() != 0) {
+		Box.notune = true;
+	}
 }
 
 static void
@@ -97,24 +204,51 @@ box_init_subblock_tables(void)
 	kernel_invoke(kd, 2, global, NULL);
 
 	buffer_free(&nblocks_remote);
+
+	// Recorded blurs may have used the old tables.
+	kernel_graph_invalidate_all();
 }
 
 static void
 box_init(void)
 {
 	const size_t	arraysize =
-	    (size_t)Width * Height * sizeof (cl_boxvector);
+	    (size_t)Width * Height * sizeof (cl_boxstore);
 	const size_t	paramsize =
 	    MAX_RADIUS * MAX_NBLOCKS * sizeof (subblock_params_t);
 
-	Box.scratch = buffer_alloc(arraysize);
+	/*
+	 * This is the biggest transient buffer there is, and the box blur is
+	 * set up before anything else that has one, so the others share it.
+	 */
+	Box.scratch[0] = transient_alloc(arraysize, TR_STEP);
 	Box.subblock_W_params = buffer_alloc(paramsize);
 	Box.subblock_H_params = buffer_alloc(paramsize);
 
 	kernel_create(&Box.manual_box_kernel,     "manual_box_2d_r1");
 	kernel_create(&Box.direct_box_kernel,     "direct_box_1d");
+	kernel_create(&Box.direct_box_multi_kernel, "direct_box_multi_1d");
+	kernel_create(&Box.fused_box_kernel,      "fused_box_1d");
+	kernel_create(&Box.downsample_kernel,     "box_downsample");
 	kernel_create(&Box.subblock_box_kernel,   "subblock_box_1d");
 	kernel_create(&Box.subblock_table_kernel, "subblock_build_table");
+	kernel_create(&Box.sat_rows_kernel,       "sat_rows");
+	kernel_create(&Box.sat_cols_kernel,       "sat_cols");
+	kernel_create(&Box.sat_box_kernel,        "sat_box_2d");
+	kernel_create(&Box.persistent_box_kernel, "persistent_box");
+	kernel_create(&Box.persistent_reset_kernel, "persistent_reset");
+#if	BOX_DIMENSIONS == 1
+	kernel_create(&Box.packed_rows_kernel,    "packed_box_rows");
+	kernel_create(&Box.packed_cols_kernel,    "packed_box_cols");
+#endif
+
+	/*
+	 * The summed-area table is allocated on first use, since it's big
+	 * and many configurations never choose it.
+	 */
+	Box.sat_hi = Box.sat_lo = NULL;
+	Box.pyramid = NULL;
+	Box.persistent_ctr = NULL;
 
 	// Initialize the boxparams table.
 	boxparams_init();
@@ -128,12 +262,39 @@ box_fini(void)
 {
 	kernel_cleanup(&Box.manual_box_kernel);
 	kernel_cleanup(&Box.direct_box_kernel);
+	kernel_cleanup(&Box.direct_box_multi_kernel);
+	kernel_cleanup(&Box.fused_box_kernel);
+	kernel_cleanup(&Box.downsample_kernel);
 	kernel_cleanup(&Box.subblock_box_kernel);
 	kernel_cleanup(&Box.subblock_table_kernel);
-
+	kernel_cleanup(&Box.sat_rows_kernel);
+	kernel_cleanup(&Box.sat_cols_kernel);
+	kernel_cleanup(&Box.sat_box_kernel);
+	kernel_cleanup(&Box.persistent_box_kernel);
+	kernel_cleanup(&Box.persistent_reset_kernel);
+#if	BOX_DIMENSIONS == 1
+	kernel_cleanup(&Box.packed_rows_kernel);
+	kernel_cleanup(&Box.packed_cols_kernel);
+#endif
+
+	if (Box.sat_hi != NULL) {
+		buffer_free(&Box.sat_hi);
+		buffer_free(&Box.sat_lo);
+	}
+	if (Box.pyramid != NULL) {
+		buffer_free(&Box.pyramid);
+	}
+	if (Box.persistent_ctr != NULL) {
+		buffer_free(&Box.persistent_ctr);
+	}
 	buffer_free(&Box.subblock_H_params);
 	buffer_free(&Box.subblock_W_params);
-	buffer_free(&Box.scratch);
+	transient_free(&Box.scratch[0], TR_STEP);
+	for (int s = 1; s < OPENCL_MAX_STREAMS; s++) {
+		if (Box.scratch[s] != NULL) {
+			buffer_free(&Box.scratch[s]);
+		}
+	}
 }
 
 const module_ops_t	box_ops = {
@@ -218,6 +379,235 @@ invoke_sub(kernel_data_t *kd,
 	}
 }
 
+/*
+ * A summed-area table blur takes three launches: building the table along
+ * the rows, then along the columns, and then doing the lookups.  Only the
+ * first of those cares about "nblocks"; it's divided up just like the
+ * subblock kernel, but one row per workgroup.
+ *
+ * The table only depends on the source, so box_blur_multi() builds it once
+ * and then does the lookups for each radius.
+ */
+static void
+invoke_sat_build(pix_t width, pix_t height, blkidx_t nblocks, cl_mem src)
+{
+	kernel_data_t	*kd;
+	size_t		global[2] = { nblocks, height };
+	size_t		local[2] = { nblocks, 1 };
+	int		arg;
+
+	if (Box.sat_hi == NULL) {
+		const size_t	arraysize =
+		    (size_t)Width * Height * sizeof (cl_boxvector);
+
+		Box.sat_hi = buffer_alloc(arraysize);
+		Box.sat_lo = buffer_alloc(arraysize);
+	}
+
+	kd = &Box.sat_rows_kernel;
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.sat_hi);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.sat_lo);
+	kernel_setarg(kd, arg++, sizeof (cl_boxvector) * local[0], NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_boxvector) * local[0], NULL);
+	kernel_invoke(kd, 2, global, local);
+
+	kd = &Box.sat_cols_kernel;
+	global[0] = P2ROUNDUP((size_t)width, kernel_wgsize(kd));
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.sat_hi);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.sat_lo);
+	kernel_invoke(kd, 1, global, NULL);
+}
+
+static void
+invoke_sat_lookup(pix_t width, pix_t height, cl_mem dst, pix_t radius)
+{
+	kernel_data_t	*kd = &Box.sat_box_kernel;
+	int		arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.sat_hi);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.sat_lo);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &dst);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &radius);
+	kernel_invoke(kd, 2, NULL, NULL);
+
+	if (debug_enabled(DB_BOX)) {
+		debug(DB_BOX, "t r=%3d wh=[%4u %4u]\n",
+		    radius, width, height);
+	}
+}
+
+static void
+invoke_sat(pix_t width, pix_t height, blkidx_t nblocks,
+    cl_mem src, cl_mem dst, pix_t radius)
+{
+	invoke_sat_build(width, height, nblocks, src);
+	invoke_sat_lookup(width, height, dst, radius);
+}
+
+/*
+ * Can fused_box_1d() do a blur of this radius on an image this size?
+ * It needs two copies of the longer of a row or a column in local memory.
+ */
+static bool
+box_fused_ok(pix_t width, pix_t height, pix_t radius)
+{
+	const size_t	need =
+	    2 * (size_t)MAX(width, height) * sizeof (cl_boxvector);
+	const size_t	have = opencl_device_localmem();
+
+	/*
+	 * Each thread slides its window along a run of the row, which can
+	 * cross from one exploration instance into the next.
+	 */
+	if (explore_tile() != 0) {
+		return (false);
+	}
+
+	return (radius < MIN(width, height) && need + BOX_FUSED_SLOP <= have);
+}
+
+/*
+ * One launch of fused_box_1d(), doing all "nbox" passes along the rows of
+ * "src", and storing the transposed result into "dst".
+ */
+static void
+invoke_fused(pix_t width, pix_t height, cl_mem src, cl_mem dst,
+    pix_t radius, int nbox)
+{
+	kernel_data_t	*kd = &Box.fused_box_kernel;
+	const size_t	nthreads = MIN(kernel_wgsize(kd), (size_t)width);
+	size_t		global[2] = { nthreads, height };
+	size_t		local[2] = { nthreads, 1 };
+	int		arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &dst);
+	kernel_setarg(kd, arg++, sizeof (cl_boxvector) * width, NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_boxvector) * width, NULL);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &radius);
+	kernel_setarg(kd, arg++, sizeof (int), &nbox);
+
+	kernel_invoke(kd, 2, global, local);
+
+	if (debug_enabled(DB_BOX)) {
+		debug(DB_BOX, "f r=%3d wh=[%4u %4u] n=%d l=%4zu\n",
+		    radius, width, height, nbox, nthreads);
+	}
+}
+
+/*
+ * Can the packed kernels do a blur of this radius on an image this size?
+ * They only exist for 1-D data, and do four pixels of a row at a time.
+ */
+static bool
+box_packed_ok(pix_t width, pix_t height, pix_t radius)
+{
+#if	BOX_DIMENSIONS == 1
+	return (explore_tile() == 0 && width % 4 == 0 &&
+	    radius < MIN(width, height));
+#else
+	return (false);
+#endif
+}
+
+/*
+ * One pass of the packed blur: packed_box_rows() from "src" into "dst"
+ * if "cols" is false, or packed_box_cols() if it's true.  Each workgroup
+ * is "blockwidth" work items (of four pixels each) wide.
+ */
+static void
+invoke_packed(bool cols, pix_t width, pix_t height, pix_t blockwidth,
+    pix_t blockheight, cl_mem src, cl_mem dst, pix_t radius)
+{
+	kernel_data_t	*kd = (cols ?
+	    &Box.packed_cols_kernel : &Box.packed_rows_kernel);
+	pix_t		rows = BOX_PACKED_ROWS;
+	const pix_t	items = (cols ? (height + rows - 1) / rows : height);
+	size_t		global[2] = {
+		P2ROUNDUP(width / 4, blockwidth),
+		P2ROUNDUP(items, blockheight)
+	};
+	size_t		local[2] = { blockwidth, blockheight };
+	int		arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &dst);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &radius);
+	if (cols) {
+		kernel_setarg(kd, arg++, sizeof (pix_t), &rows);
+	}
+
+	kernel_invoke(kd, 2, global, local);
+
+	if (debug_enabled(DB_BOX)) {
+		debug(DB_BOX, "%c r=%3d w=%4u h=%4u "
+		    "g=[%4zu %4zu] l=[%4zu %4zu]\n", (cols ? 'v' : 'p'),
+		    radius, width, height,
+		    global[0], global[1], local[0], local[1]);
+	}
+}
+
+/*
+ * One launch of direct_box_multi_1d(), doing the first (horizontal) pass
+ * for up to BOX_MULTI_MAX radii.  The radii must be in increasing order.
+ */
+static void
+invoke_box_multi(pix_t width, pix_t height, pix_t blockwidth,
+    pix_t blockheight, cl_mem src, cl_mem *dst, const pix_t *radii, int n)
+{
+	kernel_data_t	*kd = &Box.direct_box_multi_kernel;
+	size_t		global[2] = {
+		P2ROUNDUP(width, blockwidth),
+		P2ROUNDUP(height, blockheight)
+	};
+	size_t		local[2] = { blockwidth, blockheight };
+	cl_uint8	rv;
+	int		arg;
+
+	assert(n >= 1 && n <= BOX_MULTI_MAX);
+	for (int i = 0; i < BOX_MULTI_MAX; i++) {
+		rv.s[i] = radii[MIN(i, n - 1)];
+	}
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++,
+	    sizeof (cl_boxvector) * local[0] * local[1], NULL);
+	kernel_setarg(kd, arg++, sizeof (int), &n);
+	kernel_setarg(kd, arg++, sizeof (cl_uint8), &rv);
+	for (int i = 0; i < BOX_MULTI_MAX; i++) {
+		// Unused outputs still need a valid buffer; they aren't written.
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &dst[MIN(i, n - 1)]);
+	}
+
+	kernel_invoke(kd, 2, global, local);
+
+	if (debug_enabled(DB_BOX)) {
+		debug(DB_BOX, "m r=%3d-%3d n=%d w=%4u h=%4u "
+		    "g=[%4zu %4zu] l=[%4zu %4zu]\n",
+		    radii[0], radii[n - 1], n, width, height,
+		    global[0], global[1], local[0], local[1]);
+	}
+}
+
 /*
  * This is the actual constraint we need for choosing the maximum block size
  * for box blur; this might be smaller than the device's maximum workgroup size.
@@ -240,6 +630,21 @@ box_blur_maxwgsize(box_kernel_t bk)
 		kd = &Box.subblock_box_kernel;
 		break;
 
+	case BK_SAT:
+		kd = &Box.sat_rows_kernel;
+		break;
+
+	case BK_PACKED:
+		/*
+		 * Nothing can be tuned for this if the kernels don't exist,
+		 * or can't handle the image.
+		 */
+		if (!box_packed_ok(Width, Height, 1)) {
+			return (0);
+		}
+		return ((pix_t)MIN(kernel_wgsize(&Box.packed_rows_kernel),
+		    kernel_wgsize(&Box.packed_cols_kernel)));
+
 	default:
 		assert(0 && "unknown box blur type in box_blur_maxwgsize");
 		break;
@@ -248,6 +653,58 @@ box_blur_maxwgsize(box_kernel_t bk)
 	return ((pix_t)kernel_wgsize(kd));
 }
 
+/*
+ * Which kernel and block count to use for "radius".  In exploration mode,
+ * direct_box_1d() and direct_box_multi_1d() are the only kernels that know
+ * to wrap around at the edges of each instance, so they're used for every
+ * radius, with workgroups as close to square as possible.
+ */
+static box_kernel_t
+box_choose(pix_t radius, blkidx_t *nblkp)
+{
+	box_kernel_t	bk;
+
+	if (explore_tile() != 0) {
+		const pix_t	maxwg = box_blur_maxwgsize(BK_DIRECT);
+		blkidx_t	nblk = 1;
+
+		while ((pix_t)(nblk * nblk) < maxwg && nblk < MAX_NBLOCKS) {
+			nblk <<= 1;
+		}
+		*nblkp = nblk;
+		return (BK_DIRECT);
+	}
+
+	bk = boxparams_get(radius, nblkp);
+
+#if	BOX_DIMENSIONS == 1
+	/*
+	 * The untuned defaults were all tuned for 4-D data.  With 1-D data,
+	 * four pixels in a row make up the same float4, so the packed kernels
+	 * stand in for the 1-D ones wherever they can handle the image;
+	 * elsewhere, the table's own choice of 1-D kernel stays.
+	 */
+	if (!boxparams_tuned(radius) &&
+	    (bk == BK_DIRECT || bk == BK_SUBBLOCK) &&
+	    box_packed_ok(Width, Height, radius)) {
+		bk = BK_PACKED;
+	}
+#endif
+
+	/*
+	 * A tuned choice of the packed kernels might have been made for a
+	 * different image size, so it may need to fall back.  Either way,
+	 * the workgroup may need to be smaller.
+	 */
+	if (bk == BK_PACKED) {
+		if (!box_packed_ok(Width, Height, radius)) {
+			bk = BK_DIRECT;
+		}
+		*nblkp = MIN(*nblkp, (blkidx_t)box_blur_maxwgsize(bk));
+	}
+	return (bk);
+}
+
 /*
  * Another API which allows more direct invocation, for testing performance.
  */
@@ -255,9 +712,18 @@ static void
 box_blur_specific(cl_mem src, cl_mem dst, pix_t radius,
     pix_t width, pix_t height, blkidx_t nblk, box_kernel_t bk, int nbox)
 {
-	const cl_mem	scratch = Box.scratch;
+	const cl_mem	scratch = Box.scratch[opencl_stream_current()];
 	kernel_data_t	*kd;
 
+	/*
+	 * The tuner only picks the packed kernels for images they can
+	 * handle, but a cached choice might be for a different radius.
+	 */
+	if (bk == BK_PACKED && !box_packed_ok(width, height, radius)) {
+		bk = BK_DIRECT;
+		nblk = MIN(nblk, (blkidx_t)box_blur_maxwgsize(BK_DIRECT));
+	}
+
 	switch (bk) {
 	case BK_MANUAL:
 		kd = &Box.manual_box_kernel;
@@ -271,6 +737,16 @@ box_blur_specific(cl_mem src, cl_mem dst, pix_t radius,
 		kd = &Box.subblock_box_kernel;
 		break;
 
+	case BK_SAT:
+		kd = &Box.sat_rows_kernel;
+		break;
+
+	case BK_PACKED:
+		kd = (kernel_wgsize(&Box.packed_rows_kernel) <
+		    kernel_wgsize(&Box.packed_cols_kernel) ?
+		    &Box.packed_rows_kernel : &Box.packed_cols_kernel);
+		break;
+
 	default:
 		assert(0 && "unknown box blur type in box_blur_specific");
 		break;
@@ -288,6 +764,19 @@ box_blur_specific(cl_mem src, cl_mem dst, pix_t radius,
 		assert(nblk * h == maxwg);
 	}
 
+	/*
+	 * With more than one pass of a 1-D kernel, doing all of the passes
+	 * along each axis in local memory saves a round trip through global
+	 * memory per pass.  This doesn't depend on the block count, so it
+	 * doesn't need tuning.
+	 */
+	if ((bk == BK_DIRECT || bk == BK_SUBBLOCK) && nbox > 1 &&
+	    box_fused_ok(width, height, radius)) {
+		invoke_fused(width, height, src, scratch, radius, nbox);
+		invoke_fused(height, width, scratch, dst, radius, nbox);
+		return;
+	}
+
 	switch (bk) {
 	case BK_MANUAL:	/* 2-D kernel */
 		if (nbox % 2 == 1) {
@@ -329,63 +818,919 @@ box_blur_specific(cl_mem src, cl_mem dst, pix_t radius,
 		}
 		break;
 
+	case BK_SAT:
+		/*
+		 * Each pass is a complete 2-D blur, and it doesn't transpose.
+		 * (The workgroup is always one row tall; see invoke_sat().)
+		 */
+		for (int i = 0; i < nbox; i++) {
+			invoke_sat(width, height, nblk, src, dst, radius);
+			src = dst;
+		}
+		break;
+
+	case BK_PACKED:	/* doesn't transpose */
+		for (int i = 0; i < nbox; i++) {
+			invoke_packed(false, width, height, nblk, h,
+			    src, scratch, radius);
+			invoke_packed(true, width, height, nblk, h,
+			    scratch, dst, radius);
+			src = dst;
+		}
+		break;
+
 	case BK_NUM_KERNELS:	// don't do this
 		assert(0 && "box_blur_specific received BK_NUM_KERNELS");
 		break;
 	}
 }
 
+/* ------------------------------------------------------------------ */
+
 /*
- * Perform a box blur on the 2-D buffer "src", placing the result in "dst".
- * The radius of the blur is given by "radius".
+ * This is called from main() before box_init(), if the user doesn't want
+ * the startup delay of tuning.  Any results in the tuning cache are still used.
  */
 void
-box_blur(cl_mem src, cl_mem dst, pix_t radius, int nbox)
+box_autotune_disable(void)
 {
-	box_kernel_t	bk;
-	blkidx_t	nblk;
+	Box.notune = true;
+}
+
+/*
+ * Time one configuration of a single-pass box blur, in nanoseconds.
+ */
+static hrtime_t
+box_time_one(cl_mem src, cl_mem dst, pix_t radius,
+    blkidx_t nblk, box_kernel_t bk)
+{
+	hrtime_t	best = LLONG_MAX;
 
-	bk = boxparams_get(radius, &nblk);
+	box_blur_specific(src, dst, radius, Width, Height, nblk, bk, 1);
+	kernel_wait();
 
-	box_blur_specific(src, dst, radius, Width, Height, nblk, bk, nbox);
-}
+	for (int i = 0; i < BOX_TUNE_SAMPLES; i++) {
+		kernel_timing_start();
+		box_blur_specific(src, dst, radius, Width, Height, nblk, bk, 1);
+		best = MIN(best, kernel_timing_stop());
+	}
 
-/* ------------------------------------------------------------------ */
+	return (best);
+}
 
 /*
- * Run a box blur performance test on the selected GPU.
- * This is useful for calibrating or updating the heuristics given by the
- * boxparams_init_*() routines in boxparams.c.
+ * Try every kernel and block count that can handle this radius, and record
+ * the fastest one.  This is the same search that box_test() does, but for
+ * just one radius, so it can be done incrementally as radii get used.
  *
- * Unfortunately, this isn't amenable to giving incremental results,
- * since the subblock code needs to be configured with parameters
- * describing how large the block size is before it's actually used.
+ * "src" isn't modified, and "dst" gets overwritten, so the caller's blur
+ * can proceed as usual afterwards.
  */
-void
-box_test(pix_t min_radius, pix_t max_radius)
+static void
+box_tune_radius(cl_mem src, cl_mem dst, pix_t radius)
 {
 	const blkidx_t	maxnblk = (blkidx_t)opencl_device_maxwgsize();
-	const blkidx_t	minnblk = 4;	// empirically, lower isn't better
-	const size_t	lognblk = (size_t)log2((double)(maxnblk / minnblk));
-	const size_t	boxsize = Width * Height * sizeof (cl_boxvector);
-	cl_boxvector	*localbuf;
-	cl_mem		src, dst;
-	hrtime_t	**times[BK_NUM_KERNELS];	// [bk][lognblk][rad]
-	size_t		i;
+	const hrtime_t	start = gethrtime();
+	hrtime_t	besttime = LLONG_MAX;
+	blkidx_t	bestnblk;
+	box_kernel_t	bestbk;
 
-	if (max_radius > MAX_RADIUS) {
-		die("box_test: max radius must not be larger than %d\n",
-		    MAX_RADIUS);
-	}
+	bestbk = boxparams_get(radius, &bestnblk);
 
-	/*
-	 * Create some buffers for doing box blurs, and initialize them
-	 * with random (but valid, non-NaN) floating point values.
+	for (box_kernel_t bk = 0; bk < BK_NUM_KERNELS; bk++) {
+		const pix_t	maxwg = box_blur_maxwgsize(bk);
+
+		// BK_MANUAL only works for r = 1.
+		if (bk == BK_MANUAL && radius > 1) {
+			continue;
+		}
+		if (bk == BK_PACKED &&
+		    !box_packed_ok(Width, Height, radius)) {
+			continue;
+		}
+
+		for (blkidx_t nblk = maxnblk; nblk >= BOX_TUNE_MINNBLK;
+		    nblk >>= 1) {
+			hrtime_t	t;
+
+			if (nblk > maxwg || maxwg % nblk != 0 ||
+			    nblk > MAX_NBLOCKS) {
+				continue;
+			}
+
+			/*
+			 * The subblock kernel needs its parameter table
+			 * rebuilt for each block count.
+			 */
+			if (bk == BK_SUBBLOCK) {
+				boxparams_set(radius, nblk, bk);
+				box_init_subblock_tables();
+			}
+
+			t = box_time_one(src, dst, radius, nblk, bk);
+			debug(DB_BOX, "tune r=%3d bk=%d nblk=%4d: %6llu usec\n",
+			    radius, bk, nblk, t / 1000);
+			if (t < besttime) {
+				besttime = t;
+				bestbk = bk;
+				bestnblk = nblk;
+			}
+		}
+	}
+
+	boxparams_set_tuned(radius, bestnblk, bestbk);
+	box_init_subblock_tables();
+	boxparams_save();
+
+	verbose(DB_BOX, "Tuned box blur radius %d: bk %d nblk %d, "
+	    "%llu usec per pass (tuning took %llu msec)\n",
+	    radius, bestbk, bestnblk, besttime / 1000,
+	    (gethrtime() - start) / 1000000);
+}
+
+/*
+ * Perform a box blur on the 2-D buffer "src", placing the result in "dst".
+ * The radius of the blur is given by "radius".
+ */
+void
+box_blur(cl_mem src, cl_mem dst, pix_t radius, int nbox)
+{
+	box_kernel_t	bk;
+	blkidx_t	nblk;
+
+	if (!Box.notune && src != dst && !boxparams_tuned(radius)) {
+		box_tune_radius(src, dst, radius);
+	}
+
+	bk = box_choose(radius, &nblk);
+
+	box_blur_specific(src, dst, radius, Width, Height, nblk, bk, nbox);
+}
+
+/*
+ * Blur "src" at each of n full-resolution radii, placing the result for
+ * radii[i] in dst[i].
+ *
+ * This gives the same results as n calls to box_blur(), but the work that
+ * only depends on the source is shared.  The radii are handled in
+ * increasing order (the caller's order doesn't matter), and the first
+ * horizontal pass for all of the direct-kernel radii is done by one
+ * direct_box_multi_1d() launch per BOX_MULTI_MAX radii, which walks the
+ * widest window once instead of once per radius.  All summed-area table
+ * radii share one table.
+ *
+ * The first 1-D pass has to go somewhere other than its "dst" buffer, and
+ * all of them happen before any of the second passes.  Rather than
+ * allocating more scratch buffers, the first pass for the radius in sorted
+ * position p goes into the "dst" buffer of position (p - 1), and position
+ * 0 uses Box.scratch.  The second passes then go from the top down, so each
+ * one writes into a buffer whose contents have already been consumed.
+ * BK_MANUAL radii only exist for r = 1, so they're always at the bottom of
+ * the sorted order, and blur straight from "src"; since the bottom entry
+ * doesn't use Box.scratch in that case, they can use it too.
+ */
+static void
+box_blur_batch(cl_mem src, cl_mem *dst, const pix_t *radii, int n, int nbox)
+{
+	int		order[BOX_MULTI_MAXN];	// sorted position -> index
+	box_kernel_t	bk[BOX_MULTI_MAXN];	// by sorted position
+	blkidx_t	nblk[BOX_MULTI_MAXN];	// by sorted position
+	cl_mem		first[BOX_MULTI_MAXN];	// first-pass output
+	bool		sat_built = false;
+	int		ndirect = 0;
+	pix_t		mr[BOX_MULTI_MAX];
+	cl_mem		md[BOX_MULTI_MAX];
+
+	assert(n >= 1 && n <= BOX_MULTI_MAXN);
+
+	/*
+	 * Insertion sort by radius; n is always small.
+	 */
+	for (int i = 0; i < n; i++) {
+		int	p;
+
+		assert(dst[i] != src);
+		for (p = i; p > 0 && radii[order[p - 1]] > radii[i]; p--) {
+			order[p] = order[p - 1];
+		}
+		order[p] = i;
+	}
+
+	for (int p = 0; p < n; p++) {
+		const int	i = order[p];
+
+		if (!Box.notune && !boxparams_tuned(radii[i])) {
+			box_tune_radius(src, dst[i], radii[i]);
+		}
+		first[p] = (p == 0 ? Box.scratch[0] : dst[order[p - 1]]);
+	}
+	for (int p = 0; p < n; p++) {
+		bk[p] = box_choose(radii[order[p]], &nblk[p]);
+		assert(bk[p] != BK_MANUAL || bk[0] == BK_MANUAL);
+	}
+
+	/*
+	 * Phase 1: the first horizontal pass of every 1-D radius, and the
+	 * summed-area table.
+	 */
+	for (int p = 0; p < n; p++) {
+		const pix_t	r = radii[order[p]];
+		kernel_data_t	*kd;
+		pix_t		maxwg;
+
+		switch (bk[p]) {
+		case BK_MANUAL:
+			break;
+
+		case BK_SAT:
+			if (!sat_built) {
+				invoke_sat_build(Width, Height, nblk[p], src);
+				sat_built = true;
+			}
+			break;
+
+		case BK_SUBBLOCK:
+			invoke_sub(&Box.subblock_box_kernel, Width, Height,
+			    nblk[p], box_blur_maxwgsize(bk[p]) / nblk[p],
+			    src, first[p], r, Box.subblock_W_params);
+			break;
+
+		case BK_DIRECT:
+			/*
+			 * The batch uses the block size of its smallest radius.
+			 * If that doesn't fit the multi-radius kernel, this
+			 * radius just goes through the regular kernel.
+			 */
+			kd = &Box.direct_box_multi_kernel;
+			maxwg = (pix_t)kernel_wgsize(kd);
+			if (ndirect > 0 && nblk[p] != nblk[p - 1]) {
+				invoke_box_multi(Width, Height, nblk[p - 1],
+				    maxwg / nblk[p - 1], src, md, mr, ndirect);
+				ndirect = 0;
+			}
+			if (nblk[p] > maxwg || maxwg % nblk[p] != 0) {
+				kd = &Box.direct_box_kernel;
+				invoke_box(kd, Width, Height, nblk[p],
+				    (pix_t)kernel_wgsize(kd) / nblk[p],
+				    src, first[p], r);
+				break;
+			}
+			mr[ndirect] = r;
+			md[ndirect] = first[p];
+			if (++ndirect == BOX_MULTI_MAX) {
+				invoke_box_multi(Width, Height, nblk[p],
+				    maxwg / nblk[p], src, md, mr, ndirect);
+				ndirect = 0;
+			}
+			break;
+
+		case BK_PACKED:
+			invoke_packed(false, Width, Height, nblk[p],
+			    box_blur_maxwgsize(bk[p]) / nblk[p],
+			    src, first[p], r);
+			break;
+
+		case BK_NUM_KERNELS:	// don't do this
+			assert(0 && "box_blur_batch received BK_NUM_KERNELS");
+			break;
+		}
+
+		/*
+		 * Flush the batch at the end of each run of direct radii,
+		 * so the block size check above only has to look back one.
+		 */
+		if (ndirect > 0 && (p == n - 1 || bk[p + 1] != BK_DIRECT)) {
+			const pix_t	mwg = (pix_t)kernel_wgsize(
+			    &Box.direct_box_multi_kernel);
+
+			invoke_box_multi(Width, Height, nblk[p], mwg / nblk[p],
+			    src, md, mr, ndirect);
+			ndirect = 0;
+		}
+	}
+
+	/*
+	 * Phase 2: the second pass of each radius, top down.
+	 */
+	for (int p = n - 1; p >= 0; p--) {
+		const pix_t	r = radii[order[p]];
+		const cl_mem	out = dst[order[p]];
+		kernel_data_t	*kd;
+
+		switch (bk[p]) {
+		case BK_MANUAL:
+			box_blur_specific(src, out, r, Width, Height,
+			    nblk[p], bk[p], nbox);
+			break;
+
+		case BK_SAT:
+			invoke_sat_lookup(Width, Height, out, r);
+			break;
+
+		case BK_SUBBLOCK:
+			invoke_sub(&Box.subblock_box_kernel, Height, Width,
+			    nblk[p], box_blur_maxwgsize(bk[p]) / nblk[p],
+			    first[p], out, r, Box.subblock_H_params);
+			break;
+
+		case BK_DIRECT:
+			kd = &Box.direct_box_kernel;
+			invoke_box(kd, Height, Width, nblk[p],
+			    (pix_t)kernel_wgsize(kd) / nblk[p],
+			    first[p], out, r);
+			break;
+
+		case BK_PACKED:
+			invoke_packed(true, Width, Height, nblk[p],
+			    box_blur_maxwgsize(bk[p]) / nblk[p],
+			    first[p], out, r);
+			break;
+
+		case BK_NUM_KERNELS:
+			break;
+		}
+	}
+
+	/*
+	 * Phase 3: any remaining passes, which don't share anything.
+	 */
+	if (nbox > 1) {
+		for (int p = 0; p < n; p++) {
+			const cl_mem	out = dst[order[p]];
+
+			if (bk[p] != BK_MANUAL) {
+				box_blur_specific(out, out, radii[order[p]],
+				    Width, Height, nblk[p], bk[p], nbox - 1);
+			}
+		}
+	}
+}
+
+/*
+ * Another way of blurring "src" at each of n radii: rather than sharing
+ * work between them, each radius is blurred independently, in its own
+ * OpenCL stream, so that small-radius blurs that can't fill the GPU by
+ * themselves can run side by side.  Each stream gets its own scratch
+ * buffer.  The summed-area table and the pyramid buffer are shared, so
+ * all of the radii that use them are kept in stream 0, where they run in
+ * order.
+ */
+static void
+box_blur_streamed(cl_mem src, cl_mem *dst, const pix_t *radii, int n,
+    int nbox)
+{
+	const size_t	arraysize =
+	    (size_t)Width * Height * sizeof (cl_boxstore);
+	const int	nstreams = MIN(opencl_streams(), n);
+	int		f[BOX_MULTI_MAXN];
+	int		next = 0;
+
+	/*
+	 * Tuning waits for the GPU, so get it out of the way first.
+	 */
+	for (int i = 0; i < n; i++) {
+		assert(dst[i] != src);
+		f[i] = box_decimation(radii[i]);
+		if (f[i] == 1 && !Box.notune && !boxparams_tuned(radii[i])) {
+			box_tune_radius(src, dst[i], radii[i]);
+		}
+	}
+	for (int s = 1; s < nstreams; s++) {
+		if (Box.scratch[s] == NULL) {
+			Box.scratch[s] = buffer_alloc(arraysize);
+		}
+	}
+
+	opencl_fork();
+	for (int i = 0; i < n; i++) {
+		box_kernel_t	bk;
+		blkidx_t	nblk;
+
+		if (f[i] > 1) {
+			opencl_stream(0);
+			box_blur_decimated(src, dst[i], radii[i], nbox, f[i]);
+			continue;
+		}
+
+		bk = box_choose(radii[i], &nblk);
+		opencl_stream(bk == BK_SAT ? 0 : next++ % nstreams);
+		box_blur_specific(src, dst[i], radii[i],
+		    Width, Height, nblk, bk, nbox);
+	}
+	opencl_join();
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Can persistent_box() do all of these radii?  Each one has to be a
+ * full-resolution blur that fused_box_1d() could do.  Its workgroups also
+ * have to fit in a compute unit's local memory with room to spare, or else
+ * they can only run one after another, and would never meet at its
+ * barriers.
+ */
+static bool
+box_persistent_ok(const pix_t *radii, int n)
+{
+	const size_t	local = 2 * sizeof (cl_boxvector) *
+			    (size_t)MAX(Width, Height);
+
+	if (n > BOX_MULTI_MAX || 2 * local > opencl_device_localmem()) {
+		return (false);
+	}
+	for (int i = 0; i < n; i++) {
+		if (box_decimation(radii[i]) != 1 ||
+		    !box_fused_ok(Width, Height, radii[i])) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/*
+ * One launch of persistent_box() (and one of persistent_reset() before
+ * it), with at most one workgroup per compute unit, so that they can all
+ * be running at once.
+ */
+static void
+invoke_persistent(cl_mem src, cl_mem *dst, const pix_t *radii, int n,
+    int nbox)
+{
+	kernel_data_t	*kd = &Box.persistent_reset_kernel;
+	const size_t	nthreads =
+			    MIN(kernel_wgsize(&Box.persistent_box_kernel),
+			    (size_t)MIN(Width, Height));
+	const size_t	nwg = (size_t)MIN(MAX(opencl_device_computeunits(), 1),
+			    BOX_PERSIST_MAXWG);
+	const size_t	longest = (size_t)MAX(Width, Height);
+	size_t		rglobal[1] = { P2ROUNDUP((size_t)BOX_PERSIST_NCTR,
+			    kd->kd_maxitems[0]) };
+	size_t		global[2] = { nthreads, nwg };
+	size_t		local[2] = { nthreads, 1 };
+	int		nctr = BOX_PERSIST_NCTR;
+	cl_uint8	rv;
+	int		arg;
+
+	if (Box.persistent_ctr == NULL) {
+		Box.persistent_ctr =
+		    buffer_alloc(BOX_PERSIST_NCTR * sizeof (cl_int));
+	}
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.persistent_ctr);
+	kernel_setarg(kd, arg++, sizeof (int), &nctr);
+	kernel_invoke(kd, 1, rglobal, NULL);
+
+	for (int i = 0; i < BOX_MULTI_MAX; i++) {
+		rv.s[i] = radii[MIN(i, n - 1)];
+	}
+
+	kd = &Box.persistent_box_kernel;
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.scratch[0]);
+	kernel_setarg(kd, arg++, sizeof (cl_boxvector) * longest, NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_boxvector) * longest, NULL);
+	kernel_setarg(kd, arg++, sizeof (int), &n);
+	kernel_setarg(kd, arg++, sizeof (cl_uint8), &rv);
+	kernel_setarg(kd, arg++, sizeof (int), &nbox);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.persistent_ctr);
+	for (int i = 0; i < BOX_MULTI_MAX; i++) {
+		// Unused outputs need a valid buffer, but aren't written.
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &dst[MIN(i, n - 1)]);
+	}
+	kernel_invoke(kd, 2, global, local);
+
+	if (debug_enabled(DB_BOX)) {
+		debug(DB_BOX, "k r=%3d-%3d n=%d nwg=%zu l=%4zu\n",
+		    radii[0], radii[n - 1], n, nwg, nthreads);
+	}
+}
+
+#ifdef	HALF_STORAGE
+static float
+box_half_float(cl_half h)
+{
+	const int	e = (h >> 10) & 0x1f;
+	const float	m = (float)(h & 0x3ff);
+	float		f;
+
+	if (e == 0) {
+		f = ldexpf(m, -24);
+	} else if (e == 31) {
+		f = (m == 0 ? INFINITY : NAN);
+	} else {
+		f = ldexpf(m + 1024.0f, e - 25);
+	}
+	return ((h & 0x8000) ? -f : f);
+}
+#endif
+
+/*
+ * The largest difference between any two components of the first "npix"
+ * entries of "a" and "b", or NaN if either has a NaN.
+ */
+static double
+box_host_difference(const cl_boxstore *a, const cl_boxstore *b, size_t npix)
+{
+#ifdef	HALF_STORAGE
+	const cl_half	*ha = (const cl_half *)a, *hb = (const cl_half *)b;
+	const size_t	nvals = npix * sizeof (cl_boxstore) / sizeof (cl_half);
+#else
+	const float	*fa = (const float *)a, *fb = (const float *)b;
+	const size_t	nvals = npix * sizeof (cl_boxstore) / sizeof (float);
+#endif
+	double		maxdiff = 0;
+
+	for (size_t v = 0; v < nvals; v++) {
+#ifdef	HALF_STORAGE
+		const double	d =
+		    fabs(box_half_float(ha[v]) - box_half_float(hb[v]));
+#else
+		const double	d = fabs(fa[v] - fb[v]);
+#endif
+
+		if (isnan(d)) {
+			return (d);
+		}
+		maxdiff = MAX(maxdiff, d);
+	}
+
+	return (maxdiff);
+}
+
+double
+box_max_difference(cl_mem a, cl_mem b, size_t npix)
+{
+	const size_t	size = npix * sizeof (cl_boxstore);
+	cl_boxstore	*ha = mem_alloc(size);
+	cl_boxstore	*hb = mem_alloc(size);
+	double		maxdiff;
+
+	buffer_readfromgpu(a, ha, size);
+	buffer_readfromgpu(b, hb, size);
+	maxdiff = box_host_difference(ha, hb, npix);
+	mem_free((void **)&hb);
+	mem_free((void **)&ha);
+
+	return (maxdiff);
+}
+
+/*
+ * The first time persistent mode is used, time it against the usual path
+ * on the same blur, and check that it gets the same answer, with none of
+ * its barrier waits having given up; if not, the device doesn't keep the
+ * promises that persistent_box() can't count on, so persistent mode is
+ * turned back off.
+ */
+static void
+box_persistent_check(cl_mem src, cl_mem *dst, const pix_t *radii, int n,
+    int nbox)
+{
+	const size_t	npix = (size_t)Width * Height;
+	const size_t	arraysize = npix * sizeof (cl_boxstore);
+	hrtime_t	usual = LLONG_MAX, persist = LLONG_MAX;
+	cl_boxstore	*expect, *got;
+	double		maxdiff = 0;
+	cl_int		ctr[BOX_PERSIST_NCTR];
+	int		stalls = 0;
+
+	Box.persistent_checked = true;
+	expect = mem_alloc(n * arraysize);
+	got = mem_alloc(arraysize);
+
+	for (int i = 0; i < BOX_TUNE_SAMPLES; i++) {
+		kernel_timing_start();
+		box_blur_batch(src, dst, radii, n, nbox);
+		usual = MIN(usual, kernel_timing_stop());
+	}
+	for (int i = 0; i < n; i++) {
+		buffer_readfromgpu(dst[i],
+		    (char *)expect + i * arraysize, arraysize);
+	}
+
+	for (int i = 0; i < BOX_TUNE_SAMPLES; i++) {
+		kernel_timing_start();
+		invoke_persistent(src, dst, radii, n, nbox);
+		persist = MIN(persist, kernel_timing_stop());
+		buffer_readfromgpu(Box.persistent_ctr, ctr, sizeof (ctr));
+		stalls += ctr[4 * n];
+	}
+	for (int i = 0; i < n && !isnan(maxdiff); i++) {
+		buffer_readfromgpu(dst[i], got, arraysize);
+		maxdiff = MAX(maxdiff,
+		    box_host_difference(expect + i * npix, got, npix));
+	}
+
+	mem_free((void **)&got);
+	mem_free((void **)&expect);
+
+	note("Persistent box blur: %llu usec, vs. %llu usec launching each "
+	    "pass (%+.1f%%); largest difference %g, %d stalled barriers\n",
+	    persist / 1000, usual / 1000,
+	    100.0 * ((double)usual - (double)persist) / (double)usual,
+	    maxdiff, stalls);
+	if (stalls != 0) {
+		warn("Persistent box blur's workgroups don't all run at once "
+		    "on this device; turning it off\n");
+		Box.persistent = false;
+	} else if (!(maxdiff <= BOX_PERSIST_TOLERANCE)) {
+		warn("Persistent box blur gets the wrong answer on this "
+		    "device; turning it off\n");
+		Box.persistent = false;
+	}
+}
+
+/*
+ * In persistent mode, do the whole blur with invoke_persistent(), and
+ * return true; or return false if it can't be done that way.
+ */
+static bool
+box_blur_persistent(cl_mem src, cl_mem *dst, const pix_t *radii, int n,
+    int nbox)
+{
+	if (!Box.persistent || !box_persistent_ok(radii, n)) {
+		return (false);
+	}
+	if (!Box.persistent_checked) {
+		box_persistent_check(src, dst, radii, n, nbox);
+		if (!Box.persistent) {
+			box_blur_batch(src, dst, radii, n, nbox);
+			return (true);
+		}
+	}
+
+	invoke_persistent(src, dst, radii, n, nbox);
+	return (true);
+}
+
+/*
+ * Blur "src" at each of n radii, placing the result for radii[i] in dst[i].
+ * If there's more than one OpenCL stream, the radii are blurred side by
+ * side by box_blur_streamed().  Otherwise, any radius that
+ * box_decimation() says should be decimated is done with
+ * box_blur_decimated(), and the rest are batched together.
+ */
+void
+box_blur_multi(cl_mem src, cl_mem *dst, const pix_t *radii, int n, int nbox)
+{
+	cl_mem	bdst[BOX_MULTI_MAXN];
+	pix_t	bradii[BOX_MULTI_MAXN];
+	int	nb = 0;
+
+	assert(n >= 1 && n <= BOX_MULTI_MAXN);
+
+	if (nbox == 0) {
+		return;
+	}
+	if (opencl_streams() > 1) {
+		box_blur_streamed(src, dst, radii, n, nbox);
+		return;
+	}
+	if (box_blur_persistent(src, dst, radii, n, nbox)) {
+		return;
+	}
+
+	for (int i = 0; i < n; i++) {
+		const int	f = box_decimation(radii[i]);
+
+		if (f > 1) {
+			box_blur_decimated(src, dst[i], radii[i], nbox, f);
+		} else {
+			bdst[nb] = dst[i];
+			bradii[nb] = radii[i];
+			nb++;
+		}
+	}
+
+	if (nb > 0) {
+		box_blur_batch(src, bdst, bradii, nb, nbox);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The blur pyramid.  Large-radius blurs are very smooth, so computing them
+ * at full resolution is mostly wasted effort.  If enabled, radii of at
+ * least Box.pyramid_radius are done on a copy of the source that's been
+ * decimated by 2 (or by 4, for radii of at least twice that), and the
+ * consumer of the blur interpolates back up.
+ */
+void
+box_pyramid_enable(pix_t radius)
+{
+	if (radius != 0 && radius < BOX_PYRAMID_MINRADIUS) {
+		die("The blur pyramid radius must be at least %d.\n",
+		    BOX_PYRAMID_MINRADIUS);
+	}
+	Box.pyramid_radius = radius;
+}
+
+int
+box_decimation(pix_t radius)
+{
+	int	f;
+
+	/*
+	 * The decimated kernels don't know about exploration instances.
+	 */
+	if (Box.pyramid_radius == 0 || radius < Box.pyramid_radius ||
+	    explore_tile() != 0) {
+		return (1);
+	}
+
+	f = (radius < 2 * Box.pyramid_radius ? 2 : 4);
+	while (f > 1 && (Width % f != 0 || Height % f != 0)) {
+		f /= 2;
+	}
+
+	return (f);
+}
+
+void
+box_blur_decimated(cl_mem src, cl_mem dst, pix_t radius, int nbox, int f)
+{
+	kernel_data_t	*kd = &Box.downsample_kernel;
+	const pix_t	w = Width / f;
+	const pix_t	h = Height / f;
+	const pix_t	r = MAX((radius + f / 2) / f, 1);
+	pix_t		factor = f;
+	const pix_t	maxwg = box_blur_maxwgsize(BK_SAT);
+	blkidx_t	nblk;
+	int		arg;
+
+	if (f == 1) {
+		box_blur(src, dst, radius, nbox);
+		return;
+	}
+	assert(Width % f == 0 && Height % f == 0);
+
+	if (Box.pyramid == NULL) {
+		Box.pyramid = buffer_alloc(
+		    (size_t)(Width / 2) * (Height / 2) * sizeof (cl_boxstore));
+	}
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &factor);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Box.pyramid);
+	kernel_invoke(kd, 2, NULL, NULL);
+
+	/*
+	 * The summed-area table kernel is used for all decimated blurs: it's
+	 * O(1) per pixel like the subblock kernel, but it doesn't need any
+	 * tables built for this image size.  Its block count just has to
+	 * divide its workgroup size.
+	 */
+	nblk = (blkidx_t)maxwg;
+	while (nblk > 1 && ((pix_t)nblk > w || maxwg % nblk != 0)) {
+		nblk >>= 1;
+	}
+	box_blur_specific(Box.pyramid, dst, r, w, h, nblk, BK_SAT, nbox);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Summary statistics for one configuration in box_test().
+ */
+typedef struct {
+	hrtime_t	bs_median;
+	hrtime_t	bs_p95;
+	hrtime_t	bs_min;
+	hrtime_t	bs_max;
+	double		bs_mean;
+	double		bs_stddev;
+} box_stats_t;
+
+static const char *const Box_kernel_names[BK_NUM_KERNELS] = {
+	"manual", "direct", "subblock", "sat", "packed"
+};
+
+static int
+box_hrtime_cmp(const void *a, const void *b)
+{
+	const hrtime_t	x = *(const hrtime_t *)a;
+	const hrtime_t	y = *(const hrtime_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Sorts "samples" in place.  The percentiles use the nearest-rank method.
+ */
+static void
+box_stats(hrtime_t *samples, int n, box_stats_t *bs)
+{
+	double	sum, sumsq;
+
+	qsort(samples, n, sizeof (hrtime_t), box_hrtime_cmp);
+
+	sum = 0;
+	for (int i = 0; i < n; i++) {
+		sum += (double)samples[i];
+	}
+	bs->bs_mean = sum / n;
+
+	sumsq = 0;
+	for (int i = 0; i < n; i++) {
+		const double	d = (double)samples[i] - bs->bs_mean;
+		sumsq += d * d;
+	}
+	bs->bs_stddev = (n > 1 ? sqrt(sumsq / (n - 1)) : 0);
+
+	bs->bs_median = (n % 2 == 1 ? samples[n / 2] :
+	    (samples[n / 2 - 1] + samples[n / 2]) / 2);
+	bs->bs_p95 = samples[(int)ceil(0.95 * n) - 1];
+	bs->bs_min = samples[0];
+	bs->bs_max = samples[n - 1];
+}
+
+/*
+ * Write a string as a JSON string literal.
+ */
+static void
+box_json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (const char *c = str; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(fp, "\\%c", *c);
+		} else if ((unsigned char)*c < 0x20) {
+			fprintf(fp, "\\u%04x", (unsigned char)*c);
+		} else {
+			fputc(*c, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Run a box blur performance test on the selected GPU.
+ * This is useful for calibrating or updating the heuristics given by the
+ * boxparams_init_*() routines in boxparams.c.  The best results are also
+ * written to the tuning cache, so later runs will use them directly.
+ *
+ * Each configuration gets "warmup" untimed runs and then "iterations" timed
+ * ones; the median is used to pick the winners.  Timing uses the GPU's
+ * event timestamps if the profiling queue is enabled (which main() does
+ * for the box test).  If "outfile" isn't NULL, all of the results are also
+ * written there, as JSON if its name ends in ".json" and as CSV otherwise.
+ */
+void
+box_test(pix_t min_radius, pix_t max_radius, int warmup, int iterations,
+    const char *outfile)
+{
+	const blkidx_t	maxnblk = (blkidx_t)opencl_device_maxwgsize();
+	const blkidx_t	minnblk = BOX_TUNE_MINNBLK;
+	const size_t	lognblk = (size_t)log2((double)(maxnblk / minnblk));
+	const size_t	boxsize = Width * Height * sizeof (cl_boxstore);
+	cl_boxstore	*localbuf;
+	cl_mem		src, dst;
+	hrtime_t	**times[BK_NUM_KERNELS];	// [bk][lognblk][rad]
+	hrtime_t	*samples;
+	FILE		*fp = NULL;
+	bool		json = false;
+	bool		first = true;
+	size_t		i;
+
+	if (max_radius > MAX_RADIUS) {
+		die("box_test: max radius must not be larger than %d\n",
+		    MAX_RADIUS);
+	}
+	if (warmup < 0 || iterations < 1) {
+		die("box_test: need at least 0 warmup runs and 1 iteration\n");
+	}
+
+	if (outfile != NULL) {
+		const size_t	len = strlen(outfile);
+
+		json = (len >= 5 && strcmp(outfile + len - 5, ".json") == 0);
+		if ((fp = fopen(outfile, "w")) == NULL) {
+			die("box_test: couldn't open \"%s\"", outfile);
+		}
+	}
+
+	/*
+	 * Create some buffers for doing box blurs, and initialize them
+	 * with random (but valid, non-NaN) floating point values.
 	 */
 	localbuf = mem_alloc(boxsize);
+#ifdef	HALF_STORAGE
+	// Every bit pattern below 0x3c00 is a finite half in [0.0, 1.0).
+	for (size_t i = 0; i < boxsize / sizeof (cl_half); i++) {
+		((cl_half *)localbuf)[i] = (cl_half)(drandbj() * 0x3c00);
+	}
+#else
 	for (size_t i = 0; i < boxsize / sizeof (float); i++) {
 		((float *)localbuf)[i] = (float)drandbj();
 	}
+#endif
 
 	src = buffer_alloc(boxsize);
 	dst = buffer_alloc(boxsize);
@@ -397,6 +1742,7 @@ box_test(pix_t min_radius, pix_t max_radius)
 	/*
 	 * Create the buffers for keeping track of time.
 	 */
+	samples = mem_alloc(iterations * sizeof (hrtime_t));
 	for (box_kernel_t bk = 0; bk < BK_NUM_KERNELS; bk++) {
 		times[bk] = mem_alloc((lognblk + 1) * sizeof (hrtime_t *));
 		for (i = 0; i <= lognblk; i++) {
@@ -406,7 +1752,7 @@ box_test(pix_t min_radius, pix_t max_radius)
 			times[bk][i] = mem_alloc(sz);
 			for (pix_t radius = min_radius; radius <= max_radius;
 			    radius++) {
-				times[bk][i][radius - min_radius] = 1e9;
+				times[bk][i][radius - min_radius] = LLONG_MAX;
 			}
 		}
 	}
@@ -415,9 +1761,32 @@ box_test(pix_t min_radius, pix_t max_radius)
 	note("# Box blur performance test\n");
 	note("# GPU vendor = \"%s\"\n", opencl_device_vendor());
 	note("# GPU device = \"%s\"\n", opencl_device_name());
+	note("# Driver version = \"%s\"\n", opencl_driver_version());
 	note("# Buffer size = %zux%zux%d\n", Width, Height, BOX_DIMENSIONS);
+	note("# Timing = %s, %d warmup, %d iterations\n",
+	    (opencl_profiling_enabled() ? "GPU events" : "host"),
+	    warmup, iterations);
 	note("#\n");
-	note("# rad bk nblk  average -time1- -time2- -time3-\n");
+	note("# rad bk nblk   median     p95  stddev\n");
+
+	if (fp != NULL && json) {
+		fprintf(fp, "{\n  \"vendor\": ");
+		box_json_string(fp, opencl_device_vendor());
+		fprintf(fp, ",\n  \"device\": ");
+		box_json_string(fp, opencl_device_name());
+		fprintf(fp, ",\n  \"driver\": ");
+		box_json_string(fp, opencl_driver_version());
+		fprintf(fp, ",\n  \"width\": %u,\n  \"height\": %u,\n"
+		    "  \"dimensions\": %d,\n  \"timing\": \"%s\",\n"
+		    "  \"warmup\": %d,\n  \"iterations\": %d,\n"
+		    "  \"results\": [",
+		    Width, Height, BOX_DIMENSIONS,
+		    (opencl_profiling_enabled() ? "gpu" : "host"),
+		    warmup, iterations);
+	} else if (fp != NULL) {
+		fprintf(fp, "radius,bk,kernel,nblk,iterations,median_ns,p95_ns,"
+		    "mean_ns,stddev_ns,min_ns,max_ns\n");
+	}
 
 	for (box_kernel_t bk = 0; bk < BK_NUM_KERNELS; bk++) {
 
@@ -439,48 +1808,82 @@ box_test(pix_t min_radius, pix_t max_radius)
 
 			for (pix_t radius = min_radius; radius <= max_radius;
 			    radius++) {
-				hrtime_t	t[4], us;
+				box_stats_t	bs;
 
 				// BK_MANUAL only works for r = 1.
 				if (bk == BK_MANUAL && radius > 1) {
 					break;
 				}
+				if (bk == BK_PACKED && !box_packed_ok(Width,
+				    Height, radius)) {
+					break;
+				}
 
 				// Do it.
+				for (int n = 0; n < warmup; n++) {
+					box_blur_specific(src, dst, radius,
+					    Width, Height, nblk, bk, 1);
+				}
 				kernel_wait();
-				t[0] = gethrtime();
-				for (int i = 0; i < 3; i++) {
+				for (int n = 0; n < iterations; n++) {
+					kernel_timing_start();
 					box_blur_specific(src, dst, radius,
 					    Width, Height, nblk, bk, 1);
-					kernel_wait();
-					t[i + 1] = gethrtime();
+					samples[n] = kernel_timing_stop();
 				}
+				box_stats(samples, iterations, &bs);
+				times[bk][i][radius - min_radius] =
+				    bs.bs_median;
 
 				// Show the results.
-				note("# %3d %2d %4d ", radius, bk, nblk);
-				us = (t[3] - t[0]) / 1000 / 3;
-				note(" %3llu.%03llu", us / 1000, us % 1000);
-				times[bk][i][radius - min_radius] = us;
-
-				for (int i = 0; i < 3; i++) {
-					us = (t[i + 1] - t[i]) / 1000;
-					note(" %3llu.%03llu",
-					    us / 1000, us % 1000);
+				note("# %3d %2d %4d %8.3f %7.3f %7.3f\n",
+				    radius, bk, nblk,
+				    (double)bs.bs_median / 1000000.0,
+				    (double)bs.bs_p95 / 1000000.0,
+				    bs.bs_stddev / 1000000.0);
+
+				if (fp != NULL && json) {
+					fprintf(fp, "%s\n    { \"radius\": %u, "
+					    "\"bk\": %d, \"kernel\": \"%s\", "
+					    "\"nblk\": %d, \"median_ns\": %lld, "
+					    "\"p95_ns\": %lld, "
+					    "\"mean_ns\": %.1f, "
+					    "\"stddev_ns\": %.1f, "
+					    "\"min_ns\": %lld, \"max_ns\": %lld }",
+					    (first ? "" : ","), radius, bk,
+					    Box_kernel_names[bk], nblk,
+					    bs.bs_median, bs.bs_p95, bs.bs_mean,
+					    bs.bs_stddev, bs.bs_min, bs.bs_max);
+				} else if (fp != NULL) {
+					fprintf(fp, "%u,%d,%s,%d,%d,%lld,%lld,"
+					    "%.1f,%.1f,%lld,%lld\n",
+					    radius, bk, Box_kernel_names[bk],
+					    nblk, iterations, bs.bs_median,
+					    bs.bs_p95, bs.bs_mean, bs.bs_stddev,
+					    bs.bs_min, bs.bs_max);
 				}
-				note("\n");
+				first = false;
 			}
 		}
 	}
 
 	/*
-	 * Finally, figure out what's best.
+	 * Finally, figure out what's best.  The sweep above stomped on the
+	 * boxparams table, so reload it before recording the winners.
 	 */
+	boxparams_init();
+
+	if (fp != NULL && json) {
+		fprintf(fp, "\n  ],\n  \"best\": [");
+	}
+	first = true;
+
 	note("\n");
-	note("# rad bk nblk  average\n");
+	note("# rad bk nblk   median\n");
 	for (pix_t radius = min_radius; radius <= max_radius; radius++) {
 		box_kernel_t	bestbk;
 		blkidx_t	bestnblk;
-		hrtime_t	besttime = UINT_MAX;
+		hrtime_t	besttime = LLONG_MAX;
 
 		for (box_kernel_t bk = 0; bk < BK_NUM_KERNELS; bk++) {
 
@@ -491,19 +1894,41 @@ box_test(pix_t min_radius, pix_t max_radius)
 
 			for (size_t i = 0; i <= lognblk; i++) {
 				const blkidx_t	nblk = maxnblk >> i;
-				const hrtime_t	us =
+				const hrtime_t	ns =
 				    times[bk][i][radius - min_radius];
 
-				if (us < besttime) {
-					besttime = us;
+				if (ns < besttime) {
+					besttime = ns;
 					bestbk = bk;
 					bestnblk = nblk;
 				}
 			}
 		}
 
-		note("%5d %2d %4d ", radius, bestbk, bestnblk);
-		note(" %3llu.%03llu\n", besttime / 1000, besttime % 1000);
+		note("%5d %2d %4d %8.3f\n", radius, bestbk, bestnblk,
+		    (double)besttime / 1000000.0);
+		if (fp != NULL && json) {
+			fprintf(fp, "%s\n    { \"radius\": %u, \"bk\": %d, "
+			    "\"kernel\": \"%s\", \"nblk\": %d, "
+			    "\"median_ns\": %lld }",
+			    (first ? "" : ","), radius, bestbk,
+			    Box_kernel_names[bestbk], bestnblk, besttime);
+		}
+		first = false;
+
+		boxparams_set_tuned(radius, bestnblk, bestbk);
+	}
+	boxparams_save();
+
+	if (fp != NULL) {
+		if (json) {
+			fprintf(fp, "\n  ]\n}\n");
+		}
+		if (fclose(fp) != 0) {
+			warn("box_test: couldn't write \"%s\"", outfile);
+		} else {
+			note("# Results written to %s\n", outfile);
+		}
 	}
 
 	for (box_kernel_t bk = 0; bk < BK_NUM_KERNELS; bk++) {
@@ -512,6 +1937,7 @@ box_test(pix_t min_radius, pix_t max_radius)
 		}
 		mem_free((void **)&times[bk]);
 	}
+	mem_free((void **)&samples);
 	mem_free((void **)&localbuf);
 	buffer_free(&src);
 	buffer_free(&dst);
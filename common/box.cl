@@ -1,5 +1,5 @@
 /*
- * box.cl - two kernels for different implementations of box blur.  They are
+ * box.cl - kernels for a couple different implementations of box blur.  They are
  * carefully tied to the corresponding C code in box.c, and should not be
  * thought of as APIs on their own.
  */
@@ -7,6 +7,17 @@
 #define	PIXEL(x,y,w)	(((y) * (w)) + (x))
 #define	WRAP(x,max)	(((x) + (max)) % (max))
 
+/*
+ * Like WRAP(), for a coordinate "x" in the window around "c".  In
+ * exploration mode (see explore.h), each ZOUNDS_TILE pixels of the row is
+ * a separate instance, and wraps around on its own.  (TILE is only there
+ * so that the compiler doesn't see a division by zero otherwise.)
+ */
+#define	TILE		max(ZOUNDS_TILE, 1)
+#define	TILE0(c)	((c) - (c) % TILE)
+#define	TWRAP(x,c,len)	(ZOUNDS_TILE == 0 ? WRAP(x, len) :		\
+	TILE0(c) + WRAP((spix_t)(x) - (spix_t)TILE0(c), TILE))
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -25,8 +36,8 @@ __kernel void
 manual_box_2d_r1(
 	const pix_t		W,		/* in: actual width */
 	const pix_t		H,		/* in: actual height */
-	__global boxvector	*in,
-	__global boxvector	*out,
+	__global boxstore	*in,
+	__global boxstore	*out,
 	__local boxvector	*temp,
 	const pix_t		ignored)
 {
@@ -42,7 +53,8 @@ manual_box_2d_r1(
 		for (spix_t y = Y - r; y <= (spix_t)(Y + r); y++) {
 			const pix_t	ty = WRAP(y, H);
 			for (spix_t x = X - r; x <= (spix_t)(X + r); x++) {
-				acc += in[PIXEL(WRAP(x, W), ty, W)];
+				acc += load_boxvector(in,
+				    PIXEL(WRAP(x, W), ty, W));
 			}
 		}
 
@@ -53,7 +65,7 @@ manual_box_2d_r1(
 	barrier(CLK_LOCAL_MEM_FENCE);
 
 	if (inbounds) {
-		out[PIXEL(X, Y, W)] = *temp;
+		store_boxvector(*temp, out, PIXEL(X, Y, W));
 	}
 }
 
@@ -74,14 +86,15 @@ manual_box_2d_r1(
  * we can use a little trick that lets us get a bit of streaming, as described
  * below.
  *
- * Requires temp to be an array of (w * h) boxvector's.
+ * Requires temp to be an array of (w * h) boxvector's.  In exploration
+ * mode, r must be no larger than ZOUNDS_TILE.
  */
 __kernel void
 direct_box_1d(
 	const pix_t		W,		/* in: actual width */
 	const pix_t		H,		/* in: actual height */
-	__global boxvector	*in,
-	__global boxvector	*out,
+	__global boxstore	*in,
+	__global boxstore	*out,
 	__local boxvector	*temp,
 	const pix_t		r)
 {
@@ -95,14 +108,14 @@ direct_box_1d(
 	const bool	inbounds = (X < W && Y < H);
 	const bool	all_inbounds = ((X - x + w) <= W && (Y - y + h) <= H);
 	boxvector		acc;
-	__global boxvector	*inrow;
 
 	acc = 0;
 
 	if (inbounds) {
-		inrow = &in[PIXEL(0, Y, W)];
+		const pix_t	inrow = PIXEL(0, Y, W);
+
 		for (spix_t i = X - r; i <= (spix_t)(X + r); i++) {
-			acc += inrow[WRAP(i, W)];
+			acc += load_boxvector(in, inrow + TWRAP(i, X, W));
 		}
 		acc /= scale;
 	}
@@ -185,10 +198,509 @@ direct_box_1d(
 	if (w == h && all_inbounds) {		// clever store
 		temp[PIXEL(y, x, h)] = acc;
 		barrier(CLK_LOCAL_MEM_FENCE);
-		out[PIXEL(Y - y + x, X - x + y, H)] = temp[PIXEL(x, y, w)];
+		store_boxvector(temp[PIXEL(x, y, w)],
+		    out, PIXEL(Y - y + x, X - x + y, H));
 	} else if (inbounds) {			// slow store
-		out[PIXEL(Y, X, H)] = acc;
+		store_boxvector(acc, out, PIXEL(Y, X, H));
 	}
 } 
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Fused multi-pass box blur: does all "nbox" 1-D passes along one axis in
+ * a single launch, keeping the row in local memory between passes instead
+ * of bouncing it through a global scratch buffer each time.  Since box blur
+ * is separable, doing every horizontal pass and then every vertical pass
+ * gives the same result as alternating them.
+ *
+ * Each workgroup handles one row, and each thread a contiguous run of that
+ * row, much like subblock_box_1d().  After the last pass, the row is
+ * written out transposed, so a second launch does the other axis.
+ *
+ * Requirements:
+ *
+ * - a and b must each be arrays of W boxvector's.
+ *
+ * - get_global_size(0) must be set to the value of get_local_size(0),
+ *   and get_local_size(1) must be 1.
+ *
+ * - r must be smaller than W.
+ */
+static void
+fused_row(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	const pix_t		Y,		/* in: current row */
+	__global boxstore	*in,
+	__global boxstore	*out,
+	__local boxvector	*a,
+	__local boxvector	*b,
+	const pix_t		r,		/* in: radius */
+	const int		nbox)		/* in: # of passes */
+{
+	const pix_t	L = get_local_size(0);	// threads per row
+	const pix_t	l = get_local_id(0);	// current thread
+	const pix_t	rawbw = W / L;		// "small" run length
+	const pix_t	overflow = W % L;	// small->large transition
+	const pix_t	bw =			// this thread's run length
+	    rawbw + (l < overflow ? 1 : 0);
+	const pix_t	X0 =			// start of this thread's run
+	    l * rawbw + min(l, overflow);
+	const float	scale = (2 * r + 1);
+
+	__local boxvector	*cur = a;
+	__local boxvector	*next = b;
+
+	for (pix_t x = l; x < W; x += L) {
+		a[x] = load_boxvector(in, PIXEL(x, Y, W));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int pass = 0; pass < SPEC_NBOX(nbox); pass++) {
+		__local boxvector	*tmp;
+
+		if (bw > 0) {
+			boxvector	acc = 0;
+
+			for (spix_t i = (spix_t)X0 - (spix_t)r;
+			    i <= (spix_t)(X0 + r); i++) {
+				acc += cur[WRAP(i, W)];
+			}
+			next[X0] = acc / scale;
+
+			for (pix_t i = 1; i < bw; i++) {
+				const pix_t	x = X0 + i;
+
+				acc += cur[WRAP(x + r, W)] -
+				    cur[WRAP((spix_t)x - (spix_t)r - 1, W)];
+				next[x] = acc / scale;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	for (pix_t x = l; x < W; x += L) {
+		store_boxvector(cur[x], out, PIXEL(Y, x, H));
+	}
+}
+
+__kernel void
+fused_box_1d(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxstore	*in,
+	__global boxstore	*out,
+	__local boxvector	*a,
+	__local boxvector	*b,
+	const pix_t		r,		/* in: radius */
+	const int		nbox)		/* in: # of passes */
+{
+	const pix_t	Y = get_global_id(1);	// current row
+
+	// The whole workgroup has the same Y, so this can't split a barrier.
+	if (Y < H) {
+		fused_row(W, H, Y, in, out, a, b, r, nbox);
+	}
+}
+
+/*
+ * Persistent multi-radius box blur: a whole box_blur_multi() in one
+ * launch.  For each radius there are two phases, one for the rows and one
+ * for the columns, and each row (or column) of a phase is a job that one
+ * workgroup does just as fused_box_1d() would.  There are only as many
+ * workgroups as can all be running at once; each one takes the next job
+ * of the current phase from a counter in "ctr" until there are none left,
+ * and then waits at a barrier for the rest of them before moving on to the
+ * next phase, since every job of a column phase needs the whole row phase
+ * before it.
+ *
+ * This is experimental.  OpenCL doesn't promise that workgroups can wait
+ * for each other like this, or that one workgroup sees another's stores
+ * without a launch in between; box.c checks the result against the usual
+ * path before trusting it.  So that a device which runs the workgroups one
+ * after another can't hang, each wait at the barrier gives up after
+ * GRID_SPIN_MAX tries, and counts that in ctr[4 * n], which box.c checks.
+ *
+ * Requirements:
+ *
+ * - everything fused_box_1d() requires, for both axes, with a and b
+ *   holding the longer of the two.
+ *
+ * - get_local_size(1) must be 1, and get_global_size(1) must be no more
+ *   than the number of workgroups that can all be resident at once.
+ *
+ * - ctr must hold 2 * 2 * n + 1 zeroed ints, and n must be between 1 and
+ *   BOX_MULTI_MAX.
+ */
+
+/*
+ * How many times grid_barrier() looks at its counter before deciding that
+ * the other workgroups aren't running alongside this one.
+ */
+#define	GRID_SPIN_MAX	(1 << 22)
+
+/*
+ * Wait until all "nwg" workgroups have reached barrier "bar", or until
+ * that's clearly not going to happen.  Giving up is counted in "failed",
+ * and once anyone has given up, nobody waits any more.
+ */
+static void
+grid_barrier(volatile __global int *bar, int nwg, volatile __global int *failed)
+{
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+	if (get_local_id(0) == 0) {
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		(void) atomic_inc(bar);
+		for (int spin = 0; atomic_add(bar, 0) < nwg &&
+		    atomic_add(failed, 0) == 0; spin++) {
+			if (spin == GRID_SPIN_MAX) {
+				(void) atomic_inc(failed);
+				break;
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+}
+
+/*
+ * Zero the counters for the next persistent_box() launch.  This is a kernel
+ * rather than a buffer fill so that both of them can be in a kernel graph.
+ */
+__kernel void
+persistent_reset(
+	volatile __global int	*ctr,		/* out */
+	const int		n)		/* in: # of ints */
+{
+	const int	i = get_global_id(0);
+
+	if (i < n) {
+		ctr[i] = 0;
+	}
+}
+
+__kernel void
+persistent_box(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxstore	*in,
+	__global boxstore	*scratch,	/* Width * Height */
+	__local boxvector	*a,
+	__local boxvector	*b,
+	const int		n,		/* in: # of radii */
+	const uint8		radii,		/* in */
+	const int		nbox,		/* in: # of passes */
+	volatile __global int	*ctr,		/* scratch, zeroed */
+	__global boxstore	*o0,		/* out */
+	__global boxstore	*o1,
+	__global boxstore	*o2,
+	__global boxstore	*o3,
+	__global boxstore	*o4,
+	__global boxstore	*o5,
+	__global boxstore	*o6,
+	__global boxstore	*o7)
+{
+	const uint	rv[] = { radii.s0, radii.s1, radii.s2, radii.s3,
+			    radii.s4, radii.s5, radii.s6, radii.s7 };
+	__global boxstore *const	outs[] =
+			    { o0, o1, o2, o3, o4, o5, o6, o7 };
+	const int	nwg = get_num_groups(1);
+	__local int	job;
+
+	for (int phase = 0; phase < 2 * n; phase++) {
+		const int		p = phase / 2;
+		const bool		cols = (phase & 1);
+		const pix_t		w = (cols ? H : W);
+		const pix_t		h = (cols ? W : H);
+		__global boxstore	*src = (cols ? scratch : in);
+		__global boxstore	*dst = (cols ? outs[p] : scratch);
+
+		for (;;) {
+			if (get_local_id(0) == 0) {
+				job = atomic_inc(&ctr[2 * phase]);
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if (job >= (int)h) {
+				break;
+			}
+			fused_row(w, h, (pix_t)job, src, dst, a, b, rv[p],
+			    nbox);
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		grid_barrier(&ctr[2 * phase + 1], nwg, &ctr[4 * n]);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Downsampling for the blur pyramid: each output pixel is the average of an
+ * (f x f) block of the input.  The output is (W / f) by (H / f), and W and H
+ * must both be multiples of f.
+ */
+__kernel void
+box_downsample(
+	const pix_t		W,		/* in: input width */
+	const pix_t		H,		/* in: input height */
+	const pix_t		f,		/* in: decimation factor */
+	__global boxstore	*in,
+	__global boxstore	*out)
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	w = W / f;
+	const pix_t	h = H / f;
+	boxvector	acc;
+
+	if (X >= w || Y >= h) {
+		return;
+	}
+
+	acc = 0;
+	for (pix_t j = 0; j < f; j++) {
+		for (pix_t i = 0; i < f; i++) {
+			acc += load_boxvector(in, PIXEL(X * f + i, Y * f + j, W));
+		}
+	}
+	store_boxvector(acc / (float)(f * f), out, PIXEL(X, Y, w));
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The most radii that direct_box_multi_1d() can do in one launch.
+ * This has to match BOX_MULTI_MAX in box.c.
+ */
+#define	BOX_MULTI_MAX	8
+
+/*
+ * Multi-radius direct box blur: the same as direct_box_1d(), but for up to
+ * BOX_MULTI_MAX radii at once, each with its own output array.
+ *
+ * The radii must be in increasing order.  The window for each radius
+ * contains the window for the previous one, so the accumulator only has to
+ * pick up the values at the two new ends of the window; the source row is
+ * read once for the widest radius, rather than once per radius.
+ *
+ * Requires temp to be an array of (w * h) boxvector's.
+ */
+__kernel void
+direct_box_multi_1d(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxstore	*in,
+	__local boxvector	*temp,
+	const int		nradii,		/* in: # of radii to do */
+	const uint8		radii,		/* in: increasing radii */
+	__global boxstore	*out0,
+	__global boxstore	*out1,
+	__global boxstore	*out2,
+	__global boxstore	*out3,
+	__global boxstore	*out4,
+	__global boxstore	*out5,
+	__global boxstore	*out6,
+	__global boxstore	*out7)
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	w = get_local_size(0);
+	const pix_t	h = get_local_size(1);
+	const pix_t	x = get_local_id(0);
+	const pix_t	y = get_local_id(1);
+	const bool	inbounds = (X < W && Y < H);
+	const bool	all_inbounds = ((X - x + w) <= W && (Y - y + h) <= H);
+	const pix_t	rs[BOX_MULTI_MAX] = {
+		radii.s0, radii.s1, radii.s2, radii.s3,
+		radii.s4, radii.s5, radii.s6, radii.s7
+	};
+	__global boxstore *const outs[BOX_MULTI_MAX] = {
+		out0, out1, out2, out3, out4, out5, out6, out7
+	};
+	const pix_t		inrow = PIXEL(0, Y, W);
+	boxvector		acc;
+	spix_t			lo, hi;		/* current window */
+
+	acc = 0;
+	lo = (spix_t)X;
+	hi = (spix_t)X - 1;
+
+	for (int k = 0; k < nradii; k++) {
+		const pix_t	r = rs[k];
+		const float	scale = (2 * r + 1);
+		boxvector	res = 0;
+
+		if (inbounds) {
+			for (spix_t i = X - r; i < lo; i++) {
+				acc += load_boxvector(in,
+				    inrow + TWRAP(i, X, W));
+			}
+			for (spix_t i = hi + 1; i <= (spix_t)(X + r); i++) {
+				acc += load_boxvector(in,
+				    inrow + TWRAP(i, X, W));
+			}
+			lo = X - r;
+			hi = X + r;
+			res = acc / scale;
+		}
+
+		/*
+		 * The same transposing stores as direct_box_1d().  There's a
+		 * second barrier here, since temp gets reused for each radius.
+		 */
+		if (w == h && all_inbounds) {		// clever store
+			temp[PIXEL(y, x, h)] = res;
+			barrier(CLK_LOCAL_MEM_FENCE);
+			store_boxvector(temp[PIXEL(x, y, w)],
+			    outs[k], PIXEL(Y - y + x, X - x + y, H));
+			barrier(CLK_LOCAL_MEM_FENCE);
+		} else if (inbounds) {			// slow store
+			store_boxvector(res, outs[k], PIXEL(Y, X, H));
+		}
+	}
+}
+
+#undef	BOX_MULTI_MAX
+
+/* ------------------------------------------------------------------ */
+
+#if	BOX_DIMENSIONS == 1
+
+/*
+ * Packed box blur, for 1-D data: each work item does four adjacent pixels
+ * at once, as a float4.  The other kernels do one float per work item when
+ * a boxvector is just a float, which keeps the GPU's vector loads and
+ * stores a quarter full.
+ *
+ * Neither pass transposes.  packed_box_rows() does the horizontal pass:
+ * the windows for pixels X through X + 3 all contain [X - r + 3, X + r],
+ * which is summed four pixels at a time, and then each pixel adds in its
+ * own three pixels at the ends.  Near the ends of the row, where the
+ * windows wrap around, this falls back to single loads.
+ * packed_box_cols() does the vertical pass: four adjacent columns are
+ * adjacent in memory, so each row of them is a single float4, and each
+ * work item slides its window down a run of "rows" rows.
+ *
+ * Requirements:
+ *
+ * - W must be a multiple of 4, and global_size(0) must cover W / 4.
+ *
+ * - r must be at least 1, and smaller than both W and H.
+ *
+ * - "in" and "out" must be different buffers.
+ *
+ * - These don't know about exploration instances.
+ */
+#ifdef	HALF_STORAGE
+#define	load_box4(p, i)		vload_half4(0, (p) + (i))
+#define	store_box4(v, p, i)	vstore_half4((v), 0, (p) + (i))
+#else
+#define	load_box4(p, i)		vload4(0, (p) + (i))
+#define	store_box4(v, p, i)	vstore4((v), 0, (p) + (i))
+#endif
+
+__kernel void
+packed_box_rows(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxstore	*in,
+	__global boxstore	*out,
+	const pix_t		r)		/* in: radius */
+{
+	const pix_t	X = get_global_id(0) * 4;
+	const pix_t	Y = get_global_id(1);
+	const spix_t	lo = (spix_t)X - (spix_t)r;	// pixel X's window
+	const spix_t	hi = (spix_t)X + (spix_t)r;
+	const float	scale = (2 * r + 1);
+	__global boxstore	*row;
+	float		mid, a0, a1, a2, b1, b2, b3;
+	float4		acc;
+	spix_t		i;
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+	row = in + PIXEL(0, Y, W);
+
+	if (lo >= 0 && hi + 3 < (spix_t)W) {
+		acc = 0;
+		for (i = lo + 3; i + 3 <= hi; i += 4) {
+			acc += load_box4(row, i);
+		}
+		mid = acc.x + acc.y + acc.z + acc.w;
+		for (; i <= hi; i++) {
+			mid += load_boxvector(row, i);
+		}
+		a0 = load_boxvector(row, lo);
+		a1 = load_boxvector(row, lo + 1);
+		a2 = load_boxvector(row, lo + 2);
+		b1 = load_boxvector(row, hi + 1);
+		b2 = load_boxvector(row, hi + 2);
+		b3 = load_boxvector(row, hi + 3);
+	} else {
+		mid = 0;
+		for (i = lo + 3; i <= hi; i++) {
+			mid += load_boxvector(row, WRAP(i, W));
+		}
+		a0 = load_boxvector(row, WRAP(lo, W));
+		a1 = load_boxvector(row, WRAP(lo + 1, W));
+		a2 = load_boxvector(row, WRAP(lo + 2, W));
+		b1 = load_boxvector(row, WRAP(hi + 1, W));
+		b2 = load_boxvector(row, WRAP(hi + 2, W));
+		b3 = load_boxvector(row, WRAP(hi + 3, W));
+	}
+
+	store_box4((float4)(mid + a0 + a1 + a2, mid + a1 + a2 + b1,
+	    mid + a2 + b1 + b2, mid + b1 + b2 + b3) / scale,
+	    out, PIXEL(X, Y, W));
+}
+
+__kernel void
+packed_box_cols(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxstore	*in,
+	__global boxstore	*out,
+	const pix_t		r,		/* in: radius */
+	const pix_t		rows)		/* in: rows per work item */
+{
+	const pix_t	X = get_global_id(0) * 4;
+	const pix_t	Y0 = get_global_id(1) * rows;
+	const pix_t	Y1 = min(Y0 + rows, H);
+	const float	scale = (2 * r + 1);
+	float4		acc;
+
+	if (X >= W || Y0 >= H) {
+		return;
+	}
+
+	acc = 0;
+	for (spix_t y = (spix_t)Y0 - (spix_t)r; y <= (spix_t)(Y0 + r); y++) {
+		acc += load_box4(in, PIXEL(X, WRAP(y, H), W));
+	}
+	store_box4(acc / scale, out, PIXEL(X, Y0, W));
+
+	for (pix_t y = Y0 + 1; y < Y1; y++) {
+		const pix_t	add = WRAP(y + r, H);
+		const pix_t	sub = WRAP((spix_t)y - (spix_t)r - 1, H);
+
+		acc += load_box4(in, PIXEL(X, add, W)) -
+		    load_box4(in, PIXEL(X, sub, W));
+		store_box4(acc / scale, out, PIXEL(X, y, W));
+	}
+}
+
+#undef	load_box4
+#undef	store_box4
+
+#endif	/* BOX_DIMENSIONS == 1 */
+
 #undef	PIXEL
 #undef	WRAP
+#undef	TILE
+#undef	TILE0
+#undef	TWRAP
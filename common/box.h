@@ -14,10 +14,57 @@
 extern void
 box_blur(cl_mem src, cl_mem dst, pix_t radius, int nbox);
 
+/*
+ * Perform box blurs of "src" at n different radii, storing the blur with
+ * radius radii[i] into dst[i].  This is equivalent to calling box_blur()
+ * once per radius, but it shares whatever work it can between the radii.
+ * None of the dst[] buffers may be "src".
+ */
+extern void
+box_blur_multi(cl_mem src, cl_mem *dst, const pix_t *radii, int n, int nbox);
+
+/*
+ * The blur pyramid: if enabled, box_blur_multi() blurs any radius of at
+ * least "radius" on a copy of the source that has been decimated by a
+ * factor of box_decimation(radius), and stores that blur in the first
+ * (Width / f) * (Height / f) entries of its dst[] buffer.  The consumer
+ * has to interpolate it back up to full resolution.
+ *
+ * box_blur_decimated() does one such blur; with f = 1 it's just box_blur().
+ */
+extern void
+box_pyramid_enable(pix_t radius);
+
+extern int
+box_decimation(pix_t radius);
+
+extern void
+box_blur_decimated(cl_mem src, cl_mem dst, pix_t radius, int nbox, int f);
+
+/*
+ * The largest difference between any two components of the first "npix"
+ * entries of the blur buffers "a" and "b" (or NaN, if either has one).
+ * This waits for the GPU, so it's only for checking things.
+ */
+extern double
+box_max_difference(cl_mem a, cl_mem b, size_t npix);
+
 /* ------------------------------------------------------------------ */
 
+/*
+ * By default, each radius gets tuned the first time it's used, unless the
+ * tuning cache already has results for it.  This turns that off.
+ */
+extern void
+box_autotune_disable(void);
+
+/*
+ * Run the box blur benchmark over every kernel and block count, for radii
+ * in [min_radius, max_radius]; see box.c for details.
+ */
 extern void
-box_test(pix_t min_radius, pix_t max_radius);
+box_test(pix_t min_radius, pix_t max_radius, int warmup, int iterations,
+    const char *outfile);
 
 #endif	/* _BOX_H */
 
@@ -3,33 +3,42 @@
  * based on what performs well on a couple systems.  The choice shouldn't
  * matter for correctness, just speed.
  *
- * These values are all chosen for box blurs of 4-D data
+ * The vendor tables below are all chosen for box blurs of 4-D data
  * (sizeof (cl_boxvector) == 4 * sizeof (float)).
  * There may be better values for 1-D data.
  *
- * Obviously it would be much better to have this auto-tuned.
+ * The vendor tables are only a starting point, though.  box.c measures the
+ * actual performance of each radius as it gets used (see box_tune_radius()),
+ * and the results are kept in a tuning cache on disk.  The cache is keyed by
+ * everything that's known to affect the results: the device, the driver
+ * version, the image size, and the number of dimensions in a box vector.
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "common.h"
+#include "boxparams.h"
 #include "debug.h"
 #include "opencl.h"
 #include "subblock.h"	/* for MAX_NBLOCKS */
+#include "util.h"
 
 /* ------------------------------------------------------------------ */
 
 typedef struct {
 	blkidx_t	nblk;	// number of blocks per line
 	box_kernel_t	bk;	// which box kernel to use
+	bool		tuned;	// measured on this system, not from a table
 } box_params_t;
 
 static struct {
 	box_params_t	params[MAX_RADIUS];
 } Bp;
 
-static void
+void
 boxparams_set(pix_t radius, blkidx_t nblk, box_kernel_t bk)
 {
 	assert(radius > 0 && radius <= MAX_RADIUS);
@@ -45,6 +54,20 @@ boxparams_get(pix_t radius, blkidx_t *nblkp)
 	return (Bp.params[radius - 1].bk);
 }
 
+bool
+boxparams_tuned(pix_t radius)
+{
+	assert(radius > 0 && radius <= MAX_RADIUS);
+	return (Bp.params[radius - 1].tuned);
+}
+
+void
+boxparams_set_tuned(pix_t radius, blkidx_t nblk, box_kernel_t bk)
+{
+	boxparams_set(radius, nblk, bk);
+	Bp.params[radius - 1].tuned = true;
+}
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -121,6 +144,170 @@ boxparams_init_nvidia(const char *device,
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * The tuning cache.
+ *
+ * Each combination of device, driver, image size and box vector size gets
+ * its own file in the cache directory, named by a hash of that combination.
+ * The full key is also written into the file, and checked when reading it
+ * back in, so a hash collision just looks like a cache miss.
+ *
+ * The file is plain text, so it's easy to inspect or edit by hand:
+ *
+ *	# zounds box blur tuning cache
+ *	device <device name>
+ *	driver <driver version>
+ *	size <width>x<height>x<box dimensions>
+ *	<radius> <box kernel> <nblk>
+ *	...
+ */
+
+#define	BOX_CACHE_MAGIC		"# zounds box blur tuning cache"
+
+static void
+boxparams_cache_key(char *buf, size_t len)
+{
+	(void) snprintf(buf, len, "device %s\ndriver %s\nsize %ux%ux%d\n",
+	    opencl_device_name(), opencl_driver_version(),
+	    Width, Height, BOX_DIMENSIONS);
+}
+
+/*
+ * 32-bit FNV-1a; it just needs to spread out the file names.
+ */
+static uint32_t
+boxparams_hash(const char *str)
+{
+	uint32_t	h = 2166136261u;
+
+	for (const char *p = str; *p != '\0'; p++) {
+		h = (h ^ (uint8_t)*p) * 16777619u;
+	}
+
+	return (h);
+}
+
+static bool
+boxparams_cache_file(const char *key, char *buf, size_t len)
+{
+	char	name[32];
+
+	(void) snprintf(name, sizeof (name), "boxparams.%08x",
+	    boxparams_hash(key));
+
+	return (cache_path(name, buf, len));
+}
+
+/*
+ * Read in whatever tuning results we have for the current configuration.
+ * Anything that looks odd is ignored, since the values in the vendor tables
+ * are always there to fall back on.
+ */
+static void
+boxparams_load(void)
+{
+	const blkidx_t	maxnblk = (blkidx_t)opencl_device_maxwgsize();
+	char		key[2048], path[1024], line[2048];
+	char		*expect, *next;
+	FILE		*fp;
+	int		nloaded;
+
+	boxparams_cache_key(key, sizeof (key));
+	if (!boxparams_cache_file(key, path, sizeof (path))) {
+		return;
+	}
+	if ((fp = fopen(path, "r")) == NULL) {
+		verbose(DB_BOX, "No box blur tuning cache at \"%s\"\n", path);
+		return;
+	}
+
+	/*
+	 * Make sure the header matches our key, line by line.
+	 */
+	if (fgets(line, sizeof (line), fp) == NULL ||
+	    strncmp(line, BOX_CACHE_MAGIC, strlen(BOX_CACHE_MAGIC)) != 0) {
+		warn("Ignoring malformed box blur tuning cache \"%s\"\n",
+		    path);
+		fclose(fp);
+		return;
+	}
+	for (expect = key; *expect != '\0'; expect = next) {
+		next = strchr(expect, '\n') + 1;
+		if (fgets(line, sizeof (line), fp) == NULL ||
+		    strncmp(line, expect, next - expect) != 0) {
+			verbose(DB_BOX, "Box blur tuning cache \"%s\" is for "
+			    "a different configuration\n", path);
+			fclose(fp);
+			return;
+		}
+	}
+
+	nloaded = 0;
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		int	radius, bk, nblk;
+
+		if (sscanf(line, "%d %d %d", &radius, &bk, &nblk) != 3 ||
+		    radius < 1 || radius > MAX_RADIUS ||
+		    bk < 0 || bk >= BK_NUM_KERNELS ||
+		    nblk < 1 || nblk > maxnblk || nblk > MAX_NBLOCKS ||
+		    (nblk & (nblk - 1)) != 0) {
+			debug(DB_BOX, "Ignoring tuning cache line: %s", line);
+			continue;
+		}
+
+		boxparams_set_tuned(radius, nblk, bk);
+		nloaded++;
+	}
+	fclose(fp);
+
+	verbose(DB_BOX, "Loaded %d tuned box blur radii from \"%s\"\n",
+	    nloaded, path);
+}
+
+/*
+ * Write out all of the radii that have been tuned so far.
+ *
+ * This writes to a temporary file and renames it into place, so that
+ * another instance of the program never sees a partially written cache.
+ */
+void
+boxparams_save(void)
+{
+	char		key[2048], path[1024], tmppath[1100];
+	FILE		*fp;
+
+	boxparams_cache_key(key, sizeof (key));
+	if (!boxparams_cache_file(key, path, sizeof (path))) {
+		return;
+	}
+	(void) snprintf(tmppath, sizeof (tmppath), "%s.%d",
+	    path, (int)getpid());
+
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		warn("Couldn't write box blur tuning cache \"%s\"", tmppath);
+		return;
+	}
+
+	fprintf(fp, "%s\n%s", BOX_CACHE_MAGIC, key);
+	for (pix_t radius = 1; radius <= MAX_RADIUS; radius++) {
+		const box_params_t	*bp = &Bp.params[radius - 1];
+
+		if (bp->tuned) {
+			fprintf(fp, "%u %d %d\n", radius, bp->bk, bp->nblk);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(tmppath, path) != 0) {
+		warn("Couldn't update box blur tuning cache \"%s\"", path);
+		(void) unlink(tmppath);
+		return;
+	}
+
+	debug(DB_BOX, "Saved box blur tuning cache \"%s\"\n", path);
+}
+
+/* ------------------------------------------------------------------ */
+
 #define	BOX_PARAMS_VENDOR_INTEL		"Intel Inc."
 #define	BOX_PARAMS_VENDOR_AMD		"AMD"
 #define	BOX_PARAMS_VENDOR_NVIDIA	"NVIDIA Corporation"
@@ -130,6 +317,9 @@ boxparams_init_nvidia(const char *device,
  * module mechanism, because it has to come after opencl_preinit() but
  * before the rest of box_init(), and the module mechanism doesn't
  * allow enough control to guarantee that ordering.
+ *
+ * The vendor tables are loaded first, and then anything in the tuning
+ * cache overrides them.
  */
 void
 boxparams_init(void)
@@ -155,7 +345,10 @@ boxparams_init(void)
 	for (int radius = 1; radius <= MAX_RADIUS; radius++) {
 		(*fn)(device_name, radius, &nblk, &bk);
 		boxparams_set(radius, nblk, bk);
+		Bp.params[radius - 1].tuned = false;
 	}
+
+	boxparams_load();
 }
 
 /*
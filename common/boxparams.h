@@ -14,6 +14,30 @@
 extern box_kernel_t
 boxparams_get(pix_t radius, blkidx_t *nblkp);
 
+/*
+ * Set the box blur kernel and number of subblocks to use for a radius.
+ * boxparams_set_tuned() also notes that the values came from a measurement
+ * on this system, so they will be written out by boxparams_save().
+ */
+extern void
+boxparams_set(pix_t radius, blkidx_t nblk, box_kernel_t bk);
+
+extern void
+boxparams_set_tuned(pix_t radius, blkidx_t nblk, box_kernel_t bk);
+
+/*
+ * Returns true if this radius has been tuned, either in this run or in
+ * an earlier run whose results were read from the tuning cache.
+ */
+extern bool
+boxparams_tuned(pix_t radius);
+
+/*
+ * Write the tuned radii out to the tuning cache.
+ */
+extern void
+boxparams_save(void);
+
 /* ------------------------------------------------------------------ */
 
 extern void
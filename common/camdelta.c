@@ -1,8 +1,17 @@
 /*
  * camdelta.c - routines for taking the difference of two camera frames.
+ *
+ * Grabbing a frame from the camera can take a good fraction of a frame
+ * time, so that happens on a capture thread of its own, which keeps
+ * filling a ring of pinned host buffers.  camdelta_step() just takes the
+ * newest frame that has come in (if any) and starts copying it to the GPU,
+ * without waiting for the copy to finish.
  */
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
 #include <strings.h>
 #include <math.h>
 #include <assert.h>
@@ -21,16 +30,45 @@
 
 #define	NDATA		2	/* number of copies we keep */
 
+/*
+ * The capture ring needs one buffer for the capture thread to fill, one
+ * for the newest complete frame, and one being copied to the GPU.
+ */
+#define	NSTAGING	3
+
+typedef enum {
+	STAGING_FREE,				/* capture thread may fill */
+	STAGING_FILLING,			/* capture thread is filling */
+	STAGING_READY,				/* newest complete frame */
+	STAGING_UPLOADING			/* being copied to the GPU */
+} staging_state_t;
+
 static struct {
 	bool		disabled;		/* no camera -> can't use */
+	bool		opening;		/* "opener" is running */
+	pthread_t	opener;			/* opens the camera */
 
 	cl_mem		camera[NDATA];		/* uchar3's, packed BGR data */
 	pix_t		camwidth, camheight;	/* size of camera image */
 	size_t		camsize;
-
-	// for doing image reduction
-	int		*reduced_cpu;
-	int		reduced_bufedge;
+	size_t		framesize;		/* frames from the camera */
+	cl_mem		raw;			/* non-BGR frame, or NULL */
+
+	kernel_data_t	yuyv_kernel;		/* converts YUYV to BGR */
+
+	// the capture thread, and the ring it fills
+	uint8_t		*staging[NSTAGING];	/* from host_alloc() */
+	staging_state_t	state[NSTAGING];
+	cl_event	upload;			/* copy of UPLOADING buffer */
+	pthread_t	thread;
+	pthread_mutex_t	lock;			/* protects state[], quit */
+	bool		quit;
+
+	// for measuring the intensity of the motion
+	kernel_data_t	intensity_kernel;	/* updates "intensity" */
+	cl_mem		intensity;		/* a float2, see below */
+	cl_float2	intensity_cpu[2];	/* memory for readbacks */
+	int		nextbuf;		/* intensity_cpu[] to use */
 	float		delta_i;		/* average intensity diff */
 	float		rolling_delta_i;	/* DMA of delta_i */
 
@@ -74,24 +112,161 @@ camdelta_intensity(void)
 	}
 }
 
+/*
+ * Called once the latest intensities have come back from the GPU.
+ */
+static void
+camdelta_reduced(void *hostdst, void *arg)
+{
+	const cl_float2	*const	intensity = hostdst;
+
+	Camdelta.delta_i = intensity->s[0];
+	Camdelta.rolling_delta_i = intensity->s[1];
+
+	debug(DB_CAMERA, "Intensities: %f\n", Camdelta.delta_i);
+}
+
+/*
+ * Add up the delta image, and fold the result into the running average, all
+ * on the GPU.  Only the two resulting floats come back, and they aren't
+ * needed until the next frame, so camdelta_reduced() picks them up
+ * whenever they're ready.
+ */
 static void
 calc_delta_intensities(cl_mem curdelta)
 {
-	const int		bufedge = Camdelta.reduced_bufedge;
-	int		*const	reduced = Camdelta.reduced_cpu;
-	int64_t			sum;
-	const float		ema_factor = 0.005;
-
-	reduce_addup(curdelta, 3, 0.0, 1.0, reduced, bufedge);
-	sum = 0;
-	for (int i = 0; i < bufedge * bufedge; i++) {
-		sum += (int64_t)reduced[i];
+	kernel_data_t	*const	kd = &Camdelta.intensity_kernel;
+	pix_t			npix = Width * Height;
+	float			ema_factor = 0.005;
+	cl_mem			total;
+	size_t			size[1];
+	int			arg;
+
+	total = reduce_sum(curdelta);
+
+	size[0] = 1;
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &npix);
+	kernel_setarg(kd, arg++, sizeof (float), &ema_factor);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &total);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Camdelta.intensity);
+	kernel_invoke(kd, 1, size, size);
+
+	buffer_readfromgpu_async(Camdelta.intensity,
+	    &Camdelta.intensity_cpu[Camdelta.nextbuf], sizeof (cl_float2),
+	    camdelta_reduced, NULL);
+	Camdelta.nextbuf = 1 - Camdelta.nextbuf;
+}
+
+/*
+ * The capture thread.  This keeps grabbing frames into whichever staging
+ * buffer is free, and marks each one ready as it completes, replacing any
+ * older frame that camdelta_step() didn't get to.
+ */
+static void *
+camdelta_capture(void *arg)
+{
+	for (;;) {
+		int	b;
+		bool	ok;
+
+		pthread_mutex_lock(&Camdelta.lock);
+		if (Camdelta.quit) {
+			pthread_mutex_unlock(&Camdelta.lock);
+			break;
+		}
+		for (b = 0; b < NSTAGING; b++) {
+			if (Camdelta.state[b] == STAGING_FREE) {
+				break;
+			}
+		}
+		assert(b < NSTAGING);
+		Camdelta.state[b] = STAGING_FILLING;
+		pthread_mutex_unlock(&Camdelta.lock);
+
+		ok = camera_capture(Camdelta.staging[b]);
+
+		pthread_mutex_lock(&Camdelta.lock);
+		if (ok) {
+			for (int ob = 0; ob < NSTAGING; ob++) {
+				if (Camdelta.state[ob] == STAGING_READY) {
+					Camdelta.state[ob] = STAGING_FREE;
+				}
+			}
+			Camdelta.state[b] = STAGING_READY;
+		} else {
+			Camdelta.state[b] = STAGING_FREE;
+		}
+		pthread_mutex_unlock(&Camdelta.lock);
+
+		if (!ok) {
+			usleep(10000);	/* don't spin on a broken camera */
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Take the newest frame from the capture thread, and start copying it into
+ * "ncap".  Returns false if no new frame has come in since the last call.
+ */
+static bool
+camdelta_upload(cl_mem ncap)
+{
+	int	b;
+
+	/*
+	 * The buffer that was copied to the GPU last time can be reused once
+	 * that copy is done, which it almost always is by now.
+	 */
+	if (Camdelta.upload != NULL) {
+		opencl_marker_wait(Camdelta.upload);
+		Camdelta.upload = NULL;
+	}
+
+	pthread_mutex_lock(&Camdelta.lock);
+	for (int ob = 0; ob < NSTAGING; ob++) {
+		if (Camdelta.state[ob] == STAGING_UPLOADING) {
+			Camdelta.state[ob] = STAGING_FREE;
+		}
+	}
+	for (b = 0; b < NSTAGING; b++) {
+		if (Camdelta.state[b] == STAGING_READY) {
+			Camdelta.state[b] = STAGING_UPLOADING;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&Camdelta.lock);
+
+	if (b == NSTAGING) {
+		return (false);
 	}
 
-	Camdelta.delta_i = ((float)sum / (float)(Width * Height));
-	Camdelta.rolling_delta_i =
-	    Camdelta.rolling_delta_i * (1.0 - ema_factor) +
-	    Camdelta.delta_i * ema_factor;
+	if (Camdelta.raw == NULL) {
+		Camdelta.upload = buffer_writetogpu_async(Camdelta.staging[b],
+		    ncap, Camdelta.framesize);
+	} else {
+		kernel_data_t	*const	kd = &Camdelta.yuyv_kernel;
+		size_t			global[2];
+		int			arg;
+
+		Camdelta.upload = buffer_writetogpu_async(Camdelta.staging[b],
+		    Camdelta.raw, Camdelta.framesize);
+
+		global[0] = P2ROUNDUP((size_t)Camdelta.camwidth / 2,
+		    kd->kd_maxitems[0]);
+		global[1] = P2ROUNDUP((size_t)Camdelta.camheight,
+		    kd->kd_maxitems[1]);
+
+		arg = 0;
+		kernel_setarg(kd, arg++, sizeof (pix_t), &Camdelta.camwidth);
+		kernel_setarg(kd, arg++, sizeof (pix_t), &Camdelta.camheight);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &Camdelta.raw);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &ncap);
+		kernel_invoke(kd, 2, global, NULL);
+	}
+	return (true);
 }
 
 /*
@@ -102,47 +277,34 @@ void
 camdelta_step(cl_mem newdelta)
 {
 	kernel_data_t	*const	kd = &Camdelta.delta_kernel;
-	const int		steps = Camdelta.steps;
-	const size_t		size = Camdelta.camsize;
-	cl_mem			ocap = Camdelta.camera[(steps + 1) % 2];
-	cl_mem			ncap = Camdelta.camera[(steps + 0) % 2];
-	bool			grabbed;
-	uint8_t			*bgr;
+	cl_mem			ocap, ncap;
+	bool			fresh;
 	int			arg;
-	hrtime_t		t[6];
+	hrtime_t		t[4];
 
 	if (Camdelta.disabled) {
 		return;
 	}
 
-	Camdelta.steps++;
-
 	/*
-	 * Grab and retrieve a frame from the camera.
+	 * Take the newest frame from the camera.  If none has come in since
+	 * last time, compare the same two frames as last time.
 	 */
 	t[0] = gethrtime();
-	grabbed = camera_grab();
-	t[1] = gethrtime();
-	bgr = camera_retrieve();
-	t[2] = gethrtime();
-	if (grabbed == false || bgr == NULL) {
-		if (grabbed == false) {
-			warn("camdelta_step(): failed to grab an image\n");
-		} else {
-			warn("camdelta_step(): failed to retrieve an image\n");
-		}
-
-		return;
+	ncap = Camdelta.camera[(Camdelta.steps + 0) % 2];
+	fresh = camdelta_upload(ncap);
+	if (fresh) {
+		Camdelta.steps++;
+	} else if (Camdelta.steps == 0) {
+		return;			/* nothing to compare yet */
+	} else {
+		ncap = Camdelta.camera[(Camdelta.steps + 1) % 2];
 	}
-
-	/*
-	 * Copy the frame to the GPU.
-	 */
-	buffer_writetogpu(bgr, ncap, size);
+	ocap = Camdelta.camera[Camdelta.steps % 2];
 	if (debug_enabled(DB_PERF)) {
 		kernel_wait();
 	}
-	t[3] = gethrtime();
+	t[1] = gethrtime();
 
 	/*
 	 * Run the difference kernel.
@@ -160,44 +322,62 @@ camdelta_step(cl_mem newdelta)
 	if (debug_enabled(DB_PERF)) {
 		kernel_wait();
 	}
-	t[4] = gethrtime();
+	t[2] = gethrtime();
 
 	/*
-	 * Figure out how intense that delta was.
+	 * Figure out how intense that delta was.  That only changes when
+	 * there's a new frame.
 	 */
-	calc_delta_intensities(newdelta);
-	t[5] = gethrtime();
-
-	debug(DB_CAMERA, "Intensities: %f\n", Camdelta.delta_i);
+	if (fresh) {
+		calc_delta_intensities(newdelta);
+	}
+	t[3] = gethrtime();
 
-	debug(DB_PERF, "C:    %5.2lf %5.2lf %5.2lf %5.2lf %5.2lf | %7.2lf\n",
+	debug(DB_PERF, "C:    %5.2lf %5.2lf %5.2lf | %7.2lf%s\n",
 	    (double)(t[1] - t[0]) / 1000000.0,
 	    (double)(t[2] - t[1]) / 1000000.0,
 	    (double)(t[3] - t[2]) / 1000000.0,
-	    (double)(t[4] - t[3]) / 1000000.0,
-	    (double)(t[5] - t[4]) / 1000000.0,
-	    (double)(t[5] - t[0]) / 1000000.0);
+	    (double)(t[3] - t[0]) / 1000000.0,
+	    fresh ? "" : " (no new frame)");
 }
 
 /* ------------------------------------------------------------------ */
 
+static void *
+camdelta_open(void *arg)
+{
+	Camdelta.disabled = !camera_init();
+	return (NULL);
+}
+
 static void
 camdelta_preinit(void)
 {
 	/*
-	 * Do this in preinit(), so other init() operations can take actions
-	 * that depend on whether the camera is in use.
+	 * Opening the camera can take most of a second, so start it here,
+	 * and let it go on in the background while the other modules (OpenCL
+	 * in particular) are set up.  camdelta_init() waits for it, so any
+	 * init() operations after that one can take actions that depend on
+	 * whether the camera is in use.
 	 */
-	if (camera_disabled() || !camera_init()) {
+	if (camera_disabled()) {
 		Camdelta.disabled = true;
+	} else if (pthread_create(&Camdelta.opener, NULL,
+	    camdelta_open, NULL) == 0) {
+		Camdelta.opening = true;
 	} else {
-		Camdelta.disabled = false;
+		(void) camdelta_open(NULL);
 	}
 }
 
 static void
 camdelta_init(void)
 {
+	if (Camdelta.opening) {
+		(void) pthread_join(Camdelta.opener, NULL);
+		Camdelta.opening = false;
+	}
+
 	if (!Camdelta.disabled) {
 		const pix_t	camwidth = camera_width();
 		const pix_t	camheight = camera_height();
@@ -210,22 +390,51 @@ camdelta_init(void)
 		for (int nd = 0; nd < NDATA; nd++) {
 			Camdelta.camera[nd] = buffer_alloc(camsize);
 		}
+		kernel_create(&Camdelta.delta_kernel, "camera_delta");
 
-		Camdelta.reduced_bufedge = 16;	/* somewhat arbitrary */
-		Camdelta.reduced_cpu = mem_alloc(Camdelta.reduced_bufedge *
-		    Camdelta.reduced_bufedge * sizeof (int));
+		/*
+		 * The running average starts out at 1.0, so the first few
+		 * frames don't look wildly intense.
+		 */
+		kernel_create(&Camdelta.intensity_kernel, "camera_intensity");
+		Camdelta.delta_i = 0.0;
 		Camdelta.rolling_delta_i = 1.0;
+		Camdelta.intensity_cpu[0].s[0] = Camdelta.delta_i;
+		Camdelta.intensity_cpu[0].s[1] = Camdelta.rolling_delta_i;
+		Camdelta.intensity = buffer_alloc(sizeof (cl_float2));
+		buffer_writetogpu(&Camdelta.intensity_cpu[0],
+		    Camdelta.intensity, sizeof (cl_float2));
+		Camdelta.nextbuf = 0;
 
-		kernel_create(&Camdelta.delta_kernel, "camera_delta");
+		/*
+		 * Frames that don't come from the camera as BGR get copied to
+		 * the GPU as they are, and converted there.
+		 */
+		Camdelta.framesize = camera_framesize();
+		if (camera_format() == CAMERA_YUYV) {
+			kernel_create(&Camdelta.yuyv_kernel, "camera_yuyv");
+			Camdelta.raw = buffer_alloc(Camdelta.framesize);
+		} else {
+			Camdelta.raw = NULL;
+		}
+
+		for (int b = 0; b < NSTAGING; b++) {
+			Camdelta.staging[b] = host_alloc(Camdelta.framesize);
+			Camdelta.state[b] = STAGING_FREE;
+		}
+		Camdelta.upload = NULL;
+		Camdelta.quit = false;
+		pthread_mutex_init(&Camdelta.lock, NULL);
+		if (pthread_create(&Camdelta.thread, NULL,
+		    camdelta_capture, NULL) != 0) {
+			die("Failed to create camera capture thread\n");
+		}
 	} else {
 		Camdelta.camwidth = 0;
 		Camdelta.camheight = 0;
 		for (int nd = 0; nd < NDATA; nd++) {
 			Camdelta.camera[nd] = NULL;
 		}
-
-		Camdelta.reduced_bufedge = 0;
-		Camdelta.reduced_cpu = NULL;
 	}
 }
 
@@ -233,15 +442,34 @@ static void
 camdelta_fini(void)
 {
 	if (!Camdelta.disabled) {
+		pthread_mutex_lock(&Camdelta.lock);
+		Camdelta.quit = true;
+		pthread_mutex_unlock(&Camdelta.lock);
+		(void) pthread_join(Camdelta.thread, NULL);
+		pthread_mutex_destroy(&Camdelta.lock);
+
+		if (Camdelta.upload != NULL) {
+			opencl_marker_wait(Camdelta.upload);
+			Camdelta.upload = NULL;
+		}
+		for (int b = 0; b < NSTAGING; b++) {
+			host_free((void **)&Camdelta.staging[b]);
+		}
+
+		readback_wait(&Camdelta.intensity_cpu[0]);
+		readback_wait(&Camdelta.intensity_cpu[1]);
+		buffer_free(&Camdelta.intensity);
+		kernel_cleanup(&Camdelta.intensity_kernel);
 		kernel_cleanup(&Camdelta.delta_kernel);
+		if (Camdelta.raw != NULL) {
+			buffer_free(&Camdelta.raw);
+			kernel_cleanup(&Camdelta.yuyv_kernel);
+		}
 
 		for (int nd = 0; nd < NDATA; nd++) {
 			buffer_free(&Camdelta.camera[nd]);
 		}
 		Camdelta.camwidth = Camdelta.camheight = 0;
-
-		Camdelta.reduced_bufedge = 0;
-		mem_free((void **)&Camdelta.reduced_cpu);
 	}
 }
 
@@ -48,6 +48,41 @@ load_from_bgr(
 
 #undef	MIN
 
+/*
+ * Some cameras give us YUYV data instead of BGR; this converts it, so the
+ * rest of this code doesn't need to know.  Each work item converts one pair
+ * of pixels, which share a pair of chroma values.  (This is the same
+ * conversion as yuyv_to_rgba() in image.c.)
+ */
+__kernel void
+camera_yuyv(
+	const pix_t		iW,		/* in - image width */
+	const pix_t		iH,		/* in - image height */
+	__global const uchar	*yuyv,		/* in - packed YUYV */
+	__global uchar		*bgr)		/* out - packed BGR */
+{
+	const pix_t		X = get_global_id(0);
+	const pix_t		Y = get_global_id(1);
+
+	if (X >= iW / 2 || Y >= iH) {
+		return;
+	}
+
+	const pix_t		pair = Y * (iW / 2) + X;
+	const uchar4		s = vload4(pair, yuyv);
+	const float		u = (float)s.y - 128.0f;
+	const float		v = (float)s.w - 128.0f;
+	const float3		chroma = (float3)(
+	    1.772f * u,
+	    -0.344136f * u - 0.714136f * v,
+	    1.402f * v);
+
+	vstore3(convert_uchar3_sat_rte((float)s.x + chroma),
+	    2 * pair + 0, bgr);
+	vstore3(convert_uchar3_sat_rte((float)s.z + chroma),
+	    2 * pair + 1, bgr);
+}
+
 /*
  * Perform difference detection on successive camera images.
  *
@@ -93,3 +128,28 @@ camera_delta(
 	/* "rW - X" flips the camera image around horizontally. */
 	write_imagef(result, (int2)(rW - X, Y), pack_float4(res));
 }
+
+/*
+ * Turn the sum of a delta image (as computed by reduce_sum()) into the
+ * average intensity of its motion, and fold that into a running average.
+ * "intensity" holds the latest average in x, and the running average in y.
+ * This is run as a single work item.
+ */
+__kernel void
+camera_intensity(
+	const pix_t		npix,		/* in - pixels in delta */
+	const float		ema,		/* in - averaging factor */
+	__global const datavec	*total,		/* in - sum of delta */
+	__global float2		*intensity)	/* in/out - see above */
+{
+	/*
+	 * The distance lives in the W component, which runs from 0.0 to
+	 * 1.0; scale it up to match the range of a byte.
+	 */
+	const float		delta = (total->w * 255.0f) / (float)npix;
+	float2			i = *intensity;
+
+	i.x = delta;
+	i.y = i.y * (1.0f - ema) + delta * ema;
+	*intensity = i;
+}
@@ -3,11 +3,16 @@
  *
  * This code is used to initialize our data using an image from a built-in
  * camera.  Unsurprisingly, there's quite a lot of work involved in doing this,
- * so we rely on the OpenCV library to do the heavy lifting.
+ * so we usually rely on the OpenCV library to do the heavy lifting.  On
+ * Linux, we can also talk to the camera directly through Video4Linux2,
+ * which hands us the camera driver's own buffers; in that case, frames are
+ * usually in YUYV rather than BGR, and are converted on the GPU.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "common.h"
 
@@ -17,7 +22,347 @@
 #include "util.h"
 #include "osdep.h"
 
-#ifdef OPENCV_SUPPORT
+#if	defined(V4L2_SUPPORT)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#define	V4L2_DEFAULT_DEVICE	"/dev/video0"
+#define	V4L2_NBUFS		4	/* driver buffers to stream through */
+
+static struct {
+	bool		disabled;
+	bool		initialized;
+	int		fd;
+	pix_t		width, height;
+	size_t		stride;		/* bytes per row in the driver */
+	camera_format_t	format;
+	const char	*filename;	/* device to use */
+
+	void		*bufs[V4L2_NBUFS];	/* mmap()ed driver buffers */
+	size_t		buflens[V4L2_NBUFS];
+	int		nbufs;
+	int		held;		/* dequeued buffer, or -1 */
+
+	pthread_mutex_t	lock;		/* for camera_capture() */
+} Camera;
+
+static int
+v4l2_ioctl(int fd, unsigned long req, void *arg)
+{
+	int	rv;
+
+	do {
+		rv = ioctl(fd, req, arg);
+	} while (rv == -1 && errno == EINTR);
+
+	return (rv);
+}
+
+/*
+ * Open "device", make sure it's a streaming capture device, and get its
+ * current frame size.
+ */
+static int
+v4l2_open(const char *device, struct v4l2_format *fmt)
+{
+	struct v4l2_capability	cap;
+	const uint32_t		need =
+	    V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+	int			fd;
+
+	if ((fd = open(device, O_RDWR)) == -1) {
+		verbose(DB_CAMERA, "v4l2_open(): couldn't open \"%s\"\n",
+		    device);
+		return (-1);
+	}
+
+	bzero(&cap, sizeof (cap));
+	bzero(fmt, sizeof (*fmt));
+	fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (v4l2_ioctl(fd, VIDIOC_QUERYCAP, &cap) == -1 ||
+	    (cap.capabilities & need) != need ||
+	    v4l2_ioctl(fd, VIDIOC_G_FMT, fmt) == -1) {
+		verbose(DB_CAMERA, "v4l2_open(): \"%s\" isn't a streaming "
+		    "capture device\n", device);
+		(void) close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+void
+camera_disable(void)
+{
+	Camera.disabled = true;
+}
+
+bool
+camera_disabled(void)
+{
+	return (Camera.disabled);
+}
+
+/* Is this a Video4Linux2 device that we can use? */
+bool
+camera_try_file(const char *filename, pix_t *w, pix_t *h)
+{
+	struct v4l2_format	fmt;
+	int			fd;
+
+	if ((fd = v4l2_open(filename, &fmt)) == -1) {
+		return (false);
+	}
+	*w = fmt.fmt.pix.width;
+	*h = fmt.fmt.pix.height;
+	(void) close(fd);
+
+	return (true);
+}
+
+void
+camera_set_filename(const char *filename)
+{
+	Camera.filename = filename;
+}
+
+bool
+camera_init(void)
+{
+	const char		*device;
+	struct v4l2_format	fmt;
+	struct v4l2_requestbuffers req;
+	enum v4l2_buf_type	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int			fd;
+
+	if (Camera.disabled) {
+		return (false);		// and don't print a warning
+	}
+
+	device = (Camera.filename != NULL) ?
+	    Camera.filename : V4L2_DEFAULT_DEVICE;
+	if ((fd = v4l2_open(device, &fmt)) == -1) {
+		warn("camera_init(): failed to initialize camera\n");
+		camera_disable();
+		return (false);
+	}
+	verbose(DB_CAMERA, "Using \"%s\" as camera input\n", device);
+
+	/*
+	 * Ask for YUYV at the camera's current size, since just about every
+	 * webcam can do that; take BGR if that's what we get instead.
+	 */
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (v4l2_ioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
+		warn("camera_init(): failed to set the camera's format\n");
+		goto fail;
+	}
+	switch (fmt.fmt.pix.pixelformat) {
+	case V4L2_PIX_FMT_YUYV:
+		Camera.format = CAMERA_YUYV;
+		break;
+	case V4L2_PIX_FMT_BGR24:
+		Camera.format = CAMERA_BGR;
+		break;
+	default:
+		warn("camera_init(): camera can't produce YUYV or BGR\n");
+		goto fail;
+	}
+	Camera.width = fmt.fmt.pix.width;
+	Camera.height = fmt.fmt.pix.height;
+	Camera.stride = fmt.fmt.pix.bytesperline;
+
+	/*
+	 * Map the driver's buffers, and queue them all up.
+	 */
+	bzero(&req, sizeof (req));
+	req.count = V4L2_NBUFS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (v4l2_ioctl(fd, VIDIOC_REQBUFS, &req) == -1 || req.count < 2) {
+		warn("camera_init(): failed to get camera buffers\n");
+		goto fail;
+	}
+	Camera.nbufs = MIN((int)req.count, V4L2_NBUFS);
+	for (int b = 0; b < Camera.nbufs; b++) {
+		struct v4l2_buffer	buf;
+
+		bzero(&buf, sizeof (buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = b;
+		if (v4l2_ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			warn("camera_init(): failed to query buffer %d\n", b);
+			goto fail;
+		}
+		Camera.buflens[b] = buf.length;
+		Camera.bufs[b] = mmap(NULL, buf.length,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+		if (Camera.bufs[b] == MAP_FAILED) {
+			Camera.bufs[b] = NULL;
+			warn("camera_init(): failed to map buffer %d\n", b);
+			goto fail;
+		}
+		if (v4l2_ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+			warn("camera_init(): failed to queue buffer %d\n", b);
+			goto fail;
+		}
+	}
+	if (v4l2_ioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+		warn("camera_init(): failed to start streaming\n");
+		goto fail;
+	}
+
+	Camera.fd = fd;
+	Camera.held = -1;
+	Camera.initialized = true;
+	pthread_mutex_init(&Camera.lock, NULL);
+
+	return (true);
+
+fail:
+	for (int b = 0; b < Camera.nbufs; b++) {
+		if (Camera.bufs[b] != NULL) {
+			(void) munmap(Camera.bufs[b], Camera.buflens[b]);
+			Camera.bufs[b] = NULL;
+		}
+	}
+	Camera.nbufs = 0;
+	(void) close(fd);
+	camera_disable();
+	return (false);
+}
+
+bool
+camera_initialized(void)
+{
+	return (Camera.initialized);
+}
+
+pix_t
+camera_width(void)
+{
+	assert(Camera.width != 0);
+	return (Camera.width);
+}
+
+pix_t
+camera_height(void)
+{
+	assert(Camera.height != 0);
+	return (Camera.height);
+}
+
+camera_format_t
+camera_format(void)
+{
+	return (Camera.format);
+}
+
+size_t
+camera_framesize(void)
+{
+	const size_t	bpp = (Camera.format == CAMERA_YUYV) ? 2 : 3;
+
+	return ((size_t)Camera.width * Camera.height * bpp);
+}
+
+/*
+ * Give the last frame's buffer back to the driver, and wait for the next
+ * one.
+ */
+bool
+camera_grab(void)
+{
+	struct v4l2_buffer	buf;
+
+	bzero(&buf, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	if (Camera.held != -1) {
+		buf.index = Camera.held;
+		Camera.held = -1;
+		if (v4l2_ioctl(Camera.fd, VIDIOC_QBUF, &buf) == -1) {
+			return (false);
+		}
+	}
+	if (v4l2_ioctl(Camera.fd, VIDIOC_DQBUF, &buf) == -1) {
+		return (false);
+	}
+	Camera.held = buf.index;
+
+	return (true);
+}
+
+uint8_t *
+camera_retrieve(void)
+{
+	if (Camera.held == -1) {
+		warn("camera_retrieve(): failed to read from camera\n");
+		return (NULL);
+	}
+	return (Camera.bufs[Camera.held]);
+}
+
+/*
+ * Grab a frame, and copy its data into "frame", which must have room for
+ * camera_framesize() bytes.
+ */
+bool
+camera_capture(uint8_t *frame)
+{
+	const size_t	rowsize = camera_framesize() / Camera.height;
+	const uint8_t	*src;
+
+	pthread_mutex_lock(&Camera.lock);
+	if (!camera_grab()) {
+		warn("camera_capture(): failed to grab an image\n");
+		src = NULL;
+	} else if ((src = camera_retrieve()) != NULL) {
+		/*
+		 * The driver may pad out its rows.
+		 */
+		for (pix_t y = 0; y < Camera.height; y++) {
+			memcpy(&frame[y * rowsize], &src[y * Camera.stride],
+			    rowsize);
+		}
+	}
+	pthread_mutex_unlock(&Camera.lock);
+
+	return (src != NULL);
+}
+
+void
+camera_fini(void)
+{
+	enum v4l2_buf_type	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (!Camera.initialized) {
+		return;
+	}
+
+	(void) v4l2_ioctl(Camera.fd, VIDIOC_STREAMOFF, &type);
+	for (int b = 0; b < Camera.nbufs; b++) {
+		(void) munmap(Camera.bufs[b], Camera.buflens[b]);
+		Camera.bufs[b] = NULL;
+	}
+	Camera.nbufs = 0;
+	Camera.held = -1;
+	(void) close(Camera.fd);
+
+	pthread_mutex_destroy(&Camera.lock);
+	Camera.initialized = false;
+	Camera.width = Camera.height = 0;
+}
+
+#elif	defined(OPENCV_SUPPORT)
 
 #define cvRound(x) (x)	/* prevents compiler warning */
 #include "opencv2/videoio/videoio_c.h"
@@ -27,6 +372,7 @@ static struct {
 	CvCapture	*capture;
 	pix_t		width, height;
 	const char	*filename;
+	pthread_mutex_t	lock;		/* for camera_capture() */
 } Camera;
 
 void
@@ -100,6 +446,7 @@ camera_init(void)
 	    CV_CAP_PROP_FRAME_WIDTH);
 	Camera.height = (pix_t)cvGetCaptureProperty(Camera.capture,
 	    CV_CAP_PROP_FRAME_HEIGHT);
+	pthread_mutex_init(&Camera.lock, NULL);
 
 	return (true);
 }
@@ -124,6 +471,18 @@ camera_height(void)
 	return (Camera.height);
 }
 
+camera_format_t
+camera_format(void)
+{
+	return (CAMERA_BGR);
+}
+
+size_t
+camera_framesize(void)
+{
+	return ((size_t)Camera.width * Camera.height * 3 * sizeof (char));
+}
+
 bool
 camera_grab(void)
 {
@@ -173,9 +532,33 @@ camera_retrieve(void)
 	return (bgr);
 }
 
+/*
+ * Grab a frame, and copy its data into "frame", which must have room for
+ * camera_framesize() bytes.  The frame that camera_retrieve() returns is
+ * only good until the next grab, so this does both at once, and can be used
+ * from more than one thread.
+ */
+bool
+camera_capture(uint8_t *frame)
+{
+	uint8_t	*src;
+
+	pthread_mutex_lock(&Camera.lock);
+	if (!camera_grab()) {
+		warn("camera_capture(): failed to grab an image\n");
+		src = NULL;
+	} else if ((src = camera_retrieve()) != NULL) {
+		memcpy(frame, src, camera_framesize());
+	}
+	pthread_mutex_unlock(&Camera.lock);
+
+	return (src != NULL);
+}
+
 void
 camera_fini(void)
 {
+	pthread_mutex_destroy(&Camera.lock);
 	cvReleaseCapture(&Camera.capture);
 	Camera.capture = NULL;
 	Camera.width = Camera.height = 0;
@@ -231,6 +614,20 @@ camera_height(void)
 	return (0);
 }
 
+camera_format_t
+camera_format(void)
+{
+	assert(0 && "camera is not supported");
+	return (CAMERA_BGR);
+}
+
+size_t
+camera_framesize(void)
+{
+	assert(0 && "camera is not supported");
+	return (0);
+}
+
 bool
 camera_grab(void)
 {
@@ -245,6 +642,13 @@ camera_retrieve(void)
 	return (NULL);
 }
 
+bool
+camera_capture(uint8_t *frame)
+{
+	assert(0 && "camera is not supported");
+	return (false);
+}
+
 uint8_t *
 camera_query(void)
 {
@@ -257,4 +661,4 @@ camera_fini(void)
 {
 }
 
-#endif	/* OPENCV_SUPPORT */
+#endif	/* V4L2_SUPPORT, OPENCV_SUPPORT */
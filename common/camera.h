@@ -7,6 +7,14 @@
 
 #include "types.h"
 
+/*
+ * The layout of the frames that the camera produces.
+ */
+typedef enum {
+	CAMERA_BGR,		/* 3 bytes per pixel, B, G, R */
+	CAMERA_YUYV		/* 2 bytes per pixel, Y0 U Y1 V per pair */
+} camera_format_t;
+
 extern void	camera_disable(void);
 extern bool	camera_disabled(void);
 extern bool	camera_try_file(const char *, pix_t *, pix_t *);
@@ -15,8 +23,11 @@ extern bool	camera_init(void);
 extern bool	camera_initialized(void);
 extern pix_t	camera_width(void);
 extern pix_t	camera_height(void);
+extern camera_format_t camera_format(void);
+extern size_t	camera_framesize(void);
 extern bool	camera_grab(void);
 extern uint8_t *camera_retrieve(void);
+extern bool	camera_capture(uint8_t *);
 extern void	camera_fini(void);
 
 #endif	/* _CAMERA_H */
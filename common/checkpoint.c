@@ -0,0 +1,604 @@
+/*
+ * checkpoint.c - saves and restores the full state of the simulation.
+ *
+ * A saved PPM file only holds the rendered image, at eight bits per
+ * channel; loading one goes through the core's unrender() routine, which
+ * can't recover the datavec's, let alone the core's own buffers.  A
+ * checkpoint holds all of that at full precision, so a restarted program
+ * carries on exactly where it left off.
+ *
+ * A checkpoint file is a fixed-size header (ckpt_header_t), followed by
+ * the raw contents of each named section of state, each starting on a
+ * CKPT_ALIGN boundary.  The header records everything that has to match
+ * for the sections to make sense: the core algorithm, DATA_DIMENSIONS,
+ * the storage format, and the image size.  It also holds the parameters
+ * (as a param_dump() string), the step count, and the state of the random
+ * number generator.  Everything is in the host's byte order.
+ *
+ * Checkpoints are written asynchronously: each section is read back from
+ * the GPU into host memory without waiting, and once they've all arrived,
+ * a thread writes them out to a temporary file and renames it into
+ * place.  Restoring maps the file into memory, and copies each section
+ * from there straight into its buffer.
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#include "checkpoint.h"
+#include "datasrc.h"
+#include "debug.h"
+#include "module.h"
+#include "opencl.h"
+#include "param.h"
+#include "randbj.h"
+#include "util.h"
+
+#define	CKPT_MAGIC		"zoundsCP"	/* not NUL-terminated */
+#define	CKPT_VERSION		1
+#define	CKPT_MAXSECTIONS	16
+#define	CKPT_NAMELEN		32
+#define	CKPT_PARAMLEN		1024
+#define	CKPT_ALIGN		4096		/* section alignment */
+
+/*
+ * How often to write a checkpoint, in seconds.
+ */
+#define	CKPT_PERIOD		60
+
+typedef struct {
+	char		cs_name[CKPT_NAMELEN];
+	uint64_t	cs_offset;		/* from the start of the file */
+	uint64_t	cs_size;		/* in bytes */
+} ckpt_section_t;
+
+typedef struct {
+	char		ch_magic[8];		/* CKPT_MAGIC */
+	uint32_t	ch_version;		/* CKPT_VERSION */
+	uint32_t	ch_dimensions;		/* DATA_DIMENSIONS */
+	uint32_t	ch_storage;		/* sizeof (cl_datastore) */
+	uint32_t	ch_width;
+	uint32_t	ch_height;
+	int32_t		ch_steps;		/* core steps taken */
+	uint64_t	ch_rng;			/* randbj_state() */
+	char		ch_core[CKPT_NAMELEN];	/* core algorithm */
+	char		ch_params[CKPT_PARAMLEN]; /* param_dump() */
+	uint32_t	ch_nsections;
+	uint32_t	ch_pad;
+	ckpt_section_t	ch_sections[CKPT_MAXSECTIONS];
+} ckpt_header_t;
+
+struct checkpoint {
+	bool		cp_restoring;
+	ckpt_header_t	cp_header;
+
+	/* for writing */
+	void		*cp_data[CKPT_MAXSECTIONS];	/* from mem_alloc() */
+	int		cp_pending;	/* readbacks still outstanding */
+	bool		cp_collected;	/* all sections have been added */
+
+	/* for restoring */
+	const uint8_t	*cp_map;	/* the mapped file */
+	size_t		cp_maplen;
+};
+
+static struct {
+	const char	*file;		/* from checkpoint_file() */
+	checkpoint_t	resume;		/* the one to restore, if mapped */
+	checkpoint_t	save;		/* the one being written */
+	time_t		last;		/* when the last one was started */
+
+	pthread_t	thread;		/* writes out "save" */
+	pthread_mutex_t	lock;		/* protects "save", busy */
+	bool		busy;		/* "save" is in use */
+	bool		started;	/* "thread" needs to be joined */
+} Checkpoint;
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Map a checkpoint file, and check that it's one we might be able to use.
+ */
+static bool
+checkpoint_map(const char *file, checkpoint_t *cp)
+{
+	const ckpt_header_t	*ch;
+	struct stat		st;
+	void			*addr;
+	int			fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		return (false);		/* nothing to resume */
+	}
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof (ckpt_header_t)) {
+		warn("Ignoring truncated checkpoint \"%s\"\n", file);
+		close(fd);
+		return (false);
+	}
+	addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		warn("Failed to map checkpoint \"%s\"\n", file);
+		return (false);
+	}
+
+	ch = addr;
+	if (memcmp(ch->ch_magic, CKPT_MAGIC, sizeof (ch->ch_magic)) != 0 ||
+	    ch->ch_version != CKPT_VERSION ||
+	    ch->ch_nsections > CKPT_MAXSECTIONS) {
+		warn("Ignoring malformed checkpoint \"%s\"\n", file);
+	} else if (ch->ch_dimensions != DATA_DIMENSIONS ||
+	    ch->ch_storage != sizeof (cl_datastore)) {
+		warn("Ignoring checkpoint \"%s\" from a different data "
+		    "format\n", file);
+	} else {
+		const uint64_t	len = (uint64_t)st.st_size;
+
+		for (uint32_t s = 0; s < ch->ch_nsections; s++) {
+			const ckpt_section_t	*const	cs =
+			    &ch->ch_sections[s];
+
+			if (cs->cs_offset > len ||
+			    cs->cs_size > len - cs->cs_offset) {
+				warn("Ignoring truncated checkpoint "
+				    "\"%s\"\n", file);
+				(void) munmap(addr, (size_t)st.st_size);
+				return (false);
+			}
+		}
+
+		bzero(cp, sizeof (*cp));
+		cp->cp_restoring = true;
+		cp->cp_header = *ch;
+		cp->cp_header.ch_core[CKPT_NAMELEN - 1] = '\0';
+		cp->cp_header.ch_params[CKPT_PARAMLEN - 1] = '\0';
+		cp->cp_map = addr;
+		cp->cp_maplen = (size_t)st.st_size;
+		return (true);
+	}
+
+	(void) munmap(addr, (size_t)st.st_size);
+	return (false);
+}
+
+static void
+checkpoint_unmap(checkpoint_t *cp)
+{
+	if (cp->cp_map != NULL) {
+		(void) munmap((void *)cp->cp_map, cp->cp_maplen);
+		cp->cp_map = NULL;
+		cp->cp_maplen = 0;
+	}
+}
+
+/* This gets called from main() before checkpoint_preinit(). */
+bool
+checkpoint_file(const char *file, pix_t *widthp, pix_t *heightp)
+{
+	Checkpoint.file = file;
+
+	if (!checkpoint_map(file, &Checkpoint.resume)) {
+		return (false);
+	}
+
+	*widthp = Checkpoint.resume.cp_header.ch_width;
+	*heightp = Checkpoint.resume.cp_header.ch_height;
+	return (true);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The writer thread: write out "cp", which has all of its data in hand.
+ */
+static void *
+checkpoint_writer(void *arg)
+{
+	checkpoint_t	*const	cp = arg;
+	ckpt_header_t	*const	ch = &cp->cp_header;
+	char		tmpfile[PATH_MAX];
+	uint64_t	off;
+	FILE		*fp;
+	bool		ok;
+
+	off = P2ROUNDUP((uint64_t)sizeof (ckpt_header_t),
+	    (uint64_t)CKPT_ALIGN);
+	for (uint32_t s = 0; s < ch->ch_nsections; s++) {
+		ch->ch_sections[s].cs_offset = off;
+		off = P2ROUNDUP(off + ch->ch_sections[s].cs_size,
+		    (uint64_t)CKPT_ALIGN);
+	}
+
+	/*
+	 * Write to a temporary file and rename it, so a crash partway
+	 * through doesn't clobber the last good checkpoint.
+	 */
+	(void) snprintf(tmpfile, sizeof (tmpfile), "%s.tmp",
+	    Checkpoint.file);
+	ok = ((fp = fopen(tmpfile, "wb")) != NULL);
+	if (ok) {
+		ok = (fwrite(ch, sizeof (*ch), 1, fp) == 1);
+		for (uint32_t s = 0; ok && s < ch->ch_nsections; s++) {
+			const ckpt_section_t	*const	cs =
+			    &ch->ch_sections[s];
+
+			ok = (fseeko(fp, (off_t)cs->cs_offset,
+			    SEEK_SET) == 0 &&
+			    fwrite(cp->cp_data[s], cs->cs_size, 1, fp) == 1);
+		}
+		if (fclose(fp) != 0) {
+			ok = false;
+		}
+	}
+	if (ok && rename(tmpfile, Checkpoint.file) != 0) {
+		ok = false;
+	}
+	if (ok) {
+		verbose(DB_IMAGE, "Wrote checkpoint \"%s\" at step %d\n",
+		    Checkpoint.file, ch->ch_steps);
+	} else {
+		warn("Failed to write checkpoint \"%s\"\n", Checkpoint.file);
+		(void) unlink(tmpfile);
+	}
+
+	for (uint32_t s = 0; s < ch->ch_nsections; s++) {
+		mem_free(&cp->cp_data[s]);
+	}
+
+	pthread_mutex_lock(&Checkpoint.lock);
+	Checkpoint.busy = false;
+	pthread_mutex_unlock(&Checkpoint.lock);
+
+	return (NULL);
+}
+
+/*
+ * Start the writer thread once every section has been read back.  This is
+ * called with the lock held.
+ */
+static void
+checkpoint_write_if_ready(checkpoint_t *cp)
+{
+	if (cp->cp_collected && cp->cp_pending == 0) {
+		if (pthread_create(&Checkpoint.thread, NULL,
+		    checkpoint_writer, cp) != 0) {
+			die("Failed to create checkpoint writer thread\n");
+		}
+		Checkpoint.started = true;
+	}
+}
+
+static void
+checkpoint_readback_cb(void *hostdst, void *arg)
+{
+	checkpoint_t	*const	cp = arg;
+
+	pthread_mutex_lock(&Checkpoint.lock);
+	assert(cp->cp_pending > 0);
+	cp->cp_pending--;
+	checkpoint_write_if_ready(cp);
+	pthread_mutex_unlock(&Checkpoint.lock);
+}
+
+/*
+ * Start writing a checkpoint, unless the last one is still being written.
+ */
+static void
+checkpoint_save(void)
+{
+	checkpoint_t	*const	cp = &Checkpoint.save;
+	ckpt_header_t	*const	ch = &cp->cp_header;
+	bool		busy;
+
+	pthread_mutex_lock(&Checkpoint.lock);
+	busy = Checkpoint.busy;
+	Checkpoint.busy = true;
+	pthread_mutex_unlock(&Checkpoint.lock);
+
+	if (busy) {
+		verbose(DB_IMAGE, "Skipping checkpoint; the last one is "
+		    "still being written\n");
+		return;
+	}
+	if (Checkpoint.started) {
+		(void) pthread_join(Checkpoint.thread, NULL);
+		Checkpoint.started = false;
+	}
+
+	bzero(cp, sizeof (*cp));
+	memcpy(ch->ch_magic, CKPT_MAGIC, sizeof (ch->ch_magic));
+	ch->ch_version = CKPT_VERSION;
+	ch->ch_dimensions = DATA_DIMENSIONS;
+	ch->ch_storage = sizeof (cl_datastore);
+	ch->ch_width = Width;
+	ch->ch_height = Height;
+	ch->ch_rng = randbj_state();
+	param_dump(ch->ch_params, sizeof (ch->ch_params) - 1);
+
+	datasrc_checkpoint(cp);
+
+	pthread_mutex_lock(&Checkpoint.lock);
+	cp->cp_collected = true;
+	checkpoint_write_if_ready(cp);
+	pthread_mutex_unlock(&Checkpoint.lock);
+}
+
+void
+checkpoint_periodic(void)
+{
+	const time_t	t = time(NULL);
+
+	if (Checkpoint.file == NULL || t - Checkpoint.last < CKPT_PERIOD) {
+		return;
+	}
+	Checkpoint.last = t;
+	checkpoint_save();
+}
+
+/*
+ * Wait for the checkpoint that's being written, if there is one.
+ */
+static void
+checkpoint_drain(void)
+{
+	checkpoint_t	*const	cp = &Checkpoint.save;
+	bool		pending;
+
+	if (Checkpoint.file == NULL) {
+		return;
+	}
+
+	/*
+	 * Once the readbacks are all done, the writer owns the sections.
+	 */
+	pthread_mutex_lock(&Checkpoint.lock);
+	pending = (cp->cp_pending > 0);
+	pthread_mutex_unlock(&Checkpoint.lock);
+	if (pending) {
+		for (uint32_t s = 0; s < cp->cp_header.ch_nsections; s++) {
+			readback_wait(cp->cp_data[s]);
+		}
+	}
+	if (Checkpoint.started) {
+		(void) pthread_join(Checkpoint.thread, NULL);
+		Checkpoint.started = false;
+	}
+}
+
+void
+checkpoint_exit(void)
+{
+	if (Checkpoint.file == NULL || Checkpoint.resume.cp_map != NULL) {
+		return;		/* nothing new to save */
+	}
+
+	checkpoint_drain();
+	checkpoint_save();
+	checkpoint_drain();
+}
+
+/* ------------------------------------------------------------------ */
+
+bool
+checkpoint_restore(void)
+{
+	checkpoint_t	*const	cp = &Checkpoint.resume;
+	bool		rv;
+
+	if (cp->cp_map == NULL) {
+		return (false);
+	}
+
+	if (cp->cp_header.ch_width != Width ||
+	    cp->cp_header.ch_height != Height) {
+		warn("Ignoring checkpoint \"%s\": it's %ux%u, not %ux%u\n",
+		    Checkpoint.file, cp->cp_header.ch_width,
+		    cp->cp_header.ch_height, Width, Height);
+		rv = false;
+	} else {
+		rv = datasrc_checkpoint(cp);
+		if (rv) {
+			verbose(DB_IMAGE, "Resumed from checkpoint \"%s\" at "
+			    "step %d\n", Checkpoint.file,
+			    cp->cp_header.ch_steps);
+		}
+	}
+
+	checkpoint_unmap(cp);
+	Checkpoint.last = time(NULL);
+	return (rv);
+}
+
+/* ------------------------------------------------------------------ */
+
+bool
+checkpoint_restoring(const checkpoint_t *cp)
+{
+	return (cp->cp_restoring);
+}
+
+bool
+checkpoint_core(checkpoint_t *cp, const char *name)
+{
+	ckpt_header_t	*const	ch = &cp->cp_header;
+
+	if (!cp->cp_restoring) {
+		(void) snprintf(ch->ch_core, sizeof (ch->ch_core), "%s", name);
+		return (true);
+	}
+
+	if (strcmp(ch->ch_core, name) != 0) {
+		warn("Ignoring checkpoint \"%s\" from core \"%s\"\n",
+		    Checkpoint.file, ch->ch_core);
+		return (false);
+	}
+	param_undump(ch->ch_params);
+	randbj_set_state(ch->ch_rng);
+	return (true);
+}
+
+bool
+checkpoint_steps(checkpoint_t *cp, int *stepsp)
+{
+	if (cp->cp_restoring) {
+		*stepsp = cp->cp_header.ch_steps;
+	} else {
+		cp->cp_header.ch_steps = *stepsp;
+	}
+	return (true);
+}
+
+/*
+ * Find the restored section called "name", of "size" bytes.
+ */
+static const void *
+checkpoint_find(checkpoint_t *cp, const char *name, size_t size)
+{
+	const ckpt_header_t	*const	ch = &cp->cp_header;
+
+	for (uint32_t s = 0; s < ch->ch_nsections; s++) {
+		const ckpt_section_t	*const	cs = &ch->ch_sections[s];
+
+		if (strncmp(cs->cs_name, name, CKPT_NAMELEN) != 0) {
+			continue;
+		}
+		if (cs->cs_size != size) {
+			warn("Checkpoint section \"%s\" has %llu bytes, "
+			    "not %zu\n", name,
+			    (unsigned long long)cs->cs_size, size);
+			return (NULL);
+		}
+		return (cp->cp_map + cs->cs_offset);
+	}
+
+	warn("Checkpoint has no section \"%s\"\n", name);
+	return (NULL);
+}
+
+/*
+ * Add a section called "name", of "size" bytes, to a checkpoint being
+ * written.  This returns where its data should go.
+ */
+static void *
+checkpoint_add(checkpoint_t *cp, const char *name, size_t size)
+{
+	ckpt_header_t	*const	ch = &cp->cp_header;
+	ckpt_section_t	*cs;
+	const uint32_t		s = ch->ch_nsections;
+
+	if (s == CKPT_MAXSECTIONS) {
+		die("Too many checkpoint sections\n");
+	}
+	ch->ch_nsections++;
+
+	cs = &ch->ch_sections[s];
+	(void) snprintf(cs->cs_name, sizeof (cs->cs_name), "%s", name);
+	cs->cs_size = size;
+	cp->cp_data[s] = mem_alloc(size);
+
+	return (cp->cp_data[s]);
+}
+
+bool
+checkpoint_buffer(checkpoint_t *cp, const char *name, cl_mem buf,
+    size_t size)
+{
+	if (cp->cp_restoring) {
+		const void	*const	src = checkpoint_find(cp, name, size);
+
+		if (src != NULL) {
+			buffer_writetogpu(src, buf, size);
+		}
+		return (src != NULL);
+	} else {
+		void	*const	dst = checkpoint_add(cp, name, size);
+
+		pthread_mutex_lock(&Checkpoint.lock);
+		cp->cp_pending++;
+		pthread_mutex_unlock(&Checkpoint.lock);
+		buffer_readfromgpu_async(buf, dst, size,
+		    checkpoint_readback_cb, cp);
+		return (true);
+	}
+}
+
+bool
+checkpoint_image(checkpoint_t *cp, const char *name, cl_mem image)
+{
+	const size_t	size = ocl_image_bytes(image, Width, Height);
+
+	if (cp->cp_restoring) {
+		const void	*const	src = checkpoint_find(cp, name, size);
+
+		if (src != NULL) {
+			ocl_image_writetogpu(src, image, Width, Height);
+		}
+		return (src != NULL);
+	} else {
+		void	*const	dst = checkpoint_add(cp, name, size);
+
+		pthread_mutex_lock(&Checkpoint.lock);
+		cp->cp_pending++;
+		pthread_mutex_unlock(&Checkpoint.lock);
+		ocl_image_readfromgpu_async(image, dst, Width, Height,
+		    checkpoint_readback_cb, cp);
+		return (true);
+	}
+}
+
+bool
+checkpoint_value(checkpoint_t *cp, const char *name, void *val,
+    size_t size)
+{
+	if (cp->cp_restoring) {
+		const void	*const	src = checkpoint_find(cp, name, size);
+
+		if (src != NULL) {
+			memcpy(val, src, size);
+		}
+		return (src != NULL);
+	} else {
+		memcpy(checkpoint_add(cp, name, size), val, size);
+		return (true);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+checkpoint_init(void)
+{
+	static bool	inited = false;
+
+	if (!inited) {
+		pthread_mutex_init(&Checkpoint.lock, NULL);
+		Checkpoint.last = time(NULL);
+		inited = true;
+	}
+}
+
+/*
+ * Sections are read back from buffers that are about to go away.
+ */
+static void
+checkpoint_fini(void)
+{
+	checkpoint_drain();
+}
+
+const module_ops_t	checkpoint_ops = {
+	NULL,
+	checkpoint_init,
+	checkpoint_fini
+};
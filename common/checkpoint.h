@@ -0,0 +1,90 @@
+/*
+ * checkpoint.h - interfaces for saving and restoring the full state of the
+ * simulation.
+ */
+
+#ifndef	_CHECKPOINT_H
+#define	_CHECKPOINT_H
+
+#include "types.h"
+
+typedef struct checkpoint	checkpoint_t;
+
+/*
+ * Resume from the checkpoint in "file" if it exists, and checkpoint into it
+ * every so often and on exit.  If it exists, its size is returned in
+ * "widthp" and "heightp", and the return value is true.
+ *
+ * This gets called from main() before checkpoint_preinit().
+ */
+extern bool
+checkpoint_file(const char *file, pix_t *widthp, pix_t *heightp);
+
+/*
+ * Write a checkpoint if one is due.  Called after each step.
+ */
+extern void
+checkpoint_periodic(void);
+
+/*
+ * Write a last checkpoint and wait for it.  This is registered with atexit()
+ * by main(), so that it runs before module_fini().
+ */
+extern void
+checkpoint_exit(void);
+
+/*
+ * If there's a checkpoint to resume from, restore everything from it (see
+ * datasrc_checkpoint()), and return true.
+ */
+extern bool
+checkpoint_restore(void);
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * These are used by datasrc_checkpoint() and the cores' (*checkpoint)()
+ * routines, which get called both to write a checkpoint and to restore
+ * from one.  Each piece of state is named, and each of these routines
+ * either saves it or restores it, as checkpoint_restoring() says.  When
+ * restoring, they return false if the checkpoint doesn't have a matching
+ * piece of state, and leave the state alone.
+ */
+extern bool
+checkpoint_restoring(const checkpoint_t *cp);
+
+/*
+ * Record which core algorithm this is, or check that the checkpoint came
+ * from the same one.  This must come first; on restore, it also brings
+ * back the parameters and the random number generator.
+ */
+extern bool
+checkpoint_core(checkpoint_t *cp, const char *name);
+
+/*
+ * The number of steps taken by the core algorithm.
+ */
+extern bool
+checkpoint_steps(checkpoint_t *cp, int *stepsp);
+
+/*
+ * "size" bytes of GPU buffer "buf".
+ */
+extern bool
+checkpoint_buffer(checkpoint_t *cp, const char *name, cl_mem buf,
+    size_t size);
+
+/*
+ * All of the Width x Height OpenCL image "image".
+ */
+extern bool
+checkpoint_image(checkpoint_t *cp, const char *name, cl_mem image);
+
+/*
+ * "size" bytes of host memory at "val".
+ */
+extern bool
+checkpoint_value(checkpoint_t *cp, const char *name, void *val,
+    size_t size);
+
+#endif	/* _CHECKPOINT_H */
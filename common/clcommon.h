@@ -26,4 +26,20 @@ typedef	int			spix_t;
  */
 typedef int			blkidx_t;
 
+/*
+ * Index helpers for a buffer kept in TILED_SIDE x TILED_SIDE tiles, rather
+ * than in rows, so that the pixels above and below a pixel are usually in
+ * the same few cache lines as it is.  The tiles are stored in row-major
+ * order, as are the pixels within each tile.  A tiled buffer for a w x h
+ * image holds TILED_WIDTH(w) * TILED_WIDTH(h) pixels; the ones past the
+ * right and bottom edges are padding.
+ */
+#define	TILED_SIDE		8
+#define	TILED_WIDTH(w)		\
+	(((w) + TILED_SIDE - 1) / TILED_SIDE * TILED_SIDE)
+#define	TILED_PIXEL(x,y,w)	\
+	((((y) / TILED_SIDE) * TILED_WIDTH(w) +				\
+	((x) / TILED_SIDE) * TILED_SIDE + (y) % TILED_SIDE) *		\
+	TILED_SIDE + (x) % TILED_SIDE)
+
 #endif	/* _CLCOMMON_H */
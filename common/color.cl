@@ -129,6 +129,21 @@ hsv_to_rgb(const float3 hsv)
 	return ((float3)(r, g, b));
 }
 
+/*
+ * The same conversion without the branches: each of R, G, and B is a
+ * trapezoid in h, offset by a third of the way around the hue circle.
+ * This agrees with hsv_to_rgb() to within rounding.
+ */
+static float3
+hsv_to_rgb_fast(const float3 hsv)
+{
+	const float3	k = hsv.x + (float3)(1.0f, 2.0f / 3.0f, 1.0f / 3.0f);
+	const float3	p = fabs((k - floor(k)) * 6.0f - 3.0f);
+
+	return (hsv.z * mix((float3)(1.0f),
+	    clamp(p - 1.0f, 0.0f, 1.0f), hsv.y));
+}
+
 static float3
 image_to_hsv(
 	pix_t			X,		/* in */
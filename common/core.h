@@ -6,11 +6,15 @@
 #define	_CORE_H
 
 #include "types.h"
+#include "checkpoint.h"
 
 /*
  * The operations provided by a core algorithm.
  */
 typedef struct {
+	/* The name of the core algorithm, for checkpoints. */
+	const char	*name;
+
 	/*
 	 * Convert an RGBA image2d_t into an image2d_t made of datavec's.
 	 * A datavec is an N-dimensional vector of data (where "N" =
@@ -50,6 +54,39 @@ typedef struct {
 	 */
 	void	(*render)(cl_mem data, cl_mem image);
 
+	/*
+	 * Optional: the same as step_and_export() followed by render(), but
+	 * possibly in fewer passes over the image.  If "export" is false,
+	 * "data" doesn't have to be filled in, since only "image" is going
+	 * to be looked at; if it's needed later on, export() will fill it
+	 * in from the same step.
+	 */
+	void	(*step_and_render)(cl_mem data, cl_mem image, bool export);
+	void	(*export)(cl_mem data);
+
+	/*
+	 * Optional: save or restore any state that the core keeps beyond
+	 * what's in the datavec's, using checkpoint_buffer() and friends
+	 * (see checkpoint.h).  When restoring, import() has already been
+	 * called with the checkpoint's datavec's.
+	 */
+	void	(*checkpoint)(checkpoint_t *cp);
+
+	/*
+	 * Optional: return true if a step taken now couldn't change the
+	 * datavec's, or anything else that render() looks at.  As long as
+	 * that stays true and no parameters change, datasrc_step() doesn't
+	 * step at all, and shows the last image that was rendered.
+	 */
+	bool	(*frozen)(void);
+
+	/*
+	 * Set if step_and_export() does its own image skipping (see
+	 * skip_fixed()), so that datasrc_step() shouldn't put it through
+	 * skip_step() as well.
+	 */
+	bool	skips;
+
 	/* The minimum value of any component of a data vector. */
 	float	(*min)(void);
 
@@ -13,16 +13,21 @@
 
 #include "common.h"
 
+#include "checkpoint.h"
 #include "core.h"
 #include "datasrc.h"
 #include "debug.h"
 #include "heatmap.h"
 #include "histogram.h"
 #include "image.h"
+#include "interp.h"
 #include "module.h"
 #include "opencl.h"
 #include "param.h"
+#include "skip.h"
 #include "stroke.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "util.h"
 
 /* ------------------------------------------------------------------ */
@@ -41,6 +46,22 @@ static struct {
 	int		steps;			/* number of core steps taken */
 	core_ops_t	*ops;
 	step_cb_t	*cblist;		/* list of callbacks to run */
+	bool		stale;			/* rendered[last] not written */
+
+	/*
+	 * The last image rendered by a step after which the core said it
+	 * was frozen, and param_changes() as of then; see datasrc_frozen().
+	 */
+	cl_mem		frame;
+	bool		frame_valid;
+	uint64_t	frame_params;
+
+	/*
+	 * The datavec's from before a resize; see datasrc_preserve().
+	 */
+	void		*old_data;
+	pix_t		old_width;
+	pix_t		old_height;
 } Datasrc;
 
 /* ------------------------------------------------------------------ */
@@ -63,6 +84,9 @@ datasrc_init(void)
 	Datasrc.last = 0;
 	Datasrc.steps = 0;
 	Datasrc.cblist = NULL;
+	Datasrc.stale = false;
+	Datasrc.frame = NULL;
+	Datasrc.frame_valid = false;
 }
 
 static void
@@ -73,6 +97,9 @@ datasrc_fini(void)
 	for (i = 0; i < NRENDERED; i++) {
 		buffer_free(&Datasrc.rendered[i]);
 	}
+	if (Datasrc.frame != NULL) {
+		buffer_free(&Datasrc.frame);
+	}
 }
 
 const module_ops_t	datasrc_ops = {
@@ -102,6 +129,12 @@ core_ops_unregister(core_ops_t *ops)
 	Datasrc.ops = NULL;
 }
 
+const char *
+datasrc_core_name(void)
+{
+	return (Datasrc.ops != NULL ? Datasrc.ops->name : "none");
+}
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -143,6 +176,121 @@ datasrc_step_taken(void)
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * Make sure that Datasrc.rendered[Datasrc.last] holds the latest data,
+ * if step_and_render() was told that it didn't need to write it.
+ */
+static void
+datasrc_freshen(void)
+{
+	if (Datasrc.stale) {
+		(*Datasrc.ops->export)(Datasrc.rendered[Datasrc.last]);
+		Datasrc.stale = false;
+	}
+}
+
+/*
+ * Hand new data to the core.  If the interpolator is in use, it starts
+ * over from here rather than interpolating across the change.
+ */
+static void
+datasrc_import(cl_mem data)
+{
+	if (interp_enabled()) {
+		interp_load(data, Datasrc.ops->import);
+	} else {
+		(*Datasrc.ops->import)(data);
+	}
+}
+
+/*
+ * Does anything other than render() need the datavec's from this step?
+ */
+static bool
+datasrc_export_needed(void)
+{
+	return (heatmap_enabled() || debug_enabled(DB_HISTO));
+}
+
+/*
+ * Can this step be skipped?  That's the case if the core says that a step
+ * couldn't change anything, and nothing else has changed since the image
+ * in Datasrc.frame was rendered: any data loads or strokes clear
+ * Datasrc.frame_valid, and any parameter changes show up as a change in
+ * param_changes().
+ */
+static bool
+datasrc_frozen(void)
+{
+	return (Datasrc.frame_valid &&
+	    Datasrc.frame_params == param_changes() &&
+	    Datasrc.ops->frozen != NULL && (*Datasrc.ops->frozen)());
+}
+
+/*
+ * After a step, keep a copy of what it rendered if the core says the
+ * next one won't change anything.
+ */
+static void
+datasrc_keep_frame(cl_mem image)
+{
+	if (Datasrc.ops->frozen == NULL || !(*Datasrc.ops->frozen)()) {
+		return;
+	}
+	if (Datasrc.frame == NULL) {
+		Datasrc.frame = ocl_image_create(CL_RGBA, CL_UNORM_INT8,
+		    Width, Height);
+	}
+	ocl_image_copy(image, Datasrc.frame, Width, Height);
+	Datasrc.frame_valid = true;
+	Datasrc.frame_params = param_changes();
+	verbose(DB_CORE, "Core is frozen; not stepping until "
+	    "something changes\n");
+}
+
+/*
+ * Save or restore everything needed to carry on from the latest step.  On
+ * restore, the datavec's are imported into the core first, and then the
+ * core's own state (if it keeps any) is laid on top of that.
+ */
+bool
+datasrc_checkpoint(checkpoint_t *cp)
+{
+	const bool	restoring = checkpoint_restoring(cp);
+	const int	osteps = Datasrc.steps;
+	cl_mem		data;
+
+	if (!checkpoint_core(cp, Datasrc.ops->name)) {
+		return (false);
+	}
+
+	if (!restoring) {
+		datasrc_freshen();
+	}
+	data = Datasrc.rendered[Datasrc.last];
+	if (!checkpoint_image(cp, "datavec", data)) {
+		return (false);
+	}
+	(void) checkpoint_steps(cp, &Datasrc.steps);
+
+	if (restoring) {
+		/*
+		 * Pending callbacks stay the same number of steps away.
+		 */
+		for (step_cb_t *scb = Datasrc.cblist; scb != NULL;
+		    scb = scb->next) {
+			scb->when += Datasrc.steps - osteps;
+		}
+		Datasrc.stale = false;
+		datasrc_import(data);
+	}
+	if (Datasrc.ops->checkpoint != NULL) {
+		(*Datasrc.ops->checkpoint)(cp);
+	}
+
+	return (true);
+}
+
 /*
  * This is called to preserve the current image prior to a window resize
  * operation.  It explicitly *doesn't* invoke the heatmap code, since the
@@ -157,11 +305,120 @@ datasrc_rerender(cl_mem image)
 	if (Datasrc.ops == NULL) {
 		die("No core algorithm registered!\n");
 	}
+	datasrc_freshen();
 	(*Datasrc.ops->render)(src, image);
 }
 
+/*
+ * This is called instead of datasrc_rerender() and image_preserve() when
+ * the image is about to be resized without the window changing shape (see
+ * window_set_fps()).  The datavec's themselves are kept, rather than the
+ * RGBA image, and they're stretched to the new size afterwards, so the
+ * simulation carries on where it was instead of being rebuilt from colors.
+ */
+void
+datasrc_preserve(void)
+{
+	cl_mem	data;
+
+	if (Datasrc.ops == NULL) {
+		return;
+	}
+	datasrc_freshen();
+	data = Datasrc.rendered[Datasrc.last];
+
+	Datasrc.old_data = mem_alloc(ocl_image_bytes(data, Width, Height));
+	ocl_image_readfromgpu(data, Datasrc.old_data, Width, Height);
+	Datasrc.old_width = Width;
+	Datasrc.old_height = Height;
+}
+
+/*
+ * Bring back the datavec's saved by datasrc_preserve(), if there are any,
+ * stretching them to the current size.
+ */
+static bool
+datasrc_load_preserved(cl_mem data)
+{
+	cl_mem	old;
+
+	if (Datasrc.old_data == NULL) {
+		return (false);
+	}
+
+	old = ocl_datavec_image_create(Datasrc.old_width, Datasrc.old_height);
+	ocl_image_writetogpu(Datasrc.old_data, old, Datasrc.old_width,
+	    Datasrc.old_height);
+	image_resample(old, data);
+	buffer_free(&old);
+
+	mem_free(&Datasrc.old_data);
+	Datasrc.old_width = Datasrc.old_height = 0;
+	Datasrc.stale = false;
+
+	return (true);
+}
+
+/*
+ * The core's step, put through the image skipping engine.  Component 0 of
+ * the datavec's is what it looks at; for the cores that have a brightness,
+ * that's the closest thing to it.
+ */
+static void
+datasrc_skip_step(cl_mem data)
+{
+	skip_step(data, 0, (*Datasrc.ops->min)(), (*Datasrc.ops->max)(),
+	    Datasrc.ops->step_and_export);
+}
+
+/*
+ * The core's own part of a regular step.  The interpolator and the image
+ * skipping engine get a say in it if they're in use, in that order.
+ */
+static void
+datasrc_core_step(cl_mem data, cl_mem image)
+{
+	const bool	skipping = (!Datasrc.ops->skips && skip_active());
+	void		(*step)(cl_mem) = (skipping ? datasrc_skip_step :
+			    Datasrc.ops->step_and_export);
+	hrtime_t	tc;
+
+	tc = telemetry_start();
+	if (interp_active() || skipping) {
+		/*
+		 * The interpolator hands back either the next step that
+		 * wasn't skipped, or an image partway to it.
+		 */
+		if (interp_active()) {
+			interp_step(data, (*Datasrc.ops->min)(),
+			    (*Datasrc.ops->max)(), step);
+		} else {
+			(*step)(data);
+		}
+		Datasrc.stale = false;
+
+		(*Datasrc.ops->render)(data, image);
+	} else if (Datasrc.ops->step_and_render != NULL) {
+		const bool	export = datasrc_export_needed();
+
+		(*Datasrc.ops->step_and_render)(data, image, export);
+		Datasrc.stale = !export;
+	} else {
+		(*Datasrc.ops->step_and_export)(data);
+
+		/*
+		 * Generate the RGBA image.
+		 */
+		(*Datasrc.ops->render)(data, image);
+	}
+	telemetry_stop(TM_CORE, tc);
+
+	datasrc_keep_frame(image);
+}
+
 /*
  * Generate the next image.  "image" is an image2d_t of RGBA floats.
+ * This only enqueues the work; it's up to the caller to wait for it.
  */
 void
 datasrc_step(cl_mem image)
@@ -171,14 +428,40 @@ datasrc_step(cl_mem image)
 	const datavec_shape_t	shape = (*Datasrc.ops->datavec_shape)();
 	cl_mem			data;
 	bool			step_taken;
+	bool			frozen;
+	const hrtime_t		tr = trace_begin();
+	hrtime_t		tm;
 
 	data = Datasrc.rendered[Datasrc.last];
+	tm = telemetry_start();
 
 	step_taken = false;
+	frozen = false;
 	if (Datasrc.ops == NULL) {
 		die("No core algorithm registered!\n");
 	}
-	if (image_available(image)) {
+	if (checkpoint_restore()) {
+		/*
+		 * We picked up from a checkpoint, which put the whole state
+		 * back, so all that's left is to show it.
+		 */
+		data = Datasrc.rendered[Datasrc.last];
+		(*Datasrc.ops->render)(data, image);
+	} else if (datasrc_load_preserved(data)) {
+		/*
+		 * We were just resized, and kept the datavec's across it.
+		 */
+		datasrc_import(data);
+		(*Datasrc.ops->render)(data, image);
+	} else if (image_random(data, min, max, shape)) {
+		/*
+		 * Random data goes straight into the core's data, so it just
+		 * needs to be imported and shown.
+		 */
+		Datasrc.stale = false;
+		datasrc_import(data);
+		(*Datasrc.ops->render)(data, image);
+	} else if (image_available(image)) {
 		/*
 		 * There was an image to load, and we loaded it.
 		 *
@@ -186,30 +469,33 @@ datasrc_step(cl_mem image)
 		 * data that the core code can operate on.
 		 */
 		(*Datasrc.ops->unrender)(image, data);
+		Datasrc.stale = false;
 
 		/*
 		 * Import the unrendered data back into the core.
 		 */
-		(*Datasrc.ops->import)(data);
+		datasrc_import(data);
 	} else if (stroke_pending()) {
-		cl_mem	newdata;
-
 		/*
 		 * There are one or more mouse strokes pending.
-		 * Operate on them.
+		 * Operate on them; each stroke_step() takes care of a whole
+		 * batch of segments, so this usually only goes around once.
 		 */
+		datasrc_freshen();
 		while (stroke_pending()) {
-			Datasrc.last = (Datasrc.last + 1) % NRENDERED;
-			newdata = Datasrc.rendered[Datasrc.last];
-			stroke_step(data, newdata);
-			data = newdata;
+			const int	next = (Datasrc.last + 1) % NRENDERED;
+
+			if (stroke_step(data, Datasrc.rendered[next])) {
+				Datasrc.last = next;
+				data = Datasrc.rendered[next];
+			}
 		}
 
 		/*
 		 * Once those are done, import the stroked data back to the
 		 * core algorithm, and generate an RGBA image of the result.
 		 */
-		(*Datasrc.ops->import)(data);
+		datasrc_import(data);
 
 		(*Datasrc.ops->render)(data, image);
 	} else {
@@ -218,14 +504,32 @@ datasrc_step(cl_mem image)
 		 * First run the autopilot to advance parameters if needed.
 		 */
 		autopilot_step();
-		(*Datasrc.ops->step_and_export)(data);
 
-		/*
-		 * Generate the RGBA image.
-		 */
-		(*Datasrc.ops->render)(data, image);
+		if (datasrc_frozen()) {
+			/*
+			 * The core says a step couldn't change the data, and
+			 * nothing else has, so the last image is still right.
+			 * Anything other than render() that wants the data
+			 * still gets it.
+			 */
+			if (datasrc_export_needed()) {
+				datasrc_freshen();
+			}
+			ocl_image_copy(Datasrc.frame, image, Width, Height);
+			frozen = true;
+		} else {
+			datasrc_core_step(data, image);
+			step_taken = true;
+		}
+	}
+	telemetry_stop(TM_STEP, tm);
 
-		step_taken = true;
+	/*
+	 * Anything other than a regular step, or a skipped one, changes
+	 * what a step would start from.
+	 */
+	if (!step_taken && !frozen) {
+		Datasrc.frame_valid = false;
 	}
 
 	/*
@@ -237,14 +541,14 @@ datasrc_step(cl_mem image)
 	 * Add a heatmap to the image if desired.
 	 * This only updates the RGBA image; Datasrc.rendered is unmodified.
 	 */
+	tm = telemetry_start();
 	heatmap_update(data, min, max, shape, image);
+	telemetry_stop(TM_HEATMAP, tm);
+
+	trace_end(DB_CORE, "datasrc_step", tr);
 
 	if (step_taken) {
 		datasrc_step_taken();
+		checkpoint_periodic();
 	}
-
-	/*
-	 * Wait for all OpenCL work to finish before returning.
-	 */
-	kernel_wait();
 }
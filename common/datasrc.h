@@ -6,9 +6,11 @@
 #define	_DATASRC_H
 
 #include "types.h"
+#include "checkpoint.h"
 
 /*
  * Generate the next image.  "image" is an image2d_t of RGBA float's.
+ * The work is only enqueued, not waited for.
  */
 extern void
 datasrc_step(cl_mem);
@@ -19,6 +21,14 @@ datasrc_step(cl_mem);
 extern void
 datasrc_rerender(cl_mem);
 
+/*
+ * Keep the current datavec's across a resize, to be stretched to the new
+ * size.  Called instead of datasrc_rerender() when the window's shape
+ * isn't changing.
+ */
+extern void
+datasrc_preserve(void);
+
 /*
  * Register a callback to be called (with argument "arg") nsteps steps from
  * now.
@@ -26,4 +36,17 @@ datasrc_rerender(cl_mem);
 extern void
 datasrc_step_registercb(int nsteps, void (*cb)(void *), void *arg);
 
+/*
+ * The name the core algorithm registered itself under.
+ */
+extern const char *
+datasrc_core_name(void);
+
+/*
+ * Save or restore the latest datavec's, the step count, and the core
+ * algorithm's own state.  Returns false if a restore didn't work out.
+ */
+extern bool
+datasrc_checkpoint(checkpoint_t *cp);
+
 #endif	/* _DATASRC_H */
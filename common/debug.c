@@ -168,6 +168,19 @@ debug_enabled(debug_area_t area)
 	return ((Debug.areas & area) != 0);
 }
 
+const char *
+debug_area_name(debug_area_t area)
+{
+	for (int key = 0; key <= UCHAR_MAX; key++) {
+		const debug_toggle_t	*const	dt = &Debug.toggles[key];
+
+		if (dt->comment != NULL && dt->area == area) {
+			return (dt->comment);
+		}
+	}
+	return ("other");
+}
+
 static void
 debug_toggle(unsigned char key)
 {
@@ -27,6 +27,8 @@ typedef enum {
 	DB_SKIP		= 0x00001000,	/* image skipping */
 	DB_STROKE	= 0x00002000,	/* stroke processing */
 	DB_WINDOW	= 0x00004000,	/* window handling */
+	DB_GPU		= 0x00008000,	/* per-kernel GPU profiling */
+	DB_TELEM	= 0x00010000,	/* frame telemetry */
 } debug_area_t;
 
 /*
@@ -91,6 +93,12 @@ debug_register_toggle(unsigned char key,
 extern bool
 debug_enabled(debug_area_t);
 
+/*
+ * Returns the description that was registered for the specified area.
+ */
+extern const char *
+debug_area_name(debug_area_t);
+
 /* ------------------------------------------------------------------ */
 
 extern void
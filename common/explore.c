@@ -0,0 +1,268 @@
+/*
+ * explore.c - runs an atlas of small instances of the core algorithm, each
+ * with its own parameters, to help pick out presets.
+ *
+ * The parameters for each instance are chosen at random from the ones that
+ * autopilot is allowed to tune, apart from the ones explore_share() says
+ * have to be the same everywhere.  The instances are kept as parameter
+ * dump strings; the core switches to each one in turn with
+ * explore_foreach() when it sets up its per-instance state.
+ *
+ * Thumbnails of each instance are saved in "explore/latest/", each next to
+ * a text file with its parameter string and random seed.  A string that
+ * looks good can be pasted into the core's preset table.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "debug.h"
+#include "explore.h"
+#include "module.h"
+#include "opencl.h"
+#include "param.h"
+#include "ppm.h"
+#include "template.h"
+#include "util.h"
+
+/*
+ * How often to save thumbnails, in steps.
+ */
+#define	EXPLORE_THUMB_STEPS	500
+
+/*
+ * The smallest instance that's allowed, and the longest parameter string.
+ */
+#define	EXPLORE_MINTILE		16
+#define	EXPLORE_DUMPLEN		80
+
+static struct {
+	pix_t		tile;		/* instance size, or 0 */
+	int		n;		/* instances asked for */
+	int		count;		/* instances in the atlas */
+	int		cols;		/* instances per row */
+	long		seed;		/* seed for instance 0 */
+	uint64_t	shared;		/* IDs of explore_share() params */
+	bool		supported;	/* see explore_supported() */
+
+	bool		chosen;		/* have dumps[] been filled in? */
+	bool		applied;	/* has the core used them? */
+	char		base[EXPLORE_DUMPLEN];
+	char		dumps[EXPLORE_MAX][EXPLORE_DUMPLEN];
+
+	template_t	*template;	/* for naming thumbnails */
+	uint8_t		*rgba;		/* the whole atlas */
+	uint8_t		*rgb;		/* one thumbnail */
+} Explore;
+
+/* ------------------------------------------------------------------ */
+
+void
+explore_instances(int n, pix_t size, long seed, pix_t *widthp,
+    pix_t *heightp)
+{
+	int	cols;
+
+	if (n < 1 || n > EXPLORE_MAX) {
+		die("The number of instances must be between 1 and %d.\n",
+		    EXPLORE_MAX);
+	}
+	if (size < EXPLORE_MINTILE) {
+		die("Each instance must be at least %d pixels on a side.\n",
+		    EXPLORE_MINTILE);
+	}
+
+	/*
+	 * Make the atlas as close to square as possible.
+	 */
+	for (cols = 1; cols * cols < n; cols++) {
+		continue;
+	}
+
+	Explore.tile = size;
+	Explore.n = n;
+	Explore.cols = cols;
+	Explore.count = cols * ((n + cols - 1) / cols);
+	Explore.seed = seed;
+
+	*widthp = size * cols;
+	*heightp = size * (Explore.count / cols);
+}
+
+pix_t
+explore_tile(void)
+{
+	return (Explore.tile);
+}
+
+int
+explore_count(void)
+{
+	return (Explore.tile == 0 ? 1 : Explore.count);
+}
+
+long
+explore_seed(int i)
+{
+	return (Explore.seed + i);
+}
+
+void
+explore_supported(void)
+{
+	Explore.supported = true;
+}
+
+void
+explore_share(param_id_t id)
+{
+	Explore.shared |= (1ULL << id);
+}
+
+/*
+ * Pick the parameters for each instance, the first time they're needed.
+ * This can't be done any earlier, since the parameters are registered by
+ * the other modules' preinit routines.
+ */
+static void
+explore_choose(void)
+{
+	if (Explore.chosen) {
+		return;
+	}
+	Explore.chosen = true;
+
+	param_dump(Explore.base, sizeof (Explore.base) - 1);
+	for (int i = 0; i < Explore.count; i++) {
+		param_undump(Explore.base);
+		param_randomize(Explore.shared);
+		param_dump(Explore.dumps[i], sizeof (Explore.dumps[i]) - 1);
+	}
+	param_undump(Explore.base);
+}
+
+/*
+ * A core that never calls this runs every instance with the same
+ * parameters, and that's what gets reported for them.
+ */
+void
+explore_foreach(void (*cb)(int, void *), void *arg)
+{
+	explore_choose();
+
+	for (int i = 0; i < Explore.count; i++) {
+		if (!Explore.applied && i < Explore.n) {
+			verbose(DB_PARAM, "Instance %d: %s (seed %ld)\n",
+			    i, Explore.dumps[i], explore_seed(i));
+		}
+		param_undump(Explore.dumps[i]);
+		(*cb)(i, arg);
+	}
+	param_undump(Explore.base);
+	Explore.applied = true;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Save instance "i" from the atlas in Explore.rgba.
+ */
+static void
+explore_save(int i, int steps)
+{
+	const pix_t	T = Explore.tile;
+	const pix_t	x0 = (i % Explore.cols) * T;
+	const pix_t	y0 = (i / Explore.cols) * T;
+	char		label[16];
+	char		path[PATH_MAX];
+	size_t		len;
+	FILE		*fp;
+
+	for (pix_t y = 0; y < T; y++) {
+		const uint8_t	*src =
+		    Explore.rgba + 4 * ((size_t)(y0 + y) * Width + x0);
+		uint8_t		*dst = Explore.rgb + 3 * (y * T);
+
+		for (pix_t x = 0; x < T; x++, src += 4, dst += 3) {
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
+
+	(void) snprintf(label, sizeof (label), "%03d", i);
+	(void) snprintf(path, sizeof (path), "%s",
+	    template_name(Explore.template, label, steps));
+	ppm_write_rgb(path, Explore.rgb, T, T);
+
+	/*
+	 * The parameters go next to it, in a file with the same name.
+	 */
+	len = strlen(path);
+	if (len > 4 && strcmp(path + len - 4, ".ppm") == 0) {
+		(void) strcpy(path + len - 4, ".txt");
+		if ((fp = fopen(path, "w")) != NULL) {
+			(void) fprintf(fp, "%s\nseed %ld\n", Explore.applied ?
+			    Explore.dumps[i] : Explore.base, explore_seed(i));
+			(void) fclose(fp);
+		}
+	}
+}
+
+void
+explore_frame(cl_mem image, int steps)
+{
+	if (Explore.tile == 0 || steps % EXPLORE_THUMB_STEPS != 0) {
+		return;
+	}
+	explore_choose();
+
+	if (Explore.template == NULL) {
+		Explore.template = template_alloc("explore");
+	}
+	if (Explore.rgba == NULL) {
+		Explore.rgba = mem_alloc((size_t)Width * Height * 4);
+		Explore.rgb =
+		    mem_alloc((size_t)Explore.tile * Explore.tile * 3);
+	}
+
+	ocl_image_readfromgpu(image, Explore.rgba, Width, Height);
+	for (int i = 0; i < Explore.n; i++) {
+		explore_save(i, steps);
+	}
+	verbose(DB_IMAGE, "Saved %d thumbnails at step %d\n",
+	    Explore.n, steps);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * This runs after the core's preinit routine, which is where it says whether
+ * it can be explored.
+ */
+static void
+explore_preinit(void)
+{
+	if (Explore.tile != 0 && !Explore.supported) {
+		die("This core algorithm doesn't support exploration "
+		    "(\"-I\"); only tc and mstp do.\n");
+	}
+}
+
+static void
+explore_fini(void)
+{
+	if (Explore.rgba != NULL) {
+		mem_free((void **)&Explore.rgba);
+		mem_free((void **)&Explore.rgb);
+	}
+}
+
+const module_ops_t	explore_ops = {
+	explore_preinit,
+	NULL,
+	explore_fini
+};
@@ -0,0 +1,85 @@
+/*
+ * explore.h - interfaces for running many small instances of the core
+ * algorithm side by side, to look for interesting parameter settings.
+ *
+ * In exploration mode, the data is an atlas of square instances, each
+ * explore_tile() pixels on a side, laid out in rows.  Each instance has its
+ * own starting data and its own parameter settings, but they're all stepped
+ * together, so one launch of each kernel advances every instance.  Anything
+ * that looks at neighboring pixels has to wrap around at the edges of each
+ * instance rather than at the edges of the atlas; in the OpenCL code, that
+ * is what ZOUNDS_TILE (the instance size, or 0) is for.
+ */
+
+#ifndef	_EXPLORE_H
+#define	_EXPLORE_H
+
+#include "types.h"
+
+/*
+ * The most instances there can be.
+ */
+#define	EXPLORE_MAX	256
+
+/*
+ * Run "n" instances of "size" x "size" pixels each, the first started from
+ * random seed "seed", the next from "seed" + 1, and so on.  The size of the
+ * whole atlas is returned in "widthp" and "heightp".
+ *
+ * This gets called from main() before any of the modules are set up.
+ */
+extern void
+explore_instances(int n, pix_t size, long seed, pix_t *widthp,
+    pix_t *heightp);
+
+/*
+ * A core algorithm whose kernels all wrap around at the edges of each
+ * instance calls this from its preinit routine.  Only those can be explored;
+ * in the others, neighboring instances would run into each other.
+ */
+extern void
+explore_supported(void);
+
+/*
+ * The size of each instance, or 0 if we're not exploring.
+ */
+extern pix_t
+explore_tile(void);
+
+/*
+ * The number of instances in the atlas.  This can be a few more than were
+ * asked for, to fill out the last row; the extra ones run, but aren't
+ * reported.  It's 1 if we're not exploring.
+ */
+extern int
+explore_count(void);
+
+/*
+ * The random seed for the starting data of instance "i".
+ */
+extern long
+explore_seed(int i);
+
+/*
+ * Keep parameter "id" the same for every instance.  This is for parameters
+ * that control work done for the atlas as a whole, such as which blurs to
+ * do.  It has to be called from a preinit routine.
+ */
+extern void
+explore_share(param_id_t id);
+
+/*
+ * Call "cb" for each instance in turn, with its parameter settings in
+ * effect; afterwards, the settings are put back the way they were.
+ */
+extern void
+explore_foreach(void (*cb)(int, void *), void *arg);
+
+/*
+ * Every so often, save a thumbnail of each instance from "image", along
+ * with the parameter string for it.
+ */
+extern void
+explore_frame(cl_mem image, int steps);
+
+#endif	/* _EXPLORE_H */
@@ -30,6 +30,11 @@
  */
 #define	PIP_FRACTION	0.25
 
+/*
+ * The largest workgroup that the histogram kernel uses.
+ */
+#define	HM_MAX_WGSIZE	256
+
 /* ------------------------------------------------------------------ */
 
 #if	DATA_DIMENSIONS == 1
@@ -46,6 +51,17 @@ heatmap_update(cl_mem data, float min, float max, datavec_shape_t shape,
 {
 }
 
+bool
+heatmap_enabled(void)
+{
+	return (false);
+}
+
+void
+heatmap_set_interval(int interval)
+{
+}
+
 #else	/* DATA_DIMENSIONS > 1 */
 
 static void	heatmap_toggle(void);
@@ -53,11 +69,15 @@ static void	heatmap_toggle(void);
 /* ------------------------------------------------------------------ */
 
 static struct {
-	kernel_data_t		zero_kernel;
 	kernel_data_t		histogram_kernel;
 	kernel_data_t		render_kernel;
 
 	cl_mem			histogram;
+	bool			clean;		/* histogram is all zero */
+	bool			transient;	/* histogram is shared */
+	size_t			wgedge;		/* histogram workgroup edge */
+	int			interval;	/* update every Nth frame */
+	unsigned int		frame;		/* frames since last reset */
 
 	enum { OFF, PIP, ON }	state;		/* PIP = picture-in-picture */
 } Heatmap;
@@ -81,12 +101,49 @@ heatmap_init(void)
 {
 	if (Heatmap.state != OFF) {
 		const size_t	mapsize = (size_t)Width * Height * sizeof (int);
+		size_t		max;
+		cl_uint		zero = 0;
 
-		kernel_create(&Heatmap.zero_kernel, "hm_zero");
 		kernel_create(&Heatmap.histogram_kernel, "hm_histogram");
 		kernel_create(&Heatmap.render_kernel, "hm_render");
 
-		Heatmap.histogram = buffer_alloc(mapsize);
+		/*
+		 * The histogram kernel sorts within each workgroup, so it
+		 * needs a power-of-two number of members.  Use square
+		 * workgroups, since nearby pixels tend to land in the same
+		 * bucket.
+		 */
+		max = MIN(kernel_wgsize(&Heatmap.histogram_kernel),
+		    HM_MAX_WGSIZE);
+		for (Heatmap.wgedge = 1;
+		    Heatmap.wgedge * Heatmap.wgedge * 4 <= max;
+		    Heatmap.wgedge *= 2) {
+			continue;
+		}
+
+		/*
+		 * hm_render() zeroes out the histogram once it's done with
+		 * it, so this usually only needs to happen once.  It's always
+		 * allocated at full size, so it doesn't need to change when
+		 * the heatmap goes in and out of picture-in-picture mode.
+		 *
+		 * If it's regenerated every frame, nothing in it needs to
+		 * last until the next one, so it can share memory with other
+		 * transient buffers; but then the part of it that's used has
+		 * to be cleared every time, and hm_render() needn't bother.
+		 */
+		Heatmap.transient = (MAX(Heatmap.interval, 1) == 1);
+		if (Heatmap.transient) {
+			Heatmap.histogram = transient_alloc(mapsize,
+			    TR_HEATMAP);
+			Heatmap.clean = false;
+		} else {
+			Heatmap.histogram = buffer_alloc(mapsize);
+			buffer_fill(Heatmap.histogram, mapsize,
+			    &zero, sizeof (zero));
+			Heatmap.clean = true;
+		}
+		Heatmap.frame = 0;
 	}
 }
 
@@ -94,11 +151,14 @@ static void
 heatmap_fini(void)
 {
 	if (Heatmap.state != OFF) {
-		buffer_free(&Heatmap.histogram);
+		if (Heatmap.transient) {
+			transient_free(&Heatmap.histogram, TR_HEATMAP);
+		} else {
+			buffer_free(&Heatmap.histogram);
+		}
 
 		kernel_cleanup(&Heatmap.render_kernel);
 		kernel_cleanup(&Heatmap.histogram_kernel);
-		kernel_cleanup(&Heatmap.zero_kernel);
 	}
 }
 
@@ -120,6 +180,7 @@ heatmap_toggle(void)
 		break;
 	case PIP:
 		Heatmap.state = ON;
+		Heatmap.frame = 0;	/* regenerate at the new size */
 		break;
 	case ON:
 		heatmap_fini();
@@ -134,6 +195,66 @@ heatmap_toggle(void)
 	window_update();
 }
 
+bool
+heatmap_enabled(void)
+{
+	return (Heatmap.state != OFF);
+}
+
+void
+heatmap_set_interval(int interval)
+{
+	Heatmap.interval = MAX(interval, 1);
+	Heatmap.frame = 0;
+}
+
+/*
+ * Generate the "hw" x "hh" heatmap histogram from the data, looking at every
+ * "stride"th pixel in each direction.
+ */
+static void
+heatmap_histogram(cl_mem data, float min, float max, float scale,
+    cl_datavec bases[2], pix_t hw, pix_t hh, pix_t stride)
+{
+	kernel_data_t	*const	kd = &Heatmap.histogram_kernel;
+	const pix_t		updates =
+	    Heatmap.frame / MAX(Heatmap.interval, 1);
+	const pix_t		phase = updates % (stride * stride);
+	pix_t			xoff, yoff;
+	size_t			global[2], local[2];
+	int			arg;
+
+	/*
+	 * Move the sampled pixels around from one update to the next, so
+	 * that over time every pixel gets looked at.
+	 */
+	xoff = phase % stride;
+	yoff = phase / stride;
+
+	local[0] = local[1] = Heatmap.wgedge;
+	global[0] = P2ROUNDUP((size_t)(Width / stride), Heatmap.wgedge);
+	global[1] = P2ROUNDUP((size_t)(Height / stride), Heatmap.wgedge);
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &hw);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &hh);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &stride);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &xoff);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &yoff);
+	kernel_setarg(kd, arg++, sizeof (float), &min);
+	kernel_setarg(kd, arg++, sizeof (float), &max);
+	kernel_setarg(kd, arg++, sizeof (float), &scale);
+	kernel_setarg(kd, arg++, sizeof (cl_datavec), &bases[0]);
+	kernel_setarg(kd, arg++, sizeof (cl_datavec), &bases[1]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
+	kernel_setarg(kd, arg++,
+	    local[0] * local[1] * sizeof (cl_uint), NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Heatmap.histogram);
+	kernel_invoke(kd, 2, global, local);
+}
+
 /*
  * Update "image" with a heatmap image, based on the data that was accumulated
  * in "data".
@@ -144,9 +265,13 @@ heatmap_update(cl_mem data, float min, float max, datavec_shape_t shape,
 {
 	kernel_data_t	*kd;
 	int		arg;
+	size_t		global[2];
 	float		hmscale;
 	cl_datavec	bases[2];
 	float		scale;
+	pix_t		hw, hh, stride;
+	float		density;
+	int		interval, clear;
 
 	/*
 	 * Pivot the projection, and create new basis vectors.
@@ -169,16 +294,6 @@ heatmap_update(cl_mem data, float min, float max, datavec_shape_t shape,
 		break;
 	}
 
-	/*
-	 * Zero out the heatmap histogram, so we can increment it.
-	 */
-	kd = &Heatmap.zero_kernel;
-	arg = 0;
-	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &Heatmap.histogram);
-	kernel_invoke(kd, 2, NULL, NULL);
-
 	/*
 	 * Data which is cube-like needs to be shrunk down so it fits into
 	 * a unit sphere, since this may be looking at it from any basis.
@@ -190,32 +305,62 @@ heatmap_update(cl_mem data, float min, float max, datavec_shape_t shape,
 	}
 
 	/*
-	 * Generate the heatmap histogram from the data.
+	 * The histogram only needs as many buckets as it has pixels on the
+	 * screen, and about as many data points as it has buckets; any more
+	 * would be lost in the noise.  So when it's small, only look at a
+	 * similarly sized subset of the data.  "density" makes up for any
+	 * difference between the two.
 	 */
-	kd = &Heatmap.histogram_kernel;
-	arg = 0;
-	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
-	kernel_setarg(kd, arg++, sizeof (float), &min);
-	kernel_setarg(kd, arg++, sizeof (float), &max);
-	kernel_setarg(kd, arg++, sizeof (float), &scale);
-	kernel_setarg(kd, arg++, sizeof (cl_datavec), &bases[0]);
-	kernel_setarg(kd, arg++, sizeof (cl_datavec), &bases[1]);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &Heatmap.histogram);
-	kernel_invoke(kd, 2, NULL, NULL);
+	hw = MAX((pix_t)(Width * hmscale), 1);
+	hh = MAX((pix_t)(Height * hmscale), 1);
+	stride = MAX((pix_t)(1.0f / hmscale), 1);
+	density = ((float)hw * hh) /
+	    ((float)(Width / stride) * (Height / stride));
+
+	/*
+	 * The histogram is only regenerated every "interval" frames, and
+	 * redrawn the rest of the time.  It needs to be all zeroes before
+	 * it's regenerated; hm_render() takes care of that on the last frame
+	 * before each regeneration, but if the frame count got reset, it may
+	 * need to be done here.  If the histogram shares its memory, it's
+	 * done here every time, but only for the "hw" x "hh" buckets that
+	 * are about to be used.
+	 */
+	interval = MAX(Heatmap.interval, 1);
+	if (Heatmap.frame % interval == 0) {
+		if (!Heatmap.clean) {
+			const size_t	mapsize = (Heatmap.transient ?
+			    (size_t)hw * hh : (size_t)Width * Height) *
+			    sizeof (int);
+			cl_uint		zero = 0;
+
+			buffer_fill(Heatmap.histogram, mapsize,
+			    &zero, sizeof (zero));
+		}
+		heatmap_histogram(data, min, max, scale, bases,
+		    hw, hh, stride);
+	}
+	clear = ((Heatmap.frame + 1) % interval == 0 && !Heatmap.transient);
+	Heatmap.clean = clear;
+	Heatmap.frame++;
 
 	/*
 	 * Render the histogram into a colored image.
 	 */
 	kd = &Heatmap.render_kernel;
+	global[0] = P2ROUNDUP((size_t)hw, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)hh, kd->kd_maxitems[1]);
+
 	arg = 0;
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &hw);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &hh);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &Heatmap.histogram);
-	kernel_setarg(kd, arg++, sizeof (float), &hmscale);
+	kernel_setarg(kd, arg++, sizeof (float), &density);
+	kernel_setarg(kd, arg++, sizeof (int), &clear);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
-	kernel_invoke(kd, 2, NULL, NULL);
+	kernel_invoke(kd, 2, global, NULL);
 }
 
 #endif	/* DATA_DIMENSIONS > 1 */
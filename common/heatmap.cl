@@ -2,8 +2,9 @@
  * heatmap.cl - computational kernels for generating the heatmap
  * (multi-dimensional histogram).
  *
- * There are three steps to the process: zeroing out the histogram,
- * creating a histogram from the image, and rendering the histogram.
+ * There are two steps to the process: creating a histogram from the image,
+ * and rendering the histogram.  Rendering also zeroes out the histogram
+ * again, once it's going to be regenerated.
  *
  * Datasets that have more than two dimensions need to be projected down
  * into 2-space in order to fit on a computer monitor.  We use other code
@@ -13,43 +14,53 @@
  */
 
 /*
- * Step 1: zero out the heatmap.
+ * A histogram index that doesn't correspond to any bucket.
  */
-__kernel void
-hm_zero(
-	pix_t			W,		/* in */
-	pix_t			H,		/* in */
-	__global unsigned int	*heatmap)	/* out */
-{
-	const pix_t	X = get_global_id(0);
-	const pix_t	Y = get_global_id(1);
-	const pix_t	pix = Y * W + X;
-
-	if (X < W && Y < H) {
-		heatmap[pix] = 0;
-	}
-}
+#define	HM_NOBIN		0xffffffffu
 
 /*
- * Step 2: generate a histogram of "image" into "heatmap", using the vectors
+ * Step 1: generate a histogram of "image" into "heatmap", using the vectors
  * "basis1" and "basis2" as a basis for the 2-space to project onto.
  * "min" and "max" are the minimum and maximum values for this data,
  * and "scale" is a multiplier to be used in case the data isn't sphere-like.
+ *
+ * The histogram is "HW" x "HH" buckets, which is its size on the screen.
+ * When that's smaller than the image, there's no point looking at every
+ * data point, so this only looks at every "stride"th pixel in each
+ * direction, starting at ("xoff", "yoff").  One work item is run for each
+ * of those pixels.
+ *
+ * Smooth data tends to send neighboring pixels to the same bucket, and if
+ * every pixel did its own atomic increment, those would all serialize.  So
+ * each workgroup sorts its members' bucket indices in local memory ("bins"
+ * must have room for one uint per member, and the workgroup size must be a
+ * power of two), and then only the first member of each run of identical
+ * indices touches the heatmap, adding in the length of the whole run.
  */
 __kernel void
 hm_histogram(
 	pix_t			W,		/* in */
 	pix_t			H,		/* in */
+	pix_t			HW,		/* in: histogram width */
+	pix_t			HH,		/* in: histogram height */
+	pix_t			stride,		/* in */
+	pix_t			xoff,		/* in */
+	pix_t			yoff,		/* in */
 	float			min,		/* in */
 	float			max,		/* in */
 	float			scale,		/* in */
 	datavec			basis1,		/* in */
 	datavec			basis2,		/* in */
 	__read_only image2d_t	image,		/* in */
+	__local unsigned int	*bins,		/* local memory, see above */
 	__global unsigned int	*heatmap)	/* out */
 {
-	const pix_t	X = get_global_id(0);
-	const pix_t	Y = get_global_id(1);
+	const pix_t	X = xoff + get_global_id(0) * stride;
+	const pix_t	Y = yoff + get_global_id(1) * stride;
+	const int	lid =
+	    get_local_id(1) * get_local_size(0) + get_local_id(0);
+	const int	lsize = get_local_size(0) * get_local_size(1);
+	unsigned int	idx = HM_NOBIN;
 
 	if (X < W && Y < H) {
 		/*
@@ -75,16 +86,47 @@ hm_histogram(
 		 * The "+1.0f" adds back in the local range min "-1", and
 		 * the  "2.0f" divides by the local range [-1, 1].
 		 */
-		const pix_t	b1 = (pix_t)(((f1 + 1.0f) * W) / 2.0f);
-		const pix_t	b2 = (pix_t)(((f2 + 1.0f) * H) / 2.0f);
-		const pix_t	c1 = clamp(b1, (pix_t)0, W - 1);
-		const pix_t	c2 = clamp(b2, (pix_t)0, H - 1);
-		const pix_t	idx = ((H - 1) - c2) * W + c1;
+		const pix_t	b1 = (pix_t)(((f1 + 1.0f) * HW) / 2.0f);
+		const pix_t	b2 = (pix_t)(((f2 + 1.0f) * HH) / 2.0f);
+		const pix_t	c1 = clamp(b1, (pix_t)0, HW - 1);
+		const pix_t	c2 = clamp(b2, (pix_t)0, HH - 1);
 
-		/*
-		 * Finally, increment that index in the heatmap.
-		 */
-		(void) atomic_add(&heatmap[idx], 1);
+		idx = ((HH - 1) - c2) * HW + c1;
+	}
+
+	/*
+	 * Bitonic sort of the workgroup's indices.
+	 */
+	bins[lid] = idx;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int k = 2; k <= lsize; k <<= 1) {
+		for (int j = k >> 1; j > 0; j >>= 1) {
+			const int	other = lid ^ j;
+
+			if (other > lid) {
+				const unsigned int	a = bins[lid];
+				const unsigned int	b = bins[other];
+
+				if ((a > b) == ((lid & k) == 0)) {
+					bins[lid] = b;
+					bins[other] = a;
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+	}
+
+	/*
+	 * Finally, add each run into the heatmap.
+	 */
+	idx = bins[lid];
+	if (idx != HM_NOBIN && (lid == 0 || bins[lid - 1] != idx)) {
+		int	end = lid + 1;
+
+		while (end < lsize && bins[end] == idx) {
+			end++;
+		}
+		(void) atomic_add(&heatmap[idx], end - lid);
 	}
 }
 
@@ -94,39 +136,49 @@ hm_histogram(
 #define	MAX_SCALE_SHIFT		9
 
 /*
- * Step 3: render the heatmap into a nice image.
+ * Step 2: render the "HW" x "HH" heatmap into a nice image.  It goes in the
+ * lower right-hand corner of the overall image, which it fills unless we're
+ * in "picture in picture" mode.
+ *
+ * Each bucket's count gets multiplied by "density" first, to make up for
+ * any data points that step 1 skipped.  If "clear" is set, each bucket is
+ * zeroed out once it's been read, so the histogram is ready to be
+ * regenerated.
  */
 __kernel void
 hm_render(
 	pix_t			W,		/* in */
 	pix_t			H,		/* in */
-	__global unsigned int	*heatmap,	/* in */
-	float			hmscale,	/* in */
+	pix_t			HW,		/* in: histogram width */
+	pix_t			HH,		/* in: histogram height */
+	__global unsigned int	*heatmap,	/* in/out */
+	float			density,	/* in */
+	int			clear,		/* in */
 	__write_only image2d_t	image)		/* out */
 {
 	const pix_t	X = get_global_id(0);
 	const pix_t	Y = get_global_id(1);
-	const pix_t	pix = Y * W + X;
+	const pix_t	pix = Y * HW + X;
 
-	if (X >= W || Y >= H) {
+	if (X >= HW || Y >= HH) {
 		return;
 	}
 
-	/*
-	 * Figure out where the results should go.  If we're in "picture in
-	 * picture" mode, stick the heatmap in the lower right-hand corner of
-	 * the overall image.
-	 */
-	const int	x = W * (1 - hmscale) + X * hmscale;
-	const int	y = H * (1 - hmscale) + Y * hmscale;
+	const int	x = (W - HW) + X;
+	const int	y = (H - HH) + Y;
+
+	const unsigned int	hits = heatmap[pix];
+	const float		count = (float)hits * density;
+	float			h, s, v;
 
-	const float	count = (float)heatmap[pix];
-	float		h, s, v;
+	if (clear) {
+		heatmap[pix] = 0;
+	}
 
 	/*
 	 * HSV values must be in the range [0, 1].
 	 */
-	if (count < 1) {			/* no hits -> black pixel */
+	if (hits == 0) {			/* no hits -> black pixel */
 		h = 0.0;
 		s = 0.0;
 		v = 0.0;
@@ -135,7 +187,8 @@ hm_render(
 		 * Heat is based on log_2 of the value of this bucket.
 		 */
 		const float	maxscale = (float)MAX_SCALE_SHIFT;
-		const float	heat = min(log2(count) / maxscale, 1.0f);
+		const float	heat =
+		    clamp(log2(count) / maxscale, 0.0f, 1.0f);
 
 		/*
 		 * Transforming the heat into a target hue:
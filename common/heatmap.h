@@ -15,4 +15,17 @@ extern void
 heatmap_update(cl_mem data, float min, float max, datavec_shape_t shape,
     cl_mem image);
 
+/*
+ * Is the heatmap being shown?
+ */
+extern bool
+heatmap_enabled(void);
+
+/*
+ * Only regenerate the heatmap every "interval" images; it's redrawn as is
+ * in between.
+ */
+extern void
+heatmap_set_interval(int interval);
+
 #endif	/* _HEATMAP_H */
@@ -9,6 +9,11 @@
  * be useful as a debugging tool when trying out new algorithms, to see
  * where data is clustering and how it can be tweaked into something that
  * looks interesting.
+ *
+ * The GPU does the counting, for all of the components of the data at once
+ * (see histogram.cl).  Only the counts are read back, asynchronously, so
+ * each histogram is printed a frame or so after the image it describes was
+ * computed.
  */
 #include <strings.h>
 
@@ -19,10 +24,19 @@
 #include "module.h"
 #include "util.h"
 
+#define	HGCOLS	80
+#define	HGROWS	10
+
+#define	HGCOUNTS	(HGCOLS * DATA_DIMENSIONS)
+
 /* ------------------------------------------------------------------ */
 
 static struct {
-	cl_datavec	*cpu_buf;
+	kernel_data_t	kernel;		/* counting kernel */
+	cl_mem		counts;		/* HGCOUNTS counters */
+
+	cl_uint		*cpu_buf[2];	/* memory for readbacks */
+	int		nextbuf;	/* which of cpu_buf[] to use next */
 } Histogram;
 
 /* ------------------------------------------------------------------ */
@@ -31,9 +45,13 @@ static void
 histogram_init(void)
 {
 	if (debug_enabled(DB_HISTO)) {
-		const size_t	arraysize =
-		    (size_t)Width * Height * sizeof (cl_datavec);
-		Histogram.cpu_buf = mem_alloc(arraysize);
+		const size_t	countsize = HGCOUNTS * sizeof (cl_uint);
+
+		kernel_create(&Histogram.kernel, "channel_histogram");
+		Histogram.counts = buffer_alloc(countsize);
+		Histogram.cpu_buf[0] = mem_alloc(countsize);
+		Histogram.cpu_buf[1] = mem_alloc(countsize);
+		Histogram.nextbuf = 0;
 	}
 }
 
@@ -41,7 +59,12 @@ static void
 histogram_fini(void)
 {
 	if (debug_enabled(DB_HISTO)) {
-		mem_free((void **)&Histogram.cpu_buf);
+		readback_wait(Histogram.cpu_buf[0]);
+		readback_wait(Histogram.cpu_buf[1]);
+		mem_free((void **)&Histogram.cpu_buf[0]);
+		mem_free((void **)&Histogram.cpu_buf[1]);
+		buffer_free(&Histogram.counts);
+		kernel_cleanup(&Histogram.kernel);
 	}
 }
 
@@ -69,54 +92,18 @@ const module_ops_t	histogram_ops = {
 
 /* ------------------------------------------------------------------ */
 
-#define	HGCOLS	80
-#define	HGROWS	10
-
 /*
- * Given a data point, figure out which bucket it belongs in.
- *
- * We're examining the "dim" component of the vector, and we're assuming
- * that it has a value between "min" and "max".  There are "nbuck" buckets
- * in the histogram.
+ * Print one histogram, given the count in each of its HGCOLS buckets.
  */
-static int
-bucket(const cl_datavec *datum, int dim, float min, float max, int nbuck)
-{
-	int	b;
-
-	b = (int)(((datum->s[dim] - min) / (max - min)) * (nbuck - 1));
-
-	if (b < 0) {
-		b = 0;
-	} else if (b > nbuck - 1) {
-		b = nbuck - 1;
-	}
-
-	return (b);
-}
-
 static void
-histogram(const char *name,
-    const cl_datavec *data, pix_t width, pix_t height,
-    int dim, float min, float max)
+histogram(const char *name, const cl_uint *buckets)
 {
-	int	buckets[HGCOLS];
 	char	output[HGCOLS + 2], *p;
 	int	b, i;
-	int	maxb;
+	cl_uint	maxb;
 
 	debug(DB_HISTO, "%s:\n", name);
 
-	/*
-	 * This is one of the only O(data) operations that I haven't
-	 * bothered pushing out to the GPU, since this doesn't seem to be
-	 * performance-critical.
-	 */
-	bzero(buckets, sizeof (buckets));
-	for (pix_t p = 0; p < width * height; p++) {
-		b = bucket(&data[p], dim, min, max, HGCOLS);
-		buckets[b]++;
-	}
 	maxb = 0;
 	for (b = 0; b < HGCOLS; b++) {
 		if (buckets[b] > maxb) {
@@ -152,22 +139,57 @@ histogram(const char *name,
 }
 
 /*
- * Generate 1-D text histograms of the data.
+ * Called once the counts have made it back from the GPU.
  */
-void
-histogram_display(cl_mem buf, float min, float max)
+static void
+histogram_readback(void *buf, void *arg)
 {
+	const cl_uint	*const	counts = buf;
+
 	if (!debug_enabled(DB_HISTO)) {
 		return;
 	}
 
-	ocl_image_readfromgpu(buf, Histogram.cpu_buf, Width, Height);
-
 	for (int ch = 0; ch < DATA_DIMENSIONS; ch++) {
 		char	name[2] = { "xyzw"[ch], '\0' };
 
-		histogram(name, Histogram.cpu_buf, Width, Height, ch, min, max);
+		histogram(name, &counts[ch * HGCOLS]);
 	}
 
 	debug(DB_HISTO, "\n");
 }
+
+/*
+ * Generate 1-D text histograms of the data.
+ */
+void
+histogram_display(cl_mem buf, float min, float max)
+{
+	kernel_data_t	*const	kd = &Histogram.kernel;
+	const size_t		countsize = HGCOUNTS * sizeof (cl_uint);
+	int			nbuck = HGCOLS;
+	cl_uint			zero = 0;
+	int			arg;
+
+	if (!debug_enabled(DB_HISTO)) {
+		return;
+	}
+
+	buffer_fill(Histogram.counts, countsize, &zero, sizeof (zero));
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &min);
+	kernel_setarg(kd, arg++, sizeof (float), &max);
+	kernel_setarg(kd, arg++, sizeof (int), &nbuck);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &buf);
+	kernel_setarg(kd, arg++, countsize, NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Histogram.counts);
+	kernel_invoke(kd, 2, NULL, NULL);
+
+	buffer_readfromgpu_async(Histogram.counts,
+	    Histogram.cpu_buf[Histogram.nextbuf], countsize,
+	    histogram_readback, NULL);
+	Histogram.nextbuf = 1 - Histogram.nextbuf;
+}
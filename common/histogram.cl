@@ -0,0 +1,58 @@
+/*
+ * histogram.cl - computational kernel for the text histograms in
+ * histogram.c.
+ */
+
+/*
+ * Count how many data points fall into each of "nbuck" buckets, for every
+ * component of the datavec at once.  The counts for component "d" go into
+ * counts[d * nbuck] through counts[(d + 1) * nbuck - 1], which must start
+ * out zeroed.
+ *
+ * Each workgroup counts into a copy of all of the buckets in local memory
+ * ("bins" must have room for nbuck * DATA_DIMENSIONS uints), and then adds
+ * that copy into "counts", so only one global atomic per bucket per
+ * workgroup is needed.
+ */
+__kernel void
+channel_histogram(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	float			min,		/* in */
+	float			max,		/* in */
+	int			nbuck,		/* in */
+	__read_only image2d_t	data,		/* in */
+	__local unsigned int	*bins,		/* local memory, see above */
+	__global unsigned int	*counts)	/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const int	lid =
+	    get_local_id(1) * get_local_size(0) + get_local_id(0);
+	const int	lsize = get_local_size(0) * get_local_size(1);
+	const int	nbins = nbuck * DATA_DIMENSIONS;
+
+	for (int i = lid; i < nbins; i += lsize) {
+		bins[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (X < W && Y < H) {
+		const datavec	d = as_datavec(read_imagef(data, (int2)(X, Y)));
+		const datavec	s = ((d - min) / (max - min)) * (nbuck - 1);
+		const float	*const	c = (const float *)&s;
+
+		for (int dim = 0; dim < DATA_DIMENSIONS; dim++) {
+			const int	b = clamp((int)c[dim], 0, nbuck - 1);
+
+			(void) atomic_inc(&bins[dim * nbuck + b]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < nbins; i += lsize) {
+		if (bins[i] != 0) {
+			(void) atomic_add(&counts[i], bins[i]);
+		}
+	}
+}
@@ -6,22 +6,44 @@
  * from other formats; image_copy() and its callbacks enable that.
  */
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <strings.h>
+#include <unistd.h>
 
 #include "common.h"
 
 #include "camera.h"
 #include "debug.h"
+#include "explore.h"
 #include "image.h"
 #include "keyboard.h"
 #include "module.h"
 #include "opencl.h"
 #include "ppm.h"
 #include "randbj.h"
+#include "session.h"
 #include "template.h"
 #include "util.h"
 #include "window.h"
 
+/*
+ * The row converters below have SIMD versions for SSSE3 (picked at run
+ * time, since it isn't part of the baseline x86-64 instruction set) and
+ * NEON (which is always there on 64-bit ARM).  The run-time check has to be
+ * made outside of the SSSE3_FN functions, which the compiler is free to
+ * fill with SSSE3 instructions from the start.
+ */
+#if	defined(__x86_64__) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define	IMAGE_SSSE3
+#define	SSSE3_FN	__attribute__((target("ssse3")))
+#elif	defined(__ARM_NEON)
+#include <arm_neon.h>
+#define	IMAGE_NEON
+#endif
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -30,6 +52,36 @@
  */
 #define	IMAGE_BPP		(4 * sizeof (char))
 
+/*
+ * Saved images are read back into one of these many pinned buffers, and
+ * written out by a thread of their own.  If they're all in use, image_save()
+ * waits up to SAVE_MAXWAIT_MS for one to come free before giving up on the
+ * image it was asked to save.
+ */
+#define	SAVE_NBUFS		4
+#define	SAVE_MAXWAIT_MS		50
+
+/*
+ * image_copy() splits images of at least IMAGE_COPY_MINPIX pixels across
+ * up to IMAGE_COPY_MAXTHREADS threads, by rows.
+ */
+#define	IMAGE_COPY_MINPIX	(1 << 18)
+#define	IMAGE_COPY_MAXTHREADS	8
+
+typedef enum {
+	SAVE_FREE = 0,		/* available for image_save() */
+	SAVE_READING,		/* being read back from the GPU */
+	SAVE_QUEUED,		/* waiting for the save thread */
+	SAVE_WRITING		/* being written out by the save thread */
+} savestate_t;
+
+typedef struct {
+	savestate_t	ss_state;
+	uint8_t		*ss_rgba;		/* from host_alloc() */
+	int		ss_steps;		/* for ordering the writes */
+	char		ss_filename[PATH_MAX];
+} saveslot_t;
+
 typedef enum {
 	LOAD_NONE = 0,
 	LOAD_DATAFILE,
@@ -52,6 +104,30 @@ static struct {
 	uint8_t		*old_rgba;
 	pix_t		old_width;
 	pix_t		old_height;
+
+	/*
+	 * One frame's worth of RGBA data, for moving images to and from
+	 * the GPU.  This is allocated from host_alloc() the first time
+	 * it's needed (see image_staging()), and freed when the window is
+	 * resized.
+	 */
+	uint8_t		*rgba;
+
+	kernel_data_t	expand_kernel;	/* see image_expand() */
+	kernel_data_t	resample_kernel; /* see image_resample() */
+	kernel_data_t	random_kernel;	/* see image_random() */
+
+	/*
+	 * The save queue.  The lock protects the slots' states and
+	 * save_quit; the save thread waits on save_cond for work.
+	 */
+	saveslot_t	saves[SAVE_NBUFS];	/* ss_rgba's made on demand */
+	uint8_t		*save_rgb;	/* the save thread's RGB image */
+	pthread_t	save_thread;
+	pthread_mutex_t	save_lock;
+	pthread_cond_t	save_cond;
+	bool		save_quit;
+	int		save_dropped;	/* images not saved, for warnings */
 } Image;
 
 /* ------------------------------------------------------------------ */
@@ -65,15 +141,15 @@ image_datafile(char *file)
 	window_update();
 }
 
-static void
-set_loadstate_camera(void)
+void
+image_load_camera(void)
 {
 	Image.loadstate = LOAD_CAMERA;
 	window_update();
 }
 
-static void
-set_loadstate_random(void)
+void
+image_load_random(void)
 {
 	Image.loadstate = LOAD_RANDOM;
 	window_update();
@@ -87,19 +163,90 @@ image_preinit(void)
 	}
 
 	key_register('c', KB_DEFAULT, "initialize data using camera",
-	    set_loadstate_camera);
+	    image_load_camera);
 	key_register('r', KB_DEFAULT, "fill with random data",
-	    set_loadstate_random);
+	    image_load_random);
 	key_register('0', KB_KEYPAD, "initialize data using camera",
-	    set_loadstate_camera);
+	    image_load_camera);
 	key_register('3', KB_KEYPAD, "fill with random data",
-	    set_loadstate_random);
+	    image_load_random);
 
 	debug_register_toggle('I', "image I/O", DB_IMAGE, NULL);
 }
 
+static void *image_save_thread(void *);
+
+static void
+image_init(void)
+{
+	kernel_create(&Image.expand_kernel, "image_expand");
+	kernel_create(&Image.resample_kernel, "image_resample");
+	kernel_create(&Image.random_kernel, "image_random");
+
+	for (int s = 0; s < SAVE_NBUFS; s++) {
+		Image.saves[s].ss_state = SAVE_FREE;
+	}
+	Image.save_quit = false;
+	pthread_mutex_init(&Image.save_lock, NULL);
+	pthread_cond_init(&Image.save_cond, NULL);
+	if (pthread_create(&Image.save_thread, NULL,
+	    image_save_thread, NULL) != 0) {
+		die("Failed to create image save thread\n");
+	}
+}
+
+static void
+image_fini(void)
+{
+	if (pthread_equal(pthread_self(), Image.save_thread)) {
+		return;		/* it's the one that's exiting */
+	}
+
+	/*
+	 * Every image that's been handed to image_save() gets written out
+	 * before the save thread goes away.
+	 */
+	for (int s = 0; s < SAVE_NBUFS; s++) {
+		if (Image.saves[s].ss_rgba != NULL) {
+			readback_wait(Image.saves[s].ss_rgba);
+		}
+	}
+	pthread_mutex_lock(&Image.save_lock);
+	Image.save_quit = true;
+	pthread_cond_signal(&Image.save_cond);
+	pthread_mutex_unlock(&Image.save_lock);
+	(void) pthread_join(Image.save_thread, NULL);
+	pthread_cond_destroy(&Image.save_cond);
+	pthread_mutex_destroy(&Image.save_lock);
+
+	mem_free((void **)&Image.save_rgb);
+	for (int s = 0; s < SAVE_NBUFS; s++) {
+		host_free((void **)&Image.saves[s].ss_rgba);
+	}
+	kernel_cleanup(&Image.expand_kernel);
+	kernel_cleanup(&Image.resample_kernel);
+	kernel_cleanup(&Image.random_kernel);
+	host_free((void **)&Image.rgba);
+}
+
+/*
+ * The RGBA staging frame, for the sources that are built up on the CPU.
+ * Most runs never load one, so it isn't allocated until they do.
+ */
+static uint8_t *
+image_staging(void)
+{
+	if (Image.rgba == NULL) {
+		Image.rgba = host_alloc((size_t)Width * Height * IMAGE_BPP);
+	}
+
+	return (Image.rgba);
+}
+
 const module_ops_t	image_ops = {
-	image_preinit
+	image_preinit,
+	image_init,
+	image_fini
 };
 
 /* ------------------------------------------------------------------ */
@@ -136,37 +283,73 @@ image_preserve(pix_t width, pix_t height, cl_mem image)
 }
 
 /*
- * No translation needed here.  We just use this to take advantage of
- * image_copy()'s ability to handle image resizing.
+ * Upload an "ow" x "oh" image of packed RGB ("bpp" 3) or RGBA ("bpp" 4)
+ * pixels to the GPU as it is, and let the image_expand kernel convert it
+ * and center it in "image".  That's one copy, rather than a pass over
+ * every pixel on the CPU followed by a copy.
  */
 static void
-rgba_to_rgba(const uint8_t *oi, uint8_t *ni, pix_t op, pix_t np)
+image_expand(pix_t ow, pix_t oh, const uint8_t *oi, int bpp, cl_mem image)
+{
+	kernel_data_t	*const	kd = &Image.expand_kernel;
+	const size_t		size = (size_t)ow * oh * bpp;
+	cl_mem			buf;
+	size_t			global[2];
+	int			arg;
+
+	buf = buffer_alloc(size);
+	buffer_writetogpu(oi, buf, size);
+
+	global[0] = P2ROUNDUP((size_t)Width, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)Height, kd->kd_maxitems[1]);
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &ow);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &oh);
+	kernel_setarg(kd, arg++, sizeof (int), &bpp);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &buf);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
+	kernel_invoke(kd, 2, global, NULL);
+
+	/*
+	 * The kernel is queued up ahead of anything that could reuse this.
+	 */
+	buffer_free(&buf);
+}
+
+void
+image_resample(cl_mem src, cl_mem dst)
 {
-	ni[IMAGE_BPP * np + 0] = oi[IMAGE_BPP * op + 0];
-	ni[IMAGE_BPP * np + 1] = oi[IMAGE_BPP * op + 1];
-	ni[IMAGE_BPP * np + 2] = oi[IMAGE_BPP * op + 2];
-	ni[IMAGE_BPP * np + 3] = oi[IMAGE_BPP * op + 3];
+	kernel_data_t	*const	kd = &Image.resample_kernel;
+	size_t			global[2];
+	int			arg;
+
+	global[0] = P2ROUNDUP((size_t)Width, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)Height, kd->kd_maxitems[1]);
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &src);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &dst);
+	kernel_invoke(kd, 2, global, NULL);
 }
 
 /*
- * Load a previously preserved image.
+ * Load a previously preserved image.  Width and Height may have changed
+ * compared to the old image; image_expand() takes care of that.
  */
 static bool
-load_oldimage_cb(pix_t width, pix_t height, uint8_t *rgba)
+load_oldimage(cl_mem image)
 {
 	assert(Image.old_rgba != NULL);
 
 	verbose(DB_IMAGE, "Loading a previously rendered image\n");
 
-	/*
-	 * Width and Height may have changed compared to the old image,
-	 * in which case image_copy() won't touch all parts of the new
-	 * image.
-	 */
-	bzero(rgba, width * height * IMAGE_BPP);
-
-	image_copy(Image.old_width, Image.old_height, Image.old_rgba,
-	    width, height, rgba, rgba_to_rgba);
+	image_expand(Image.old_width, Image.old_height, Image.old_rgba,
+	    IMAGE_BPP, image);
 
 	mem_free((void **)&Image.old_rgba);
 	Image.old_width = Image.old_height = 0;
@@ -175,30 +358,19 @@ load_oldimage_cb(pix_t width, pix_t height, uint8_t *rgba)
 }
 
 /*
- * Convert from three-bytes-per-pixel data, such as what comes from a PPM
- * file, to four-bytes-per-pixel RGBA data.
- */
-static void
-rgb_to_rgba(const uint8_t *rgb, uint8_t *rgba, pix_t op, pix_t np)
-{
-	rgba[4 * np + 0] = rgb[3 * op + 0];
-	rgba[4 * np + 1] = rgb[3 * op + 1];
-	rgba[4 * np + 2] = rgb[3 * op + 2];
-	rgba[4 * np + 3] = 0;
-}
-
-/*
- * Load from a PPM file.
+ * Load from a PPM file.  The file is mapped rather than read, and its
+ * three-bytes-per-pixel data goes to the GPU untouched.
  *
  * We only support raw files (with header "P6"), and not all-text PPM files
  * (with header "P3").
  */
 static bool
-load_file_cb(pix_t width, pix_t height, uint8_t *rgba)
+load_file(cl_mem image)
 {
-	bool		rv;
+	const uint8_t	*rgb;
+	ppm_map_t	map;
 	pix_t		iw, ih;
-	uint8_t		*rgb;
+	bool		rv;
 
 	assert(Image.datafile != NULL);
 
@@ -206,33 +378,126 @@ load_file_cb(pix_t width, pix_t height, uint8_t *rgba)
 
 	rv = ppm_read_sizes(Image.datafile, &iw, &ih);
 	if (rv) {
-		rgb = mem_alloc(iw * ih * 3 * sizeof (uint8_t));
-		rv = ppm_read_rgb(Image.datafile, iw, ih, rgb);
+		rgb = ppm_map_rgb(Image.datafile, iw, ih, &map);
+		rv = (rgb != NULL);
 		if (rv) {
-			image_copy(iw, ih, rgb, width, height, rgba,
-			    rgb_to_rgba);
+			image_expand(iw, ih, rgb, 3, image);
+			ppm_unmap(&map);
 		}
-		mem_free((void **)&rgb);
 	}
 
 	Image.datafile = NULL;
 	return (rv);
 }
 
+#if	defined(IMAGE_SSSE3)
+/*
+ * Four pixels at a time.  Each 16-byte load reads four bytes past the
+ * pixels it converts, so this stops two pixels short of the end.
+ */
+static SSSE3_FN pix_t
+bgr_to_rgba_ssse3(const uint8_t *bgr, uint8_t *rgba, pix_t n)
+{
+	const __m128i	shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+			    8, 7, 6, -1, 11, 10, 9, -1);
+	pix_t		i;
+
+	for (i = 0; i + 6 <= n; i += 4) {
+		const __m128i	v =
+		    _mm_loadu_si128((const __m128i *)&bgr[3 * i]);
+
+		_mm_storeu_si128((__m128i *)&rgba[4 * i],
+		    _mm_shuffle_epi8(v, shuf));
+	}
+	return (i);
+}
+
+static pix_t
+bgr_to_rgba_simd(const uint8_t *bgr, uint8_t *rgba, pix_t n)
+{
+	if (!__builtin_cpu_supports("ssse3")) {
+		return (0);
+	}
+	return (bgr_to_rgba_ssse3(bgr, rgba, n));
+}
+#elif	defined(IMAGE_NEON)
+static pix_t
+bgr_to_rgba_simd(const uint8_t *bgr, uint8_t *rgba, pix_t n)
+{
+	pix_t		i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const uint8x16x3_t	v = vld3q_u8(&bgr[3 * i]);
+		uint8x16x4_t		o;
+
+		o.val[0] = v.val[2];
+		o.val[1] = v.val[1];
+		o.val[2] = v.val[0];
+		o.val[3] = vdupq_n_u8(0);
+		vst4q_u8(&rgba[4 * i], o);
+	}
+	return (i);
+}
+#else
+static pix_t
+bgr_to_rgba_simd(const uint8_t *bgr, uint8_t *rgba, pix_t n)
+{
+	return (0);
+}
+#endif
+
 /*
  * Apparently it's common for webcam-like things to return their results
  * in BGR order rather than RGB.  Thankfully, image_copy() makes it
  * pretty easy to handle that.
  */
 static void
-bgr_to_rgba(const uint8_t *bgr, uint8_t *rgba, pix_t op, pix_t np)
+bgr_to_rgba(const uint8_t *orow, pix_t ox, uint8_t *rgba, pix_t n)
 {
-	rgba[4 * np + 0] = bgr[3 * op + 2];
-	rgba[4 * np + 1] = bgr[3 * op + 1];
-	rgba[4 * np + 2] = bgr[3 * op + 0];
-	rgba[4 * np + 3] = 0;
+	const uint8_t	*const	bgr = &orow[3 * ox];
+
+	for (pix_t i = bgr_to_rgba_simd(bgr, rgba, n); i < n; i++) {
+		rgba[4 * i + 0] = bgr[3 * i + 2];
+		rgba[4 * i + 1] = bgr[3 * i + 1];
+		rgba[4 * i + 2] = bgr[3 * i + 0];
+		rgba[4 * i + 3] = 0;
+	}
 }
 
+static const image_conv_t	Bgr_to_rgba = { 3, 4, bgr_to_rgba };
+
+static uint8_t
+yuv_clamp(float v)
+{
+	return ((uint8_t)(v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v)));
+}
+
+/*
+ * Other cameras return YUYV: each pair of pixels gets a luma value of its
+ * own, and shares a pair of chroma values with its neighbor.  (The same
+ * conversion is done on the GPU by camera_yuyv(), in camdelta.cl.)  A row
+ * can start halfway through a pair, so this works from pixel indices
+ * rather than a byte pointer.
+ */
+static void
+yuyv_to_rgba(const uint8_t *yuyv, pix_t ox, uint8_t *rgba, pix_t n)
+{
+	for (pix_t i = 0; i < n; i++) {
+		const pix_t		op = ox + i;
+		const uint8_t	*const	pair = &yuyv[4 * (op / 2)];
+		const float		y = pair[(op % 2) * 2];
+		const float		u = (float)pair[1] - 128.0f;
+		const float		v = (float)pair[3] - 128.0f;
+
+		rgba[4 * i + 0] = yuv_clamp(y + 1.402f * v);
+		rgba[4 * i + 1] = yuv_clamp(y - 0.344136f * u - 0.714136f * v);
+		rgba[4 * i + 2] = yuv_clamp(y + 1.772f * u);
+		rgba[4 * i + 3] = 0;
+	}
+}
+
+static const image_conv_t	Yuyv_to_rgba = { 2, 4, yuyv_to_rgba };
+
 /*
  * Load an image from the camera.
  */
@@ -240,7 +505,7 @@ static bool
 load_camera_cb(pix_t width, pix_t height, uint8_t *rgba)
 {
 	const bool	inited = camera_initialized();
-	uint8_t		*bgr;
+	uint8_t		*frame;
 	bool		rv;
 
 	if (!inited && !camera_init()) {
@@ -249,37 +514,82 @@ load_camera_cb(pix_t width, pix_t height, uint8_t *rgba)
 
 	verbose(DB_IMAGE, "Loading image from camera\n");
 
-	if (!camera_grab()) {
-		return (false);
-	}
-
-	bgr = camera_retrieve();
-	if (bgr != NULL) {
+	/*
+	 * camdelta.c may be capturing frames on a thread of its own, so
+	 * this has to go through camera_capture().
+	 */
+	frame = mem_alloc(camera_framesize());
+	rv = camera_capture(frame);
+	if (rv) {
 		bzero(rgba, width * height * 4 * sizeof (char));
-		image_copy(camera_width(), camera_height(), bgr,
-		    width, height, rgba, bgr_to_rgba);
+		image_copy(camera_width(), camera_height(), frame,
+		    width, height, rgba,
+		    (camera_format() == CAMERA_YUYV) ?
+		    &Yuyv_to_rgba : &Bgr_to_rgba);
 	}
+	mem_free((void **)&frame);
 
 	if (!inited) {
 		camera_fini();
 	}
-	return (bgr != NULL);
+	return (rv);
 }
 
 /*
- * Get random noise.
+ * Random data is made on the GPU, straight into the core's datavec image,
+ * so it doesn't have to be built up on the CPU, uploaded, and unrendered.
+ * Each instance takes one number from the random number generator as the
+ * key for its noise; in exploration mode, each instance gets its key from
+ * its own seed, so that it can be reproduced by itself.
  */
-static bool
-load_random_cb(pix_t width, pix_t height, uint8_t *rgba)
+bool
+image_random(cl_mem data, float min, float max, datavec_shape_t shape)
 {
+	kernel_data_t	*const	kd = &Image.random_kernel;
+	const int		n = explore_count();
+	pix_t			T = explore_tile();
+	int			sphere = (shape == DATAVEC_SHAPE_SPHERE);
+	cl_uint			keys[EXPLORE_MAX];
+	cl_mem			buf;
+	size_t			global[2];
+	int			arg;
+
+	if (Image.loadstate != LOAD_RANDOM) {
+		return (false);
+	}
+	Image.loadstate = LOAD_NONE;
+	session_image("random", NULL);
+
 	verbose(DB_IMAGE, "Loading random data\n");
 
-	for (pix_t p = 0; p < width * height; p++) {
-		rgba[IMAGE_BPP * p + 0] = drandbj() * 255.0;
-		rgba[IMAGE_BPP * p + 1] = drandbj() * 255.0;
-		rgba[IMAGE_BPP * p + 2] = drandbj() * 255.0;
-		rgba[IMAGE_BPP * p + 3] = drandbj() * 255.0;
+	for (int i = 0; i < n; i++) {
+		if (T != 0) {
+			srandbj(explore_seed(i));
+		}
+		keys[i] = (cl_uint)lrandbj();
 	}
+	buf = buffer_alloc(n * sizeof (cl_uint));
+	buffer_writetogpu(keys, buf, n * sizeof (cl_uint));
+
+	global[0] = P2ROUNDUP((size_t)Width, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)Height, kd->kd_maxitems[1]);
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &T);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &buf);
+	kernel_setarg(kd, arg++, sizeof (float), &min);
+	kernel_setarg(kd, arg++, sizeof (float), &max);
+	kernel_setarg(kd, arg++, sizeof (int), &sphere);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
+	kernel_invoke(kd, 2, global, NULL);
+
+	/*
+	 * As in image_expand(), the kernel is queued up ahead of anything
+	 * that could reuse this.
+	 */
+	buffer_free(&buf);
 
 	return (true);
 }
@@ -291,7 +601,6 @@ load_random_cb(pix_t width, pix_t height, uint8_t *rgba)
 bool
 image_available(cl_mem image)
 {
-	const size_t	rgba_size = (size_t)Width * Height * IMAGE_BPP;
 	bool		(*cb)(pix_t, pix_t, uint8_t *);
 	uint8_t		*rgba;
 	bool		rv;
@@ -301,53 +610,224 @@ image_available(cl_mem image)
 		return (false);		/* nothing to do */
 		break;
 	case LOAD_DATAFILE:
-		cb = load_file_cb;
+		session_image("file", Image.datafile);
+		cb = NULL;
+		rv = load_file(image);
 		break;
 	case LOAD_CAMERA:
+		session_image("camera", NULL);
 		cb = load_camera_cb;
 		break;
 	case LOAD_RANDOM:
-		cb = load_random_cb;
+		return (false);		/* see image_random() */
 		break;
 	case LOAD_OLDIMAGE:
-		cb = load_oldimage_cb;
+		cb = NULL;
+		rv = load_oldimage(image);
 		break;
 	default:
 		assert(0 && "bad load state");
 		break;
 	}
 
-	rgba = mem_alloc(rgba_size);
-	rv = (*cb)(Width, Height, rgba);
-	if (rv) {
-		ocl_image_writetogpu(rgba, image, Width, Height);
+	/*
+	 * The other sources are built up on the CPU, in RGBA form.
+	 */
+	if (cb != NULL) {
+		rgba = image_staging();
+		rv = (*cb)(Width, Height, rgba);
+		if (rv) {
+			ocl_image_writetogpu(rgba, image, Width, Height);
+		}
 	}
-	mem_free((void **)&rgba);
 
 	Image.loadstate = LOAD_NONE;
 	return (rv);
 }
 
+#if	defined(IMAGE_SSSE3)
+/*
+ * Four pixels at a time.  Each 16-byte store writes four bytes past the
+ * pixels it converts, so this stops two pixels short of the end.
+ */
+static SSSE3_FN pix_t
+rgba_to_rgb_ssse3(const uint8_t *rgba, uint8_t *rgb, pix_t n)
+{
+	const __m128i	shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+			    10, 12, 13, 14, -1, -1, -1, -1);
+	pix_t		i;
+
+	for (i = 0; i + 6 <= n; i += 4) {
+		const __m128i	v =
+		    _mm_loadu_si128((const __m128i *)&rgba[4 * i]);
+
+		_mm_storeu_si128((__m128i *)&rgb[3 * i],
+		    _mm_shuffle_epi8(v, shuf));
+	}
+	return (i);
+}
+
+static pix_t
+rgba_to_rgb_simd(const uint8_t *rgba, uint8_t *rgb, pix_t n)
+{
+	if (!__builtin_cpu_supports("ssse3")) {
+		return (0);
+	}
+	return (rgba_to_rgb_ssse3(rgba, rgb, n));
+}
+#elif	defined(IMAGE_NEON)
+static pix_t
+rgba_to_rgb_simd(const uint8_t *rgba, uint8_t *rgb, pix_t n)
+{
+	pix_t		i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const uint8x16x4_t	v = vld4q_u8(&rgba[4 * i]);
+		uint8x16x3_t		o;
+
+		o.val[0] = v.val[0];
+		o.val[1] = v.val[1];
+		o.val[2] = v.val[2];
+		vst3q_u8(&rgb[3 * i], o);
+	}
+	return (i);
+}
+#else
+static pix_t
+rgba_to_rgb_simd(const uint8_t *rgba, uint8_t *rgb, pix_t n)
+{
+	return (0);
+}
+#endif
+
 /*
  * Data written to a PPM file is only three bytes per pixel; this
  * discards the fourth byte.
  */
 static void
-rgba_to_rgb(const uint8_t *rgba, uint8_t *rgb, pix_t op, pix_t np)
+rgba_to_rgb(const uint8_t *orow, pix_t ox, uint8_t *rgb, pix_t n)
 {
-	rgb[3 * np + 0] = rgba[4 * op + 0];
-	rgb[3 * np + 1] = rgba[4 * op + 1];
-	rgb[3 * np + 2] = rgba[4 * op + 2];
+	const uint8_t	*const	rgba = &orow[4 * ox];
+
+	for (pix_t i = rgba_to_rgb_simd(rgba, rgb, n); i < n; i++) {
+		rgb[3 * i + 0] = rgba[4 * i + 0];
+		rgb[3 * i + 1] = rgba[4 * i + 1];
+		rgb[3 * i + 2] = rgba[4 * i + 2];
+	}
+}
+
+static const image_conv_t	Rgba_to_rgb = { 4, 3, rgba_to_rgb };
+
+/*
+ * The save thread.  This writes out queued images oldest first, and exits
+ * once it's been told to and there's nothing left to write.
+ */
+static void *
+image_save_thread(void *arg)
+{
+	pthread_mutex_lock(&Image.save_lock);
+	for (;;) {
+		saveslot_t	*ss = NULL;
+
+		for (int s = 0; s < SAVE_NBUFS; s++) {
+			saveslot_t	*const	cand = &Image.saves[s];
+
+			if (cand->ss_state == SAVE_QUEUED &&
+			    (ss == NULL || cand->ss_steps < ss->ss_steps)) {
+				ss = cand;
+			}
+		}
+		if (ss == NULL) {
+			if (Image.save_quit) {
+				break;
+			}
+			pthread_cond_wait(&Image.save_cond, &Image.save_lock);
+			continue;
+		}
+		ss->ss_state = SAVE_WRITING;
+		pthread_mutex_unlock(&Image.save_lock);
+
+		if (Image.save_rgb == NULL) {
+			Image.save_rgb = mem_alloc((size_t)Width * Height * 3);
+		}
+		image_copy(Width, Height, ss->ss_rgba, Width, Height,
+		    Image.save_rgb, &Rgba_to_rgb);
+		ppm_write_rgb(ss->ss_filename, Image.save_rgb, Width, Height);
+		verbose(DB_IMAGE, "Saved image %05d\n", ss->ss_steps);
+
+		pthread_mutex_lock(&Image.save_lock);
+		ss->ss_state = SAVE_FREE;
+	}
+	pthread_mutex_unlock(&Image.save_lock);
+
+	return (NULL);
+}
+
+/*
+ * Called once an image has been read back from the GPU.
+ */
+static void
+image_save_cb(void *hostdst, void *arg)
+{
+	saveslot_t	*const	ss = arg;
+
+	pthread_mutex_lock(&Image.save_lock);
+	assert(ss->ss_state == SAVE_READING);
+	ss->ss_state = SAVE_QUEUED;
+	pthread_cond_signal(&Image.save_cond);
+	pthread_mutex_unlock(&Image.save_lock);
+}
+
+/*
+ * Find a slot for a new image, giving the save thread a little while to
+ * catch up if they're all busy.
+ */
+static saveslot_t *
+image_save_slot(void)
+{
+	for (int ms = 0; ms <= SAVE_MAXWAIT_MS; ms++) {
+		saveslot_t	*ss = NULL;
+
+		pthread_mutex_lock(&Image.save_lock);
+		for (int s = 0; s < SAVE_NBUFS; s++) {
+			if (Image.saves[s].ss_state == SAVE_FREE) {
+				ss = &Image.saves[s];
+				ss->ss_state = SAVE_READING;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&Image.save_lock);
+
+		if (ss != NULL) {
+			return (ss);
+		}
+
+		readback_poll();	/* a slot may be waiting on this */
+		usleep(1000);
+	}
+
+	return (NULL);
 }
 
 void
 image_save(cl_mem image, int steps)
 {
-	const size_t	rgba_size = (size_t)Width * Height * IMAGE_BPP;
-	const size_t	rgb_size =
-	    (size_t)Width * Height * 3 * sizeof (uint8_t);
-	uint8_t		*rgba, *rgb;
-	const char	*filename;
+	saveslot_t	*ss;
+
+	ss = image_save_slot();
+	if (ss == NULL) {
+		/*
+		 * The disk isn't keeping up.  Rather than stall the
+		 * simulation indefinitely, this image is skipped.
+		 */
+		if (Image.save_dropped++ == 0) {
+			warn("Image saves are falling behind; "
+			    "skipping image %05d\n", steps);
+		}
+		verbose(DB_IMAGE, "Skipped image %05d (%d so far)\n",
+		    steps, Image.save_dropped);
+		return;
+	}
 
 	/*
 	 * Get a useful filename, based on the number of images rendered
@@ -356,19 +836,69 @@ image_save(cl_mem image, int steps)
 	if (Image.template == NULL) {
 		Image.template = template_alloc("images");
 	}
-	filename = template_name(Image.template, NULL, steps);
+	(void) snprintf(ss->ss_filename, sizeof (ss->ss_filename), "%s",
+	    template_name(Image.template, NULL, steps));
+	ss->ss_steps = steps;
 
-	rgba = mem_alloc(rgba_size);
-	rgb = mem_alloc(rgb_size);
+	if (ss->ss_rgba == NULL) {
+		ss->ss_rgba = host_alloc((size_t)Width * Height * IMAGE_BPP);
+	}
+	ocl_image_readfromgpu_async(image, ss->ss_rgba, Width, Height,
+	    image_save_cb, ss);
+}
+
+/*
+ * Write out an image right away.  This reads back into the staging frame,
+ * which the GPU can get to directly, rather than into a new allocation.
+ */
+void
+image_write(cl_mem image, const char *path)
+{
+	uint8_t		*const	rgba = image_staging();
+	uint8_t		*rgb = mem_alloc((size_t)Width * Height * 3);
 
 	ocl_image_readfromgpu(image, rgba, Width, Height);
-	image_copy(Width, Height, rgba, Width, Height, rgb, rgba_to_rgb);
-	ppm_write_rgb(filename, rgb, Width, Height);
+	image_copy(Width, Height, rgba, Width, Height, rgb, &Rgba_to_rgb);
+	ppm_write_rgb(path, rgb, Width, Height);
 
 	mem_free((void **)&rgb);
-	mem_free((void **)&rgba);
+}
 
-	verbose(DB_IMAGE, "Saved image %05d\n", steps);
+/*
+ * One thread's share of an image_copy().
+ */
+typedef struct {
+	const image_conv_t	*ir_conv;
+	const uint8_t		*ir_oi;
+	uint8_t			*ir_ni;
+	pix_t			ir_ow;		/* old image width */
+	pix_t			ir_nw;		/* new image width */
+	pix_t			ir_odx;		/* first old pixel in a row */
+	pix_t			ir_ndx;		/* first new pixel in a row */
+	pix_t			ir_ody;		/* first old row */
+	pix_t			ir_ndy;		/* first new row */
+	pix_t			ir_w;		/* pixels per row */
+	pix_t			ir_y0;		/* rows to copy */
+	pix_t			ir_y1;
+} image_rows_t;
+
+static void *
+image_copy_rows(void *arg)
+{
+	const image_rows_t	*const	ir = arg;
+	const image_conv_t	*const	conv = ir->ir_conv;
+
+	for (pix_t y = ir->ir_y0; y < ir->ir_y1; y++) {
+		const uint8_t	*const	orow = ir->ir_oi +
+		    (size_t)(y + ir->ir_ody) * ir->ir_ow * conv->ic_obpp;
+		uint8_t		*const	npix = ir->ir_ni +
+		    ((size_t)(y + ir->ir_ndy) * ir->ir_nw + ir->ir_ndx) *
+		    conv->ic_nbpp;
+
+		(*conv->ic_row)(orow, ir->ir_odx, npix, ir->ir_w);
+	}
+
+	return (NULL);
 }
 
 /*
@@ -377,8 +907,9 @@ image_save(cl_mem image, int steps)
  * This takes an old image ("oi"), with size "ow" x "oh", and copies what
  * parts of it that it can into a new image ("ni"), with size "nw" x "nh".
  * The images are arrays of uint8_t's, and the specified sizes are in
- * pixels (not bytes).  The copy callback function "copy_cb" is called for
- * every pixel of the old image that has a place in the new image.
+ * pixels (not bytes).  The converter "conv" is called for each row of the
+ * old image that has a place in the new image, with the span of that row
+ * that fits.  Large images are split up by rows across several threads.
  *
  * This does not rescale the old image to fit in the new one.  It truncates
  * and pads along the horizontal and/or vertical axes as needed.  It
@@ -386,8 +917,7 @@ image_save(cl_mem image, int steps)
  */
 void
 image_copy(const pix_t ow, const pix_t oh, const uint8_t *oi,
-    const pix_t nw, const pix_t nh, uint8_t *ni,
-    void (*copy_cb)(const uint8_t *oi, uint8_t *ni, pix_t op, pix_t np))
+    const pix_t nw, const pix_t nh, uint8_t *ni, const image_conv_t *conv)
 {
 	const pix_t	odx = (nw < ow ? (ow - nw) / 2 : 0);
 	const pix_t	ndx = (nw > ow ? (nw - ow) / 2 : 0);
@@ -395,18 +925,54 @@ image_copy(const pix_t ow, const pix_t oh, const uint8_t *oi,
 	const pix_t	ndy = (nh > oh ? (nh - oh) / 2 : 0);
 	const pix_t	w = MIN(ow, nw);
 	const pix_t	h = MIN(oh, nh);
+	image_rows_t	rows[IMAGE_COPY_MAXTHREADS];
+	pthread_t	threads[IMAGE_COPY_MAXTHREADS];
+	bool		started[IMAGE_COPY_MAXTHREADS];
+	int		nthreads;
 
 	debug(DB_IMAGE, "old <%4zu,%4zu>: x = [%4zu, %4zu), y = [%4zu, %4zu)\n",
 	    ow, oh, odx, odx + w, ody, ody + h);
 	debug(DB_IMAGE, "new <%4zu,%4zu>: x = [%4zu, %4zu), y = [%4zu, %4zu)\n",
 	    nw, nh, ndx, ndx + w, ndy, ndy + h);
 
-	for (pix_t y = 0; y < h; y++) {
-		for (pix_t x = 0; x < w; x++) {
-			const pix_t	op = (y + ody) * ow + (x + odx);
-			const pix_t	np = (y + ndy) * nw + (x + ndx);
+	nthreads = 1;
+	if ((size_t)w * h >= IMAGE_COPY_MINPIX) {
+		const long	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nthreads = (int)MIN(MAX(ncpu, 1), IMAGE_COPY_MAXTHREADS);
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		image_rows_t	*const	ir = &rows[t];
+
+		ir->ir_conv = conv;
+		ir->ir_oi = oi;
+		ir->ir_ni = ni;
+		ir->ir_ow = ow;
+		ir->ir_nw = nw;
+		ir->ir_odx = odx;
+		ir->ir_ndx = ndx;
+		ir->ir_ody = ody;
+		ir->ir_ndy = ndy;
+		ir->ir_w = w;
+		ir->ir_y0 = (pix_t)((size_t)h * t / nthreads);
+		ir->ir_y1 = (pix_t)((size_t)h * (t + 1) / nthreads);
+	}
 
-			(*copy_cb)(oi, ni, op, np);
+	/*
+	 * This thread takes the first share.  If a thread can't be started,
+	 * its share gets done here too.
+	 */
+	for (int t = 1; t < nthreads; t++) {
+		started[t] = (pthread_create(&threads[t], NULL,
+		    image_copy_rows, &rows[t]) == 0);
+	}
+	(void) image_copy_rows(&rows[0]);
+	for (int t = 1; t < nthreads; t++) {
+		if (started[t]) {
+			(void) pthread_join(threads[t], NULL);
+		} else {
+			(void) image_copy_rows(&rows[t]);
 		}
 	}
 }
@@ -0,0 +1,176 @@
+/*
+ * image.cl - computational kernels for loading images in image.c.
+ */
+
+/*
+ * Copy an "ow" x "oh" image of packed 8-bit pixels into the "nw" x "nh"
+ * OpenCL image "image", centering it, and truncating or padding it with
+ * zeroes as needed.  This places the pixels the same way that image_copy()
+ * does.  The source pixels are RGB if "bpp" is 3, and RGBA if it's 4;
+ * RGB pixels get an alpha of zero.
+ *
+ * Each work item fills in one pixel of the new image.
+ */
+__kernel void
+image_expand(
+	const pix_t		ow,		/* in: width of old image */
+	const pix_t		oh,		/* in: height of old image */
+	const int		bpp,		/* in: bytes per old pixel */
+	__global const uchar	*oi,		/* in: old image */
+	const pix_t		nw,		/* in: width of new image */
+	const pix_t		nh,		/* in: height of new image */
+	__write_only image2d_t	image)		/* out: new image */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= nw || Y >= nh) {
+		return;
+	}
+
+	const int	ox = (int)X + ((int)ow - (int)nw) / 2;
+	const int	oy = (int)Y + ((int)oh - (int)nh) / 2;
+	float4		rgba = 0.0f;
+
+	if (ox >= 0 && oy >= 0 && ox < (int)ow && oy < (int)oh) {
+		const pix_t	op = (pix_t)oy * ow + (pix_t)ox;
+
+		if (bpp == 4) {
+			rgba = convert_float4(vload4(op, oi));
+		} else {
+			rgba = (float4)(convert_float3(vload3(op, oi)), 0.0f);
+		}
+	}
+
+	write_imagef(image, (int2)(X, Y), rgba / 255.0f);
+}
+
+/*
+ * Stretch the image "src", whatever its size, to fill the "nw" x "nh" image
+ * "dst", interpolating linearly between its pixels.  Both images can be of
+ * any floating-point type, as long as they have the same channels.
+ *
+ * Each work item fills in one pixel of the new image.
+ */
+__kernel void
+image_resample(
+	__read_only image2d_t	src,		/* in: old image */
+	const pix_t		nw,		/* in: width of new image */
+	const pix_t		nh,		/* in: height of new image */
+	__write_only image2d_t	dst)		/* out: new image */
+{
+	const sampler_t	sampler = CLK_NORMALIZED_COORDS_TRUE |
+			    CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= nw || Y >= nh) {
+		return;
+	}
+
+	const float2	coord = (float2)(((float)X + 0.5f) / (float)nw,
+			    ((float)Y + 0.5f) / (float)nh);
+
+	write_imagef(dst, (int2)(X, Y), read_imagef(src, sampler, coord));
+}
+
+/*
+ * A 32-bit integer hash with good avalanche behavior, for image_random().
+ */
+static uint
+image_hash(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return (x);
+}
+
+/*
+ * The "n"th of a stream of uniform random numbers in [0, 1), for "key".
+ */
+static float
+image_uniform(uint key, uint n)
+{
+	return ((float)(image_hash(key ^ image_hash(n)) >> 8) *
+	    (1.0f / 16777216.0f));
+}
+
+/*
+ * Fill the W x H datavec image "data" with random data points, each of
+ * whose components is in [lo, hi].  If "sphere" is set, the points are
+ * spread evenly through the ball that fits in that range; otherwise,
+ * through the whole cube.  (A core can ask for something else with
+ * DATA_RANDOM_MAXOF; see vectypes.h.)
+ *
+ * Each pixel's numbers only depend on its instance's key and on where it
+ * is within its instance, so an instance can be reproduced by itself.
+ * With T == 0, the whole image is one instance, and keys[0] is its key;
+ * otherwise each T x T tile is an instance, in row-major order.
+ *
+ * Each work item fills in one pixel.
+ */
+__kernel void
+image_random(
+	const pix_t		W,		/* in */
+	const pix_t		H,		/* in */
+	const pix_t		T,		/* in: exploration tile, or 0 */
+	__constant uint		*keys,		/* in: one per instance */
+	const float		lo,		/* in */
+	const float		hi,		/* in */
+	const int		sphere,		/* in */
+	__write_only image2d_t	data)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+
+	const pix_t	tw = (T == 0 ? W : T);
+	const pix_t	th = (T == 0 ? H : T);
+	const uint	key = keys[(Y / th) * (W / tw) + X / tw];
+	const uint	n = 8 * ((Y % th) * tw + (X % tw));
+	float4		u, v;
+
+	u = (float4)(image_uniform(key, n + 0), image_uniform(key, n + 1),
+	    image_uniform(key, n + 2), image_uniform(key, n + 3));
+
+#ifdef	DATA_RANDOM_MAXOF
+	v = 0.0f;
+	for (int i = 0; i < DATA_RANDOM_MAXOF; i++) {
+		v.x = max(v.x, image_uniform(key, n + i));
+	}
+	v = lo + v * (hi - lo);
+#else
+	if (sphere) {
+		/*
+		 * A direction from normally distributed components (by way
+		 * of Box-Muller), and a radius that makes the points come
+		 * out evenly spread by volume.
+		 */
+		const float	r1 = sqrt(-2.0f * log(1.0f - u.x));
+		const float	r2 = sqrt(-2.0f * log(1.0f - u.z));
+		const float	len = pow(image_uniform(key, n + 4),
+		    1.0f / DATA_DIMENSIONS);
+		float4		g;
+
+		g = (float4)(r1 * cospi(2.0f * u.y), r1 * sinpi(2.0f * u.y),
+		    r2 * cospi(2.0f * u.w), r2 * sinpi(2.0f * u.w));
+#if	DATA_DIMENSIONS == 1
+		g.yzw = 0.0f;
+#elif	DATA_DIMENSIONS == 3
+		g.w = 0.0f;
+#endif
+		v = (length(g) > 0.0f ? g * (len / length(g)) : 0.0f);
+		v = (hi + lo) / 2 + v * ((hi - lo) / 2);
+	} else {
+		v = lo + u * (hi - lo);
+	}
+#endif
+
+	write_imagef(data, (int2)(X, Y), v);
+}
@@ -14,31 +14,78 @@
 extern bool
 image_available(cl_mem);
 
+/*
+ * If random data was asked for, fill the datavec image "data" with it on
+ * the GPU, and return true.  The components are in [min, max], spread
+ * through a sphere or a cube as "shape" says.  This is checked before
+ * image_available(), which leaves random data to it.
+ */
+extern bool
+image_random(cl_mem data, float min, float max, datavec_shape_t shape);
+
 /*
  * Save the current OpenCL image. "steps" refers to the number of steps
  * that have been executed thus far; it is just used to name the file.
+ *
+ * This only starts reading the image back; it's written out by a thread of
+ * its own.  If too many saves are already in flight, this waits briefly for
+ * one of them to finish, and then skips the image if none does.
  */
 extern void
 image_save(cl_mem, int steps);
 
+/*
+ * Write the OpenCL image "image" to the PPM file "path", and don't return
+ * until it's been written.
+ */
+extern void
+image_write(cl_mem image, const char *path);
+
 /*
  * Called to preserve the current image before a resize.
  */
 extern void
 image_preserve(pix_t, pix_t, cl_mem);
 
+/*
+ * Stretch the OpenCL image "src", whatever size it is, to fill the Width x
+ * Height image "dst", with linear interpolation.
+ */
+extern void
+image_resample(cl_mem src, cl_mem dst);
+
+/*
+ * A conversion between two pixel formats, for image_copy().  ic_row()
+ * converts "n" pixels, starting with pixel "ox" of the old image's row
+ * "orow", into the new image's pixels starting at "npix".
+ */
+typedef struct {
+	size_t		ic_obpp;	/* bytes per old pixel */
+	size_t		ic_nbpp;	/* bytes per new pixel */
+	void		(*ic_row)(const uint8_t *orow, pix_t ox,
+			    uint8_t *npix, pix_t n);
+} image_conv_t;
+
 /*
  * Copy an "ow"x"oh"-sized image, located at "oi", into a "nw"x"nh"-sized
- * image, located at "ni".
+ * image, located at "ni", converting it with "conv".
  */
 extern void
 image_copy(const pix_t ow, const pix_t oh, const uint8_t *oi,
-    const pix_t nw, const pix_t nh, uint8_t *ni,
-    void (*copy_cb)(const uint8_t *oi, uint8_t *ni, pix_t op, pix_t np));
+    const pix_t nw, const pix_t nh, uint8_t *ni, const image_conv_t *conv);
 
 /* ------------------------------------------------------------------ */
 
 extern void
 image_datafile(char *file);
 
+/*
+ * Start over from the camera, or from random data, at the next step.
+ */
+extern void
+image_load_camera(void);
+
+extern void
+image_load_random(void);
+
 #endif	/* _IMAGE_H */
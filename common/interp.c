@@ -32,21 +32,39 @@
  *
  * This code is enabled by having the core algorithm's preinit() routine
  * call interp_enable(), passing in the default and maximum amount of
- * interpolation desired.  interp_load() and interp_step() are then used
- * to interpose on core_load() and core_step() respectively.
+ * interpolation desired.  datasrc.c then goes through interp_load() and
+ * interp_step() to import data into the core and to step it.
+ *
+ * In automatic mode (toggled with "A"), the interpolation parameter is
+ * ignored, and the amount of interpolation follows how long the core
+ * algorithm's steps take compared to the images in between them, which
+ * are paced by the display.  A core that takes three display intervals
+ * per step gets three images per step, so the motion on the screen keeps
+ * up with the display however fast or slow the core is.
+ *
+ * The images being interpolated between live in a ring of NINTERP slots.
+ * The core algorithm's step routine writes straight into the next free
+ * slot, and every image handed back to the caller - interpolated or not -
+ * is written by the interpolation kernel, so nothing on the stepping path
+ * ever has to copy an image around.
  */
 #include <strings.h>
 #include <assert.h>
+#include <math.h>
 
 #include "common.h"
 
 #include "debug.h"
 #include "interp.h"
+#include "keyboard.h"
 #include "module.h"
 #include "opencl.h"
+#include "osdep.h"
 #include "param.h"
+#include "telemetry.h"
 
 static void	interp_adjust(void);
+static void	interp_set_total(int ntotal);
 
 /* ------------------------------------------------------------------ */
 
@@ -61,6 +79,18 @@ static void	interp_adjust(void);
  */
 #define	NINTERP		3
 
+/*
+ * Automatic mode.  The amount of interpolation is reconsidered every
+ * INTERP_AUTO_STEPS core steps.  It goes up once a core step takes more
+ * than INTERP_AUTO_SLACK display intervals longer than the images it's
+ * spread across, and down once it takes that much less than one fewer.
+ * Until there are images in between to measure, the display interval is
+ * assumed to be INTERP_AUTO_REFRESH nanoseconds.
+ */
+#define	INTERP_AUTO_STEPS	16
+#define	INTERP_AUTO_SLACK	0.25
+#define	INTERP_AUTO_REFRESH	(1000000000.0 / 60)
+
 static struct {
 	bool		enabled;	/* is this used? */
 
@@ -72,6 +102,19 @@ static struct {
 	int		fr_queued;	/* number of valid images queued */
 	int		interp_cur;	/* current interpolation distance */
 	int		interp_total;	/* total interpolation distance */
+	int		interp_max;	/* from interp_enable() */
+
+	/*
+	 * Automatic mode.  The times are moving averages, in nanoseconds,
+	 * of the time from one interp_step() call to the next, depending on
+	 * whether the first one took a core step.
+	 */
+	bool		automatic;
+	hrtime_t	last_call;	/* when interp_step() last returned */
+	bool		last_stepped;	/* ... and whether it took a step */
+	double		step_time;	/* images with a core step */
+	double		frame_time;	/* interpolated images */
+	int		auto_steps;	/* core steps since last decision */
 } Interp;
 
 /* ------------------------------------------------------------------ */
@@ -124,6 +167,8 @@ interp_init(void)
 	 */
 	Interp.interp_total = 1;
 	interp_reset();
+	Interp.last_call = 0;
+	Interp.auto_steps = 0;
 
 	param_cb_register(Interp.id, interp_adjust);
 }
@@ -148,6 +193,26 @@ const module_ops_t	interp_ops = {
 	interp_fini
 };
 
+/*
+ * Switch between following the interpolation parameter and choosing the
+ * amount of interpolation automatically.
+ */
+static void
+interp_auto_toggle(void)
+{
+	Interp.automatic = !Interp.automatic;
+	Interp.last_call = 0;
+	Interp.auto_steps = 0;
+	Interp.step_time = Interp.frame_time = 0;
+
+	verbose(DB_INTERP, "Automatic interpolation %s\n",
+	    Interp.automatic ? "enabled" : "disabled");
+
+	if (!Interp.automatic) {
+		interp_set_total(param_int(Interp.id));
+	}
+}
+
 /*
  * This must be called from core_preinit() if we're using the interpolator,
  * and shouldn't be called otherwise.
@@ -174,25 +239,51 @@ interp_enable(int dflt, int max)
 
 	param_key_register('i', KB_DEFAULT, Interp.id, -1);
 	param_key_register('I', KB_DEFAULT, Interp.id,  1);
+	key_register('A', KB_DEFAULT, "toggle automatic interpolation",
+	    interp_auto_toggle);
 	debug_register_toggle('i', "interpolation", DB_INTERP, NULL);
 
+	Interp.interp_max = pi.pi_max;
 	Interp.enabled = true;
 	debug(DB_INTERP, "Interpolation enabled\n");
 }
 
+bool
+interp_enabled(void)
+{
+	return (Interp.enabled);
+}
+
+bool
+interp_active(void)
+{
+	return (Interp.enabled && (Interp.automatic ||
+	    Interp.interp_total > 1 || Interp.fr_queued > 0));
+}
+
 /* ------------------------------------------------------------------ */
 
 /*
  * Called when the interpolation parameter changes.
  *
  * This parameter tracks the number of intermediate steps to display
- * between two successive "real" images.
+ * between two successive "real" images.  In automatic mode, it's ignored.
  */
 static void
 interp_adjust(void)
+{
+	if (!Interp.automatic) {
+		interp_set_total(param_int(Interp.id));
+	}
+}
+
+/*
+ * Change the number of images shown per core step.
+ */
+static void
+interp_set_total(int ntotal)
 {
 	const int	ototal = Interp.interp_total;
-	const int	ntotal = param_int(Interp.id);
 
 	if (ototal == ntotal) {
 		return;
@@ -231,22 +322,27 @@ interp_adjust(void)
 /* ------------------------------------------------------------------ */
 
 /*
- * Make a copy of the data being loaded into the core algorithm.
+ * Claim the next slot in the ring, and return the image for it.
  */
-static void
-interp_copy(cl_mem data)
+static cl_mem
+interp_push(void)
 {
 	const int	idx = Interp.fr_next % NINTERP;
 
 	assert(Interp.interp_total > 1);
+	assert(Interp.fr_queued < NINTERP);
 
-	debug(DB_INTERP, "Interpolation: copying into %d\n", idx);
+	debug(DB_INTERP, "Interpolation: filling %d\n", idx);
 
-	ocl_image_copy(data, Interp.bounds[idx], Width, Height);
 	Interp.fr_next++;
 	Interp.fr_queued++;
+
+	return (Interp.bounds[idx]);
 }
 
+/*
+ * Loading doesn't happen every frame, so it's fine to copy the data here.
+ */
 void
 interp_load(cl_mem data, void (*load)(cl_mem))
 {
@@ -254,7 +350,7 @@ interp_load(cl_mem data, void (*load)(cl_mem))
 
 	if (Interp.interp_total > 1) {
 		interp_reset();
-		interp_copy(data);
+		ocl_image_copy(data, interp_push(), Width, Height);
 	}
 	(*load)(data);
 }
@@ -268,6 +364,7 @@ interpolate(cl_mem start, cl_mem end,
     float amount, float min, float max, cl_mem result)
 {
 	kernel_data_t	*const	kd = &Interp.kernel;
+	const hrtime_t		tm = telemetry_start();
 	int			arg;
 
 	arg = 0;
@@ -281,6 +378,56 @@ interpolate(cl_mem start, cl_mem end,
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
 
 	kernel_invoke(kd, 2, NULL, NULL);
+	telemetry_stop(TM_INTERP, tm);
+}
+
+/*
+ * In automatic mode, time each call to interp_step(), and every so often
+ * pick the amount of interpolation that spreads a core step over as many
+ * display intervals as it takes.  This is called at the start of each call,
+ * to account for the previous one.
+ */
+static void
+interp_auto_update(void)
+{
+	const hrtime_t	now = gethrtime();
+	const double	delta = (double)(now - Interp.last_call);
+	double		*avg;
+	double		refresh, ratio;
+	int		ntotal;
+
+	if (!Interp.automatic) {
+		return;
+	}
+	if (Interp.last_call == 0 || delta > 1000000000.0) {
+		Interp.last_call = now;		/* we were paused */
+		return;
+	}
+	Interp.last_call = now;
+
+	avg = (Interp.last_stepped ? &Interp.step_time : &Interp.frame_time);
+	*avg = (*avg == 0 ? delta : *avg + (delta - *avg) / 8);
+
+	if (!Interp.last_stepped ||
+	    ++Interp.auto_steps < INTERP_AUTO_STEPS) {
+		return;
+	}
+	Interp.auto_steps = 0;
+
+	refresh = (Interp.frame_time != 0 ?
+	    Interp.frame_time : INTERP_AUTO_REFRESH);
+	ratio = Interp.step_time / refresh;
+	ntotal = Interp.interp_total;
+	if (ratio > ntotal + INTERP_AUTO_SLACK ||
+	    ratio < ntotal - 1 - INTERP_AUTO_SLACK) {
+		ntotal = MAX(1, MIN((int)ceil(ratio), Interp.interp_max));
+	}
+
+	debug(DB_INTERP, "Interpolation: step %.2f ms, frame %.2f ms, "
+	    "total %d\n", Interp.step_time / 1000000.0, refresh / 1000000.0,
+	    ntotal);
+
+	interp_set_total(ntotal);
 }
 
 /*
@@ -289,6 +436,9 @@ interpolate(cl_mem start, cl_mem end,
 void
 interp_step(cl_mem result, float min, float max, void (*step)(cl_mem))
 {
+	interp_auto_update();
+	Interp.last_stepped = false;
+
 	assert(Interp.interp_total > 0);
 	assert(Interp.enabled);
 
@@ -298,13 +448,15 @@ interp_step(cl_mem result, float min, float max, void (*step)(cl_mem))
 		 *
 		 * If we have any queued images that we don't need anymore,
 		 * use those as our results before going back to the core.
+		 * Interpolating all the way to the end of a pair yields
+		 * the end image itself, so the kernel hands it over.
 		 */
 		if (Interp.fr_queued > 0) {
 			const int	idx =
 			    (Interp.fr_next - Interp.fr_queued) % NINTERP;
 
-			ocl_image_copy(Interp.bounds[idx], result,
-			    Width, Height);
+			interpolate(Interp.bounds[idx], Interp.bounds[idx],
+			    1.0f, min, max, result);
 			Interp.fr_queued--;
 
 			if (Interp.fr_queued == 0) {
@@ -312,17 +464,31 @@ interp_step(cl_mem result, float min, float max, void (*step)(cl_mem))
 			}
 		} else {
 			(*step)(result);
+			Interp.last_stepped = true;
 		}
 
 		return;
 	}
 
 	/*
-	 * Do we need to add to our queue?
+	 * Do we need to add to our queue?  The core writes its next image
+	 * directly into the ring.
 	 */
 	if (Interp.fr_queued < NINTERP) {
-		(*step)(result);
-		interp_copy(result);	/* increases fr_queued */
+		(*step)(interp_push());	/* increases fr_queued */
+		Interp.last_stepped = true;
+
+		/*
+		 * With nothing to interpolate from yet, the new image is
+		 * the result.
+		 */
+		if (Interp.fr_queued == 1) {
+			const int	idx = (Interp.fr_next - 1) % NINTERP;
+
+			interpolate(Interp.bounds[idx], Interp.bounds[idx],
+			    1.0f, min, max, result);
+			return;
+		}
 	}
 
 	/*
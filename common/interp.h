@@ -15,15 +15,31 @@ extern void
 interp_enable(int dflt, int max);
 
 /*
- * A hook to be called by the core algorithm's import() routine.
+ * Whether interp_enable() has been called.
+ */
+extern bool
+interp_enabled(void);
+
+/*
+ * Whether the next step has to go through interp_step(): that is, whether
+ * there's any interpolation to do, any left over from before, or any
+ * timing to be done for automatic mode.  Otherwise the core can be stepped
+ * directly.
+ */
+extern bool
+interp_active(void);
+
+/*
+ * Used by datasrc.c in place of the core algorithm's import() routine.
  * The load() callback loads the next non-interpolated image.
  */
 extern void
 interp_load(cl_mem data, void (*load)(cl_mem));
 
 /*
- * A hook to be called by the core algorithm's step_and_export() routine.
- * The step() callback generates the next non-interpolated image.
+ * Used by datasrc.c in place of the core algorithm's step_and_export()
+ * routine.  The step() callback generates the next non-interpolated image,
+ * into an image owned by the interpolator (not necessarily "result").
  */
 extern void
 interp_step(cl_mem result, float min, float max, void (*step)(cl_mem));
@@ -1,24 +1,21 @@
 /*
- * The opencl code uses this source file to pull in everything.
+ * The opencl code uses this source file to pull in the core program, which
+ * is built as soon as possible.  Kernels that are only used by optional
+ * features (camdelta.cl, heatmap.cl, histogram.cl, interp.cl, stroke.cl)
+ * are each in a program of their own, which isn't built unless something
+ * needs it; see "make-kernelsrc".  vectypes.h and clcommon.h come before
+ * all of them.
  */
 
-/*
- * These files are used by multiple kernels, and must come first.
- */
-#include "vectypes.h"
-#include "clcommon.h"
-
 /*
  * The common kernel code.
  */
 #include "box.cl"
 #include "subblock.cl"
-#include "color.cl"	// used by camdelta.cl and heatmap.cl
-#include "camdelta.cl"
-#include "heatmap.cl"
-#include "interp.cl"
+#include "sat.cl"
+#include "color.cl"
 #include "reduce.cl"
-#include "stroke.cl"
+#include "skip.cl"
 
 /*
  * The core algorithm comes last; that way, any #define's that it generates
@@ -1,22 +1,39 @@
+#include <math.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "common.h"
 
+#include "batch.h"
+#include "bench.h"
 #include "box.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "debug.h"
+#include "explore.h"
+#include "heatmap.h"
 #include "image.h"
 #include "keyboard.h"
 #include "module.h"
+#include "opencl.h"
 #include "param.h"
 #include "ppm.h"
 #include "randbj.h"
+#include "publish.h"
+#include "record.h"
+#include "session.h"
+#include "stroke.h"
 #include "subblock.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "window.h"
 
 #define	DEF_WIDTH	1280	/* default width */
 #define	DEF_HEIGHT	720	/* default height */
+#define	DEF_INSTANCE	256	/* default exploration instance size */
+#define	DEF_BENCHSEED	1	/* default benchmark random seed */
+#define	DEF_BENCHWARMUP	50	/* default benchmark warmup steps */
+#define	DEF_BENCHFILE	"bench.json"	/* default benchmark results */
 
 static void
 key_q(void)
@@ -27,29 +44,87 @@ key_q(void)
 static void
 usage(const char *arg0)
 {
-	note("Usage: %s [-w <width>] [-h <height>] [-A] [-a] [-B] [-C] "
-	    "[-D <areas>] [-F] [-f <file>] [-K <keys>] [-k] [-L] "
-	    "[-r <radius>] [-R <radius>] [-s <seconds>] [-S <scale>] [-v] "
-	    "[-x <random seed>]\n\n", arg0);
+	note("Usage: %s [-w <width>] [-h <height>] [-A] [-a] [-B] "
+	    "[-b <steps>] [-C] [-c] [-D <areas>] [-d] [-E <name>] "
+	    "[-e <params>] [-F] [-f <file>] [-g] "
+	    "[-H <frames>] [-I <n>[x<size>]] [-i <file>] [-J <file>] "
+	    "[-j <file>] [-K <keys>] [-k] [-L] [-M] [-m] [-N <iterations>] "
+	    "[-n <frames>] [-O] [-o <file>] [-P <radius>] [-p] "
+	    "[-Q <queues>] [-r <radius>] [-R <radius>] [-s <seconds>] "
+	    "[-S <scale>] [-T] [-t <size>] [-U <fps>] [-u <msec>] "
+	    "[-V <file>] [-v] "
+	    "[-W <warmup>] [-X <fraction>] [-x <random seed>] [-Y <file>] "
+	    "[-Z <file>] [-z <file>]\n\n",
+	    arg0);
 
 	note("\t-w <width>\tMake the display window <width> pixels wide.\n");
 	note("\t-h <height>\tMake the display window <height> pixels tall.\n");
 	note("\t-A\t\tDisable autopilot mode.\n");
 	note("\t-a\t\tDisable animation.\n");
 	note("\t-B\t\tRun box blur performance test.\n");
+	note("\t-b <steps>\tBenchmark <steps> steps headless, "
+	    "then exit.\n");
 	note("\t-C\t\tDisable the use of a camera.\n");
+	note("\t-c\t\tCompute on the CPU's OpenCL device, headless.\n");
 	note("\t-D <areas>\tEnable debugging output for <areas>.\n");
+	note("\t-d\t\tStep the simulation on a thread of its own.\n");
+	note("\t-E <name>\tPublish images in shared memory object <name>.\n");
+	note("\t-e <params>\tStart with the parameters in dump string "
+	    "<params>.\n");
 	note("\t-F\t\tDisable fullscreen mode.\n");
 	note("\t-f <file>\tLoad the PPM file <file> as the starting image.\n");
+	note("\t-g\t\tDon't record and replay kernel launches.\n");
+	note("\t-H <frames>\tRegenerate the heatmap every <frames> images.\n");
+	note("\t-I <n>[x<size>]\tExplore <n> random settings headless, "
+	    "in <size>-pixel squares (tc, mstp).\n");
+	note("\t-i <file>\tRun the render jobs in <file> headless, "
+	    "then exit.\n");
+	note("\t-J <file>\tAppend per-stage frame timings to <file> "
+	    "every second.\n");
+	note("\t-j <file>\tTrace host calls and GPU kernels, and write "
+	    "the trace to <file>.\n");
 	note("\t-K <keys>\tEnter some keystrokes from command line.\n");
 	note("\t-k\t\tRun in keypad mode.\n");
 	note("\t-L\t\tLog all keypresses.\n");
+	note("\t-M\t\tWith \"-i\", run one job per GPU at a time.\n");
+	note("\t-m\t\tHold off the core's steps while the mouse is "
+	    "drawing.\n");
+	note("\t-N <count>\tTimed runs per box blur test configuration.\n");
+	note("\t-n <frames>\tLet up to <frames> images be in flight "
+	    "on the GPU.\n");
+	note("\t-O\t\tDon't build kernels specialized for the current "
+	    "settings.\n");
+	note("\t-o <file>\tWrite box blur test results to <file> "
+	    "(CSV or .json),\n\t\tor append benchmark results to it.\n");
+	note("\t-P <radius>\tBlur radii >= <radius> at reduced resolution.\n");
+	note("\t-p\t\tEnable per-kernel GPU stats (toggled with \"D g\").\n");
+	note("\t-Q <queues>\tRun independent blurs on up to <queues> "
+	    "command queues.\n");
 	note("\t-r <radius>\tMinimum radius for box blur performance test.\n");
 	note("\t-R <radius>\tMaximum radius for box blur performance test.\n");
 	note("\t-S <scale>\tCalculate images at <scale> magnification.\n");
 	note("\t-s <seconds>\tSave an image every <seconds> seconds.\n");
+	note("\t-T\t\tDon't tune box blur radii that aren't in the cache.\n");
+	note("\t-t <size>\tDisplay through textures at most <size> pixels "
+	    "on a side.\n");
+	note("\t-U <fps>\tLower the resolution as needed to keep up <fps> "
+	    "images per second.\n");
+	note("\t-u <msec>\tKeep autopilot's choices to around <msec> "
+	    "per frame.\n");
+	note("\t-V <file>\tRecord a Y4M (or .nv12) video stream to <file>, "
+	    "\"-\", or \"|command\".\n");
 	note("\t-v\t\tEnable verbose status output.\n");
+	note("\t-W <count>\tUntimed warmup runs per box blur test "
+	    "configuration,\n\t\tor untimed steps before a benchmark.\n");
+	note("\t-X <fraction>\tWith -b, time the framework around the core "
+	    "in a window, and\n\t\twarn if it takes more than <fraction> of "
+	    "the core's time.\n");
 	note("\t-x <seed>\tSpecify a seed for the random number generator.\n");
+	note("\t-Y <file>\tResume from checkpoint <file>, and keep it "
+	    "up to date.\n");
+	note("\t-Z <file>\tReplay the session in <file> headless, "
+	    "as a benchmark.\n");
+	note("\t-z <file>\tRecord this session's changes to <file>.\n");
 
 	exit(1);
 }
@@ -64,14 +139,29 @@ main(int argc, char **argv)
 	bool		animated;
 	bool		boxtest;
 	bool		graphics;
+	bool		threaded;
 	bool		use_keypad;
 	char		*keys;
 	bool		log_keys;
 	pix_t		boxtest_minradius;
 	pix_t		boxtest_maxradius;
+	int		boxtest_iterations;
+	int		boxtest_warmup;
+	char		*boxtest_outfile;
 	time_t		saveperiod;
 	float		scale;
 	long		randomseed;
+	bool		seeded;
+	int		bench_steps;
+	char		*params;
+	char		*session;
+	int		replay_frames;
+	float		overhead;
+	int		ninstances;
+	pix_t		instsize;
+	char		*batchfile;
+	bool		multidev;
+	char		*end;
 
 	w = DEF_WIDTH;
 	h = DEF_HEIGHT;
@@ -80,17 +170,33 @@ main(int argc, char **argv)
 	animated = true;
 	boxtest = false;
 	graphics = true;
+	threaded = false;
 	use_keypad = false;
 	keys = NULL;
 	log_keys = false;
 	boxtest_minradius = 0;
 	boxtest_maxradius = 0;
+	boxtest_iterations = 0;
+	boxtest_warmup = -1;
+	boxtest_outfile = NULL;
 	saveperiod = 0;
 	scale = 1;
 	randomseed = getpid();
+	seeded = false;
+	bench_steps = 0;
+	params = NULL;
+	session = NULL;
+	replay_frames = 0;
+	overhead = 0;
+	ninstances = 0;
+	instsize = DEF_INSTANCE;
+	batchfile = NULL;
+	multidev = false;
 
+	module_mark("start");
 	while ((ch = getopt(argc, argv,
-	    "AaBCD:Ff:Gh:K:kLR:r:S:s:vw:x:?")) != -1) {
+	    "AaBb:CcD:dE:e:Ff:GgH:h:I:i:J:j:K:kLMmN:n:Oo:P:pQ:R:r:S:s:Tt:U:u:"
+	    "V:vW:w:X:x:Y:Z:z:?")) != -1) {
 		switch (ch) {
 		case 'A':
 			enable_autopilot = false;
@@ -104,12 +210,31 @@ main(int argc, char **argv)
 			go_fullscreen = false;
 			boxtest = true;
 			break;
+		case 'b':
+			bench_steps = atoi(optarg);
+			if (bench_steps <= 0) {
+				usage(argv[0]);
+			}
+			break;
 		case 'C':
 			camera_disable();
 			break;
+		case 'c':
+			opencl_cpu_enable();
+			graphics = false;
+			break;
 		case 'D':
 			debug_init_areas(optarg);
 			break;
+		case 'd':
+			threaded = true;
+			break;
+		case 'E':
+			publish_name(optarg);
+			break;
+		case 'e':
+			params = optarg;
+			break;
 		case 'F':
 			go_fullscreen = false;
 			break;
@@ -129,10 +254,31 @@ main(int argc, char **argv)
 		case 'G':
 			graphics = false;
 			break;
+		case 'g':
+			kernel_graphs_disable();
+			break;
+		case 'H':
+			heatmap_set_interval(atoi(optarg));
+			break;
 		case 'h':
 			h = atoi(optarg);
 			go_fullscreen = false;
 			break;
+		case 'I':
+			ninstances = (int)strtol(optarg, &end, 10);
+			if (*end == 'x') {
+				instsize = atoi(end + 1);
+			}
+			break;
+		case 'i':
+			batchfile = optarg;
+			break;
+		case 'J':
+			telemetry_file(optarg);
+			break;
+		case 'j':
+			trace_file(optarg);
+			break;
 		case 'k':
 			use_keypad = true;
 			break;
@@ -142,6 +288,33 @@ main(int argc, char **argv)
 		case 'L':
 			log_keys = true;
 			break;
+		case 'M':
+			multidev = true;
+			break;
+		case 'm':
+			stroke_set_priority(true);
+			break;
+		case 'N':
+			boxtest_iterations = atoi(optarg);
+			break;
+		case 'n':
+			window_set_inflight(atoi(optarg));
+			break;
+		case 'O':
+			opencl_specialize_disable();
+			break;
+		case 'o':
+			boxtest_outfile = optarg;
+			break;
+		case 'P':
+			box_pyramid_enable(atoi(optarg));
+			break;
+		case 'p':
+			opencl_profiling_enable();
+			break;
+		case 'Q':
+			opencl_streams_enable(atoi(optarg));
+			break;
 		case 'r':
 			boxtest_minradius = atoi(optarg);
 			break;
@@ -154,15 +327,56 @@ main(int argc, char **argv)
 		case 'S':
 			scale = strtof(optarg, NULL);
 			break;
+		case 'T':
+			box_autotune_disable();
+			break;
+		case 't':
+			window_set_tilesize(atoi(optarg));
+			break;
+		case 'U':
+			window_set_fps(strtof(optarg, NULL));
+			break;
+		case 'u':
+			autopilot_budget(strtof(optarg, NULL));
+			break;
+		case 'V':
+			record_stream(optarg);
+			break;
 		case 'v':
 			debug_set_verbose();
 			break;
+		case 'W':
+			boxtest_warmup = atoi(optarg);
+			break;
 		case 'w':
 			w = atoi(optarg);
 			go_fullscreen = false;
 			break;
+		case 'X':
+			overhead = strtof(optarg, &end);
+			if (*end != '\0' || overhead <= 0) {
+				usage(argv[0]);
+			}
+			break;
 		case 'x':
 			randomseed = atoi(optarg);
+			seeded = true;
+			break;
+		case 'Y':
+			if (checkpoint_file(optarg, &w, &h)) {
+				verbose(DB_IMAGE,
+				    "Resuming from checkpoint %s\n", optarg);
+				go_fullscreen = false;
+			}
+			break;
+		case 'Z':
+			session_replay(optarg, &w, &h, &randomseed,
+			    &replay_frames);
+			seeded = true;
+			go_fullscreen = false;
+			break;
+		case 'z':
+			session = optarg;
 			break;
 		case '?':
 		default:
@@ -171,18 +385,110 @@ main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * A batch of jobs runs headless, with each job's size, seed, and
+	 * parameters coming from the job file.  With "-M", the GPUs each
+	 * get a process of their own.
+	 */
+	if (batchfile != NULL) {
+		batch_file(batchfile, multidev, &w, &h, &randomseed, &params);
+		seeded = true;
+		go_fullscreen = false;
+		graphics = false;
+		enable_autopilot = false;
+		animated = true;
+		threaded = false;
+	} else if (multidev) {
+		warn("\"-M\" only applies to a batch of jobs (\"-i\")\n");
+	}
+
+	/*
+	 * A replay is a benchmark of the frames that were recorded, apart
+	 * from a few at the start to warm up.  The session has the size of
+	 * the images, which with "-S" is that many times the window's.
+	 */
+	if (replay_frames != 0) {
+		if (scale > 0) {
+			w = (pix_t)ceilf((float)w / scale);
+			h = (pix_t)ceilf((float)h / scale);
+		}
+		if (boxtest_warmup < 0) {
+			boxtest_warmup =
+			    MIN(DEF_BENCHWARMUP, replay_frames / 10);
+		}
+		bench_steps = replay_frames - MAX(boxtest_warmup, 1);
+		if (bench_steps <= 0) {
+			die("The session is too short to replay.\n");
+		}
+	}
+
+	/*
+	 * A benchmark runs headless, with nothing random about it.  When
+	 * it's measuring the overhead, it keeps a window (though not a
+	 * full-screen one), since handing images to OpenGL is part of that.
+	 */
+	if (bench_steps != 0) {
+		if (!seeded) {
+			randomseed = DEF_BENCHSEED;
+		}
+		if (boxtest_warmup < 0) {
+			boxtest_warmup = DEF_BENCHWARMUP;
+		}
+		if (boxtest_outfile == NULL) {
+			boxtest_outfile = DEF_BENCHFILE;
+		}
+		bench_enable(bench_steps, boxtest_warmup, randomseed,
+		    boxtest_outfile);
+		if (overhead != 0) {
+			bench_overhead_enable(overhead);
+		}
+		go_fullscreen = false;
+		graphics = (overhead != 0);
+		enable_autopilot = false;
+		animated = true;
+		threaded = false;
+	} else if (overhead != 0) {
+		warn("need to use \"-b\" to measure the overhead\n");
+	}
+
+	if (session != NULL) {
+		session_record(session, randomseed);
+	}
 	srandbj(randomseed);
 
-	if ((boxtest_minradius != 0 || boxtest_maxradius != 0) && !boxtest) {
+	/*
+	 * Exploration runs headless, with each instance's parameters fixed.
+	 */
+	if (ninstances != 0) {
+		explore_instances(ninstances, instsize, randomseed, &w, &h);
+		go_fullscreen = false;
+		graphics = false;
+		enable_autopilot = false;
+	}
+
+	if ((boxtest_minradius != 0 || boxtest_maxradius != 0 ||
+	    boxtest_iterations != 0 || ((boxtest_warmup != -1 ||
+	    boxtest_outfile != NULL) && bench_steps == 0)) && !boxtest) {
 		warn("need to use \"-B\" to enable box test\n");
 	}
 
+	/*
+	 * The box test wants to time kernels using the GPU's own clock,
+	 * which needs a profiling-enabled command queue.
+	 */
+	if (boxtest) {
+		opencl_profiling_enable();
+	}
+
 	if (enable_autopilot) {
 		autopilot_enable();
 	}
 
 	window_set_animated(animated);
 	window_set_graphics(graphics);
+	if (threaded && !boxtest) {
+		window_set_threaded(true);
+	}
 
 	if (scale == 0) {
 		usage(argv[0]);
@@ -199,14 +505,20 @@ main(int argc, char **argv)
 	 * module preinit/init routines.
 	 */
 	window_create(w, h);
+	module_mark("window created");
 
 	/*
 	 * Initialize all of the subsystems.
 	 */
 	module_preinit();
 	module_init();
+	if (params != NULL) {
+		param_undump(params);
+	}
+	opencl_mem_report();
 	atexit(module_postfini);
 	atexit(module_fini);
+	atexit(checkpoint_exit);	/* must run before module_fini() */
 
 	/*
 	 * Register a handler for quitting the program.
@@ -240,7 +552,14 @@ main(int argc, char **argv)
 		if (boxtest_maxradius == 0 || boxtest_maxradius > MAX_RADIUS) {
 			boxtest_maxradius = MAX_RADIUS;
 		}
-		box_test(boxtest_minradius, boxtest_maxradius);
+		if (boxtest_iterations <= 0) {
+			boxtest_iterations = 10;
+		}
+		if (boxtest_warmup < 0) {
+			boxtest_warmup = 1;
+		}
+		box_test(boxtest_minradius, boxtest_maxradius,
+		    boxtest_warmup, boxtest_iterations, boxtest_outfile);
 	} else {
 		window_mainloop();
 	}
@@ -2,10 +2,14 @@
  * module.c - invoke all of the subsystem-specific init and fini functions.
  * See the module_ops_t definition in module.h for more details.
  */
+#include <stdio.h>
+
 #include "common.h"
 
+#include "debug.h"
 #include "module.h"
 #include "opencl.h"	/* for kernel_wait() */
+#include "osdep.h"
 
 /* ------------------------------------------------------------------ */
 
@@ -15,11 +19,14 @@
  */
 
 extern const module_ops_t	basis_ops;
+extern const module_ops_t	bench_ops;
 extern const module_ops_t	box_ops;
 extern const module_ops_t	camdelta_ops;
+extern const module_ops_t	checkpoint_ops;
 extern const module_ops_t	core_ops;
 extern const module_ops_t	datasrc_ops;
 extern const module_ops_t	debug_ops;
+extern const module_ops_t	explore_ops;
 extern const module_ops_t	heatmap_ops;
 extern const module_ops_t	histogram_ops;
 extern const module_ops_t	image_ops;
@@ -28,34 +35,109 @@ extern const module_ops_t	keyboard_ops;
 extern const module_ops_t	mouse_ops;
 extern const module_ops_t	opencl_ops;
 extern const module_ops_t	param_ops;
+extern const module_ops_t	publish_ops;
+extern const module_ops_t	record_ops;
 extern const module_ops_t	reduce_ops;
+extern const module_ops_t	session_ops;
 extern const module_ops_t	skip_ops;
 extern const module_ops_t	stroke_ops;
+extern const module_ops_t	telemetry_ops;
+extern const module_ops_t	trace_ops;
 extern const module_ops_t	window_ops;
 
-static const module_ops_t *Modules[] = {
-	&basis_ops,
-	&box_ops,
-	&camdelta_ops,
-	&core_ops,
-	&datasrc_ops,
-	&debug_ops,
-	&heatmap_ops,
-	&histogram_ops,
-	&image_ops,
-	&interp_ops,
-	&keyboard_ops,
-	&mouse_ops,
-	&opencl_ops,
-	&param_ops,
-	&reduce_ops,
-	&skip_ops,
-	&stroke_ops,
-	&window_ops
+typedef struct {
+	const char		*me_name;
+	const module_ops_t	*me_ops;
+} module_entry_t;
+
+#define	MODULE(m)	{ #m, &m##_ops }
+
+static const module_entry_t Modules[] = {
+	MODULE(basis),
+	MODULE(bench),
+	MODULE(box),
+	MODULE(camdelta),
+	MODULE(checkpoint),
+	MODULE(core),
+	MODULE(datasrc),
+	MODULE(debug),
+	MODULE(explore),
+	MODULE(heatmap),
+	MODULE(histogram),
+	MODULE(image),
+	MODULE(interp),
+	MODULE(keyboard),
+	MODULE(mouse),
+	MODULE(opencl),
+	MODULE(param),
+	MODULE(publish),
+	MODULE(record),
+	MODULE(reduce),
+	MODULE(session),
+	MODULE(skip),
+	MODULE(stroke),
+	MODULE(telemetry),
+	MODULE(trace),
+	MODULE(window)
 };
 
+/*
+ * Only startup is timed; the modules are set up again on every resize, but
+ * that isn't what the timeline is for.
+ */
+#define	MODULE_MARK_MSEC	1.0	/* least time worth marking */
+
+static struct {
+	hrtime_t	start;		/* first module_mark() */
+	hrtime_t	last;		/* latest module_mark() */
+	bool		started;	/* first module_init() is done */
+} Module;
+
 /* ------------------------------------------------------------------ */
 
+void
+module_mark(const char *what)
+{
+	const hrtime_t	now = gethrtime();
+
+	if (Module.start == 0) {
+		Module.start = Module.last = now;
+	}
+	verbose(DB_PERF, "Startup: %8.1f msec  %-24s (+%.1f)\n",
+	    (double)(now - Module.start) / 1000000.0, what,
+	    (double)(now - Module.last) / 1000000.0);
+	Module.last = now;
+}
+
+/*
+ * Call one module's callback, marking the timeline if it's startup and the
+ * callback took a while.
+ */
+static void
+module_call(const module_entry_t *me, void (*cb)(void), const char *phase)
+{
+	hrtime_t	start;
+	double		msec;
+	char		what[64];
+
+	if (cb == NULL) {
+		return;
+	}
+	if (Module.started) {
+		(*cb)();
+		return;
+	}
+
+	start = gethrtime();
+	(*cb)();
+	msec = (double)(gethrtime() - start) / 1000000.0;
+	if (msec >= MODULE_MARK_MSEC) {
+		(void) snprintf(what, sizeof (what), "%s %s",
+		    me->me_name, phase);
+		module_mark(what);
+	}
+}
+
 void
 module_preinit(void)
 {
@@ -63,9 +145,11 @@ module_preinit(void)
 	size_t		i;
 
 	for (i = 0; i < nmod; i++) {
-		if (Modules[i]->preinit != NULL) {
-			(*Modules[i]->preinit)();
-		}
+		module_call(&Modules[i], Modules[i].me_ops->preinit,
+		    "preinit");
+	}
+	if (!Module.started) {
+		module_mark("all preinit");
 	}
 }
 
@@ -76,9 +160,11 @@ module_init(void)
 	size_t		i;
 
 	for (i = 0; i < nmod; i++) {
-		if (Modules[i]->init != NULL) {
-			(*Modules[i]->init)();
-		}
+		module_call(&Modules[i], Modules[i].me_ops->init, "init");
+	}
+	if (!Module.started) {
+		module_mark("all init");
+		Module.started = true;
 	}
 }
 
@@ -91,8 +177,8 @@ module_fini(void)
 	kernel_wait();
 
 	for (i = 0; i < nmod; i++) {
-		if (Modules[i]->fini != NULL) {
-			(*Modules[i]->fini)();
+		if (Modules[i].me_ops->fini != NULL) {
+			(*Modules[i].me_ops->fini)();
 		}
 	}
 }
@@ -104,8 +190,8 @@ module_postfini(void)
 	size_t		i;
 
 	for (i = 0; i < nmod; i++) {
-		if (Modules[i]->postfini != NULL) {
-			(*Modules[i]->postfini)();
+		if (Modules[i].me_ops->postfini != NULL) {
+			(*Modules[i].me_ops->postfini)();
 		}
 	}
 }
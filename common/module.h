@@ -52,4 +52,12 @@ extern void	module_init(void);
 extern void	module_fini(void);
 extern void	module_postfini(void);
 
+/*
+ * The startup timeline.  With "-v", this prints how long the program has
+ * been running, and how long it's been since the last mark, when it gets
+ * to "what"; the first call starts the clock.  The first module_preinit()
+ * and module_init() mark every module that takes a noticeable time.
+ */
+extern void	module_mark(const char *what);
+
 #endif	/* _MODULE_H */
@@ -4,41 +4,361 @@
  * A lot of what these do is to check the return codes for success;
  * error codes from OpenCL are generally treated as fatal.
  */
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "common.h"
 
 #include "debug.h"
+#include "explore.h"
 #include "gfxhdr.h"
 #include "opencl.h"
 #include "osdep.h"
 #include "module.h"
+#include "trace.h"
 #include "util.h"
 #include "window.h"
 
 /*
- * Pull in the OpenCL sources.
+ * Pull in the OpenCL sources.  These are split up into several programs
+ * (see make-kernelsrc), each of which is only built once something wants
+ * one of its kernels.  The first one holds the core algorithm and the
+ * kernels that every core uses.
  */
+typedef struct {
+	const char	*ks_name;
+	const char	*ks_kernels;	/* " name1 name2 ... " */
+	const char	*ks_source;
+} kernel_source_t;
+
 #include "kernelsrc.c"
 
+#define	NPROGRAMS	(sizeof (Kernel_sources) / sizeof (Kernel_sources[0]))
+#define	CORE_PROGRAM	0
+
+/*
+ * This goes in front of the OpenCL sources at run time, after they've been
+ * through the preprocessor, so it can depend on options passed to the
+ * OpenCL compiler.  SPEC_x(v) is just "v" in the generic program; in a
+ * program specialized with -DZOUNDS_x=<n> (see opencl_specialize()), it's
+ * the constant <n> whenever v is equal to that, which lets the compiler
+ * unroll and constant-fold the common case while still handling any value.
+ *
+ * ZOUNDS_TILE is the size of each instance in exploration mode (see
+ * explore.h), or 0.  It's defined ahead of this, by program_source().
+ */
+#define	SPEC_MACRO(x)							\
+	"#ifdef ZOUNDS_" #x "\n"					\
+	"#define SPEC_" #x "(v) "					\
+	    "((v) == ZOUNDS_" #x " ? ZOUNDS_" #x " : (v))\n"		\
+	"#else\n"							\
+	"#define SPEC_" #x "(v) (v)\n"					\
+	"#endif\n"
+
+static const char Kernel_prelude[] =
+	"#ifndef ZOUNDS_TILE\n"
+	"#define ZOUNDS_TILE 0\n"
+	"#endif\n"
+	SPEC_MACRO(W)
+	SPEC_MACRO(H)
+	SPEC_MACRO(NSCALES)
+	SPEC_MACRO(NBOX);
+
+#undef	SPEC_MACRO
+
 /* ------------------------------------------------------------------ */
 
+/*
+ * The most kernel launches that kernel_timing_start() keeps events for
+ * before it has to wait for them and add them up.
+ */
+#define	KERNEL_TIMING_MAX	256
+
+/*
+ * The per-kernel GPU stats: the most distinct kernel methods that are
+ * tracked, the most launches whose events can be outstanding at once (any
+ * more are just not counted), and how often to dump the stats.
+ */
+#define	KERNEL_STATS_MAX	64
+#define	KERNEL_STATS_PENDING	1024
+#define	KERNEL_STATS_PERIOD	(10 * 1000000000LL)
+
+/*
+ * The most launches whose trace events can be outstanding at once, and
+ * how many times to sample the GPU's clock when lining it up with ours.
+ */
+#define	KERNEL_TRACE_PENDING	1024
+#define	KERNEL_TRACE_SYNCS	4
+
+/*
+ * The most kernel launches in one kernel graph.
+ */
+#define	KERNEL_GRAPH_MAX	256
+
+/*
+ * The most kernels that can exist at once; they're all tracked, so that
+ * they can be moved over to a specialized program.
+ */
+#define	KERNEL_MAX_KERNELS	128
+
+/*
+ * The most kernels that kernel_cleanup() keeps around for kernel_create()
+ * to reuse.
+ */
+#define	KERNEL_IDLE_MAX		64
+
+/*
+ * The most GPU buffers and images that buffer_free() keeps around for
+ * buffer_alloc() and ocl_image_create() to reuse, and the fraction of the
+ * GPU's memory that they can take up.
+ */
+#define	BUFFER_POOL_MAX		64
+#define	TRANSIENT_MAX		8	/* memory shared by transients */
+#define	BUFFER_POOL_FRACTION	4	/* i.e. 1/4 */
+
+/*
+ * The most host_alloc() buffers that can exist at once.
+ */
+#define	HOST_MEM_MAX		16
+
+/*
+ * GPU memory accounting: the most source files that can own buffers, the
+ * most live buffers and images that are kept track of, and how much of the
+ * GPU's memory we expect to be able to use.
+ */
+#define	MEM_OWNERS_MAX		32
+#define	MEM_TRACK_MAX		1024
+#define	MEM_FIT_FRACTION	0.9
+
+/*
+ * The most asynchronous readbacks that can be outstanding at once.
+ */
+#define	READBACK_MAX		16
+
+/*
+ * How many times in a row opencl_specialize() has to be asked for the same
+ * options before it starts building a program for them.
+ */
+#define	SPEC_SETTLE_CALLS	50
+
+/*
+ * The most OpenCL platforms (i.e. installed drivers) that are looked at
+ * when running headless.
+ */
+#define	OPENCL_MAX_PLATFORMS	8
+
+typedef struct {
+	const char	*ks_method;
+	uint64_t	ks_count;
+	hrtime_t	ks_total;
+	hrtime_t	ks_worst;
+} kernel_stats_t;
+
+typedef struct {
+	char		*kp_source;	/* prelude + ks_source */
+	cl_program	kp_program;	/* the one in use */
+	cl_program	kp_generic;	/* built without options */
+	cl_program	kp_building;	/* set by the build thread */
+	bool		kp_pending;	/* build thread is running */
+	pthread_t	kp_thread;
+	hrtime_t	kp_start;	/* when the build started */
+} kernel_program_t;
+
+typedef struct {
+	const char	*ki_method;
+	cl_program	ki_program;	/* what it was created from */
+	cl_kernel	ki_kernel;
+} kernel_idle_t;
+
+typedef struct {
+	cl_mem			bp_mem;
+	cl_mem_object_type	bp_type;
+	size_t			bp_size;
+	cl_image_format		bp_format;	/* images only */
+	size_t			bp_width;	/* images only */
+	size_t			bp_height;	/* images only */
+} buffer_pool_t;
+
+typedef struct {
+	cl_mem		ts_mem;
+	size_t		ts_size;
+	int		ts_nusers;
+	int		ts_users[TR_NPHASES];	/* ... in each phase */
+} transient_slot_t;
+
+typedef struct {
+	const char	*mo_name;	/* source file, from __FILE__ */
+	int		mo_count;	/* live buffers and images */
+	uint64_t	mo_live;	/* bytes in them */
+	uint64_t	mo_peak;	/* most bytes there have been */
+} mem_owner_t;
+
+typedef struct {
+	cl_mem		mt_mem;
+	size_t		mt_size;
+	int		mt_owner;	/* index into owners[] */
+} mem_track_t;
+
+typedef struct {
+	uint8_t		*hm_ptr;
+	size_t		hm_size;
+	cl_mem		hm_mem;		/* NULL if it's just mem_alloc() */
+	bool		hm_owned;	/* hm_ptr is ours, not the driver's */
+} host_mem_t;
+
+typedef struct {
+	cl_event	rb_event;	/* when the data is there */
+	void		*rb_dst;
+	readback_cb_t	rb_cb;
+	void		*rb_arg;
+} readback_t;
+
 static struct {
 	cl_context		context;
 	cl_command_queue	commands;
-	cl_program		program;
+	cl_command_queue	current;	/* where work is enqueued */
+
+	/*
+	 * The extra command queues; streams[0] is "commands".
+	 */
+	cl_command_queue	streams[OPENCL_MAX_STREAMS];
+	int			nstreams;
+	int			curstream;
+	bool			forked;
+	bool			stream_used[OPENCL_MAX_STREAMS];
+	cl_event		fork_event;
+
+	/*
+	 * The display's own command queue; see opencl_display_enable().
+	 */
+	bool			display_wanted;
+	cl_command_queue	display;
+
+	kernel_program_t	programs[NPROGRAMS];
 	cl_device_id		deviceid;
 
+	bool			cpu;		/* see opencl_cpu_enable() */
+	bool			picked;		/* see opencl_device_pick() */
+	int			pick;
+
+	kernel_data_t		*kernels[KERNEL_MAX_KERNELS];
+	int			nkernels;
+	kernel_idle_t		idle[KERNEL_IDLE_MAX];	/* kernel_cleanup() */
+	int			nidle;
+
+	/*
+	 * Freed buffers and images, oldest first; see buffer_free().
+	 */
+	buffer_pool_t		pool[BUFFER_POOL_MAX];
+	int			npool;
+	uint64_t		pool_bytes;
+
+	/*
+	 * Memory shared by transient buffers; see transient_alloc().
+	 */
+	transient_slot_t	transients[TRANSIENT_MAX];
+
+	/*
+	 * Who holds what; see opencl_mem_report().  Pooled buffers aren't
+	 * counted here.
+	 */
+	mem_owner_t		owners[MEM_OWNERS_MAX];
+	int			nowners;
+	mem_track_t		tracked[MEM_TRACK_MAX];
+	int			ntracked;
+	uint64_t		mem_live;	/* bytes, all owners */
+	uint64_t		mem_peak;
+	double			mem_perpixel;	/* mem_live / pixels */
+
+	host_mem_t		host[HOST_MEM_MAX];	/* see host_alloc() */
+
+	/*
+	 * Outstanding asynchronous readbacks, oldest first.
+	 */
+	readback_t		readbacks[READBACK_MAX];
+	int			nreadbacks;
+
+	/*
+	 * Specialized versions of the core program; see opencl_specialize().
+	 */
+	bool			spec_disabled;
+	char			spec_active[512];	/* options dealt with */
+	char			spec_want[512];		/* being settled on */
+	int			spec_calls;	/* # calls with spec_want */
+	cl_program		spec_building;
+	char			spec_building_opts[512];
+	volatile bool		spec_built;	/* set by build callback */
+
 	char			device_vendor[1024];
 	char			device_name[1024];
+	char			driver_version[1024];
 	size_t			max_work_items[3];
+	cl_ulong		local_mem_size;
+	cl_ulong		global_mem_size;
+	cl_uint			compute_units;
+	size_t			image2d_max[2];		/* width, height */
+	cl_bool			unified_mem;
+
+	bool			profiling;	/* queue can profile events */
+	bool			timing;		/* kernel_timing_start() */
+	hrtime_t		timing_start;	/* host time, w/o profiling */
+	hrtime_t		timing_total;	/* GPU time of reaped events */
+	int			ntiming;	/* # events in timing_events */
+	cl_event		timing_events[KERNEL_TIMING_MAX];
+
+	kernel_stats_t		stats[KERNEL_STATS_MAX];
+	int			nstats;
+	cl_event		pending[KERNEL_STATS_PENDING];	/* ring */
+	int			pending_kernel[KERNEL_STATS_PENDING];
+	int			pending_head;	/* oldest outstanding */
+	int			npending;
+	uint64_t		dropped;	/* launches not counted */
+	hrtime_t		stats_lastdump;
+
+	bool			tracing;	/* opencl_trace_start() */
+	hrtime_t		trace_offset;	/* host ns - GPU ns */
+	cl_event		trace_pending[KERNEL_TRACE_PENDING]; /* ring */
+	const char		*trace_name[KERNEL_TRACE_PENDING];
+	int			trace_stream[KERNEL_TRACE_PENDING];
+	int			trace_head;	/* oldest outstanding */
+	int			ntrace;
+
+	struct kernel_graph	*recording;	/* graph being recorded */
+	int			graph_generation;
+	bool			graphs_disabled;
+	bool			cmdbuf_ok;	/* cl_khr_command_buffer */
+	bool			gl_event;	/* cl_khr_gl_event */
+#ifdef	cl_khr_command_buffer
+	clCreateCommandBufferKHR_fn	create_cmdbuf;
+	clCommandNDRangeKernelKHR_fn	cmdbuf_ndrange;
+	clFinalizeCommandBufferKHR_fn	finalize_cmdbuf;
+	clEnqueueCommandBufferKHR_fn	enqueue_cmdbuf;
+	clReleaseCommandBufferKHR_fn	release_cmdbuf;
+#endif
 } Opencl;
 
+static void	kernel_timing_reap(void);
+static bool	device_has_extension(const char *name);
+static void	kernel_graph_init(void);
+static void	kernel_graph_break(void);
+static void	kernel_graph_add(kernel_data_t *, int, const size_t *,
+		    const size_t *);
+static void	kernel_args_forget(cl_mem mem);
+static void	kernel_stats_reap(void);
+static void	kernel_stats_toggle(void);
+static void	kernel_trace_add(cl_event ev, const char *name);
+static void	buffer_pool_flush(void);
+
 /* ------------------------------------------------------------------ */
 
 const char *
@@ -53,12 +373,43 @@ opencl_device_name(void)
 	return (Opencl.device_name);
 }
 
+const char *
+opencl_driver_version(void)
+{
+	return (Opencl.driver_version);
+}
+
 size_t
 opencl_device_maxwgsize(void)
 {
 	return (MIN(Opencl.max_work_items[0], Opencl.max_work_items[1]));
 }
 
+void
+opencl_device_image2d_max(pix_t *width, pix_t *height)
+{
+	*width = (pix_t)MIN(Opencl.image2d_max[0], UINT32_MAX);
+	*height = (pix_t)MIN(Opencl.image2d_max[1], UINT32_MAX);
+}
+
+size_t
+opencl_device_localmem(void)
+{
+	return ((size_t)Opencl.local_mem_size);
+}
+
+uint64_t
+opencl_device_globalmem(void)
+{
+	return ((uint64_t)Opencl.global_mem_size);
+}
+
+int
+opencl_device_computeunits(void)
+{
+	return ((int)Opencl.compute_units);
+}
+
 /*
  * Initialization code.
  */
@@ -164,7 +515,8 @@ create_compute_device(void)
 
 		clGetDeviceInfo(d, CL_DEVICE_TYPE,
 		    sizeof (cl_device_type), &device_type, NULL);
-		if (device_type != CL_DEVICE_TYPE_GPU) {
+		if ((device_type & (Opencl.cpu ?
+		    CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU)) == 0) {
 			continue;
 		}
 		err = clGetDeviceInfo(d, CL_DEVICE_HOST_UNIFIED_MEMORY,
@@ -186,13 +538,15 @@ create_compute_device(void)
 		 */
 		if (image_support && (devid == NULL || !unified_mem)) {
 			devid = d;
+			Opencl.unified_mem = unified_mem;
 		}
 	}
 	if (devid == NULL) {
-		die("Failed to locate compute device\n");
+		die("Failed to locate compute device%s\n", (Opencl.cpu ? "" :
+		    "; \"-c\" will use the CPU, if it has an OpenCL driver"));
 	}
 
-	/* save these for boxparams */
+	/* save these for boxparams and its tuning cache */
 	err = clGetDeviceInfo(devid, CL_DEVICE_VENDOR,
 	    sizeof (Opencl.device_vendor), (cl_char *)Opencl.device_vendor,
 	    &returned_size);
@@ -205,55 +559,483 @@ create_compute_device(void)
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to retrieve device name");
 	}
+	err = clGetDeviceInfo(devid, CL_DRIVER_VERSION,
+	    sizeof (Opencl.driver_version), (cl_char *)Opencl.driver_version,
+	    &returned_size);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to retrieve driver version");
+	}
 	err = clGetDeviceInfo(devid, CL_DEVICE_MAX_WORK_ITEM_SIZES,
 	    sizeof (Opencl.max_work_items), &Opencl.max_work_items, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to retrieve kernel work group sizes");
 	}
+	err = clGetDeviceInfo(devid, CL_DEVICE_LOCAL_MEM_SIZE,
+	    sizeof (Opencl.local_mem_size), &Opencl.local_mem_size, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to retrieve local memory size");
+	}
+	err = clGetDeviceInfo(devid, CL_DEVICE_GLOBAL_MEM_SIZE,
+	    sizeof (Opencl.global_mem_size), &Opencl.global_mem_size, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to retrieve global memory size");
+	}
+	err = clGetDeviceInfo(devid, CL_DEVICE_MAX_COMPUTE_UNITS,
+	    sizeof (Opencl.compute_units), &Opencl.compute_units, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to retrieve max compute units");
+	}
+	err = clGetDeviceInfo(devid, CL_DEVICE_IMAGE2D_MAX_WIDTH,
+	    sizeof (Opencl.image2d_max[0]), &Opencl.image2d_max[0], NULL);
+	if (err == CL_SUCCESS) {
+		err = clGetDeviceInfo(devid, CL_DEVICE_IMAGE2D_MAX_HEIGHT,
+		    sizeof (Opencl.image2d_max[1]), &Opencl.image2d_max[1],
+		    NULL);
+	}
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to retrieve image size limits");
+	}
 
 	report_device(devid, "Connecting to");
 
 	return (devid);
 }
 
+/*
+ * The program binary cache.
+ *
+ * Building the program from source can take several seconds on some
+ * drivers, so the built binary is saved in the cache directory and loaded
+ * from there on the next run.  Each combination of device, driver, build
+ * options and kernel source gets its own file, named by a hash of that
+ * combination.  The file starts with a text header holding the full key
+ * (with the source stood in for by its hash and length), which is checked
+ * when reading it back in, followed by the binary itself:
+ *
+ *	# zounds program binary cache
+ *	device <device name>
+ *	driver <driver version>
+ *	options <build options>
+ *	source <hash> <length>
+ *	<binary>
+ *
+ * If the driver rejects a cached binary, we just build from source and
+ * overwrite it.
+ */
+
+#define	PROGRAM_CACHE_MAGIC	"# zounds program binary cache"
+
+/*
+ * 64-bit FNV-1a, continuing from "h"; passing 0 starts a new hash.
+ */
+static uint64_t
+program_cache_hash(uint64_t h, const char *str)
+{
+	if (h == 0) {
+		h = 14695981039346656037ull;
+	}
+	for (const char *p = str; *p != '\0'; p++) {
+		h = (h ^ (uint8_t)*p) * 1099511628211ull;
+	}
+
+	return (h);
+}
+
+static void
+program_cache_key(const char *source, const char *options,
+    char *buf, size_t len)
+{
+	(void) snprintf(buf, len,
+	    "device %s\ndriver %s\noptions %s\nsource %016llx %zu\n",
+	    Opencl.device_name, Opencl.driver_version, options,
+	    (unsigned long long)program_cache_hash(0, source), strlen(source));
+}
+
+static bool
+program_cache_file(const char *key, char *buf, size_t len)
+{
+	char	name[32];
+
+	(void) snprintf(name, sizeof (name), "program.%016llx",
+	    (unsigned long long)program_cache_hash(0, key));
+
+	return (cache_path(name, buf, len));
+}
+
+/*
+ * Returns the built program from the cache, or NULL if there isn't a
+ * usable one.
+ */
 static cl_program
-create_program(void)
+program_cache_load(const char *key, const char *options)
 {
-	const char	*source;
+	char		path[1024], line[2048];
+	const char	*expect, *next;
+	unsigned char	*binary;
+	struct stat	st;
+	size_t		len;
+	long		off;
 	cl_program	prog;
-	cl_int		err;
+	cl_int		status, err;
+	FILE		*fp;
+
+	if (!program_cache_file(key, path, sizeof (path))) {
+		return (NULL);
+	}
+	if ((fp = fopen(path, "rb")) == NULL) {
+		verbose(DB_OPENCL, "No program binary cache at \"%s\"\n", path);
+		return (NULL);
+	}
+
+	/*
+	 * Make sure the header matches our key, line by line.
+	 */
+	if (fgets(line, sizeof (line), fp) == NULL ||
+	    strncmp(line, PROGRAM_CACHE_MAGIC,
+	    strlen(PROGRAM_CACHE_MAGIC)) != 0) {
+		warn("Ignoring malformed program binary cache \"%s\"\n", path);
+		fclose(fp);
+		return (NULL);
+	}
+	for (expect = key; *expect != '\0'; expect = next) {
+		next = strchr(expect, '\n') + 1;
+		if (fgets(line, sizeof (line), fp) == NULL ||
+		    strncmp(line, expect, next - expect) != 0) {
+			verbose(DB_OPENCL, "Program binary cache \"%s\" is for "
+			    "a different configuration\n", path);
+			fclose(fp);
+			return (NULL);
+		}
+	}
+
+	/*
+	 * The rest of the file is the binary.
+	 */
+	if (fstat(fileno(fp), &st) != 0 || (off = ftell(fp)) < 0 ||
+	    st.st_size <= off) {
+		warn("Ignoring truncated program binary cache \"%s\"\n", path);
+		fclose(fp);
+		return (NULL);
+	}
+	len = (size_t)(st.st_size - off);
+	binary = mem_alloc(len);
+	if (fread(binary, 1, len, fp) != len) {
+		warn("Couldn't read program binary cache \"%s\"\n", path);
+		mem_free((void **)&binary);
+		fclose(fp);
+		return (NULL);
+	}
+	fclose(fp);
+
+	prog = clCreateProgramWithBinary(Opencl.context, 1, &Opencl.deviceid,
+	    &len, (const unsigned char **)&binary, &status, &err);
+	mem_free((void **)&binary);
+	if (err != CL_SUCCESS || status != CL_SUCCESS) {
+		verbose(DB_OPENCL, "Driver rejected program binary cache "
+		    "\"%s\"\n", path);
+		if (prog != NULL) {
+			clReleaseProgram(prog);
+		}
+		return (NULL);
+	}
 
-	source = Kernel_source;			/* from kernelsrc.c */
-	prog = clCreateProgramWithSource(Opencl.context, 1,
-	    (const char **)&source, NULL, &err);
+	/*
+	 * A program created from a binary still has to be "built", though
+	 * this is generally quick.
+	 */
+	err = clBuildProgram(prog, 1, &Opencl.deviceid, options, NULL, NULL);
 	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to create compute program");
+		verbose(DB_OPENCL, "Couldn't build program from binary cache "
+		    "\"%s\"\n", path);
+		clReleaseProgram(prog);
+		return (NULL);
+	}
+
+	verbose(DB_OPENCL, "Loaded program binary from \"%s\"\n", path);
+	return (prog);
+}
+
+static void
+program_cache_save(cl_program prog, const char *key)
+{
+	char		path[1024], tmppath[1100];
+	cl_device_id	*devices;
+	unsigned char	**binaries;
+	size_t		*sizes;
+	cl_uint		ndevices, d;
+	cl_int		err;
+	FILE		*fp;
+
+	if (!program_cache_file(key, path, sizeof (path))) {
+		return;
 	}
 
 	/*
-	 * Build the program executable.
+	 * The program may have been built for more than one device, so
+	 * find the binary for the one we're using.
 	 */
-	err = clBuildProgram(prog, 0, NULL, NULL, NULL, NULL);
+	err = clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES,
+	    sizeof (ndevices), &ndevices, NULL);
+	if (err != CL_SUCCESS || ndevices == 0) {
+		return;
+	}
+	devices = mem_alloc(ndevices * sizeof (cl_device_id));
+	sizes = mem_alloc(ndevices * sizeof (size_t));
+	binaries = mem_alloc(ndevices * sizeof (unsigned char *));
+	bzero(binaries, ndevices * sizeof (unsigned char *));
+
+	if (clGetProgramInfo(prog, CL_PROGRAM_DEVICES,
+	    ndevices * sizeof (cl_device_id), devices, NULL) != CL_SUCCESS ||
+	    clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES,
+	    ndevices * sizeof (size_t), sizes, NULL) != CL_SUCCESS) {
+		goto out;
+	}
+	for (d = 0; d < ndevices; d++) {
+		if (devices[d] == Opencl.deviceid) {
+			break;
+		}
+	}
+	if (d == ndevices || sizes[d] == 0) {
+		goto out;
+	}
+	binaries[d] = mem_alloc(sizes[d]);
+	if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES,
+	    ndevices * sizeof (unsigned char *), binaries, NULL) !=
+	    CL_SUCCESS) {
+		goto out;
+	}
+
+	(void) snprintf(tmppath, sizeof (tmppath), "%s.%d",
+	    path, (int)getpid());
+	if ((fp = fopen(tmppath, "wb")) == NULL) {
+		warn("Couldn't write program binary cache \"%s\"", tmppath);
+		goto out;
+	}
+	fprintf(fp, "%s\n%s", PROGRAM_CACHE_MAGIC, key);
+	(void) fwrite(binaries[d], 1, sizes[d], fp);
+	if (fclose(fp) != 0 || rename(tmppath, path) != 0) {
+		warn("Couldn't update program binary cache \"%s\"", path);
+		(void) unlink(tmppath);
+		goto out;
+	}
+
+	debug(DB_OPENCL, "Saved program binary cache \"%s\"\n", path);
+out:
+	for (d = 0; d < ndevices; d++) {
+		if (binaries[d] != NULL) {
+			mem_free((void **)&binaries[d]);
+		}
+	}
+	mem_free((void **)&binaries);
+	mem_free((void **)&sizes);
+	mem_free((void **)&devices);
+}
+
+static void
+program_build_failed(cl_program prog)
+{
+	char	*buffer;
+	size_t	len;
+
+	warn("Failed to build program executable\n");
+
+	clGetProgramBuildInfo(prog, Opencl.deviceid,
+	    CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+	buffer = mem_alloc(len);
+
+	clGetProgramBuildInfo(prog, Opencl.deviceid,
+	    CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
+	die("%s\n", buffer);
+}
+
+static void CL_CALLBACK
+program_build_done(cl_program prog, void *arg)
+{
+	// This may be called from another thread.
+	*(volatile bool *)arg = true;
+}
+
+static const char *
+program_source(int p)
+{
+	kernel_program_t	*kp = &Opencl.programs[p];
+
+	if (kp->kp_source == NULL) {
+		const char	*src = Kernel_sources[p].ks_source;
+		const size_t	plen = strlen(Kernel_prelude);
+		const size_t	slen = strlen(src);
+		char		tile[64] = "";
+		size_t		tlen;
+
+		if (explore_tile() != 0) {
+			(void) snprintf(tile, sizeof (tile),
+			    "#define ZOUNDS_TILE %u\n",
+			    (unsigned)explore_tile());
+		}
+		tlen = strlen(tile);
+
+		kp->kp_source = mem_alloc(tlen + plen + slen + 1);
+		memcpy(kp->kp_source, tile, tlen);
+		memcpy(kp->kp_source + tlen, Kernel_prelude, plen);
+		memcpy(kp->kp_source + tlen + plen, src, slen + 1);
+	}
+
+	return (kp->kp_source);
+}
+
+/*
+ * Find the program that holds the kernel "method".
+ */
+static int
+program_find(const char *method)
+{
+	char	pattern[256];
+
+	(void) snprintf(pattern, sizeof (pattern), " %s ", method);
+	for (int p = 0; p < NPROGRAMS; p++) {
+		if (strstr(Kernel_sources[p].ks_kernels, pattern) != NULL) {
+			return (p);
+		}
+	}
+
+	die("No OpenCL program has a kernel named \"%s\"\n", method);
+	return (-1);
+}
+
+/*
+ * Build program "p", from the binary cache if it has it.  This runs on a
+ * thread of its own, so that the programs can be built while the rest of
+ * the program starts up; clBuildProgram() can take a callback rather than
+ * blocking, but not every driver does that.  The OpenCL calls here are safe
+ * from any thread, and nothing else touches "kp" until program_wait().
+ */
+static void *
+program_build(void *arg)
+{
+	const int		p = (int)(intptr_t)arg;
+	kernel_program_t	*kp = &Opencl.programs[p];
+	const char		*options = "";
+	const char		*source = kp->kp_source;
+	cl_build_status		status;
+	char			key[4096];
+	cl_program		prog;
+	cl_int			err;
+
+	program_cache_key(source, options, key, sizeof (key));
+	if ((prog = program_cache_load(key, options)) != NULL) {
+		kp->kp_building = prog;
+		return (NULL);
+	}
+
+	prog = clCreateProgramWithSource(Opencl.context, 1, &source, NULL,
+	    &err);
 	if (err != CL_SUCCESS) {
-		char	*buffer;
-		size_t	len;
+		ocl_die(err, "Failed to create compute program \"%s\"",
+		    Kernel_sources[p].ks_name);
+	}
 
-		warn("Failed to build program executable\n");
+	debug(DB_OPENCL, "Building program \"%s\"\n",
+	    Kernel_sources[p].ks_name);
+	err = clBuildProgram(prog, 1, &Opencl.deviceid, options, NULL, NULL);
+	if (err == CL_SUCCESS) {
+		err = clGetProgramBuildInfo(prog, Opencl.deviceid,
+		    CL_PROGRAM_BUILD_STATUS, sizeof (status), &status, NULL);
+	}
+	if (err != CL_SUCCESS || status != CL_BUILD_SUCCESS) {
+		program_build_failed(prog);
+	}
+
+	debug(DB_OPENCL, "Built program \"%s\" in %.1f msec\n",
+	    Kernel_sources[p].ks_name,
+	    (double)(gethrtime() - kp->kp_start) / 1000000.0);
+	program_cache_save(prog, key);
+
+	kp->kp_building = prog;
+	return (NULL);
+}
+
+/*
+ * Get program "p" going, if it isn't already.  If the binary cache has
+ * it, that's quick; otherwise, it's built in the background, so that
+ * several programs can be built at once.
+ */
+static void
+program_start(int p)
+{
+	kernel_program_t	*kp = &Opencl.programs[p];
 
-		clGetProgramBuildInfo(prog, Opencl.deviceid,
-		    CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-		buffer = mem_alloc(len);
+	if (kp->kp_generic != NULL || kp->kp_pending) {
+		return;
+	}
 
-		clGetProgramBuildInfo(prog, Opencl.deviceid,
-		    CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
-		die("%s\n", buffer);
+	kp->kp_start = gethrtime();
+	(void) program_source(p);
+	kp->kp_building = NULL;
+	kp->kp_pending = true;
+	if (pthread_create(&kp->kp_thread, NULL, program_build,
+	    (void *)(intptr_t)p) != 0) {
+		kp->kp_pending = false;
+		(void) program_build((void *)(intptr_t)p);
+		kp->kp_program = kp->kp_generic = kp->kp_building;
+		kp->kp_building = NULL;
 	}
+}
 
-	return (prog);
+/*
+ * Wait for program "p" to be built, starting it first if need be.
+ */
+static void
+program_wait(int p)
+{
+	kernel_program_t	*kp = &Opencl.programs[p];
+	hrtime_t		start;
+
+	program_start(p);
+	if (!kp->kp_pending) {
+		return;
+	}
+
+	start = gethrtime();
+	(void) pthread_join(kp->kp_thread, NULL);
+	kp->kp_pending = false;
+	kp->kp_program = kp->kp_generic = kp->kp_building;
+	kp->kp_building = NULL;
+
+	debug(DB_OPENCL, "Waited %.1f msec for program \"%s\"\n",
+	    (double)(gethrtime() - start) / 1000000.0,
+	    Kernel_sources[p].ks_name);
+}
+
+/*
+ * Find the first platform that has any devices of type "type", and how
+ * many it has.
+ */
+static bool
+find_platform(cl_device_type type, cl_platform_id *platformp, cl_uint *ndevp)
+{
+	cl_platform_id	platforms[OPENCL_MAX_PLATFORMS];
+	cl_uint		nplat;
+	cl_int		err;
+
+	err = clGetPlatformIDs(OPENCL_MAX_PLATFORMS, platforms, &nplat);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to get platform IDs");
+	}
+	nplat = MIN(nplat, OPENCL_MAX_PLATFORMS);
+
+	for (cl_uint p = 0; p < nplat; p++) {
+		err = clGetDeviceIDs(platforms[p], type, 0, NULL, ndevp);
+		if (err == CL_SUCCESS && *ndevp > 0) {
+			*platformp = platforms[p];
+			return (true);
+		}
+	}
+	return (false);
 }
 
 /*
- * Create an OpenCL context without using OpenGL.
+ * Create an OpenCL context without using OpenGL.  This uses a GPU if
+ * there is one, and the CPU's OpenCL device otherwise (or if asked to).
  */
 static cl_context
 create_cl_context_nogfx(void)
@@ -261,25 +1043,30 @@ create_cl_context_nogfx(void)
 	cl_platform_id	platform;
 	cl_context	ctx;
 	cl_int		err;
-	cl_uint		ndev;
+	cl_uint		ndev, d;
 	cl_device_id	*devs;
+	cl_device_type	type;
 
 	cl_context_properties *const properties = NULL;
 
-	err = clGetPlatformIDs(1, &platform, NULL);
-	if (err != 0) {
-		ocl_die(err, "Failed to get platform ID");
+	if (!Opencl.cpu &&
+	    !find_platform(CL_DEVICE_TYPE_GPU, &platform, &ndev)) {
+		warn("No OpenCL GPU found; using the CPU instead\n");
+		Opencl.cpu = true;
 	}
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &ndev);
-	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to get device count");
+	if (Opencl.cpu &&
+	    !find_platform(CL_DEVICE_TYPE_CPU, &platform, &ndev)) {
+		die("Failed to find an OpenCL driver for the CPU\n");
 	}
+	type = (Opencl.cpu ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU);
+
 	devs = mem_alloc(ndev * sizeof (cl_device_id));
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, ndev, devs, NULL);
+	err = clGetDeviceIDs(platform, type, ndev, devs, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to get device list");
 	}
-	ctx = clCreateContext(properties, 1, &devs[ndev - 1], NULL, NULL, &err);
+	d = (Opencl.picked ? (cl_uint)Opencl.pick % ndev : ndev - 1);
+	ctx = clCreateContext(properties, 1, &devs[d], NULL, NULL, &err);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to create a compute context");
 	}
@@ -298,6 +1085,8 @@ opencl_preinit(void)
 	int err;
 
 	debug_register_toggle('o', "OpenCL", DB_OPENCL, NULL);
+	debug_register_toggle('g', "GPU kernel stats", DB_GPU,
+	    kernel_stats_toggle);
 
 	if (window_graphics()) {
 		Opencl.context = create_cl_context();
@@ -305,26 +1094,97 @@ opencl_preinit(void)
 		Opencl.context = create_cl_context_nogfx();
 	}
 	Opencl.deviceid = create_compute_device();
-	Opencl.program = create_program();
 
-	Opencl.commands =
-	    clCreateCommandQueue(Opencl.context, Opencl.deviceid, 0, &err);
+	Opencl.commands = clCreateCommandQueue(Opencl.context, Opencl.deviceid,
+	    (Opencl.profiling ? CL_QUEUE_PROFILING_ENABLE : 0), &err);
 	if (Opencl.commands == NULL) {
 		ocl_die(err, "Failed to create the command queue");
 	}
-}
-
-/*
- * Tear this context down before we exit.  Probably not strictly needed,
- * but seems wise.
- */
-static void
-opencl_postfini(void)
-{
-	clFinish(Opencl.commands);
+	Opencl.current = Opencl.streams[0] = Opencl.commands;
 
+	if (Opencl.nstreams == 0) {
+		Opencl.nstreams = 1;
+	}
+	for (int s = 1; s < Opencl.nstreams; s++) {
+		Opencl.streams[s] = clCreateCommandQueue(Opencl.context,
+		    Opencl.deviceid, (Opencl.profiling ?
+		    CL_QUEUE_PROFILING_ENABLE : 0), &err);
+		if (Opencl.streams[s] == NULL) {
+			ocl_die(err, "Failed to create command queue %d", s);
+		}
+	}
+	debug(DB_OPENCL, "Using %d command queue(s)\n", Opencl.nstreams);
+	if (Opencl.display_wanted) {
+		Opencl.display = clCreateCommandQueue(Opencl.context,
+		    Opencl.deviceid, 0, &err);
+		if (Opencl.display == NULL) {
+			ocl_die(err, "Failed to create the display queue");
+		}
+	}
+
+	kernel_graph_init();
+	Opencl.gl_event = device_has_extension("cl_khr_gl_event");
+
+	/*
+	 * Every core needs the core program, so get that going while the
+	 * other modules are being set up.
+	 */
+	program_start(CORE_PROGRAM);
+}
+
+/*
+ * Tear this context down before we exit.  Probably not strictly needed,
+ * but seems wise.
+ */
+static void
+opencl_postfini(void)
+{
+	kernel_wait();
+
+	/*
+	 * Hand the GPU's last spans over to the trace, which gets written
+	 * out after this.
+	 */
+	opencl_trace_stop();
+
+	kernel_stats_reap();
+	assert(Opencl.npending == 0);
+	if (debug_enabled(DB_GPU)) {
+		kernel_stats_dump();
+	}
+
+	assert(Opencl.nreadbacks == 0);
+	buffer_pool_flush();
+	for (int i = 0; i < Opencl.nidle; i++) {
+		clReleaseKernel(Opencl.idle[i].ki_kernel);
+	}
+
+	for (int s = 1; s < Opencl.nstreams; s++) {
+		clReleaseCommandQueue(Opencl.streams[s]);
+	}
+	if (Opencl.display != NULL) {
+		clReleaseCommandQueue(Opencl.display);
+	}
 	clReleaseCommandQueue(Opencl.commands);
-	clReleaseProgram(Opencl.program);
+	if (Opencl.spec_building != NULL) {
+		clReleaseProgram(Opencl.spec_building);
+	}
+	for (int p = 0; p < NPROGRAMS; p++) {
+		kernel_program_t	*kp = &Opencl.programs[p];
+
+		if (kp->kp_pending) {
+			program_wait(p);
+		}
+		if (kp->kp_program != kp->kp_generic) {
+			clReleaseProgram(kp->kp_program);
+		}
+		if (kp->kp_generic != NULL) {
+			clReleaseProgram(kp->kp_generic);
+		}
+		if (kp->kp_source != NULL) {
+			mem_free((void **)&kp->kp_source);
+		}
+	}
 	clReleaseContext(Opencl.context);
 
 	bzero(&Opencl, sizeof (Opencl));
@@ -339,22 +1199,520 @@ const module_ops_t	opencl_ops = {
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * Host memory for transfers; see opencl.h.
+ *
+ * On a GPU with its own memory, this is a pinned buffer that stays mapped
+ * the whole time, which lets the driver DMA straight to and from it; the
+ * transfer routines just use it like any other host memory.  On a GPU that
+ * shares memory with the host, it's page-aligned memory of our own that
+ * the GPU uses in place (CL_MEM_USE_HOST_PTR), so a transfer is a copy on
+ * the GPU's side between that and the destination: the buffer is unmapped
+ * for the copy, and mapped again afterwards (which waits for the copy, and
+ * doesn't move anything).  An asynchronous readback maps it again without
+ * waiting, and hands the map's event to readback_poll() instead.
+ */
+static void
+host_mem_map(host_mem_t *hm, cl_event *evp)
+{
+	void	*ptr;
+	cl_int	err;
+
+	ptr = clEnqueueMapBuffer(Opencl.current, hm->hm_mem,
+	    (evp == NULL ? CL_TRUE : CL_FALSE), CL_MAP_READ | CL_MAP_WRITE,
+	    0, hm->hm_size, 0, NULL, evp, &err);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to map host buffer");
+	}
+	if (hm->hm_ptr == NULL) {
+		hm->hm_ptr = ptr;
+	}
+	assert(ptr == hm->hm_ptr);
+}
+
+static void
+host_mem_unmap(host_mem_t *hm)
+{
+	cl_int	err;
+
+	err = clEnqueueUnmapMemObject(Opencl.current, hm->hm_mem, hm->hm_ptr,
+	    0, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to unmap host buffer");
+	}
+}
+
+static host_mem_t *
+host_mem_find(const void *ptr)
+{
+	for (int i = 0; i < HOST_MEM_MAX; i++) {
+		if (Opencl.host[i].hm_ptr == ptr) {
+			return (&Opencl.host[i]);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * If [ptr, ptr + size) is in a host_alloc() buffer that the GPU uses in
+ * place, return that buffer, and how far into it "ptr" is.
+ */
+static host_mem_t *
+host_mem_shared(const void *ptr, size_t size, size_t *offp)
+{
+	const uint8_t	*p = ptr;
+
+	if (!Opencl.unified_mem) {
+		return (NULL);
+	}
+	for (int i = 0; i < HOST_MEM_MAX; i++) {
+		host_mem_t	*hm = &Opencl.host[i];
+
+		if (hm->hm_mem != NULL && p >= hm->hm_ptr &&
+		    p + size <= hm->hm_ptr + hm->hm_size) {
+			*offp = (size_t)(p - hm->hm_ptr);
+			return (hm);
+		}
+	}
+	return (NULL);
+}
+
+void *
+host_alloc(size_t size)
+{
+	host_mem_t	*hm = NULL;
+	void		*ptr;
+	cl_int		err;
+
+	for (int i = 0; i < HOST_MEM_MAX; i++) {
+		if (Opencl.host[i].hm_ptr == NULL) {
+			hm = &Opencl.host[i];
+			break;
+		}
+	}
+	if (hm == NULL) {
+		die("Too many host buffers; increase HOST_MEM_MAX\n");
+	}
+	bzero(hm, sizeof (*hm));
+	hm->hm_size = size;
+
+	if (Opencl.unified_mem) {
+		const size_t	len = P2ROUNDUP(size, 4096);
+
+		if (posix_memalign(&ptr, 4096, len) != 0) {
+			die("Failed to allocate %zu bytes\n", len);
+		}
+		hm->hm_ptr = ptr;
+		hm->hm_owned = true;
+		hm->hm_mem = clCreateBuffer(Opencl.context,
+		    CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, len, ptr, &err);
+	} else {
+		hm->hm_mem = clCreateBuffer(Opencl.context,
+		    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL,
+		    &err);
+	}
+
+	if (err == CL_SUCCESS) {
+		host_mem_map(hm, NULL);
+	} else {
+		/*
+		 * Plain memory still works, just more slowly.
+		 */
+		verbose(DB_OPENCL, "Couldn't create %zu-byte host buffer; "
+		    "using ordinary memory\n", size);
+		hm->hm_mem = NULL;
+		if (hm->hm_ptr == NULL) {
+			hm->hm_ptr = mem_alloc(size);
+			hm->hm_owned = true;
+		}
+	}
+
+	return (hm->hm_ptr);
+}
+
+void
+host_free(void **ptrp)
+{
+	host_mem_t	*hm;
+
+	if (*ptrp == NULL) {
+		return;		/* never allocated */
+	}
+	hm = host_mem_find(*ptrp);
+	assert(hm != NULL);
+	if (hm->hm_mem != NULL) {
+		host_mem_unmap(hm);
+		kernel_args_forget(hm->hm_mem);
+		clReleaseMemObject(hm->hm_mem);
+	}
+	if (hm->hm_owned) {
+		mem_free((void **)&hm->hm_ptr);
+	}
+	bzero(hm, sizeof (*hm));
+	*ptrp = NULL;
+}
+
+/* ------------------------------------------------------------------ */
+
 /*
  * OpenCL buffers.
  */
 
+/*
+ * Freed buffers and images go into a pool, so that when the window is
+ * resized - which frees and reallocates almost everything - the new ones
+ * can mostly come from there.  A pooled buffer can be used for anything
+ * that's no more than twice as big as what's asked for, which covers going
+ * back to a smaller size; images have to match exactly.  Nothing is taken
+ * from the pool while the streams are forked, since the buffer could still
+ * be in use by another stream.
+ */
+static void
+buffer_pool_remove(int i)
+{
+	Opencl.pool_bytes -= Opencl.pool[i].bp_size;
+	Opencl.npool--;
+	memmove(&Opencl.pool[i], &Opencl.pool[i + 1],
+	    (Opencl.npool - i) * sizeof (Opencl.pool[0]));
+}
+
+static void
+buffer_pool_flush(void)
+{
+	while (Opencl.npool > 0) {
+		kernel_args_forget(Opencl.pool[0].bp_mem);
+		clReleaseMemObject(Opencl.pool[0].bp_mem);
+		buffer_pool_remove(0);
+	}
+}
+
+/*
+ * Returns true if "buf" was put into the pool.
+ */
+static bool
+buffer_pool_put(cl_mem buf)
+{
+	const uint64_t	budget =
+	    Opencl.global_mem_size / BUFFER_POOL_FRACTION;
+	buffer_pool_t	bp;
+	cl_GLuint	glname;
+
+	/*
+	 * Objects shared with OpenGL belong to the texture that they came
+	 * from, so they can't be reused.
+	 */
+	if (clGetGLObjectInfo(buf, NULL, &glname) == CL_SUCCESS) {
+		return (false);
+	}
+
+	bzero(&bp, sizeof (bp));
+	bp.bp_mem = buf;
+	if (clGetMemObjectInfo(buf, CL_MEM_TYPE, sizeof (bp.bp_type),
+	    &bp.bp_type, NULL) != CL_SUCCESS ||
+	    clGetMemObjectInfo(buf, CL_MEM_SIZE, sizeof (bp.bp_size),
+	    &bp.bp_size, NULL) != CL_SUCCESS) {
+		return (false);
+	}
+	if (bp.bp_type == CL_MEM_OBJECT_IMAGE2D) {
+		if (clGetImageInfo(buf, CL_IMAGE_FORMAT,
+		    sizeof (bp.bp_format), &bp.bp_format, NULL) != CL_SUCCESS ||
+		    clGetImageInfo(buf, CL_IMAGE_WIDTH, sizeof (bp.bp_width),
+		    &bp.bp_width, NULL) != CL_SUCCESS ||
+		    clGetImageInfo(buf, CL_IMAGE_HEIGHT, sizeof (bp.bp_height),
+		    &bp.bp_height, NULL) != CL_SUCCESS) {
+			return (false);
+		}
+	} else if (bp.bp_type != CL_MEM_OBJECT_BUFFER) {
+		return (false);
+	}
+	if (bp.bp_size > budget) {
+		return (false);
+	}
+
+	/*
+	 * Make room by getting rid of the oldest ones.
+	 */
+	while (Opencl.npool > 0 && (Opencl.npool == BUFFER_POOL_MAX ||
+	    Opencl.pool_bytes + bp.bp_size > budget)) {
+		kernel_args_forget(Opencl.pool[0].bp_mem);
+		clReleaseMemObject(Opencl.pool[0].bp_mem);
+		buffer_pool_remove(0);
+	}
+
+	Opencl.pool[Opencl.npool++] = bp;
+	Opencl.pool_bytes += bp.bp_size;
+	return (true);
+}
+
+/*
+ * Take the smallest usable buffer, or an exactly matching image, out of
+ * the pool.  "format" is NULL for a buffer.
+ */
+static cl_mem
+buffer_pool_get(size_t size, const cl_image_format *format,
+    size_t width, size_t height)
+{
+	cl_mem	buf;
+	int	best = -1;
+
+	if (Opencl.forked) {
+		return (NULL);
+	}
+
+	for (int i = 0; i < Opencl.npool; i++) {
+		const buffer_pool_t	*bp = &Opencl.pool[i];
+
+		if (format == NULL) {
+			if (bp->bp_type != CL_MEM_OBJECT_BUFFER ||
+			    bp->bp_size < size || bp->bp_size / 2 > size) {
+				continue;
+			}
+		} else if (bp->bp_type != CL_MEM_OBJECT_IMAGE2D ||
+		    bp->bp_width != width || bp->bp_height != height ||
+		    bp->bp_format.image_channel_order !=
+		    format->image_channel_order ||
+		    bp->bp_format.image_channel_data_type !=
+		    format->image_channel_data_type) {
+			continue;
+		}
+		if (best == -1 || bp->bp_size < Opencl.pool[best].bp_size) {
+			best = i;
+		}
+	}
+	if (best == -1) {
+		return (NULL);
+	}
+
+	buf = Opencl.pool[best].bp_mem;
+	buffer_pool_remove(best);
+	return (buf);
+}
+
+/*
+ * GPU memory accounting.  buffer_alloc() and the image routines are macros
+ * that pass along the caller's __FILE__, so each buffer and image is
+ * charged to the source file that asked for it, from when it's allocated
+ * until it's freed (or goes into the pool).
+ */
+static int
+mem_owner(const char *file)
+{
+	const char	*slash = strrchr(file, '/');
+	const char	*name = (slash != NULL ? slash + 1 : file);
+	int		i;
+
+	for (i = 0; i < Opencl.nowners; i++) {
+		if (strcmp(Opencl.owners[i].mo_name, name) == 0) {
+			return (i);
+		}
+	}
+	if (Opencl.nowners == MEM_OWNERS_MAX) {
+		return (MEM_OWNERS_MAX - 1);	/* lump the rest together */
+	}
+	Opencl.owners[i].mo_name = name;
+	Opencl.nowners++;
+
+	return (i);
+}
+
+static void
+mem_track(cl_mem mem, const char *file)
+{
+	mem_track_t	*mt;
+	mem_owner_t	*mo;
+	size_t		size;
+
+	if (Opencl.ntracked == MEM_TRACK_MAX ||
+	    clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof (size), &size,
+	    NULL) != CL_SUCCESS) {
+		return;
+	}
+
+	mt = &Opencl.tracked[Opencl.ntracked++];
+	mt->mt_mem = mem;
+	mt->mt_size = size;
+	mt->mt_owner = mem_owner(file);
+
+	mo = &Opencl.owners[mt->mt_owner];
+	mo->mo_count++;
+	mo->mo_live += size;
+	mo->mo_peak = MAX(mo->mo_peak, mo->mo_live);
+	Opencl.mem_live += size;
+	Opencl.mem_peak = MAX(Opencl.mem_peak, Opencl.mem_live);
+}
+
+static void
+mem_untrack(cl_mem mem)
+{
+	for (int i = Opencl.ntracked - 1; i >= 0; i--) {
+		mem_track_t	*mt = &Opencl.tracked[i];
+		mem_owner_t	*mo = &Opencl.owners[mt->mt_owner];
+
+		if (mt->mt_mem != mem) {
+			continue;
+		}
+		mo->mo_count--;
+		mo->mo_live -= mt->mt_size;
+		Opencl.mem_live -= mt->mt_size;
+		*mt = Opencl.tracked[--Opencl.ntracked];
+		return;
+	}
+}
+
+static double
+mem_mb(uint64_t bytes)
+{
+	return ((double)bytes / (1024.0 * 1024.0));
+}
+
+/*
+ * List what each source file holds, either always ("loud") or only if
+ * OpenCL debugging is on.
+ */
+static void
+mem_report_owners(bool loud)
+{
+	static const char	fmt[] =
+	    "  %-16s %4d live %9.1f MB, peak %9.1f MB\n";
+
+	for (int i = 0; i < Opencl.nowners; i++) {
+		const mem_owner_t	*mo = &Opencl.owners[i];
+
+		if (loud) {
+			note(fmt, mo->mo_name, mo->mo_count,
+			    mem_mb(mo->mo_live), mem_mb(mo->mo_peak));
+		} else {
+			debug(DB_OPENCL, fmt, mo->mo_name, mo->mo_count,
+			    mem_mb(mo->mo_live), mem_mb(mo->mo_peak));
+		}
+	}
+}
+
+/*
+ * About how big an image will be, before there is one to ask.
+ */
+static size_t
+mem_image_bytes(const cl_image_format *format, pix_t width, pix_t height)
+{
+	size_t	channels, bytes;
+
+	switch (format->image_channel_order) {
+	case CL_R:
+	case CL_A:
+	case CL_INTENSITY:
+	case CL_LUMINANCE:
+		channels = 1;
+		break;
+	case CL_RG:
+	case CL_RA:
+		channels = 2;
+		break;
+	case CL_RGB:
+		channels = 3;
+		break;
+	default:
+		channels = 4;
+		break;
+	}
+	switch (format->image_channel_data_type) {
+	case CL_UNORM_INT8:
+	case CL_SNORM_INT8:
+	case CL_SIGNED_INT8:
+	case CL_UNSIGNED_INT8:
+		bytes = 1;
+		break;
+	case CL_HALF_FLOAT:
+	case CL_UNORM_INT16:
+	case CL_SNORM_INT16:
+	case CL_SIGNED_INT16:
+	case CL_UNSIGNED_INT16:
+		bytes = 2;
+		break;
+	default:
+		bytes = 4;
+		break;
+	}
+
+	return ((size_t)width * height * channels * bytes);
+}
+
+/*
+ * Say who was holding what when an allocation of "size" bytes failed,
+ * before giving up.
+ */
+static void
+mem_alloc_failed(cl_int err, size_t size, const char *file,
+    const char *what)
+{
+	const uint64_t	want = Opencl.mem_live + size;
+	const double	avail =
+	    (double)Opencl.global_mem_size * MEM_FIT_FRACTION;
+
+	note("GPU memory: %.1f MB in use, %.1f MB more wanted by %s, "
+	    "of %.1f MB\n", mem_mb(Opencl.mem_live), mem_mb(size),
+	    file, mem_mb(Opencl.global_mem_size));
+	mem_report_owners(true);
+	if (Width != 0 && Height != 0 && (double)want > avail) {
+		note("An image scale (-S) of %.2f or less might fit.\n",
+		    window_getscale() * sqrt(avail / (double)want));
+	}
+	ocl_die(err, "Failed to allocate OpenCL %s", what);
+}
+
+void
+opencl_mem_report(void)
+{
+	if (Width != 0 && Height != 0) {
+		Opencl.mem_perpixel =
+		    (double)Opencl.mem_live / ((double)Width * Height);
+	}
+
+	verbose(DB_OPENCL, "GPU memory: %.1f MB in use (peak %.1f MB), "
+	    "%.1f MB pooled, of %.1f MB\n", mem_mb(Opencl.mem_live),
+	    mem_mb(Opencl.mem_peak), mem_mb(Opencl.pool_bytes),
+	    mem_mb(Opencl.global_mem_size));
+	mem_report_owners(false);
+}
+
+bool
+opencl_mem_fits(pix_t width, pix_t height, float *scalep)
+{
+	const double	want =
+	    Opencl.mem_perpixel * (double)width * (double)height;
+	const double	avail =
+	    (double)Opencl.global_mem_size * MEM_FIT_FRACTION;
+
+	if (Opencl.mem_perpixel == 0 || want <= avail) {
+		return (true);
+	}
+	*scalep = (float)sqrt(avail / want);
+	return (false);
+}
+
 cl_mem
-buffer_alloc(size_t size)
+buffer_alloc_owner(size_t size, const char *file)
 {
 	cl_int	err;
 	cl_mem	buf;
 
+	if ((buf = buffer_pool_get(size, NULL, 0, 0)) != NULL) {
+		mem_track(buf, file);
+		return (buf);
+	}
+
 	buf = clCreateBuffer(Opencl.context,
 	    CL_MEM_READ_WRITE, size, NULL, &err);
+	if ((err == CL_MEM_OBJECT_ALLOCATION_FAILURE ||
+	    err == CL_OUT_OF_RESOURCES) && Opencl.npool > 0) {
+		buffer_pool_flush();
+		buf = clCreateBuffer(Opencl.context,
+		    CL_MEM_READ_WRITE, size, NULL, &err);
+	}
 	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to allocate OpenCL array");
+		mem_alloc_failed(err, size, file, "array");
 	}
 	assert(buf != NULL);
+	mem_track(buf, file);
 
 	return (buf);
 }
@@ -362,13 +1720,62 @@ buffer_alloc(size_t size)
 void
 buffer_writetogpu(const void *hostsrc, cl_mem gpudst, size_t size)
 {
-	cl_int	err;
+	host_mem_t	*hm;
+	size_t		off;
+	hrtime_t	tr;
+	cl_int		err;
 
-	err = clEnqueueWriteBuffer(Opencl.commands,
+	kernel_graph_break();
+	tr = trace_begin();
+
+	if ((hm = host_mem_shared(hostsrc, size, &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyBuffer(Opencl.current, hm->hm_mem, gpudst,
+		    off, 0, size, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy buffer to GPU");
+		}
+		host_mem_map(hm, NULL);
+		trace_end(DB_OPENCL, "buffer_writetogpu", tr);
+		return;
+	}
+
+	err = clEnqueueWriteBuffer(Opencl.current,
 	    gpudst, CL_TRUE, 0, size, hostsrc, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to write buffer to GPU");
 	}
+	trace_end(DB_OPENCL, "buffer_writetogpu", tr);
+}
+
+cl_event
+buffer_writetogpu_async(const void *hostsrc, cl_mem gpudst, size_t size)
+{
+	host_mem_t	*hm;
+	size_t		off;
+	cl_event	ev;
+	cl_int		err;
+
+	kernel_graph_break();
+
+	if ((hm = host_mem_shared(hostsrc, size, &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyBuffer(Opencl.current, hm->hm_mem, gpudst,
+		    off, 0, size, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy buffer to GPU");
+		}
+		host_mem_map(hm, &ev);
+	} else {
+		err = clEnqueueWriteBuffer(Opencl.current,
+		    gpudst, CL_FALSE, 0, size, hostsrc, 0, NULL, &ev);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to write buffer to GPU");
+		}
+	}
+	clFlush(Opencl.current);
+
+	return (ev);
 }
 
 void
@@ -376,7 +1783,9 @@ buffer_fill(cl_mem dst, size_t size, void *pattern, size_t pattern_size)
 {
 	cl_int	err;
 
-	err = clEnqueueFillBuffer(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueFillBuffer(Opencl.current,
 	    dst, pattern, pattern_size, 0, size, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to fill buffer");
@@ -388,7 +1797,9 @@ buffer_copy(cl_mem src, cl_mem dst, size_t size)
 {
 	cl_int	err;
 
-	err = clEnqueueCopyBuffer(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueCopyBuffer(Opencl.current,
 	    src, dst, 0, 0, size, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to copy buffer");
@@ -398,13 +1809,32 @@ buffer_copy(cl_mem src, cl_mem dst, size_t size)
 void
 buffer_readfromgpu(const cl_mem gpusrc, void *hostdst, size_t size)
 {
-	cl_int	err;
+	host_mem_t	*hm;
+	size_t		off;
+	hrtime_t	tr;
+	cl_int		err;
 
-	err = clEnqueueReadBuffer(Opencl.commands,
+	kernel_graph_break();
+	tr = trace_begin();
+
+	if ((hm = host_mem_shared(hostdst, size, &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyBuffer(Opencl.current, gpusrc, hm->hm_mem,
+		    0, off, size, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy buffer from GPU");
+		}
+		host_mem_map(hm, NULL);
+		trace_end(DB_OPENCL, "buffer_readfromgpu", tr);
+		return;
+	}
+
+	err = clEnqueueReadBuffer(Opencl.current,
 	    gpusrc, CL_TRUE, 0, size, hostdst, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to read buffer from GPU");
 	}
+	trace_end(DB_OPENCL, "buffer_readfromgpu", tr);
 }
 
 /*
@@ -416,7 +1846,9 @@ buffer_float_at(cl_mem gpusrc, pix_t off)
 	cl_int		err;
 	float		v;
 
-	err = clEnqueueReadBuffer(Opencl.commands, gpusrc, CL_TRUE,
+	kernel_graph_break();
+
+	err = clEnqueueReadBuffer(Opencl.current, gpusrc, CL_TRUE,
 	    off * sizeof (float), sizeof (v), &v, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to read offset %zu of buffer", off);
@@ -443,7 +1875,9 @@ buffer_datavec_at(cl_mem gpusrc, pix_t off)
 	cl_int		err;
 	cl_datavec	v;
 
-	err = clEnqueueReadBuffer(Opencl.commands, gpusrc, CL_TRUE,
+	kernel_graph_break();
+
+	err = clEnqueueReadBuffer(Opencl.current, gpusrc, CL_TRUE,
 	    off * sizeof (cl_datavec), sizeof (v), &v, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to read offset %zu of buffer", off);
@@ -458,131 +1892,1486 @@ buffer_datavec_at(cl_mem gpusrc, pix_t off)
 float
 buffer_datavec_sumup(cl_mem gpusrc)
 {
-	cl_datavec	v[800];
-	const int	N = sizeof (v) / sizeof (*v);
-	cl_int		err;
+	cl_datavec	v[800];
+	const int	N = sizeof (v) / sizeof (*v);
+	cl_int		err;
+
+	kernel_graph_break();
+
+	err = clEnqueueReadBuffer(Opencl.current, gpusrc, CL_TRUE,
+	    0, sizeof (v), v, 0, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to read offset %zu of buffer", 0);
+	}
+
+	int	sum = 0;
+	for (int i = 0; i < N; i++) {
+		sum += (int)v[i].s[0];
+	}
+
+	return ((float)sum / (float)N);
+}
+
+/*
+ * Read a single datavec from the debug offset of the specified buffer.
+ */
+cl_datavec
+buffer_datavec_dbg(cl_mem gpusrc)
+{
+	return (buffer_datavec_at(gpusrc, debug_offset()));
+}
+
+void
+buffer_free(cl_mem *buf)
+{
+	mem_untrack(*buf);
+	if (!buffer_pool_put(*buf)) {
+		kernel_args_forget(*buf);
+		clReleaseMemObject(*buf);
+	}
+	*buf = NULL;
+}
+
+/*
+ * Transient buffers go into the smallest slot that's big enough and isn't
+ * in use in any of the same phases.  Slots never grow, since whoever is
+ * already using one may have recorded it in a kernel graph; so the biggest
+ * buffers should be asked for first.
+ */
+static int
+transient_phases(const transient_slot_t *ts)
+{
+	int	phases = 0;
+
+	for (int p = 0; p < TR_NPHASES; p++) {
+		if (ts->ts_users[p] != 0) {
+			phases |= (1 << p);
+		}
+	}
+	return (phases);
+}
+
+cl_mem
+transient_alloc_owner(size_t size, int phases, const char *file)
+{
+	transient_slot_t	*ts = NULL;
+	transient_slot_t	*empty = NULL;
+
+	for (int i = 0; i < TRANSIENT_MAX; i++) {
+		transient_slot_t	*const	cand = &Opencl.transients[i];
+
+		if (cand->ts_mem == NULL) {
+			if (empty == NULL) {
+				empty = cand;
+			}
+		} else if ((transient_phases(cand) & phases) == 0 &&
+		    cand->ts_size >= size &&
+		    (ts == NULL || cand->ts_size < ts->ts_size)) {
+			ts = cand;
+		}
+	}
+
+	if (ts == NULL) {
+		if (empty == NULL) {
+			return (buffer_alloc_owner(size, file));
+		}
+		ts = empty;
+		ts->ts_mem = buffer_alloc_owner(size, file);
+		if (clGetMemObjectInfo(ts->ts_mem, CL_MEM_SIZE,
+		    sizeof (ts->ts_size), &ts->ts_size, NULL) != CL_SUCCESS) {
+			ts->ts_size = size;
+		}
+	} else {
+		debug(DB_OPENCL, "%s shares %.1f MB of transient memory\n",
+		    file, mem_mb(size));
+	}
+
+	for (int p = 0; p < TR_NPHASES; p++) {
+		if (phases & (1 << p)) {
+			ts->ts_users[p]++;
+		}
+	}
+	ts->ts_nusers++;
+
+	return (ts->ts_mem);
+}
+
+void
+transient_free(cl_mem *buf, int phases)
+{
+	for (int i = 0; i < TRANSIENT_MAX; i++) {
+		transient_slot_t	*const	ts = &Opencl.transients[i];
+
+		if (ts->ts_mem != *buf || ts->ts_nusers == 0) {
+			continue;
+		}
+		for (int p = 0; p < TR_NPHASES; p++) {
+			if (phases & (1 << p)) {
+				ts->ts_users[p]--;
+			}
+		}
+		if (--ts->ts_nusers == 0) {
+			buffer_free(&ts->ts_mem);
+			bzero(ts, sizeof (*ts));
+		}
+		*buf = NULL;
+		return;
+	}
+
+	buffer_free(buf);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * OpenCL kernels.
+ */
+
+/*
+ * Set all of the arguments that have been given to "kd" on "kernel".
+ */
+static bool
+kernel_apply_args(cl_kernel kernel, const kernel_data_t *kd)
+{
+	for (int a = 0; a < kd->kd_nargs; a++) {
+		if (kd->kd_argset[a] &&
+		    clSetKernelArg(kernel, a, kd->kd_argsize[a],
+		    (kd->kd_argnull[a] ? NULL : kd->kd_argval[a])) !=
+		    CL_SUCCESS) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/*
+ * "mem" is about to be released, so any kernel that still has it as an
+ * argument mustn't pass it on to another copy of the kernel (see
+ * program_swap()); whoever uses the kernel next will set it again.
+ */
+static void
+kernel_args_forget(cl_mem mem)
+{
+	for (int i = 0; i < Opencl.nkernels; i++) {
+		kernel_data_t	*kd = Opencl.kernels[i];
+
+		for (int a = 0; a < kd->kd_nargs; a++) {
+			if (kd->kd_argset[a] && !kd->kd_argnull[a] &&
+			    kd->kd_argsize[a] == sizeof (cl_mem) &&
+			    memcmp(kd->kd_argval[a], &mem,
+			    sizeof (cl_mem)) == 0) {
+				kd->kd_argset[a] = false;
+			}
+		}
+	}
+}
+
+/*
+ * Actually create the OpenCL kernel for "kd", once its program is ready.
+ */
+static void
+kernel_resolve(kernel_data_t *kd)
+{
+	cl_program	prog;
+	cl_int		err;
+	size_t		max_wg_size;
+
+	if (kd->kd_kernel != NULL) {
+		return;
+	}
+
+	program_wait(kd->kd_program);
+	prog = Opencl.programs[kd->kd_program].kp_program;
+
+	/*
+	 * Use a kernel that kernel_cleanup() kept, if there's one.
+	 */
+	for (int i = 0; i < Opencl.nidle; i++) {
+		if (Opencl.idle[i].ki_program == prog &&
+		    strcmp(Opencl.idle[i].ki_method, kd->kd_method) == 0) {
+			kd->kd_kernel = Opencl.idle[i].ki_kernel;
+			Opencl.idle[i] = Opencl.idle[--Opencl.nidle];
+			break;
+		}
+	}
+	if (kd->kd_kernel == NULL) {
+		kd->kd_kernel = clCreateKernel(prog, kd->kd_method, &err);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to create compute kernel");
+		}
+	}
+	assert(kd->kd_kernel != NULL);
+	if (!kernel_apply_args(kd->kd_kernel, kd)) {
+		die("Failed to set args in kernel %s\n", kd->kd_method);
+	}
+
+	/*
+	 * Get the maximum work group size for executing the kernel on the
+	 * device.
+	 */
+	err = clGetKernelWorkGroupInfo(kd->kd_kernel, Opencl.deviceid,
+	    CL_KERNEL_WORK_GROUP_SIZE, sizeof (size_t), &max_wg_size, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to retrieve kernel work group info");
+	}
+	kd->kd_wgsize = MIN(max_wg_size, Opencl.max_work_items[0]);
+
+	debug(DB_OPENCL, "Kernel \"%s\" workgroup size: max %zu, actual %zu\n",
+	    kd->kd_method, max_wg_size, kd->kd_wgsize);
+}
+
+void
+kernel_create(kernel_data_t *kd, const char *method)
+{
+	if (Opencl.nkernels == KERNEL_MAX_KERNELS) {
+		die("Too many kernels; increase KERNEL_MAX_KERNELS\n");
+	}
+	Opencl.kernels[Opencl.nkernels++] = kd;
+
+	kd->kd_method = method;
+	kd->kd_nargs = 0;
+	kd->kd_argsok = true;
+	bzero(kd->kd_argset, sizeof (kd->kd_argset));
+	for (kd->kd_stats = 0; kd->kd_stats < Opencl.nstats; kd->kd_stats++) {
+		if (strcmp(Opencl.stats[kd->kd_stats].ks_method, method) == 0) {
+			break;
+		}
+	}
+	if (kd->kd_stats == Opencl.nstats) {
+		if (Opencl.nstats < KERNEL_STATS_MAX) {
+			Opencl.stats[Opencl.nstats++].ks_method = method;
+		} else {
+			kd->kd_stats = -1;
+		}
+	}
+
+	/*
+	 * The kernel itself isn't created until it's needed, so that the
+	 * program it's in can be built in the meantime.
+	 */
+	kd->kd_kernel = NULL;
+	kd->kd_program = program_find(method);
+	program_start(kd->kd_program);
+
+	/*
+	 * What I really want here is "the size of the local work group
+	 * that would be used if I don't specify a size".  'Cause that's
+	 * as far as I really want to round it.  But I don't know how to
+	 * get that, so...
+	 */
+	kd->kd_maxitems[0] = Opencl.max_work_items[0];
+	kd->kd_maxitems[1] = Opencl.max_work_items[1];
+}
+
+size_t
+kernel_wgsize(kernel_data_t *kd)
+{
+	kernel_resolve(kd);
+	return (kd->kd_wgsize);
+}
+
+void
+kernel_setarg(kernel_data_t *kd, int arg, size_t size, void *value)
+{
+	/*
+	 * Keep a copy of the argument, so that kernel graphs can bind it to
+	 * another copy of the kernel.  A NULL value (a __local buffer) only
+	 * needs its size kept, however big that is.
+	 */
+	if (arg < KERNEL_MAX_ARGS &&
+	    (value == NULL || size <= KERNEL_MAX_ARGSIZE)) {
+		kd->kd_argset[arg] = true;
+		kd->kd_argnull[arg] = (value == NULL);
+		kd->kd_argsize[arg] = size;
+		if (value != NULL) {
+			memcpy(kd->kd_argval[arg], value, size);
+		}
+		kd->kd_nargs = MAX(kd->kd_nargs, arg + 1);
+	} else {
+		kd->kd_argsok = false;
+		kernel_resolve(kd);
+	}
+
+	/*
+	 * If the kernel hasn't been created yet, it'll get the copy.
+	 */
+	if (kd->kd_kernel != NULL &&
+	    clSetKernelArg(kd->kd_kernel, arg, size, value) != 0) {
+		die("Failed to set arg #%d in kernel %s\n", arg, kd->kd_method);
+	}
+}
+
+/*
+ * Enqueue one launch of "kernel", keeping track of its GPU time if anyone
+ * wants that.  "stats" is the kernel's index into the per-kernel stats.
+ */
+static void
+kernel_enqueue(cl_kernel kernel, const char *method, int stats_index,
+    int dim, const size_t *global, const size_t *local)
+{
+	const hrtime_t	tr = trace_begin();
+	cl_int		err;
+	bool		stats, timing;
+	cl_event	ev;
+
+	if (Opencl.timing && Opencl.profiling &&
+	    Opencl.ntiming == KERNEL_TIMING_MAX) {
+		kernel_timing_reap();
+	}
+	stats = Opencl.profiling && stats_index >= 0 &&
+	    debug_enabled(DB_GPU);
+	if (stats) {
+		kernel_stats_reap();
+		if (Opencl.npending == KERNEL_STATS_PENDING) {
+			Opencl.dropped++;
+			stats = false;
+		}
+	}
+
+	timing = Opencl.timing && Opencl.profiling;
+
+	err = clEnqueueNDRangeKernel(Opencl.current, kernel,
+	    dim, NULL, global, local, 0, NULL,
+	    (timing || stats || Opencl.tracing) ? &ev : NULL);
+	if (err) {
+		ocl_die(err, "Failed to enqueue kernel %s", method);
+	}
+
+	if (stats) {
+		const int	slot = (Opencl.pending_head + Opencl.npending) %
+		    KERNEL_STATS_PENDING;
+
+		Opencl.pending[slot] = ev;
+		Opencl.pending_kernel[slot] = stats_index;
+		Opencl.npending++;
+	}
+	if (timing) {
+		if (stats) {
+			clRetainEvent(ev);
+		}
+		Opencl.timing_events[Opencl.ntiming++] = ev;
+	}
+	if (Opencl.tracing) {
+		if (stats || timing) {
+			clRetainEvent(ev);
+		}
+		kernel_trace_add(ev, method);
+	}
+	trace_end(DB_OPENCL, method, tr);
+}
+
+void
+kernel_invoke(kernel_data_t *kd, int dim, size_t *global_arg, size_t *local)
+{
+	size_t	global_default[2] = {
+		P2ROUNDUP((size_t)Width, kd->kd_maxitems[0]),
+		P2ROUNDUP((size_t)Height, kd->kd_maxitems[1])
+	};
+	size_t	*global;
+
+	if (global_arg == NULL) {
+		global = global_default;
+	} else {
+		global = global_arg;
+	}
+
+	kernel_resolve(kd);
+	kernel_enqueue(kd->kd_kernel, kd->kd_method, kd->kd_stats,
+	    dim, global, local);
+
+	if (Opencl.recording != NULL) {
+		kernel_graph_add(kd, dim, global, local);
+	}
+}
+
+void
+kernel_wait(void)
+{
+	const hrtime_t	tr = trace_begin();
+
+	for (int s = Opencl.nstreams - 1; s >= 0; s--) {
+		clFinish(Opencl.streams[s]);
+	}
+	if (Opencl.display != NULL) {
+		clFinish(Opencl.display);
+	}
+	trace_end(DB_OPENCL, "kernel_wait", tr);
+
+	// Everything is done now, so hand over any readbacks.
+	readback_poll();
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Streams: extra in-order command queues, so that independent work can
+ * overlap on the GPU.  Between opencl_fork() and opencl_join(), work goes
+ * to whichever stream was last chosen by opencl_stream().  Everything in
+ * each stream starts after everything that was enqueued before the fork,
+ * and everything after the join waits for everything in every stream; in
+ * between, the streams are unordered with respect to each other.  None of
+ * this makes the host wait for anything.
+ */
+void
+opencl_streams_enable(int n)
+{
+	assert(Opencl.commands == NULL);
+	Opencl.nstreams = MAX(1, MIN(n, OPENCL_MAX_STREAMS));
+}
+
+int
+opencl_streams(void)
+{
+	return (Opencl.nstreams);
+}
+
+void
+opencl_fork(void)
+{
+	cl_int	err;
+
+	assert(!Opencl.forked);
+	if (Opencl.nstreams == 1) {
+		return;
+	}
+	kernel_graph_break();
+
+	err = clEnqueueMarkerWithWaitList(Opencl.commands, 0, NULL,
+	    &Opencl.fork_event);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to enqueue fork marker");
+	}
+	bzero(Opencl.stream_used, sizeof (Opencl.stream_used));
+	Opencl.stream_used[0] = true;
+	Opencl.forked = true;
+}
+
+void
+opencl_stream(int s)
+{
+	cl_int	err;
+
+	if (!Opencl.forked) {
+		return;
+	}
+
+	s %= Opencl.nstreams;
+	if (!Opencl.stream_used[s]) {
+		err = clEnqueueBarrierWithWaitList(Opencl.streams[s], 1,
+		    &Opencl.fork_event, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to enqueue fork barrier");
+		}
+		Opencl.stream_used[s] = true;
+	}
+	Opencl.curstream = s;
+	Opencl.current = Opencl.streams[s];
+}
+
+int
+opencl_stream_current(void)
+{
+	return (Opencl.curstream);
+}
+
+void
+opencl_cpu_enable(void)
+{
+	assert(Opencl.commands == NULL);
+	Opencl.cpu = true;
+}
+
+void
+opencl_device_pick(int d)
+{
+	assert(Opencl.commands == NULL);
+	Opencl.picked = true;
+	Opencl.pick = d;
+}
+
+int
+opencl_gpu_count(void)
+{
+	cl_platform_id	platform;
+	cl_uint		ndev;
+
+	if (!find_platform(CL_DEVICE_TYPE_GPU, &platform, &ndev)) {
+		return (0);
+	}
+	return ((int)ndev);
+}
+
+void
+opencl_join(void)
+{
+	cl_event	done[OPENCL_MAX_STREAMS];
+	cl_uint		ndone = 0;
+	cl_int		err;
+
+	if (!Opencl.forked) {
+		return;
+	}
+
+	for (int s = 1; s < Opencl.nstreams; s++) {
+		if (!Opencl.stream_used[s]) {
+			continue;
+		}
+		err = clEnqueueMarkerWithWaitList(Opencl.streams[s], 0, NULL,
+		    &done[ndone]);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to enqueue join marker");
+		}
+		clFlush(Opencl.streams[s]);
+		ndone++;
+	}
+	if (ndone > 0) {
+		err = clEnqueueBarrierWithWaitList(Opencl.commands, ndone,
+		    done, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to enqueue join barrier");
+		}
+	}
+	for (cl_uint i = 0; i < ndone; i++) {
+		clReleaseEvent(done[i]);
+	}
+	clReleaseEvent(Opencl.fork_event);
+
+	Opencl.forked = false;
+	Opencl.curstream = 0;
+	Opencl.current = Opencl.commands;
+}
+
+/*
+ * The display queue.  Only the display's own work goes there, so it doesn't
+ * have to wait behind whatever the simulation has queued up.
+ */
+void
+opencl_display_enable(void)
+{
+	assert(Opencl.commands == NULL);
+	Opencl.display_wanted = true;
+}
+
+void
+opencl_display_begin(void)
+{
+	assert(Opencl.display != NULL);
+	assert(!Opencl.forked);
+
+	kernel_graph_break();
+	Opencl.current = Opencl.display;
+}
+
+void
+opencl_display_end(void)
+{
+	assert(Opencl.current == Opencl.display);
+
+	clFlush(Opencl.display);
+	Opencl.current = Opencl.commands;
+}
+
+/*
+ * Mark the end of everything enqueued so far.  opencl_marker_wait() only
+ * waits for the GPU, so it doesn't care what other threads are doing.
+ */
+cl_event
+opencl_marker(void)
+{
+	cl_event	ev;
+	cl_int		err;
+
+	assert(!Opencl.forked);
+
+	err = clEnqueueMarkerWithWaitList(Opencl.commands, 0, NULL, &ev);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to enqueue marker");
+	}
+	clFlush(Opencl.commands);
+
+	return (ev);
+}
+
+void
+opencl_marker_wait(cl_event ev)
+{
+	const hrtime_t	tr = trace_begin();
+	cl_int		err;
+
+	err = clWaitForEvents(1, &ev);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to wait for marker");
+	}
+	clReleaseEvent(ev);
+	trace_end(DB_OPENCL, "opencl_marker_wait", tr);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Kernel timing.  With a profiling queue, each kernel launched between
+ * kernel_timing_start() and kernel_timing_stop() gets an event, and the
+ * result is the sum of the GPU's own execution times for them; that
+ * leaves out launch overhead and any idle time in between.  Without one,
+ * this falls back to host time around a kernel_wait().
+ */
+void
+opencl_profiling_enable(void)
+{
+	assert(Opencl.commands == NULL);
+	Opencl.profiling = true;
+}
+
+bool
+opencl_profiling_enabled(void)
+{
+	return (Opencl.profiling);
+}
+
+/*
+ * Wait for the outstanding timing events, and add up their run times.
+ */
+static void
+kernel_timing_reap(void)
+{
+	cl_int	err;
+
+	if (Opencl.ntiming == 0) {
+		return;
+	}
+
+	err = clWaitForEvents(Opencl.ntiming, Opencl.timing_events);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to wait for kernel events");
+	}
+
+	for (int i = 0; i < Opencl.ntiming; i++) {
+		cl_event	ev = Opencl.timing_events[i];
+		cl_ulong	start, end;
+
+		err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+		    sizeof (start), &start, NULL);
+		if (err == CL_SUCCESS) {
+			err = clGetEventProfilingInfo(ev,
+			    CL_PROFILING_COMMAND_END, sizeof (end), &end, NULL);
+		}
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to get kernel profiling info");
+		}
+
+		Opencl.timing_total += (hrtime_t)(end - start);
+		clReleaseEvent(ev);
+	}
+	Opencl.ntiming = 0;
+}
+
+void
+kernel_timing_start(void)
+{
+	assert(!Opencl.timing);
+
+	Opencl.timing = true;
+	Opencl.timing_total = 0;
+	Opencl.ntiming = 0;
+	if (!Opencl.profiling) {
+		kernel_wait();
+		Opencl.timing_start = gethrtime();
+	}
+}
+
+hrtime_t
+kernel_timing_stop(void)
+{
+	assert(Opencl.timing);
+
+	Opencl.timing = false;
+	if (!Opencl.profiling) {
+		kernel_wait();
+		return (gethrtime() - Opencl.timing_start);
+	}
+
+	kernel_timing_reap();
+	return (Opencl.timing_total);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Add the finished events in the pending ring to their kernels' stats.
+ * This doesn't wait for anything.  Events are collected in launch order,
+ * so the first one that isn't finished yet holds up the rest; that's
+ * exact for a single in-order queue, and just delays things a bit when
+ * opencl_fork() has spread them across several.
+ */
+static void
+kernel_stats_reap(void)
+{
+	while (Opencl.npending > 0) {
+		const int	slot = Opencl.pending_head;
+		cl_event	ev = Opencl.pending[slot];
+		kernel_stats_t	*ks = &Opencl.stats[Opencl.pending_kernel[slot]];
+		cl_int		status, err;
+		cl_ulong	start, end;
+
+		err = clGetEventInfo(ev, CL_EVENT_COMMAND_EXECUTION_STATUS,
+		    sizeof (status), &status, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to get kernel event status");
+		}
+		if (status > CL_COMPLETE) {
+			break;
+		}
+
+		if (status == CL_COMPLETE &&
+		    clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+		    sizeof (start), &start, NULL) == CL_SUCCESS &&
+		    clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+		    sizeof (end), &end, NULL) == CL_SUCCESS) {
+			const hrtime_t	ns = (hrtime_t)(end - start);
+
+			ks->ks_count++;
+			ks->ks_total += ns;
+			ks->ks_worst = MAX(ks->ks_worst, ns);
+		}
+		clReleaseEvent(ev);
+
+		Opencl.pending_head = (slot + 1) % KERNEL_STATS_PENDING;
+		Opencl.npending--;
+	}
+
+	if (debug_enabled(DB_GPU) &&
+	    gethrtime() - Opencl.stats_lastdump >= KERNEL_STATS_PERIOD) {
+		kernel_stats_dump();
+	}
+}
+
+void
+kernel_stats_dump(void)
+{
+	hrtime_t	total = 0;
+
+	Opencl.stats_lastdump = gethrtime();
+
+	for (int i = 0; i < Opencl.nstats; i++) {
+		total += Opencl.stats[i].ks_total;
+	}
+
+	note("# GPU kernel stats: %.3f ms total\n",
+	    (double)total / 1000000.0);
+	note("# %-24s %9s %11s %9s %9s %5s\n",
+	    "kernel", "count", "total ms", "mean us", "worst us", "%");
+	for (int i = 0; i < Opencl.nstats; i++) {
+		const kernel_stats_t	*ks = &Opencl.stats[i];
+
+		if (ks->ks_count == 0) {
+			continue;
+		}
+		note("  %-24s %9llu %11.3f %9.1f %9.1f %5.1f\n",
+		    ks->ks_method, (unsigned long long)ks->ks_count,
+		    (double)ks->ks_total / 1000000.0,
+		    (double)ks->ks_total / ks->ks_count / 1000.0,
+		    (double)ks->ks_worst / 1000.0,
+		    (total > 0 ? 100.0 * ks->ks_total / total : 0.0));
+	}
+	if (Opencl.dropped != 0) {
+		note("  (%llu launches not counted)\n",
+		    (unsigned long long)Opencl.dropped);
+	}
+}
+
+/*
+ * Called after the "GPU kernel stats" debug area is toggled.  Turning it on
+ * starts over from scratch; turning it off shows what was collected.
+ */
+static void
+kernel_stats_toggle(void)
+{
+	if (!Opencl.profiling) {
+		warn("GPU kernel stats need a profiling queue (see \"-p\")\n");
+		return;
+	}
+
+	if (debug_enabled(DB_GPU)) {
+		for (int i = 0; i < Opencl.nstats; i++) {
+			Opencl.stats[i].ks_count = 0;
+			Opencl.stats[i].ks_total = 0;
+			Opencl.stats[i].ks_worst = 0;
+		}
+		Opencl.dropped = 0;
+		Opencl.stats_lastdump = gethrtime();
+	} else {
+		kernel_stats_dump();
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Timeline tracing; see opencl_trace_start().
+ */
+
+/*
+ * Work out how far the GPU's profiling clock is from gethrtime().  A marker
+ * enqueued on an idle queue finishes right away, so the host's time just
+ * after waiting for it is a little later than the GPU's time at its end.
+ * The smallest difference over a few tries is the closest.
+ */
+static void
+kernel_trace_sync(void)
+{
+	hrtime_t	best = 0;
+
+	kernel_wait();
+	for (int i = 0; i < KERNEL_TRACE_SYNCS; i++) {
+		cl_event	ev;
+		cl_ulong	end;
+		hrtime_t	now, offset;
+		cl_int		err;
+
+		err = clEnqueueMarkerWithWaitList(Opencl.commands, 0, NULL,
+		    &ev);
+		if (err == CL_SUCCESS) {
+			err = clWaitForEvents(1, &ev);
+		}
+		now = gethrtime();
+		if (err == CL_SUCCESS) {
+			err = clGetEventProfilingInfo(ev,
+			    CL_PROFILING_COMMAND_END, sizeof (end), &end, NULL);
+			clReleaseEvent(ev);
+		}
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to sync with the GPU's clock");
+		}
+
+		offset = now - (hrtime_t)end;
+		if (i == 0 || offset < best) {
+			best = offset;
+		}
+	}
+	Opencl.trace_offset = best;
+}
+
+/*
+ * Hand the finished events in the trace ring over to trace_gpu().  Like
+ * kernel_stats_reap(), this doesn't wait for anything.
+ */
+static void
+kernel_trace_reap(void)
+{
+	while (Opencl.ntrace > 0) {
+		const int	slot = Opencl.trace_head;
+		cl_event	ev = Opencl.trace_pending[slot];
+		cl_int		status, err;
+		cl_ulong	start, end;
+
+		err = clGetEventInfo(ev, CL_EVENT_COMMAND_EXECUTION_STATUS,
+		    sizeof (status), &status, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to get kernel event status");
+		}
+		if (status > CL_COMPLETE) {
+			break;
+		}
+
+		if (status == CL_COMPLETE &&
+		    clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+		    sizeof (start), &start, NULL) == CL_SUCCESS &&
+		    clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+		    sizeof (end), &end, NULL) == CL_SUCCESS) {
+			trace_gpu(Opencl.trace_name[slot],
+			    Opencl.trace_stream[slot],
+			    (hrtime_t)start + Opencl.trace_offset,
+			    (hrtime_t)end + Opencl.trace_offset);
+		}
+		clReleaseEvent(ev);
+
+		Opencl.trace_head = (slot + 1) % KERNEL_TRACE_PENDING;
+		Opencl.ntrace--;
+	}
+}
+
+/*
+ * Add an event for "name" to the trace ring, which takes over the caller's
+ * reference to it.  If the ring is full, this waits for the oldest event,
+ * rather than leave a gap in the timeline.
+ */
+static void
+kernel_trace_add(cl_event ev, const char *name)
+{
+	int	slot;
+
+	kernel_trace_reap();
+	if (Opencl.ntrace == KERNEL_TRACE_PENDING) {
+		(void) clWaitForEvents(1,
+		    &Opencl.trace_pending[Opencl.trace_head]);
+		kernel_trace_reap();
+	}
+
+	slot = (Opencl.trace_head + Opencl.ntrace) % KERNEL_TRACE_PENDING;
+	Opencl.trace_pending[slot] = ev;
+	Opencl.trace_name[slot] = name;
+	Opencl.trace_stream[slot] = Opencl.curstream;
+	Opencl.ntrace++;
+}
+
+void
+opencl_trace_start(void)
+{
+	if (!Opencl.profiling) {
+		warn("GPU times in the trace need a profiling queue "
+		    "(see \"-p\")\n");
+		return;
+	}
+	kernel_trace_sync();
+	Opencl.tracing = true;
+}
+
+void
+opencl_trace_stop(void)
+{
+	if (!Opencl.tracing) {
+		return;
+	}
+	kernel_wait();
+	kernel_trace_reap();
+	assert(Opencl.ntrace == 0);
+	Opencl.tracing = false;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Specialized programs; see opencl.h.
+ */
+
+/*
+ * Move every kernel in the core program over to "prog".  This can't be
+ * done if a kernel in the new program can't use as big a workgroup as the
+ * old one did, since callers may have sized things to fit; or if we don't
+ * know all of a kernel's arguments, since they have to be set again.
+ */
+static bool
+program_swap(cl_program prog)
+{
+	kernel_program_t	*kp = &Opencl.programs[CORE_PROGRAM];
+	cl_kernel		newk[KERNEL_MAX_KERNELS];
+	int			i;
+
+	for (i = 0; i < Opencl.nkernels; i++) {
+		kernel_data_t	*kd = Opencl.kernels[i];
+		size_t		wgsize;
+		cl_int		err;
+
+		/*
+		 * Kernels that haven't been created yet will just come from
+		 * the new program.
+		 */
+		newk[i] = NULL;
+		if (kd->kd_program != CORE_PROGRAM || kd->kd_kernel == NULL) {
+			continue;
+		}
+		newk[i] = clCreateKernel(prog, kd->kd_method, &err);
+		if (err != CL_SUCCESS) {
+			break;
+		}
+		if (!kd->kd_argsok ||
+		    clGetKernelWorkGroupInfo(newk[i], Opencl.deviceid,
+		    CL_KERNEL_WORK_GROUP_SIZE, sizeof (wgsize), &wgsize,
+		    NULL) != CL_SUCCESS || wgsize < kd->kd_wgsize) {
+			clReleaseKernel(newk[i]);
+			break;
+		}
+		if (!kernel_apply_args(newk[i], kd)) {
+			clReleaseKernel(newk[i]);
+			break;
+		}
+	}
+	if (i < Opencl.nkernels) {
+		verbose(DB_OPENCL, "Can't use specialized program for kernel "
+		    "\"%s\"\n", Opencl.kernels[i]->kd_method);
+		while (--i >= 0) {
+			if (newk[i] != NULL) {
+				clReleaseKernel(newk[i]);
+			}
+		}
+		return (false);
+	}
+
+	for (i = 0; i < Opencl.nkernels; i++) {
+		if (newk[i] != NULL) {
+			clReleaseKernel(Opencl.kernels[i]->kd_kernel);
+			Opencl.kernels[i]->kd_kernel = newk[i];
+		}
+	}
+	for (i = 0; i < Opencl.nidle; i++) {
+		if (Opencl.idle[i].ki_program == kp->kp_program) {
+			clReleaseKernel(Opencl.idle[i].ki_kernel);
+			Opencl.idle[i--] = Opencl.idle[--Opencl.nidle];
+		}
+	}
+	if (kp->kp_program != kp->kp_generic) {
+		clReleaseProgram(kp->kp_program);
+	}
+	kp->kp_program = prog;
+
+	// Recorded graphs use the old kernels.
+	kernel_graph_invalidate_all();
+
+	return (true);
+}
+
+/*
+ * Whether or not the swap works, these options have been dealt with, so
+ * don't try them again until something else has been asked for.
+ */
+static void
+spec_finish(cl_program prog, const char *options)
+{
+	if (program_swap(prog)) {
+		verbose(DB_OPENCL, "Using program specialized for \"%s\"\n",
+		    options);
+	} else {
+		clReleaseProgram(prog);
+	}
+	(void) snprintf(Opencl.spec_active, sizeof (Opencl.spec_active),
+	    "%s", options);
+}
+
+void
+opencl_specialize(const char *options)
+{
+	const char	*source;
+	char		key[4096];
+	cl_program	prog;
+	cl_build_status	status;
+	cl_int		err;
+
+	if (Opencl.spec_disabled || Opencl.recording != NULL ||
+	    Opencl.forked ||
+	    Opencl.programs[CORE_PROGRAM].kp_generic == NULL) {
+		return;
+	}
+	source = Opencl.programs[CORE_PROGRAM].kp_source;
+
+	/*
+	 * See if a background build has finished.
+	 */
+	if (Opencl.spec_building != NULL && Opencl.spec_built) {
+		prog = Opencl.spec_building;
+		Opencl.spec_building = NULL;
+
+		err = clGetProgramBuildInfo(prog, Opencl.deviceid,
+		    CL_PROGRAM_BUILD_STATUS, sizeof (status), &status, NULL);
+		if (err == CL_SUCCESS && status == CL_BUILD_SUCCESS) {
+			program_cache_key(source, Opencl.spec_building_opts,
+			    key, sizeof (key));
+			program_cache_save(prog, key);
+			spec_finish(prog, Opencl.spec_building_opts);
+		} else {
+			warn("Failed to build program specialized for "
+			    "\"%s\"\n", Opencl.spec_building_opts);
+			clReleaseProgram(prog);
+			(void) snprintf(Opencl.spec_active,
+			    sizeof (Opencl.spec_active), "%s",
+			    Opencl.spec_building_opts);
+		}
+	}
+
+	if (strcmp(options, Opencl.spec_active) == 0) {
+		Opencl.spec_calls = 0;
+		return;
+	}
+	if (strcmp(options, Opencl.spec_want) != 0) {
+		(void) snprintf(Opencl.spec_want, sizeof (Opencl.spec_want),
+		    "%s", options);
+		Opencl.spec_calls = 0;
+	}
+	if (++Opencl.spec_calls < SPEC_SETTLE_CALLS ||
+	    Opencl.spec_building != NULL) {
+		return;
+	}
+	Opencl.spec_calls = 0;
+
+	/*
+	 * The options have settled down.  If there's a cached binary, it
+	 * can be swapped in right away; otherwise, start building one.
+	 */
+	program_cache_key(source, options, key, sizeof (key));
+	if ((prog = program_cache_load(key, options)) != NULL) {
+		spec_finish(prog, options);
+		return;
+	}
+
+	prog = clCreateProgramWithSource(Opencl.context, 1, &source, NULL,
+	    &err);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to create specialized program");
+	}
+	(void) snprintf(Opencl.spec_building_opts,
+	    sizeof (Opencl.spec_building_opts), "%s", options);
+	Opencl.spec_built = false;
+	Opencl.spec_building = prog;
+
+	verbose(DB_OPENCL, "Building program specialized for \"%s\"\n",
+	    options);
+	err = clBuildProgram(prog, 1, &Opencl.deviceid, options,
+	    program_build_done, (void *)&Opencl.spec_built);
+	if (err != CL_SUCCESS) {
+		warn("Failed to start building program specialized for "
+		    "\"%s\"\n", options);
+		clReleaseProgram(prog);
+		Opencl.spec_building = NULL;
+		// Don't keep trying.
+		(void) snprintf(Opencl.spec_active, sizeof (Opencl.spec_active),
+		    "%s", options);
+	}
+}
+
+void
+opencl_specialize_disable(void)
+{
+	Opencl.spec_disabled = true;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Kernel graphs; see opencl.h.
+ */
+
+typedef struct {
+	cl_kernel	kl_kernel;	/* pre-bound copy of the kernel */
+	const char	*kl_method;
+	int		kl_stats;
+	int		kl_dim;
+	size_t		kl_global[3];
+	size_t		kl_local[3];
+	bool		kl_haslocal;
+} kernel_launch_t;
+
+struct kernel_graph {
+	bool		kg_valid;	/* can be replayed */
+	bool		kg_broken;	/* recording can't be replayed */
+	int		kg_generation;	/* Opencl.graph_generation */
+	int		kg_nlaunches;
+	kernel_launch_t	kg_launches[KERNEL_GRAPH_MAX];
+#ifdef	cl_khr_command_buffer
+	cl_command_buffer_khr	kg_cmdbuf;
+	cl_sync_point_khr	kg_last;	/* most recent command */
+#endif
+};
+
+/*
+ * Does the current device support the extension "name"?
+ */
+static bool
+device_has_extension(const char *name)
+{
+	char		*ext;
+	size_t		len;
+	bool		found;
+
+	if (clGetDeviceInfo(Opencl.deviceid, CL_DEVICE_EXTENSIONS, 0, NULL,
+	    &len) != CL_SUCCESS) {
+		return (false);
+	}
+	ext = mem_alloc(len + 1);
+	ext[0] = '\0';
+	(void) clGetDeviceInfo(Opencl.deviceid, CL_DEVICE_EXTENSIONS, len,
+	    ext, NULL);
+	ext[len] = '\0';
+	found = (strstr(ext, name) != NULL);
+	mem_free((void **)&ext);
+
+	return (found);
+}
+
+/*
+ * Look for cl_khr_command_buffer, and find its entry points.
+ */
+static void
+kernel_graph_init(void)
+{
+#ifdef	cl_khr_command_buffer
+	cl_platform_id	platform;
+
+	Opencl.cmdbuf_ok = device_has_extension("cl_khr_command_buffer");
+	if (!Opencl.cmdbuf_ok ||
+	    clGetDeviceInfo(Opencl.deviceid, CL_DEVICE_PLATFORM,
+	    sizeof (platform), &platform, NULL) != CL_SUCCESS) {
+		Opencl.cmdbuf_ok = false;
+		return;
+	}
+
+#define	GETFN(field, name)						\
+	Opencl.field = (name##_fn)					\
+	    clGetExtensionFunctionAddressForPlatform(platform, #name);	\
+	if (Opencl.field == NULL) {					\
+		Opencl.cmdbuf_ok = false;				\
+	}
+	GETFN(create_cmdbuf, clCreateCommandBufferKHR);
+	GETFN(cmdbuf_ndrange, clCommandNDRangeKernelKHR);
+	GETFN(finalize_cmdbuf, clFinalizeCommandBufferKHR);
+	GETFN(enqueue_cmdbuf, clEnqueueCommandBufferKHR);
+	GETFN(release_cmdbuf, clReleaseCommandBufferKHR);
+#undef	GETFN
+#endif	/* cl_khr_command_buffer */
+
+	debug(DB_OPENCL, "Kernel graphs use %s\n",
+	    (Opencl.cmdbuf_ok ? "command buffers" : "pre-bound kernels"));
+}
+
+static void
+kernel_graph_clear(kernel_graph_t *g)
+{
+	for (int i = 0; i < g->kg_nlaunches; i++) {
+		if (g->kg_launches[i].kl_kernel != NULL) {
+			clReleaseKernel(g->kg_launches[i].kl_kernel);
+		}
+	}
+#ifdef	cl_khr_command_buffer
+	if (g->kg_cmdbuf != NULL) {
+		Opencl.release_cmdbuf(g->kg_cmdbuf);
+		g->kg_cmdbuf = NULL;
+	}
+#endif
+	g->kg_nlaunches = 0;
+	g->kg_valid = false;
+	g->kg_broken = false;
+}
+
+kernel_graph_t *
+kernel_graph_create(void)
+{
+	kernel_graph_t	*g = mem_alloc(sizeof (*g));
+
+	bzero(g, sizeof (*g));
+	return (g);
+}
+
+void
+kernel_graph_destroy(kernel_graph_t **gp)
+{
+	if (*gp == NULL) {
+		return;
+	}
+	if (Opencl.recording == *gp) {
+		Opencl.recording = NULL;
+	}
+	kernel_graph_clear(*gp);
+	mem_free((void **)gp);
+}
+
+void
+kernel_graph_record(kernel_graph_t *g)
+{
+	assert(Opencl.recording == NULL);
 
-	err = clEnqueueReadBuffer(Opencl.commands, gpusrc, CL_TRUE,
-	    0, sizeof (v), v, 0, NULL, NULL);
-	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to read offset %zu of buffer", 0);
+	kernel_graph_clear(g);
+	if (Opencl.graphs_disabled) {
+		return;
 	}
+	g->kg_generation = Opencl.graph_generation;
+	Opencl.recording = g;
 
-	int	sum = 0;
-	for (int i = 0; i < N; i++) {
-		sum += (int)v[i].s[0];
-	}
+#ifdef	cl_khr_command_buffer
+	if (Opencl.cmdbuf_ok) {
+		cl_int	err;
 
-	return ((float)sum / (float)N);
+		g->kg_cmdbuf = Opencl.create_cmdbuf(1, &Opencl.commands,
+		    NULL, &err);
+		if (err != CL_SUCCESS) {
+			g->kg_cmdbuf = NULL;
+			g->kg_broken = true;
+		}
+	}
+#endif
 }
 
 /*
- * Read a single datavec from the debug offset of the specified buffer.
+ * Called from anything that enqueues work other than a kernel launch.
  */
-cl_datavec
-buffer_datavec_dbg(cl_mem gpusrc)
+static void
+kernel_graph_break(void)
 {
-	return (buffer_datavec_at(gpusrc, debug_offset()));
+	if (Opencl.recording != NULL) {
+		Opencl.recording->kg_broken = true;
+	}
 }
 
-void
-buffer_free(cl_mem *buf)
+static void
+kernel_graph_add(kernel_data_t *kd, int dim, const size_t *global,
+    const size_t *local)
 {
-	clReleaseMemObject(*buf);
-	*buf = NULL;
-}
-
-/* ------------------------------------------------------------------ */
+	kernel_graph_t	*g = Opencl.recording;
+	kernel_launch_t	*kl;
+	cl_int		err;
 
-/*
- * OpenCL kernels.
- */
+	if (g->kg_broken) {
+		return;
+	}
+	if (g->kg_nlaunches == KERNEL_GRAPH_MAX || !kd->kd_argsok) {
+		g->kg_broken = true;
+		return;
+	}
 
-void
-kernel_create(kernel_data_t *kd, const char *method)
-{
-	cl_int	err;
-	size_t	max_wg_size;
+	kl = &g->kg_launches[g->kg_nlaunches++];
+	bzero(kl, sizeof (*kl));
+	kl->kl_method = kd->kd_method;
+	kl->kl_stats = kd->kd_stats;
+	kl->kl_dim = dim;
+	for (int d = 0; d < dim; d++) {
+		kl->kl_global[d] = global[d];
+		if (local != NULL) {
+			kl->kl_local[d] = local[d];
+		}
+	}
+	kl->kl_haslocal = (local != NULL);
 
-	kd->kd_method = method;
+#ifdef	cl_khr_command_buffer
+	if (g->kg_cmdbuf != NULL) {
+		/*
+		 * The command buffer takes the kernel's arguments as they
+		 * are right now.  Each command waits for the previous one,
+		 * just like in the queue it stands in for.
+		 */
+		const bool		first = (g->kg_nlaunches == 1);
+		cl_sync_point_khr	prev = g->kg_last;
 
-	kd->kd_kernel = clCreateKernel(Opencl.program, method, &err);
-	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to create compute kernel");
+		err = Opencl.cmdbuf_ndrange(g->kg_cmdbuf, NULL, NULL,
+		    kd->kd_kernel, dim, NULL, global, local,
+		    (first ? 0 : 1), (first ? NULL : &prev), &g->kg_last, NULL);
+		if (err != CL_SUCCESS) {
+			g->kg_broken = true;
+		}
+		return;
 	}
-	assert(kd->kd_kernel != NULL);
+#endif
 
 	/*
-	 * Get the maximum work group size for executing the kernel on the
-	 * device.
+	 * Otherwise, make a copy of the kernel with these arguments.
 	 */
-	err = clGetKernelWorkGroupInfo(kd->kd_kernel, Opencl.deviceid,
-	    CL_KERNEL_WORK_GROUP_SIZE, sizeof (size_t), &max_wg_size, NULL);
+	kl->kl_kernel = clCreateKernel(
+	    Opencl.programs[kd->kd_program].kp_program, kd->kd_method, &err);
 	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to retrieve kernel work group info");
+		kl->kl_kernel = NULL;
+		g->kg_broken = true;
+		return;
+	}
+	for (int a = 0; a < kd->kd_nargs; a++) {
+		if (!kd->kd_argset[a] ||
+		    clSetKernelArg(kl->kl_kernel, a, kd->kd_argsize[a],
+		    (kd->kd_argnull[a] ? NULL : kd->kd_argval[a])) !=
+		    CL_SUCCESS) {
+			g->kg_broken = true;
+			return;
+		}
 	}
-
-	/*
-	 * What I really want here is "the size of the local work group
-	 * that would be used if I don't specify a size".  'Cause that's
-	 * as far as I really want to round it.  But I don't know how to
-	 * get that, so...
-	 */
-	kd->kd_maxitems[0] = Opencl.max_work_items[0];
-	kd->kd_maxitems[1] = Opencl.max_work_items[1];
-	kd->kd_wgsize = MIN(max_wg_size, Opencl.max_work_items[0]);
-
-	debug(DB_OPENCL, "Kernel \"%s\" workgroup size: max %zu, actual %zu\n",
-	    kd->kd_method, max_wg_size, kd->kd_wgsize);
 }
 
-size_t
-kernel_wgsize(kernel_data_t *kd)
+bool
+kernel_graph_end(kernel_graph_t *g)
 {
-	return (kd->kd_wgsize);
-}
+	if (Opencl.recording != g) {
+		return (false);
+	}
+	Opencl.recording = NULL;
 
-void
-kernel_setarg(kernel_data_t *kd, int arg, size_t size, void *value)
-{
-	if (clSetKernelArg(kd->kd_kernel, arg, size, value) != 0) {
-		die("Failed to set arg #%d in kernel %s\n", arg, kd->kd_method);
+#ifdef	cl_khr_command_buffer
+	if (!g->kg_broken && g->kg_cmdbuf != NULL &&
+	    Opencl.finalize_cmdbuf(g->kg_cmdbuf) != CL_SUCCESS) {
+		g->kg_broken = true;
 	}
+#endif
+
+	if (g->kg_broken || g->kg_nlaunches == 0) {
+		debug(DB_OPENCL, "Kernel graph recording abandoned\n");
+		kernel_graph_clear(g);
+		return (false);
+	}
+
+	debug(DB_OPENCL, "Recorded kernel graph of %d launches\n",
+	    g->kg_nlaunches);
+	g->kg_valid = true;
+	return (true);
 }
 
-void
-kernel_invoke(kernel_data_t *kd, int dim, size_t *global_arg, size_t *local)
+bool
+kernel_graph_replay(kernel_graph_t *g)
 {
-	size_t	global_default[2] = {
-		P2ROUNDUP((size_t)Width, kd->kd_maxitems[0]),
-		P2ROUNDUP((size_t)Height, kd->kd_maxitems[1])
-	};
-	size_t	*global;
-	cl_int	err;
+	if (!g->kg_valid || g->kg_generation != Opencl.graph_generation ||
+	    Opencl.graphs_disabled || Opencl.forked ||
+	    Opencl.recording != NULL) {
+		return (false);
+	}
 
-	if (global_arg == NULL) {
-		global = global_default;
-	} else {
-		global = global_arg;
+#ifdef	cl_khr_command_buffer
+	if (g->kg_cmdbuf != NULL) {
+		cl_event	ev;
+		const cl_int	err = Opencl.enqueue_cmdbuf(0, NULL,
+		    g->kg_cmdbuf, 0, NULL, (Opencl.tracing ? &ev : NULL));
+
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to enqueue command buffer");
+		}
+		if (Opencl.tracing) {
+			kernel_trace_add(ev, "kernel graph");
+		}
+		return (true);
 	}
+#endif
 
-	err = clEnqueueNDRangeKernel(Opencl.commands, kd->kd_kernel,
-	    dim, NULL, global, local, 0, NULL, NULL);
-	if (err) {
-		ocl_die(err, "Failed to enqueue kernel %s", kd->kd_method);
+	for (int i = 0; i < g->kg_nlaunches; i++) {
+		const kernel_launch_t	*kl = &g->kg_launches[i];
+
+		kernel_enqueue(kl->kl_kernel, kl->kl_method, kl->kl_stats,
+		    kl->kl_dim, kl->kl_global,
+		    (kl->kl_haslocal ? kl->kl_local : NULL));
 	}
+
+	return (true);
 }
 
 void
-kernel_wait(void)
+kernel_graph_invalidate_all(void)
+{
+	Opencl.graph_generation++;
+}
+
+void
+kernel_graphs_disable(void)
 {
-	clFinish(Opencl.commands);
+	Opencl.graphs_disabled = true;
 }
 
+/* ------------------------------------------------------------------ */
+
 void
 kernel_cleanup(kernel_data_t *kd)
 {
-	clReleaseKernel(kd->kd_kernel);
+	for (int i = 0; i < Opencl.nkernels; i++) {
+		if (Opencl.kernels[i] == kd) {
+			Opencl.kernels[i] = Opencl.kernels[--Opencl.nkernels];
+			break;
+		}
+	}
+
+	/*
+	 * Modules clean up all of their kernels when the window is resized,
+	 * and then create them again, so keep the kernel around for that.
+	 */
+	if (kd->kd_kernel != NULL) {
+		if (Opencl.nidle < KERNEL_IDLE_MAX) {
+			kernel_idle_t	*ki = &Opencl.idle[Opencl.nidle++];
+
+			ki->ki_method = kd->kd_method;
+			ki->ki_program =
+			    Opencl.programs[kd->kd_program].kp_program;
+			ki->ki_kernel = kd->kd_kernel;
+		} else {
+			clReleaseKernel(kd->kd_kernel);
+		}
+	}
 	bzero(kd, sizeof (*kd));
 }
 
@@ -621,7 +3410,9 @@ clgl_cl_acquire(cl_mem image)
 		return;
 	}
 
-	err = clEnqueueAcquireGLObjects(Opencl.commands, 1, &image, 0, 0, NULL);
+	kernel_graph_break();
+
+	err = clEnqueueAcquireGLObjects(Opencl.current, 1, &image, 0, 0, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to acquire GL object");
 	}
@@ -637,7 +3428,23 @@ clgl_cl_release(cl_mem image)
 		return;
 	}
 
-	err = clEnqueueReleaseGLObjects(Opencl.commands, 1, &image, 0, 0, &ev);
+	kernel_graph_break();
+
+	/*
+	 * With cl_khr_gl_event, OpenGL commands issued after the release is
+	 * flushed wait for it on their own, so the host doesn't have to.
+	 */
+	if (Opencl.gl_event) {
+		err = clEnqueueReleaseGLObjects(Opencl.current, 1, &image,
+		    0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to release GL object");
+		}
+		clFlush(Opencl.current);
+		return;
+	}
+
+	err = clEnqueueReleaseGLObjects(Opencl.current, 1, &image, 0, 0, &ev);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to release GL object");
 	}
@@ -658,8 +3465,8 @@ clgl_cl_release(cl_mem image)
  */
 
 cl_mem
-ocl_image_create(cl_channel_order order, cl_channel_type datatype,
-    pix_t width, pix_t height)
+ocl_image_create_owner(cl_channel_order order, cl_channel_type datatype,
+    pix_t width, pix_t height, const char *file)
 {
 	cl_mem		image;
 	cl_image_format	format;
@@ -681,12 +3488,30 @@ ocl_image_create(cl_channel_order order, cl_channel_type datatype,
 	desc.num_mip_levels		= 0;
 	desc.num_samples		= 0;
 
+	if ((image = buffer_pool_get(0, &format, width, height)) != NULL) {
+		mem_track(image, file);
+		return (image);
+	}
+	if (width > Opencl.image2d_max[0] || height > Opencl.image2d_max[1]) {
+		die("A %ux%u image is bigger than this GPU can handle "
+		    "(%zux%zu)\n", width, height,
+		    Opencl.image2d_max[0], Opencl.image2d_max[1]);
+	}
+
 	image = clCreateImage(Opencl.context, CL_MEM_READ_WRITE,
 	    &format, &desc, NULL, &err);
+	if ((err == CL_MEM_OBJECT_ALLOCATION_FAILURE ||
+	    err == CL_OUT_OF_RESOURCES) && Opencl.npool > 0) {
+		buffer_pool_flush();
+		image = clCreateImage(Opencl.context, CL_MEM_READ_WRITE,
+		    &format, &desc, NULL, &err);
+	}
 	if (err != CL_SUCCESS) {
-		ocl_die(err, "Failed to allocate OpenCL image");
+		mem_alloc_failed(err, mem_image_bytes(&format, width, height),
+		    file, "image");
 	}
 	assert(image != NULL);
+	mem_track(image, file);
 
 	return (image);
 }
@@ -695,7 +3520,7 @@ ocl_image_create(cl_channel_order order, cl_channel_type datatype,
  * Create an image2d_t that can hold datavec's.
  */
 cl_mem
-ocl_datavec_image_create(pix_t width, pix_t height)
+ocl_datavec_image_create_owner(pix_t width, pix_t height, const char *file)
 {
 #if	DATA_DIMENSIONS == 1
 	const cl_channel_order  order = CL_INTENSITY;
@@ -707,7 +3532,7 @@ ocl_datavec_image_create(pix_t width, pix_t height)
 #error  Do not know how to convert data into an image.
 #endif
 
-	return (ocl_image_create(order, CL_FLOAT, width, height));
+	return (ocl_image_create_owner(order, CL_FLOAT, width, height, file));
 }
 
 void
@@ -718,26 +3543,63 @@ ocl_datavec_image_fill(cl_mem dst, pix_t width, pix_t height,
 	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
 	cl_int		err;
 
-	err = clEnqueueFillImage(Opencl.commands, dst,
+	kernel_graph_break();
+
+	err = clEnqueueFillImage(Opencl.current, dst,
 	    (const void *)datavec, origin, region, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to fill image");
 	}
 }
 
+size_t
+ocl_image_bytes(cl_mem image, pix_t width, pix_t height)
+{
+	size_t	elsize;
+	cl_int	err;
+
+	err = clGetImageInfo(image, CL_IMAGE_ELEMENT_SIZE, sizeof (elsize),
+	    &elsize, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to get image element size");
+	}
+
+	return ((size_t)width * height * elsize);
+}
+
 void
 ocl_image_readfromgpu(const cl_mem gpusrc, void *hostdst,
     pix_t width, pix_t height)
 {
 	const size_t	origin[] = { 0, 0, 0 };
 	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
+	host_mem_t	*hm;
+	size_t		off;
+	hrtime_t	tr;
 	cl_int		err;
 
-	err = clEnqueueReadImage(Opencl.commands,
+	kernel_graph_break();
+	tr = trace_begin();
+
+	if ((hm = host_mem_shared(hostdst,
+	    ocl_image_bytes(gpusrc, width, height), &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyImageToBuffer(Opencl.current, gpusrc,
+		    hm->hm_mem, origin, region, off, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy image from GPU");
+		}
+		host_mem_map(hm, NULL);
+		trace_end(DB_OPENCL, "ocl_image_readfromgpu", tr);
+		return;
+	}
+
+	err = clEnqueueReadImage(Opencl.current,
 	    gpusrc, CL_TRUE, origin, region, 0, 0, hostdst, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to read image from GPU");
 	}
+	trace_end(DB_OPENCL, "ocl_image_readfromgpu", tr);
 }
 
 void
@@ -746,9 +3608,25 @@ ocl_image_writetogpu(const void *hostsrc, cl_mem gpudst,
 {
 	const size_t	origin[] = { 0, 0, 0 };
 	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
+	host_mem_t	*hm;
+	size_t		off;
 	cl_int		err;
 
-	err = clEnqueueWriteImage(Opencl.commands,
+	kernel_graph_break();
+
+	if ((hm = host_mem_shared(hostsrc,
+	    ocl_image_bytes(gpudst, width, height), &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyBufferToImage(Opencl.current, hm->hm_mem,
+		    gpudst, off, origin, region, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy image to GPU");
+		}
+		host_mem_map(hm, NULL);
+		return;
+	}
+
+	err = clEnqueueWriteImage(Opencl.current,
 	    gpudst, CL_TRUE, origin, region, 0, 0, hostsrc, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to write image to GPU");
@@ -767,7 +3645,9 @@ ocl_image_dbgval_off(cl_mem gpusrc, pix_t off)
 	cl_int		err;
 	unsigned int	v;
 
-	err = clEnqueueReadImage(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueReadImage(Opencl.current,
 	    gpusrc, CL_TRUE, origin, region, 0, 0, &v, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to read offset %u of image", off);
@@ -797,7 +3677,9 @@ ocl_image_dbgdatavec_off(cl_mem gpusrc, pix_t off)
 	cl_int		err;
 	cl_datavec	v;
 
-	err = clEnqueueReadImage(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueReadImage(Opencl.current,
 	    gpusrc, CL_TRUE, origin, region, 0, 0, &v, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to read offset %u of image", off);
@@ -822,13 +3704,50 @@ ocl_image_copy(cl_mem src, cl_mem dst, pix_t width, pix_t height)
 	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
 	cl_int		err;
 
-	err = clEnqueueCopyImage(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueCopyImage(Opencl.current,
 	    src, dst, origin, origin, region, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to copy image");
 	}
 }
 
+void
+ocl_image_copy_region(cl_mem src, pix_t x, pix_t y, cl_mem dst,
+    pix_t width, pix_t height)
+{
+	const size_t	src_origin[] = { (size_t)x, (size_t)y, 0 };
+	const size_t	dst_origin[] = { 0, 0, 0 };
+	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
+	cl_int		err;
+
+	kernel_graph_break();
+
+	err = clEnqueueCopyImage(Opencl.current,
+	    src, dst, src_origin, dst_origin, region, 0, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to copy image region");
+	}
+}
+
+void
+ocl_image_copy_rect(cl_mem src, cl_mem dst, pix_t x, pix_t y,
+    pix_t width, pix_t height)
+{
+	const size_t	origin[] = { (size_t)x, (size_t)y, 0 };
+	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
+	cl_int		err;
+
+	kernel_graph_break();
+
+	err = clEnqueueCopyImage(Opencl.current,
+	    src, dst, origin, origin, region, 0, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to copy image rectangle");
+	}
+}
+
 void
 ocl_image_copyfrombuf(cl_mem src, cl_mem image, pix_t width, pix_t height)
 {
@@ -836,7 +3755,9 @@ ocl_image_copyfrombuf(cl_mem src, cl_mem image, pix_t width, pix_t height)
 	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
 	cl_int		err;
 
-	err = clEnqueueCopyBufferToImage(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueCopyBufferToImage(Opencl.current,
 	    src, image, 0, origin, region, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to copy buffer to image");
@@ -850,9 +3771,155 @@ ocl_image_copytobuf(cl_mem image, cl_mem dst, pix_t width, pix_t height)
 	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
 	cl_int		err;
 
-	err = clEnqueueCopyImageToBuffer(Opencl.commands,
+	kernel_graph_break();
+
+	err = clEnqueueCopyImageToBuffer(Opencl.current,
 	    image, dst, origin, region, 0, 0, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		ocl_die(err, "Failed to copy image to buffer");
 	}
 }
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Asynchronous readbacks; see opencl.h.  The callbacks are always run by
+ * readback_poll() or readback_wait(), on the main thread, in the order
+ * that the reads were started.
+ */
+static void
+readback_deliver(void)
+{
+	const readback_t	rb = Opencl.readbacks[0];
+	cl_int			err;
+
+	err = clWaitForEvents(1, &rb.rb_event);
+	if (err != CL_SUCCESS) {
+		ocl_die(err, "Failed to read back data from GPU");
+	}
+	clReleaseEvent(rb.rb_event);
+
+	Opencl.nreadbacks--;
+	memmove(&Opencl.readbacks[0], &Opencl.readbacks[1],
+	    Opencl.nreadbacks * sizeof (Opencl.readbacks[0]));
+
+	// This may start another readback.
+	(*rb.rb_cb)(rb.rb_dst, rb.rb_arg);
+}
+
+static void
+readback_add(cl_event ev, void *hostdst, readback_cb_t cb, void *arg)
+{
+	readback_t	*rb;
+
+	if (Opencl.nreadbacks == READBACK_MAX) {
+		readback_deliver();
+	}
+	rb = &Opencl.readbacks[Opencl.nreadbacks++];
+	rb->rb_event = ev;
+	rb->rb_dst = hostdst;
+	rb->rb_cb = cb;
+	rb->rb_arg = arg;
+
+	/*
+	 * Make sure the GPU actually gets going on this.
+	 */
+	clFlush(Opencl.current);
+}
+
+void
+readback_poll(void)
+{
+	while (Opencl.nreadbacks > 0) {
+		cl_int	status;
+
+		if (clGetEventInfo(Opencl.readbacks[0].rb_event,
+		    CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof (status),
+		    &status, NULL) != CL_SUCCESS || status > CL_COMPLETE) {
+			break;
+		}
+		readback_deliver();
+	}
+}
+
+void
+readback_wait(const void *hostdst)
+{
+	int	last = -1;
+
+	for (int i = 0; i < Opencl.nreadbacks; i++) {
+		if (hostdst == NULL || Opencl.readbacks[i].rb_dst == hostdst) {
+			last = i;
+		}
+	}
+	for (int i = 0; i <= last; i++) {
+		readback_deliver();
+	}
+}
+
+void
+buffer_readfromgpu_async(const cl_mem gpusrc, void *hostdst, size_t size,
+    readback_cb_t cb, void *arg)
+{
+	host_mem_t	*hm;
+	size_t		off;
+	cl_event	ev;
+	cl_int		err;
+
+	readback_wait(hostdst);
+	readback_poll();
+	kernel_graph_break();
+
+	if ((hm = host_mem_shared(hostdst, size, &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyBuffer(Opencl.current, gpusrc, hm->hm_mem,
+		    0, off, size, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy buffer from GPU");
+		}
+		host_mem_map(hm, &ev);
+	} else {
+		err = clEnqueueReadBuffer(Opencl.current,
+		    gpusrc, CL_FALSE, 0, size, hostdst, 0, NULL, &ev);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to read buffer from GPU");
+		}
+	}
+
+	readback_add(ev, hostdst, cb, arg);
+}
+
+void
+ocl_image_readfromgpu_async(const cl_mem gpusrc, void *hostdst,
+    pix_t width, pix_t height, readback_cb_t cb, void *arg)
+{
+	const size_t	origin[] = { 0, 0, 0 };
+	const size_t	region[] = { (size_t)width, (size_t)height, 1 };
+	host_mem_t	*hm;
+	size_t		off;
+	cl_event	ev;
+	cl_int		err;
+
+	readback_wait(hostdst);
+	readback_poll();
+	kernel_graph_break();
+
+	if ((hm = host_mem_shared(hostdst,
+	    ocl_image_bytes(gpusrc, width, height), &off)) != NULL) {
+		host_mem_unmap(hm);
+		err = clEnqueueCopyImageToBuffer(Opencl.current, gpusrc,
+		    hm->hm_mem, origin, region, off, 0, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to copy image from GPU");
+		}
+		host_mem_map(hm, &ev);
+	} else {
+		err = clEnqueueReadImage(Opencl.current, gpusrc, CL_FALSE,
+		    origin, region, 0, 0, hostdst, 0, NULL, &ev);
+		if (err != CL_SUCCESS) {
+			ocl_die(err, "Failed to read image from GPU");
+		}
+	}
+
+	readback_add(ev, hostdst, cb, arg);
+}
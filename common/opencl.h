@@ -11,6 +11,7 @@
 #define _OPENCL_H
 
 #include "types.h"
+#include "osdep.h"
 
 /* ------------------------------------------------------------------ */
 
@@ -24,24 +25,77 @@ opencl_device_name(void);
 const char *
 opencl_device_vendor(void);
 
+/*
+ * Get the version string of the OpenCL driver for the GPU device.
+ * The returned string must not be freed.
+ */
+const char *
+opencl_driver_version(void);
+
 /*
  * Get the maximum workgroup size for the current device.
  */
 size_t
 opencl_device_maxwgsize(void);
 
+/*
+ * Get the largest image2d_t that the current device can make.
+ */
+void
+opencl_device_image2d_max(pix_t *width, pix_t *height);
+
+/*
+ * Get the size of local memory on the current device, in bytes.
+ */
+size_t
+opencl_device_localmem(void);
+
+/*
+ * Get the size of global memory on the current device, in bytes.
+ */
+uint64_t
+opencl_device_globalmem(void);
+
+/*
+ * Get the number of compute units on the current device.
+ */
+int
+opencl_device_computeunits(void);
+
 /* ------------------------------------------------------------------ */
 
+/*
+ * The most arguments, and the largest argument, that kernel_setarg() keeps
+ * a copy of.  Kernels with more, or bigger, arguments still work; they just
+ * can't be recorded in a kernel graph (see below).
+ */
+#define	KERNEL_MAX_ARGS		24
+#define	KERNEL_MAX_ARGSIZE	32
+
 typedef struct {
-	cl_kernel	kd_kernel;
+	cl_kernel	kd_kernel;	/* NULL until first needed */
 	const char	*kd_method;
+	int		kd_program;	/* which program it's in */
 	size_t		kd_wgsize;
 	size_t		kd_maxitems[2];
+	int		kd_stats;	/* index into per-kernel stats */
+
+	/*
+	 * The argument values most recently set.
+	 */
+	int		kd_nargs;
+	bool		kd_argsok;	/* all of them fit in kd_argval */
+	bool		kd_argset[KERNEL_MAX_ARGS];
+	bool		kd_argnull[KERNEL_MAX_ARGS];	/* e.g. __local */
+	size_t		kd_argsize[KERNEL_MAX_ARGS];
+	uint8_t		kd_argval[KERNEL_MAX_ARGS][KERNEL_MAX_ARGSIZE];
 } kernel_data_t;
 
 /*
  * Create a computation kernel. "kd" holds the relevant metadata;
- * "method" is the name of the OpenCL method.
+ * "method" is the name of the OpenCL method.  This starts building the
+ * OpenCL program that holds the method, if that hasn't been done yet;
+ * nothing waits for the build until the kernel is actually used.
  */
 extern void
 kernel_create(kernel_data_t *kd, const char *method);
@@ -85,9 +139,214 @@ kernel_invoke(kernel_data_t *kd, int dim, size_t *global, size_t *local);
 extern void
 kernel_wait(void);
 
+/*
+ * Measure how long the GPU spends running the kernels that get launched
+ * between kernel_timing_start() and kernel_timing_stop(); the latter waits
+ * for them to finish, and returns the total in nanoseconds.  This uses the
+ * GPU's own event timestamps if opencl_profiling_enable() was called before
+ * the OpenCL module was initialized, and host time otherwise.
+ */
+extern void
+opencl_profiling_enable(void);
+
+extern bool
+opencl_profiling_enabled(void);
+
+/*
+ * Streams of independent work.  opencl_streams_enable() asks for up to "n"
+ * command queues; like opencl_profiling_enable(), it has to be called
+ * before the OpenCL module is initialized.  opencl_streams() says how many
+ * there are.
+ *
+ * After opencl_fork(), opencl_stream(s) directs all subsequent work to
+ * stream (s % opencl_streams()); opencl_join() then makes everything after
+ * it wait for all of the streams, and goes back to stream 0.  Work in
+ * different streams can run at the same time, so it mustn't share any
+ * buffers that are written.  With only one stream, all of these are no-ops.
+ */
+#define	OPENCL_MAX_STREAMS	4
+
+extern void
+opencl_streams_enable(int n);
+
+extern int
+opencl_streams(void);
+
+extern void
+opencl_fork(void);
+
+extern void
+opencl_stream(int s);
+
+extern int
+opencl_stream_current(void);
+
+extern void
+opencl_join(void);
+
+/*
+ * A separate command queue for the display.  opencl_display_enable() asks
+ * for it; like opencl_streams_enable(), it has to be called before the
+ * OpenCL module is initialized.  Between opencl_display_begin() and
+ * opencl_display_end(), all work goes to the display queue instead of the
+ * main one.  This lets a display thread copy and show finished images while
+ * the main queue is busy with the next one.  The caller has to make sure
+ * that only one thread at a time enqueues anything.
+ */
+extern void
+opencl_display_enable(void);
+
+extern void
+opencl_display_begin(void);
+
+extern void
+opencl_display_end(void);
+
+/*
+ * opencl_marker() returns an event for the end of the work enqueued so far,
+ * and opencl_marker_wait() waits for it and releases it.  The wait touches
+ * nothing but the event, so it can be done without holding whatever keeps
+ * other threads from enqueueing work.
+ */
+extern cl_event
+opencl_marker(void);
+
+extern void
+opencl_marker_wait(cl_event ev);
+
+/*
+ * Run everything on the CPU's OpenCL device (such as PoCL, or Intel's CPU
+ * runtime), which spreads each kernel launch across all of the cores and
+ * vectorizes it.  That's also what happens when running headless on a
+ * machine with no GPU.  There's no sharing with OpenGL, so this only
+ * works headless.  This has to be called before opencl_preinit().
+ */
+extern void
+opencl_cpu_enable(void);
+
+/*
+ * When running headless, use GPU "d" (counting from 0, in the order the
+ * platform lists them) rather than the one that would have been picked.
+ * This has to be called before opencl_preinit().
+ *
+ * opencl_gpu_count() says how many GPUs there are to pick from.  It starts
+ * up the OpenCL runtime to find out, so it's best called in a process of
+ * its own.
+ */
+extern void
+opencl_device_pick(int d);
+
+extern int
+opencl_gpu_count(void);
+
+/*
+ * Per-kernel GPU statistics.  If the profiling queue is enabled, then while
+ * the "GPU kernel stats" debug area is active, every kernel launch gets an
+ * event, and the time it took on the GPU is added to the stats for its
+ * method once it has finished.  This never waits for the GPU; finished
+ * events are collected whenever another kernel is launched.  The stats are
+ * dumped periodically while the area is active, and when it's turned off.
+ */
+extern void
+kernel_stats_dump(void);
+
+/*
+ * Timeline tracing; see trace.h.  Between opencl_trace_start() and
+ * opencl_trace_stop(), every kernel launch gets an event, as with the
+ * stats, and each finished one is handed to trace_gpu() with its times
+ * converted to the host's clock.  opencl_trace_stop() waits for the GPU
+ * so that nothing is left out.  This needs the profiling queue.
+ */
+extern void
+opencl_trace_start(void);
+
+extern void
+opencl_trace_stop(void);
+
+extern void
+kernel_timing_start(void);
+
+extern hrtime_t
+kernel_timing_stop(void);
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Kernel graphs.  Most of the kernel launches in a frame are the same from
+ * one frame to the next, with the same arguments, so rather than setting
+ * all of the arguments and enqueueing each kernel again, a sequence of
+ * launches can be recorded once and replayed.
+ *
+ * kernel_graph_record() starts recording: subsequent kernel launches still
+ * run as usual, and are also added to the graph.  kernel_graph_end() stops
+ * recording, and returns true if the graph can be replayed.  It can't be if
+ * anything other than a kernel launch was enqueued while recording (a
+ * buffer copy, say), or if opencl_fork() was used.
+ *
+ * kernel_graph_replay() enqueues the recorded launches again, with the
+ * arguments they had when recorded, and returns true; or it returns false
+ * if there's no valid recording, in which case the caller should do the
+ * work itself (probably recording it again).  Recordings are invalidated
+ * by kernel_graph_invalidate_all(), which should be called by anything that
+ * changes state that recorded launches depend on other than their
+ * arguments (such as parameter tables that decide which kernels are used).
+ *
+ * If the device supports cl_khr_command_buffer, the graph is replayed as a
+ * command buffer.  Otherwise, each launch gets its own copy of the kernel
+ * with its arguments already set, which still saves all of the
+ * kernel_setarg() calls.  kernel_graphs_disable() turns all of this off,
+ * so that kernel_graph_replay() always returns false.
+ */
+typedef struct kernel_graph	kernel_graph_t;
+
+extern kernel_graph_t *
+kernel_graph_create(void);
+
+extern void
+kernel_graph_destroy(kernel_graph_t **gp);
+
+extern void
+kernel_graph_record(kernel_graph_t *g);
+
+extern bool
+kernel_graph_end(kernel_graph_t *g);
+
+extern bool
+kernel_graph_replay(kernel_graph_t *g);
+
+extern void
+kernel_graph_invalidate_all(void);
+
+extern void
+kernel_graphs_disable(void);
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Program specialization.  Kernels can use SPEC_W(W), SPEC_H(H),
+ * SPEC_NSCALES(nscales) and SPEC_NBOX(nbox) in place of those arguments;
+ * in the generic program, they're just the argument, but in a program
+ * built with -DZOUNDS_NSCALES=<n> (for example), the compiler can assume
+ * that nscales == n, with a fallback for any other value.
+ *
+ * A core calls opencl_specialize() every step with the -D options that
+ * describe its current configuration.  Once the same options have been
+ * asked for a number of times in a row, a program specialized for them is
+ * loaded from the binary cache or built in the background; meanwhile, the
+ * generic program keeps being used.  When it's ready, all kernels are
+ * moved over to it, with their arguments intact.  This has no effect on
+ * results, since a specialized program handles every configuration.
+ */
+extern void
+opencl_specialize(const char *options);
+
+extern void
+opencl_specialize_disable(void);
+
 /*
  * Release all resources associated with "kd". "kd" must not be used after
- * this is called.
+ * this is called.  The OpenCL kernel itself is kept, so that creating the
+ * same kernel again (e.g. after a resize) is cheap.
  */
 extern void
 kernel_cleanup(kernel_data_t *kd);
@@ -95,10 +354,47 @@ kernel_cleanup(kernel_data_t *kd);
 /* ------------------------------------------------------------------ */
 
 /*
- * Allocate a GPU buffer of the specified size.
+ * Allocate host memory that's fast to transfer to and from the GPU, for
+ * things that are copied every frame.  Any part of it can be passed to
+ * buffer_writetogpu(), buffer_readfromgpu(), ocl_image_writetogpu() and
+ * ocl_image_readfromgpu(); on a GPU that shares memory with the host,
+ * nothing is copied through the host at all.  It must be freed with
+ * host_free(), before opencl_postfini() runs; freeing a NULL pointer
+ * does nothing.
  */
+extern void *
+host_alloc(size_t size);
+
+extern void
+host_free(void **ptr);
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Allocate a GPU buffer of the specified size.  The memory is charged to
+ * the calling source file until it's freed; see opencl_mem_report().
+ */
+#define	buffer_alloc(size)	buffer_alloc_owner((size), __FILE__)
+
 extern cl_mem
-buffer_alloc(size_t size);
+buffer_alloc_owner(size_t size, const char *file);
+
+/*
+ * Report how much GPU memory is in use, and which source files hold it,
+ * against the size of the GPU's memory.  This also notes how much memory
+ * each pixel of the current image size takes, for opencl_mem_fits().
+ */
+extern void
+opencl_mem_report(void);
+
+/*
+ * Returns false if "width" x "height" images probably won't fit in the
+ * GPU's memory, going by how much the last opencl_mem_report() saw per
+ * pixel.  In that case, "*scalep" is about how much the image would have
+ * to be scaled by to fit.
+ */
+extern bool
+opencl_mem_fits(pix_t width, pix_t height, float *scalep);
 
 /*
  * Copy the buffer at "hostsrc" to the GPU buffer at "gpudst".
@@ -106,6 +402,14 @@ buffer_alloc(size_t size);
 extern void
 buffer_writetogpu(const void *hostsrc, cl_mem gpudst, size_t size);
 
+/*
+ * Like buffer_writetogpu(), but don't wait for the copy.  "hostsrc" must be
+ * left alone until the event that's returned has completed; pass it to
+ * opencl_marker_wait() to wait for that and release it.
+ */
+extern cl_event
+buffer_writetogpu_async(const void *hostsrc, cl_mem gpudst, size_t size);
+
 /*
  * Copy the GPU buffer at "src" to the GPU buffer at "dst".
  */
@@ -159,26 +463,66 @@ buffer_datavec_sumup(cl_mem gpusrc);
 
 /*
  * Free the GPU buffer pointed to by "buf".  (note, unlike the rest of these
- * routines, this takes a pointer to the buffer)
+ * routines, this takes a pointer to the buffer)  This also works for
+ * images.  Buffers and images are kept in a pool of limited size, so that
+ * buffer_alloc() and ocl_image_create() can reuse them; a reused buffer
+ * may be bigger than what was asked for, and its contents are undefined.
  */
 extern void
 buffer_free(cl_mem *buf);
 
+/*
+ * Transient buffers.  Some buffers are only used during one part of each
+ * frame, and don't need to keep what's in them from one frame to the next.
+ * transient_alloc() takes the parts of the frame that the buffer is used
+ * in, and buffers that are never in use during the same part share memory;
+ * so whatever is in one of them is undefined each time its part starts.
+ * Since the streams are always joined before a part ends, the parts follow
+ * each other on the GPU the same way they do here.
+ *
+ * The memory stays the same until transient_free(), which has to be given
+ * the same phases.  Slots don't grow once they're handed out, so the bigger
+ * a buffer is, the sooner it should be asked for.
+ */
+typedef enum {
+	TR_STEP =	0x1,		/* the core's step: blurs, etc. */
+	TR_HEATMAP =	0x2,		/* heatmap_update() */
+	TR_OUTPUT =	0x4		/* converting images for output */
+} transient_phase_t;
+
+#define	TR_NPHASES	3
+
+#define	transient_alloc(size, phases)					\
+	transient_alloc_owner((size), (phases), __FILE__)
+
+extern cl_mem
+transient_alloc_owner(size_t size, int phases, const char *file);
+
+extern void
+transient_free(cl_mem *buf, int phases);
+
 /* ------------------------------------------------------------------ */
 
 /*
  * Create an OpenCL image2d_t (in GPU memory) that can hold the type of data
  * specified by "order" and "datatype".
  */
+#define	ocl_image_create(order, datatype, width, height)		\
+	ocl_image_create_owner((order), (datatype), (width), (height),	\
+	    __FILE__)
+
 extern cl_mem
-ocl_image_create(cl_channel_order order, cl_channel_type datatype,
-    pix_t width, pix_t height);
+ocl_image_create_owner(cl_channel_order order, cl_channel_type datatype,
+    pix_t width, pix_t height, const char *file);
 
 /*
  * Create an OpenCL image2d_t that can hold datavec's.
  */
+#define	ocl_datavec_image_create(width, height)				\
+	ocl_datavec_image_create_owner((width), (height), __FILE__)
+
 extern cl_mem
-ocl_datavec_image_create(pix_t width, pix_t height);
+ocl_datavec_image_create_owner(pix_t width, pix_t height, const char *file);
 
 /*
  * Fill an OpenCL image2d_t with the given datavec, over and over.
@@ -187,6 +531,13 @@ extern void
 ocl_datavec_image_fill(cl_mem dst, pix_t width, pix_t height,
     cl_datavec *datavec);
 
+/*
+ * How many bytes a tightly packed copy of "width" x "height" of "image"
+ * takes up.
+ */
+extern size_t
+ocl_image_bytes(cl_mem image, pix_t width, pix_t height);
+
 /*
  * Copy the OpenCL image2d_t at "gpusrc" to the host buffer at "hostdst".
  */
@@ -235,6 +586,22 @@ ocl_image_copy(cl_mem src, cl_mem dst, pix_t width, pix_t height);
 extern void
 ocl_image_copyfrombuf(cl_mem src, cl_mem image, pix_t width, pix_t height);
 
+/*
+ * Copy the "width" x "height" region at ("x", "y") in the OpenCL image2d_t
+ * "src" to the top left corner of "dst".
+ */
+extern void
+ocl_image_copy_region(cl_mem src, pix_t x, pix_t y, cl_mem dst,
+    pix_t width, pix_t height);
+
+/*
+ * Copy the "width" x "height" region at ("x", "y") in the OpenCL image2d_t
+ * "src" to the same place in "dst".
+ */
+extern void
+ocl_image_copy_rect(cl_mem src, cl_mem dst, pix_t x, pix_t y,
+    pix_t width, pix_t height);
+
 /*
  * Copy the contents of the OpenCL image2d_t at "image" to the OpenCL buffer
  * at "dst". The buffer must have a size given by
@@ -245,6 +612,42 @@ ocl_image_copytobuf(cl_mem image, cl_mem dst, pix_t width, pix_t height);
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * Asynchronous readbacks.  These start reading "gpusrc" into "hostdst",
+ * like buffer_readfromgpu() and ocl_image_readfromgpu(), but return right
+ * away; "cb" is called with "hostdst" and "arg" once the data is there.
+ * That happens in readback_poll() (called at the start of each frame, and
+ * by each new readback) or readback_wait(), so results usually show up a
+ * frame later, and the callback can do anything that the main loop can.
+ * Starting a readback into a "hostdst" that already has one outstanding
+ * waits for the older one first.  kernel_wait() delivers everything, so
+ * nothing is left outstanding when the modules' fini() routines run.
+ */
+typedef void (*readback_cb_t)(void *hostdst, void *arg);
+
+extern void
+buffer_readfromgpu_async(const cl_mem gpusrc, void *hostdst, size_t size,
+    readback_cb_t cb, void *arg);
+
+extern void
+ocl_image_readfromgpu_async(const cl_mem gpusrc, void *hostdst,
+    pix_t width, pix_t height, readback_cb_t cb, void *arg);
+
+/*
+ * Run the callbacks for any readbacks that have finished.
+ */
+extern void
+readback_poll(void);
+
+/*
+ * Wait for the readbacks into "hostdst" (or all of them, if it's NULL),
+ * and anything started before them, and run their callbacks.
+ */
+extern void
+readback_wait(const void *hostdst);
+
+/* ------------------------------------------------------------------ */
+
 /*
  * Create an OpenCL image2d_t from an OpenGL texture.
  */
@@ -253,7 +656,8 @@ clgl_makeimage(uint32_t TextureTarget, uint32_t TextureId);
 
 /*
  * Acquire OpenCL access to the specified CL/GL image.
- * Graphics rendering must not take place while OpenCL has access to it.
+ * Graphics rendering must not take place while OpenCL has access to it,
+ * and must have finished before this is called (see texture_wait()).
  */
 extern void
 clgl_cl_acquire(cl_mem image);
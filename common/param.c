@@ -22,6 +22,8 @@
 #include "osdep.h"
 #include "param.h"
 #include "randbj.h"
+#include "session.h"
+#include "telemetry.h"
 #include "util.h"
 
 static void autopilot_disable(void);
@@ -39,12 +41,29 @@ typedef struct {
 	int		value;		/* current parameter value */
 
 	/* Data used by autopilot: */
+	int		ap_min;		/* lowest value it picks */
 	int		ap_target;	/* target parameter value */
 	int		ap_frequency;	/* frequency of autopiloting */
 	hrtime_t	ap_delay;	/* delay between each tweak */
 	hrtime_t	ap_nextstep;	/* time of next tweak */
 } param_t;
 
+/*
+ * Autopilot's cost model; see param_costly().  There's a cell for each
+ * combination of the costly parameters' values, holding the frame time
+ * seen with those values.
+ */
+#define	PARAM_COSTLY_MAX	4	/* costly parameters */
+#define	PARAM_COST_CELLS	4096	/* combinations of their values */
+#define	PARAM_COST_SAMPLES	16	/* frames before a cell is trusted */
+#define	PARAM_COST_SETTLE	4	/* frames to skip after a change */
+#define	PARAM_COST_TRIES	8	/* random targets to try */
+
+typedef struct {
+	float		pc_msec;	/* mean frame time */
+	int		pc_n;		/* frames counted in it */
+} param_cost_t;
+
 /*
  * Callback for when a parameter changes.
  */
@@ -76,6 +95,16 @@ static struct {
 	bool		noop_registered;
 
 	bool		ap_enabled;	/* is autopilot enabled? */
+	uint64_t	changes;	/* see param_changes() */
+
+	param_id_t	costly[PARAM_COSTLY_MAX];	/* see param_costly() */
+	int		ncostly;
+	int		ncells;		/* combinations of their values */
+	param_cost_t	*cost_table;	/* one per combination */
+	float		budget;		/* msec per frame, or 0 */
+	int		cost_cell;	/* cell for the current values */
+	int		cost_settle;	/* frames before it's counted */
+	int		cost_scratch[PARAM_COSTLY_MAX];	/* for presets */
 } Param;
 
 /* ------------------------------------------------------------------ */
@@ -187,6 +216,10 @@ param_set(param_id_t id, param_update_t pu, int nv)
 		verbose(DB_PARAM, "Changing %s %s: %d -> %d\n",
 		    param->pi.pi_name, name, *ovp, nv);
 		*ovp = nv;
+		if (pu == PU_VALUE) {
+			session_param(param->pi.pi_name, nv);
+			Param.changes++;
+		}
 	}
 
 	/*
@@ -201,6 +234,21 @@ param_set(param_id_t id, param_update_t pu, int nv)
 	}
 }
 
+void
+param_autopilot_min(param_id_t id, int min)
+{
+	param_t	*const	param = &Param.value_table[id];
+
+	assert(param->pi.pi_min <= min && min <= param->pi.pi_max);
+	param->ap_min = min;
+}
+
+uint64_t
+param_changes(void)
+{
+	return (Param.changes);
+}
+
 static void
 param_target_set(param_id_t id, int nt)
 {
@@ -214,7 +262,7 @@ static int
 param_choose_target(param_id_t id)
 {
 	param_t		*param = &Param.value_table[id];
-	const int	min = param->pi.pi_min;
+	const int	min = param->ap_min;
 	const int	max = param->pi.pi_max;
 	const int	nv = (lrandbj() % (max - min + 1)) + min;
 
@@ -287,6 +335,18 @@ param_set_float(param_id_t id, float newvalue)
 	autopilot_disable();
 }
 
+/*
+ * Set the parameter's value in its own units, as param_dump() does, without
+ * touching autopilot.  Values out of range are clamped.
+ */
+void
+param_set_raw(param_id_t id, int val)
+{
+	param_t	*const	param = &Param.value_table[id];
+
+	param_value_set(id, MAX(MIN(val, param->pi.pi_max), param->pi.pi_min));
+}
+
 static void
 param_reset_to_defaults_withcb(void (*cb)(param_id_t, int))
 {
@@ -305,6 +365,20 @@ param_reset_to_defaults(void)
 	param_reset_to_defaults_withcb(param_value_set);
 }
 
+void
+param_randomize(uint64_t keep)
+{
+	for (param_id_t id = 0; id < Param.value_count; id++) {
+		param_t	*const	param = &Param.value_table[id];
+
+		if ((keep & (1ULL << id)) == 0 &&
+		    param->pi.pi_ap_freq != APF_OFF &&
+		    strlen(param->pi.pi_abbrev) > 0) {
+			param_value_set(id, param_choose_target(id));
+		}
+	}
+}
+
 /*
  * ------------------------------------------------------------------
  * Registering and unregistering parameters, presets, and callbacks.
@@ -421,6 +495,7 @@ param_register(const param_init_t *pi)
 		param->pi.pi_name = "";
 	}
 	param->value = pi->pi_default;
+	param->ap_min = pi->pi_min;
 	param->ap_target = pi->pi_default;
 	param->ap_frequency = ap_frequency(pi->pi_ap_freq);
 	param->ap_nextstep = 0;
@@ -677,6 +752,7 @@ param_undump_withcb(const char *buf, void (*cb)(param_id_t id, int val))
 	for (;;) {
 		char		a[3];
 		int		val;
+		bool		neg;
 		param_id_t	id;
 
 		if (strlen(buf) < 2) {
@@ -685,9 +761,16 @@ param_undump_withcb(const char *buf, void (*cb)(param_id_t id, int val))
 		strncpy(a, buf, 2);
 		a[2] = '\0';
 
-		for (buf += 2, val = 0; *buf >= '0' && *buf <= '9'; buf++) {
+		buf += 2;
+		if ((neg = (*buf == '-'))) {
+			buf++;
+		}
+		for (val = 0; *buf >= '0' && *buf <= '9'; buf++) {
 			val = val * 10 + (*buf - '0');
 		}
+		if (neg) {
+			val = -val;
+		}
 
 		for (id = 0; id < Param.value_count; id++) {
 			param_t	*const	param = &Param.value_table[id];
@@ -809,6 +892,288 @@ autopilot_pause(void)
 	autopilot_target(id, target);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * Keeping autopilot within a frame-time budget.
+ *
+ * Costly parameters are assumed to make frames slower as they go up, so a
+ * combination that hasn't been seen yet costs at least as much as any that
+ * has been seen with no larger a value of any of them.  Autopilot doesn't
+ * pick targets or presets that are known to go over the budget, stops
+ * walking a parameter up once the next step is known to, and backs off if
+ * the current combination turns out to.  Combinations nobody knows about
+ * yet are fair game, since that's how they get measured.
+ */
+
+void
+param_costly(param_id_t id)
+{
+	param_t	*const	param = &Param.value_table[id];
+	const int	range = param->pi.pi_max - param->pi.pi_min + 1;
+	const int	ncells = MAX(Param.ncells, 1) * range;
+
+	if (Param.ncostly == PARAM_COSTLY_MAX ||
+	    ncells > PARAM_COST_CELLS) {
+		die("Too many costly parameters; increase PARAM_COSTLY_MAX "
+		    "or PARAM_COST_CELLS\n");
+	}
+	Param.costly[Param.ncostly++] = id;
+	Param.ncells = ncells;
+
+	mem_free((void **)&Param.cost_table);
+	Param.cost_table = mem_alloc(ncells * sizeof (param_cost_t));
+	bzero(Param.cost_table, ncells * sizeof (param_cost_t));
+	Param.cost_cell = -1;
+}
+
+void
+autopilot_budget(float msec)
+{
+	Param.budget = msec;
+	if (msec > 0) {
+		telemetry_enable();
+	}
+}
+
+/*
+ * Which cell holds the costly parameters' values "vals".
+ */
+static int
+cost_cell(const int *vals)
+{
+	int	cell = 0;
+
+	for (int k = Param.ncostly - 1; k >= 0; k--) {
+		const param_init_t	*pi =
+		    &Param.value_table[Param.costly[k]].pi;
+
+		cell = cell * (pi->pi_max - pi->pi_min + 1) +
+		    (vals[k] - pi->pi_min);
+	}
+	return (cell);
+}
+
+/*
+ * Get the costly parameters' current values, or their targets.
+ */
+static void
+cost_values(int *vals, bool targets)
+{
+	for (int k = 0; k < Param.ncostly; k++) {
+		const param_t	*param = &Param.value_table[Param.costly[k]];
+
+		vals[k] = (targets ? param->ap_target : param->value);
+	}
+}
+
+/*
+ * The frame time that "vals" is expected to take, or 0 if nothing is
+ * known about it.
+ */
+static float
+cost_predict(const int *vals)
+{
+	const param_cost_t	*pc = &Param.cost_table[cost_cell(vals)];
+	float			lower = 0;
+
+	if (pc->pc_n >= PARAM_COST_SAMPLES) {
+		return (pc->pc_msec);
+	}
+
+	for (int c = 0; c < Param.ncells; c++) {
+		int	rest = c;
+		int	k;
+
+		pc = &Param.cost_table[c];
+		if (pc->pc_n < PARAM_COST_SAMPLES || pc->pc_msec <= lower) {
+			continue;
+		}
+		for (k = 0; k < Param.ncostly; k++) {
+			const param_init_t	*pi =
+			    &Param.value_table[Param.costly[k]].pi;
+			const int		range =
+			    pi->pi_max - pi->pi_min + 1;
+
+			if (pi->pi_min + rest % range > vals[k]) {
+				break;
+			}
+			rest /= range;
+		}
+		if (k == Param.ncostly) {
+			lower = pc->pc_msec;
+		}
+	}
+
+	return (lower);
+}
+
+static bool
+cost_fits(const int *vals)
+{
+	return (Param.budget <= 0 || Param.ncostly == 0 ||
+	    cost_predict(vals) <= Param.budget);
+}
+
+/*
+ * Charge the last frame's time to the cell it was drawn with.  A few
+ * frames are skipped after each change, since those may have been queued
+ * up with the old values.
+ */
+static void
+autopilot_cost_measure(void)
+{
+	int		vals[PARAM_COSTLY_MAX];
+	param_cost_t	*pc;
+	double		msec;
+	int		cell;
+
+	if (Param.budget <= 0 || Param.ncostly == 0) {
+		return;
+	}
+
+	cost_values(vals, false);
+	cell = cost_cell(vals);
+	if (cell != Param.cost_cell) {
+		Param.cost_cell = cell;
+		Param.cost_settle = PARAM_COST_SETTLE;
+		return;
+	}
+	if (Param.cost_settle > 0) {
+		Param.cost_settle--;
+		return;
+	}
+	if ((msec = telemetry_last(TM_FRAME)) < 0) {
+		return;
+	}
+
+	pc = &Param.cost_table[cell];
+	pc->pc_n++;
+	pc->pc_msec += ((float)msec - pc->pc_msec) /
+	    MIN(pc->pc_n, PARAM_COST_SAMPLES);
+	if (pc->pc_n == PARAM_COST_SAMPLES) {
+		debug(DB_PARAM, "Autopilot: cell %d takes %.2f msec\n",
+		    cell, pc->pc_msec);
+	}
+}
+
+/*
+ * If the current values are known to be over budget, start walking one of
+ * the costly parameters down.
+ */
+static void
+autopilot_cost_enforce(void)
+{
+	int		vals[PARAM_COSTLY_MAX];
+	const param_cost_t *pc;
+	int		k, n;
+
+	if (Param.budget <= 0 || Param.ncostly == 0) {
+		return;
+	}
+	cost_values(vals, false);
+	pc = &Param.cost_table[cost_cell(vals)];
+	if (pc->pc_n < PARAM_COST_SAMPLES || pc->pc_msec <= Param.budget) {
+		return;
+	}
+
+	for (k = 0, n = 0; k < Param.ncostly; k++) {
+		const param_t	*param = &Param.value_table[Param.costly[k]];
+
+		if (param->ap_target < param->value) {
+			return;		/* already on the way down */
+		}
+		if (param->value > param->ap_min) {
+			n++;
+		}
+	}
+	if (n == 0) {
+		return;
+	}
+
+	n = lrandbj() % n;
+	for (k = 0; k < Param.ncostly; k++) {
+		const param_id_t	id = Param.costly[k];
+		const param_t		*param = &Param.value_table[id];
+
+		if (param->value > param->ap_min && n-- == 0) {
+			debug(DB_PARAM, "Autopilot: %.2f msec is over budget; "
+			    "backing %s off\n", pc->pc_msec, param->pi.pi_name);
+			autopilot_target(id, param->value - 1);
+			return;
+		}
+	}
+}
+
+/*
+ * Pick a random target for "id" that isn't known to go over budget, given
+ * where the other costly parameters are headed.  If none turns up, it
+ * stays where it is.
+ */
+static int
+autopilot_choose_target(param_id_t id)
+{
+	int	vals[PARAM_COSTLY_MAX];
+	int	k;
+
+	for (k = 0; k < Param.ncostly && Param.costly[k] != id; k++) {
+		continue;
+	}
+	if (k == Param.ncostly || Param.budget <= 0) {
+		return (param_choose_target(id));
+	}
+
+	cost_values(vals, true);
+	for (int t = 0; t < PARAM_COST_TRIES; t++) {
+		vals[k] = param_choose_target(id);
+		if (cost_fits(vals)) {
+			return (vals[k]);
+		}
+	}
+	return (Param.value_table[id].value);
+}
+
+/*
+ * Whether stepping "id" up one would stay within budget.
+ */
+static bool
+autopilot_step_fits(param_id_t id)
+{
+	int	vals[PARAM_COSTLY_MAX];
+
+	for (int k = 0; k < Param.ncostly; k++) {
+		if (Param.costly[k] == id) {
+			cost_values(vals, false);
+			vals[k]++;
+			return (cost_fits(vals));
+		}
+	}
+	return (true);
+}
+
+static void
+cost_collect(param_id_t id, int val)
+{
+	for (int k = 0; k < Param.ncostly; k++) {
+		if (Param.costly[k] == id) {
+			Param.cost_scratch[k] = val;
+		}
+	}
+}
+
+/*
+ * Whether preset "pp" is within budget.
+ */
+static bool
+autopilot_preset_fits(const param_preset_t *pp)
+{
+	if (Param.budget <= 0 || Param.ncostly == 0) {
+		return (true);
+	}
+	cost_values(Param.cost_scratch, true);
+	param_undump_withcb(pp->pp_dumpstr, cost_collect);
+	return (cost_fits(Param.cost_scratch));
+}
+
 /*
  * Called before core_step(), so autopilot can provide fresh parameter values.
  * This runs the parameter autopilot.
@@ -819,9 +1184,11 @@ autopilot_step(void)
 	param_id_t	id;
 	hrtime_t	now;
 
+	autopilot_cost_measure();
 	if (!Param.ap_enabled) {
 		return;
 	}
+	autopilot_cost_enforce();
 
 	/*
 	 * Are there any parameters that autopilot is still tweaking?
@@ -850,6 +1217,12 @@ autopilot_step(void)
 			const size_t	i = lrandbj() % Param.preset_count;
 			param_preset_t	*pp = &Param.preset_table[i];
 
+			if (!autopilot_preset_fits(pp)) {
+				debug(DB_PARAM, "Autopilot: \"%s\" preset "
+				    "would be too slow\n", pp->pp_descr);
+				autopilot_pause();
+				return;
+			}
 			debug(DB_PARAM,
 			    "Autopilot: using \"%s\" preset string\n",
 			    pp->pp_descr);
@@ -890,7 +1263,7 @@ autopilot_step(void)
 			/*
 			 * Got one. Choose and set a random target for it.
 			 */
-			autopilot_target(id, param_choose_target(id));
+			autopilot_target(id, autopilot_choose_target(id));
 		}
 	}
 
@@ -903,6 +1276,13 @@ autopilot_step(void)
 		if (param->ap_nextstep > now) {
 			continue;
 		} else if (param->value < param->ap_target) {
+			if (!autopilot_step_fits(id)) {
+				debug(DB_PARAM, "Autopilot: stopping %s at %d; "
+				    "%d would be too slow\n", param->pi.pi_name,
+				    param->value, param->value + 1);
+				param->ap_target = param->value;
+				continue;
+			}
 			param->ap_nextstep = now + param->ap_delay;
 			param_value_adjust(id, 1);
 		} else if (param->value > param->ap_target) {
@@ -143,12 +143,43 @@ param_set_int(param_id_t id, int val);
 extern void
 param_set_float(param_id_t id, float val);
 
+/*
+ * Set the current value of parameter "id" to "val", in the units that
+ * param_dump() uses, and without disabling autopilot.  This is for replaying
+ * a recorded session.
+ */
+extern void
+param_set_raw(param_id_t id, int val);
+
+/*
+ * Keep autopilot, and param_randomize(), from picking a value of "id" below
+ * "min".  Lower values can still be set by hand, or by a preset.
+ */
+extern void
+param_autopilot_min(param_id_t id, int min);
+
+/*
+ * How many times any parameter's value has changed.  Anything that depends
+ * on the parameters can compare this against what it was the last time to
+ * tell whether it's still up to date.
+ */
+extern uint64_t
+param_changes(void);
+
 /*
  * Reset all parameters to their default values.
  */
 extern void
 param_reset_to_defaults(void);
 
+/*
+ * Set every parameter that autopilot can tune, and that shows up in a
+ * param_dump() string, to a random value; the ones whose IDs are set in
+ * the bitmask "keep" are left alone.
+ */
+extern void
+param_randomize(uint64_t keep);
+
 /*
  * Dump the current parameters into a string.
  */
@@ -169,4 +200,17 @@ autopilot_step(void);
 extern void
 autopilot_enable(void);
 
+/*
+ * Mark "id" as a parameter whose value changes how long each frame takes:
+ * the higher it is, the slower.  With a budget of "msec" per frame, the
+ * autopilot learns how long each combination of the costly parameters'
+ * values takes, and keeps away from the ones that go over.  The others are
+ * explored as usual.
+ */
+extern void
+param_costly(param_id_t id);
+
+extern void
+autopilot_budget(float msec);
+
 #endif	/* _PARAM_H */
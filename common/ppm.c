@@ -10,6 +10,8 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ppm.h"
 #include "debug.h"
@@ -45,40 +47,36 @@ ppm_read_sizes(const char *filename, pix_t *widthp, pix_t *heightp)
 }
 
 /*
- * Read a PPM file into a three-byte-per-pixel RGB uint8_t array.
+ * Check the "len" bytes of PPM header in "buf" (which doesn't have to be
+ * NUL-terminated) against the expected size, and find where the pixel data
+ * starts.
  */
-bool
-ppm_read_rgb(const char *filename, pix_t tgtwidth, pix_t tgtheight,
-    uint8_t *rgb)
+static bool
+ppm_parse_header(const char *filename, const char *buf, size_t len,
+    pix_t tgtwidth, pix_t tgtheight, size_t *offsetp)
 {
-	char		header[80], magic[4];
+	char		header[80 + 1], magic[4];
 	char		*p;
 	int		width, height;
-	pix_t		npixels;
-	int		ncolors, fd, state, i;
+	int		ncolors, state;
+
+	len = MIN(len, sizeof (header) - 1);
+	memcpy(header, buf, len);
+	header[len] = '\0';
 
-	fd = open(filename, O_RDONLY);
-	if (fd == -1) {
-		warn("Failed to open file \"%s\"", filename);
-		return (false);
-	}
-	(void) read(fd, header, sizeof(header));
 	if (sscanf(header, "%3s %u %u %d",
 	    magic, &width, &height, &ncolors) != 4) {
 		warn("Failed to parse header \"%s\"\n", header);
-		close(fd);
 		return (false);
 	}
 	if (strcmp(magic, "P6") != 0 || ncolors > 255) {
 		warn("Can't handle header type \"%s\"\n", header);
-		close(fd);
 		return (false);
 	}
 	if ((pix_t)width != tgtwidth || (pix_t)height != tgtheight) {
 		warn("can't use image \"%s\" -- "
 		    "must be %ux%u pixels, found %ux%u\n", filename,
 		    tgtwidth, tgtheight, width, height);
-		close(fd);
 		return (false);
 	}
 
@@ -86,7 +84,7 @@ ppm_read_rgb(const char *filename, pix_t tgtwidth, pix_t tgtheight,
 	 * string parsing in C, wooooo
 	 */
 	state = 0;
-	for (p = header; p < header + sizeof (header) && state < 7; p++) {
+	for (p = header; p < header + len && state < 7; p++) {
 		switch (state) {
 		case 0:
 		case 2:
@@ -106,22 +104,45 @@ ppm_read_rgb(const char *filename, pix_t tgtwidth, pix_t tgtheight,
 	}
 	if (state != 7 || *(p - 1) != '\n') {
 		warn("failed to parse \"%s\" carefully\n", header);
-		close(fd);
 		return (false);
 	}
 
-	/*
-	 * Seek to the actual data portion of the file.
-	 */
-	lseek(fd, p - header, SEEK_SET);
+	*offsetp = p - header;
+	return (true);
+}
+
+/*
+ * Read a PPM file into a three-byte-per-pixel RGB uint8_t array.
+ */
+bool
+ppm_read_rgb(const char *filename, pix_t tgtwidth, pix_t tgtheight,
+    uint8_t *rgb)
+{
+	char		header[80];
+	const size_t	nbytes = (size_t)tgtwidth * tgtheight * 3;
+	size_t		offset;
+	ssize_t		i;
+	int		fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		warn("Failed to open file \"%s\"", filename);
+		return (false);
+	}
+	i = read(fd, header, sizeof (header));
+	if (i < 0 || !ppm_parse_header(filename, header, (size_t)i,
+	    tgtwidth, tgtheight, &offset)) {
+		close(fd);
+		return (false);
+	}
 
 	/*
-	 * Read in the data.
+	 * Seek to the actual data portion of the file, and read it in.
 	 */
-	npixels = (pix_t)width * (pix_t)height;
-	i = read(fd, rgb, npixels * 3);
-	if (i != npixels * 3) {
-		warn("only read %d bytes of data\n", i);
+	lseek(fd, offset, SEEK_SET);
+	i = read(fd, rgb, nbytes);
+	if (i != (ssize_t)nbytes) {
+		warn("only read %zd bytes of data\n", i);
 		close(fd);
 		return (false);
 	};
@@ -130,6 +151,65 @@ ppm_read_rgb(const char *filename, pix_t tgtwidth, pix_t tgtheight,
 	return (true);
 }
 
+/*
+ * Map a PPM file into memory, rather than reading it.
+ */
+const uint8_t *
+ppm_map_rgb(const char *filename, pix_t tgtwidth, pix_t tgtheight,
+    ppm_map_t *map)
+{
+	const size_t	nbytes = (size_t)tgtwidth * tgtheight * 3;
+	struct stat	st;
+	size_t		offset;
+	void		*addr;
+	int		fd;
+
+	map->pm_addr = NULL;
+	map->pm_len = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		warn("Failed to open file \"%s\"", filename);
+		return (NULL);
+	}
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		warn("Failed to stat file \"%s\"", filename);
+		close(fd);
+		return (NULL);
+	}
+	addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		warn("Failed to map file \"%s\"", filename);
+		return (NULL);
+	}
+	map->pm_addr = addr;
+	map->pm_len = (size_t)st.st_size;
+
+	if (!ppm_parse_header(filename, addr, map->pm_len,
+	    tgtwidth, tgtheight, &offset)) {
+		ppm_unmap(map);
+		return (NULL);
+	}
+	if (map->pm_len - offset < nbytes) {
+		warn("only found %zu bytes of data\n", map->pm_len - offset);
+		ppm_unmap(map);
+		return (NULL);
+	}
+
+	return ((const uint8_t *)addr + offset);
+}
+
+void
+ppm_unmap(ppm_map_t *map)
+{
+	if (map->pm_addr != NULL) {
+		(void) munmap(map->pm_addr, map->pm_len);
+		map->pm_addr = NULL;
+		map->pm_len = 0;
+	}
+}
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -26,6 +26,27 @@ extern bool
 ppm_read_rgb(const char *filename,
     pix_t width, pix_t height, uint8_t *rgb);
 
+/*
+ * A PPM file mapped into memory by ppm_map_rgb().
+ */
+typedef struct {
+	void		*pm_addr;	/* start of the mapping */
+	size_t		pm_len;		/* length of the mapping */
+} ppm_map_t;
+
+/*
+ * Like ppm_read_rgb(), but the file is mapped into memory rather than read.
+ * This returns a pointer to its width * height * 3 bytes of data, which stays
+ * valid until ppm_unmap() is called on "map", or NULL if the file can't be
+ * used.
+ */
+extern const uint8_t *
+ppm_map_rgb(const char *filename,
+    pix_t width, pix_t height, ppm_map_t *map);
+
+extern void
+ppm_unmap(ppm_map_t *map);
+
 /*
  * Create the specified PPM file from "rgb". "rgb" is a buffer with size
  * width * height * 3 (one byte for each of R, G, and B).
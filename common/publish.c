@@ -0,0 +1,192 @@
+/*
+ * publish.c - publishes the displayed images in shared memory.
+ *
+ * External compositors and capture tools can pick up each image from a
+ * small ring of frames in a POSIX shared memory object, rather than
+ * scraping the window.  The images are read back asynchronously straight
+ * into the shared memory, so publishing costs one readback per image and
+ * no copies on either side; see publish.h for the layout, and for how a
+ * consumer should read it.
+ *
+ * The object is recreated at the new size whenever the window is resized.
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#include "debug.h"
+#include "module.h"
+#include "opencl.h"
+#include "publish.h"
+
+typedef struct {
+	int		pa_slot;	/* which slot is being filled in */
+	uint64_t	pa_seq;		/* which frame is going into it */
+} publish_arg_t;
+
+static struct {
+	const char	*name;		/* from publish_name() */
+	bool		failed;		/* couldn't create the object */
+
+	publish_header_t *header;	/* the object, once it's mapped */
+	size_t		size;		/* bytes mapped at "header" */
+	uint64_t	seq;		/* next frame to be published */
+	publish_arg_t	args[PUBLISH_NSLOTS];
+} Publish;
+
+/* ------------------------------------------------------------------ */
+
+void
+publish_name(const char *name)
+{
+	Publish.name = name;
+}
+
+static uint64_t
+publish_now(void)
+{
+	struct timespec	ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static uint8_t *
+publish_slot_data(int slot)
+{
+	return ((uint8_t *)Publish.header + Publish.header->ph_dataoffset +
+	    (size_t)slot * Publish.header->ph_framesize);
+}
+
+/*
+ * Called once a frame has landed in shared memory.
+ */
+static void
+publish_readback_cb(void *hostdst, void *arg)
+{
+	const publish_arg_t	*const	pa = arg;
+	publish_header_t	*const	ph = Publish.header;
+	publish_slot_t		*const	ps = &ph->ph_slots[pa->pa_slot];
+
+	ps->ps_published = publish_now();
+	__atomic_store_n(&ps->ps_seq, 2 * pa->pa_seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ph->ph_latest, (uint64_t)pa->pa_slot,
+	    __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+publish_init(void)
+{
+	const size_t	pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t	framesize = (size_t)Width * Height * 4;
+	const size_t	dataoffset =
+	    P2ROUNDUP(sizeof (publish_header_t), pagesize);
+	publish_header_t *ph;
+	void		*addr;
+	int		fd;
+
+	if (Publish.name == NULL || Publish.failed) {
+		return;
+	}
+
+	Publish.size = dataoffset + PUBLISH_NSLOTS * framesize;
+	(void) shm_unlink(Publish.name);
+	fd = shm_open(Publish.name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t)Publish.size) != 0 ||
+	    (addr = mmap(NULL, Publish.size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		warn("Failed to create shared memory object \"%s\"; "
+		    "not publishing images\n", Publish.name);
+		if (fd >= 0) {
+			(void) close(fd);
+			(void) shm_unlink(Publish.name);
+		}
+		Publish.failed = true;
+		return;
+	}
+	(void) close(fd);
+
+	/*
+	 * The object starts out zero-filled, so every slot reads as empty
+	 * (ps_seq == 0) until its first frame shows up.
+	 */
+	ph = addr;
+	ph->ph_width = Width;
+	ph->ph_height = Height;
+	ph->ph_nslots = PUBLISH_NSLOTS;
+	ph->ph_framesize = framesize;
+	ph->ph_dataoffset = dataoffset;
+	ph->ph_version = PUBLISH_VERSION;
+	__atomic_store_n(&ph->ph_magic, PUBLISH_MAGIC, __ATOMIC_RELEASE);
+
+	Publish.header = ph;
+	Publish.seq = 0;
+
+	verbose(DB_IMAGE, "Publishing %ux%u images in \"%s\"\n",
+	    (unsigned)Width, (unsigned)Height, Publish.name);
+}
+
+static void
+publish_fini(void)
+{
+	if (Publish.header == NULL) {
+		return;
+	}
+
+	for (int s = 0; s < PUBLISH_NSLOTS; s++) {
+		readback_wait(publish_slot_data(s));
+	}
+
+	/*
+	 * Anyone still attached keeps their mapping of the old object, and
+	 * finds out from ph_closed that they should open the new one.
+	 */
+	__atomic_store_n(&Publish.header->ph_closed, 1, __ATOMIC_RELEASE);
+	(void) munmap(Publish.header, Publish.size);
+	(void) shm_unlink(Publish.name);
+	Publish.header = NULL;
+}
+
+const module_ops_t	publish_ops = {
+	NULL,
+	publish_init,
+	publish_fini
+};
+
+/* ------------------------------------------------------------------ */
+
+void
+publish_frame(cl_mem image)
+{
+	const int		slot = (int)(Publish.seq % PUBLISH_NSLOTS);
+	publish_arg_t		*const	pa = &Publish.args[slot];
+	publish_slot_t		*ps;
+	uint8_t			*data;
+
+	if (Publish.header == NULL) {
+		return;
+	}
+	ps = &Publish.header->ph_slots[slot];
+
+	/*
+	 * The oldest slot gets reused, so the one that was just published
+	 * stays readable until two more frames have come along.  Its previous
+	 * readback has to finish before we can mark it as being rewritten.
+	 */
+	data = publish_slot_data(slot);
+	readback_wait(data);
+
+	pa->pa_slot = slot;
+	pa->pa_seq = Publish.seq++;
+	__atomic_store_n(&ps->ps_seq, 2 * pa->pa_seq + 1, __ATOMIC_RELEASE);
+	ps->ps_rendered = publish_now();
+
+	ocl_image_readfromgpu_async(image, data, Width, Height,
+	    publish_readback_cb, pa);
+}
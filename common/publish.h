@@ -0,0 +1,67 @@
+/*
+ * publish.h - interfaces for publishing the displayed images in shared
+ * memory, for other processes to pick up.
+ *
+ * The shared memory object starts with a publish_header_t, which is
+ * followed (at ph_dataoffset) by ph_nslots frames of ph_framesize bytes
+ * each.  Frames are ph_width x ph_height RGBA, one byte per channel, with
+ * no padding between rows.
+ *
+ * Each slot is guarded by a sequence lock.  While a frame is being written
+ * into slot "s", ph_slots[s].ps_seq is odd; once it's complete, ps_seq is
+ * set to twice the frame's sequence number plus two, and ph_latest is set
+ * to "s".  To read the newest frame, a consumer reads ph_latest, then
+ * ps_seq (which must be even), then the frame itself, and then ps_seq
+ * again; if it changed, the frame was overwritten partway through, and the
+ * consumer should try again.  Frames can be read in place, without
+ * copying, as long as they're checked this way afterwards.
+ *
+ * When the window is resized, or the program exits, ph_closed is set; a
+ * consumer that sees it should unmap the object and open it again.
+ */
+
+#ifndef	_PUBLISH_H
+#define	_PUBLISH_H
+
+#include "types.h"
+
+#define	PUBLISH_MAGIC		0x5a534844	/* "ZSHD" */
+#define	PUBLISH_VERSION		1
+#define	PUBLISH_NSLOTS		3
+
+typedef struct {
+	uint64_t	ps_seq;		/* sequence lock, see above */
+	uint64_t	ps_rendered;	/* CLOCK_MONOTONIC ns: handed over */
+	uint64_t	ps_published;	/* CLOCK_MONOTONIC ns: readable */
+} publish_slot_t;
+
+typedef struct {
+	uint32_t	ph_magic;	/* PUBLISH_MAGIC */
+	uint32_t	ph_version;	/* PUBLISH_VERSION */
+	uint32_t	ph_width;	/* in pixels */
+	uint32_t	ph_height;	/* in pixels */
+	uint32_t	ph_nslots;	/* PUBLISH_NSLOTS */
+	uint32_t	ph_closed;	/* nonzero: reopen, see above */
+	uint64_t	ph_framesize;	/* bytes per frame */
+	uint64_t	ph_dataoffset;	/* where slot 0's frame starts */
+	uint64_t	ph_latest;	/* slot with the newest frame */
+	publish_slot_t	ph_slots[PUBLISH_NSLOTS];
+} publish_header_t;
+
+/*
+ * Publish every image in the POSIX shared memory object "name" (which
+ * should start with a "/").
+ *
+ * This gets called from main() before publish_preinit().
+ */
+extern void
+publish_name(const char *name);
+
+/*
+ * Publish the image "image", if we've been asked to.  This only starts
+ * reading it back; it shows up in shared memory a little later.
+ */
+extern void
+publish_frame(cl_mem image);
+
+#endif	/* _PUBLISH_H */
@@ -39,6 +39,18 @@ srandbj(int r)
 	RV = (((unsigned long long)r) << 16) | 0x330e;
 }
 
+unsigned long long
+randbj_state(void)
+{
+	return (RV);
+}
+
+void
+randbj_set_state(unsigned long long state)
+{
+	RV = state & ((1ULL << 48) - 1);
+}
+
 #include <math.h>
 
 double
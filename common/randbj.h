@@ -12,6 +12,15 @@
 extern void
 srandbj(int seed);
 
+/*
+ * Get and set the whole state of the generator, for checkpoints.
+ */
+extern unsigned long long
+randbj_state(void);
+
+extern void
+randbj_set_state(unsigned long long state);
+
 /*
  * Get a pseudo-random floating point number in the range [0.0, 1.0).
  */
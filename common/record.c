@@ -0,0 +1,364 @@
+/*
+ * record.c - streams the displayed images out as uncompressed video.
+ *
+ * Saving one PPM file per image (see image_save()) is a clumsy way to make
+ * an animation.  This instead converts each image to YUV 4:2:0 on the GPU,
+ * which is half the size of RGB, and writes the frames one after another
+ * to a single file or pipe, so that an external encoder can be attached.
+ * The frames are read back asynchronously into a small pool of pinned
+ * buffers, and written out by a thread of their own, so recording never
+ * stalls the simulation; if the writer falls behind, frames are dropped.
+ *
+ * The stream's frame size is fixed when it's opened.  If the window is
+ * resized later, the images are centered in the original frame size, the
+ * same way image_copy() does it.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "debug.h"
+#include "module.h"
+#include "opencl.h"
+#include "record.h"
+
+/*
+ * Frames are read back into this many pinned buffers.
+ */
+#define	RECORD_NBUFS		4
+
+/*
+ * The frame rate written into Y4M headers.  Images aren't produced at a
+ * steady rate, so this is only a nominal value for the encoder's benefit.
+ */
+#define	RECORD_FPS		30
+
+typedef enum {
+	REC_FREE = 0,		/* available for record_frame() */
+	REC_READING,		/* being read back from the GPU */
+	REC_QUEUED,		/* waiting for the writer thread */
+	REC_WRITING		/* being written out */
+} recstate_t;
+
+typedef struct {
+	recstate_t	rs_state;
+	uint8_t		*rs_frame;		/* from host_alloc() */
+	uint64_t	rs_seq;			/* for ordering the writes */
+} recslot_t;
+
+static struct {
+	const char	*target;	/* from record_stream() */
+	FILE		*fp;		/* the stream, once it's open */
+	bool		piped;		/* fp came from popen() */
+	bool		nv12;		/* raw NV12, rather than Y4M */
+	pix_t		width;		/* fixed when the stream opens */
+	pix_t		height;
+	size_t		framesize;	/* bytes per frame */
+
+	kernel_data_t	kernel;		/* converts an image to a frame */
+	cl_mem		frame;		/* the converted frame */
+
+	/*
+	 * The write queue.  The lock protects the slots' states, "seq",
+	 * "failed", and "quit"; the writer waits on "cond" for work.
+	 */
+	recslot_t	slots[RECORD_NBUFS];
+	uint64_t	seq;		/* next frame to be queued */
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	bool		failed;		/* couldn't write the stream */
+	bool		quit;
+	int		dropped;	/* frames not recorded */
+} Record;
+
+/* ------------------------------------------------------------------ */
+
+static void	record_close(void);
+
+void
+record_stream(const char *target)
+{
+	record_close();
+	Record.target = target;
+	Record.failed = false;
+	Record.dropped = 0;
+	Record.seq = 0;
+}
+
+/*
+ * Open the stream and write its header.
+ */
+static bool
+record_open(void)
+{
+	const char	*const	t = Record.target;
+	const size_t		len = strlen(t);
+
+	if (t[0] == '|') {
+		/*
+		 * If the encoder goes away, the writes will fail and get
+		 * reported; that shouldn't kill the program.
+		 */
+		(void) signal(SIGPIPE, SIG_IGN);
+		Record.fp = popen(&t[1], "w");
+		Record.piped = true;
+	} else if (strcmp(t, "-") == 0) {
+		Record.fp = stdout;
+	} else {
+		Record.fp = fopen(t, "wb");
+	}
+	if (Record.fp == NULL) {
+		warn("Failed to open video stream \"%s\"\n", t);
+		return (false);
+	}
+
+	/*
+	 * 4:2:0 chroma needs an even number of pixels in each direction.
+	 */
+	Record.width = Width & ~(pix_t)1;
+	Record.height = Height & ~(pix_t)1;
+	Record.framesize = (size_t)Record.width * Record.height * 3 / 2;
+	Record.nv12 = (len > 5 && strcmp(&t[len - 5], ".nv12") == 0);
+
+	if (!Record.nv12) {
+		(void) fprintf(Record.fp, "YUV4MPEG2 W%u H%u F%d:1 Ip A1:1 "
+		    "C420jpeg XCOLORRANGE=FULL\n", (unsigned)Record.width,
+		    (unsigned)Record.height, RECORD_FPS);
+	}
+
+	verbose(DB_IMAGE, "Recording %ux%u %s video to \"%s\"\n",
+	    (unsigned)Record.width, (unsigned)Record.height,
+	    Record.nv12 ? "NV12" : "Y4M", t);
+
+	return (true);
+}
+
+/*
+ * The writer thread.  This writes out queued frames in the order that they
+ * were recorded, and exits once it's been told to and there's nothing left
+ * to write.
+ */
+static void *
+record_writer(void *arg)
+{
+	pthread_mutex_lock(&Record.lock);
+	for (;;) {
+		recslot_t	*rs = NULL;
+		bool		ok;
+
+		/*
+		 * Find the oldest frame that's still outstanding; if it's
+		 * still being read back, the ones behind it have to wait.
+		 */
+		for (int s = 0; s < RECORD_NBUFS; s++) {
+			recslot_t	*const	cand = &Record.slots[s];
+
+			if ((cand->rs_state == REC_READING ||
+			    cand->rs_state == REC_QUEUED) &&
+			    (rs == NULL || cand->rs_seq < rs->rs_seq)) {
+				rs = cand;
+			}
+		}
+		if (rs == NULL || rs->rs_state != REC_QUEUED) {
+			if (rs == NULL && Record.quit) {
+				break;
+			}
+			pthread_cond_wait(&Record.cond, &Record.lock);
+			continue;
+		}
+		rs->rs_state = REC_WRITING;
+		pthread_mutex_unlock(&Record.lock);
+
+		ok = true;
+		if (!Record.nv12 && fputs("FRAME\n", Record.fp) == EOF) {
+			ok = false;
+		}
+		if (ok && fwrite(rs->rs_frame, Record.framesize, 1,
+		    Record.fp) != 1) {
+			ok = false;
+		}
+
+		pthread_mutex_lock(&Record.lock);
+		if (!ok && !Record.failed) {
+			warn("Failed to write video stream \"%s\"; "
+			    "recording stopped\n", Record.target);
+			Record.failed = true;
+		}
+		rs->rs_state = REC_FREE;
+	}
+	pthread_mutex_unlock(&Record.lock);
+
+	return (NULL);
+}
+
+/*
+ * Called once a frame has been read back from the GPU.
+ */
+static void
+record_readback_cb(void *hostdst, void *arg)
+{
+	recslot_t	*const	rs = arg;
+
+	pthread_mutex_lock(&Record.lock);
+	assert(rs->rs_state == REC_READING);
+	rs->rs_state = REC_QUEUED;
+	pthread_cond_signal(&Record.cond);
+	pthread_mutex_unlock(&Record.lock);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+record_init(void)
+{
+	if (Record.target == NULL) {
+		return;
+	}
+	if (Record.fp == NULL && (Record.failed || !record_open())) {
+		Record.failed = true;
+		return;
+	}
+
+	kernel_create(&Record.kernel, "record_yuv420");
+	Record.frame = transient_alloc(Record.framesize, TR_OUTPUT);
+
+	for (int s = 0; s < RECORD_NBUFS; s++) {
+		Record.slots[s].rs_state = REC_FREE;
+		Record.slots[s].rs_frame = host_alloc(Record.framesize);
+	}
+	Record.quit = false;
+	pthread_mutex_init(&Record.lock, NULL);
+	pthread_cond_init(&Record.cond, NULL);
+	if (pthread_create(&Record.thread, NULL, record_writer, NULL) != 0) {
+		die("Failed to create video writer thread\n");
+	}
+}
+
+static void
+record_fini(void)
+{
+	if (Record.fp == NULL) {
+		return;
+	}
+
+	/*
+	 * Every frame that's been handed to record_frame() gets written out
+	 * before the writer goes away.
+	 */
+	for (int s = 0; s < RECORD_NBUFS; s++) {
+		readback_wait(Record.slots[s].rs_frame);
+	}
+	pthread_mutex_lock(&Record.lock);
+	Record.quit = true;
+	pthread_cond_signal(&Record.cond);
+	pthread_mutex_unlock(&Record.lock);
+	(void) pthread_join(Record.thread, NULL);
+	pthread_cond_destroy(&Record.cond);
+	pthread_mutex_destroy(&Record.lock);
+
+	for (int s = 0; s < RECORD_NBUFS; s++) {
+		host_free((void **)&Record.slots[s].rs_frame);
+	}
+	transient_free(&Record.frame, TR_OUTPUT);
+	kernel_cleanup(&Record.kernel);
+}
+
+/*
+ * The stream stays open across resizes, and is only closed on the way out,
+ * or when record_stream() switches to another one.
+ */
+static void
+record_close(void)
+{
+	if (Record.fp == NULL) {
+		return;
+	}
+
+	if (Record.dropped > 0) {
+		verbose(DB_IMAGE, "Dropped %d video frames\n", Record.dropped);
+	}
+	if (Record.piped) {
+		(void) pclose(Record.fp);
+	} else if (Record.fp != stdout) {
+		(void) fclose(Record.fp);
+	} else {
+		(void) fflush(Record.fp);
+	}
+	Record.fp = NULL;
+}
+
+static void
+record_postfini(void)
+{
+	record_close();
+}
+
+const module_ops_t	record_ops = {
+	NULL,
+	record_init,
+	record_fini,
+	record_postfini
+};
+
+/* ------------------------------------------------------------------ */
+
+void
+record_frame(cl_mem image)
+{
+	kernel_data_t	*const	kd = &Record.kernel;
+	recslot_t	*rs = NULL;
+	size_t		global[2];
+	int		nv12;
+	int		arg;
+
+	if (Record.fp == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&Record.lock);
+	if (!Record.failed) {
+		for (int s = 0; s < RECORD_NBUFS; s++) {
+			if (Record.slots[s].rs_state == REC_FREE) {
+				rs = &Record.slots[s];
+				rs->rs_state = REC_READING;
+				rs->rs_seq = Record.seq++;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&Record.lock);
+
+	if (rs == NULL) {
+		if (!Record.failed && Record.dropped++ == 0) {
+			warn("Video stream is falling behind; "
+			    "dropping frames\n");
+		}
+		return;
+	}
+
+	global[0] = P2ROUNDUP((size_t)Record.width / 2, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)Record.height / 2, kd->kd_maxitems[1]);
+	nv12 = Record.nv12;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Record.width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Record.height);
+	kernel_setarg(kd, arg++, sizeof (int), &nv12);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Record.frame);
+	kernel_invoke(kd, 2, global, NULL);
+
+	/*
+	 * If an earlier frame is still being read back, the next conversion
+	 * is queued up behind it, so it's safe to reuse Record.frame.
+	 */
+	buffer_readfromgpu_async(Record.frame, rs->rs_frame, Record.framesize,
+	    record_readback_cb, rs);
+}
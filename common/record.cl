@@ -0,0 +1,80 @@
+/*
+ * record.cl - computational kernel for converting images to video frames
+ * in record.c.
+ */
+
+/*
+ * Read a pixel of the W x H image, as 8-bit RGB values; anything outside
+ * of it is black.
+ */
+static float3
+record_pixel(const pix_t W, const pix_t H, __read_only image2d_t image,
+    int x, int y)
+{
+	if (x < 0 || y < 0 || x >= (int)W || y >= (int)H) {
+		return ((float3)(0.0f));
+	}
+
+	return (read_imagef(image, (int2)(x, y)).xyz * 255.0f);
+}
+
+static float
+record_luma(const float3 rgb)
+{
+	return (dot(rgb, (float3)(0.299f, 0.587f, 0.114f)));
+}
+
+/*
+ * Convert the W x H image into an SW x SH frame of full-range BT.601
+ * YUV 4:2:0, with the image centered in the frame (as image_copy() does).
+ * The frame starts with SW * SH luma bytes.  If "nv12" is set, that's
+ * followed by the chroma as interleaved U and V bytes; otherwise it's an
+ * I420 frame, with all of the U bytes followed by all of the V bytes.
+ *
+ * Each work item converts one 2x2 block, which shares a pair of chroma
+ * values.  SW and SH must be even.
+ */
+__kernel void
+record_yuv420(
+	const pix_t		W,		/* in: width of image */
+	const pix_t		H,		/* in: height of image */
+	const pix_t		SW,		/* in: width of frame */
+	const pix_t		SH,		/* in: height of frame */
+	const int		nv12,		/* in: chroma layout */
+	__read_only image2d_t	image,		/* in: RGBA image */
+	__global uchar		*frame)		/* out: YUV frame */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= SW / 2 || Y >= SH / 2) {
+		return;
+	}
+
+	const int	x = 2 * X + ((int)W - (int)SW) / 2;
+	const int	y = 2 * Y + ((int)H - (int)SH) / 2;
+	const float3	p00 = record_pixel(W, H, image, x + 0, y + 0);
+	const float3	p01 = record_pixel(W, H, image, x + 1, y + 0);
+	const float3	p10 = record_pixel(W, H, image, x + 0, y + 1);
+	const float3	p11 = record_pixel(W, H, image, x + 1, y + 1);
+	const float3	avg = (p00 + p01 + p10 + p11) * 0.25f;
+	const float	u = dot(avg, (float3)(-0.168736f, -0.331264f, 0.5f));
+	const float	v = dot(avg, (float3)(0.5f, -0.418688f, -0.081312f));
+	const pix_t	luma = (2 * Y) * SW + 2 * X;
+	const pix_t	cw = SW / 2;
+	__global uchar	*const	chroma = &frame[SW * SH];
+
+	vstore2(convert_uchar2_sat_rte((float2)(
+	    record_luma(p00), record_luma(p01))), 0, &frame[luma]);
+	vstore2(convert_uchar2_sat_rte((float2)(
+	    record_luma(p10), record_luma(p11))), 0, &frame[luma + SW]);
+
+	if (nv12) {
+		vstore2(convert_uchar2_sat_rte((float2)(u, v) + 128.0f),
+		    Y * cw + X, chroma);
+	} else {
+		chroma[Y * cw + X] = convert_uchar_sat_rte(u + 128.0f);
+		chroma[(SH / 2) * cw + Y * cw + X] =
+		    convert_uchar_sat_rte(v + 128.0f);
+	}
+}
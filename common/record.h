@@ -0,0 +1,32 @@
+/*
+ * record.h - interfaces for streaming the displayed images out as video.
+ */
+
+#ifndef	_RECORD_H
+#define	_RECORD_H
+
+#include "types.h"
+
+/*
+ * Record every image to "target".  If it starts with "|", the rest of it is
+ * a command to pipe the stream into (such as an encoder); if it's "-", the
+ * stream goes to standard output; otherwise it's a file name.  Files ending
+ * in ".nv12" get raw NV12 frames, and everything else gets a Y4M stream.
+ *
+ * This gets called from main() before record_preinit().  It can also be
+ * called between module_fini() and module_init(), to close the stream that
+ * was open and start a new one (or none, if "target" is NULL).
+ */
+extern void
+record_stream(const char *target);
+
+/*
+ * Add the image "image" to the stream, if there is one.  This converts it
+ * on the GPU and returns right away; the frame is written out by a thread
+ * of its own.  If the writer has fallen too far behind, the frame is
+ * dropped.
+ */
+extern void
+record_frame(cl_mem image);
+
+#endif	/* _RECORD_H */
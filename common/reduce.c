@@ -1,36 +1,46 @@
 /*
- * reduce.c - reduces an image down to a much smaller version of itself.
+ * reduce.c - reduces an image down to a much smaller version of itself,
+ * or to a single value.
  *
- * This uses OpenCL to perform the image reduction.  This isn't a fantastic
- * fit for OpenCL, since it involves coordinating results across many pixels,
- * but it seems to perform better (on my laptop) than doing it on the CPU.
- * The final step of the reduction kernel is to add the intermediate result
- * to a global tracking array, using atomic_add().  But OpenCL can only use
- * atomic_add() on 32-bit integral data types.  So, rather than having a
- * nicely general image reduction kernel, the last step picks out one
- * component of the vector, scales it up by 256, converts it to an integer,
- * and adds that to the tracking array.
+ * This uses OpenCL to perform the image reduction, as a two-level tree.
+ * In the first level, each workgroup adds up one rectangular region of the
+ * image, using a tree in local memory, and writes that region's sum out.
+ * If all that's wanted is the sum of the whole image, a second level adds
+ * up the regions' sums in a single workgroup.  Every output is written by
+ * exactly one workgroup, so there's nothing to clear beforehand and no need
+ * for global atomics, and all of the components of the datavec's get summed
+ * at once, as floats.
  */
-#include <strings.h>
 #include <assert.h>
 
 #include "common.h"
 
 #include "debug.h"
-#include "interp.h"
 #include "module.h"
 #include "opencl.h"
-#include "param.h"
 #include "reduce.h"
 #include "util.h"
 
+/*
+ * The first level of reduce_sum() uses this many regions on a side.
+ */
+#define	REDUCE_SUM_EDGE		16
+
+/*
+ * The largest workgroup that the reduction kernels use.
+ */
+#define	REDUCE_MAX_WGSIZE	256
+
 /* ------------------------------------------------------------------ */
 
 static struct {
-	kernel_data_t	reduce_kernel;	/* reduction kernel */
+	kernel_data_t	regions_kernel;	/* first level */
+	kernel_data_t	total_kernel;	/* second level */
 
-	cl_mem		reduce_gpu;	/* memory for reduction */
-	size_t		reduce_bufsize;
+	cl_mem		grid_gpu;	/* result of reduce_grid() */
+	pix_t		grid_bufedge;
+	cl_mem		partial_gpu;	/* first level of reduce_sum() */
+	cl_mem		sum_gpu;	/* result of reduce_sum() */
 } Reduce;
 
 /* ------------------------------------------------------------------ */
@@ -38,19 +48,29 @@ static struct {
 static void
 reduce_init(void)
 {
-	kernel_create(&Reduce.reduce_kernel, "reduce");
+	const size_t	partialsize = (size_t)REDUCE_SUM_EDGE *
+			    REDUCE_SUM_EDGE * sizeof (cl_datavec);
 
-	Reduce.reduce_bufsize = 0;
+	kernel_create(&Reduce.regions_kernel, "reduce_regions");
+	kernel_create(&Reduce.total_kernel, "reduce_total");
+
+	Reduce.grid_bufedge = 0;
+	Reduce.partial_gpu = buffer_alloc(partialsize);
+	Reduce.sum_gpu = buffer_alloc(sizeof (cl_datavec));
 }
 
 static void
 reduce_fini(void)
 {
-	if (Reduce.reduce_bufsize > 0) {
-		buffer_free(&Reduce.reduce_gpu);
+	if (Reduce.grid_bufedge > 0) {
+		buffer_free(&Reduce.grid_gpu);
+		Reduce.grid_bufedge = 0;
 	}
+	buffer_free(&Reduce.sum_gpu);
+	buffer_free(&Reduce.partial_gpu);
 
-	kernel_cleanup(&Reduce.reduce_kernel);
+	kernel_cleanup(&Reduce.total_kernel);
+	kernel_cleanup(&Reduce.regions_kernel);
 }
 
 const module_ops_t	reduce_ops = {
@@ -62,84 +82,103 @@ const module_ops_t	reduce_ops = {
 /* ------------------------------------------------------------------ */
 
 /*
- * Wrapper around the OpenCL kernel to do image reduction.
- *
- * - "data" is an image2d_t made of datavec's.
- * - "dim" is which dimension of the datavec to do the reduction upon.
- *   (Right now it only does one at a time.)
- * - "min" and "max" are the bounds of possible data values in the datavec.
- *
- * - "tgtbuffer" is a buffer of "bufedge" * "bufedge" int's,
- *   which will hold the reduced result.
- *
- * The reduce kernel actually just adds up the pixel values and scales
- * them so they are within a [0, 256) range per pixel.
+ * The kernels' tree reductions need a power-of-two workgroup size.
  */
-void
-reduce_addup(cl_mem data, int dim, float min, float max,
-    int *tgtbuffer, pix_t bufedge)
+static size_t
+reduce_wgsize(kernel_data_t *kd)
 {
-	kernel_data_t	*const	kd = &Reduce.reduce_kernel;
-	const size_t		wgsize = kernel_wgsize(kd);
-	const size_t		bufsize =
-	    (size_t)bufedge * bufedge * sizeof (int);
-	int			arg;
+	const size_t	max = MIN(kernel_wgsize(kd), REDUCE_MAX_WGSIZE);
+	size_t		wgsize;
 
-	if (Reduce.reduce_bufsize != bufsize) {
-		if (Reduce.reduce_bufsize > 0) {
-			buffer_free(&Reduce.reduce_gpu);
-		}
-		Reduce.reduce_gpu = buffer_alloc(bufsize);
-		Reduce.reduce_bufsize = bufsize;
+	for (wgsize = 1; wgsize * 2 <= max; wgsize *= 2) {
+		continue;
 	}
 
-	bzero(tgtbuffer, bufsize);
-	buffer_writetogpu(tgtbuffer, Reduce.reduce_gpu, bufsize);
+	return (wgsize);
+}
+
+/*
+ * The first level: sum up each of the "bufedge" x "bufedge" regions of
+ * "data" into "dst".
+ */
+static void
+reduce_regions(cl_mem data, pix_t bufedge, cl_mem dst)
+{
+	kernel_data_t	*const	kd = &Reduce.regions_kernel;
+	const size_t		wgsize = reduce_wgsize(kd);
+	size_t			global[1], local[1];
+	int			arg;
+
+	global[0] = (size_t)bufedge * bufedge * wgsize;
+	local[0] = wgsize;
 
 	arg = 0;
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
-	kernel_setarg(kd, arg++, wgsize * sizeof (cl_datavec), NULL);
-	kernel_setarg(kd, arg++, wgsize * sizeof (int), NULL);
 	kernel_setarg(kd, arg++, sizeof (pix_t), &bufedge);
-	kernel_setarg(kd, arg++, sizeof (int), &dim);
-	kernel_setarg(kd, arg++, sizeof (float), &min);
-	kernel_setarg(kd, arg++, sizeof (float), &max);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &Reduce.reduce_gpu);
-	kernel_invoke(kd, 2, NULL, NULL);
-
-	buffer_readfromgpu(Reduce.reduce_gpu, tgtbuffer, bufsize);
+	kernel_setarg(kd, arg++, wgsize * sizeof (cl_datavec), NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &dst);
+	kernel_invoke(kd, 1, global, local);
 }
 
-/*
- * The reduce kernel just adds up the results; here we scale them down to get
- * an average value for each resulting pixel.  The extra rigmarole for
- * calculating "dx" and "dy" is because bufedge might not divide Width or
- * Height evenly, and we want to get the same pixel count as the OpenCL kernel
- * uses.
- */
-static void
-reduce_normalize(int *tgtbuffer, pix_t bufedge)
+cl_mem
+reduce_grid(cl_mem data, pix_t bufedge)
 {
-	int		x, y, p;
-
-	for (p = y = 0; y < bufedge; y++) {
-		for (x = 0; x < bufedge; x++, p++) {
-			const int	dx = ((x + 1) * Width / bufedge) -
-			    (x * Width / bufedge);
-			const int	dy = ((y + 1) * Height / bufedge) -
-			    (y * Height / bufedge);
+	assert(bufedge > 0);
 
-			tgtbuffer[p] /= dx * dy;
+	if (Reduce.grid_bufedge != bufedge) {
+		if (Reduce.grid_bufedge > 0) {
+			buffer_free(&Reduce.grid_gpu);
 		}
+		Reduce.grid_gpu = buffer_alloc(
+		    (size_t)bufedge * bufedge * sizeof (cl_datavec));
+		Reduce.grid_bufedge = bufedge;
 	}
+
+	/*
+	 * If an earlier reduction is still being read back, this is queued
+	 * up behind it, so it's safe to reuse the buffer.
+	 */
+	reduce_regions(data, bufedge, Reduce.grid_gpu);
+
+	return (Reduce.grid_gpu);
+}
+
+void
+reduce_grid_async(cl_mem data, pix_t bufedge,
+    cl_datavec *tgtbuffer, readback_cb_t cb, void *arg)
+{
+	buffer_readfromgpu_async(reduce_grid(data, bufedge), tgtbuffer,
+	    (size_t)bufedge * bufedge * sizeof (cl_datavec), cb, arg);
+}
+
+cl_mem
+reduce_sum(cl_mem data)
+{
+	kernel_data_t	*const	kd = &Reduce.total_kernel;
+	const size_t		wgsize = reduce_wgsize(kd);
+	int			n = REDUCE_SUM_EDGE * REDUCE_SUM_EDGE;
+	size_t			size[1];
+	int			arg;
+
+	reduce_regions(data, REDUCE_SUM_EDGE, Reduce.partial_gpu);
+
+	size[0] = wgsize;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (int), &n);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Reduce.partial_gpu);
+	kernel_setarg(kd, arg++, wgsize * sizeof (cl_datavec), NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Reduce.sum_gpu);
+	kernel_invoke(kd, 1, size, size);
+
+	return (Reduce.sum_gpu);
 }
 
 void
-reduce(cl_mem data, int dim, float min, float max,
-    int *tgtbuffer, pix_t bufedge)
+reduce_sum_async(cl_mem data, cl_datavec *tgt, readback_cb_t cb, void *arg)
 {
-	reduce_addup(data, dim, min, max, tgtbuffer, bufedge);
-	reduce_normalize(tgtbuffer, bufedge);
+	buffer_readfromgpu_async(reduce_sum(data), tgt,
+	    sizeof (cl_datavec), cb, arg);
 }
@@ -1,5 +1,6 @@
 /*
- * skip.cl - a computational kernel to help the image skipping code in skip.c.
+ * reduce.cl - computational kernels for reducing an image to a much
+ * smaller one, or to a single value.
  */
 
 /*
@@ -32,114 +33,93 @@ datavec_pick(const datavec v, int dim)
 }
 
 /*
- * Reduce the image to a much smaller one.  The "reduce" argument gives the
- * size of one edge of the reduced image.
- *
- * The original image can be thought of as being tiled with "reduce * reduce"
- * rectangular regions of (nearly) equal size.  The "id" of each pixel
- * indicates which region it is a part of.  All the data points from each
- * region get summed up into a single value of the "result" array.
- *
- * "temp" must be an array of one datavec for each workgroup member.
- * "ids"  must be an array of one int     for each workgroup member.
+ * Add up the "temp" values of every workgroup member, leaving the total in
+ * temp[0].  The workgroup size must be a power of two.
+ */
+static void
+reduce_tree(__local datavec *temp)
+{
+	const int	lid = get_local_id(0);
+
+	for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+		if (lid < s) {
+			temp[lid] += temp[lid + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+/*
+ * The first level of the reduction.  The image can be thought of as being
+ * tiled with "reduce * reduce" rectangular regions of (nearly) equal size;
+ * region (x, y) runs from (x * W / reduce) up to ((x + 1) * W / reduce) in X,
+ * and likewise in Y.  Each workgroup adds up every component of all of the
+ * data points in one region, and writes the sum to sums[y * reduce + x].
  *
- * This assumes that all datavec entries are in the range [min, max).
+ * This is run as "reduce * reduce" one-dimensional workgroups, each with a
+ * power-of-two number of members.  "temp" must be an array of one datavec
+ * for each workgroup member.
  */
 __kernel void
-reduce(
+reduce_regions(
 	const pix_t		W,	/* in: width of image */
 	const pix_t		H,	/* in: height of image */
 	__read_only image2d_t	data,	/* in: image */
-	__local datavec		*temp,	/* local memory, see above */
-	__local int		*ids,	/* local memory, see above */
 	const pix_t		reduce,	/* in: size of target edge */
-	const int		dim,	/* in: which data dimension to use */
-	const float		min,	/* in: minimum value for datavec */
-	const float		max,	/* in: maximum value for datavec */
-	__global int		*result) /* out */
+	__local datavec		*temp,	/* local memory, see above */
+	__global datavec	*sums)	/* out */
 {
-	const pix_t	X = get_global_id(0);
-	const pix_t	Y = get_global_id(1);
-	const int	w = get_local_size(0);
-	const int	h = get_local_size(1);
-	const int	x = get_local_id(0);
-	const int	y = get_local_id(1);
-	const int	p = y * w + x;
-	const int	id = ((Y * reduce) / H) * reduce + (X * reduce) / W;
-	datavec		t;
+	const pix_t	g = get_group_id(0);
+	const pix_t	lid = get_local_id(0);
+	const pix_t	lsize = get_local_size(0);
+	const pix_t	rx = g % reduce;
+	const pix_t	ry = g / reduce;
+	const pix_t	x0 = (rx * W) / reduce;
+	const pix_t	y0 = (ry * H) / reduce;
+	const pix_t	rw = ((rx + 1) * W) / reduce - x0;
+	const pix_t	rh = ((ry + 1) * H) / reduce - y0;
+	datavec		sum = 0;
+
+	for (pix_t i = lid; i < rw * rh; i += lsize) {
+		const int2	pos = (int2)(x0 + i % rw, y0 + i / rw);
 
-	/*
-	 * This kernel is complicated by the fact that not only do all worker
-	 * threads need to go through the exact same number of barriers, they
-	 * need to go through the exact same *set* of barriers!
-	 *
-	 * The easiest way to make this work is to take any threads which are
-	 * outside the "real" WxH bounds of the image and give them a
-	 * zero-valued datavec to work with, since that winds up contributing
-	 * nothing to the summing-up process.
-	 */
-	if (X >= W || Y >= H) {
-		temp[p] = (datavec)0;
-	} else {
-		temp[p] = as_datavec(read_imagef(data, (int2)(X, Y)));
+		sum += as_datavec(read_imagef(data, pos));
 	}
 
-	ids[p] = id;
+	temp[lid] = sum;
 	barrier(CLK_LOCAL_MEM_FENCE);
+	reduce_tree(temp);
 
-	/*
-	 * Sum together all values in this workgroup row with the same ID.
-	 */
-	for (int i = 1; i < w; i <<= 1) {
-		if (((x & i) == 0) && (x + i < w) && ids[p + i] == id) {
-			t = temp[p + i];
-			ids[p + i] = -1;
-			temp[p] += t;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
-
-		if (((x & i) == 0) && (x > i) && ids[p - i] == id) {
-			t = temp[p - i];
-			ids[p - i] = -1;
-			temp[p] += t;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid == 0) {
+		sums[g] = temp[0];
 	}
+}
 
-	/*
-	 * Sum together all values in this workgroup column with the same ID.
-	 */
-	for (int i = 1; i < h; i <<= 1) {
-		const int	wi = w * i;
-
-		if (((y & i) == 0) && (y + i < h) && ids[p + wi] == id) {
-			t = temp[p + wi];
-			ids[p + wi] = -1;
-			temp[p] += t;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+/*
+ * The second level of the reduction: add up the "n" datavec's in "sums"
+ * into "total".  This is run as a single one-dimensional workgroup with a
+ * power-of-two number of members; "temp" is as for reduce_regions().
+ */
+__kernel void
+reduce_total(
+	const int		n,	/* in: number of sums */
+	__global datavec	*sums,	/* in */
+	__local datavec		*temp,	/* local memory, see above */
+	__global datavec	*total)	/* out */
+{
+	const int	lid = get_local_id(0);
+	const int	lsize = get_local_size(0);
+	datavec		sum = 0;
 
-		if (((y & i) == 0) && (y > i) && ids[p - wi] == id) {
-			t = temp[p - wi];
-			ids[p - wi] = -1;
-			temp[p] += t;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = lid; i < n; i += lsize) {
+		sum += sums[i];
 	}
 
-	if (ids[p] != -1) {
-		/*
-		 * Doing the conversion to "int" here means that we'll
-		 * be somewhat less precise than if we added together
-		 * all the values as floats and then scaled the result
-		 * to an integer.  But since we're only look at the top
-		 * few bits of the result, it doesn't really matter.
-		 * (And there isn't an atomic_add() that works with
-		 * floating-point values.)
-		 */
-		const float	res = datavec_pick(temp[p], dim);
-		const float	scaled = (res - min) / (max - min);
+	temp[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	reduce_tree(temp);
 
-		atomic_add(&result[id], (int)(scaled * 255.0));
+	if (lid == 0) {
+		*total = temp[0];
 	}
 }
@@ -8,29 +8,42 @@
 #include "types.h"
 
 /*
- * Wrapper around the OpenCL kernel to do image reduction.  This routine
- * just adds up the pixel values and scales them so they are within a [0,
- * 256) range per pixel. This is the better routine for finding totals.
+ * Reduce an image to a much smaller one.  "data" is an image2d_t made of
+ * datavec's, which is tiled with "bufedge" x "bufedge" rectangular regions
+ * of (nearly) equal size.  Every component of all of the datavec's in each
+ * region gets summed up.  Region (x, y) starts at (x * Width / bufedge,
+ * y * Height / bufedge), and its sum is datavec (y * bufedge + x) of the
+ * result.
  *
- * - "data" is an image2d_t made of datavec's.
- * - "dim" is which dimension of the datavec to do the reduction upon.
- *   (Right now it only does one at a time.)
- * - "min" and "max" are the bounds of possible data values in the datavec.
- *
- * - "tgtbuffer" is a buffer of "bufedge"x"bufedge" int's, which will hold
- *   the reduced result.
+ * The result stays on the GPU, in the buffer that's returned.  That buffer
+ * is reused by the next reduce_grid() call.
+ */
+extern cl_mem
+reduce_grid(cl_mem data, pix_t bufedge);
+
+/*
+ * Like reduce_grid(), but the result is read back asynchronously into
+ * "tgtbuffer", which must hold "bufedge" * "bufedge" cl_datavec's.  "cb" is
+ * called with "tgtbuffer" and "arg" once it's been filled in (see
+ * readback_poll()).
+ */
+extern void
+reduce_grid_async(cl_mem data, pix_t bufedge,
+    cl_datavec *tgtbuffer, readback_cb_t cb, void *arg);
+
+/*
+ * Sum up every component of all of the datavec's in "data".  The result is
+ * a single cl_datavec, in the GPU buffer that's returned; that buffer is
+ * reused by the next reduce_sum() call.
  */
-void
-reduce_addup(cl_mem data, int dim, float min, float max,
-    int *tgtbuffer, pix_t bufedge);
+extern cl_mem
+reduce_sum(cl_mem data);
 
 /*
- * This routine invokes reduce_addup(), then scales down each reduced
- * pixel value by the number of original pixels each scaled pixel
- * represents. This is the better routine for finding average values.
+ * Like reduce_sum(), but the result is read back asynchronously into
+ * "tgt", as for reduce_grid_async().
  */
-void
-reduce(cl_mem data, int dim, float min, float max,
-    int *tgtbuffer, pix_t bufedge);
+extern void
+reduce_sum_async(cl_mem data, cl_datavec *tgt, readback_cb_t cb, void *arg);
 
 #endif	/* _REDUCE_H */
@@ -0,0 +1,260 @@
+/*
+ * sat.cl -- implementation of 2-D box blur using a summed-area table.
+ *
+ * A summed-area table (also known as an integral image) holds, at each pixel
+ * (x,y), the sum of all source values at or above and to the left of it.
+ * Once it has been built, the sum of any axis-aligned rectangle can be found
+ * with four lookups, so a box blur of any radius costs the same O(1) per
+ * pixel.  Building the table is a pair of prefix sums, one along the rows
+ * and one along the columns.
+ *
+ * The catch is precision.  The table entries at the far corner hold the sum
+ * of every pixel in the image - about eight million of them at 4K - and a
+ * small blur is the tiny difference of two of those huge numbers.  A float
+ * only has 24 bits of mantissa, which isn't nearly enough.  Not all GPUs
+ * have doubles, so instead each entry is kept as an unevaluated sum of two
+ * floats (a "hi" part and a "lo" part that holds the rounding error of the
+ * hi part), using error-free transformations.  That gives about 48 bits,
+ * which is plenty.
+ *
+ * These error-free transformations depend on the compiler not reassociating
+ * floating point math, so this must never be built with
+ * -cl-fast-relaxed-math or -cl-unsafe-math-optimizations.
+ *
+ * The source is treated as periodic in both directions, just like the other
+ * box blur kernels, so lookups outside the table are folded back in using
+ * the row, column, and whole-image totals.
+ */
+
+#define	PIXEL(x,y,w)	(((y) * (w)) + (x))
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Add "b" to the two-float value (*hi, *lo), exactly.
+ * This is Knuth's TwoSum, followed by a renormalization.
+ */
+static void
+sat_add(boxvector *hi, boxvector *lo, const boxvector b_hi,
+    const boxvector b_lo)
+{
+	const boxvector	s = *hi + b_hi;
+	const boxvector	bb = s - *hi;
+	const boxvector	err = (*hi - (s - bb)) + (b_hi - bb) + *lo + b_lo;
+
+	*hi = s + err;
+	*lo = err - (*hi - s);
+}
+
+/*
+ * Multiply the two-float value (hi, lo) by a small integer "q", and add it
+ * to (*shi, *slo).  fma() gives us the rounding error of the product.
+ */
+static void
+sat_add_scaled(boxvector *shi, boxvector *slo, const boxvector hi,
+    const boxvector lo, const float q)
+{
+	const boxvector	p = hi * q;
+	const boxvector	e = fma(hi, (boxvector)q, -p) + lo * q;
+
+	sat_add(shi, slo, p, e);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Step 1: prefix sums along each row, from "in" into (sat_hi, sat_lo).
+ *
+ * Like subblock_box_1d(), each row is divided into get_local_size(0)
+ * subblocks, with one thread per subblock.  Each thread adds up its own
+ * subblock, then adds up the totals of all the subblocks to its left, and
+ * then walks its subblock again to write out the running sums.
+ *
+ * Requirements:
+ *
+ * - temp_hi and temp_lo must be arrays of (w * h) boxvector's.
+ *
+ * - get_global_size(0) must be set to the value of get_local_size(0).
+ */
+__kernel void
+sat_rows(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxstore	*in,		/* in: source data */
+	__global boxvector	*sat_hi,	/* out: row sums, hi part */
+	__global boxvector	*sat_lo,	/* out: row sums, lo part */
+	__local boxvector	*temp_hi,
+	__local boxvector	*temp_lo)
+{
+	const blkidx_t	w = get_local_size(0);	// workgroup width (# blocks)
+	const blkidx_t	x = get_local_id(0);	// current block index
+	const pix_t	y = get_local_id(1);	// current row in workgroup
+	const pix_t	rawbw = W / w;		// "small" block width
+	const blkidx_t	overflow = W % w;	// small->large transition
+	const pix_t	bw =			// this block's actual width
+	    rawbw + (x < overflow ? 1 : 0);
+	const pix_t	X =			// global X position, pixels
+	    x * rawbw + min(x, overflow);
+	const pix_t	Y = get_global_id(1);	// global Y position, pixels
+	const bool	inbounds = ((pix_t)x < W && Y < H);
+
+	const pix_t		inrow = PIXEL(X, Y, W);
+	boxvector		hi, lo;
+
+	/*
+	 * First: sum up our block into temp.
+	 */
+	hi = lo = 0;
+	if (inbounds) {
+		for (pix_t i = 0; i < bw; i++) {
+			sat_add(&hi, &lo, load_boxvector(in, inrow + i), 0);
+		}
+	}
+	temp_hi[y * w + x] = hi;
+	temp_lo[y * w + x] = lo;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!inbounds) {
+		return;
+	}
+
+	/*
+	 * Next: add up all of the blocks to our left.
+	 */
+	hi = lo = 0;
+	for (blkidx_t b = 0; b < x; b++) {
+		sat_add(&hi, &lo, temp_hi[y * w + b], temp_lo[y * w + b]);
+	}
+
+	/*
+	 * Finally: write out the running sums for our block.
+	 */
+	for (pix_t i = 0; i < bw; i++) {
+		sat_add(&hi, &lo, load_boxvector(in, inrow + i), 0);
+		sat_hi[PIXEL(X + i, Y, W)] = hi;
+		sat_lo[PIXEL(X + i, Y, W)] = lo;
+	}
+}
+
+/*
+ * Step 2: prefix sums down each column, in place.
+ *
+ * There's one thread per column.  Neighboring threads touch neighboring
+ * addresses on every iteration, so the loads and stores stream nicely
+ * even though each thread walks the whole column.
+ */
+__kernel void
+sat_cols(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxvector	*sat_hi,	/* in/out: sums, hi part */
+	__global boxvector	*sat_lo)	/* in/out: sums, lo part */
+{
+	const pix_t	X = get_global_id(0);
+	boxvector	hi, lo;
+
+	if (X >= W) {
+		return;
+	}
+
+	hi = lo = 0;
+	for (pix_t Y = 0; Y < H; Y++) {
+		const pix_t	p = PIXEL(X, Y, W);
+
+		sat_add(&hi, &lo, sat_hi[p], sat_lo[p]);
+		sat_hi[p] = hi;
+		sat_lo[p] = lo;
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Look up the sum of all source values in [0, a) x [0, b), for
+ * 0 <= a <= W and 0 <= b <= H, and add "q" times it to (*shi, *slo).
+ */
+static void
+sat_accum(
+	const pix_t		W,
+	__global boxvector	*sat_hi,
+	__global boxvector	*sat_lo,
+	const pix_t		a,
+	const pix_t		b,
+	const float		q,
+	boxvector		*shi,
+	boxvector		*slo)
+{
+	if (a != 0 && b != 0 && q != 0) {
+		const pix_t	p = PIXEL(a - 1, b - 1, W);
+
+		sat_add_scaled(shi, slo, sat_hi[p], sat_lo[p], q);
+	}
+}
+
+/*
+ * Add "sign" times the sum of all source values in [0, x) x [0, y) to
+ * (*shi, *slo).  x and y can be anywhere; the source is periodic, so
+ * each full trip around the image adds another copy of a row, column or
+ * image total.
+ */
+static void
+sat_lookup(
+	const pix_t		W,
+	const pix_t		H,
+	__global boxvector	*sat_hi,
+	__global boxvector	*sat_lo,
+	const spix_t		x,
+	const spix_t		y,
+	const float		sign,
+	boxvector		*shi,
+	boxvector		*slo)
+{
+	const spix_t	sW = (spix_t)W;
+	const spix_t	sH = (spix_t)H;
+	const spix_t	qx = (x >= 0 ? x / sW : -((sW - 1 - x) / sW));
+	const spix_t	qy = (y >= 0 ? y / sH : -((sH - 1 - y) / sH));
+	const pix_t	rx = (pix_t)(x - qx * sW);
+	const pix_t	ry = (pix_t)(y - qy * sH);
+
+	sat_accum(W, sat_hi, sat_lo, rx, ry, sign, shi, slo);
+	sat_accum(W, sat_hi, sat_lo, W, ry, sign * qx, shi, slo);
+	sat_accum(W, sat_hi, sat_lo, rx, H, sign * qy, shi, slo);
+	sat_accum(W, sat_hi, sat_lo, W, H, sign * qx * qy, shi, slo);
+}
+
+/*
+ * Step 3: the box blur itself.  Unlike the 1-D kernels, this produces a
+ * complete 2-D blur of radius "r" in one pass, and doesn't transpose.
+ */
+__kernel void
+sat_box_2d(
+	const pix_t		W,		/* in: actual width */
+	const pix_t		H,		/* in: actual height */
+	__global boxvector	*sat_hi,	/* in: summed-area table */
+	__global boxvector	*sat_lo,
+	__global boxstore	*out,		/* out: blurred data */
+	const pix_t		r)		/* in: radius */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const float	scale = (2 * r + 1);
+	const spix_t	x0 = (spix_t)X - (spix_t)r;
+	const spix_t	x1 = (spix_t)X + (spix_t)r + 1;
+	const spix_t	y0 = (spix_t)Y - (spix_t)r;
+	const spix_t	y1 = (spix_t)Y + (spix_t)r + 1;
+	boxvector	hi, lo;
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+
+	hi = lo = 0;
+	sat_lookup(W, H, sat_hi, sat_lo, x1, y1,  1.0f, &hi, &lo);
+	sat_lookup(W, H, sat_hi, sat_lo, x0, y1, -1.0f, &hi, &lo);
+	sat_lookup(W, H, sat_hi, sat_lo, x1, y0, -1.0f, &hi, &lo);
+	sat_lookup(W, H, sat_hi, sat_lo, x0, y0,  1.0f, &hi, &lo);
+
+	store_boxvector((hi + lo) / (scale * scale), out, PIXEL(X, Y, W));
+}
+
+#undef	PIXEL
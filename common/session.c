@@ -0,0 +1,369 @@
+/*
+ * session.c - records the changes made during a session, and plays them
+ * back.
+ *
+ * A session file is plain text.  After a short header, each line is one
+ * change, starting with the number of frames that were finished when it
+ * was made:
+ *
+ *	zounds session 1
+ *	core multiscale
+ *	size 1280 720
+ *	seed 4242
+ *	0 i random
+ *	57 p 12 blur radius
+ *	90 s 400 300 407 310
+ *	133 i file start.ppm
+ *	2400 end
+ *
+ * A change made during a step (e.g. by autopilot) is tagged with the frame
+ * that step belongs to, and one made between steps (by a key or the mouse)
+ * with the next one; so on replay, all of the changes tagged with a frame
+ * are made just before that frame starts, and each of them is seen by the
+ * same step that saw it the first time.
+ *
+ * Autopilot is off during a replay, since its changes are in the file.
+ * Random data for "i random" isn't the same as it was when recording,
+ * since autopilot doesn't get to use up random numbers; but it's random
+ * data of the same size, which takes the same amount of work.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "datasrc.h"
+#include "debug.h"
+#include "image.h"
+#include "module.h"
+#include "param.h"
+#include "session.h"
+#include "stroke.h"
+#include "util.h"
+
+#define	SESSION_VERSION	1
+#define	SESSION_LINELEN	1024
+
+typedef enum {
+	SE_PARAM,
+	SE_STROKE,
+	SE_IMAGE
+} session_type_t;
+
+typedef struct {
+	int		se_frame;	/* frames finished beforehand */
+	session_type_t	se_type;
+	int		se_val;		/* SE_PARAM's new value */
+	pix_t		se_stroke[4];	/* SE_STROKE's ox, oy, nx, ny */
+	char		*se_str;	/* param name, or image kind */
+	char		*se_file;	/* image file, for "i file" */
+} session_event_t;
+
+static struct {
+	const char	*path;		/* to record to */
+	long		seed;
+	FILE		*fp;		/* the recording, if any */
+
+	session_event_t	*events;	/* being replayed, if any */
+	int		nevents;
+	int		nalloc;
+	int		next;		/* next one to replay */
+	char		core[64];	/* as recorded */
+
+	int		frames;		/* frames finished */
+} Session;
+
+/* ------------------------------------------------------------------ */
+
+void
+session_record(const char *path, long seed)
+{
+	Session.path = path;
+	Session.seed = seed;
+}
+
+static bool
+session_recording(void)
+{
+	return (Session.fp != NULL);
+}
+
+void
+session_param(const char *name, int val)
+{
+	if (session_recording()) {
+		(void) fprintf(Session.fp, "%d p %d %s\n",
+		    Session.frames, val, name);
+	}
+}
+
+void
+session_stroke(pix_t ox, pix_t oy, pix_t nx, pix_t ny)
+{
+	if (session_recording()) {
+		(void) fprintf(Session.fp, "%d s %d %d %d %d\n",
+		    Session.frames, (int)ox, (int)oy, (int)nx, (int)ny);
+	}
+}
+
+void
+session_image(const char *kind, const char *file)
+{
+	if (!session_recording()) {
+		return;
+	}
+	if (file != NULL) {
+		(void) fprintf(Session.fp, "%d i %s %s\n",
+		    Session.frames, kind, file);
+	} else {
+		(void) fprintf(Session.fp, "%d i %s\n", Session.frames, kind);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static char *
+session_strdup(const char *str)
+{
+	char	*copy = mem_alloc(strlen(str) + 1);
+
+	(void) strcpy(copy, str);
+	return (copy);
+}
+
+static session_event_t *
+session_event_add(void)
+{
+	session_event_t	*events;
+
+	if (Session.nevents == Session.nalloc) {
+		Session.nalloc = MAX(2 * Session.nalloc, 256);
+		events = mem_alloc(Session.nalloc * sizeof (session_event_t));
+		if (Session.events != NULL) {
+			(void) memcpy(events, Session.events,
+			    Session.nevents * sizeof (session_event_t));
+			mem_free((void **)&Session.events);
+		}
+		Session.events = events;
+	}
+	return (&Session.events[Session.nevents++]);
+}
+
+/*
+ * Parse one change from the file.  Returns false at the "end" line.
+ */
+static bool
+session_parse(const char *path, int lineno, char *line, int *framep)
+{
+	session_event_t	*se;
+	char		type;
+	int		frame, off;
+	unsigned	xy[4];
+	char		kind[16];
+
+	if (sscanf(line, "%d %n", &frame, &off) < 1 || line[off] == '\0') {
+		die("%s, line %d: can't parse \"%s\"\n", path, lineno, line);
+	}
+	if (frame < *framep) {
+		die("%s, line %d: frame %d is out of order\n",
+		    path, lineno, frame);
+	}
+	*framep = frame;
+	line += off;
+	if (strcmp(line, "end") == 0) {
+		return (false);
+	}
+	type = *line++;
+	line += strspn(line, " ");
+
+	se = session_event_add();
+	se->se_frame = frame;
+	se->se_str = NULL;
+	se->se_file = NULL;
+
+	switch (type) {
+	case 'p':
+		se->se_type = SE_PARAM;
+		if (sscanf(line, "%d %n", &se->se_val, &off) < 1) {
+			die("%s, line %d: bad parameter change\n",
+			    path, lineno);
+		}
+		se->se_str = session_strdup(line + off);
+		break;
+	case 's':
+		se->se_type = SE_STROKE;
+		if (sscanf(line, "%u %u %u %u",
+		    &xy[0], &xy[1], &xy[2], &xy[3]) < 4) {
+			die("%s, line %d: bad stroke\n", path, lineno);
+		}
+		for (int i = 0; i < 4; i++) {
+			se->se_stroke[i] = xy[i];
+		}
+		break;
+	case 'i':
+		se->se_type = SE_IMAGE;
+		if (sscanf(line, "%15s %n", kind, &off) < 1) {
+			die("%s, line %d: bad image load\n", path, lineno);
+		}
+		se->se_str = session_strdup(kind);
+		if (strcmp(kind, "file") == 0) {
+			se->se_file = session_strdup(line + off);
+		}
+		break;
+	default:
+		die("%s, line %d: unknown change '%c'\n", path, lineno, type);
+		break;
+	}
+	return (true);
+}
+
+/* This gets called from main() before session_preinit(). */
+void
+session_replay(const char *path, pix_t *widthp, pix_t *heightp,
+    long *seedp, int *framesp)
+{
+	char		line[SESSION_LINELEN];
+	int		version, lineno, frame;
+	unsigned	w, h;
+	bool		ended;
+	FILE		*fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		die("Couldn't open session file \"%s\"\n", path);
+	}
+
+	if (fscanf(fp, "zounds session %d\n", &version) != 1 ||
+	    version != SESSION_VERSION) {
+		die("\"%s\" isn't a session file I know how to replay\n",
+		    path);
+	}
+	if (fscanf(fp, "core %63s\n", Session.core) != 1 ||
+	    fscanf(fp, "size %u %u\n", &w, &h) != 2 ||
+	    fscanf(fp, "seed %ld\n", seedp) != 1) {
+		die("\"%s\" has a bad header\n", path);
+	}
+	*widthp = w;
+	*heightp = h;
+
+	ended = false;
+	frame = 0;
+	for (lineno = 5; fgets(line, sizeof (line), fp) != NULL; lineno++) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!session_parse(path, lineno, line, &frame)) {
+			ended = true;
+			break;
+		}
+	}
+	(void) fclose(fp);
+
+	/*
+	 * A session that didn't get to exit cleanly is still good up to
+	 * its last change.
+	 */
+	if (!ended) {
+		warn("\"%s\" was cut short; replaying %d frames\n",
+		    path, frame + 1);
+		frame++;
+	}
+	*framesp = frame;
+
+	verbose(DB_PARAM, "Replaying %d changes over %d frames from %s\n",
+	    Session.nevents, frame, path);
+}
+
+static void
+session_apply(const session_event_t *se)
+{
+	switch (se->se_type) {
+	case SE_PARAM:
+		param_set_raw(param_lookup(se->se_str), se->se_val);
+		break;
+	case SE_STROKE:
+		stroke_add(se->se_stroke[0], se->se_stroke[1],
+		    se->se_stroke[2], se->se_stroke[3]);
+		break;
+	case SE_IMAGE:
+		if (se->se_file != NULL) {
+			image_datafile(se->se_file);
+		} else if (strcmp(se->se_str, "camera") == 0) {
+			image_load_camera();
+		} else {
+			image_load_random();
+		}
+		break;
+	}
+}
+
+void
+session_frame_start(void)
+{
+	while (Session.next < Session.nevents &&
+	    Session.events[Session.next].se_frame <= Session.frames) {
+		session_apply(&Session.events[Session.next++]);
+	}
+}
+
+void
+session_frame_end(void)
+{
+	Session.frames++;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Recording starts once everything is set up, so the parameters that
+ * main() sets after that are part of the session.  This gets called again
+ * after a resize, but the file is only opened the first time.
+ */
+static void
+session_init(void)
+{
+	if (Session.events != NULL && Session.next == 0 &&
+	    strcmp(Session.core, datasrc_core_name()) != 0) {
+		warn("Replaying a session recorded with the \"%s\" core\n",
+		    Session.core);
+	}
+
+	if (Session.path == NULL || Session.fp != NULL) {
+		return;
+	}
+	if ((Session.fp = fopen(Session.path, "w")) == NULL) {
+		warn("Couldn't record session to \"%s\"\n", Session.path);
+		Session.path = NULL;
+		return;
+	}
+	(void) fprintf(Session.fp, "zounds session %d\ncore %s\n"
+	    "size %d %d\nseed %ld\n", SESSION_VERSION, datasrc_core_name(),
+	    (int)Width, (int)Height, Session.seed);
+	verbose(DB_PARAM, "Recording session to %s\n", Session.path);
+}
+
+static void
+session_postfini(void)
+{
+	if (Session.fp != NULL) {
+		(void) fprintf(Session.fp, "%d end\n", Session.frames);
+		(void) fclose(Session.fp);
+		Session.fp = NULL;
+	}
+	for (int i = 0; i < Session.nevents; i++) {
+		if (Session.events[i].se_str != NULL) {
+			mem_free((void **)&Session.events[i].se_str);
+		}
+		if (Session.events[i].se_file != NULL) {
+			mem_free((void **)&Session.events[i].se_file);
+		}
+	}
+	if (Session.events != NULL) {
+		mem_free((void **)&Session.events);
+	}
+}
+
+const module_ops_t	session_ops = {
+	NULL,
+	session_init,
+	NULL,
+	session_postfini
+};
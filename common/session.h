@@ -0,0 +1,62 @@
+/*
+ * session.h - interfaces for recording a session and replaying it.
+ *
+ * A recording ("-z <file>") notes every change to a parameter's value,
+ * whether it came from a key, autopilot, or a preset, along with every
+ * mouse stroke and every image load, each tagged with the number of frames
+ * that had been finished when it happened.  A replay ("-Z <file>") runs
+ * the same sequence of changes headless, at the same size and from the
+ * same seed, as a benchmark (see bench.h); so a real show can be timed
+ * against each new build.
+ */
+
+#ifndef	_SESSION_H
+#define	_SESSION_H
+
+#include "types.h"
+
+/*
+ * Record this session to "path", starting from random seed "seed".
+ *
+ * This gets called from main() before session_preinit().
+ */
+extern void
+session_record(const char *path, long seed);
+
+/*
+ * Replay the session recorded in "path".  The size and seed it was
+ * recorded with are returned in "widthp", "heightp", and "seedp", and the
+ * number of frames it ran for in "framesp".
+ *
+ * This gets called from main() before session_preinit().
+ */
+extern void
+session_replay(const char *path, pix_t *widthp, pix_t *heightp,
+    long *seedp, int *framesp);
+
+/*
+ * Called at the start and the end of each frame.  In threaded mode, these
+ * have to be called with the window lock held.
+ */
+extern void
+session_frame_start(void);
+
+extern void
+session_frame_end(void);
+
+/*
+ * Note that the value of the parameter named "name" is now "val" (in the
+ * units of param_dump()), that a stroke was added, or that an image is
+ * being loaded.  "kind" is "random", "camera", or "file", in which case
+ * "file" is the name of the PPM file.
+ */
+extern void
+session_param(const char *name, int val);
+
+extern void
+session_stroke(pix_t ox, pix_t oy, pix_t nx, pix_t ny);
+
+extern void
+session_image(const char *kind, const char *file);
+
+#endif	/* _SESSION_H */
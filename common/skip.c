@@ -48,6 +48,12 @@
  *   out a way to balance that out.  Maybe hash each channel separately, and
  *   use the result from whichever channel has the winner farthest ahead of
  *   the second-place result?
+ *
+ * All three steps run on the GPU (see skip.cl), which keeps the hashes and
+ * the scores in its own memory.  The only thing read back is the winning
+ * skip count, once per frame and asynchronously, so a new skip count takes
+ * effect a frame or so later.  That's a lot cheaper than stalling the
+ * pipeline every frame, and it doesn't change which skip count wins.
  */
 #include <strings.h>
 #include <assert.h>
@@ -61,6 +67,7 @@
 #include "param.h"
 #include "reduce.h"
 #include "skip.h"
+#include "telemetry.h"
 #include "util.h"
 
 #define	REDUCE		16	/* reduce image to REDUCExREDUCE */
@@ -75,20 +82,27 @@ static void	skip_adjust(void);
 #define	HASHSZ		(P2ROUNDUP(REDUCE * REDUCE * HASHBITS, 8) / 8)
 #define	NHASHES		(NSKIPS + 2)
 
+/*
+ * The detector's state on the GPU.  This must match skipstate_t in skip.cl.
+ */
 typedef struct {
-	uint8_t		hash[HASHSZ];
-} skiphash_t;
+	cl_int		ss_next;	/* which hash slot to fill next */
+	cl_int		ss_filled;	/* how many hash slots are valid */
+	cl_int		ss_nskip;	/* best skip count so far */
+} skipstate_t;
 
 static struct {
 	param_id_t	id;		/* parameter ID for skip count */
 	int		param;		/* value of skip parameter */
 	int		nskip;		/* number of images to skip */
 
-	int		*reduce_cpu;	/* memory for reduction */
+	kernel_data_t	hash_kernel;	/* hashing and scoring kernel */
+	cl_mem		hashes;		/* NHASHES image hashes */
+	cl_mem		score;		/* scores of the skip counts */
+	cl_mem		state;		/* a skipstate_t */
 
-	skiphash_t	hashes[NHASHES]; /* image hashes */
-	int		nexthash;	/* which of hashes[] to use next */
-	float		score[NHASHES - 1]; /* scores of the skip counts */
+	skipstate_t	state_cpu[2];	/* memory for readbacks */
+	int		nextbuf;	/* which of state_cpu[] to use next */
 } Skip;
 
 /* ------------------------------------------------------------------ */
@@ -105,11 +119,12 @@ skip_preinit(void)
 	/*
 	 * The image skipping parameter can be set to skip any number of
 	 * images from 0 to NSKIPS.  If the parameter is set to -1, that
-	 * triggers the auto-detect code.  Its default setting is to use
-	 * autodetect.
+	 * triggers the auto-detect code.  Its default setting is not to
+	 * skip at all, since skipping (and detection) take a step apart from
+	 * rendering in the cores that can do both at once.
 	 */
 	pi.pi_min = -1;
-	pi.pi_default = -1;
+	pi.pi_default = 0;
 	pi.pi_max = NSKIPS;
 	pi.pi_units = 1;
 	pi.pi_ap_freq = APF_OFF;
@@ -126,20 +141,33 @@ skip_preinit(void)
 static void
 skip_init(void)
 {
-	const size_t	reducesz = (size_t)REDUCE * REDUCE * sizeof (int);
+	const size_t	hashsz = (size_t)NHASHES * HASHSZ;
+	const size_t	scoresz = (NHASHES - 1) * sizeof (cl_float);
+	int		zero = 0;
+	skipstate_t	state;
+
+	kernel_create(&Skip.hash_kernel, "skip_hash");
 
-	Skip.reduce_cpu = mem_alloc(reducesz);
+	Skip.hashes = buffer_alloc(hashsz);
+	Skip.score = buffer_alloc(scoresz);
+	Skip.state = buffer_alloc(sizeof (skipstate_t));
 
-	bzero(&Skip.hashes, sizeof (Skip.hashes));
+	buffer_fill(Skip.hashes, hashsz, &zero, sizeof (zero));
+	buffer_fill(Skip.score, scoresz, &zero, sizeof (zero));
+	bzero(&state, sizeof (state));
+	buffer_writetogpu(&state, Skip.state, sizeof (state));
 
-	/* skip_analyze() starts by incrementing this value. */
-	Skip.nexthash = -1;
+	Skip.nextbuf = 0;
 }
 
 static void
 skip_fini(void)
 {
-	mem_free((void **)&Skip.reduce_cpu);
+	buffer_free(&Skip.state);
+	buffer_free(&Skip.score);
+	buffer_free(&Skip.hashes);
+
+	kernel_cleanup(&Skip.hash_kernel);
 }
 
 const module_ops_t	skip_ops = {
@@ -173,170 +201,106 @@ skip_adjust(void)
 }
 
 /*
- * Return the number of bits set in the specified byte.
- */
-static int
-popc(uint8_t val)
-{
-	int rv = 0;
-	for (int i = 1; i < (1 << 8); i <<= 1) {
-		if (val & i) {
-			rv++;
-		}
-	}
-	return (rv);
-}
-
-/*
- * Create a hash of the most recently reduced image.
- *
- * The CPU-local copy of the image is in Skip.reduce_cpu;
- * the hash goes into Skip.hashes[Skip.nexthash % NHASHES].
+ * The second half of the auto-skip detector, called once the winning skip
+ * count has made it back from the GPU.
  */
 static void
-skip_hash(void)
+skip_hashed(void *buf, void *arg)
 {
-	const int	idx = Skip.nexthash % NHASHES;
-	uint8_t	*const	shash = &Skip.hashes[idx].hash[0];
-	uint8_t	*const	ehash = &Skip.hashes[idx].hash[HASHSZ];
-	int	*const	reduced = Skip.reduce_cpu;
-	uint8_t		*hash;
-	int		x, y, p, newbits, nbits;
-	uint8_t		bits;
-
-	bits = 0;
-	nbits = 0;
-	hash = shash;
+	const skipstate_t	*const	ss = buf;
 
-	/*
-	 * The code below assumes that the bit concatenation will never
-	 * wind up spanning multiple bytes.
-	 */
-	assert(8 % HASHBITS == 0);
-
-	for (p = y = 0; y < REDUCE; y++) {
-		for (x = 0; x < REDUCE; x++, p++) {
-			/*
-			 * Take the top HASHBITS bits of each pixel and
-			 * concatenate them.
-			 */
-			newbits = reduced[p] >> (8 - HASHBITS);
-			newbits &= ((1 << HASHBITS) - 1);
-
-			bits = (bits << HASHBITS) | newbits;
-			nbits += HASHBITS;
-			if (nbits == 8) {
-				assert(hash < ehash);
-				*hash++ = bits;
-				bits = 0;
-				nbits = 0;
-			}
-		}
+	if (Skip.param >= 0) {
+		return;		/* auto-skip detection was turned off */
 	}
-
-	if (nbits > 0) {
-		assert(hash < ehash);
-		*hash++ = bits;
+	if (ss->ss_filled < NHASHES) {
+		return;		/* not enough history yet */
 	}
 
-	/*
-	 * We should have filled up the hash entirely.
-	 */
-	assert(hash == ehash);
-}
-
-/*
- * Analyze the results of the latest hashing.
- */
-static int
-skip_hashcmp(void)
-{
-	const int	idx = Skip.nexthash % NHASHES;
-	int		nbits, nskip, nh;
-	float		bestscore;
-
-	debug(DB_SKIP, "Skip: new scores");
-
-	for (nh = 0; nh < NHASHES - 1; nh++) {
-		const int	oidx = (idx - nh - 1 + NHASHES) % NHASHES;
-		const uint8_t	*ohash = &Skip.hashes[oidx].hash[0];
-		const uint8_t	*nhash = &Skip.hashes[idx].hash[0];
-
-		/*
-		 * Compute the Hamming distance between the most recent hash
-		 * and the hash "nh" images away.
-		 */
-		nbits = 0;
-		for (int b = 0; b < HASHSZ; b++) {
-			nbits += popc(ohash[b] ^ nhash[b]);
-		}
-
-		/*
-		 * Update the score for this skip count.  This uses
-		 * exponential smoothing to feed in new data gently.
-		 */
-		Skip.score[nh] =
-		    Skip.score[nh] * SKIPFADE + nbits * (1 - SKIPFADE);
-		debug(DB_SKIP, "%c %7.3f", (nh == 0 ? ':' : ','),
-		    Skip.score[nh]);
-	}
+	debug(DB_SKIP, "Skip: best = %d\n", ss->ss_nskip);
 
-	/*
-	 * Pick the new winner.
-	 */
-	bestscore = HASHSZ * 8;
-	nskip = -1;
-	for (nh = 0; nh < NHASHES - 1; nh++) {
-		if (Skip.score[nh] < bestscore) {
-			bestscore = Skip.score[nh];
-			nskip = nh;
-		}
+	if (ss->ss_nskip != Skip.nskip) {
+		verbose(DB_SKIP,
+		    "Auto-skip detection: now skipping %d image%s\n",
+		    ss->ss_nskip, (ss->ss_nskip != 1 ? "s" : ""));
+		Skip.nskip = ss->ss_nskip;
 	}
-
-	debug(DB_SKIP, " -> best = %d\n", nskip);
-
-	return (nskip);
 }
 
 /*
- * The auto-skip detector.
+ * The auto-skip detector.  This generates a highly "reduced" version of the
+ * data (16x16 pixels), and has the GPU hash it and update the scores.
  */
 static void
 skip_analyze(cl_mem data, int dim, float min, float max)
 {
-	int	nskip;
+	kernel_data_t	*const	kd = &Skip.hash_kernel;
+	pix_t			reduce = REDUCE;
+	int			hashbits = HASHBITS;
+	int			hashsz = HASHSZ;
+	int			nhashes = NHASHES;
+	float			fade = SKIPFADE;
+	size_t			size[1];
+	cl_mem			sums;
+	int			arg;
 
 	if (Skip.param >= 0) {
 		return;		/* not doing auto-skip detection */
 	}
 
-	Skip.nexthash++;
-
 	/*
-	 * Generate a highly "reduced" version of the data (16x16 pixels).
+	 * The code in skip.cl assumes that the bit concatenation will never
+	 * wind up spanning multiple bytes.
 	 */
-	reduce(data, dim, min, max, Skip.reduce_cpu, REDUCE);
+	assert(8 % HASHBITS == 0);
 
-	/*
-	 * Create a hash of the reduced image.
-	 */
-	skip_hash();
+	sums = reduce_grid(data, REDUCE);
+
+	size[0] = MIN(kernel_wgsize(kd), HASHSZ);
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &reduce);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &sums);
+	kernel_setarg(kd, arg++, sizeof (int), &dim);
+	kernel_setarg(kd, arg++, sizeof (float), &min);
+	kernel_setarg(kd, arg++, sizeof (float), &max);
+	kernel_setarg(kd, arg++, sizeof (int), &hashbits);
+	kernel_setarg(kd, arg++, sizeof (int), &hashsz);
+	kernel_setarg(kd, arg++, sizeof (int), &nhashes);
+	kernel_setarg(kd, arg++, sizeof (float), &fade);
+	kernel_setarg(kd, arg++, (NHASHES - 1) * sizeof (int), NULL);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Skip.hashes);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Skip.score);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Skip.state);
+	kernel_invoke(kd, 1, size, size);
+}
 
-	if (Skip.nexthash < NHASHES - 1) {
+/*
+ * Start reading back the latest winner.  The rest happens in skip_hashed().
+ */
+static void
+skip_readback(void)
+{
+	if (Skip.param >= 0) {
 		return;
 	}
 
-	/*
-	 * See which skip target looks best now, given the new data.
-	 */
-	nskip = skip_hashcmp();
+	buffer_readfromgpu_async(Skip.state, &Skip.state_cpu[Skip.nextbuf],
+	    sizeof (skipstate_t), skip_hashed, NULL);
+	Skip.nextbuf = 1 - Skip.nextbuf;
+}
 
-	if (nskip != Skip.nskip) {
-		verbose(DB_SKIP,
-		    "Auto-skip detection: now skipping %d image%s\n",
-		    nskip, (nskip != 1 ? "s" : ""));
-		Skip.nskip = nskip;
-	}
+bool
+skip_active(void)
+{
+	return (Skip.param < 0 || Skip.nskip > 0);
+}
+
+int
+skip_fixed(void)
+{
+	return (Skip.param >= 0 ? Skip.nskip : 0);
 }
 
 /*
@@ -346,21 +310,27 @@ void
 skip_step(cl_mem result, int dim, float min, float max, void (*step)(cl_mem))
 {
 	const int	nskip = Skip.nskip;
+	hrtime_t	tm;
 
 	/*
 	 * Generate "nskip" images, and throw them away (overwrite them).
 	 * We do feed each image into the auto-skip detector before
 	 * overwriting it, though.
 	 */
+	tm = telemetry_start();
 	for (int i = 0; i < nskip; i++) {
 		(*step)(result);
 		debug(DB_PERF, " (skip)\n");
 		skip_analyze(result, dim, min, max);
 	}
+	telemetry_stop(TM_SKIP, tm);
 
 	/*
 	 * Generate a real image to be displayed.
 	 */
 	(*step)(result);
+	tm = telemetry_start();
 	skip_analyze(result, dim, min, max);
+	skip_readback();
+	telemetry_stop(TM_SKIP, tm);
 }
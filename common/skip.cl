@@ -3,134 +3,123 @@
  */
 
 /*
- * Pick one component out of a vector.
+ * The detector's state, which stays on the GPU between frames.
+ * This must match skipstate_t in skip.c.
  */
-static float
-datavec_pick(const datavec v, int dim)
-{
-	const datavec	masks[DATA_DIMENSIONS] = {
-#if	DATA_DIMENSIONS == 4
-		(datavec)(1, 0, 0, 0),
-		(datavec)(0, 1, 0, 0),
-		(datavec)(0, 0, 1, 0),
-		(datavec)(0, 0, 0, 1)
-#elif	DATA_DIMENSIONS == 3
-		(datavec)(1, 0, 0),
-		(datavec)(0, 1, 0),
-		(datavec)(0, 0, 1)
-#elif	DATA_DIMENSIONS == 2
-		(datavec)(1, 0),
-		(datavec)(0, 1)
-#elif	DATA_DIMENSIONS == 1
-		(datavec)(1)
-#else
-#error	I do not know what to do.
-#endif
-	};
-
-	return (dot(v, masks[dim]));
-}
+typedef struct {
+	int		ss_next;	/* which hash slot to fill next */
+	int		ss_filled;	/* how many hash slots are valid */
+	int		ss_nskip;	/* best skip count so far */
+} skipstate_t;
 
 /*
- * Reduce the image to a much smaller one.  The "reduce" argument gives the
- * size of one edge of the reduced image.
- *
- * The original image can be thought of as being tiled with "reduce * reduce"
- * rectangular regions of (nearly) equal size.  The "id" of each pixel
- * indicates which region it is a part of.  All the data points from each
- * region get summed up into a single value of the "result" array.
+ * Hash the reduced image in "sums" into the next slot of the hash ring, then
+ * score each skip count by the Hamming distance between the new hash and the
+ * hash that many images back, and pick the winner.  (See skip.c for the
+ * details of each step.)
  *
- * "temp" must be an array of one datavec for each workgroup member.
- * "ids"  must be an array of one int     for each workgroup member.
+ * "sums" is the output of the reduce_regions kernel: for each of the
+ * "reduce" x "reduce" regions of the image, the sum of its datavec's.  Only
+ * component "dim" is hashed, after its range [min, max] is scaled to
+ * [0, 256).
  *
- * This assumes that all datavec entries are in the range [min, max).
+ * This is run as a single workgroup, whose members each take a share of
+ * the bytes of the hash.  "dist" must have room for "nhashes - 1" ints.
  */
 __kernel void
-reduce(
-	const pix_t		W,	/* in: width of image */
-	const pix_t		H,	/* in: height of image */
-	__read_only image2d_t	data,	/* in: image */
-	__local datavec		*temp,	/* local memory, see above */
-	__local int		*ids,	/* local memory, see above */
-	const pix_t		reduce,	/* in: size of target edge */
-	const int		dim,	/* in: which data dimension to use */
-	const float		min,	/* in: minimum value for datavec */
-	const float		max,	/* in: maximum value for datavec */
-	__global int		*result) /* out */
+skip_hash(
+	const pix_t		W,		/* in: width of image */
+	const pix_t		H,		/* in: height of image */
+	const pix_t		reduce,		/* in: size of reduced edge */
+	__global const datavec	*sums,		/* in: reduced image */
+	const int		dim,		/* in: component to hash */
+	const float		min,		/* in: bottom of range */
+	const float		max,		/* in: top of range */
+	const int		hashbits,	/* in: bits per reduced pixel */
+	const int		hashsz,		/* in: bytes per hash */
+	const int		nhashes,	/* in: size of hash ring */
+	const float		fade,		/* in: score decay rate */
+	__local int		*dist,		/* local memory, see above */
+	__global uchar		*hashes,	/* in/out: hash ring */
+	__global float		*score,		/* in/out: skip count scores */
+	__global skipstate_t	*state)		/* in/out: detector state */
 {
-	const pix_t	X = get_global_id(0);
-	const pix_t	Y = get_global_id(1);
+	const int	lid = get_local_id(0);
+	const int	lsize = get_local_size(0);
+	const int	perbyte = 8 / hashbits;
+	const int	mask = (1 << hashbits) - 1;
+	const int	npix = reduce * reduce;
+	const int	idx = state->ss_next;
+	__global uchar	*const	nhash = &hashes[idx * hashsz];
 
-	if (X >= W || Y >= H) {
-		return;
+	for (int nh = lid; nh < nhashes - 1; nh += lsize) {
+		dist[nh] = 0;
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	const int	x = get_local_id(0);
-	const int	y = get_local_id(1);
-	const int	w = get_local_size(0);
-	const int	h = get_local_size(1);
-	const int	p = y * w + x;
-	const int	id = ((Y * reduce) / H) * reduce + (X * reduce) / W;
-
-	datavec		t;
+	for (int b = lid; b < hashsz; b += lsize) {
+		uchar	bits = 0;
 
-	temp[p] = as_datavec(read_imagef(data, (int2)(X, Y)));
-	ids[p] = id;
-	barrier(CLK_LOCAL_MEM_FENCE);
+		/*
+		 * Average each region, and concatenate the top "hashbits"
+		 * bits of the averages.  The region sizes are computed the
+		 * same way the reduce kernel assigns pixels to regions.
+		 */
+		for (int i = 0; i < perbyte; i++) {
+			const int	p = b * perbyte + i;
+			const int	x = p % reduce;
+			const int	y = p / reduce;
+			const int	dx =
+			    ((x + 1) * W / reduce) - (x * W / reduce);
+			const int	dy =
+			    ((y + 1) * H / reduce) - (y * H / reduce);
+			const float	mean = (p < npix) ?
+			    datavec_pick(sums[p], dim) / (dx * dy) : min;
+			const int	avg = clamp(
+			    (int)((mean - min) / (max - min) * 255), 0, 255);
 
-	/*
-	 * Sum together all values in this workgroup row with the same ID.
-	 */
-	for (int i = 1; i < w; i <<= 1) {
-		if (((x & i) == 0) && (x + i < w) && ids[p + i] == id) {
-			t = temp[p + i];
-			ids[p + i] = -1;
-			temp[p] += t;
+			bits = (bits << hashbits) |
+			    ((avg >> (8 - hashbits)) & mask);
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);
 
-		if (((x & i) == 0) && (x > i) && ids[p - i] == id) {
-			t = temp[p - i];
-			ids[p - i] = -1;
-			temp[p] += t;
+		/*
+		 * Each byte of the old hashes is read by the only member
+		 * that writes that byte of the new one.
+		 */
+		for (int nh = 0; nh < nhashes - 1; nh++) {
+			const int	oidx =
+			    (idx - nh - 1 + nhashes) % nhashes;
+			const uchar	diff = hashes[oidx * hashsz + b] ^ bits;
+
+			(void) atomic_add(&dist[nh], popcount(diff));
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+		nhash[b] = bits;
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	/*
-	 * Sum together all values in this workgroup column with the same ID.
-	 */
-	for (int i = 1; i < h; i <<= 1) {
-		const int	wi = w * i;
-
-		if (((y & i) == 0) && (y + i < h) && ids[p + wi] == id) {
-			t = temp[p + wi];
-			ids[p + wi] = -1;
-			temp[p] += t;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid != 0) {
+		return;
+	}
 
-		if (((y & i) == 0) && (y > i) && ids[p - wi] == id) {
-			t = temp[p - wi];
-			ids[p - wi] = -1;
-			temp[p] += t;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	state->ss_next = (idx + 1) % nhashes;
+	if (state->ss_filled < nhashes) {
+		state->ss_filled++;
+	}
+	if (state->ss_filled < nhashes) {
+		return;		/* not enough history yet */
 	}
 
-	if (ids[p] != -1) {
-		/*
-		 * Doing the conversion to "int" here means that we'll
-		 * be somewhat less precise than if we added together
-		 * all the values as floats and then scaled the result
-		 * to an integer.  But since we're only look at the top
-		 * few bits of the result, it doesn't really matter.
-		 * (And there isn't an atomic_add() that works with
-		 * floating-point values.)
-		 */
-		const float	res = datavec_pick(temp[p], dim);
-		const float	scaled = (res - min) / (max - min);
+	/*
+	 * Update the scores using exponential smoothing, and pick the new
+	 * winner.
+	 */
+	int	nskip = 0;
 
-		atomic_add(&result[id], (int)(scaled * 255.0));
+	for (int nh = 0; nh < nhashes - 1; nh++) {
+		score[nh] = score[nh] * fade + dist[nh] * (1 - fade);
+		if (score[nh] < score[nskip]) {
+			nskip = nh;
+		}
 	}
+	state->ss_nskip = nskip;
 }
@@ -8,8 +8,8 @@
 #include "types.h"
 
 /*
- * The image skipping engine. Should be called from a core algorithm's
- * step_and_export() routine.
+ * The image skipping engine.  datasrc.c calls this in place of the core
+ * algorithm's step_and_export() routine.
  *
  * "result" is the image2d_t that is passed to step_and_export().
  * "step" is the core algorithm's real callback for generating images.
@@ -21,4 +21,21 @@
 extern void
 skip_step(cl_mem result, int dim, float min, float max, void (*step)(cl_mem));
 
+/*
+ * Whether skip_step() has anything to do: images to skip, or an auto-skip
+ * detector to feed.  Otherwise the core can be stepped directly.
+ */
+extern bool
+skip_active(void);
+
+/*
+ * If the image skipping parameter is set to a fixed count, rather than
+ * auto-detecting, return that count; otherwise, return 0.  A core that can
+ * make several images in a row more cheaply than one at a time can use this
+ * instead of skip_step(), since nothing needs to look at the skipped ones;
+ * it sets "skips" in its core_ops_t to say so.
+ */
+extern int
+skip_fixed(void);
+
 #endif	/* _SKIP_H */
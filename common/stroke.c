@@ -8,6 +8,13 @@
  *
  * As described in the paper, we get nicer results if we break down larger
  * movements into a series of smaller ones (referred to here as "segments").
+ * All of the pending segments, up to STROKE_MAX_BATCH of them, are handed
+ * to the kernel at once, so a fast mouse movement costs one image pass
+ * rather than one per segment.
+ *
+ * Each stroke is stamped with the time the mouse movement came in, and the
+ * time from then until the first image showing it is swapped onto the
+ * screen is charged to the "latency" telemetry stage.
  */
 #include <stdlib.h>
 #include <strings.h>
@@ -21,11 +28,27 @@
 #include "opencl.h"
 #include "osdep.h"
 #include "param.h"
+#include "session.h"
 #include "stroke.h"
+#include "telemetry.h"
 #include "util.h"
 
 /* ------------------------------------------------------------------ */
 
+#define	STROKE_MAX_BATCH	64	/* max segments per kernel launch */
+
+/*
+ * Pixels that a stroke would move by less than this fraction of a pixel are
+ * left alone.
+ */
+#define	STROKE_EPSILON		0.25f
+
+/*
+ * With stroke_set_priority(), core steps are held off until the mouse has
+ * been still for this long.
+ */
+#define	STROKE_HOLD		200000000LL	/* nsec */
+
 /*
  * Data describing a single linear movement.
  */
@@ -36,6 +59,7 @@ typedef struct stroke {
 	pix_t		ny;
 	int		nsegs_done;	/* number of segments stroked */
 	int		nsegs_total;	/* number of segments to stroke */
+	hrtime_t	added;		/* when the mouse moved */
 
 	struct stroke	*next;
 	struct stroke	*prev;
@@ -45,8 +69,14 @@ static struct {
 	stroke_t	strokes;	/* head of linked list */
 
 	kernel_data_t	kernel;
+	cl_int4		*segs_cpu;	/* from host_alloc() */
+	cl_mem		segs;		/* segments for the kernel */
 
 	param_id_t	viscid;		/* Viscosity parameter ID */
+
+	hrtime_t	applied;	/* oldest stroke not shown yet */
+	hrtime_t	last;		/* latest stroke_add() */
+	bool		priority;	/* see stroke_set_priority() */
 } Stroke;
 
 /* ------------------------------------------------------------------ */
@@ -88,6 +118,9 @@ stroke_init(void)
 	Stroke.strokes.next = Stroke.strokes.prev = &Stroke.strokes;
 
 	kernel_create(&Stroke.kernel, "stroke");
+
+	Stroke.segs_cpu = host_alloc(STROKE_MAX_BATCH * sizeof (cl_int4));
+	Stroke.segs = buffer_alloc(STROKE_MAX_BATCH * sizeof (cl_int4));
 }
 
 static void
@@ -100,6 +133,9 @@ stroke_fini(void)
 		mem_free((void **)&s);
 	}
 
+	buffer_free(&Stroke.segs);
+	host_free((void **)&Stroke.segs_cpu);
+
 	kernel_cleanup(&Stroke.kernel);
 }
 
@@ -111,6 +147,41 @@ const module_ops_t	stroke_ops = {
 
 /* ------------------------------------------------------------------ */
 
+void
+stroke_set_priority(bool priority)
+{
+	Stroke.priority = priority;
+}
+
+bool
+stroke_holding(void)
+{
+	return (Stroke.priority && Stroke.last != 0 &&
+	    gethrtime() - Stroke.last < STROKE_HOLD);
+}
+
+hrtime_t
+stroke_applied(void)
+{
+	const hrtime_t	applied = Stroke.applied;
+
+	Stroke.applied = 0;
+	return (applied);
+}
+
+void
+stroke_shown(hrtime_t applied)
+{
+	if (applied == 0) {
+		return;
+	}
+	debug(DB_STROKE, "Stroke shown %.1f msec after the mouse moved\n",
+	    (double)(gethrtime() - applied) / 1000000.0);
+	if (telemetry_start() != 0) {
+		telemetry_stop(TM_LATENCY, applied);
+	}
+}
+
 /*
  * Is there at least one stroke pending?
  */
@@ -148,12 +219,7 @@ stroke_nsegs(pix_t ox, pix_t oy, pix_t nx, pix_t ny)
 	 */
 	const int	nsegs = ((int)ceilf((len * 2.0) / stroke_viscosity()));
 
-	/*
-	 * Low viscosities yield large segment counts, and those can take a
-	 * while to render. This is an attempt to balance getting a smooth
-	 * stroke against getting closer to real-time response.
-	 */
-	return (MIN(nsegs, 20));
+	return (MAX(nsegs, 1));
 }
 
 /*
@@ -173,6 +239,8 @@ stroke_add(pix_t ox, pix_t oy, pix_t nx, pix_t ny)
 		    "[ %4zu, %4zu ] -> [ %4zu, %4zu ]\n", ox, oy, nx, ny);
 		return;
 	}
+	session_stroke(ox, oy, nx, ny);
+	Stroke.last = gethrtime();
 
 	/*
 	 * If there is already at least one stroke pending that we haven't
@@ -215,6 +283,7 @@ stroke_add(pix_t ox, pix_t oy, pix_t nx, pix_t ny)
 	s->ny = ny;
 	s->nsegs_done = 0;
 	s->nsegs_total = stroke_nsegs(ox, oy, nx, ny);
+	s->added = Stroke.last;
 
 	s->next = &Stroke.strokes;
 	s->prev = Stroke.strokes.prev;
@@ -223,37 +292,169 @@ stroke_add(pix_t ox, pix_t oy, pix_t nx, pix_t ny)
 }
 
 /*
- * Fetch a piece of work to do.
+ * Fetch up to "max" segments of work to do, in order, into "segs".
+ * Returns the number of segments fetched.
  */
-static void
-stroke_fetch(pix_t *oxp, pix_t *oyp, pix_t *nxp, pix_t *nyp)
+static int
+stroke_fetch(cl_int4 *segs, int max)
 {
-	stroke_t	*s = Stroke.strokes.next;
-	const spix_t	dx = s->nx - s->ox;
-	const spix_t	dy = s->ny - s->oy;
-	const int	done = s->nsegs_done;
-	const int	total = s->nsegs_total;
+	int	n;
 
 	assert(stroke_pending());
-	assert(done < total);
+
+	for (n = 0; n < max && stroke_pending(); n++) {
+		stroke_t	*s = Stroke.strokes.next;
+		const spix_t	dx = s->nx - s->ox;
+		const spix_t	dy = s->ny - s->oy;
+		const int	done = s->nsegs_done;
+		const int	total = s->nsegs_total;
+
+		assert(done < total);
+		if (Stroke.applied == 0 || s->added < Stroke.applied) {
+			Stroke.applied = s->added;
+		}
+
+		/*
+		 * Pick the next segment of the current stroke.
+		 */
+		segs[n].s[0] = s->ox + (dx * done) / total;
+		segs[n].s[1] = s->oy + (dy * done) / total;
+		segs[n].s[2] = s->ox + (dx * (done + 1)) / total;
+		segs[n].s[3] = s->oy + (dy * (done + 1)) / total;
+
+		s->nsegs_done++;
+		if (s->nsegs_done == s->nsegs_total) {
+			s->next->prev = s->prev;
+			s->prev->next = s->next;
+			mem_free((void **)&s);
+		}
+
+		debug(DB_STROKE, "Stroke: [ %4d, %4d ] -> [ %4d, %4d ] "
+		    "[%d/%d]\n", segs[n].s[0], segs[n].s[1],
+		    segs[n].s[2], segs[n].s[3], done + 1, total);
+	}
+
+	return (n);
+}
+
+/*
+ * Figure out which part of the image a batch of segments could affect.
+ * The range in X is returned as ["x0", "x0" + "w"), and likewise in Y;
+ * "x0" and "y0" may be negative, or the ranges may run past the far edges
+ * of the image, in which case they wrap around.
+ */
+static void
+stroke_bounds(const cl_int4 *segs, int nsegs, float L,
+    spix_t *x0p, spix_t *y0p, pix_t *wp, pix_t *hp)
+{
+	const float	eps = STROKE_EPSILON / (float)MAX(Width, Height);
+	spix_t		xmin, xmax, ymin, ymax;
+	spix_t		mx, my;
+	float		lambda, r;
+
+	xmin = xmax = segs[0].s[0];
+	ymin = ymax = segs[0].s[1];
+	lambda = 0.0f;
+	for (int i = 0; i < nsegs; i++) {
+		const float	dx = (float)(segs[i].s[2] - segs[i].s[0]) /
+				    (float)Width;
+		const float	dy = (float)(segs[i].s[3] - segs[i].s[1]) /
+				    (float)Height;
+
+		for (int e = 0; e < 4; e += 2) {
+			xmin = MIN(xmin, segs[i].s[e]);
+			xmax = MAX(xmax, segs[i].s[e]);
+			ymin = MIN(ymin, segs[i].s[e + 1]);
+			ymax = MAX(ymax, segs[i].s[e + 1]);
+		}
+		lambda += sqrtf(dx * dx + dy * dy);
+	}
 
 	/*
-	 * Pick the next segment of the current stroke.
+	 * A segment of length "lambda" moves a point at distance "r" from
+	 * it by no more than about lambda * (1 + r / L) * exp(-r / L); see
+	 * stroke_delta() in stroke.cl.  The batch as a whole can't move it
+	 * any further than the sum of its segments' movements.  Find the
+	 * distance at which that falls below "eps".
 	 */
-	*oxp = s->ox + (dx * done) / total;
-	*oyp = s->oy + (dy * done) / total;
-	*nxp = s->ox + (dx * (done + 1)) / total;
-	*nyp = s->oy + (dy * (done + 1)) / total;
-
-	s->nsegs_done++;
-	if (s->nsegs_done == s->nsegs_total) {
-		s->next->prev = s->prev;
-		s->prev->next = s->next;
-		mem_free((void **)&s);
+	for (r = 0.0f; r < 1.0f; r += L / 8.0f) {
+		if (lambda * (1.0f + r / L) * expf(-r / L) < eps) {
+			break;
+		}
+	}
+
+	/*
+	 * Add an extra pixel for the linear filtering of the source image.
+	 */
+	mx = (spix_t)ceilf(r * (float)Width) + 1;
+	my = (spix_t)ceilf(r * (float)Height) + 1;
+
+	*x0p = xmin - mx;
+	*y0p = ymin - my;
+	*wp = MIN((pix_t)(xmax - xmin + 2 * mx + 1), Width);
+	*hp = MIN((pix_t)(ymax - ymin + 2 * my + 1), Height);
+	if (*wp == Width) {
+		*x0p = 0;
+	}
+	if (*hp == Height) {
+		*y0p = 0;
+	}
+}
+
+/*
+ * Split the range [x0, x0 + w), which may wrap around an edge of the image,
+ * into at most two ranges that don't.  Returns the number of ranges.
+ */
+static int
+stroke_split(spix_t x0, pix_t w, pix_t size, pix_t start[2], pix_t len[2])
+{
+	if (x0 < 0) {
+		start[0] = size + x0;
+		len[0] = -x0;
+		start[1] = 0;
+		len[1] = w + x0;
+		return (2);
+	} else if (x0 + w > size) {
+		start[0] = x0;
+		len[0] = size - x0;
+		start[1] = 0;
+		len[1] = x0 + w - size;
+		return (2);
+	} else {
+		start[0] = x0;
+		len[0] = w;
+		return (1);
 	}
+}
+
+/*
+ * Run the stroke kernel over one rectangle of the image.
+ */
+static void
+stroke_rect(cl_mem srcdata, cl_mem dstdata, int nsegs, float viscosity,
+    pix_t x, pix_t y, pix_t w, pix_t h)
+{
+	kernel_data_t	*const	kd = &Stroke.kernel;
+	size_t			global[2];
+	int			arg;
+
+	global[0] = P2ROUNDUP((size_t)w, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)h, kd->kd_maxitems[1]);
 
-	debug(DB_STROKE, "Stroke: [ %4zu, %4zu ] -> [ %4zu, %4zu ] [%d/%d]\n",
-	    *oxp, *oyp, *nxp, *nyp, done + 1, total);
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &x);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &y);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &w);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &h);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Stroke.segs);
+	kernel_setarg(kd, arg++, sizeof (int),    &nsegs);
+	kernel_setarg(kd, arg++, sizeof (float),  &viscosity);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &srcdata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &dstdata);
+
+	kernel_invoke(kd, 2, global, NULL);
 }
 
 /*
@@ -261,14 +462,22 @@ stroke_fetch(pix_t *oxp, pix_t *oyp, pix_t *nxp, pix_t *nyp)
  * each vector component in the range [0, 1].  It doesn't know anything
  * about the meaning of the data; it simply assumes that it's meaningful
  * to perform the stroke algorithm on it.
+ *
+ * A short stroke only moves the pixels near it, so usually only that part
+ * of the image gets stroked into "dstdata", and then copied back into
+ * "srcdata"; the rest of the image is left where it was.  Returns true if
+ * the result is in "dstdata", or false if it's in "srcdata".
  */
-void
+bool
 stroke_step(cl_mem srcdata, cl_mem dstdata)
 {
-	kernel_data_t	*const	kd = &Stroke.kernel;
 	float			viscosity = stroke_viscosity();
-	pix_t			ox, oy, nx, ny;
-	int			arg;
+	int			nsegs;
+	spix_t			x0, y0;
+	pix_t			w, h;
+	pix_t			xs[2], xl[2], ys[2], yl[2];
+	int			nx, ny;
+	bool			whole;
 	hrtime_t		a, b;
 
 	if (debug_enabled(DB_STROKE) && debug_enabled(DB_PERF)) {
@@ -277,28 +486,47 @@ stroke_step(cl_mem srcdata, cl_mem dstdata)
 	}
 
 	/*
-	 * Get a piece of work to do.
+	 * Get a batch of work to do.
 	 */
-	stroke_fetch(&ox, &oy, &nx, &ny);
-
-	arg = 0;
-	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &ox);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &oy);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &nx);
-	kernel_setarg(kd, arg++, sizeof (pix_t), &ny);
-	kernel_setarg(kd, arg++, sizeof (float),  &viscosity);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &srcdata);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &dstdata);
-
-	kernel_invoke(kd, 2, NULL, NULL);
+	nsegs = stroke_fetch(Stroke.segs_cpu, STROKE_MAX_BATCH);
+	buffer_writetogpu(Stroke.segs_cpu, Stroke.segs,
+	    nsegs * sizeof (cl_int4));
+
+	stroke_bounds(Stroke.segs_cpu, nsegs, viscosity, &x0, &y0, &w, &h);
+	whole = (w == Width && h == Height);
+
+	if (whole) {
+		stroke_rect(srcdata, dstdata, nsegs, viscosity,
+		    0, 0, Width, Height);
+	} else {
+		/*
+		 * Every rectangle has to be stroked before any of them get
+		 * copied back, since a rectangle's source pixels can come
+		 * from its neighbors across the edges of the image.
+		 */
+		nx = stroke_split(x0, w, Width, xs, xl);
+		ny = stroke_split(y0, h, Height, ys, yl);
+		for (int j = 0; j < ny; j++) {
+			for (int i = 0; i < nx; i++) {
+				stroke_rect(srcdata, dstdata, nsegs, viscosity,
+				    xs[i], ys[j], xl[i], yl[j]);
+			}
+		}
+		for (int j = 0; j < ny; j++) {
+			for (int i = 0; i < nx; i++) {
+				ocl_image_copy_rect(dstdata, srcdata,
+				    xs[i], ys[j], xl[i], yl[j]);
+			}
+		}
+	}
 
 	if (debug_enabled(DB_STROKE) && debug_enabled(DB_PERF)) {
 		kernel_wait();
 		b = gethrtime();
 
-		debug(DB_STROKE, "Stroke: [ %4zu, %4zu ] -> [ %4zu, %4zu ]: "
-			"%6llu usec\n", ox, oy, nx, ny, (b - a) / 1000);
+		debug(DB_STROKE, "Stroke: %d segments, %u x %u pixels: "
+		    "%6llu usec\n", nsegs, w, h, (b - a) / 1000);
 	}
+
+	return (whole);
 }
@@ -10,8 +10,8 @@
  * "Oseen Flow in Ink Marbling": https://arxiv.org/pdf/1702.02106v1.pdf
  *
  * This helper function implements the core of the algorithm; it's called
- * from stroke(), below, which normalizes the coordinates and does the
- * actual image movement.
+ * via stroke_wrapped() from stroke(), below, which normalizes the
+ * coordinates and does the actual image movement.
  *
  * The names of the variables, and the operation of the algorithm,
  * are taken directly from the paper; I won't try to summarize it.
@@ -61,25 +61,65 @@ stroke_delta(
 }
 
 /*
- * The code invoking this kernel is responsible for subdividing long strokes
- * into shorter ones, as recommended in the paper.
+ * If we only use the point "P" for calculating stroke behavior, none of the
+ * strokes "push" their contents across the edges of the screen.  This leads
+ * to weird asymmetries, since the core algorithms assume that the image
+ * wraps on all sides.
+ *
+ * So, since GPUs are ridiculously fast at doing math, we consider nine
+ * copies of the image (the original, plus copies arranged on all edges and
+ * corners), and calculate the delta that the point would get if the stroke
+ * was actually happening in each respective copy.  The vast majority of the
+ * movement that a point is going to undergo is going to come from just one
+ * copy, so adding them together is a straightforward way to combine all of
+ * the effects.
+ */
+static float2
+stroke_wrapped(
+	const float2		P,		/* in: current pixel */
+	const float2		B,		/* in: stroke start */
+	const float2		E,		/* in: stroke end */
+	const float		L)		/* in: viscosity parameter */
+{
+	return (
+		stroke_delta(P, B + (float2)(-1, -1), E + (float2)(-1, -1), L) +
+		stroke_delta(P, B + (float2)(-1,  0), E + (float2)(-1,  0), L) +
+		stroke_delta(P, B + (float2)(-1,  1), E + (float2)(-1,  1), L) +
+		stroke_delta(P, B + (float2)( 0, -1), E + (float2)( 0, -1), L) +
+		stroke_delta(P, B + (float2)( 0,  0), E + (float2)( 0,  0), L) +
+		stroke_delta(P, B + (float2)( 0,  1), E + (float2)( 0,  1), L) +
+		stroke_delta(P, B + (float2)( 1, -1), E + (float2)( 1, -1), L) +
+		stroke_delta(P, B + (float2)( 1,  0), E + (float2)( 1,  0), L) +
+		stroke_delta(P, B + (float2)( 1,  1), E + (float2)( 1,  1), L));
+}
+
+/*
+ * Apply a batch of "nsegs" stroke segments to the image at once.  Each
+ * segment is (Bx, By, Ex, Ey), in pixels.  The code invoking this kernel is
+ * responsible for subdividing long strokes into shorter ones, as
+ * recommended in the paper.
+ *
+ * This only updates the "RW" x "RH" rectangle at ("xoff", "yoff") of the
+ * destination, which is run as one work item per pixel.
  */
 __kernel void
 stroke(
 	const pix_t		W,		/* in: width of image */
 	const pix_t		H,		/* in: height of image */
-	const pix_t		Bx,		/* in: stroke start pos., X */
-	const pix_t		By,		/* in: stroke start pos., Y */
-	const pix_t		Ex,		/* in: stroke end position, X */
-	const pix_t		Ey,		/* in: stroke end position, Y */
+	const pix_t		xoff,		/* in: rectangle position, X */
+	const pix_t		yoff,		/* in: rectangle position, Y */
+	const pix_t		RW,		/* in: rectangle width */
+	const pix_t		RH,		/* in: rectangle height */
+	__constant int4		*segs,		/* in: stroke segments */
+	const int		nsegs,		/* in: number of segments */
 	const float		L,		/* in: viscosity parameter */
 	__read_only image2d_t	image,		/* in: source image */
 	__write_only image2d_t	dst)		/* out: updated image */
 {
-	const pix_t	X = get_global_id(0);
-	const pix_t	Y = get_global_id(1);
+	const pix_t	X = xoff + get_global_id(0);
+	const pix_t	Y = yoff + get_global_id(1);
 
-	if (X >= W || Y >= H) {
+	if (get_global_id(0) >= RW || get_global_id(1) >= RH) {
 		return;
 	}
 
@@ -91,38 +131,6 @@ stroke(
 #define	NORM(x,y)	\
 	(float2)(((float)(x) + 0.5) / (float)W, ((float)(y) + 0.5) / (float)H)
 
-	/*
-	 * The names of these variables are taken directly from the paper.
-	 */
-	const float2	P = NORM(X, Y);
-	const float2	B = NORM(Bx, By);
-	const float2	E = NORM(Ex, Ey);
-
-	/*
-	 * If we only use the point "P" for calculating stroke behavior,
-	 * none of the strokes "push" their contents across the edges of
-	 * the screen.  This leads to weird asymmetries, since the core
-	 * algorithms assume that the image wraps on all sides.
-	 *
-	 * So, since GPUs are ridiculously fast at doing math, we consider
-	 * nine copies of the image (the original, plus copies arranged on
-	 * all edges and corners), and calculate the delta that the point
-	 * would get if the stroke was actually happening in each respective
-	 * copy.  The vast majority of the movement that a point is going
-	 * to undergo is going to come from just one copy, so adding them
-	 * together is a straightforward way to combine all of the effects.
-	 */
-	const float2	Delta = \
-		stroke_delta(P, B + (float2)(-1, -1), E + (float2)(-1, -1), L) +
-		stroke_delta(P, B + (float2)(-1,  0), E + (float2)(-1,  0), L) +
-		stroke_delta(P, B + (float2)(-1,  1), E + (float2)(-1,  1), L) +
-		stroke_delta(P, B + (float2)( 0, -1), E + (float2)( 0, -1), L) +
-		stroke_delta(P, B + (float2)( 0,  0), E + (float2)( 0,  0), L) +
-		stroke_delta(P, B + (float2)( 0,  1), E + (float2)( 0,  1), L) +
-		stroke_delta(P, B + (float2)( 1, -1), E + (float2)( 1, -1), L) +
-		stroke_delta(P, B + (float2)( 1,  0), E + (float2)( 1,  0), L) +
-		stroke_delta(P, B + (float2)( 1,  1), E + (float2)( 1,  1), L);
-
 	/*
 	 * The point of this whole operation is to move the contents of
 	 * location P to location P + Delta.  But P + Delta is (probably) not
@@ -131,8 +139,28 @@ stroke(
 	 * way that would play nice with the parallelism that GPUs provide.
 	 * So instead, as an approximation, we move the contents of location
 	 * P - Delta *to* location P.
+	 *
+	 * With several segments, the last one moves the contents of P - Delta
+	 * to P, but those contents were moved there by the segment before it,
+	 * and so on.  So we can follow the point back through all of the
+	 * segments, from the last to the first, and only read the image
+	 * once, where the point started out.
 	 */
-	const float2	srccoord = P - Delta;
+	float2		P = NORM(X, Y);
+
+	for (int i = nsegs - 1; i >= 0; i--) {
+		/*
+		 * The names of these variables are taken directly from
+		 * the paper.
+		 */
+		const int4	seg = segs[i];
+		const float2	B = NORM(seg.x, seg.y);
+		const float2	E = NORM(seg.z, seg.w);
+
+		P -= stroke_wrapped(P, B, E, L);
+		P -= floor(P);		/* wrap back onto the image */
+	}
+
 	const sampler_t	sampler = CLK_NORMALIZED_COORDS_TRUE |
 		CLK_ADDRESS_REPEAT | CLK_FILTER_LINEAR;
 
@@ -140,5 +168,5 @@ stroke(
 	const int2	dstcoord = (int2)(X, Y);
 
 	/* Here's where the data gets moved. */
-	write_imagef(dst, dstcoord, read_imagef(image, sampler, srccoord));
+	write_imagef(dst, dstcoord, read_imagef(image, sampler, P));
 }
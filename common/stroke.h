@@ -6,6 +6,7 @@
 #define	_STROKE_H
 
 #include "types.h"
+#include "osdep.h"
 
 /*
  * Returns true if there is at least one mouse stroke pending.
@@ -22,7 +23,40 @@ stroke_add(pix_t ox, pix_t oy, pix_t nx, pix_t ny);
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * Apply a batch of pending stroke segments to the image in "srcdata".  The
+ * result is left in "dstdata" if this returns true, or in "srcdata" if it
+ * returns false.  This is called until stroke_pending() returns false.
+ */
+extern bool
+stroke_step(cl_mem srcdata, cl_mem dstdata);
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Input-to-photon latency.  stroke_applied() returns when the oldest mouse
+ * movement that has gone into an image since the last call came in, or 0
+ * if none has; once that image has been swapped onto the screen, passing
+ * the same time to stroke_shown() records how long it took.
+ */
+extern hrtime_t
+stroke_applied(void);
+
 extern void
-stroke_step(cl_mem, cl_mem);
+stroke_shown(hrtime_t applied);
+
+/*
+ * Give strokes priority over core steps ("-m").  A core step can take
+ * longer than several display frames, and the GPU can't be interrupted in
+ * the middle of one; so while the mouse is drawing, and for a little while
+ * after, stroke_holding() returns true, and the window doesn't start any
+ * images except the ones that strokes ask for.  That keeps the queue clear
+ * for the strokes, so each one shows up in the next display frame.
+ */
+extern void
+stroke_set_priority(bool priority);
+
+extern bool
+stroke_holding(void);
 
 #endif	/* _STROKE_H */
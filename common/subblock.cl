@@ -262,8 +262,8 @@ __kernel void
 subblock_box_1d(
 	const pix_t		W,		/* in: actual width */
 	const pix_t		H,		/* in: actual height */
-	__global boxvector	*in,
-	__global boxvector	*out,
+	__global boxstore	*in,
+	__global boxstore	*out,
 	__local boxvector	*temp,
 	const pix_t		r,
 	__global const subblock_params_t *params) /* in: parameters */
@@ -293,7 +293,8 @@ subblock_box_1d(
 
 	const float	scale = (2 * r + 1);	// scale factor for accum
 
-	__global boxvector	*inrow;
+	const pix_t		inrow =		// start of our row in "in"
+	    PIXEL(0, Y, W);
 	__local boxvector	*temprow;
 	boxvector		accum;
 	spix_t			i;
@@ -303,10 +304,9 @@ subblock_box_1d(
 	 */
 	accum = 0;
 	temprow = &temp[y * w];
-	inrow = &in[PIXEL(X, Y, W)];
 	if (inbounds) {
 		for (i = 0; i < (spix_t)bw; i++) {
-			accum += inrow[i];
+			accum += load_boxvector(in, inrow + X + i);
 		}
 	}
 	temprow[x] = accum;
@@ -329,16 +329,17 @@ subblock_box_1d(
 	 */
 	if (inbounds && ((lpix | rpix) != 0)) {
 		spix_t	offset;
-		inrow = &in[PIXEL(0, Y, W)];
 
 		offset = X - r;
 		for (i = 0; i < lpix; i++) {
-			accum += inrow[WRAP(offset + i, W)];
+			accum += load_boxvector(in,
+			    inrow + WRAP(offset + i, W));
 		}
 
 		offset = X + r - rpix;
 		for (i = 0; i < rpix; i++) {
-			accum += inrow[WRAP(offset + i, W)];
+			accum += load_boxvector(in,
+			    inrow + WRAP(offset + i, W));
 		}
 	}
 
@@ -352,12 +353,11 @@ subblock_box_1d(
 	 * "if"-tests after the first barrier keep the small blocks from doing
 	 * a final (improper) store.
 	 */
-	inrow = &in[PIXEL(0, Y, W)];
 	for (i = 0; i < (spix_t)(rawbw + 1); i++) {
 		if (inbounds) {
-			accum += inrow[WRAP(X + i + r, W)];
+			accum += load_boxvector(in, inrow + WRAP(X + i + r, W));
 			temp[PIXEL(y, x, h)] = accum / scale;
-			accum -= inrow[WRAP(X + i - r, W)];
+			accum -= load_boxvector(in, inrow + WRAP(X + i - r, W));
 		}
 
 		barrier(CLK_LOCAL_MEM_FENCE);
@@ -407,12 +407,12 @@ subblock_box_1d(
 			const pix_t	ybase =
 			    y * rawbw + min(y, (pix_t)overflow);
 
-			out[PIXEL((Y - y) + x, ybase + i, H)] =
-			    temp[PIXEL(x, y, w)];
+			store_boxvector(temp[PIXEL(x, y, w)],
+			    out, PIXEL((Y - y) + x, ybase + i, H));
 		} else if (inbounds &&			// slow store
 		    (i < (spix_t)rawbw || x < overflow)) {
-			out[PIXEL((Y - y) + y, X + i, H)] =
-			    temp[PIXEL(y, x, h)];
+			store_boxvector(temp[PIXEL(y, x, h)],
+			    out, PIXEL((Y - y) + y, X + i, H));
 		}
 
 		barrier(CLK_LOCAL_MEM_FENCE);
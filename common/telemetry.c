@@ -0,0 +1,447 @@
+/*
+ * telemetry.c - per-stage frame timing, with rolling percentiles.
+ *
+ * The DB_PERF output prints a line of raw numbers per frame, which is fine
+ * for watching but hard to trend.  This keeps a ring of recent times for
+ * each stage instead, and once a second boils each ring down to a few
+ * percentiles.  The summary goes to the terminal when the 't' debug area
+ * is on, and to the file given with -J as one JSON object per line:
+ *
+ *	{"time":12.003,"frames":60,"fps":59.94,"stages":{
+ *	    "step":{"n":256,"p50":4.102,"p95":4.870,"p99":5.311}, ...}}
+ *
+ * All times are in milliseconds.  Only the stages that were charged since
+ * the last line are included.
+ *
+ * Recording a stage is a gethrtime() call at either end and a store; the
+ * sorting is only done once a second, so this is cheap enough to leave on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "debug.h"
+#include "module.h"
+#include "opencl.h"
+#include "telemetry.h"
+#include "util.h"
+
+/*
+ * How often to report, and the longest gap between frames that still
+ * counts as idle time rather than a pause.
+ */
+#define	TELEMETRY_PERIOD	1000000000LL
+
+typedef struct {
+	float		ts_ring[TELEMETRY_FRAMES];	/* ms, per frame */
+	int		ts_n;		/* valid entries in ts_ring[] */
+	int		ts_next;	/* where the next one goes */
+	hrtime_t	ts_cur;		/* time charged this frame */
+	float		ts_last;	/* last frame's, or -1 */
+	bool		ts_touched;	/* charged this frame? */
+	bool		ts_fresh;	/* charged since the last report? */
+	float		*ts_rec;	/* see telemetry_record() */
+	int		ts_nrec;
+} tm_series_t;
+
+static const char	*Stage_names[TM_NSTAGES] = {
+	"step",
+	"core",
+	"blur",
+	"combine",
+	"render",
+	"heatmap",
+	"interp",
+	"skip",
+	"present",
+	"handoff",
+	"idle",
+	"frame",
+	"latency"
+};
+
+static struct {
+	const char	*path;		/* from telemetry_file() */
+	FILE		*fp;		/* the open file, if any */
+
+	tm_series_t	stages[TM_NSTAGES];
+	tm_series_t	scales[TELEMETRY_NSCALES];
+
+	hrtime_t	epoch;		/* when the first frame started */
+	hrtime_t	frame_start;	/* start of this frame, or 0 */
+	hrtime_t	frame_end;	/* end of the last frame */
+	hrtime_t	report_time;	/* when the last report was made */
+	int		frames;		/* frames since then */
+	int		maxrec;		/* frames to record, or 0 */
+	bool		wanted;		/* see telemetry_enable() */
+	bool		sync;		/* see telemetry_sync() */
+} Telemetry;
+
+/* ------------------------------------------------------------------ */
+
+void
+telemetry_file(const char *path)
+{
+	Telemetry.path = path;
+}
+
+void
+telemetry_enable(void)
+{
+	Telemetry.wanted = true;
+}
+
+static bool
+telemetry_on(void)
+{
+	return (Telemetry.fp != NULL || Telemetry.maxrec != 0 ||
+	    Telemetry.wanted || debug_enabled(DB_TELEM));
+}
+
+void
+telemetry_sync(bool sync)
+{
+	Telemetry.sync = sync;
+}
+
+hrtime_t
+telemetry_start(void)
+{
+	if (!telemetry_on()) {
+		return (0);
+	}
+	if (Telemetry.sync) {
+		kernel_wait();
+	}
+	return (gethrtime());
+}
+
+static void
+telemetry_charge(tm_series_t *ts, hrtime_t start)
+{
+	if (start == 0) {
+		return;
+	}
+	if (Telemetry.sync) {
+		kernel_wait();
+	}
+	ts->ts_cur += gethrtime() - start;
+	ts->ts_touched = true;
+}
+
+void
+telemetry_stop(telemetry_stage_t stage, hrtime_t start)
+{
+	telemetry_charge(&Telemetry.stages[stage], start);
+}
+
+void
+telemetry_stop_scale(int sc, hrtime_t start)
+{
+	if (sc < TELEMETRY_NSCALES) {
+		telemetry_charge(&Telemetry.scales[sc], start);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static int
+telemetry_cmp(const void *a, const void *b)
+{
+	const float	fa = *(const float *)a;
+	const float	fb = *(const float *)b;
+
+	return ((fa > fb) - (fa < fb));
+}
+
+/*
+ * Find the 50th, 95th, and 99th percentiles of the "n" values in "vals",
+ * by nearest rank.  This sorts "vals".
+ */
+static void
+telemetry_percentiles(float *vals, int n, float pct[3])
+{
+	static const float	q[3] = { 0.50f, 0.95f, 0.99f };
+
+	qsort(vals, n, sizeof (float), telemetry_cmp);
+
+	for (int i = 0; i < 3; i++) {
+		int	rank = (int)(q[i] * n + 0.999f);
+
+		pct[i] = vals[MAX(rank, 1) - 1];
+	}
+}
+
+static void
+telemetry_report_one(tm_series_t *ts, const char *name, bool *firstp)
+{
+	float	sorted[TELEMETRY_FRAMES];
+	float	pct[3];
+
+	if (!ts->ts_fresh || ts->ts_n == 0) {
+		return;
+	}
+	ts->ts_fresh = false;
+	(void) memcpy(sorted, ts->ts_ring, ts->ts_n * sizeof (float));
+	telemetry_percentiles(sorted, ts->ts_n, pct);
+
+	debug(DB_TELEM, "  %-10s p50 %7.2f  p95 %7.2f  p99 %7.2f ms\n",
+	    name, pct[0], pct[1], pct[2]);
+
+	if (Telemetry.fp != NULL) {
+		(void) fprintf(Telemetry.fp, "%s\"%s\":{\"n\":%d,"
+		    "\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f}",
+		    *firstp ? "" : ",", name, ts->ts_n,
+		    pct[0], pct[1], pct[2]);
+	}
+	*firstp = false;
+}
+
+static void
+telemetry_report(hrtime_t now)
+{
+	const double	elapsed = (double)(now - Telemetry.report_time);
+	const double	fps = Telemetry.frames * 1e9 / elapsed;
+	bool		first = true;
+	char		name[16];
+
+	debug(DB_TELEM, "telemetry: %.2f fps over %d frames\n",
+	    fps, Telemetry.frames);
+	if (Telemetry.fp != NULL) {
+		(void) fprintf(Telemetry.fp, "{\"time\":%.3f,\"frames\":%d,"
+		    "\"fps\":%.2f,\"stages\":{",
+		    (double)(now - Telemetry.epoch) / 1e9, Telemetry.frames,
+		    fps);
+	}
+
+	for (int st = 0; st < TM_NSTAGES; st++) {
+		telemetry_report_one(&Telemetry.stages[st], Stage_names[st],
+		    &first);
+	}
+	for (int sc = 0; sc < TELEMETRY_NSCALES; sc++) {
+		(void) snprintf(name, sizeof (name), "blur.%d", sc);
+		telemetry_report_one(&Telemetry.scales[sc], name, &first);
+	}
+
+	if (Telemetry.fp != NULL) {
+		(void) fprintf(Telemetry.fp, "}}\n");
+		(void) fflush(Telemetry.fp);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+void
+telemetry_frame_start(void)
+{
+	const hrtime_t	now = telemetry_start();
+
+	if (now == 0) {
+		return;
+	}
+
+	/*
+	 * After a pause, or after telemetry was turned back on, start a new
+	 * reporting period rather than counting the gap.
+	 */
+	if (Telemetry.frame_end != 0 &&
+	    now - Telemetry.frame_end < TELEMETRY_PERIOD) {
+		telemetry_stop(TM_IDLE, Telemetry.frame_end);
+	} else {
+		Telemetry.report_time = now;
+		Telemetry.frames = 0;
+	}
+	if (Telemetry.epoch == 0) {
+		Telemetry.epoch = now;
+	}
+	Telemetry.frame_start = now;
+}
+
+static void
+telemetry_push(tm_series_t *ts)
+{
+	if (!ts->ts_touched) {
+		ts->ts_last = -1;
+		return;
+	}
+	ts->ts_ring[ts->ts_next] = (float)ts->ts_cur / 1000000.0f;
+	ts->ts_last = ts->ts_ring[ts->ts_next];
+	if (ts->ts_rec != NULL && ts->ts_nrec < Telemetry.maxrec) {
+		ts->ts_rec[ts->ts_nrec++] = ts->ts_ring[ts->ts_next];
+	}
+	ts->ts_next = (ts->ts_next + 1) % TELEMETRY_FRAMES;
+	ts->ts_n = MIN(ts->ts_n + 1, TELEMETRY_FRAMES);
+	ts->ts_cur = 0;
+	ts->ts_touched = false;
+	ts->ts_fresh = true;
+}
+
+void
+telemetry_frame_end(void)
+{
+	hrtime_t	now;
+
+	if (Telemetry.frame_start == 0) {
+		return;
+	}
+	telemetry_stop(TM_FRAME, Telemetry.frame_start);
+	Telemetry.frame_start = 0;
+
+	for (int st = 0; st < TM_NSTAGES; st++) {
+		telemetry_push(&Telemetry.stages[st]);
+	}
+	for (int sc = 0; sc < TELEMETRY_NSCALES; sc++) {
+		telemetry_push(&Telemetry.scales[sc]);
+	}
+
+	now = gethrtime();
+	Telemetry.frame_end = now;
+	Telemetry.frames++;
+	if (now - Telemetry.report_time >= TELEMETRY_PERIOD) {
+		telemetry_report(now);
+		Telemetry.report_time = now;
+		Telemetry.frames = 0;
+	}
+}
+
+double
+telemetry_last(telemetry_stage_t stage)
+{
+	const tm_series_t	*ts = &Telemetry.stages[stage];
+
+	return (ts->ts_n == 0 ? -1 : ts->ts_last);
+}
+
+/* ------------------------------------------------------------------ */
+
+void
+telemetry_record(int nframes)
+{
+	const size_t	sz = nframes * sizeof (float);
+
+	for (int st = 0; st < TM_NSTAGES; st++) {
+		Telemetry.stages[st].ts_rec = mem_alloc(sz);
+		Telemetry.stages[st].ts_nrec = 0;
+	}
+	for (int sc = 0; sc < TELEMETRY_NSCALES; sc++) {
+		Telemetry.scales[sc].ts_rec = mem_alloc(sz);
+		Telemetry.scales[sc].ts_nrec = 0;
+	}
+	Telemetry.maxrec = nframes;
+}
+
+static double
+telemetry_mean(const tm_series_t *ts)
+{
+	double	sum;
+
+	if (ts->ts_nrec == 0) {
+		return (0);
+	}
+	sum = 0;
+	for (int i = 0; i < ts->ts_nrec; i++) {
+		sum += ts->ts_rec[i];
+	}
+	return (sum / ts->ts_nrec);
+}
+
+double
+telemetry_record_mean(telemetry_stage_t stage)
+{
+	return (telemetry_mean(&Telemetry.stages[stage]));
+}
+
+static void
+telemetry_record_one(FILE *fp, tm_series_t *ts, const char *name,
+    bool *firstp)
+{
+	const int	n = ts->ts_nrec;
+	const double	mean = telemetry_mean(ts);
+	float		pct[3];
+
+	if (n == 0) {
+		return;
+	}
+	telemetry_percentiles(ts->ts_rec, n, pct);
+
+	(void) fprintf(fp, "%s\"%s\":{\"n\":%d,\"mean\":%.3f,\"min\":%.3f,"
+	    "\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+	    *firstp ? "" : ",", name, n, mean, ts->ts_rec[0],
+	    pct[0], pct[1], pct[2], ts->ts_rec[n - 1]);
+	*firstp = false;
+}
+
+void
+telemetry_record_write(FILE *fp)
+{
+	bool	first = true;
+	char	name[16];
+
+	(void) fprintf(fp, "{");
+	for (int st = 0; st < TM_NSTAGES; st++) {
+		telemetry_record_one(fp, &Telemetry.stages[st],
+		    Stage_names[st], &first);
+	}
+	for (int sc = 0; sc < TELEMETRY_NSCALES; sc++) {
+		(void) snprintf(name, sizeof (name), "blur.%d", sc);
+		telemetry_record_one(fp, &Telemetry.scales[sc], name, &first);
+	}
+	(void) fprintf(fp, "}");
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+telemetry_preinit(void)
+{
+	debug_register_toggle('t', "frame telemetry", DB_TELEM, NULL);
+}
+
+static void
+telemetry_init(void)
+{
+	if (Telemetry.path == NULL) {
+		return;
+	}
+	if ((Telemetry.fp = fopen(Telemetry.path, "a")) == NULL) {
+		warn("Couldn't open telemetry file \"%s\"", Telemetry.path);
+	}
+}
+
+static void
+telemetry_fini(void)
+{
+	if (Telemetry.fp != NULL) {
+		(void) fclose(Telemetry.fp);
+		Telemetry.fp = NULL;
+	}
+}
+
+/*
+ * The recorded frames have to last across resizes, so they're only freed
+ * at the very end.
+ */
+static void
+telemetry_postfini(void)
+{
+	for (int st = 0; st < TM_NSTAGES; st++) {
+		if (Telemetry.stages[st].ts_rec != NULL) {
+			mem_free((void **)&Telemetry.stages[st].ts_rec);
+		}
+	}
+	for (int sc = 0; sc < TELEMETRY_NSCALES; sc++) {
+		if (Telemetry.scales[sc].ts_rec != NULL) {
+			mem_free((void **)&Telemetry.scales[sc].ts_rec);
+		}
+	}
+	Telemetry.maxrec = 0;
+}
+
+const module_ops_t	telemetry_ops = {
+	telemetry_preinit,
+	telemetry_init,
+	telemetry_fini,
+	telemetry_postfini
+};
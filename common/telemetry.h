@@ -0,0 +1,139 @@
+/*
+ * telemetry.h - interfaces for per-stage frame timing.
+ *
+ * Each stage of making a frame is timed on the host with gethrtime(), and
+ * the times for the last TELEMETRY_FRAMES frames are kept for each stage.
+ * Once a second, their median, 95th and 99th percentiles, along with the
+ * frame rate, are printed (if the 't' debug area is on) and appended to the
+ * telemetry file (if one was given) as one line of JSON.
+ *
+ * When nobody is looking at the numbers, telemetry_start() returns 0 and
+ * nothing else is done, so the calls can stay in place all the time.
+ */
+
+#ifndef	_TELEMETRY_H
+#define	_TELEMETRY_H
+
+#include <stdio.h>
+
+#include "osdep.h"
+
+/*
+ * How many frames the percentiles are taken over.
+ */
+#define	TELEMETRY_FRAMES	256
+
+/*
+ * The stages.  These are host times, so a stage that only enqueues work is
+ * cheap, and the GPU time shows up in whichever stage waits for it, unless
+ * telemetry_sync() has been called.  The
+ * blur, combine, and render stages are only filled in by the cores that
+ * wait for each of them while telemetry is on; otherwise it all goes into
+ * TM_STEP.  The stages that happen inside the step (core through skip) are
+ * counted in TM_STEP too.  TM_CORE is just the core algorithm's own calls
+ * for a regular step; the rest of a frame is the framework's overhead.
+ * TM_HANDOFF is the part of TM_PRESENT that hands the displayed textures
+ * back and forth between OpenCL and OpenGL.
+ * TM_LATENCY isn't part of a frame at all; see stroke_shown().
+ */
+typedef enum {
+	TM_STEP,		/* the core's step, and what wraps it */
+	TM_CORE,		/* the core's step_and_render() etc. */
+	TM_BLUR,		/* box blurs, all scales */
+	TM_COMBINE,		/* combining the blurs */
+	TM_RENDER,		/* turning data into an image */
+	TM_HEATMAP,		/* heatmap overlay */
+	TM_INTERP,		/* interpolating between images */
+	TM_SKIP,		/* making and analyzing skipped images */
+	TM_PRESENT,		/* compositing and swapping buffers */
+	TM_HANDOFF,		/* acquiring and releasing GL textures */
+	TM_IDLE,		/* waiting for the next frame to start */
+	TM_FRAME,		/* start of one frame to the end of it */
+	TM_LATENCY,		/* mouse movement to its image on screen */
+	TM_NSTAGES
+} telemetry_stage_t;
+
+/*
+ * The most scales whose blurs are timed one at a time.
+ */
+#define	TELEMETRY_NSCALES	16
+
+/*
+ * Append a line of JSON to "path" once a second.
+ */
+extern void
+telemetry_file(const char *path);
+
+/*
+ * Turn telemetry on for something that uses telemetry_last(), even if
+ * nothing is being reported.
+ */
+extern void
+telemetry_enable(void);
+
+/*
+ * Wait for the GPU at both ends of every stage, so that each one is charged
+ * its own GPU time, rather than just the time it took to enqueue its work.
+ * This slows everything down, so it's only for the benchmark's overhead
+ * measurement.
+ */
+extern void
+telemetry_sync(bool sync);
+
+/*
+ * Start timing something.  This returns 0 if telemetry is off, in which case
+ * the matching telemetry_stop() does nothing.
+ */
+extern hrtime_t
+telemetry_start(void);
+
+/*
+ * Charge the time since "start" to "stage", or to the blur at scale "sc".
+ * A stage can be charged more than once in a frame; the times add up.
+ */
+extern void
+telemetry_stop(telemetry_stage_t stage, hrtime_t start);
+
+extern void
+telemetry_stop_scale(int sc, hrtime_t start);
+
+/*
+ * Mark the beginning and the end of a frame.  The time from the end of one
+ * frame to the beginning of the next is TM_IDLE.
+ *
+ * In threaded mode, all of these have to be called with the window lock
+ * held.
+ */
+extern void
+telemetry_frame_start(void);
+
+extern void
+telemetry_frame_end(void);
+
+/*
+ * The time charged to "stage" in the last frame that finished, in
+ * milliseconds, or -1 if it wasn't charged.
+ */
+extern double
+telemetry_last(telemetry_stage_t stage);
+
+/*
+ * Keep every frame's times from now on, for up to "nframes" frames, rather
+ * than only the last TELEMETRY_FRAMES.  This turns telemetry on, if it
+ * wasn't already.  telemetry_record_write() writes the distribution of the
+ * recorded times for each stage to "fp" as a JSON object.
+ */
+extern void
+telemetry_record(int nframes);
+
+extern void
+telemetry_record_write(FILE *fp);
+
+/*
+ * The mean of the recorded times for "stage", in milliseconds, or 0 if it
+ * wasn't charged.
+ */
+extern double
+telemetry_record_mean(telemetry_stage_t stage);
+
+#endif	/* _TELEMETRY_H */
@@ -6,16 +6,40 @@
  *
  * Yes, it takes this much code to put a single image on the screen,
  * if I want to use up-to-date graphics coding standards.
+ *
+ * Textures can only be so big, so a large enough image gets split up into
+ * a grid of them ("tiles"), each drawn as its own pair of triangles.
+ *
+ * There can also be several copies ("sets") of the textures, which take
+ * turns being shown, so that OpenCL can fill in one set while OpenGL is
+ * still drawing another.  A fence after each set is drawn tells when it's
+ * safe to hand that set back to OpenCL.
  */
 #define	GL3_PROTOTYPES
+#include <assert.h>
+#include <string.h>
+
 #include "common.h"
 #include "gfxhdr.h"
 
 #include "debug.h"
 #include "texture.h"
 
+/*
+ * How long texture_wait() waits for a fence before checking again.
+ */
+#define	TEXTURE_WAIT_NS		(100 * 1000 * 1000)
+
 /* ------------------------------------------------------------------ */
 
+typedef struct {
+	GLuint		tt_id[TEXTURE_MAX_SETS]; /* OpenGL texture IDs */
+	pix_t		tt_x;		/* the part of the image it holds */
+	pix_t		tt_y;
+	pix_t		tt_w;
+	pix_t		tt_h;
+} texture_tile_t;
+
 static struct {
 	GLuint		program_id;	/* rendering program ID */
 
@@ -28,7 +52,11 @@ static struct {
 	GLint		vertex_loc;
 	GLint		texunit_loc;
 
-	GLuint		texture_id;	/* OpenGL texture ID */
+	texture_tile_t	tiles[TEXTURE_MAX_TILES];
+	int		ntiles;
+	int		nsets;
+	GLsync		fences[TEXTURE_MAX_SETS]; /* set last drawn */
+	bool		smooth;		/* see texture_set_smooth() */
 } Texture;
 
 /*
@@ -150,27 +178,88 @@ link_shaders(void)
 
 /* ------------------------------------------------------------------ */
 
+void
+texture_set_smooth(bool smooth)
+{
+	Texture.smooth = smooth;
+}
+
 /*
  * This is called directly by window.c, rather than via the module API.
  */
 int
-texture_init(float width_fraction, float height_fraction)
+texture_init(int nsets, float width_fraction, float height_fraction,
+    pix_t maxtile)
 {
 	/*
-	 * Data for mapping between the texture and the screen window.
-	 * It is represented as two triangles, rather than one rectangle,
-	 * because the hardware thinks of everything in terms of triangles.
+	 * Data for mapping between the textures and the screen window.
+	 * Each one is represented as two triangles, rather than one
+	 * rectangle, because the hardware thinks of everything in terms of
+	 * triangles.
 	 */
-	const float	wf = 1.0f; // was "width_fraction"
-	const float	hf = 1.0f; // was "height_fraction"
-	const GLfloat	vertices[6][2] = {
-		{ -wf,  hf }, { -wf, -hf }, {  wf, -hf },
-		{ -wf,  hf }, {  wf, -hf }, {  wf,  hf }
-	};
 	const GLfloat	texcoords[6][2] = {
 		{ 0, 0 }, { 0, 1 }, { 1, 1 },
 		{ 0, 0 }, { 1, 1 }, { 1, 0 }
 	};
+	GLfloat		vertices[TEXTURE_MAX_TILES][6][2];
+	GLfloat		tilecoords[TEXTURE_MAX_TILES][6][2];
+	GLint		maxsize;
+	pix_t		tw, th;
+	int		nx, ny;
+
+	/*
+	 * Figure out how to split up the image.
+	 */
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+	if (maxtile == 0 || maxtile > (pix_t)maxsize) {
+		maxtile = (pix_t)maxsize;
+	}
+	nx = (Width + maxtile - 1) / maxtile;
+	ny = (Height + maxtile - 1) / maxtile;
+	if (nx * ny > TEXTURE_MAX_TILES) {
+		die("A %ux%u image needs %d textures; the most is %d\n",
+		    Width, Height, nx * ny, TEXTURE_MAX_TILES);
+	}
+	tw = (Width + nx - 1) / nx;
+	th = (Height + ny - 1) / ny;
+	assert(nsets >= 1 && nsets <= TEXTURE_MAX_SETS);
+	Texture.nsets = nsets;
+
+	Texture.ntiles = 0;
+	for (int y = 0; y < ny; y++) {
+		for (int x = 0; x < nx; x++) {
+			const int	i = Texture.ntiles++;
+			texture_tile_t	*tt = &Texture.tiles[i];
+			GLfloat		x0, x1, y0, y1;
+
+			tt->tt_x = x * tw;
+			tt->tt_y = y * th;
+			tt->tt_w = MIN(tw, Width - tt->tt_x);
+			tt->tt_h = MIN(th, Height - tt->tt_y);
+
+			/*
+			 * The top of the image is at the top of the screen.
+			 */
+			x0 = -1.0f + 2.0f * (GLfloat)tt->tt_x / (GLfloat)Width;
+			x1 = -1.0f + 2.0f * (GLfloat)(tt->tt_x + tt->tt_w) /
+			    (GLfloat)Width;
+			y0 = 1.0f - 2.0f * (GLfloat)tt->tt_y / (GLfloat)Height;
+			y1 = 1.0f - 2.0f * (GLfloat)(tt->tt_y + tt->tt_h) /
+			    (GLfloat)Height;
+
+			vertices[i][0][0] = x0; vertices[i][0][1] = y0;
+			vertices[i][1][0] = x0; vertices[i][1][1] = y1;
+			vertices[i][2][0] = x1; vertices[i][2][1] = y1;
+			vertices[i][3][0] = x0; vertices[i][3][1] = y0;
+			vertices[i][4][0] = x1; vertices[i][4][1] = y1;
+			vertices[i][5][0] = x1; vertices[i][5][1] = y0;
+			memcpy(tilecoords[i], texcoords, sizeof (texcoords));
+		}
+	}
+	if (Texture.ntiles > 1) {
+		verbose(DB_WINDOW, "Showing the image as %dx%d textures\n",
+		    nx, ny);
+	}
 
 	/* Compile the GLSL programs. */
 	Texture.program_id = link_shaders();
@@ -182,27 +271,43 @@ texture_init(float width_fraction, float height_fraction)
 	/* Generate the OpenGL buffers for the texture mapping metadata. */
 	glGenBuffers(1, &Texture.vertex_buffer);
 	glBindBuffer(GL_ARRAY_BUFFER, Texture.vertex_buffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof (vertices), vertices,
-	    GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER,
+	    Texture.ntiles * sizeof (vertices[0]), vertices, GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	glGenBuffers(1, &Texture.texcoord_buffer);
 	glBindBuffer(GL_ARRAY_BUFFER, Texture.texcoord_buffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof (texcoords), texcoords,
+	glBufferData(GL_ARRAY_BUFFER,
+	    Texture.ntiles * sizeof (tilecoords[0]), tilecoords,
 	    GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	/* Generate the OpenGL texture we're using to render the data. */
-	glGenTextures(1, &Texture.texture_id);
-	glBindTexture(GL_TEXTURE_2D, Texture.texture_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-	    Width, Height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	/* Generate the OpenGL textures we're using to render the data. */
+	for (int i = 0; i < Texture.ntiles; i++) {
+		texture_tile_t	*tt = &Texture.tiles[i];
+
+		glGenTextures(nsets, tt->tt_id);
+		for (int s = 0; s < nsets; s++) {
+			glBindTexture(GL_TEXTURE_2D, tt->tt_id[s]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+			    Texture.smooth ? GL_LINEAR : GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D,
+			    GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D,
+			    GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D,
+			    GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tt->tt_w,
+			    tt->tt_h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		}
+	}
 	glBindTexture(GL_TEXTURE_2D, 0);
+	for (int s = 0; s < nsets; s++) {
+		Texture.fences[s] = NULL;
+	}
 
 	/*
-	 * Since we're only displaying one thing (our data, as a texture),
+	 * Since we're only displaying one thing (our data, as textures),
 	 * bind and enable all of our OpenGL resources now.
 	 */
 	Texture.vertex_loc = glGetAttribLocation(Texture.program_id,
@@ -217,7 +322,7 @@ texture_init(float width_fraction, float height_fraction)
 
 	/* Use our texture buffer. */
 	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, Texture.texture_id);
+	glBindTexture(GL_TEXTURE_2D, Texture.tiles[0].tt_id[0]);
 
 	/* Point the vertex shader at our vertex and texture coordinate data. */
 	glEnableVertexAttribArray(Texture.vertex_loc);
@@ -231,25 +336,72 @@ texture_init(float width_fraction, float height_fraction)
 	    2, GL_FLOAT, GL_FALSE, 0, NULL);
 
 	/* Tell the fragment shader how to find our texture. */
-	glUniform1i(Texture.texunit_loc, Texture.texture_id);
+	glUniform1i(Texture.texunit_loc, 0);
 
 	glFinish();
 
 	/*
-	 * Finally, make an OpenCL handle for this texture, and return it.
-	 * This is how the rest of the program accesses it.
+	 * The caller makes an OpenCL handle for each texture, using
+	 * texture_tile().  This is how the rest of the program accesses them.
 	 */
-	return (Texture.texture_id);
+	return (Texture.ntiles);
+}
+
+int
+texture_tile(int set, int i, pix_t *x, pix_t *y, pix_t *w, pix_t *h)
+{
+	const texture_tile_t	*tt = &Texture.tiles[i];
+
+	assert(i < Texture.ntiles && set < Texture.nsets);
+	*x = tt->tt_x;
+	*y = tt->tt_y;
+	*w = tt->tt_w;
+	*h = tt->tt_h;
+	return (tt->tt_id[set]);
 }
 
 void
-texture_render(void)
+texture_render(int set)
 {
 	/*
 	 * Everything is set up; we just need to draw the triangles.
-	 * We have 2 of them, with 3 vertices per triangle.
+	 * We have 2 of them per texture, with 3 vertices per triangle.
+	 */
+	if (Texture.ntiles == 1 && Texture.nsets == 1) {
+		glDrawArrays(GL_TRIANGLES, 0, 2 * 3);
+		return;
+	}
+	for (int i = 0; i < Texture.ntiles; i++) {
+		glBindTexture(GL_TEXTURE_2D, Texture.tiles[i].tt_id[set]);
+		glDrawArrays(GL_TRIANGLES, i * 2 * 3, 2 * 3);
+	}
+
+	/*
+	 * Note when OpenGL is done with this set.
 	 */
-	glDrawArrays(GL_TRIANGLES, 0, 2 * 3);
+	if (Texture.nsets > 1) {
+		if (Texture.fences[set] != NULL) {
+			glDeleteSync(Texture.fences[set]);
+		}
+		Texture.fences[set] =
+		    glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
+
+void
+texture_wait(int set)
+{
+	GLsync	fence = Texture.fences[set];
+
+	if (fence == NULL) {
+		return;
+	}
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+	    TEXTURE_WAIT_NS) == GL_TIMEOUT_EXPIRED) {
+		continue;
+	}
+	glDeleteSync(fence);
+	Texture.fences[set] = NULL;
 }
 
 void
@@ -263,7 +415,16 @@ texture_fini(void)
 	glDisable(GL_TEXTURE_2D);
 
 	/* Delete the objects. */
-	glDeleteTextures(1, &Texture.texture_id);
+	for (int s = 0; s < Texture.nsets; s++) {
+		if (Texture.fences[s] != NULL) {
+			glDeleteSync(Texture.fences[s]);
+			Texture.fences[s] = NULL;
+		}
+	}
+	for (int i = 0; i < Texture.ntiles; i++) {
+		glDeleteTextures(Texture.nsets, Texture.tiles[i].tt_id);
+	}
+	Texture.ntiles = 0;
 	glDeleteBuffers(1, &Texture.vertex_buffer);
 	glDeleteBuffers(1, &Texture.texcoord_buffer);
 	glDeleteVertexArrays(1, &Texture.vertex_array);
@@ -7,21 +7,55 @@
 
 #include "types.h"
 
+#define	TEXTURE_MAX_TILES	64	/* textures per image */
+#define	TEXTURE_MAX_SETS	3	/* copies of each texture */
+
 /*
- * Creates an OpenGL texture. "width_fraction" and "height_fraction" refer to
- * the ratio of the image's width and height to the screen's width and height.
+ * Magnify the image to fill the window with linear filtering, rather than
+ * showing each pixel as a block.  This takes effect at the next
+ * texture_init().
+ */
+extern void
+texture_set_smooth(bool smooth);
+
+/*
+ * Creates the OpenGL textures. "width_fraction" and "height_fraction" refer
+ * to the ratio of the image's width and height to the screen's width and
+ * height.
+ *
+ * An image that's bigger than one texture can be (or than "maxtile" on a
+ * side, if that's nonzero) is shown as a grid of textures, each covering
+ * its own part of the screen.  This returns the number of them.
+ *
+ * There are "nsets" copies of the whole grid, which can be filled in and
+ * shown in turn.
  */
 extern int
-texture_init(float width_fraction, float height_fraction);
+texture_init(int nsets, float width_fraction, float height_fraction,
+    pix_t maxtile);
+
+/*
+ * Get the ID of texture "i" in set "set", and which part of the image it
+ * shows.
+ */
+extern int
+texture_tile(int set, int i, pix_t *x, pix_t *y, pix_t *w, pix_t *h);
+
+/*
+ * Render the contents of set "set" of the textures to the screen.
+ */
+extern void
+texture_render(int set);
 
 /*
- * Render the contents of the texture to the screen.
+ * Wait until OpenGL has finished drawing set "set", the last time it was
+ * rendered, so that OpenCL can have it back.
  */
 extern void
-texture_render(void);
+texture_wait(int set);
 
 /*
- * Destroys the OpenGL texture.
+ * Destroys the OpenGL textures.
  */
 extern void
 texture_fini(void);
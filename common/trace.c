@@ -0,0 +1,253 @@
+/*
+ * trace.c - a timeline of host calls and GPU work, for finding stalls.
+ *
+ * Spans go into a ring buffer as they finish, from whichever thread they
+ * happen on; the GPU's spans are handed over by opencl.c once their events
+ * have completed.  Nothing is formatted until the trace is written out, as
+ * Chrome trace-event JSON:
+ *
+ *	{"traceEvents":[
+ *	{"name":"ms_multiscale","cat":"OpenCL","ph":"X","pid":1,"tid":1,
+ *	    "ts":1234.567,"dur":8.250}, ...
+ *	],"displayTimeUnit":"ms"}
+ *
+ * Host spans are in process 1, one thread per host thread, and filed under
+ * the description of their debug area.  GPU spans are in process 2, one
+ * thread per stream.  Times are in microseconds since tracing started.
+ */
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common.h"
+
+#include "debug.h"
+#include "module.h"
+#include "opencl.h"
+#include "trace.h"
+#include "util.h"
+
+#define	TRACE_DEFPATH	"zounds.trace.json"
+
+typedef struct {
+	const char	*te_name;
+	debug_area_t	te_area;	/* 0 for a GPU span */
+	int		te_tid;		/* host thread, or GPU stream */
+	hrtime_t	te_start;
+	hrtime_t	te_end;
+} trace_event_t;
+
+static struct {
+	const char	*path;		/* from trace_file() */
+	bool		startup;	/* start at the first trace_init() */
+	bool		on;		/* are we tracing? */
+
+	pthread_mutex_t	lock;		/* protects everything below */
+	trace_event_t	*ring;		/* TRACE_MAX spans */
+	int		next;		/* where the next one goes */
+	int		n;		/* valid spans in ring[] */
+	uint64_t	lost;		/* spans that were overwritten */
+	hrtime_t	epoch;		/* when tracing started */
+	int		nthreads;	/* host threads seen so far */
+} Trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/*
+ * Host threads are numbered from 1 in the order they first record a span.
+ */
+static __thread int	Trace_tid;
+
+/* ------------------------------------------------------------------ */
+
+void
+trace_file(const char *path)
+{
+	Trace.path = path;
+	Trace.startup = true;
+}
+
+hrtime_t
+trace_begin(void)
+{
+	return (Trace.on ? gethrtime() : 0);
+}
+
+static void
+trace_record(const char *name, debug_area_t area, int tid, hrtime_t start,
+    hrtime_t end)
+{
+	trace_event_t	*te;
+
+	pthread_mutex_lock(&Trace.lock);
+	te = &Trace.ring[Trace.next];
+	te->te_name = name;
+	te->te_area = area;
+	te->te_tid = tid;
+	te->te_start = start;
+	te->te_end = end;
+
+	Trace.next = (Trace.next + 1) % TRACE_MAX;
+	if (Trace.n < TRACE_MAX) {
+		Trace.n++;
+	} else {
+		Trace.lost++;
+	}
+	pthread_mutex_unlock(&Trace.lock);
+}
+
+void
+trace_end(debug_area_t area, const char *name, hrtime_t start)
+{
+	const hrtime_t	end = gethrtime();
+
+	if (start == 0 || !Trace.on) {
+		return;
+	}
+	if (Trace_tid == 0) {
+		pthread_mutex_lock(&Trace.lock);
+		Trace_tid = ++Trace.nthreads;
+		pthread_mutex_unlock(&Trace.lock);
+	}
+	trace_record(name, area, Trace_tid, start, end);
+}
+
+void
+trace_gpu(const char *name, int stream, hrtime_t start, hrtime_t end)
+{
+	if (Trace.on) {
+		trace_record(name, 0, stream, start, end);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+trace_write(void)
+{
+	const char	*path = Trace.path;
+	FILE		*fp;
+
+	if (path == NULL) {
+		path = TRACE_DEFPATH;
+	}
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		warn("Couldn't write trace to \"%s\"", path);
+		return;
+	}
+
+	(void) fprintf(fp, "{\"traceEvents\":[\n"
+	    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	    "\"args\":{\"name\":\"host\"}},\n"
+	    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+	    "\"args\":{\"name\":\"GPU\"}}");
+
+	pthread_mutex_lock(&Trace.lock);
+	for (int i = 0; i < Trace.n; i++) {
+		const trace_event_t	*te = &Trace.ring[
+		    (Trace.next - Trace.n + i + TRACE_MAX) % TRACE_MAX];
+
+		(void) fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\","
+		    "\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		    "\"ts\":%.3f,\"dur\":%.3f}",
+		    te->te_name,
+		    (te->te_area != 0 ? debug_area_name(te->te_area) : "GPU"),
+		    (te->te_area != 0 ? 1 : 2), te->te_tid,
+		    (double)(te->te_start - Trace.epoch) / 1000.0,
+		    (double)(te->te_end - te->te_start) / 1000.0);
+	}
+	(void) fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	note("Wrote %d trace spans to %s", Trace.n, path);
+	if (Trace.lost != 0) {
+		note(" (%llu older ones were overwritten)",
+		    (unsigned long long)Trace.lost);
+	}
+	note("\n");
+	pthread_mutex_unlock(&Trace.lock);
+
+	(void) fclose(fp);
+}
+
+static void
+trace_start(void)
+{
+	if (Trace.ring == NULL) {
+		Trace.ring = mem_alloc(TRACE_MAX * sizeof (trace_event_t));
+	}
+
+	pthread_mutex_lock(&Trace.lock);
+	Trace.next = 0;
+	Trace.n = 0;
+	Trace.lost = 0;
+	Trace.epoch = gethrtime();
+	pthread_mutex_unlock(&Trace.lock);
+
+	Trace.on = true;
+	opencl_trace_start();
+	note("Tracing started\n");
+}
+
+static void
+trace_stop(void)
+{
+	/*
+	 * Collect the GPU's spans before turning tracing off.
+	 */
+	opencl_trace_stop();
+	Trace.on = false;
+	trace_write();
+}
+
+/*
+ * Called for "D T".
+ */
+static void
+trace_toggle(void)
+{
+	if (Trace.on) {
+		trace_stop();
+	} else {
+		trace_start();
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+trace_preinit(void)
+{
+	debug_register_toggle('T', "timeline trace", 0, trace_toggle);
+}
+
+/*
+ * A resize runs module_fini() and module_init() again, and a trace should
+ * carry on through it, so it's only written out when the program exits.
+ * opencl_postfini() has handed over the GPU's last spans by then.
+ */
+static void
+trace_init(void)
+{
+	if (Trace.startup) {
+		Trace.startup = false;
+		trace_start();
+	}
+}
+
+static void
+trace_postfini(void)
+{
+	if (Trace.on) {
+		trace_stop();
+	}
+	if (Trace.ring != NULL) {
+		mem_free((void **)&Trace.ring);
+	}
+}
+
+const module_ops_t	trace_ops = {
+	trace_preinit,
+	trace_init,
+	NULL,
+	trace_postfini
+};
@@ -0,0 +1,55 @@
+/*
+ * trace.h - interfaces for recording a timeline of host calls and GPU work.
+ *
+ * While tracing is on, host calls that are bracketed by trace_begin() and
+ * trace_end() are kept in a ring buffer, along with the GPU's execution
+ * times for each kernel launch (converted to the host's clock).  When
+ * tracing stops, the ring is written out as Chrome trace-event JSON, which
+ * can be loaded into chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Tracing is toggled with "D T", or turned on from startup with "-j <file>";
+ * either way, the trace is written out when it's toggled off or when the
+ * program exits.  GPU times need a profiling queue ("-p").
+ */
+
+#ifndef	_TRACE_H
+#define	_TRACE_H
+
+#include "debug.h"
+#include "osdep.h"
+
+/*
+ * How many spans the ring holds.  Once it's full, the oldest ones are
+ * overwritten.
+ */
+#define	TRACE_MAX	65536
+
+/*
+ * Trace from startup, and write the trace to "path".  This gets called
+ * from main() before trace_preinit().
+ */
+extern void
+trace_file(const char *path);
+
+/*
+ * Start a host span.  This returns 0 if we're not tracing, in which case
+ * the matching trace_end() does nothing.
+ */
+extern hrtime_t
+trace_begin(void);
+
+/*
+ * Finish a host span named "name", which is filed under the debug area
+ * "area".  "name" has to stay valid until the trace is written.
+ */
+extern void
+trace_end(debug_area_t area, const char *name, hrtime_t start);
+
+/*
+ * Record that the GPU ran "name" on stream "stream" between host times
+ * "start" and "end".
+ */
+extern void
+trace_gpu(const char *name, int stream, hrtime_t start, hrtime_t end);
+
+#endif	/* _TRACE_H */
@@ -38,6 +38,8 @@ typedef enum {
 	BK_MANUAL,
 	BK_DIRECT,
 	BK_SUBBLOCK,
+	BK_SAT,		// summed-area table
+	BK_PACKED,	// four pixels per work item, 1-D data only
 
 	BK_NUM_KERNELS	// must be last
 } box_kernel_t;
@@ -2,7 +2,11 @@
  * util.c - utility routines used by all parts of the code.
  * These don't depend on any other part of the program.
  */
+#include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include "debug.h"
 #include "util.h"
@@ -27,3 +31,34 @@ mem_free(void **p)
 	free(*p);
 	*p = NULL;
 }
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Cached data lives in $ZOUNDS_CACHE if that's set, or ~/.zounds otherwise.
+ * None of it is precious; deleting the directory just means that things get
+ * recomputed the next time around.
+ */
+bool
+cache_path(const char *name, char *buf, size_t len)
+{
+	const char	*dir = getenv("ZOUNDS_CACHE");
+	char		dirbuf[PATH_MAX];
+
+	if (dir == NULL) {
+		const char	*home = getenv("HOME");
+
+		if (home == NULL) {
+			return (false);
+		}
+		(void) snprintf(dirbuf, sizeof (dirbuf), "%s/.zounds", home);
+		dir = dirbuf;
+	}
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		warn("Couldn't create cache directory \"%s\"", dir);
+		return (false);
+	}
+
+	return (snprintf(buf, len, "%s/%s", dir, name) < len);
+}
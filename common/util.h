@@ -20,4 +20,12 @@ mem_alloc(size_t bytes);
 extern void
 mem_free(void **p);
 
+/*
+ * Fills in "buf" with the pathname of a file called "name" in the directory
+ * used to cache data (such as tuning results) across runs, creating that
+ * directory if needed.  Returns false if there is no usable cache directory.
+ */
+extern bool
+cache_path(const char *name, char *buf, size_t len);
+
 #endif	/* _UTIL_H */
@@ -18,6 +18,19 @@
 #error	DATA_DIMENSIONS must be defined.
 #endif
 
+/*
+ * A 1-D core algorithm can also define DATA_RANDOM_MAXOF to "n" (up to 8),
+ * to have image_random() make each random data point the largest of "n"
+ * uniform random numbers rather than just one.  That's how the data used to
+ * come out of a random RGB image for the Game of Life cores, whose unrender()
+ * takes a pixel's brightness (the largest of its three color components) as
+ * its value, so the fraction of pixels that start out dead is the cube of
+ * the aliveness threshold rather than the threshold itself.
+ */
+#if	defined(DATA_RANDOM_MAXOF) && DATA_DIMENSIONS != 1
+#error	DATA_RANDOM_MAXOF only works with 1-D data.
+#endif
+
 /*
  * The data types used in the multiscale algorithm.
  */
@@ -51,6 +64,59 @@ typedef float4			datavec;
 #error	Do not know how to deal with that value of DATA_DIMENSIONS.
 #endif
 
+/*
+ * The types used for storing boxvector's and datavec's in the global
+ * buffers that the box blur and the multiscale kernels work on, along with
+ * macros to load and store them.  All arithmetic is still done on boxvector
+ * and datavec values; only the storage changes.
+ *
+ * If HALF_STORAGE is defined, these are kept as half-precision floats,
+ * which halves the memory traffic of the blur.  This uses vload_half() and
+ * friends, which don't need the cl_khr_fp16 extension.  (3-vectors use the
+ * aligned variants, so they're padded out to 4, just like float3.)
+ */
+#ifdef	HALF_STORAGE
+
+typedef half			boxstore;
+typedef half			datastore;
+
+#if	BOX_DIMENSIONS == 1
+#define	load_boxvector(p, i)		vload_half((i), (p))
+#define	store_boxvector(v, p, i)	vstore_half((v), (i), (p))
+#elif	BOX_DIMENSIONS == 2
+#define	load_boxvector(p, i)		vload_half2((i), (p))
+#define	store_boxvector(v, p, i)	vstore_half2((v), (i), (p))
+#elif	BOX_DIMENSIONS == 3
+#define	load_boxvector(p, i)		vloada_half3((i), (p))
+#define	store_boxvector(v, p, i)	vstorea_half3((v), (i), (p))
+#elif	BOX_DIMENSIONS == 4
+#define	load_boxvector(p, i)		vload_half4((i), (p))
+#define	store_boxvector(v, p, i)	vstore_half4((v), (i), (p))
+#endif
+
+#if	DATA_DIMENSIONS == 1
+#define	load_datavec(p, i)		vload_half((i), (p))
+#define	store_datavec(v, p, i)		vstore_half((v), (i), (p))
+#elif	DATA_DIMENSIONS == 3
+#define	load_datavec(p, i)		vloada_half3((i), (p))
+#define	store_datavec(v, p, i)		vstorea_half3((v), (i), (p))
+#elif	DATA_DIMENSIONS == 4
+#define	load_datavec(p, i)		vload_half4((i), (p))
+#define	store_datavec(v, p, i)		vstore_half4((v), (i), (p))
+#endif
+
+#else	/* HALF_STORAGE */
+
+typedef boxvector		boxstore;
+typedef datavec			datastore;
+
+#define	load_boxvector(p, i)		((p)[i])
+#define	store_boxvector(v, p, i)	((p)[i] = (v))
+#define	load_datavec(p, i)		((p)[i])
+#define	store_datavec(v, p, i)		((p)[i] = (v))
+
+#endif	/* HALF_STORAGE */
+
 #else					/* C types */
 
 #if	BOX_DIMENSIONS == 1
@@ -75,6 +141,19 @@ typedef cl_float4		cl_datavec;
 #error	Do not know how to deal with that value of DATA_DIMENSIONS.
 #endif
 
+/*
+ * The host-side sizes of boxstore and datastore; see above.
+ */
+#ifdef	HALF_STORAGE
+#define	HALF_VECSIZE(n)		((n) == 3 ? 4 : (n))
+typedef struct { cl_half s[HALF_VECSIZE(BOX_DIMENSIONS)]; }	cl_boxstore;
+typedef struct { cl_half s[HALF_VECSIZE(DATA_DIMENSIONS)]; }	cl_datastore;
+#undef	HALF_VECSIZE
+#else
+typedef cl_boxvector		cl_boxstore;
+typedef cl_datavec		cl_datastore;
+#endif
+
 /* Whether datavec's fit into a sphere or a cube. */
 typedef enum {
 	DATAVEC_SHAPE_SPHERE,
@@ -3,21 +3,33 @@
  * All of the GLUT interaction happens here and in osdep.c.
  */
 
+#include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "gfxhdr.h"
 
+#include "batch.h"
+#include "bench.h"
 #include "datasrc.h"
 #include "debug.h"
+#include "explore.h"
 #include "image.h"
 #include "keyboard.h"
 #include "module.h"
 #include "opencl.h"
 #include "osdep.h"
+#include "publish.h"
+#include "record.h"
+#include "session.h"
+#include "stroke.h"
+#include "telemetry.h"
 #include "texture.h"
+#include "trace.h"
 #include "window.h"
 
 /* ------------------------------------------------------------------ */
@@ -30,6 +42,37 @@
  */
 pix_t		Width, Height;		/* The thing we're computing. */
 
+/*
+ * In threaded mode, the number of images being displayed, waiting to be
+ * displayed, and being rendered.
+ */
+#define	WINDOW_NFRAMES	3
+
+/*
+ * The number of sets of textures that take turns being displayed.
+ */
+#define	WINDOW_NSETS	2
+
+/*
+ * Adaptive resolution; see window_set_fps().  Every WINDOW_ADAPT_FRAMES
+ * images, the scale goes down by a factor of WINDOW_ADAPT_STEP if images
+ * are taking more than WINDOW_ADAPT_SLOW times as long as they should, and
+ * back up if they're taking less than WINDOW_ADAPT_FAST times as long.
+ * The time per image goes roughly with the number of pixels, so one step
+ * up makes it about 1 / (0.8 * 0.8) = 1.56 times as long; that's still
+ * below WINDOW_ADAPT_SLOW, so the scale doesn't bounce back and forth.
+ */
+#define	WINDOW_ADAPT_FRAMES	30
+#define	WINDOW_ADAPT_STEP	0.8f
+#define	WINDOW_ADAPT_SLOW	1.2
+#define	WINDOW_ADAPT_FAST	0.75
+#define	WINDOW_ADAPT_MINSCALE	0.25f
+
+/*
+ * The most images that window_step() lets the GPU fall behind by.
+ */
+#define	WINDOW_MAX_INFLIGHT	3
+
 static struct {
 	pix_t	view_width;		/* Size of our view onto the image */
 	pix_t	view_height;
@@ -46,16 +89,72 @@ static struct {
 	time_t	last_period_save;	/* If save_period, when last done */
 	float	scale;			/* View-to-image scale factor */
 
-	cl_mem	gl_image;		/* The image for display. */
+	/*
+	 * Adaptive resolution; see window_set_fps().
+	 */
+	float		target_fps;	/* 0 if the scale is fixed */
+	float		max_scale;	/* the scale we were asked for */
+	hrtime_t	last_frame;	/* when the last image was finished */
+	double		frame_time;	/* moving average, in ns */
+	int		adapt_frames;	/* images since the last decision */
+
+	cl_mem	gl_image;		/* The image being rendered into. */
+
+	/*
+	 * The textures come in WINDOW_NSETS sets, which take turns being
+	 * displayed: OpenCL holds set "set", while OpenGL may still be
+	 * drawing the others.  If the image fits in one texture, gl_image is
+	 * the current set's texture (and ntiles is 0).  Otherwise, gl_image
+	 * is an ordinary OpenCL image, and it's copied into the current set's
+	 * tiles for display.
+	 */
+	cl_mem	direct[WINDOW_NSETS];
+	cl_mem	tiles[WINDOW_NSETS][TEXTURE_MAX_TILES];
+	int	ntiles;
+	int	set;
+	pix_t	tilesize;		/* most pixels per tile side */
 
 	float	width_fraction;		/* What magnification we're using */
 	float	height_fraction;
 
+	/*
+	 * Pipelining; see window_set_inflight().  pending[] holds an event
+	 * for the end of each image that may not be finished yet, oldest
+	 * first.
+	 */
+	int		inflight;	/* images allowed in flight */
+	cl_event	pending[WINDOW_MAX_INFLIGHT];
+	int		npending;
+
+	/*
+	 * Threaded mode; see window_set_threaded().  "lock" is held by
+	 * whichever thread is enqueueing OpenCL work or using any other
+	 * module's state.  The simulation renders into frames[], which
+	 * are copied into the tiles for display.
+	 */
+	bool		threaded;
+	pthread_t	sim_thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wakeup;		/* signalled on each unlock */
+	bool		display_locked;	/* display thread has "lock" */
+	bool		quit;		/* simulation thread should exit */
+	cl_mem		frames[WINDOW_NFRAMES];
+	int		front;		/* frames[] index being displayed */
+	int		ready;		/* ... newest finished */
+	int		back;		/* ... being rendered */
+	bool		fresh;		/* "ready" hasn't been shown yet */
+	hrtime_t	stroked[WINDOW_NFRAMES];	/* stroke_applied() */
+	int		generation;	/* bumped when frames[] changes */
+
+	bool	shown;			/* first image is on the screen */
+
 	void	(*keyboard_cb)(unsigned char);
 	void	(*mouse_cb)(int, int, bool);
 	void	(*motion_cb)(int, int);
 } Win;	/* X11 thinks it owns the symbol "Window", as a type. Sigh. */
 
+static void	window_adapt(void);
+
 /* ------------------------------------------------------------------ */
 
 /*
@@ -77,6 +176,38 @@ window_graphics(void)
 	return (!Win.nogfx);
 }
 
+/*
+ * The display thread's side of the lock.  These do nothing unless we're
+ * in threaded mode.
+ */
+static void
+window_lock(void)
+{
+	if (Win.threaded) {
+		pthread_mutex_lock(&Win.lock);
+		Win.display_locked = true;
+	}
+}
+
+static void
+window_unlock(void)
+{
+	if (Win.threaded) {
+		Win.display_locked = false;
+		pthread_cond_signal(&Win.wakeup);
+		pthread_mutex_unlock(&Win.lock);
+	}
+}
+
+/*
+ * The image that's on the screen (or would be, with graphics).
+ */
+static cl_mem
+window_image(void)
+{
+	return (Win.threaded ? Win.frames[Win.front] : Win.gl_image);
+}
+
 /*
  * Trigger a window update.
  */
@@ -128,7 +259,81 @@ key_f(void)
 static void
 window_save(void)
 {
-	image_save(Win.gl_image, Win.steps);
+	/*
+	 * If the image is rendered straight into the textures, the set that
+	 * OpenCL holds has an older image in it; bring it up to date.
+	 */
+	if (window_graphics() && Win.ntiles == 0 && Win.steps != 0) {
+		datasrc_rerender(Win.gl_image);
+	}
+	image_save(window_image(), Win.steps);
+}
+
+/*
+ * Save a newly finished image, add it to the video stream, publish it in
+ * shared memory, or save thumbnails from it, if we've been asked to.
+ */
+static void
+window_autosave(cl_mem image)
+{
+	publish_frame(image);
+	record_frame(image);
+	explore_frame(image, Win.steps);
+
+	if (Win.save_ongoing) {
+		image_save(image, Win.steps);
+	}
+
+	if (Win.save_period != 0) {
+		const time_t	t = time(NULL);
+		const time_t	sp = Win.save_period;
+
+		if (t / sp != Win.last_period_save / sp) {
+			Win.last_period_save = t;
+			verbose(DB_WINDOW, "Auto-save at %s", ctime(&t));
+			image_save(image, Win.steps);
+		}
+	}
+}
+
+/*
+ * Note how long it's been since the last image was finished, for
+ * window_adapt().
+ */
+static void
+window_frame_done(void)
+{
+	const hrtime_t	now = gethrtime();
+	const hrtime_t	delta = now - Win.last_frame;
+
+	if (Win.target_fps == 0) {
+		return;
+	}
+
+	/*
+	 * A long gap means that we were paused, not slow.
+	 */
+	if (Win.last_frame != 0 && delta < 1000000000LL) {
+		if (Win.frame_time == 0) {
+			Win.frame_time = (double)delta;
+		} else {
+			Win.frame_time += ((double)delta - Win.frame_time) / 8;
+		}
+		Win.adapt_frames++;
+	}
+	Win.last_frame = now;
+}
+
+/*
+ * Mark the startup timeline the first time an image reaches the screen.
+ */
+static void
+window_shown(void)
+{
+	if (!Win.shown) {
+		Win.shown = true;
+		module_mark("first image shown");
+	}
 }
 
 /*
@@ -185,70 +390,372 @@ window_stamp(const char *msg)
 	then = now;
 }
 
+/*
+ * Hand the current set of textures back and forth between OpenCL and
+ * OpenGL.
+ */
+static void
+window_cl_acquire(void)
+{
+	const hrtime_t	tm = telemetry_start();
+
+	if (Win.ntiles == 0) {
+		clgl_cl_acquire(Win.direct[Win.set]);
+	}
+	for (int i = 0; i < Win.ntiles; i++) {
+		clgl_cl_acquire(Win.tiles[Win.set][i]);
+	}
+	telemetry_stop(TM_HANDOFF, tm);
+}
+
+static void
+window_cl_release(void)
+{
+	const hrtime_t	tm = telemetry_start();
+
+	if (Win.ntiles == 0) {
+		clgl_cl_release(Win.direct[Win.set]);
+	}
+	for (int i = 0; i < Win.ntiles; i++) {
+		clgl_cl_release(Win.tiles[Win.set][i]);
+	}
+	telemetry_stop(TM_HANDOFF, tm);
+}
+
+/*
+ * In threaded mode, the textures only ever change hands on the display
+ * queue, so that they don't wait behind the simulation.
+ */
+static void
+window_display_acquire(void)
+{
+	if (Win.threaded) {
+		opencl_display_begin();
+		window_cl_acquire();
+		opencl_display_end();
+	} else {
+		window_cl_acquire();
+	}
+}
+
+static void
+window_display_release(void)
+{
+	if (Win.threaded) {
+		opencl_display_begin();
+		window_cl_release();
+		opencl_display_end();
+	} else {
+		window_cl_release();
+	}
+}
+
+/*
+ * Once the current set of textures has been handed to OpenGL to display,
+ * move on to the next one.  That was last drawn a frame or more ago, so
+ * waiting for OpenGL to be done with it rarely takes any time, and OpenCL
+ * can get going on the next image while this one is still being shown.
+ */
+static void
+window_display_next(void)
+{
+	Win.set = (Win.set + 1) % WINDOW_NSETS;
+	texture_wait(Win.set);
+	window_display_acquire();
+	if (Win.ntiles == 0) {
+		Win.gl_image = Win.direct[Win.set];
+	}
+}
+
+/*
+ * Copy each part of the image into the texture that displays it.
+ */
+static void
+window_composite(cl_mem image)
+{
+	for (int i = 0; i < Win.ntiles; i++) {
+		pix_t	x, y, w, h;
+
+		(void) texture_tile(Win.set, i, &x, &y, &w, &h);
+		ocl_image_copy_region(image, x, y, Win.tiles[Win.set][i], w, h);
+	}
+}
+
+/*
+ * Called once all of the work for an image has been enqueued.  Without
+ * pipelining, this waits for it to finish.  With pipelining, it only waits
+ * for the image from (Win.inflight - 1) steps ago, so the host can get on
+ * with the next image while the GPU is still working on this one.  Anything
+ * that reads data back, or hands an image to OpenGL, still waits for what
+ * it needs.
+ */
+static void
+window_pipeline(void)
+{
+	if (Win.inflight <= 1) {
+		kernel_wait();
+		return;
+	}
+
+	if (Win.npending == Win.inflight - 1) {
+		opencl_marker_wait(Win.pending[0]);
+		Win.npending--;
+		memmove(&Win.pending[0], &Win.pending[1],
+		    Win.npending * sizeof (Win.pending[0]));
+	}
+	Win.pending[Win.npending++] = opencl_marker();
+}
+
+/*
+ * Wait for every image that's still in flight.
+ */
+static void
+window_pipeline_drain(void)
+{
+	for (int i = 0; i < Win.npending; i++) {
+		opencl_marker_wait(Win.pending[i]);
+	}
+	Win.npending = 0;
+}
+
 /*
  * Generate a new image, and display it.
  */
 static void
 window_step(void)
 {
+	hrtime_t	tr;
+
 	// debug(DB_WINDOW, "\n");		// start of a new round
 	// window_stamp("window_step start");
 
-	if (!Win.animated && !Win.update) {
+	if ((!Win.animated || stroke_holding()) && !Win.update) {
 		return;
 	}
+	tr = trace_begin();
 
 	Win.update = false;
 	Win.steps++;
+	telemetry_frame_start();
+	session_frame_start();
+
+	/*
+	 * Hand over whatever the GPU has finished reading back since the
+	 * last frame.
+	 */
+	readback_poll();
 
 	/*
 	 * Get a new image and render it into the displayable image.
 	 */
 	datasrc_step(Win.gl_image);
+	window_pipeline();
+
+	/*
+	 * This has to happen while OpenCL still holds the image.
+	 */
+	window_autosave(Win.gl_image);
+	window_frame_done();
 
 	/*
 	 * Show the displayable image on the screen.
 	 */
 	if (window_graphics()) {
-		if (debug_enabled(DB_PERF) && Win.steps > 1) {
-			hrtime_t x;
-			x = gethrtime();
+		const hrtime_t	start = gethrtime();
+		const hrtime_t	tm = telemetry_start();
 
-			clgl_cl_release(Win.gl_image);
-			texture_render();
-			glutSwapBuffers();
-			glFinish();
-			clgl_cl_acquire(Win.gl_image);
+		window_composite(Win.gl_image);
+		window_cl_release();
+		texture_render(Win.set);
+		glutSwapBuffers();
+		stroke_shown(stroke_applied());
+		window_display_next();
+		telemetry_stop(TM_PRESENT, tm);
 
-			x = gethrtime() - x;
-			debug(DB_PERF, " + %5.2lf\n", (double)x / 1000000.0);
-		} else {
-			clgl_cl_release(Win.gl_image);
-			texture_render();
-			glutSwapBuffers();
-			clgl_cl_acquire(Win.gl_image);
+		if (debug_enabled(DB_PERF) && Win.steps > 1) {
+			debug(DB_PERF, " + %5.2lf\n",
+			    (double)(gethrtime() - start) / 1000000.0);
 		}
 	} else {
 		debug(DB_PERF, "\n");
 	}
+	window_shown();
 
-	if (Win.save_ongoing) {
-		window_save();
+	window_adapt();
+	session_frame_end();
+	telemetry_frame_end();
+	trace_end(DB_WINDOW, "window_step", tr);
+	bench_frame();
+	batch_frame(Win.gl_image);
+
+	// window_stamp("window_step end");
+}
+
+/*
+ * Wait to be woken up, in the simulation thread.  While strokes are holding
+ * off the core's steps, nothing signals the end of the hold, so check back
+ * every millisecond.
+ */
+static void
+window_sim_wait(void)
+{
+	struct timespec	ts;
+
+	if (!Win.animated) {
+		pthread_cond_wait(&Win.wakeup, &Win.lock);
+		return;
 	}
 
-	if (Win.save_period != 0) {
-		const time_t	t = time(NULL);
-		const time_t	sp = Win.save_period;
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	(void) pthread_cond_timedwait(&Win.wakeup, &Win.lock, &ts);
+}
 
-		if (t / sp != Win.last_period_save / sp) {
-			const time_t	now = time(NULL);
-			Win.last_period_save = t;
-			verbose(DB_WINDOW, "Auto-save at %s", ctime(&t));
-			window_save();
+/*
+ * The simulation thread, in threaded mode.  This does what window_step()
+ * does up to the point of displaying the image: it renders into
+ * frames[back], then swaps that with frames[ready] for window_display() to
+ * pick up.
+ *
+ * It only holds the lock while it's enqueueing work, not while the GPU is
+ * doing it, so the display and the input callbacks never have to wait for
+ * a slow step to finish.
+ */
+static void *
+window_sim(void *arg)
+{
+	pthread_mutex_lock(&Win.lock);
+	for (;;) {
+		cl_event	done;
+		int		gen, t;
+
+		while (!Win.quit && !Win.update &&
+		    (!Win.animated || stroke_holding())) {
+			window_sim_wait();
+		}
+		if (Win.quit) {
+			break;
+		}
+
+		Win.update = false;
+		Win.steps++;
+		gen = Win.generation;
+		telemetry_frame_start();
+		session_frame_start();
+
+		readback_poll();
+		datasrc_step(Win.frames[Win.back]);
+		Win.stroked[Win.back] = stroke_applied();
+		done = opencl_marker();
+
+		pthread_mutex_unlock(&Win.lock);
+		opencl_marker_wait(done);
+		pthread_mutex_lock(&Win.lock);
+
+		/*
+		 * If the window was resized in the meantime, this image
+		 * went away with the old frames[].
+		 */
+		if (gen != Win.generation) {
+			continue;
+		}
+
+		window_autosave(Win.frames[Win.back]);
+		window_frame_done();
+		session_frame_end();
+		telemetry_frame_end();
+
+		/*
+		 * If the last image never got shown, whatever strokes went
+		 * into it are first seen in this one.
+		 */
+		if (Win.fresh && Win.stroked[Win.ready] != 0 &&
+		    (Win.stroked[Win.back] == 0 ||
+		    Win.stroked[Win.ready] < Win.stroked[Win.back])) {
+			Win.stroked[Win.back] = Win.stroked[Win.ready];
 		}
+
+		t = Win.ready;
+		Win.ready = Win.back;
+		Win.back = t;
+		Win.fresh = true;
 	}
+	pthread_mutex_unlock(&Win.lock);
 
-	// window_stamp("window_step end");
+	return (NULL);
+}
+
+/*
+ * Show the newest finished image, in threaded mode.  GLUT calls this
+ * whenever it's idle, and glutSwapBuffers() paces it to the display.
+ */
+static void
+window_display(void)
+{
+	const hrtime_t	tr = trace_begin();
+	bool		fresh;
+	hrtime_t	tm = 0;
+
+	window_lock();
+	fresh = Win.fresh;
+	if (fresh) {
+		const int	t = Win.front;
+
+		tm = telemetry_start();
+
+		Win.front = Win.ready;
+		Win.ready = t;
+		Win.fresh = false;
+
+		opencl_display_begin();
+		window_composite(Win.frames[Win.front]);
+		window_cl_release();
+		opencl_display_end();
+	}
+	window_unlock();
+
+	if (!fresh) {
+		usleep(1000);	/* nothing new yet; don't spin */
+		return;
+	}
+
+	texture_render(Win.set);
+	glutSwapBuffers();
+	window_shown();
+
+	window_lock();
+	stroke_shown(Win.stroked[Win.front]);
+	Win.stroked[Win.front] = 0;
+	window_display_next();
+	window_adapt();
+	telemetry_stop(TM_PRESENT, tm);
+	window_unlock();
+	trace_end(DB_WINDOW, "window_display", tr);
+}
+
+/*
+ * Stop the simulation thread before the modules are torn down.
+ */
+static void
+window_sim_stop(void)
+{
+	if (pthread_equal(pthread_self(), Win.sim_thread)) {
+		return;		/* it's the one that's exiting */
+	}
+
+	if (!Win.display_locked) {
+		pthread_mutex_lock(&Win.lock);
+	}
+	Win.quit = true;
+	Win.display_locked = false;
+	pthread_cond_signal(&Win.wakeup);
+	pthread_mutex_unlock(&Win.lock);
+
+	(void) pthread_join(Win.sim_thread, NULL);
 }
 
 /* ------------------------------------------------------------------ */
@@ -278,7 +785,7 @@ window_preinit(void)
 	 * window_step() will be called.
 	 */
 	if (window_graphics()) {
-		glutDisplayFunc(window_step);
+		glutDisplayFunc(Win.threaded ? window_display : window_step);
 	}
 
 	debug_register_toggle('W', "window handling", DB_WINDOW, NULL);
@@ -288,14 +795,57 @@ static void
 window_init(void)
 {
 	if (window_graphics()) {
+		pix_t		maxw, maxh, x, y, w, h;
+		pix_t		maxtile;
+		int		ntiles;
+
 		/*
-		 * Create an OpenGL image of type GL_RGBA / GL_UNSIGNED_BYTE.
+		 * Create OpenGL images of type GL_RGBA / GL_UNSIGNED_BYTE.
+		 * Each one has to be usable by OpenCL as well.
 		 */
-		const int	texture_id =
-		    texture_init(Win.width_fraction, Win.height_fraction);
+		opencl_device_image2d_max(&maxw, &maxh);
+		maxtile = MIN(maxw, maxh);
+		if (Win.tilesize != 0) {
+			maxtile = MIN(maxtile, Win.tilesize);
+		}
+		ntiles = texture_init(WINDOW_NSETS, Win.width_fraction,
+		    Win.height_fraction, maxtile);
+		for (int s = 0; s < WINDOW_NSETS; s++) {
+			if (ntiles == 1 && !Win.threaded) {
+				Win.ntiles = 0;
+				Win.direct[s] = clgl_makeimage(GL_TEXTURE_2D,
+				    texture_tile(s, 0, &x, &y, &w, &h));
+				continue;
+			}
+			Win.ntiles = ntiles;
+			for (int i = 0; i < ntiles; i++) {
+				Win.tiles[s][i] = clgl_makeimage(GL_TEXTURE_2D,
+				    texture_tile(s, i, &x, &y, &w, &h));
+			}
+		}
+		Win.set = 0;
 
-		Win.gl_image = clgl_makeimage(GL_TEXTURE_2D, texture_id);
-		clgl_cl_acquire(Win.gl_image);
+		/*
+		 * Without a single shared texture, images are rendered into
+		 * ordinary OpenCL images and copied into the tiles.
+		 */
+		if (Win.threaded) {
+			for (int i = 0; i < WINDOW_NFRAMES; i++) {
+				Win.frames[i] = ocl_image_create(CL_RGBA,
+				    CL_UNORM_INT8, Width, Height);
+			}
+			Win.front = 0;
+			Win.ready = 1;
+			Win.back = 2;
+			Win.fresh = false;
+			Win.generation++;
+		} else if (Win.ntiles > 0) {
+			Win.gl_image = ocl_image_create(CL_RGBA, CL_UNORM_INT8,
+			    Width, Height);
+		} else {
+			Win.gl_image = Win.direct[Win.set];
+		}
+		window_display_acquire();
 	} else {
 		/*
 		 * Create an image that acts the same as the GL image would.
@@ -308,9 +858,27 @@ window_init(void)
 static void
 window_fini(void)
 {
+	window_pipeline_drain();
+
 	if (window_graphics()) {
-		clgl_cl_release(Win.gl_image);
-		buffer_free(&Win.gl_image);
+		window_display_release();
+		for (int s = 0; s < WINDOW_NSETS; s++) {
+			if (Win.ntiles == 0) {
+				buffer_free(&Win.direct[s]);
+			}
+			for (int i = 0; i < Win.ntiles; i++) {
+				buffer_free(&Win.tiles[s][i]);
+			}
+		}
+		if (Win.threaded) {
+			for (int i = 0; i < WINDOW_NFRAMES; i++) {
+				buffer_free(&Win.frames[i]);
+			}
+		} else if (Win.ntiles > 0) {
+			buffer_free(&Win.gl_image);
+		}
+		Win.gl_image = NULL;
+		Win.ntiles = 0;
 		texture_fini();
 	} else {
 		buffer_free(&Win.gl_image);
@@ -350,23 +918,35 @@ set_size(pix_t vw, pix_t vh)
 	Win.height_fraction = MIN((float)ih / (float)vh, 1.0f);
 }
 
+/*
+ * Change the view to "vw" x "vh", and the image to match, at Win.scale.
+ * If only the scale is changing, the view stays the same shape, so the
+ * datavec's are stretched to the new size; otherwise the RGBA image is
+ * centered in the new one, cropped or padded as needed.  The caller holds
+ * the lock.
+ */
 static void
-reshape_cb(int w, int h)
+window_resize(pix_t vw, pix_t vh, bool rescale)
 {
-	const pix_t	vw = (pix_t)w;
-	const pix_t	vh = (pix_t)h;
 	const pix_t	iw = (pix_t)((float)vw * Win.scale);
 	const pix_t	ih = (pix_t)((float)vh * Win.scale);
 	const bool	change_image = (Width != iw || Height != ih);
-
-	debug(DB_WINDOW, "reshape_cb: invoked\n");
+	float		fit;
 
 	if (change_image) {
-		debug(DB_WINDOW, "reshape_cb: preparing to resize\n");
+		debug(DB_WINDOW, "window_resize: preparing to resize\n");
 
-		if (Win.steps != 0) {
-			datasrc_rerender(Win.gl_image);
-			image_preserve(Width, Height, Win.gl_image);
+		/*
+		 * In threaded mode, the GPU may still be working on the
+		 * simulation's latest image.
+		 */
+		kernel_wait();
+
+		if (Win.steps != 0 && rescale) {
+			datasrc_preserve();
+		} else if (Win.steps != 0) {
+			datasrc_rerender(window_image());
+			image_preserve(Width, Height, window_image());
 		}
 
 		module_fini();
@@ -375,16 +955,99 @@ reshape_cb(int w, int h)
 	set_size(vw, vh);
 
 	if (change_image) {
+		if (!opencl_mem_fits(Width, Height, &fit)) {
+			warn("%ux%u images probably won't fit in GPU memory; "
+			    "try \"-S %.2f\"\n", Width, Height,
+			    Win.scale * fit);
+		}
 		module_init();
-		debug(DB_WINDOW, "reshape_cb: done resizing\n");
+		opencl_mem_report();
+		debug(DB_WINDOW, "window_resize: done resizing\n");
 	}
 
-	if (window_graphics()) {
+	if (window_graphics() && !rescale) {
 		glViewport(0, 0, Win.view_width, Win.view_height);
-		clgl_cl_release(Win.gl_image);
+		window_display_release();
 		glutSwapBuffers();
-		clgl_cl_acquire(Win.gl_image);
+		window_display_acquire();
+	}
+}
+
+/*
+ * Start over from nothing at "w" x "h", as if the program had just been
+ * started at that size: nothing from the old images is carried over.  "cb",
+ * if it's not NULL, is called while every module is torn down.  This is
+ * for batch mode, which is headless and unthreaded.
+ */
+void
+window_restart(pix_t w, pix_t h, void (*cb)(void))
+{
+	assert(!window_graphics() && !Win.threaded);
+
+	kernel_wait();
+	module_fini();
+
+	set_size(w, h);
+	if (cb != NULL) {
+		(*cb)();
 	}
+
+	module_init();
+	opencl_mem_report();
+	Win.steps = 0;
+}
+
+/*
+ * If images are coming too slowly or too quickly for the frame rate that
+ * was asked for, change the scale, and resize the image to match.  This
+ * runs on the display thread, with the lock held.
+ */
+static void
+window_adapt(void)
+{
+	double	target;
+	float	scale;
+
+	if (Win.target_fps == 0 || Win.adapt_frames < WINDOW_ADAPT_FRAMES) {
+		return;
+	}
+	Win.adapt_frames = 0;
+
+	target = 1000000000.0 / Win.target_fps;
+	scale = Win.scale;
+	if (Win.frame_time > target * WINDOW_ADAPT_SLOW) {
+		scale = MAX(scale * WINDOW_ADAPT_STEP, WINDOW_ADAPT_MINSCALE);
+	} else if (Win.frame_time < target * WINDOW_ADAPT_FAST) {
+		scale = MIN(scale / WINDOW_ADAPT_STEP, Win.max_scale);
+	}
+	if (scale == Win.scale) {
+		return;
+	}
+
+	verbose(DB_WINDOW, "%.1f fps; scale %.2f -> %.2f\n",
+	    1000000000.0 / Win.frame_time, Win.scale, scale);
+
+	Win.scale = scale;
+	window_resize(Win.view_width, Win.view_height, true);
+
+	/*
+	 * Start over, so the time spent resizing doesn't count.
+	 */
+	Win.frame_time = 0;
+	Win.last_frame = 0;
+}
+
+static void
+reshape_cb(int w, int h)
+{
+	const hrtime_t	tr = trace_begin();
+
+	debug(DB_WINDOW, "reshape_cb: invoked\n");
+
+	window_lock();
+	window_resize((pix_t)w, (pix_t)h, false);
+	window_unlock();
+	trace_end(DB_WINDOW, "reshape_cb", tr);
 }
 
 static void
@@ -399,8 +1062,13 @@ static void
 keyboard_cb(unsigned char key, int x, int y)
 {
 	if (Win.keyboard_cb) {
+		const hrtime_t	tr = trace_begin();
+
+		window_lock();
 		(*Win.keyboard_cb)(key);
+		window_unlock();
 		redisplay_cb();
+		trace_end(DB_WINDOW, "keyboard_cb", tr);
 	}
 }
 
@@ -413,13 +1081,17 @@ mouse_cb(int button, int state, int x, int y)
 		const pix_t	offset = sy * Width + sx;
 		debug(DB_WINDOW, "mouse_cb: setting debug offset to "
 		    "%7d (<x,y> = <%d,%d>)\n", offset, sx, sy);
+		window_lock();
 		debug_set_offset(offset);
+		window_unlock();
 	}
 
 	if (Win.mouse_cb && button == GLUT_LEFT_BUTTON) {
 		const int	sx = (int)(Win.scale * x);
 		const int	sy = (int)(Win.scale * y);
+		window_lock();
 		(*Win.mouse_cb)(sx, sy, state == GLUT_DOWN);
+		window_unlock();
 		redisplay_cb();
 	}
 }
@@ -431,8 +1103,13 @@ motion_cb(int x, int y)
 	if (Win.motion_cb) {
 		const int	sx = (int)(Win.scale * x);
 		const int	sy = (int)(Win.scale * y);
+		const hrtime_t	tr = trace_begin();
+
+		window_lock();
 		(*Win.motion_cb)(sx, sy);
+		window_unlock();
 		redisplay_cb();
+		trace_end(DB_WINDOW, "motion_cb", tr);
 	}
 	window_stamp("motion_cb end");
 }
@@ -443,6 +1120,49 @@ window_saveperiod(time_t period)
 	Win.save_period = period;
 }
 
+/*
+ * Run the simulation on a thread of its own, with the display showing the
+ * newest finished image at its own pace.  A slow step then doesn't hold up
+ * the display or the input callbacks.  This has to be called before the
+ * modules are initialized, and it does nothing without graphics.
+ */
+void
+window_set_threaded(bool threaded)
+{
+	if (threaded && !window_graphics()) {
+		note("threaded mode does nothing with graphics disabled\n");
+		return;
+	}
+
+	Win.threaded = threaded;
+	if (threaded) {
+		pthread_mutex_init(&Win.lock, NULL);
+		pthread_cond_init(&Win.wakeup, NULL);
+		opencl_display_enable();
+	}
+}
+
+/*
+ * Let up to "n" images be in flight at once; 1 means each image is finished
+ * before the next one is started.  This doesn't affect threaded mode, where
+ * the simulation thread waits for each image before passing it on.
+ */
+void
+window_set_inflight(int n)
+{
+	Win.inflight = MAX(1, MIN(n, WINDOW_MAX_INFLIGHT));
+}
+
+/*
+ * Show the image through textures of at most "size" pixels on a side,
+ * e.g. to drive several outputs.  0 means as big as the GPU can do.
+ */
+void
+window_set_tilesize(pix_t size)
+{
+	Win.tilesize = size;
+}
+
 float
 window_getscale(void)
 {
@@ -450,8 +1170,8 @@ window_getscale(void)
 }
 
 /*
- * Changing this dynamically would require a trip through init/fini,
- * so right now we don't do that.
+ * Changing this dynamically requires a trip through init/fini, so it's
+ * only done by window_adapt().
  */
 void
 window_setscale(float scale)
@@ -459,6 +1179,18 @@ window_setscale(float scale)
 	Win.scale = scale;
 }
 
+/*
+ * Adjust the scale as we go, to keep up "fps" images per second, but never
+ * go above the scale given to window_setscale().  The image is magnified
+ * smoothly to fill the window.
+ */
+void
+window_set_fps(float fps)
+{
+	Win.target_fps = fps;
+	texture_set_smooth(fps > 0);
+}
+
 void
 window_set_keyboard_cb(void (*cb)(unsigned char))
 {
@@ -483,6 +1215,7 @@ window_create(pix_t w, pix_t h)
 	if (Win.scale == 0) {
 		Win.scale = 1;
 	}
+	Win.max_scale = Win.scale;
 
 	/*
 	 * Need to have Win.view_width and Win.view_height set
@@ -531,6 +1264,13 @@ window_fullscreen(void)
 void
 window_mainloop(void)
 {
+	if (Win.threaded) {
+		if (pthread_create(&Win.sim_thread, NULL, window_sim, NULL)) {
+			die("Couldn't create the simulation thread");
+		}
+		atexit(window_sim_stop);
+	}
+
 	if (window_graphics()) {
 		glutIdleFunc(redisplay_cb);
 		glutReshapeFunc(reshape_cb);
@@ -59,6 +59,9 @@ window_create(pix_t, pix_t);
 extern void
 window_setscale(float);
 
+extern void
+window_set_fps(float);
+
 extern void
 window_fullscreen(void);
 
@@ -71,7 +74,23 @@ window_set_graphics(bool);
 extern void
 window_saveperiod(time_t);
 
+extern void
+window_set_tilesize(pix_t);
+
+extern void
+window_set_threaded(bool);
+
+extern void
+window_set_inflight(int);
+
 extern void
 window_mainloop(void);
 
+/*
+ * Start over at a new size, with "cb" called between tearing everything
+ * down and setting it up again.  Headless only; used by batch mode.
+ */
+extern void
+window_restart(pix_t w, pix_t h, void (*cb)(void));
+
 #endif	/* _WINDOW_H */
@@ -0,0 +1,453 @@
+/*
+ * hashlife.c - Gosper's HashLife algorithm, for jumping Life ahead by many
+ * generations at once.
+ *
+ * The state is a quadtree in which identical subtrees are only stored once,
+ * so a canvas full of repeated still lifes and oscillators takes very little
+ * space.  A node at level k is a 2^k x 2^k square of cells, and its "result"
+ * -- the central 2^(k-1) x 2^(k-1) square, some power of two generations
+ * later -- is memoized in the node itself.  That's what makes the jump
+ * cheap: every copy of a subpattern is only ever advanced once.
+ *
+ * HashLife works on the infinite plane, but the canvas is a torus.  A torus
+ * evolves exactly like the infinite plane tiled with copies of it, though, so
+ * each jump builds a quadtree over enough of that tiling to cover the whole
+ * canvas once it has been advanced.
+ */
+
+#include <string.h>
+
+#include "common.h"
+
+#include "debug.h"
+#include "hashlife.h"
+#include "util.h"
+
+#define	NONE		UINT32_MAX	/* no such node */
+#define	DEAD		0		/* the level-0 node for a dead cell */
+#define	ALIVE		1		/* ... and for a live one */
+#define	MIN_NODES	(1U << 16)	/* initial size of the node table */
+#define	MAX_NODES	(1U << 23)	/* start over if it grows past this */
+
+typedef uint32_t	node_t;
+
+typedef struct {
+	node_t		hn_quad[4];	/* NW, NE, SW, SE children */
+	node_t		hn_result;	/* memoized result, or NONE */
+	node_t		hn_next;	/* next node in this hash chain */
+	int		hn_level;	/* this is 2^level cells on a side */
+} hnode_t;
+
+/*
+ * The node last built for each aligned square of the tiling, so that building
+ * the tree doesn't have to visit every cell of every copy of the canvas.
+ */
+typedef struct {
+	uint64_t	be_key;		/* level, x, y; or 0 if unused */
+	node_t		be_node;
+} bentry_t;
+
+static struct {
+	hnode_t		*nodes;
+	node_t		nnodes;
+	node_t		maxnodes;	/* size of nodes[] and buckets[] */
+	node_t		*buckets;	/* heads of the hash chains */
+	int		step;		/* results are 2^step generations on */
+
+	bentry_t	*built;		/* open-addressed hash table */
+	size_t		nbuilt;		/* entries in use */
+	size_t		maxbuilt;	/* size of built[], a power of two */
+
+	const uint8_t	*cells;		/* the canvas being read in */
+	pix_t		width;
+	pix_t		height;
+} Hl;
+
+#define	Q(n, i)		(Hl.nodes[n].hn_quad[i])
+#define	LEVEL(n)	(Hl.nodes[n].hn_level)
+
+/* ------------------------------------------------------------------ */
+
+static uint32_t
+hl_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return ((uint32_t)h);
+}
+
+static uint32_t
+hl_hash(node_t nw, node_t ne, node_t sw, node_t se)
+{
+	return (hl_mix(((uint64_t)nw << 32 | ne) * 0x9e3779b97f4a7c15ULL ^
+	    ((uint64_t)sw << 32 | se)));
+}
+
+static void
+hl_fini(void)
+{
+	if (Hl.nodes != NULL) {
+		mem_free((void **)&Hl.nodes);
+		mem_free((void **)&Hl.buckets);
+	}
+	if (Hl.built != NULL) {
+		mem_free((void **)&Hl.built);
+	}
+}
+
+static void
+hl_reset(void)
+{
+	hl_fini();
+
+	Hl.maxnodes = MIN_NODES;
+	Hl.nodes = mem_alloc(Hl.maxnodes * sizeof (hnode_t));
+	Hl.buckets = mem_alloc(Hl.maxnodes * sizeof (node_t));
+	memset(Hl.buckets, 0xff, Hl.maxnodes * sizeof (node_t));
+
+	// The two leaves aren't in the hash table.
+	for (node_t n = DEAD; n <= ALIVE; n++) {
+		Hl.nodes[n].hn_quad[0] = Hl.nodes[n].hn_quad[1] =
+		    Hl.nodes[n].hn_quad[2] = Hl.nodes[n].hn_quad[3] = NONE;
+		Hl.nodes[n].hn_result = NONE;
+		Hl.nodes[n].hn_next = NONE;
+		Hl.nodes[n].hn_level = 0;
+	}
+	Hl.nnodes = 2;
+	Hl.step = -1;
+}
+
+/*
+ * Double the size of the node table, and rehash everything in it.
+ */
+static void
+hl_grow(void)
+{
+	const node_t	maxnodes = Hl.maxnodes * 2;
+	hnode_t		*nodes = mem_alloc(maxnodes * sizeof (hnode_t));
+
+	memcpy(nodes, Hl.nodes, Hl.nnodes * sizeof (hnode_t));
+	mem_free((void **)&Hl.nodes);
+	mem_free((void **)&Hl.buckets);
+	Hl.nodes = nodes;
+	Hl.maxnodes = maxnodes;
+
+	Hl.buckets = mem_alloc(maxnodes * sizeof (node_t));
+	memset(Hl.buckets, 0xff, maxnodes * sizeof (node_t));
+	for (node_t n = ALIVE + 1; n < Hl.nnodes; n++) {
+		const node_t	b = (maxnodes - 1) &
+				    hl_hash(Q(n, 0), Q(n, 1), Q(n, 2), Q(n, 3));
+
+		Hl.nodes[n].hn_next = Hl.buckets[b];
+		Hl.buckets[b] = n;
+	}
+}
+
+/*
+ * Find the one node with these four children, creating it if need be.
+ */
+static node_t
+hl_find(node_t nw, node_t ne, node_t sw, node_t se)
+{
+	const uint32_t	h = hl_hash(nw, ne, sw, se);
+	node_t		n;
+
+	for (n = Hl.buckets[h & (Hl.maxnodes - 1)]; n != NONE;
+	    n = Hl.nodes[n].hn_next) {
+		if (Q(n, 0) == nw && Q(n, 1) == ne &&
+		    Q(n, 2) == sw && Q(n, 3) == se) {
+			return (n);
+		}
+	}
+
+	if (Hl.nnodes == Hl.maxnodes) {
+		hl_grow();
+	}
+
+	const node_t	b = h & (Hl.maxnodes - 1);
+	hnode_t		*np;
+
+	n = Hl.nnodes++;
+	np = &Hl.nodes[n];
+	np->hn_quad[0] = nw;
+	np->hn_quad[1] = ne;
+	np->hn_quad[2] = sw;
+	np->hn_quad[3] = se;
+	np->hn_result = NONE;
+	np->hn_level = LEVEL(nw) + 1;
+	np->hn_next = Hl.buckets[b];
+	Hl.buckets[b] = n;
+
+	return (n);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The central 2x2 of a 4x4 node, one generation later.
+ */
+static node_t
+hl_base(node_t n)
+{
+	int	cell[4][4];
+	node_t	next[4];
+
+	for (int y = 0; y < 4; y++) {
+		for (int x = 0; x < 4; x++) {
+			const node_t	q = Q(n, (y / 2) * 2 + (x / 2));
+
+			cell[y][x] = (Q(q, (y % 2) * 2 + (x % 2)) == ALIVE);
+		}
+	}
+
+	for (int y = 1; y <= 2; y++) {
+		for (int x = 1; x <= 2; x++) {
+			int	count = -cell[y][x];
+
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					count += cell[y + dy][x + dx];
+				}
+			}
+			next[(y - 1) * 2 + (x - 1)] =
+			    (count == 3 || (count == 2 && cell[y][x])) ?
+			    ALIVE : DEAD;
+		}
+	}
+
+	return (hl_find(next[0], next[1], next[2], next[3]));
+}
+
+/*
+ * The central half of a node, right now.
+ */
+static node_t
+hl_center(node_t n)
+{
+	return (hl_find(Q(Q(n, 0), 3), Q(Q(n, 1), 2),
+	    Q(Q(n, 2), 1), Q(Q(n, 3), 0)));
+}
+
+/*
+ * The central half of a level-k node, 2^min(step, k - 2) generations later.
+ *
+ * This splits the node into nine overlapping subnodes of half its size and
+ * gets the central half of each.  For a full-sized step those are advanced
+ * along the way; either way, they're then put back together into four nodes
+ * whose results make up the answer.
+ */
+static node_t
+hl_result(node_t n)
+{
+	node_t	r;
+
+	if (Hl.nodes[n].hn_result != NONE) {
+		return (Hl.nodes[n].hn_result);
+	}
+
+	if (LEVEL(n) == 2) {
+		r = hl_base(n);
+	} else {
+		const bool	full = (LEVEL(n) - 2 <= Hl.step);
+		const node_t	a = Q(n, 0), b = Q(n, 1);
+		const node_t	c = Q(n, 2), d = Q(n, 3);
+		node_t		s[9];
+
+		s[0] = a;
+		s[1] = hl_find(Q(a, 1), Q(b, 0), Q(a, 3), Q(b, 2));
+		s[2] = b;
+		s[3] = hl_find(Q(a, 2), Q(a, 3), Q(c, 0), Q(c, 1));
+		s[4] = hl_find(Q(a, 3), Q(b, 2), Q(c, 1), Q(d, 0));
+		s[5] = hl_find(Q(b, 2), Q(b, 3), Q(d, 0), Q(d, 1));
+		s[6] = c;
+		s[7] = hl_find(Q(c, 1), Q(d, 0), Q(c, 3), Q(d, 2));
+		s[8] = d;
+
+		for (int i = 0; i < 9; i++) {
+			s[i] = full ? hl_result(s[i]) : hl_center(s[i]);
+		}
+
+		const node_t	nw = hl_result(hl_find(s[0], s[1], s[3], s[4]));
+		const node_t	ne = hl_result(hl_find(s[1], s[2], s[4], s[5]));
+		const node_t	sw = hl_result(hl_find(s[3], s[4], s[6], s[7]));
+		const node_t	se = hl_result(hl_find(s[4], s[5], s[7], s[8]));
+
+		r = hl_find(nw, ne, sw, se);
+	}
+
+	Hl.nodes[n].hn_result = r;
+	return (r);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+hl_built_clear(void)
+{
+	if (Hl.built == NULL) {
+		Hl.maxbuilt = MIN_NODES;
+		Hl.built = mem_alloc(Hl.maxbuilt * sizeof (bentry_t));
+	}
+	memset(Hl.built, 0, Hl.maxbuilt * sizeof (bentry_t));
+	Hl.nbuilt = 0;
+}
+
+static bentry_t *
+hl_built_lookup(bentry_t *table, size_t size, uint64_t key)
+{
+	size_t	i;
+
+	for (i = hl_mix(key) & (size - 1); table[i].be_key != 0;
+	    i = (i + 1) & (size - 1)) {
+		if (table[i].be_key == key) {
+			break;
+		}
+	}
+	return (&table[i]);
+}
+
+static void
+hl_built_insert(uint64_t key, node_t n)
+{
+	bentry_t	*be;
+
+	if (2 * (Hl.nbuilt + 1) > Hl.maxbuilt) {
+		const size_t	maxbuilt = Hl.maxbuilt * 2;
+		bentry_t	*built;
+
+		built = mem_alloc(maxbuilt * sizeof (bentry_t));
+
+		memset(built, 0, maxbuilt * sizeof (bentry_t));
+		for (size_t i = 0; i < Hl.maxbuilt; i++) {
+			if (Hl.built[i].be_key != 0) {
+				*hl_built_lookup(built, maxbuilt,
+				    Hl.built[i].be_key) = Hl.built[i];
+			}
+		}
+		mem_free((void **)&Hl.built);
+		Hl.built = built;
+		Hl.maxbuilt = maxbuilt;
+	}
+
+	be = hl_built_lookup(Hl.built, Hl.maxbuilt, key);
+	be->be_key = key;
+	be->be_node = n;
+	Hl.nbuilt++;
+}
+
+/*
+ * Build the level-"level" node whose top left corner is at canvas
+ * coordinates (x, y), wrapping around the edges of the canvas.
+ */
+static node_t
+hl_build(int level, pix_t x, pix_t y)
+{
+	const uint64_t	key = ((uint64_t)level << 56) |
+			    ((uint64_t)x << 28) | (uint64_t)y;
+	bentry_t	*be;
+	node_t		n;
+
+	if (level == 0) {
+		return (Hl.cells[y * Hl.width + x] ? ALIVE : DEAD);
+	}
+
+	be = hl_built_lookup(Hl.built, Hl.maxbuilt, key);
+	if (be->be_key == key) {
+		return (be->be_node);
+	}
+
+	const uint64_t	half = 1ULL << (level - 1);
+	const pix_t	xr = (pix_t)((x + half) % Hl.width);
+	const pix_t	yr = (pix_t)((y + half) % Hl.height);
+	const node_t	nw = hl_build(level - 1, x, y);
+	const node_t	ne = hl_build(level - 1, xr, y);
+	const node_t	sw = hl_build(level - 1, x, yr);
+	const node_t	se = hl_build(level - 1, xr, yr);
+
+	n = hl_find(nw, ne, sw, se);
+	hl_built_insert(key, n);
+
+	return (n);
+}
+
+/*
+ * Copy the part of the level-"level" node "n" that lies within the canvas
+ * back out to it, with the top left corner of the node at (x, y).
+ */
+static void
+hl_read(uint8_t *cells, node_t n, int level, pix_t x, pix_t y)
+{
+	if (x >= Hl.width || y >= Hl.height) {
+		return;
+	}
+
+	if (level == 0) {
+		cells[y * Hl.width + x] = (n == ALIVE);
+		return;
+	}
+
+	const pix_t	half = (pix_t)1 << (level - 1);
+
+	hl_read(cells, Q(n, 0), level - 1, x, y);
+	hl_read(cells, Q(n, 1), level - 1, x + half, y);
+	hl_read(cells, Q(n, 2), level - 1, x, y + half);
+	hl_read(cells, Q(n, 3), level - 1, x + half, y + half);
+}
+
+/* ------------------------------------------------------------------ */
+
+void
+hashlife_advance(uint8_t *cells, pix_t width, pix_t height, uint64_t gens)
+{
+	int	top;		/* the level of the root of the tree */
+
+	/*
+	 * The root's result (its central half) has to cover the canvas.
+	 * That also limits each jump to 2^(top - 2) generations, which keeps
+	 * the tree from covering far more of the tiling than it needs to;
+	 * longer jumps are made up of several of those.
+	 */
+	for (top = 2; ((pix_t)1 << (top - 1)) < MAX(width, height); top++)
+		continue;
+
+	hl_reset();
+	Hl.cells = cells;
+	Hl.width = width;
+	Hl.height = height;
+
+	while (gens > 0) {
+		const pix_t	quarter = (pix_t)1 << (top - 2);
+		int		step;
+		node_t		root;
+
+		for (step = 0; step < top - 2 && (2ULL << step) <= gens; step++)
+			continue;
+
+		if (Hl.nnodes > MAX_NODES) {
+			hl_reset();
+		}
+		if (step != Hl.step) {
+			for (node_t n = 0; n < Hl.nnodes; n++) {
+				Hl.nodes[n].hn_result = NONE;
+			}
+			Hl.step = step;
+		}
+
+		/*
+		 * Center the canvas within the root, so that the result
+		 * starts at the canvas's origin.
+		 */
+		hl_built_clear();
+		root = hl_build(top, (width - quarter % width) % width,
+		    (height - quarter % height) % height);
+		hl_read(cells, hl_result(root), top - 1, 0, 0);
+
+		debug(DB_CORE, "hashlife: %llu generations, %u nodes\n",
+		    1ULL << step, Hl.nnodes);
+
+		gens -= 1ULL << step;
+	}
+
+	hl_fini();
+}
@@ -0,0 +1,17 @@
+/*
+ * hashlife.h - a memoized quadtree engine for fast-forwarding Life.
+ */
+
+#ifndef	_HASHLIFE_H
+#define	_HASHLIFE_H
+
+#include "types.h"
+
+/*
+ * Advance "cells", a width x height torus with one byte per cell (nonzero
+ * for alive), by "gens" generations of Conway's Game of Life.
+ */
+extern void
+hashlife_advance(uint8_t *cells, pix_t width, pix_t height, uint64_t gens);
+
+#endif	/* _HASHLIFE_H */
@@ -15,8 +15,25 @@
  * to drop most pixels below the threshold.  Gently lowering the threshold
  * down to 0.1, and using a stroke width of 1, gives something slightly
  * interesting.
+ *
+ * The "p" key switches to a bit-packed version of the algorithm, which keeps
+ * only the "alive" bit of each cell (packed 32 to a word) plus a byte of age,
+ * and counts neighbors for a whole word at a time.  The float value of each
+ * cell is rebuilt from those when the step writes out its result.  This needs
+ * a width that's a multiple of LIFE_WORDBITS.  The packed words are padded
+ * with ghost words (see shared.h), which get refreshed after every step, so
+ * the step itself never wraps around the edges.
+ *
+ * Otherwise, the step is done in tiles, and only the tiles near something
+ * that changed in the last step get computed (and rendered) again.  Most of
+ * a canvas that's been running for a while has settled into still lifes and
+ * oscillators, so that's usually a small fraction of it.
+ *
+ * The "F" key jumps ahead LIFE_FASTFORWARD generations at the next step,
+ * using the HashLife engine in hashlife.c on the CPU.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <strings.h>
 
@@ -25,15 +42,24 @@
 #include "box.h"
 #include "core.h"
 #include "debug.h"
+#include "hashlife.h"
+#include "heatmap.h"
 #include "keyboard.h"
 #include "module.h"
 #include "opencl.h"
 #include "osdep.h"
 #include "param.h"
 #include "randbj.h"
+#include "shared.h"
+#include "skip.h"
+#include "telemetry.h"
 #include "tweak.h"
 #include "util.h"
 
+#define	LIFE_FASTFORWARD	1000	/* generations per "F" keypress */
+#define	LIFE_GENS		7	/* most generations per step_multi() */
+#define	LIFE_RENDERED		8	/* images that life_render() tracks */
+
 /* ------------------------------------------------------------------ */
 
 struct {
@@ -42,11 +68,50 @@ struct {
 	kernel_data_t	unrender_kernel;
 	kernel_data_t	import_kernel;
 	kernel_data_t	step_kernel;
+	kernel_data_t	step_tiled_kernel;
+	kernel_data_t	step_multi_kernel;
 	kernel_data_t	render_kernel;
-
-	cl_mem		arena[2];	/* Width * Height * sizeof (float) */
-	cl_mem		random;		/* state for RNG */
+	kernel_data_t	render_tiles_kernel;
+	kernel_data_t	pack_kernel;
+	kernel_data_t	unpack_kernel;
+	kernel_data_t	step_packed_kernel;
+	kernel_data_t	ghost_packed_kernel;
+
+	cl_mem		arena[2];	/* LIFE_CELLS() floats */
+	cl_uint		seed;		/* key for the RNG */
 	int		steps;
+	uint64_t	fastforward;	/* generations to jump at next step */
+
+	/*
+	 * State for bit-packed mode.  "bits" is only allocated if the width
+	 * allows it.
+	 */
+	cl_mem		bits[2];	/* one bit per pixel, plus ghosts */
+	cl_mem		age;		/* Width * Height * sizeof (uchar) */
+	bool		packed;		/* running the bit-packed engine? */
+	bool		want_packed;	/* ... starting with the next step? */
+	float		packed_thresh;	/* aliveness used to fill in "bits" */
+
+	/*
+	 * State for the tiled step, which only computes tiles near ones
+	 * that changed during the previous step.
+	 */
+	size_t		tile[2];	/* tile size, in pixels */
+	cl_mem		active[2];	/* per tile: did it change? */
+	bool		wake_all;	/* compute every tile next step */
+	float		active_thresh;	/* aliveness at the last tiled step */
+	cl_mem		active_result;	/* result image of that step */
+	int		render_span;	/* latest steps "active" covers */
+
+	/*
+	 * The images that have been rendered into recently, and the step
+	 * that each of them shows.  The window takes turns between a few
+	 * sets of images, so the one being rendered into usually isn't the
+	 * one that was rendered into last.
+	 */
+	cl_mem		rendered[LIFE_RENDERED];
+	int		rendered_steps[LIFE_RENDERED];
+	int		nextrendered;
 } Life;
 
 /* ------------------------------------------------------------------ */
@@ -81,6 +146,109 @@ life_datavec_shape(void)
 
 /* ------------------------------------------------------------------ */
 
+/*
+ * The bit-packed kernels have one work item per word, rather than per pixel.
+ */
+static void
+life_packed_invoke(kernel_data_t *kd)
+{
+	size_t	global[2] = {
+		P2ROUNDUP((size_t)Width / LIFE_WORDBITS, kd->kd_maxitems[0]),
+		P2ROUNDUP((size_t)Height, kd->kd_maxitems[1])
+	};
+
+	kernel_invoke(kd, 2, global, NULL);
+}
+
+/*
+ * Copy the edges of the packed state in "bits" into its ghost words.
+ */
+static void
+life_ghost(cl_mem bits)
+{
+	kernel_data_t	*const	kd = &Life.ghost_packed_kernel;
+	size_t			global[1] = {
+		P2ROUNDUP(2 * (size_t)LIFE_GHOSTW(Width) + 2 * (size_t)Height,
+		    kd->kd_maxitems[0])
+	};
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &bits);
+	kernel_invoke(kd, 1, global, NULL);
+}
+
+/*
+ * Build the packed state from the float state, at the given threshold.
+ */
+static void
+life_pack(float thresh)
+{
+	kernel_data_t	*const	kd = &Life.pack_kernel;
+	const int		cur = (Life.steps & 1);
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &thresh);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.bits[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.age);
+	life_packed_invoke(kd);
+	life_ghost(Life.bits[cur]);
+
+	Life.packed_thresh = thresh;
+}
+
+/*
+ * Rebuild the float state from the packed state.
+ */
+static void
+life_unpack(void)
+{
+	kernel_data_t	*const	kd = &Life.unpack_kernel;
+	const int		cur = (Life.steps & 1);
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &Life.packed_thresh);
+	kernel_setarg(kd, arg++, sizeof (int), &Life.steps);
+	kernel_setarg(kd, arg++, sizeof (cl_uint), &Life.seed);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.bits[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.age);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur]);
+	life_packed_invoke(kd);
+}
+
+static void
+life_toggle_packed(void)
+{
+	if (Life.bits[0] == NULL) {
+		warn("Bit-packed Life needs a width that's a multiple of %d\n",
+		    LIFE_WORDBITS);
+		return;
+	}
+
+	Life.want_packed = !Life.want_packed;
+	verbose(DB_CORE, "Bit-packed Life %s\n",
+	    Life.want_packed ? "enabled" : "disabled");
+}
+
+static void
+life_key_fastforward(void)
+{
+	Life.fastforward += LIFE_FASTFORWARD;
+	verbose(DB_CORE, "Fast-forwarding %llu generations\n",
+	    (unsigned long long)Life.fastforward);
+}
+
+/* ------------------------------------------------------------------ */
+
 static void
 life_unrender(cl_mem image, cl_mem data)
 {
@@ -97,6 +265,19 @@ life_unrender(cl_mem image, cl_mem data)
 	kernel_invoke(kd, 2, NULL, NULL);
 }
 
+/*
+ * New data has been written to the current arena from outside.
+ */
+static void
+life_imported(float aliveness)
+{
+	if (Life.packed) {
+		life_pack(aliveness);
+	}
+	Life.wake_all = true;
+	Life.render_span = 0;
+}
+
 static void
 life_import(cl_mem data)
 {
@@ -112,17 +293,210 @@ life_import(cl_mem data)
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur]);
 	kernel_invoke(kd, 2, NULL, NULL);
+
+	life_imported(aliveness);
 }
 
 static void
-life_step(cl_mem result)
+life_step_packed(cl_mem result, float aliveness)
+{
+	kernel_data_t	*const	kd = &Life.step_packed_kernel;
+	int			steps = Life.steps;
+	const int		cur = (steps & 1);
+	int			arg;
+
+	/*
+	 * A new threshold changes which cells are alive, so take the
+	 * packed state back through the float representation.
+	 */
+	if (aliveness != Life.packed_thresh) {
+		life_unpack();
+		life_pack(aliveness);
+	}
+
+	Life.steps++;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (int), &steps);
+	kernel_setarg(kd, arg++, sizeof (cl_uint), &Life.seed);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.bits[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.bits[cur ^ 1]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.age);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
+	life_packed_invoke(kd);
+	life_ghost(Life.bits[cur ^ 1]);
+}
+
+/*
+ * Pick a workgroup shape for a kernel that works on tiles: as close to
+ * square as the kernel's maximum workgroup size allows, in powers of two.
+ * This returns false if "nbufs" copies of a tile plus a halo "halo" cells
+ * wide won't fit in local memory.
+ */
+static bool
+life_tile_shape(kernel_data_t *kd, size_t halo, size_t nbufs,
+    size_t local[2])
 {
-	kernel_data_t	*const	kd = &Life.step_kernel;
+	const size_t		maxwg = kernel_wgsize(kd);
+	size_t			w, h;
+
+	for (w = 1; (w * 2) * (w * 2) <= maxwg; w *= 2)
+		continue;
+	for (h = 1; w * h * 2 <= maxwg && h * 2 <= kd->kd_maxitems[1]; h *= 2)
+		continue;
+
+	local[0] = w;
+	local[1] = h;
+
+	return (nbufs * (w + 2 * halo) * (h + 2 * halo) * sizeof (cl_float) <=
+	    opencl_device_localmem());
+}
+
+/*
+ * The shape for step_tiled().  If it won't fit, the untiled kernel gets used
+ * instead.
+ */
+static bool
+life_tile(size_t local[2])
+{
+	return (life_tile_shape(&Life.step_tiled_kernel, 1, 1, local));
+}
+
+/*
+ * Get the per-tile flags ready for a tiled step.  The flags only describe
+ * the arena and the result image if nothing else has touched them since the
+ * last tiled step; if something has, every tile has to be computed, and this
+ * returns false.
+ */
+static bool
+life_tiles_prepare(const size_t local[2], float aliveness, cl_mem result)
+{
+	const int	cur = (Life.steps & 1);
+	const size_t	ntiles = (P2ROUNDUP((size_t)Width, local[0]) /
+			    local[0]) *
+			    (P2ROUNDUP((size_t)Height, local[1]) / local[1]);
+	cl_int		one = 1;
+
+	if (local[0] != Life.tile[0] || local[1] != Life.tile[1]) {
+		for (int i = 0;
+		    i < sizeof (Life.active) / sizeof (*Life.active); i++) {
+			if (Life.active[i] != NULL) {
+				buffer_free(&Life.active[i]);
+			}
+			Life.active[i] = buffer_alloc(ntiles * sizeof (cl_int));
+		}
+		Life.tile[0] = local[0];
+		Life.tile[1] = local[1];
+		Life.wake_all = true;
+	}
+
+	if (aliveness != Life.active_thresh || result != Life.active_result) {
+		Life.wake_all = true;
+	}
+
+	Life.active_thresh = aliveness;
+	Life.active_result = result;
+
+	if (Life.wake_all) {
+		buffer_fill(Life.active[cur], ntiles * sizeof (cl_int),
+		    &one, sizeof (one));
+		Life.wake_all = false;
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Jump ahead Life.fastforward generations with HashLife, which only knows
+ * about the binary alive state.  The ages of the live cells come out right
+ * by letting the last few generations run on the GPU as usual; this
+ * returns how many steps that takes.
+ */
+static int
+life_fastforward(float aliveness)
+{
+	const size_t	npix = (size_t)Width * Height;
+	const size_t	ncells = LIFE_CELLS(Width, Height);
+	const int	cur = (Life.steps & 1);
+	const uint64_t	settle = MIN(Life.fastforward,
+			    (uint64_t)ceilf((1.0f - aliveness) / LIFE_UNIT));
+	float		*arena;
+	uint8_t		*cells;
+
+	if (Life.packed) {
+		life_unpack();
+	}
+
+	arena = mem_alloc(ncells * sizeof (float));
+	cells = mem_alloc(npix);
+	buffer_readfromgpu(Life.arena[cur], arena, ncells * sizeof (float));
+	for (pix_t y = 0; y < Height; y++) {
+		for (pix_t x = 0; x < Width; x++) {
+			cells[y * Width + x] =
+			    (arena[LIFE_PIXEL(x, y, Width)] > aliveness);
+		}
+	}
+
+	hashlife_advance(cells, Width, Height, Life.fastforward - settle);
+
+	/*
+	 * Every live cell starts out newly born; the dead ones get random
+	 * sub-threshold values, as the kernels would give them.
+	 */
+	for (pix_t y = 0; y < Height; y++) {
+		for (pix_t x = 0; x < Width; x++) {
+			arena[LIFE_PIXEL(x, y, Width)] = cells[y * Width + x] ?
+			    1.0f : (float)drandbj() * aliveness;
+		}
+	}
+	buffer_writetogpu(arena, Life.arena[cur], ncells * sizeof (float));
+	mem_free((void **)&cells);
+	mem_free((void **)&arena);
+
+	life_imported(aliveness);
+
+	verbose(DB_CORE, "Fast-forwarded %llu generations\n",
+	    (unsigned long long)Life.fastforward);
+	Life.fastforward = 0;
+
+	return ((int)settle);
+}
+
+static void
+life_step_one(cl_mem result)
+{
+	size_t			local[2];
+	const bool		tiled = life_tile(local);
+	kernel_data_t	*const	kd =
+	    tiled ? &Life.step_tiled_kernel : &Life.step_kernel;
 	float			aliveness = tweak_aliveness();
 	int			steps = Life.steps;
 	const int		cur = (steps & 1);
 	int			arg;
 
+	/*
+	 * Switch engines between steps, carrying the current state across.
+	 */
+	if (Life.want_packed != Life.packed) {
+		if (Life.want_packed) {
+			life_pack(aliveness);
+		} else {
+			life_unpack();
+			Life.wake_all = true;
+		}
+		Life.packed = Life.want_packed;
+	}
+
+	if (Life.packed) {
+		Life.render_span = 0;
+		life_step_packed(result, aliveness);
+		return;
+	}
+
 	Life.steps++;
 
 	arg = 0;
@@ -130,11 +504,31 @@ life_step(cl_mem result)
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
 	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
 	kernel_setarg(kd, arg++, sizeof (int), &steps);
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.random);
+	kernel_setarg(kd, arg++, sizeof (cl_uint), &Life.seed);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur]);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur ^ 1]);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
-	kernel_invoke(kd, 2, NULL, NULL);
+	if (tiled) {
+		size_t	global[2] = {
+			P2ROUNDUP((size_t)Width, local[0]),
+			P2ROUNDUP((size_t)Height, local[1])
+		};
+		bool	sparse;
+
+		sparse = life_tiles_prepare(local, aliveness, result);
+
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.active[cur]);
+		kernel_setarg(kd, arg++, sizeof (cl_mem),
+		    &Life.active[cur ^ 1]);
+		kernel_setarg(kd, arg++,
+		    sizeof (cl_float) * (local[0] + 2) * (local[1] + 2), NULL);
+		kernel_invoke(kd, 2, global, local);
+
+		Life.render_span = sparse ? MIN(Life.render_span + 1, 2) : 0;
+	} else {
+		Life.render_span = 0;
+		kernel_invoke(kd, 2, NULL, NULL);
+	}
 
 	/*
 	 * Debugging: display the values of the pixels in the immediate
@@ -142,18 +536,18 @@ life_step(cl_mem result)
 	 */
 	if (debug_enabled(DB_CORE)) {
 		const pix_t	off = debug_offset();
-		const spix_t	X = off / Width;
-		const spix_t	Y = off % Width;
+		const spix_t	X = off % Width;
+		const spix_t	Y = off / Width;
 		spix_t		x, y;
 
 		debug(DB_CORE, "%d %5d: ||", off, steps);
 
 #define	WRAP(x,max)	(((x) + (max)) % (max))
-#define	PIXEL(x,y,w,h)	(((WRAP(y,h)) * (w)) + (WRAP(x,w)))
 
 		for (y = Y - 1; y <= Y + 1; y++) {
 			for (x = X - 1; x <= X + 1; x++) {
-				pix_t	p = PIXEL(x, y, Width, Height);
+				pix_t	p = LIFE_PIXEL(WRAP(x, Width),
+				    WRAP(y, Height), Width);
 				debug(DB_CORE, " %7.4f",
 				    buffer_float_at(Life.arena[cur], p));
 			}
@@ -161,17 +555,162 @@ life_step(cl_mem result)
 		}
 
 #undef	WRAP
-#undef	PIXEL
 
 		debug(DB_CORE, "| -> %7.4f\n",
-		    buffer_float_dbg(Life.arena[cur ^ 1]));
+		    buffer_float_at(Life.arena[cur ^ 1],
+		    LIFE_PIXEL(X, Y, Width)));
 	}
 }
 
+/*
+ * How many of the next "n" generations step_multi() can do in one launch,
+ * or 1 if it shouldn't be used.  It only handles the float arena, and it
+ * writes to the other arena from the one it reads, so it always does an odd
+ * number of generations.
+ */
+static int
+life_gens(int n, size_t local[2])
+{
+	int	gens = MIN(n, LIFE_GENS);
+
+	if ((gens & 1) == 0) {
+		gens--;
+	}
+	if (gens < 3 || Life.packed || Life.want_packed ||
+	    !life_tile_shape(&Life.step_multi_kernel, LIFE_GENS, 2, local) ||
+	    local[0] + 2 * gens > Width || local[1] + 2 * gens > Height) {
+		return (1);
+	}
+
+	return (gens);
+}
+
+/*
+ * Run "gens" generations at once, for steps whose images nobody will see.
+ * This leaves the per-tile flags behind, so the next tiled step does every
+ * tile.
+ */
+static void
+life_step_multi(cl_mem result, int gens, size_t local[2])
+{
+	kernel_data_t	*const	kd = &Life.step_multi_kernel;
+	const size_t	nlocal = sizeof (cl_float) *
+			    (local[0] + 2 * gens) * (local[1] + 2 * gens);
+	size_t		global[2] = {
+		P2ROUNDUP((size_t)Width, local[0]),
+		P2ROUNDUP((size_t)Height, local[1])
+	};
+	float		aliveness = tweak_aliveness();
+	int		steps = Life.steps;
+	const int	cur = (steps & 1);
+	int		arg;
+
+	Life.steps += gens;
+	Life.wake_all = true;
+	Life.render_span = 0;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (int), &steps);
+	kernel_setarg(kd, arg++, sizeof (cl_uint), &Life.seed);
+	kernel_setarg(kd, arg++, sizeof (int), &gens);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Life.arena[cur ^ 1]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
+	kernel_setarg(kd, arg++, nlocal, NULL);
+	kernel_setarg(kd, arg++, nlocal, NULL);
+	kernel_invoke(kd, 2, global, local);
+}
+
+/*
+ * Take "n" generations, several at a time where possible.
+ */
+static void
+life_step_gens(cl_mem result, int n)
+{
+	while (n > 0) {
+		size_t		local[2];
+		const int	gens = life_gens(n, local);
+
+		if (gens > 1) {
+			life_step_multi(result, gens, local);
+		} else {
+			life_step_one(result);
+		}
+		n -= gens;
+	}
+}
+
+/*
+ * Every step but the last one here gets thrown away -- the ones that let
+ * the ages settle after a fast-forward, and the ones that the skip filter
+ * has been told to skip -- so they're done several generations at a time
+ * where possible.  The skip filter's auto-detection would need to see every
+ * one of them, so only a fixed skip count is used.  When telemetry is on,
+ * the skipped ones are done on their own, so that they can be charged to
+ * TM_SKIP; otherwise they're batched along with the rest.
+ */
+static void
+life_step(cl_mem result)
+{
+	const int	nskip = skip_fixed();
+	int		n = 1;
+	hrtime_t	tm;
+
+	if (Life.fastforward > 0) {
+		n += life_fastforward(tweak_aliveness());
+	}
+
+	if (nskip > 0 && (tm = telemetry_start()) != 0) {
+		life_step_gens(result, nskip);
+		kernel_wait();
+		telemetry_stop(TM_SKIP, tm);
+	} else {
+		n += nskip;
+	}
+	life_step_gens(result, n);
+}
+
+/*
+ * Find the slot in Life.rendered[] that belongs to "image", or the one to
+ * give it if it doesn't have one yet.
+ */
+static int
+life_rendered_slot(cl_mem image)
+{
+	int	slot;
+
+	for (int i = 0; i < LIFE_RENDERED; i++) {
+		if (Life.rendered[i] == image) {
+			return (i);
+		}
+	}
+	slot = Life.nextrendered;
+	Life.nextrendered = (slot + 1) % LIFE_RENDERED;
+	Life.rendered[slot] = image;
+	Life.rendered_steps[slot] = -1;
+	return (slot);
+}
+
+/*
+ * Right after tiled steps, only the tiles that changed need to be rendered
+ * again -- as long as the image still holds what was rendered into it at
+ * one of those steps.  The "active" buffers cover the last two of them.
+ * The heatmap draws over the image, so it rules that out.
+ */
 static void
 life_render(cl_mem data, cl_mem image)
 {
-	kernel_data_t	*const	kd = &Life.render_kernel;
+	const int		slot = life_rendered_slot(image);
+	const int		behind = Life.steps - Life.rendered_steps[slot];
+	const bool		sparse = (Life.rendered_steps[slot] >= 0 &&
+				    behind >= 1 && behind <= Life.render_span &&
+				    data == Life.active_result);
+	kernel_data_t	*const	kd = sparse ?
+				    &Life.render_tiles_kernel :
+				    &Life.render_kernel;
 	float			aliveness = tweak_aliveness();
 	int			arg;
 
@@ -179,9 +718,52 @@ life_render(cl_mem data, cl_mem image)
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
 	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	if (sparse) {
+		pix_t	tw = (pix_t)Life.tile[0];
+		pix_t	th = (pix_t)Life.tile[1];
+		cl_mem	latest = Life.active[Life.steps & 1];
+		cl_mem	before = (behind > 1 ?
+			    Life.active[(Life.steps & 1) ^ 1] : latest);
+
+		kernel_setarg(kd, arg++, sizeof (pix_t), &tw);
+		kernel_setarg(kd, arg++, sizeof (pix_t), &th);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &latest);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &before);
+	}
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
 	kernel_invoke(kd, 2, NULL, NULL);
+
+	Life.rendered_steps[slot] = heatmap_enabled() ? -1 : Life.steps;
+}
+
+/*
+ * The current arena, the step count, and the RNG key are the whole state.
+ * The bit-packed engine's state is carried through the arena, the same way
+ * it is when switching engines; a restored run starts out unpacked, and
+ * goes back to packing on its next step if it's been asked to.
+ */
+static void
+life_checkpoint(checkpoint_t *cp)
+{
+	const size_t	arenasize =
+			    (size_t)LIFE_CELLS(Width, Height) * sizeof (float);
+	const bool	restoring = checkpoint_restoring(cp);
+
+	if (!restoring && Life.packed) {
+		life_unpack();
+	}
+
+	(void) checkpoint_value(cp, "life.steps", &Life.steps,
+	    sizeof (Life.steps));
+	(void) checkpoint_value(cp, "life.seed", &Life.seed,
+	    sizeof (Life.seed));
+	if (checkpoint_buffer(cp, "life.arena", Life.arena[Life.steps & 1],
+	    arenasize) && restoring) {
+		Life.packed = false;
+		Life.wake_all = true;
+		Life.render_span = 0;
+	}
 }
 
 /* ------------------------------------------------------------------ */
@@ -189,6 +771,7 @@ life_render(cl_mem data, cl_mem image)
 static void
 life_preinit(void)
 {
+	Life.ops.name = "life";
 	Life.ops.unrender = life_unrender;
 	Life.ops.import = life_import;
 	Life.ops.step_and_export = life_step;
@@ -196,18 +779,25 @@ life_preinit(void)
 	Life.ops.min = life_min;
 	Life.ops.max = life_max;
 	Life.ops.datavec_shape = life_datavec_shape;
+	Life.ops.checkpoint = life_checkpoint;
+	Life.ops.skips = true;
 
 	tweak_preinit();
 
 	debug_register_toggle('c', "core algorithm", DB_CORE, NULL);
+	key_register('p', KB_DEFAULT, "toggle bit-packed Life",
+	    life_toggle_packed);
+	key_register('F', KB_DEFAULT, "fast-forward Life",
+	    life_key_fastforward);
 }
 
 static void
 life_init(void)
 {
-	const size_t	arenasize = (size_t)Width * Height * sizeof (float);
-	const size_t	randsize = (size_t)Width * Height * sizeof (cl_uint4);
-	cl_uint4	*rand_cpu;
+	const size_t	arenasize =
+			    (size_t)LIFE_CELLS(Width, Height) * sizeof (float);
+	const size_t	bitsize = (size_t)LIFE_GHOSTW(Width) * (Height + 2) *
+			    sizeof (cl_uint);
 
 	core_ops_register(&Life.ops);
 
@@ -215,30 +805,71 @@ life_init(void)
 		Life.arena[i] = buffer_alloc(arenasize);
 	}
 
-	/* Initialize state for the PRNG. */
-	Life.random = buffer_alloc(randsize);
-	rand_cpu = mem_alloc(randsize);
-	for (pix_t i = 0; i < Width * Height; i++) {
-		rand_cpu[i].x = (cl_uint)lrandbj();
-		rand_cpu[i].y = (cl_uint)lrandbj();
-		rand_cpu[i].z = (cl_uint)lrandbj();
-		rand_cpu[i].w = (cl_uint)lrandbj();
-	}
-	buffer_writetogpu(rand_cpu, Life.random, randsize);
-	mem_free((void **)&rand_cpu);
+	/* The PRNG is keyed off of the "-x" seed, for reproducibility. */
+	Life.seed = (cl_uint)lrandbj();
 
 	kernel_create(&Life.unrender_kernel, "unrender");
 	kernel_create(&Life.import_kernel, "import");
 	kernel_create(&Life.step_kernel, "step_and_export");
+	kernel_create(&Life.step_tiled_kernel, "step_tiled");
+	kernel_create(&Life.step_multi_kernel, "step_multi");
 	kernel_create(&Life.render_kernel, "render");
+	kernel_create(&Life.render_tiles_kernel, "render_tiles");
+
+	if (Width % LIFE_WORDBITS == 0) {
+		for (int i = 0; i < sizeof (Life.bits) / sizeof (*Life.bits);
+		    i++) {
+			Life.bits[i] = buffer_alloc(bitsize);
+		}
+		Life.age = buffer_alloc((size_t)Width * Height);
+
+		kernel_create(&Life.pack_kernel, "pack");
+		kernel_create(&Life.unpack_kernel, "unpack");
+		kernel_create(&Life.step_packed_kernel, "step_packed");
+		kernel_create(&Life.ghost_packed_kernel, "ghost_packed");
+	} else {
+		Life.want_packed = false;
+	}
+	Life.packed = false;
+
+	Life.tile[0] = Life.tile[1] = 0;
+	Life.wake_all = true;
+	Life.render_span = 0;
+	for (int i = 0; i < LIFE_RENDERED; i++) {
+		Life.rendered[i] = NULL;
+	}
+	Life.nextrendered = 0;
 
 	Life.steps = 0;
+	Life.fastforward = 0;
 }
 
 static void
 life_fini(void)
 {
+	if (Life.bits[0] != NULL) {
+		kernel_cleanup(&Life.ghost_packed_kernel);
+		kernel_cleanup(&Life.step_packed_kernel);
+		kernel_cleanup(&Life.unpack_kernel);
+		kernel_cleanup(&Life.pack_kernel);
+
+		for (int i = 0; i < sizeof (Life.bits) / sizeof (*Life.bits);
+		    i++) {
+			buffer_free(&Life.bits[i]);
+		}
+		buffer_free(&Life.age);
+	}
+
+	kernel_cleanup(&Life.render_tiles_kernel);
 	kernel_cleanup(&Life.render_kernel);
+
+	for (int i = 0; i < sizeof (Life.active) / sizeof (*Life.active); i++) {
+		if (Life.active[i] != NULL) {
+			buffer_free(&Life.active[i]);
+		}
+	}
+	kernel_cleanup(&Life.step_multi_kernel);
+	kernel_cleanup(&Life.step_tiled_kernel);
 	kernel_cleanup(&Life.step_kernel);
 	kernel_cleanup(&Life.import_kernel);
 	kernel_cleanup(&Life.unrender_kernel);
@@ -246,7 +877,6 @@ life_fini(void)
 	for (int i = 0; i < sizeof (Life.arena) / sizeof (*Life.arena); i++) {
 		buffer_free(&Life.arena[i]);
 	}
-	buffer_free(&Life.random);
 
 	core_ops_unregister(&Life.ops);
 }
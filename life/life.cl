@@ -2,10 +2,9 @@
  * life.cl - the computational kernels for John Conway's Game of Life.
  */
 
-#define	UNIT		(0.01f)
+#include "shared.h"
 
 #define	WRAP(x,max)	(((x) + (max)) % (max))
-#define	PIXEL(x,y,w,h)	(((WRAP(y,h)) * (w)) + (WRAP(x,w)))
 
 /* ------------------------------------------------------------------ */
 
@@ -51,60 +50,99 @@ import(
 	const pix_t	Y = get_global_id(1);
 
 	if (X < W && Y < H) {
-		dst[Y * W + X] = as_datavec(read_imagef(src, (int2)(X, Y)));
+		dst[LIFE_PIXEL(X, Y, W)] =
+		    as_datavec(read_imagef(src, (int2)(X, Y)));
 	}
 }
 
 /* ------------------------------------------------------------------ */
 
 /*
- * from http://http.developer.nvidia.com/GPUGems3/gpugems3_ch37.html, via
- * https://math.stackexchange.com/questions/337782/pseudo-random-number-generation-on-the-gpu
- *
- * This is overkill for the current task, but simpler PRNGs that didn't keep
- * per-pixel state showed very obvious periodicity.
+ * A counter-based random number generator (Philox-2x32-10, from Salmon et
+ * al., "Parallel Random Numbers: As Easy as 1, 2, 3").  The random value for
+ * a pixel at a given step is a function of the seed, the pixel, and the step
+ * alone, so there's no per-pixel generator state to read and write back.
  */
 
-static uint
-LCGStep(uint z, uint A, uint C)
-{
-	return (A * z + C);    
-}
+#define	PHILOX_M	0xd256d193U
+#define	PHILOX_W	0x9e3779b9U
 
-static uint
-TausStep(uint z, int S1, int S2, int S3, uint M)
+static float
+generate_random(uint seed, pix_t pix, int steps)
 {
-	return ((((z << S1) ^ z) >> S2) ^ ((z & M) << S3));
+	uint2	ctr = (uint2)(pix, (uint)steps);
+	uint	key = seed;
+
+	for (int r = 0; r < 10; r++) {
+		const uint	hi = mul_hi(PHILOX_M, ctr.x);
+		const uint	lo = PHILOX_M * ctr.x;
+
+		ctr = (uint2)(hi ^ key ^ ctr.y, lo);
+		key += PHILOX_W;
+	}
+
+	/* 24 bits, so the result stays strictly below 1. */
+	return ((ctr.x >> 8) * (1.0f / 16777216.0f));
 }
 
+/* ------------------------------------------------------------------ */
+
+#define	IS_ALIVE(v)	((v) > (thresh))
+
+/*
+ * Given a cell's old value and its count of live neighbors, compute its new
+ * value.  If "resample" is false, a cell that stays dead keeps its old
+ * sub-threshold value rather than getting a new one, so that a patch of the
+ * image that isn't changing stays exactly the same.
+ */
 static float
-generate_random(
-	pix_t			W,		/* in */
-	pix_t			H,		/* in */
-	__global uint4		*random_state)	/* in/out */
+life_update(
+	const float		thresh,		/* in */
+	const uint		seed,		/* in */
+	const int		steps,		/* in */
+	const pix_t		pix,		/* in */
+	const float		ov,		/* in */
+	const int		count,		/* in */
+	const bool		resample)	/* in */
 {
-	const pix_t	pix = get_global_id(1) * W + get_global_id(0);
-	uint4		state;
+	float		nv;
 
-	state = random_state[pix];
-	state.w = LCGStep(state.w, 1664525, 1013904223);	// p = 2^32
-	state.x = TausStep(state.x, 13, 19, 12, (uint)( -2));	// p = 2^31 - 1
-	state.y = TausStep(state.y,  2, 25,  4, (uint)( -8));	// p = 2^30 - 1
-	state.z = TausStep(state.z,  3, 11, 17, (uint)(-16));	// p = 2^28 - 1
-	random_state[pix] = state;
+	if (IS_ALIVE(ov) && (count == 2 || count == 3)) {
+		/*
+		 * Keep it alive, but "age" the pixel one step (until it gets
+		 * to the minimum allowed age that's still alive).
+		 */
+		if (IS_ALIVE(ov - LIFE_UNIT)) {
+			nv = ov - LIFE_UNIT;
+		} else {
+			nv = ov;
+		}
+	} else if (!IS_ALIVE(ov) && count == 3) {
+		/*
+		 * Make it fully alive.
+		 */
+		nv = 1.0f;
+	} else if (!resample && !IS_ALIVE(ov)) {
+		nv = ov;
+	} else {
+		/*
+		 * It's not alive; give it a new random sub-threshold value.
+		 * This allows random new growth to happen if the threshold
+		 * is reduced.
+		 */
+		nv = generate_random(seed, pix, steps) * thresh;
+	}
 
-	return (2.3283064365387e-10 * (state.x ^ state.y ^ state.z ^ state.w));
+	return (nv);
 }
 
-/* ------------------------------------------------------------------ */
-
 __kernel void
 step_and_export(
 	pix_t			W,		/* in */
 	pix_t			H,		/* in */
 	const float		thresh,		/* in */
 	const int		steps,		/* in */
-	__global uint4		*random_state,	/* in/out */
+	const uint		seed,		/* in */
 	__global float		*src,		/* in */
 	__global float		*dst,		/* out */
 	__write_only image2d_t	result)		/* out */
@@ -112,55 +150,488 @@ step_and_export(
 	const pix_t	X = get_global_id(0);
 	const pix_t	Y = get_global_id(1);
 	const pix_t	pix = Y * W + X;
-	spix_t		x, y;
+	const pix_t	cell = LIFE_PIXEL(X, Y, W);
+	int		x, y;
 
 	if (X >= W || Y >= H) {
 		return;
 	}
 
-	const float	ov = src[pix];
-	float		nv;
-
-#define	IS_ALIVE(v)	((v) > (thresh))
+	const float	ov = src[cell];
 
 	/*
-	 * Very standard Game of Life algorithm.
+	 * Very standard Game of Life algorithm.  Only the cells on the edges
+	 * have neighbors that wrap around, so that's a comparison apiece
+	 * rather than a modulo for every neighbor.
 	 */
-	int	count = 0;
-	for (y = Y - 1; y <= (spix_t)Y + 1; y++) {
-		for (x = X - 1; x <= (spix_t)X + 1; x++) {
-			count += IS_ALIVE(src[PIXEL(x, y, W, H)]);
+	const pix_t	cols[3] =
+	    { (X == 0 ? W : X) - 1, X, (X + 1 == W ? 0 : X + 1) };
+	const pix_t	rows[3] =
+	    { (Y == 0 ? H : Y) - 1, Y, (Y + 1 == H ? 0 : Y + 1) };
+	int		count = 0;
+
+	for (y = 0; y < 3; y++) {
+		for (x = 0; x < 3; x++) {
+			count += IS_ALIVE(
+			    src[LIFE_PIXEL(cols[x], rows[y], W)]);
 		}
 	}
 	count -= IS_ALIVE(ov);
 
-	if (IS_ALIVE(ov) && (count == 2 || count == 3)) {
-		/*
-		 * Keep it alive, but "age" the pixel one step (until it gets
-		 * to the minimum allowed age that's still alive).
-		 */
-		if (IS_ALIVE(ov - UNIT)) {
-			nv = ov - UNIT;
+	const float	nv =
+	    life_update(thresh, seed, steps, pix, ov, count, true);
+
+	dst[cell] = nv;
+
+	write_imagef(result, (int2)(X, Y), nv);
+}
+
+/*
+ * The same step, but each workgroup first copies its tile of "src" plus a
+ * one-cell halo into local memory, so each cell is read from global memory
+ * about once rather than nine times.  Only the halo can wrap around the edges
+ * of the image.  "tile" holds (get_local_size(0) + 2) *
+ * (get_local_size(1) + 2) floats.
+ *
+ * Each workgroup's tile also has a flag saying whether anything in it changed
+ * during the step.  A tile can only change if it or one of its neighbors
+ * changed during the previous step, so the workgroups for all the other
+ * tiles return right away, leaving "dst" and "result" as they were.  Since
+ * "dst" is the arena from two steps ago, that only works if dead cells keep
+ * their values; see life_update().
+ */
+__kernel void
+step_tiled(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const int		steps,		/* in */
+	const uint		seed,		/* in */
+	__global float		*src,		/* in */
+	__global float		*dst,		/* out */
+	__write_only image2d_t	result,		/* out */
+	__global const int	*active,	/* in: changed last step */
+	__global int		*changed,	/* out: changed this step */
+	__local float		*tile)		/* scratch */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	lx = get_local_id(0);
+	const pix_t	ly = get_local_id(1);
+	const pix_t	LW = get_local_size(0);
+	const pix_t	LH = get_local_size(1);
+	const pix_t	TW = LW + 2;
+	const spix_t	X0 = (spix_t)(X - lx) - 1;
+	const spix_t	Y0 = (spix_t)(Y - ly) - 1;
+	const pix_t	GX = get_group_id(0);
+	const pix_t	GY = get_group_id(1);
+	const pix_t	NGX = get_num_groups(0);
+	const pix_t	NGY = get_num_groups(1);
+	const bool	leader = (lx == 0 && ly == 0);
+	__local int	any;
+	int		awake = 0;
+
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			awake |= active[WRAP(GY + dy, NGY) * NGX +
+			    WRAP(GX + dx, NGX)];
+		}
+	}
+	if (!awake) {
+		if (leader) {
+			changed[GY * NGX + GX] = 0;
+		}
+		return;
+	}
+	if (leader) {
+		any = 0;
+	}
+
+	for (pix_t i = ly * LW + lx; i < TW * (LH + 2); i += LW * LH) {
+		spix_t	x = X0 + (spix_t)(i % TW);
+		spix_t	y = Y0 + (spix_t)(i / TW);
+
+		if (x < 0 || x >= W) {
+			x = WRAP(x, (spix_t)W);
+		}
+		if (y < 0 || y >= H) {
+			y = WRAP(y, (spix_t)H);
+		}
+		tile[i] = src[LIFE_PIXEL(x, y, W)];
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (X < W && Y < H) {
+		__local const float	*const	c =
+		    tile + (ly + 1) * TW + (lx + 1);
+		const float	ov = *c;
+		const int	count =
+		    IS_ALIVE(c[-TW - 1]) + IS_ALIVE(c[-TW]) +
+		    IS_ALIVE(c[-TW + 1]) + IS_ALIVE(c[-1]) + IS_ALIVE(c[1]) +
+		    IS_ALIVE(c[TW - 1]) + IS_ALIVE(c[TW]) +
+		    IS_ALIVE(c[TW + 1]);
+		const pix_t	pix = Y * W + X;
+		const float	nv =
+		    life_update(thresh, seed, steps, pix, ov, count, false);
+
+		dst[LIFE_PIXEL(X, Y, W)] = nv;
+		write_imagef(result, (int2)(X, Y), nv);
+
+		if (nv != ov) {
+			any = 1;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (leader) {
+		changed[GY * NGX + GX] = any;
+	}
+}
+
+/*
+ * Wrap a coordinate that's at most one image width (or height) "n" outside
+ * of [0, n) back into it.
+ */
+static pix_t
+life_wrap(spix_t v, pix_t n)
+{
+	if (v < 0) {
+		return ((pix_t)(v + (spix_t)n));
+	}
+	if (v >= (spix_t)n) {
+		return ((pix_t)(v - (spix_t)n));
+	}
+	return ((pix_t)v);
+}
+
+/*
+ * Several generations in one launch.  Each workgroup copies its tile of
+ * "src" plus a halo "gens" cells wide into local memory, and then computes
+ * one generation after another there; each generation has one less ring
+ * of the halo that it can get right, so after "gens" of them, just the
+ * tile itself is left, and that's what gets written out.  The halo cells
+ * are computed by more than one workgroup, but the arena is only read and
+ * written once for all of the generations.
+ *
+ * Dead cells keep their values, as in step_tiled(), and each generation
+ * draws its random numbers for the step it stands in for, so this gives
+ * the same result as "gens" calls to step_tiled().  "a" and "b" each hold
+ * (get_local_size(0) + 2 * gens) * (get_local_size(1) + 2 * gens) floats,
+ * and the tile plus its halo has to fit within the image.
+ */
+__kernel void
+step_multi(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const int		steps,		/* in */
+	const uint		seed,		/* in */
+	const int		gens,		/* in */
+	__global float		*src,		/* in */
+	__global float		*dst,		/* out */
+	__write_only image2d_t	result,		/* out */
+	__local float		*a,		/* scratch */
+	__local float		*b)		/* scratch */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	lx = get_local_id(0);
+	const pix_t	ly = get_local_id(1);
+	const pix_t	LW = get_local_size(0);
+	const pix_t	LH = get_local_size(1);
+	const pix_t	TW = LW + 2 * gens;
+	const pix_t	TH = LH + 2 * gens;
+	const spix_t	X0 = (spix_t)(X - lx) - gens;
+	const spix_t	Y0 = (spix_t)(Y - ly) - gens;
+	__local float	*cur = a;
+	__local float	*next = b;
+
+	for (pix_t i = ly * LW + lx; i < TW * TH; i += LW * LH) {
+		const pix_t	x = life_wrap(X0 + (spix_t)(i % TW), W);
+		const pix_t	y = life_wrap(Y0 + (spix_t)(i / TW), H);
+
+		cur[i] = src[LIFE_PIXEL(x, y, W)];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int g = 1; g <= gens; g++) {
+		const pix_t	w = TW - 2 * g;
+		const pix_t	h = TH - 2 * g;
+		__local float	*tmp;
+
+		for (pix_t i = ly * LW + lx; i < w * h; i += LW * LH) {
+			const pix_t	tx = g + i % w;
+			const pix_t	ty = g + i / w;
+			__local const float	*const	c = cur + ty * TW + tx;
+			const int	count =
+			    IS_ALIVE(c[-TW - 1]) + IS_ALIVE(c[-TW]) +
+			    IS_ALIVE(c[-TW + 1]) + IS_ALIVE(c[-1]) +
+			    IS_ALIVE(c[1]) + IS_ALIVE(c[TW - 1]) +
+			    IS_ALIVE(c[TW]) + IS_ALIVE(c[TW + 1]);
+			const pix_t	pix =
+			    life_wrap(Y0 + (spix_t)ty, H) * W +
+			    life_wrap(X0 + (spix_t)tx, W);
+
+			next[ty * TW + tx] = life_update(thresh, seed,
+			    steps + g - 1, pix, *c, count, false);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	if (X < W && Y < H) {
+		const float	nv = cur[(ly + gens) * TW + (lx + gens)];
+
+		dst[LIFE_PIXEL(X, Y, W)] = nv;
+		write_imagef(result, (int2)(X, Y), nv);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Bit-packed Life.  Each uint holds the "alive" bits of LIFE_WORDBITS
+ * horizontally adjacent cells (bit b of word w is cell w * LIFE_WORDBITS + b),
+ * so one work item loads nine words to update a whole word's worth of cells,
+ * and counts neighbors for all of them at once with bit-sliced adders.
+ *
+ * The float value of a cell is only needed by render().  For a live cell it
+ * is derived from the number of steps it has been alive, kept in "age"; a dead
+ * cell gets a fresh random sub-threshold value, just as in step_and_export().
+ */
+
+#define	AGED(a)		(1.0f - (a) * LIFE_UNIT)
+
+/*
+ * Add the one-bit-per-cell word "x" into the bit-sliced counter (s0, s1, s2).
+ * A count of 8 wraps around to 0, which is just as dead.
+ */
+static void
+bit_add(uint *s0, uint *s1, uint *s2, uint x)
+{
+	const uint	c0 = *s0 & x;
+	const uint	c1 = *s1 & c0;
+
+	*s0 ^= x;
+	*s1 ^= c0;
+	*s2 ^= c1;
+}
+
+__kernel void
+pack(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	__global float		*src,		/* in */
+	__global uint		*dst,		/* out */
+	__global uchar		*age)		/* out */
+{
+	const pix_t	WX = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	NW = W / LIFE_WORDBITS;
+	uint		bits = 0;
+
+	if (WX >= NW || Y >= H) {
+		return;
+	}
+
+	for (int b = 0; b < LIFE_WORDBITS; b++) {
+		const pix_t	X = WX * LIFE_WORDBITS + b;
+		const pix_t	pix = Y * W + X;
+		const float	v = src[LIFE_PIXEL(X, Y, W)];
+
+		if (v > thresh) {
+			/*
+			 * Round the age down, so AGED(age) stays above the
+			 * threshold.
+			 */
+			bits |= 1U << b;
+			age[pix] =
+			    (uchar)min(floor((1.0f - v) / LIFE_UNIT), 255.0f);
+		}
+	}
+
+	dst[LIFE_GHOST(WX, Y, W)] = bits;
+}
+
+/*
+ * Fill in the ghost words around the bit-packed state in "bits", from the
+ * words on the opposite edges, so step_packed() never has to wrap around.
+ * There's one work item per ghost word: first the row above, then the row
+ * below, then the two ends of each row in between.
+ */
+__kernel void
+ghost_packed(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	__global uint		*bits)		/* in/out */
+{
+	const pix_t	I = get_global_id(0);
+	const pix_t	NW = W / LIFE_WORDBITS;
+	const pix_t	GW = LIFE_GHOSTW(W);
+
+	if (I < 2 * GW) {
+		const pix_t	gx = I % GW;
+		const pix_t	wx = (gx == 0 ? NW : (gx == GW - 1 ? 1 : gx));
+
+		if (I < GW) {
+			bits[gx] = bits[H * GW + wx];
 		} else {
-			nv = ov;
+			bits[(H + 1) * GW + gx] = bits[GW + wx];
 		}
-	} else if (!IS_ALIVE(ov) && count == 3) {
-		/*
-		 * Make it fully alive.
-		 */
-		nv = 1.0f;
+	} else if (I < 2 * GW + 2 * H) {
+		const pix_t	y = (I - 2 * GW) / 2 + 1;
+
+		if ((I & 1) == 0) {
+			bits[y * GW] = bits[y * GW + NW];
+		} else {
+			bits[y * GW + NW + 1] = bits[y * GW + 1];
+		}
+	}
+}
+
+__kernel void
+unpack(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const int		steps,		/* in */
+	const uint		seed,		/* in */
+	__global uint		*src,		/* in */
+	__global uchar		*age,		/* in */
+	__global float		*dst)		/* out */
+{
+	const pix_t	WX = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	NW = W / LIFE_WORDBITS;
+
+	if (WX >= NW || Y >= H) {
+		return;
+	}
+
+	const uint	bits = src[LIFE_GHOST(WX, Y, W)];
+
+	for (int b = 0; b < LIFE_WORDBITS; b++) {
+		const pix_t	X = WX * LIFE_WORDBITS + b;
+		const pix_t	pix = Y * W + X;
+		const pix_t	cell = LIFE_PIXEL(X, Y, W);
+
+		if ((bits >> b) & 1) {
+			dst[cell] = AGED(age[pix]);
+		} else {
+			dst[cell] = generate_random(seed, pix, steps) * thresh;
+		}
+	}
+}
+
+__kernel void
+step_packed(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const int		steps,		/* in */
+	const uint		seed,		/* in */
+	__global uint		*src,		/* in */
+	__global uint		*dst,		/* out */
+	__global uchar		*age,		/* in/out */
+	__write_only image2d_t	result)		/* out */
+{
+	const pix_t	WX = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	NW = W / LIFE_WORDBITS;
+
+	if (WX >= NW || Y >= H) {
+		return;
+	}
+
+	const pix_t	GW = LIFE_GHOSTW(W);
+	uint		s0 = 0, s1 = 0, s2 = 0;
+	uint		alive = 0;
+
+	/*
+	 * Shift each row's word by one cell in each direction, pulling in
+	 * the edge bit of the neighboring word, to line up the west and east
+	 * neighbors of every cell with the cell itself.  The neighbors of the
+	 * words on the edges are ghost words, so none of this wraps around.
+	 */
+	for (int r = 0; r < 3; r++) {
+		__global const uint	*row =
+		    src + LIFE_GHOST(WX, Y, W) + (r - 1) * (spix_t)GW;
+		const uint		c = row[0];
+
+		bit_add(&s0, &s1, &s2,
+		    (c << 1) | (row[-1] >> (LIFE_WORDBITS - 1)));
+		bit_add(&s0, &s1, &s2,
+		    (c >> 1) | (row[1] << (LIFE_WORDBITS - 1)));
+		if (r == 1) {
+			alive = c;
+		} else {
+			bit_add(&s0, &s1, &s2, c);
+		}
+	}
+
+	/* Alive next step: 3 neighbors, or 2 neighbors and alive now. */
+	const uint	next = s1 & ~s2 & (s0 | alive);
+
+	dst[LIFE_GHOST(WX, Y, W)] = next;
+
+	for (int b = 0; b < LIFE_WORDBITS; b++) {
+		const pix_t	X = WX * LIFE_WORDBITS + b;
+		const pix_t	pix = Y * W + X;
+		float		nv;
+
+		if ((next >> b) & 1) {
+			uint	a = 0;
+
+			if ((alive >> b) & 1) {
+				/* Age it, as long as it stays alive. */
+				a = age[pix];
+				if (AGED(a + 1) > thresh) {
+					age[pix] = ++a;
+				}
+			} else {
+				age[pix] = 0;
+			}
+			nv = AGED(a);
+		} else {
+			nv = generate_random(seed, pix, steps) * thresh;
+		}
+
+		write_imagef(result, (int2)(X, Y), nv);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+render_datum(
+	const pix_t		X,		/* in */
+	const pix_t		Y,		/* in */
+	const float		thresh,		/* in */
+	__read_only image2d_t	data,		/* in */
+	__write_only image2d_t	image)		/* out */
+{
+	const float	d = as_datavec(read_imagef(data, (int2)(X, Y)));
+	float3		hsv;
+
+	if (d < thresh) {
+		hsv = (float3)(0, 0, 0);
 	} else {
 		/*
-		 * It's not alive; give it a new random sub-threshold value.
-		 * This allows random new growth to happen if the threshold
-		 * is reduced.
+		 * This makes new pixels red; as they age, they
+		 * follow the hues around through warm to cool.
 		 */
-		nv = generate_random(W, H, random_state) * thresh;
+		const float	a = (d - thresh) / (1 - thresh);
+		const float	b = (1 - a) * 0.7f;
+		hsv = (float3)(b, 1, 1);
 	}
 
-	dst[pix] = nv;
-
-	write_imagef(result, (int2)(X, Y), nv);
+	hsv_to_image(X, Y, hsv, image);
 }
 
 __kernel void
@@ -175,22 +646,32 @@ render(
 	const pix_t	Y = get_global_id(1);
 
 	if (X < W && Y < H) {
-		const float	d =
-		    as_datavec(read_imagef(data, (int2)(X, Y)));
-		float3		hsv;
+		render_datum(X, Y, thresh, data, image);
+	}
+}
 
-		if (d < thresh) {
-			hsv = (float3)(0, 0, 0);
-		} else {
-			/*
-			 * This makes new pixels red; as they age, they
-			 * follow the hues around through warm to cool.
-			 */
-			const float	a = (d - thresh) / (1 - thresh);
-			const float	b = (1 - a) * 0.7f;
-			hsv = (float3)(b, 1, 1);
-		}
+/*
+ * Render only the tiles that step_tiled() says changed in either of two
+ * steps, with tiles of TW x TH pixels.
+ */
+__kernel void
+render_tiles(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const pix_t		TW,		/* in */
+	const pix_t		TH,		/* in */
+	__global const int	*changed,	/* in: at the latest step */
+	__global const int	*changed0,	/* in: at the one before */
+	__read_only image2d_t	data,		/* in */
+	__write_only image2d_t	image)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	NTX = (W + TW - 1) / TW;
+	const pix_t	T = (Y / TH) * NTX + X / TW;
 
-		hsv_to_image(X, Y, hsv, image);
+	if (X < W && Y < H && (changed[T] | changed0[T])) {
+		render_datum(X, Y, thresh, data, image);
 	}
 }
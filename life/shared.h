@@ -7,4 +7,31 @@
 
 #define	THRESH_SCALE	100	/* units of threshold scaling */
 
+#define	LIFE_UNIT	(0.01f)	/* how much a live cell ages per step */
+
+#define	LIFE_WORDBITS	32	/* cells per word in bit-packed mode */
+
+/*
+ * Where cell (x, y) is in an arena "w" cells wide, and how many cells an
+ * arena for a w x h image holds.  With LIFE_TILED (see the Makefile), the
+ * arenas are kept in tiles (see clcommon.h), so the rows above and below a
+ * tile of the tiled step are mostly in the same cache lines as the tile.
+ */
+#ifdef	LIFE_TILED
+#define	LIFE_PIXEL(x,y,w)	TILED_PIXEL(x, y, w)
+#define	LIFE_CELLS(w,h)		(TILED_WIDTH(w) * TILED_WIDTH(h))
+#else
+#define	LIFE_PIXEL(x,y,w)	((y) * (w) + (x))
+#define	LIFE_CELLS(w,h)		((w) * (h))
+#endif
+
+/*
+ * The bit-packed state has a ghost word at each end of every row, and a ghost
+ * row above and below, holding copies of the words on the opposite edges.
+ * Word "wx" of row "y" is at LIFE_GHOST(wx, y, w), for an image "w" cells
+ * wide.
+ */
+#define	LIFE_GHOSTW(w)		((w) / LIFE_WORDBITS + 2)
+#define	LIFE_GHOST(wx,y,w)	(((y) + 1) * LIFE_GHOSTW(w) + (wx) + 1)
+
 #endif	/* _SHARED_H */
@@ -2,5 +2,6 @@
 #define	_VECSIZES_H
 
 #define	DATA_DIMENSIONS		1
+#define	DATA_RANDOM_MAXOF	3	/* see vectypes.h */
 
 #endif	/* _VECSIZES_H */
@@ -0,0 +1,352 @@
+/*
+ * ltl.c - a core algorithm implementing Larger-than-Life, Kellie Evans's
+ * generalization of the Game of Life to large neighborhoods.
+ *
+ * A cell's neighborhood is the (2R + 1) x (2R + 1) square around it, itself
+ * included.  A dead cell comes alive if the number of live cells in its
+ * neighborhood is within the birth range, and a live cell stays alive if it
+ * is within the survival range.  (See tweak.c for the parameters.)
+ *
+ * Counting a big neighborhood directly gets expensive fast, but the count is
+ * just a box blur of a mask of the live cells, scaled up by the size of the
+ * neighborhood.  So each step makes that mask, runs the regular box blur on
+ * it, and applies the rule to the result.  The box blur takes about the same
+ * time at any radius, and it's already tuned for each one.
+ *
+ * With HALF_STORAGE, though, the blurred fraction isn't precise enough to get
+ * the count back out of at the larger radii.  Then the count is done exactly
+ * instead, in two separable passes: the live cells in the stretch of each
+ * row around every cell, then those added up over the stretch of rows
+ * around it.  Both keep a running sum, so they also cost about the same at
+ * any radius.
+ *
+ * The aliveness threshold and the rendering work as in the Game of Life core.
+ */
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include "common.h"
+
+#include "box.h"
+#include "core.h"
+#include "debug.h"
+#include "keyboard.h"
+#include "module.h"
+#include "opencl.h"
+#include "param.h"
+#include "shared.h"
+#include "tweak.h"
+#include "util.h"
+
+/* ------------------------------------------------------------------ */
+
+static struct {
+	core_ops_t	ops;
+
+	kernel_data_t	unrender_kernel;
+	kernel_data_t	import_kernel;
+#ifndef	HALF_STORAGE
+	kernel_data_t	mask_kernel;
+#else
+	kernel_data_t	rows_kernel;
+	kernel_data_t	cols_kernel;
+#endif
+	kernel_data_t	step_kernel;
+	kernel_data_t	render_kernel;
+
+	cl_mem		arena[2];	/* Width * Height * sizeof (float) */
+#ifndef	HALF_STORAGE
+	cl_mem		mask;		/* alive mask, for the box blur */
+	cl_mem		density;	/* blurred mask */
+#else
+	cl_mem		rows;		/* Width * Height * sizeof (cl_int) */
+	cl_mem		counts;		/* Width * Height * sizeof (cl_int) */
+#endif
+	int		steps;
+} Ltl;
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The minimum value of any component of a data vector.
+ */
+float
+ltl_min(void)
+{
+	return (0.0f);
+}
+
+/*
+ * The maximum value of any component of a data vector.
+ */
+float
+ltl_max(void)
+{
+	return (1.0f);
+}
+
+/*
+ * Whether datavec's fit into a sphere or a cube.
+ * (here it doesn't matter, since they're 1-D)
+ */
+datavec_shape_t
+ltl_datavec_shape(void)
+{
+	return (DATAVEC_SHAPE_SPHERE);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+ltl_unrender(cl_mem image, cl_mem data)
+{
+	kernel_data_t	*const	kd = &Ltl.unrender_kernel;
+	float			aliveness = tweak_aliveness();
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
+	kernel_invoke(kd, 2, NULL, NULL);
+}
+
+static void
+ltl_import(cl_mem data)
+{
+	kernel_data_t	*const	kd = &Ltl.import_kernel;
+	const int		cur = (Ltl.steps & 1);
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.arena[cur]);
+	kernel_invoke(kd, 2, NULL, NULL);
+}
+
+#ifndef	HALF_STORAGE
+/*
+ * Blur the alive mask of the arena at "cur" into Ltl.density.
+ */
+static void
+ltl_count(int cur, float aliveness, pix_t radius)
+{
+	kernel_data_t	*const	kd = &Ltl.mask_kernel;
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.arena[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.mask);
+	kernel_invoke(kd, 2, NULL, NULL);
+
+	box_blur(Ltl.mask, Ltl.density, radius, 1);
+}
+#else	/* HALF_STORAGE */
+/*
+ * Count the live cells around each cell of the arena at "cur" into
+ * Ltl.counts.
+ */
+static void
+ltl_count(int cur, float aliveness, pix_t radius)
+{
+	kernel_data_t	*kd;
+	int		iradius = radius;
+	size_t		global[2];
+	int		arg;
+
+	kd = &Ltl.rows_kernel;
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (int), &iradius);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.arena[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.rows);
+	global[0] = P2ROUNDUP((size_t)(Width + LTL_RUN - 1) / LTL_RUN,
+	    kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)Height, kd->kd_maxitems[1]);
+	kernel_invoke(kd, 2, global, NULL);
+
+	kd = &Ltl.cols_kernel;
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (int), &iradius);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.rows);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.counts);
+	global[0] = P2ROUNDUP((size_t)Width, kd->kd_maxitems[0]);
+	global[1] = P2ROUNDUP((size_t)(Height + LTL_RUN - 1) / LTL_RUN,
+	    kd->kd_maxitems[1]);
+	kernel_invoke(kd, 2, global, NULL);
+}
+#endif	/* HALF_STORAGE */
+
+static void
+ltl_step(cl_mem result)
+{
+	kernel_data_t		*const	kd = &Ltl.step_kernel;
+	float			aliveness = tweak_aliveness();
+	const pix_t		radius = tweak_radius();
+	int			neighborhood = (2 * radius + 1) *
+				    (2 * radius + 1);
+	const int		cur = (Ltl.steps & 1);
+	cl_int4			rule;
+	int			arg;
+
+	Ltl.steps++;
+
+	tweak_birth(neighborhood, &rule.s[0], &rule.s[1]);
+	tweak_survival(neighborhood, &rule.s[2], &rule.s[3]);
+
+	ltl_count(cur, aliveness, radius);
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (cl_int4), &rule);
+#ifndef	HALF_STORAGE
+	kernel_setarg(kd, arg++, sizeof (int), &neighborhood);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.density);
+#else
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.counts);
+#endif
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.arena[cur]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Ltl.arena[cur ^ 1]);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
+	kernel_invoke(kd, 2, NULL, NULL);
+
+	debug(DB_CORE, "r=%u birth=[%d %d] survival=[%d %d] of %d\n",
+	    radius, rule.s[0], rule.s[1], rule.s[2], rule.s[3], neighborhood);
+}
+
+static void
+ltl_render(cl_mem data, cl_mem image)
+{
+	kernel_data_t	*const	kd = &Ltl.render_kernel;
+	float			aliveness = tweak_aliveness();
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (float), &aliveness);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
+	kernel_invoke(kd, 2, NULL, NULL);
+}
+
+/*
+ * The current arena and the step count are the whole state; the counts (or
+ * the blurred mask) are rebuilt on every step.
+ */
+static void
+ltl_checkpoint(checkpoint_t *cp)
+{
+	const size_t	arenasize = (size_t)Width * Height * sizeof (float);
+
+	(void) checkpoint_value(cp, "ltl.steps", &Ltl.steps,
+	    sizeof (Ltl.steps));
+	(void) checkpoint_buffer(cp, "ltl.arena", Ltl.arena[Ltl.steps & 1],
+	    arenasize);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+ltl_preinit(void)
+{
+	Ltl.ops.name = "ltl";
+	Ltl.ops.unrender = ltl_unrender;
+	Ltl.ops.import = ltl_import;
+	Ltl.ops.step_and_export = ltl_step;
+	Ltl.ops.render = ltl_render;
+	Ltl.ops.min = ltl_min;
+	Ltl.ops.max = ltl_max;
+	Ltl.ops.datavec_shape = ltl_datavec_shape;
+	Ltl.ops.checkpoint = ltl_checkpoint;
+
+	tweak_preinit();
+
+	debug_register_toggle('c', "core algorithm", DB_CORE, NULL);
+}
+
+static void
+ltl_init(void)
+{
+	const size_t	arenasize = (size_t)Width * Height * sizeof (float);
+#ifndef	HALF_STORAGE
+	const size_t	masksize =
+			    (size_t)Width * Height * sizeof (cl_boxstore);
+#else
+	const size_t	countsize = (size_t)Width * Height * sizeof (cl_int);
+#endif
+
+	core_ops_register(&Ltl.ops);
+
+	for (int i = 0; i < sizeof (Ltl.arena) / sizeof (*Ltl.arena); i++) {
+		Ltl.arena[i] = buffer_alloc(arenasize);
+	}
+#ifndef	HALF_STORAGE
+	Ltl.mask = buffer_alloc(masksize);
+	Ltl.density = buffer_alloc(masksize);
+#else
+	Ltl.rows = buffer_alloc(countsize);
+	Ltl.counts = buffer_alloc(countsize);
+#endif
+
+	kernel_create(&Ltl.unrender_kernel, "unrender");
+	kernel_create(&Ltl.import_kernel, "import");
+#ifndef	HALF_STORAGE
+	kernel_create(&Ltl.mask_kernel, "alive_mask");
+#else
+	kernel_create(&Ltl.rows_kernel, "count_rows");
+	kernel_create(&Ltl.cols_kernel, "count_cols");
+#endif
+	kernel_create(&Ltl.step_kernel, "step_and_export");
+	kernel_create(&Ltl.render_kernel, "render");
+
+	Ltl.steps = 0;
+}
+
+static void
+ltl_fini(void)
+{
+	kernel_cleanup(&Ltl.render_kernel);
+	kernel_cleanup(&Ltl.step_kernel);
+#ifndef	HALF_STORAGE
+	kernel_cleanup(&Ltl.mask_kernel);
+#else
+	kernel_cleanup(&Ltl.cols_kernel);
+	kernel_cleanup(&Ltl.rows_kernel);
+#endif
+	kernel_cleanup(&Ltl.import_kernel);
+	kernel_cleanup(&Ltl.unrender_kernel);
+
+#ifndef	HALF_STORAGE
+	buffer_free(&Ltl.density);
+	buffer_free(&Ltl.mask);
+#else
+	buffer_free(&Ltl.counts);
+	buffer_free(&Ltl.rows);
+#endif
+	for (int i = 0; i < sizeof (Ltl.arena) / sizeof (*Ltl.arena); i++) {
+		buffer_free(&Ltl.arena[i]);
+	}
+
+	core_ops_unregister(&Ltl.ops);
+}
+
+const module_ops_t	core_ops = {
+	ltl_preinit,
+	ltl_init,
+	ltl_fini
+};
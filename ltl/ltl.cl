@@ -0,0 +1,245 @@
+/*
+ * ltl.cl - the computational kernels for Larger-than-Life.
+ */
+
+#include "shared.h"
+
+#define	WRAP(x,max)	(((x) + (max)) % (max))
+#define	IS_ALIVE(v)	((v) > (thresh))
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * This performs the inverse of the value-to-color mapping defined in render().
+ */
+__kernel void
+unrender(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	__read_only image2d_t	image,		/* in */
+	__write_only image2d_t	data)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	float		val;
+
+	if (X < W && Y < H) {
+		const float3	hsv = image_to_hsv(X, Y, image);
+
+		if (hsv.z < thresh) {
+			val = hsv.z;
+		} else {
+			const float	a = 1 - fmod(hsv.x / 0.7f, 1.0f);
+			val = a * (1 - thresh) + thresh;
+		}
+
+		/* Data and internal representation are in [0, 1]. */
+		write_imagef(data, (int2)(X, Y), val);
+	}
+}
+
+__kernel void
+import(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	__read_only image2d_t	src,		/* in */
+	__global float		*dst)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X < W && Y < H) {
+		dst[Y * W + X] = as_datavec(read_imagef(src, (int2)(X, Y)));
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+#ifndef	HALF_STORAGE
+/*
+ * Turn the arena into a mask that's 1 wherever a cell is alive, for the box
+ * blur to count.
+ */
+__kernel void
+alive_mask(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	__global float		*src,		/* in */
+	__global boxstore	*mask)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X < W && Y < H) {
+		const pix_t	pix = Y * W + X;
+
+		store_boxvector(IS_ALIVE(src[pix]) ? 1.0f : 0.0f, mask, pix);
+	}
+}
+#else	/* HALF_STORAGE */
+/*
+ * Count the live cells in the (2 * radius + 1) cells of the row around each
+ * cell, with a running sum over a run of LTL_RUN cells.
+ */
+__kernel void
+count_rows(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const int		radius,		/* in */
+	__global float		*src,		/* in */
+	__global int		*rows)		/* out */
+{
+	const pix_t	X0 = get_global_id(0) * LTL_RUN;
+	const pix_t	Y = get_global_id(1);
+
+	if (X0 >= W || Y >= H) {
+		return;
+	}
+
+	__global float	*const row = src + Y * W;
+	const pix_t	X1 = min(X0 + LTL_RUN, W);
+	int		sum = 0;
+
+	for (int x = (int)X0 - radius; x <= (int)X0 + radius; x++) {
+		sum += IS_ALIVE(row[WRAP(x, (int)W)]);
+	}
+	for (int x = X0; ; x++) {
+		rows[Y * W + x] = sum;
+		if (x + 1 == X1) {
+			break;
+		}
+		sum += IS_ALIVE(row[WRAP(x + radius + 1, (int)W)]);
+		sum -= IS_ALIVE(row[WRAP(x - radius, (int)W)]);
+	}
+}
+
+/*
+ * Add up the row counts in the (2 * radius + 1) rows around each cell, which
+ * gives the count for the whole neighborhood.
+ */
+__kernel void
+count_cols(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const int		radius,		/* in */
+	__global int		*rows,		/* in */
+	__global int		*counts)	/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y0 = get_global_id(1) * LTL_RUN;
+
+	if (X >= W || Y0 >= H) {
+		return;
+	}
+
+	const pix_t	Y1 = min(Y0 + LTL_RUN, H);
+	int		sum = 0;
+
+	for (int y = (int)Y0 - radius; y <= (int)Y0 + radius; y++) {
+		sum += rows[WRAP(y, (int)H) * W + X];
+	}
+	for (int y = Y0; ; y++) {
+		counts[y * W + X] = sum;
+		if (y + 1 == Y1) {
+			break;
+		}
+		sum += rows[WRAP(y + radius + 1, (int)H) * W + X];
+		sum -= rows[WRAP(y - radius, (int)H) * W + X];
+	}
+}
+#endif	/* HALF_STORAGE */
+
+/*
+ * Apply the rule to the number of live cells in each neighborhood (which
+ * includes the cell itself).  Normally that comes from "density", the box
+ * blur of the alive mask, i.e. the fraction of the (2 * radius + 1)^2
+ * neighborhood that's alive, so multiplying it by "neighborhood" gives back
+ * the count.  With HALF_STORAGE, the exact "counts" are used instead.
+ *
+ * Live cells age the same way they do in the Game of Life core.
+ */
+__kernel void
+step_and_export(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	const int4		rule,		/* in: birth, survival ranges */
+#ifndef	HALF_STORAGE
+	const int		neighborhood,	/* in */
+	__global boxstore	*density,	/* in */
+#else
+	__global int		*counts,	/* in */
+#endif
+	__global float		*src,		/* in */
+	__global float		*dst,		/* out */
+	__write_only image2d_t	result)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+
+	const pix_t	pix = Y * W + X;
+	const float	ov = src[pix];
+#ifndef	HALF_STORAGE
+	const int	count =
+	    (int)rint(load_boxvector(density, pix) * neighborhood);
+#else
+	const int	count = counts[pix];
+#endif
+	float		nv;
+
+	if (IS_ALIVE(ov)) {
+		if (count >= rule.z && count <= rule.w) {
+			nv = IS_ALIVE(ov - LIFE_UNIT) ? ov - LIFE_UNIT : ov;
+		} else {
+			nv = 0.0f;
+		}
+	} else if (count >= rule.x && count <= rule.y) {
+		nv = 1.0f;
+	} else {
+		nv = ov;
+	}
+
+	dst[pix] = nv;
+
+	write_imagef(result, (int2)(X, Y), nv);
+}
+
+__kernel void
+render(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	const float		thresh,		/* in */
+	__read_only image2d_t	data,		/* in */
+	__write_only image2d_t	image)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X < W && Y < H) {
+		const float	d =
+		    as_datavec(read_imagef(data, (int2)(X, Y)));
+		float3		hsv;
+
+		if (d < thresh) {
+			hsv = (float3)(0, 0, 0);
+		} else {
+			/*
+			 * As in the Game of Life core, new pixels are red,
+			 * and they move through the hues towards blue as
+			 * they age.
+			 */
+			const float	a = (d - thresh) / (1 - thresh);
+			const float	b = (1 - a) * 0.7f;
+			hsv = (float3)(b, 1, 1);
+		}
+
+		hsv_to_image(X, Y, hsv, image);
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef	_LTL_SHARED_H
+#define	_LTL_SHARED_H
+
+/*
+ * This header file is #include'd by both C and OpenCL code.
+ */
+
+/*
+ * Live cells age the same way they do in the Game of Life core.
+ */
+#include "../life/shared.h"
+
+/*
+ * With HALF_STORAGE, how many cells of a row (or column) each invocation of
+ * the counting kernels takes care of.  The first costs 2 * radius + 1 reads, and each of
+ * the rest costs two.
+ */
+#define	LTL_RUN		32
+
+#endif	/* _LTL_SHARED_H */
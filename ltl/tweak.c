@@ -0,0 +1,125 @@
+/*
+ * tweak.c - holds the policy parts of the Larger-than-Life algorithm.
+ */
+
+#include <stdlib.h>
+#include <strings.h>
+#include <math.h>
+
+#include "common.h"
+#include "keyboard.h"
+#include "param.h"
+#include "tweak.h"
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The tweakable parameters, and their default values.
+ *
+ * The birth and survival ranges are fractions of the neighborhood (which
+ * includes the cell itself), so that they keep roughly the same meaning as
+ * the radius changes.  The defaults are Bosco's Rule: radius 5, survival
+ * with 34-58 live cells out of 121, and birth with 34-45.
+ */
+static const param_init_t Param_values[] = {
+     /* min, def, max,  units,    freq,    rate, abbr, name */
+	{ 1,  50, 100,  0.01f, APF_OFF, APR_LOW, "AL", "aliveness" },
+	// Aliveness threshold.
+
+	{ 1,   5,  20,      1, APF_OFF, APR_LOW, "RA", "radius" },
+	// Radius of the neighborhood.
+
+	{ 0,  56, 200, 0.005f, APF_OFF, APR_LOW, "BL", "birthmin" },
+	{ 0,  75, 200, 0.005f, APF_OFF, APR_LOW, "BH", "birthmax" },
+	// Range of live fractions of the neighborhood that make a cell alive.
+
+	{ 0,  56, 200, 0.005f, APF_OFF, APR_LOW, "SL", "survivalmin" },
+	{ 0,  96, 200, 0.005f, APF_OFF, APR_LOW, "SH", "survivalmax" },
+	// Range of live fractions that keep a live cell alive.
+};
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The parameter IDs, used for calling into the param subsystem.
+ */
+static struct {
+	param_id_t	aliveness;
+	param_id_t	radius;
+	param_id_t	birthmin;
+	param_id_t	birthmax;
+	param_id_t	survivalmin;
+	param_id_t	survivalmax;
+} Params;
+
+void
+tweak_preinit(void)
+{
+	param_register_table(Param_values,
+	    sizeof (Param_values) / sizeof (*Param_values));
+
+	Params.aliveness = param_lookup("aliveness");
+	param_key_register('-', KB_DEFAULT, Params.aliveness, -1);
+	param_key_register('_', KB_DEFAULT, Params.aliveness, -1);
+	param_key_register('+', KB_DEFAULT, Params.aliveness,  1);
+	param_key_register('=', KB_DEFAULT, Params.aliveness,  1);
+
+	Params.radius = param_lookup("radius");
+	param_key_register('<', KB_DEFAULT, Params.radius, -1);
+	param_key_register(',', KB_DEFAULT, Params.radius, -1);
+	param_key_register('>', KB_DEFAULT, Params.radius,  1);
+	param_key_register('.', KB_DEFAULT, Params.radius,  1);
+
+	Params.birthmin = param_lookup("birthmin");
+	param_key_register('j', KB_DEFAULT, Params.birthmin, -1);
+	param_key_register('J', KB_DEFAULT, Params.birthmin,  1);
+	Params.birthmax = param_lookup("birthmax");
+	param_key_register('k', KB_DEFAULT, Params.birthmax, -1);
+	param_key_register('K', KB_DEFAULT, Params.birthmax,  1);
+
+	Params.survivalmin = param_lookup("survivalmin");
+	param_key_register('n', KB_DEFAULT, Params.survivalmin, -1);
+	param_key_register('N', KB_DEFAULT, Params.survivalmin,  1);
+	Params.survivalmax = param_lookup("survivalmax");
+	param_key_register('m', KB_DEFAULT, Params.survivalmax, -1);
+	param_key_register('M', KB_DEFAULT, Params.survivalmax,  1);
+}
+
+/* ------------------------------------------------------------------ */
+
+float
+tweak_aliveness(void)
+{
+	return (param_float(Params.aliveness));
+}
+
+pix_t
+tweak_radius(void)
+{
+	return ((pix_t)param_int(Params.radius));
+}
+
+/*
+ * Turn a range of fractions into an inclusive range of live cell counts
+ * out of "neighborhood".
+ */
+static void
+tweak_range(param_id_t lo, param_id_t hi, int neighborhood,
+    int *min, int *max)
+{
+	*min = (int)ceilf(param_float(lo) * neighborhood - 0.001f);
+	*max = (int)floorf(param_float(hi) * neighborhood + 0.001f);
+}
+
+void
+tweak_birth(int neighborhood, int *min, int *max)
+{
+	tweak_range(Params.birthmin, Params.birthmax, neighborhood, min, max);
+}
+
+void
+tweak_survival(int neighborhood, int *min, int *max)
+{
+	tweak_range(Params.survivalmin, Params.survivalmax, neighborhood,
+	    min, max);
+}
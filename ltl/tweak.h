@@ -0,0 +1,13 @@
+#ifndef	_TWEAK_H
+#define	_TWEAK_H
+
+#include "types.h"
+
+extern void	tweak_preinit(void);
+
+extern float	tweak_aliveness(void);
+extern pix_t	tweak_radius(void);
+extern void	tweak_birth(int neighborhood, int *min, int *max);
+extern void	tweak_survival(int neighborhood, int *min, int *max);
+
+#endif	/* _TWEAK_H */
@@ -0,0 +1,8 @@
+#ifndef	_VECSIZES_H
+#define	_VECSIZES_H
+
+#define	BOX_DIMENSIONS		1
+#define	DATA_DIMENSIONS		1
+#define	DATA_RANDOM_MAXOF	3	/* see vectypes.h */
+
+#endif	/* _VECSIZES_H */
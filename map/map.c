@@ -74,7 +74,6 @@ map_unrender(cl_mem image, cl_mem data)
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
-	kernel_wait();
 	kernel_invoke(kd, 2, NULL, NULL);
 }
 
@@ -122,6 +121,14 @@ map_render(cl_mem data, cl_mem image)
 	kernel_invoke(kd, 2, NULL, NULL);
 }
 
+static void
+map_checkpoint(checkpoint_t *cp)
+{
+	const size_t	datasize = (size_t)Width * Height * sizeof (cl_datavec);
+
+	(void) checkpoint_buffer(cp, "map.data", Map.data, datasize);
+}
+
 /* ------------------------------------------------------------------ */
 
 static void
@@ -130,6 +137,7 @@ map_preinit(void)
 	debug_register_toggle('c', "core algorithm", DB_CORE, NULL);
 	debug_register_toggle('P', "performance", DB_PERF, NULL);
 
+	Map.ops.name = "map";
 	Map.ops.unrender = map_unrender;
 	Map.ops.import = map_import;
 	Map.ops.step_and_export = map_export;
@@ -137,6 +145,7 @@ map_preinit(void)
 	Map.ops.min = map_min;
 	Map.ops.max = map_max;
 	Map.ops.datavec_shape = map_datavec_shape;
+	Map.ops.checkpoint = map_checkpoint;
 }
 
 static void
@@ -4,6 +4,7 @@
  * Yep, this is all it takes.  The Makefile pulls in multiscale.{c,cl} and
  * tweak.c from the 4-D MSTP implementation.
  */
+#include "../tc/msparams.h"
 
 __kernel void
 unrender(
@@ -27,21 +28,38 @@ import(
 	pix_t			W,		/* in */
 	pix_t			H,		/* in */
 	__read_only image2d_t	src,		/* in */
-	__global datavec	*dst)		/* out */
+	__global datastore	*dst)		/* out */
 {
 	const pix_t	X = get_global_id(0);
 	const pix_t	Y = get_global_id(1);
 
 	if (X < W && Y < H) {
-		dst[Y * W + X] = as_datavec(read_imagef(src, (int2)(X, Y)));
+		store_datavec(as_datavec(read_imagef(src, (int2)(X, Y))),
+		    dst, Y * W + X);
 	}
 }
 
+/*
+ * Render one data point.  This is also used by multiscale_render().
+ */
+static void
+render_datum(
+	const pix_t		X,
+	const pix_t		Y,
+	const int		rendertype,	/* ignored */
+	const datavec		datum,
+	const float		rs,		/* ignored */
+	__write_only image2d_t	image)
+{
+	/* Our data is in [-1, 1], but HSV values must be in [0, 1]. */
+	hsv_to_image(X, Y, (float3)(0, 0, (datum + 1) / 2), image);
+}
+
 __kernel void
 render(
 	pix_t			W,		/* in */
 	pix_t			H,		/* in */
-	int			rendertype,	/* ignored */
+	__constant ms_params_t	*params,	/* ignored */
 	__read_only image2d_t	data,		/* in */
 	__global float		*recentscale,	/* ignored */
 	__write_only image2d_t	image)		/* out */
@@ -50,8 +68,7 @@ render(
 	const pix_t	Y = get_global_id(1);
 
 	if (X < W && Y < H) {
-		/* Our data is in [-1, 1], but HSV values must be in [0, 1]. */
-		const float	v = as_datavec(read_imagef(data, (int2)(X, Y)));
-		hsv_to_image(X, Y, (float3)(0, 0, (v + 1) / 2), image);
+		render_datum(X, Y, 0,
+		    as_datavec(read_imagef(data, (int2)(X, Y))), 0.0f, image);
 	}
 }
@@ -0,0 +1,58 @@
+/*
+ * msparams.h - the block of parameters that the multiscale kernels read,
+ * shared between C and OpenCL.
+ *
+ * Everything about a step that comes from the tweakable parameters, rather
+ * than from the data, goes into one of these.  It's written into a
+ * __constant buffer before each step (see ms_params_update()), so that the
+ * kernels' arguments stay the same from one step to the next, no matter
+ * how the parameters change.
+ *
+ * In exploration mode (see explore.h), the buffer holds one of these for
+ * each instance, in order, and each pixel uses the one for its instance.
+ */
+
+#ifndef	_MSPARAMS_H
+#define	_MSPARAMS_H
+
+#define	NSCALES		9	/* number of scales to operate on */
+
+/*
+ * The bit of ms_rendertype that picks the fast rendering path, and how far
+ * off (in any RGB channel, in [0, 1]) that path is allowed to be from the
+ * precise one: half of an 8-bit step, so the displayed colors differ by
+ * at most one.
+ */
+#define	RENDER_FAST		2
+#define	RENDER_FAST_TOLERANCE	(0.5f / 255.0f)
+
+#ifdef	__OPENCL_VERSION__
+#define	MS_FLOAT	float
+#define	MS_INT		int
+#else
+#include "types.h"
+#define	MS_FLOAT	cl_float
+#define	MS_INT		cl_int
+#endif
+
+typedef struct {
+	MS_FLOAT	ms_adj[NSCALES - 1];	/* see tweak_multiscale_adj() */
+	MS_FLOAT	ms_maxadj;		/* largest of ms_adj[] */
+	MS_INT		ms_nscales;		/* see tweak_nscales() */
+	MS_INT		ms_rendertype;		/* see tweak_rendertype() */
+	MS_INT		ms_decim[NSCALES];	/* see box_decimation() */
+} ms_params_t;
+
+#undef	MS_FLOAT
+#undef	MS_INT
+
+#ifdef	__OPENCL_VERSION__
+/*
+ * The index of the block for pixel (X, Y) of a W-pixel-wide image.
+ */
+#define	MS_INSTANCE(X, Y, W)	(ZOUNDS_TILE == 0 ? 0 :			\
+	(Y) / max(ZOUNDS_TILE, 1) * ((W) / max(ZOUNDS_TILE, 1)) +	\
+	(X) / max(ZOUNDS_TILE, 1))
+#endif
+
+#endif	/* _MSPARAMS_H */
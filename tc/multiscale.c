@@ -34,27 +34,70 @@
  * Most of the tweakable bits (including the blur radii and the adjustment
  * values) are in tweak.c.
  *
+ * Keeping a blur around for every scale takes a lot of GPU memory at large
+ * image sizes, so there's also a "streaming" mode, which only keeps the
+ * current and previous blurs and folds each pair into a running best match;
+ * see ms_stream().  It's used when the batched buffers wouldn't comfortably
+ * fit on the GPU.
+ *
+ * When nothing but the display is going to look at the data that a step
+ * exports, the batched version can also render the displayed image in the
+ * same kernel, and skip writing out the data; see ms_step_and_render().
+ *
+ * The kernels get the step's parameters (the adjustment constants, the
+ * number of scales, and so on) from an ms_params_t in a __constant buffer;
+ * see ms_params_update().
+ *
+ * The largest scales change very little from one step to the next, so the
+ * "lazyscales" largest ones can be blurred only every "lazyperiod" steps,
+ * with the combining reusing their last blurs in between; see
+ * ms_lazy_mask().  With the "P" debug area on, how far those are from a
+ * fresh blur gets reported every MS_LAZY_CHECK_STEPS steps.
+ *
  * This code is also shared by the "mstp" core algorithm, which implements
  * McCabe's original black-and-white MSTP algorithm.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "common.h"
 
 #include "box.h"
 #include "core.h"
 #include "debug.h"
+#include "explore.h"
 #include "keyboard.h"
 #include "module.h"
 #include "opencl.h"
 #include "osdep.h"
 #include "param.h"
+#include "telemetry.h"
 #include "tweak.h"
 
 /* ------------------------------------------------------------------ */
 
 #define	NDATA		2	/* number of copies we keep */
+#define	NGRAPHS		32	/* recorded steps we keep; see ms_batch() */
+
+#define	MS_LAZY_CHECK_STEPS	64	/* how often to check lazy scales */
+
+/*
+ * Everything that a recorded step depends on, other than the contents of
+ * buffers; if any of this changes, the step has to be recorded again.
+ */
+typedef struct {
+	cl_mem		src;
+	cl_mem		result;
+	cl_mem		image;		/* if rendering in the same pass */
+	bool		export;
+	int		nscales;
+	int		nbox;
+	pix_t		radii[NSCALES];
+	unsigned	blurmask;	/* which scales get blurred */
+} ms_graph_key_t;
 
 static struct {
 	core_ops_t	ops;
@@ -64,13 +107,51 @@ static struct {
 	cl_mem		recentscale;		/* history of which scale */
 	int		steps;			/* number of steps taken */
 
+	/*
+	 * What each of blurdata[] is a blur of, for lazy scales; a radius of
+	 * 0 means it has to be blurred again.
+	 */
+	pix_t		blur_radius[NSCALES];
+	int		blur_nbox[NSCALES];
+	cl_mem		lazycheck;		/* for the DB_PERF check */
+
+	bool		streaming;		/* only keep two blurs */
+	cl_mem		bestlen;		/* streaming: min diff length */
+	cl_mem		bestvec;		/* streaming: min diff vector */
+	cl_mem		bestscale;		/* streaming: min diff scale */
+
 	kernel_data_t	render_kernel;
 	kernel_data_t	load_kernel;
 	kernel_data_t	unrender_kernel;
+#if	DATA_DIMENSIONS == 4
+	kernel_data_t	render_check_kernel;
+	bool		render_check;		/* check before next step */
+#endif
 
 	kernel_data_t	multiscale_kernel;
-	cl_mem		adj_gpu;		/* adjustment constants */
-	float		maxadj;			/* largest adj constant */
+	kernel_data_t	multiscale_render_kernel;
+	kernel_data_t	export_kernel;
+	kernel_data_t	fold_kernel;
+	kernel_data_t	apply_kernel;
+
+	/*
+	 * The parameter blocks.  Each parity of "steps" has its own, so the
+	 * recorded launches for each parity always use the same buffer, and
+	 * one can be rewritten while the GPU may still be reading the other.
+	 * params[] is what's been sent to each buffer, from memory that has
+	 * to be left alone until params_ev[] says the upload is done.  In
+	 * exploration mode, these hold a block for each instance.
+	 */
+	cl_mem		params_gpu[NDATA];
+	ms_params_t	*params[NDATA];		/* from host_alloc() */
+	cl_event	params_ev[NDATA];	/* last upload, if any */
+
+	/*
+	 * The recorded launches for each step of the cycle of data buffers
+	 * and lazy blurs; see ms_batch().
+	 */
+	kernel_graph_t	*graph[NGRAPHS];
+	ms_graph_key_t	graph_key[NGRAPHS];	/* what each was recorded for */
 } Multiscale;
 
 /* ------------------------------------------------------------------ */
@@ -102,6 +183,21 @@ ms_datavec_shape(void)
 	return (DATAVEC_SHAPE_SPHERE);
 }
 
+/*
+ * With the "speed" parameter at -1, every adjustment is 0, so a step
+ * leaves every data point exactly where it was (see multiscale_update()).
+ * The recent-scale history still moves, though, so this only counts as
+ * frozen if that isn't what's being rendered.  In exploration mode, each
+ * instance has its own parameters, so the whole atlas is never frozen.
+ */
+static bool
+ms_frozen(void)
+{
+	return (explore_tile() == 0 && Multiscale.steps > 0 &&
+	    tweak_multiscale_adj(0) == 0.0f &&
+	    (tweak_rendertype() & 1) == 0);
+}
+
 /* ------------------------------------------------------------------ */
 
 static void
@@ -115,7 +211,6 @@ ms_unrender(cl_mem image, cl_mem data)
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
-	kernel_wait();
 	kernel_invoke(kd, 2, NULL, NULL);
 }
 
@@ -134,13 +229,16 @@ ms_import(cl_mem src)
 	kernel_invoke(kd, 2, NULL, NULL);
 
 	const size_t		arraysize =
-	    (size_t)Width * Height * sizeof (cl_datavec);
+	    (size_t)Width * Height * sizeof (cl_datastore);
 	buffer_copy(Multiscale.data[0], Multiscale.data[1], arraysize);
+
+	bzero(Multiscale.blur_radius, sizeof (Multiscale.blur_radius));
 }
 
 static void
 ms_combine_and_export(
 	cl_mem *densities,
+	cl_mem params,
 	cl_mem odata,
 	cl_mem ndata,
 	int nscales,
@@ -155,8 +253,7 @@ ms_combine_and_export(
 	for (i = 0; i < NSCALES; i++, arg++) {
 		kernel_setarg(kd, arg, sizeof (cl_mem), &densities[i]);
 	}
-	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.adj_gpu);
-	kernel_setarg(kd, arg++, sizeof (float), &Multiscale.maxadj);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &params);
 	kernel_setarg(kd, arg++, sizeof (int), &nscales);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &odata);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &ndata);
@@ -165,109 +262,577 @@ ms_combine_and_export(
 	kernel_invoke(kd, 2, NULL, NULL);
 }
 
+/*
+ * ms_combine_and_export() and ms_render() in one pass.  "result" is only
+ * written if "export" is set.
+ */
+static void
+ms_combine_and_render(
+	cl_mem *densities,
+	cl_mem params,
+	cl_mem odata,
+	cl_mem ndata,
+	int nscales,
+	cl_mem result,
+	bool export,
+	cl_mem image)
+{
+	kernel_data_t	*const	kd = &Multiscale.multiscale_render_kernel;
+	int			exportdata = export;
+	int			arg, i;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	for (i = 0; i < NSCALES; i++, arg++) {
+		kernel_setarg(kd, arg, sizeof (cl_mem), &densities[i]);
+	}
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &params);
+	kernel_setarg(kd, arg++, sizeof (int), &nscales);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &odata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &ndata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.recentscale);
+	kernel_setarg(kd, arg++, sizeof (int), &exportdata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
+	kernel_invoke(kd, 2, NULL, NULL);
+}
+
+/*
+ * Fill in the data that ms_combine_and_render() skipped, for the most
+ * recent step.
+ */
+static void
+ms_export(cl_mem result)
+{
+	kernel_data_t	*const	kd = &Multiscale.export_kernel;
+	const int		parity = (Multiscale.steps & 1);
+	cl_mem			odata = Multiscale.data[!parity];
+	cl_mem			ndata = Multiscale.data[parity];
+	int			arg;
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &odata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &ndata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
+	kernel_invoke(kd, 2, NULL, NULL);
+}
+
+/*
+ * Blur one scale for ms_stream().  When telemetry is on, this is the only
+ * place where the blur at each scale can be timed by itself.
+ */
+static void
+ms_stream_blur(cl_mem src, cl_mem dst, int sc, int nbox, int factor)
+{
+	const hrtime_t	tm = telemetry_start();
+
+	box_blur_decimated(src, dst, tweak_box_radius(sc), nbox, factor);
+	if (tm != 0) {
+		kernel_wait();
+		telemetry_stop_scale(sc, tm);
+	}
+}
+
+/*
+ * The streaming version of the blur-and-combine: blur one scale at a time,
+ * and fold each adjacent pair of blurs into the running best match.
+ */
+static void
+ms_stream(cl_mem params, cl_mem odata, cl_mem ndata, int nscales, int nbox,
+    cl_mem result)
+{
+	kernel_data_t	*kd;
+	cl_mem		prev = Multiscale.blurdata[0];
+	cl_mem		cur = Multiscale.blurdata[1];
+	int		prevf, curf;
+	int		arg;
+
+	prevf = box_decimation(tweak_box_radius(0));
+	ms_stream_blur(odata, prev, 0, nbox, prevf);
+
+	kd = &Multiscale.fold_kernel;
+	for (int sc = 1; sc < nscales; sc++) {
+		const cl_mem	tmp = prev;
+
+		curf = box_decimation(tweak_box_radius(sc));
+		ms_stream_blur(odata, cur, sc, nbox, curf);
+
+		arg = 0;
+		kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+		kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &prev);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &cur);
+		kernel_setarg(kd, arg++, sizeof (int), &sc);
+		kernel_setarg(kd, arg++, sizeof (int), &prevf);
+		kernel_setarg(kd, arg++, sizeof (int), &curf);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.bestlen);
+		kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.bestvec);
+		kernel_setarg(kd, arg++, sizeof (cl_mem),
+		    &Multiscale.bestscale);
+		kernel_invoke(kd, 2, NULL, NULL);
+
+		prev = cur;
+		prevf = curf;
+		cur = tmp;
+	}
+
+	kd = &Multiscale.apply_kernel;
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.bestlen);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.bestvec);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.bestscale);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &params);
+	kernel_setarg(kd, arg++, sizeof (int), &nscales);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &odata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &ndata);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.recentscale);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &result);
+	kernel_invoke(kd, 2, NULL, NULL);
+}
+
+/*
+ * Fill in "p" from the current parameters.
+ *
+ * If the blur pyramid is enabled, some scales are blurred on a decimated
+ * grid, and the multiscale kernel needs to know which ones; that's in the
+ * block too.
+ */
+static void
+ms_params_fill(ms_params_t *p)
+{
+	const int	nscales = tweak_nscales();
+
+	bzero(p, sizeof (*p));
+	for (int i = 0; i < NSCALES - 1; i++) {
+		p->ms_adj[i] = tweak_multiscale_adj(i);
+		p->ms_maxadj = MAX(p->ms_adj[i], p->ms_maxadj);
+	}
+	p->ms_nscales = nscales;
+	p->ms_rendertype = tweak_rendertype();
+	for (int sc = 0; sc < NSCALES; sc++) {
+		p->ms_decim[sc] =
+		    (sc < nscales ? box_decimation(tweak_box_radius(sc)) : 1);
+	}
+}
+
+/*
+ * The explore_foreach() callback, for filling in each instance's block.
+ */
+static void
+ms_params_fill_instance(int i, void *arg)
+{
+	ms_params_fill((ms_params_t *)arg + i);
+}
+
+/*
+ * Bring parameter block "slot" up to date, and return its buffer.  If
+ * nothing has changed since it was last sent, this does nothing; during
+ * autopilot ramps, something changes on most steps, but the upload doesn't
+ * wait, and it's queued up ahead of the kernels that need it.
+ *
+ * In exploration mode, each instance's parameters are fixed, so the blocks
+ * were sent once and for all by multiscale_init().
+ */
+static cl_mem
+ms_params_update(int slot)
+{
+	ms_params_t	p;
+
+	if (explore_tile() != 0) {
+		return (Multiscale.params_gpu[slot]);
+	}
+	ms_params_fill(&p);
+
+	if (memcmp(&p, Multiscale.params[slot], sizeof (p)) != 0) {
+		if (Multiscale.params_ev[slot] != NULL) {
+			opencl_marker_wait(Multiscale.params_ev[slot]);
+		}
+		*Multiscale.params[slot] = p;
+		Multiscale.params_ev[slot] = buffer_writetogpu_async(
+		    Multiscale.params[slot], Multiscale.params_gpu[slot],
+		    sizeof (p));
+	}
+
+	return (Multiscale.params_gpu[slot]);
+}
+
 static void
 ms_render(cl_mem data, cl_mem image)
 {
 	kernel_data_t	*const	kd = &Multiscale.render_kernel;
-	int			rendertype = tweak_rendertype();
+	cl_mem			params =
+	    ms_params_update(Multiscale.steps & 1);
 	int			arg;
 
 	arg = 0;
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
 	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
-	kernel_setarg(kd, arg++, sizeof (int), &rendertype);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &params);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &Multiscale.recentscale);
 	kernel_setarg(kd, arg++, sizeof (cl_mem), &image);
 	kernel_invoke(kd, 2, NULL, NULL);
 }
 
+#if	DATA_DIMENSIONS == 4
+/*
+ * Compare the fast rendering path against the precise one on the current
+ * data, and report how far apart they are.  This is asked for with "D r",
+ * but it's done at the start of the next step, on the stepping thread.
+ */
+static void
+ms_render_check_request(void)
+{
+	Multiscale.render_check = true;
+}
+
+static void
+ms_render_check(cl_mem data)
+{
+	kernel_data_t	*const	kd = &Multiscale.render_check_kernel;
+	cl_mem			maxerr;
+	cl_int			bits = 0;
+	float			err;
+	int			arg;
+
+	Multiscale.render_check = false;
+
+	maxerr = buffer_alloc(sizeof (cl_int));
+	buffer_writetogpu(&bits, maxerr, sizeof (bits));
+
+	arg = 0;
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Width);
+	kernel_setarg(kd, arg++, sizeof (pix_t), &Height);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &data);
+	kernel_setarg(kd, arg++, sizeof (cl_mem), &maxerr);
+	kernel_invoke(kd, 2, NULL, NULL);
+
+	buffer_readfromgpu(maxerr, &bits, sizeof (bits));
+	buffer_free(&maxerr);
+	memcpy(&err, &bits, sizeof (err));
+
+	note("Fast rendering is off by at most %.5f (%.2f 8-bit steps); "
+	    "the tolerance is %.5f, so it %s\n", err, err * 255.0f,
+	    RENDER_FAST_TOLERANCE,
+	    (err <= RENDER_FAST_TOLERANCE ? "passes" : "FAILS"));
+}
+#endif
+
 /* ------------------------------------------------------------------ */
 
 /*
  * A callback that gets invoked when the "adjtype" or "speed" parameters
- * change. This adjusts the constants used by the OpenCL kernels.
+ * change.  The new constants get to the OpenCL kernels with the next
+ * step's parameter block; this just reports them.
  */
 void
 multiscale_adjust(void)
 {
-	const int	ndiff = NSCALES - 1;
-	float		adj[NSCALES - 1];
-
-	Multiscale.maxadj = 0;
-	for (int i = 0; i < ndiff; i++) {
-		adj[i] = tweak_multiscale_adj(i);
-		Multiscale.maxadj = MAX(adj[i], Multiscale.maxadj);
-	}
 	debug(DB_CORE, "Setting adj weights: [");
-	for (int i = 0; i < ndiff; i++) {
-		debug(DB_CORE, " %.3f", adj[i]);
+	for (int i = 0; i < NSCALES - 1; i++) {
+		debug(DB_CORE, " %.3f", tweak_multiscale_adj(i));
 	}
 	debug(DB_CORE, " ]\n");
-	buffer_writetogpu(adj, Multiscale.adj_gpu, ndiff * sizeof (float));
 }
 
 /*
- * The Multi-Scale Turing Patterns algorithm.
+ * Which scales need to be blurred this step, as a bitmask.  The largest
+ * "lazyscales" scales (the lowest-numbered ones) are only blurred every
+ * "lazyperiod" steps, staggered so that they don't all come due on the
+ * same step, or when their last blur was at a different radius or had a
+ * different number of passes.  In streaming mode, there's nowhere to keep
+ * the blurs, so every scale is blurred.
+ */
+static unsigned
+ms_lazy_mask(const pix_t *radii, int nscales, int nbox)
+{
+	const int	lazy = (Multiscale.streaming ? 0 : tweak_lazy_scales());
+	const int	period = tweak_lazy_period();
+	unsigned	mask = 0;
+
+	for (int sc = 0; sc < nscales; sc++) {
+		if (sc >= lazy || (Multiscale.steps + sc) % period == 0 ||
+		    Multiscale.blur_radius[sc] != radii[sc] ||
+		    Multiscale.blur_nbox[sc] != nbox) {
+			mask |= (1U << sc);
+			Multiscale.blur_radius[sc] = radii[sc];
+			Multiscale.blur_nbox[sc] = nbox;
+		}
+	}
+
+	return (mask);
+}
+
+/*
+ * Blur "src" into blurdata[] at each of the scales in "mask".
  */
 static void
-ms_step(cl_mem result)
+ms_blur(cl_mem src, const pix_t *radii, int nscales, int nbox, unsigned mask)
+{
+	cl_mem	bdst[NSCALES];
+	pix_t	bradii[NSCALES];
+	int	nb = 0;
+
+	for (int sc = 0; sc < nscales; sc++) {
+		if (mask & (1U << sc)) {
+			bdst[nb] = Multiscale.blurdata[sc];
+			bradii[nb] = radii[sc];
+			nb++;
+		}
+	}
+
+	if (nb > 0) {
+		box_blur_multi(src, bdst, bradii, nb, nbox);
+	}
+}
+
+/*
+ * For the "P" debug area: how far are the blurs that this step is reusing
+ * from what a full recompute would give?
+ */
+static void
+ms_lazy_check(cl_mem src, const pix_t *radii, int nscales, int nbox,
+    unsigned mask)
+{
+	double	worst = 0;
+
+	if (Multiscale.lazycheck == NULL) {
+		Multiscale.lazycheck =
+		    buffer_alloc((size_t)Width * Height * sizeof (cl_boxstore));
+	}
+
+	for (int sc = 0; sc < nscales; sc++) {
+		const int	f = box_decimation(radii[sc]);
+
+		if (mask & (1U << sc)) {
+			continue;
+		}
+		box_blur_multi(src, &Multiscale.lazycheck, &radii[sc], 1, nbox);
+		worst = MAX(worst, box_max_difference(Multiscale.lazycheck,
+		    Multiscale.blurdata[sc],
+		    (size_t)(Width / f) * (Height / f)));
+	}
+
+	verbose(DB_PERF, "Lazy scales: largest deviation from a full blur "
+	    "is %g\n", worst);
+}
+
+/*
+ * The batched version of the algorithm: blur at every scale in "mask", and
+ * then use the blurs to determine how to update each pixel.  After the
+ * first time, the whole sequence of kernel launches can usually just be
+ * replayed.
+ *
+ * The data buffers alternate from step to step, and the lazy scales come
+ * due every "lazyperiod" steps, so the steps go around in a cycle as long as
+ * both of those together; each step of the cycle gets its own recording.
+ * (With the biggest lazyperiod, that's 30 of them.)
+ */
+static void
+ms_batch(cl_mem src, cl_mem dst, const pix_t *radii, int nscales, int nbox,
+    unsigned mask, cl_mem result, cl_mem image, bool export)
+{
+	const int	parity = (Multiscale.steps & 1);
+	const int	period = tweak_lazy_period();
+	const int	cycle = (Multiscale.streaming ||
+			    tweak_lazy_scales() == 0) ? 2 :
+			    (period % 2 == 0 ? period : 2 * period);
+	const int	slot = (Multiscale.steps % cycle) % NGRAPHS;
+	kernel_graph_t	*g = Multiscale.graph[slot];
+	const cl_mem	params = Multiscale.params_gpu[parity];
+	ms_graph_key_t	key;
+
+	bzero(&key, sizeof (key));
+	key.src = src;
+	key.result = result;
+	key.image = image;
+	key.export = export;
+	key.nscales = nscales;
+	key.nbox = nbox;
+	memcpy(key.radii, radii, nscales * sizeof (pix_t));
+	key.blurmask = mask;
+
+	if (memcmp(&key, &Multiscale.graph_key[slot], sizeof (key)) == 0 &&
+	    kernel_graph_replay(g)) {
+		return;
+	}
+
+	kernel_graph_record(g);
+	ms_blur(src, radii, nscales, nbox, mask);
+	if (image != NULL) {
+		ms_combine_and_render(Multiscale.blurdata, params, src, dst,
+		    nscales, result, export, image);
+	} else {
+		ms_combine_and_export(Multiscale.blurdata, params, src, dst,
+		    nscales, result);
+	}
+	if (kernel_graph_end(g)) {
+		Multiscale.graph_key[slot] = key;
+	} else {
+		bzero(&Multiscale.graph_key[slot], sizeof (key));
+	}
+}
+
+/*
+ * The Multi-Scale Turing Patterns algorithm.  If "image" isn't NULL, this
+ * also renders the result into it, and only writes "result" if "export"
+ * is set.
+ */
+static void
+ms_step_common(cl_mem result, cl_mem image, bool export)
 {
 	const int	nscales = tweak_nscales();
 	const int	nbox = tweak_nbox();
 	cl_mem		src = Multiscale.data[(Multiscale.steps & 1)];
 	cl_mem		dst = Multiscale.data[!(Multiscale.steps & 1)];
+	cl_mem		params;
+	pix_t		radii[NSCALES];
+	unsigned	mask;
+	char		spec[128];
+
+#if	DATA_DIMENSIONS == 4
+	if (Multiscale.render_check) {
+		ms_render_check(src);
+	}
+#endif
 
 	Multiscale.steps++;
+	params = ms_params_update(Multiscale.steps & 1);
 
 	/*
-	 * If we're not measuring performance, don't add in any extra
-	 * calls to kernel_wait().
+	 * Once this configuration has been stable for a while, the kernels
+	 * get rebuilt with these values as compile-time constants.
 	 */
-	if (!debug_enabled(DB_PERF)) {
-		/*
-		 * Do a box blur at each scale.  Changing the number of
-		 * box blur passes yields visually interesting results.
-		 */
-		for (int sc = 0; sc < nscales; sc++) {
-			const pix_t	radius = tweak_box_radius(sc);
+	(void) snprintf(spec, sizeof (spec), "-DZOUNDS_W=%u -DZOUNDS_H=%u "
+	    "-DZOUNDS_NSCALES=%d -DZOUNDS_NBOX=%d",
+	    Width, Height, nscales, nbox);
+	opencl_specialize(spec);
+
+	/*
+	 * Do a box blur at each scale.  Changing the number of box blur
+	 * passes yields visually interesting results.  All of the scales
+	 * are blurred from the same source, so unless we're streaming, this
+	 * is done as one batch.
+	 */
+	for (int sc = 0; sc < nscales; sc++) {
+		radii[sc] = tweak_box_radius(sc);
+	}
+	mask = ms_lazy_mask(radii, nscales, nbox);
 
-			box_blur(src, Multiscale.blurdata[sc], radius, nbox);
+	/*
+	 * If we're not measuring performance, either for DB_PERF or for
+	 * telemetry, don't add in any extra calls to kernel_wait().
+	 */
+	if (!debug_enabled(DB_PERF) && telemetry_start() == 0) {
+		if (Multiscale.streaming) {
+			ms_stream(params, src, dst, nscales, nbox, result);
+			if (image != NULL) {
+				ms_render(result, image);
+			}
+			return;
 		}
 
-		/*
-		 * Use the box blurs to determine how to update each pixel.
-		 */
-		ms_combine_and_export(Multiscale.blurdata,
-		    src, dst, nscales, result);
+		ms_batch(src, dst, radii, nscales, nbox, mask, result, image,
+		    export);
 	} else {
 		hrtime_t	t[3];
-		t[0] = gethrtime();
+		hrtime_t	tm;
+
+		if (debug_enabled(DB_PERF) && mask != (1U << nscales) - 1 &&
+		    Multiscale.steps % MS_LAZY_CHECK_STEPS == 0) {
+			ms_lazy_check(src, radii, nscales, nbox, mask);
+		}
 
-		for (int sc = 0; sc < nscales; sc++) {
-			const pix_t	radius = tweak_box_radius(sc);
-			cl_mem		bsrc, bdst;
-			hrtime_t	u;
+		t[0] = gethrtime();
+		tm = telemetry_start();
 
-			u = gethrtime();
-			box_blur(src, Multiscale.blurdata[sc], radius, nbox);
+		/*
+		 * In streaming mode, the blurs and the combining are
+		 * interleaved, so it all gets charged to the blurs.
+		 */
+		if (Multiscale.streaming) {
+			ms_stream(params, src, dst, nscales, nbox, result);
 			kernel_wait();
+			telemetry_stop(TM_BLUR, tm);
+			t[1] = gethrtime();
+		} else {
+			ms_blur(src, radii, nscales, nbox, mask);
+			kernel_wait();
+			telemetry_stop(TM_BLUR, tm);
 
-			u = gethrtime() - u;
-			debug(DB_PERF, "%5.2lf ", (double)u / 1000000.0);
-		}
-
-		t[1] = gethrtime();
+			t[1] = gethrtime();
+			tm = telemetry_start();
 
-		ms_combine_and_export(Multiscale.blurdata,
-		    src, dst, nscales, result);
-		kernel_wait();
+			ms_combine_and_export(Multiscale.blurdata, params,
+			    src, dst, nscales, result);
+			kernel_wait();
+			telemetry_stop(TM_COMBINE, tm);
+		}
 
 		t[2] = gethrtime();
 
-		debug(DB_PERF, " | %5.2lf | %7.2lf",
+		debug(DB_PERF, "%5.2lf | %5.2lf | %7.2lf",
+		    (double)(t[1] - t[0]) / 1000000.0,
 		    (double)(t[2] - t[1]) / 1000000.0,
 		    (double)(t[2] - t[0]) / 1000000.0);
+
+		/*
+		 * Keep the timings comparable with the unfused version.
+		 */
+		if (image != NULL) {
+			tm = telemetry_start();
+			ms_render(result, image);
+			if (tm != 0) {
+				kernel_wait();
+				telemetry_stop(TM_RENDER, tm);
+			}
+		}
+	}
+}
+
+static void
+ms_step(cl_mem result)
+{
+	ms_step_common(result, NULL, true);
+}
+
+static void
+ms_step_and_render(cl_mem result, cl_mem image, bool export)
+{
+	ms_step_common(result, image, export);
+}
+
+/*
+ * The data buffers, the scale history, and the step count are the whole
+ * state; everything else is rebuilt from them on every step.
+ */
+static void
+ms_checkpoint(checkpoint_t *cp)
+{
+	const size_t	datasize =
+	    (size_t)Width * Height * sizeof (cl_datastore);
+	const size_t	scalesize =
+	    (size_t)Width * Height * sizeof (float);
+
+	for (int nd = 0; nd < NDATA; nd++) {
+		char	name[16];
+
+		(void) snprintf(name, sizeof (name), "ms.data%d", nd);
+		(void) checkpoint_buffer(cp, name, Multiscale.data[nd],
+		    datasize);
+	}
+	(void) checkpoint_buffer(cp, "ms.recentscale", Multiscale.recentscale,
+	    scalesize);
+	(void) checkpoint_value(cp, "ms.steps", &Multiscale.steps,
+	    sizeof (Multiscale.steps));
+
+	if (checkpoint_restoring(cp)) {
+		bzero(Multiscale.blur_radius, sizeof (Multiscale.blur_radius));
 	}
 }
 
@@ -278,15 +843,25 @@ ms_preinit(void)
 {
 	debug_register_toggle('c', "core algorithm", DB_CORE, NULL);
 	debug_register_toggle('P', "performance", DB_PERF, NULL);
+#if	DATA_DIMENSIONS == 4
+	debug_register_toggle('r', "fast render check", 0,
+	    ms_render_check_request);
+#endif
 
+	Multiscale.ops.name = "multiscale";
 	Multiscale.ops.unrender = ms_unrender;
 	Multiscale.ops.import = ms_import;
 	Multiscale.ops.step_and_export = ms_step;
 	Multiscale.ops.render = ms_render;
+	Multiscale.ops.step_and_render = ms_step_and_render;
+	Multiscale.ops.export = ms_export;
 	Multiscale.ops.min = ms_min;
 	Multiscale.ops.max = ms_max;
 	Multiscale.ops.datavec_shape = ms_datavec_shape;
+	Multiscale.ops.checkpoint = ms_checkpoint;
+	Multiscale.ops.frozen = ms_frozen;
 
+	explore_supported();
 	tweak_preinit();
 }
 
@@ -294,28 +869,83 @@ static void
 ms_init(void)
 {
 	const size_t	boxsize =
-	    (size_t)Width * Height * sizeof (cl_boxvector);
+	    (size_t)Width * Height * sizeof (cl_boxstore);
 	const size_t	datasize =
-	    (size_t)Width * Height * sizeof (cl_datavec);
+	    (size_t)Width * Height * sizeof (cl_datastore);
 	const size_t	scalesize =
 	    (size_t)Width * Height * sizeof (float);
+	int		nblur;
 
 	core_ops_register(&Multiscale.ops);
 
+	/*
+	 * The batched mode needs a blur buffer per scale, on top of the data
+	 * buffers and the blur's own scratch space.  If that would take more
+	 * than half of the GPU's memory, switch to streaming mode, which only
+	 * needs two blur buffers plus the running best match.  (The other
+	 * half is left for the textures, the summed-area table, and whatever
+	 * else the driver needs.)
+	 */
+	Multiscale.streaming = ((uint64_t)(NSCALES + 1) * boxsize +
+	    (uint64_t)NDATA * datasize + scalesize >
+	    opencl_device_globalmem() / 2);
+	nblur = (Multiscale.streaming ? 2 : NSCALES);
+	if (Multiscale.streaming) {
+		verbose(DB_CORE, "Using streaming multiscale mode "
+		    "to save GPU memory\n");
+		Multiscale.bestlen = buffer_alloc(scalesize);
+		Multiscale.bestvec = buffer_alloc(boxsize);
+		Multiscale.bestscale = buffer_alloc(
+		    (size_t)Width * Height * sizeof (cl_int));
+	}
+
 	for (int sc = 0; sc < NSCALES; sc++) {
-		Multiscale.blurdata[sc] = buffer_alloc(boxsize);
+		Multiscale.blurdata[sc] =
+		    (sc < nblur ? buffer_alloc(boxsize) : NULL);
 	}
 	for (int nd = 0; nd < NDATA; nd++) {
 		Multiscale.data[nd] = buffer_alloc(datasize);
 	}
 	Multiscale.recentscale = buffer_alloc(scalesize);
+	bzero(Multiscale.blur_radius, sizeof (Multiscale.blur_radius));
+	Multiscale.lazycheck = NULL;
 
 	kernel_create(&Multiscale.unrender_kernel, "unrender");
 	kernel_create(&Multiscale.load_kernel, "import");
 	kernel_create(&Multiscale.multiscale_kernel, "multiscale");
+	kernel_create(&Multiscale.multiscale_render_kernel,
+	    "multiscale_render");
+	kernel_create(&Multiscale.export_kernel, "multiscale_export");
+	kernel_create(&Multiscale.fold_kernel, "multiscale_fold");
+	kernel_create(&Multiscale.apply_kernel, "multiscale_apply");
 	kernel_create(&Multiscale.render_kernel, "render");
+#if	DATA_DIMENSIONS == 4
+	kernel_create(&Multiscale.render_check_kernel, "render_check");
+#endif
+
+	/*
+	 * The blocks start out zeroed, which no real set of parameters
+	 * matches, so the first ms_params_update() for each sends it.
+	 */
+	for (int nd = 0; nd < NDATA; nd++) {
+		const size_t	psize = explore_count() * sizeof (ms_params_t);
+
+		Multiscale.params_gpu[nd] = buffer_alloc(psize);
+		Multiscale.params[nd] = host_alloc(psize);
+		bzero(Multiscale.params[nd], psize);
+		Multiscale.params_ev[nd] = NULL;
+		if (explore_tile() != 0) {
+			explore_foreach(ms_params_fill_instance,
+			    Multiscale.params[nd]);
+			buffer_writetogpu(Multiscale.params[nd],
+			    Multiscale.params_gpu[nd], psize);
+		}
+	}
 
-	Multiscale.adj_gpu = buffer_alloc(NSCALES * sizeof (float));
+	for (int g = 0; g < NGRAPHS; g++) {
+		Multiscale.graph[g] = kernel_graph_create();
+		bzero(&Multiscale.graph_key[g], sizeof (ms_graph_key_t));
+	}
 
 	tweak_init();
 }
@@ -325,10 +955,27 @@ ms_fini(void)
 {
 	tweak_fini();
 
+	for (int g = 0; g < NGRAPHS; g++) {
+		kernel_graph_destroy(&Multiscale.graph[g]);
+	}
+	kernel_cleanup(&Multiscale.apply_kernel);
+	kernel_cleanup(&Multiscale.fold_kernel);
+	kernel_cleanup(&Multiscale.export_kernel);
+	kernel_cleanup(&Multiscale.multiscale_render_kernel);
 	kernel_cleanup(&Multiscale.multiscale_kernel);
-	buffer_free(&Multiscale.adj_gpu);
+	for (int nd = 0; nd < NDATA; nd++) {
+		if (Multiscale.params_ev[nd] != NULL) {
+			opencl_marker_wait(Multiscale.params_ev[nd]);
+			Multiscale.params_ev[nd] = NULL;
+		}
+		host_free((void **)&Multiscale.params[nd]);
+		buffer_free(&Multiscale.params_gpu[nd]);
+	}
 
 	kernel_cleanup(&Multiscale.render_kernel);
+#if	DATA_DIMENSIONS == 4
+	kernel_cleanup(&Multiscale.render_check_kernel);
+#endif
 	kernel_cleanup(&Multiscale.load_kernel);
 	kernel_cleanup(&Multiscale.unrender_kernel);
 
@@ -337,7 +984,17 @@ ms_fini(void)
 		buffer_free(&Multiscale.data[nd]);
 	}
 	for (int sc = 0; sc < NSCALES; sc++) {
-		buffer_free(&Multiscale.blurdata[sc]);
+		if (Multiscale.blurdata[sc] != NULL) {
+			buffer_free(&Multiscale.blurdata[sc]);
+		}
+	}
+	if (Multiscale.lazycheck != NULL) {
+		buffer_free(&Multiscale.lazycheck);
+	}
+	if (Multiscale.streaming) {
+		buffer_free(&Multiscale.bestscale);
+		buffer_free(&Multiscale.bestvec);
+		buffer_free(&Multiscale.bestlen);
 	}
 
 	core_ops_unregister(&Multiscale.ops);
@@ -4,75 +4,86 @@
  *
  * The rendering/unrendering/importing code is in render.cl, since the 1-D
  * version uses a fundamentally different mapping from data point to color.
+ *
+ * The tweakable parameters for a step come in an ms_params_t (see
+ * msparams.h), rather than as separate arguments.  "nscales" is still
+ * passed separately, so that it can be specialized.  In exploration mode,
+ * each instance has its own ms_params_t; see MS_INSTANCE().
  */
-__kernel void
-multiscale(
-	const pix_t		W,		/* in */
-	const pix_t		H,		/* in */
-	__global boxvector	*d0,		/* in */
-	__global boxvector	*d1,		/* in */
-	__global boxvector	*d2,		/* in */
-	__global boxvector	*d3,		/* in */
-	__global boxvector	*d4,		/* in */
-	__global boxvector	*d5,		/* in */
-	__global boxvector	*d6,		/* in */
-	__global boxvector	*d7,		/* in */
-	__global boxvector	*d8,		/* in */
-	__global float		*adj,		/* in */
-	const float		maxadj,		/* in */
-	const int		nscales,	/* in */
-	__global datavec	*odata,		/* in */
-	__global datavec	*ndata,		/* out */
-	__global float		*recentscale,	/* in/out */
-	__write_only image2d_t	result)		/* out */
+#include "msparams.h"
+
+/*
+ * Load the blur "d" at pixel (X, Y).  If the blur was done on a grid that
+ * was decimated by "f" (see box_decimation()), interpolate bilinearly
+ * between the four nearest pixels of the decimated grid.  The image wraps
+ * around at the edges, just like the blur does.
+ */
+static boxvector
+multiscale_sample(
+	__global boxstore	*d,
+	const int		f,
+	const pix_t		X,
+	const pix_t		Y,
+	const pix_t		W,
+	const pix_t		H)
 {
-	const pix_t		X = get_global_id(0);
-	const pix_t		Y = get_global_id(1);
-	const pix_t		p = Y * W + X;
-	__global boxvector	*const	densities[9] =
-	    { d0, d1, d2, d3, d4, d5, d6, d7, d8 };
+	if (f == 1) {
+		return (load_boxvector(d, Y * W + X));
+	}
 
-	boxvector		o, n, diff, tgtv;
-	datavec			od, nd;
-	float			minlen, len;
-	int			s, tgts;
+	const pix_t	w = W / f;
+	const pix_t	h = H / f;
+	const float	fx = ((float)X + 0.5f) / (float)f - 0.5f;
+	const float	fy = ((float)Y + 0.5f) / (float)f - 0.5f;
+	const float	x0f = floor(fx);
+	const float	y0f = floor(fy);
+	const float	tx = fx - x0f;
+	const float	ty = fy - y0f;
+	const pix_t	x0 = (pix_t)((spix_t)x0f + (spix_t)w) % w;
+	const pix_t	y0 = (pix_t)((spix_t)y0f + (spix_t)h) % h;
+	const pix_t	x1 = (x0 + 1) % w;
+	const pix_t	y1 = (y0 + 1) % h;
 
-	if (X >= W || Y >= H) {
-		return;
-	}
+	const boxvector	v00 = load_boxvector(d, y0 * w + x0);
+	const boxvector	v01 = load_boxvector(d, y0 * w + x1);
+	const boxvector	v10 = load_boxvector(d, y1 * w + x0);
+	const boxvector	v11 = load_boxvector(d, y1 * w + x1);
 
-	minlen = FLT_MAX;
-	o = densities[0][p];
-
-	for (s = 1; s < nscales; s++) {
-		/*
-		 * Look for the adjacent-scale pair that has the
-		 * smallest-magnitude difference vector.
-		 */
-		n = densities[s][p];
-		diff = n - o;
-		o = n;
-		len = length(diff);
+	return (mix(mix(v00, v01, tx), mix(v10, v11, tx), ty));
+}
 
-		if (len < minlen) {
-			minlen = len;
-			tgts = s;
-			tgtv = diff;
-		}
-	}
+/*
+ * The second half of the algorithm, shared by all versions of the kernel.
+ * "tgts" is the smaller-radius scale index of the scale pair that was
+ * chosen for pixel (X, Y), "tgtv" is the difference vector between scales
+ * "tgts" and "tgts - 1", and "minlen" is its length.
+ *
+ * This returns the data point to be displayed, and sets "*rsp" to the new
+ * value of recentscale[p].
+ */
+static datavec
+multiscale_update(
+	const pix_t		p,
+	const float		minlen,
+	const int		tgts,
+	const boxvector		tgtv,
+	__constant ms_params_t	*params,
+	const int		nscales,
+	__global datastore	*odata,
+	__global datastore	*ndata,
+	__global float		*recentscale,
+	float			*rsp)
+{
+	datavec		od, nd;
 
 	/*
-	 * At this point, "tgts" is the smaller-radius scale index of the
-	 * scale pair we've chosen, and "tgtv" is the difference vector
-	 * between "s" and "s-1".
-	 *
 	 * We adjust this data point by the difference vector, as scaled by
 	 * the adjustment factor for this scale.
 	 */
-	od = odata[p];
+	od = load_datavec(odata, p);
 	nd = od;
 	if (minlen > 0) {
-		nd += normalize(tgtv) * adj[tgts - 1];
+		nd += normalize(tgtv) * params->ms_adj[tgts - 1];
 	}
 
 	/*
@@ -87,16 +98,16 @@ multiscale(
 	 * but min/max isn't as parallelizable as some things.
 	 *
 	 * Instead, we just observe that the largest possible component
-	 * would be (1 + maxadj) -- which would happen if odata[p] was a
+	 * would be (1 + ms_maxadj) -- which would happen if odata[p] was a
 	 * unit vector in some direction, normalize(tgtv) was a unit vector
-	 * in the same direction, and adj[tgts - 1] used the maximum
+	 * in the same direction, and ms_adj[tgts - 1] used the maximum
 	 * adjustment.  So we simplify the process by just forcibly
 	 * rescaling all the results by that amount.
 	 *
 	 * This also injects visually useful instability into the system.
 	 */
-	nd /= (1 + maxadj);
-	ndata[p] = nd;
+	nd /= (1 + params->ms_maxadj);
+	store_datavec(nd, ndata, p);
 
 	/*
 	 * A decayed moving average of which scale was used to drive this
@@ -108,10 +119,255 @@ multiscale(
 	const float	ns = decay * rs +
 	    (1.0f - decay) * (float)tgts / nscales;
 	recentscale[p] = ns;
+	*rsp = ns;
 
 	/*
 	 * We average out the previous and next data point when generating
 	 * the results to be displayed.
 	 */
-	write_imagef(result, (int2)(X, Y), (od + nd) / 2);
+	return ((od + nd) / 2);
+}
+
+/*
+ * Look for the adjacent-scale pair that has the smallest-magnitude
+ * difference vector.  This returns that magnitude, and sets "*tgtsp" to
+ * the smaller-radius scale index of the pair and "*tgtvp" to the vector.
+ */
+static float
+multiscale_search(
+	__global boxstore	*const *densities,
+	__constant int		*decim,
+	const int		nscales,
+	const pix_t		X,
+	const pix_t		Y,
+	const pix_t		W,
+	const pix_t		H,
+	int			*tgtsp,
+	boxvector		*tgtvp)
+{
+	boxvector	o, n, diff;
+	float		minlen, len;
+
+	minlen = FLT_MAX;
+	o = multiscale_sample(densities[0], decim[0], X, Y, W, H);
+
+	for (int s = 1; s < nscales; s++) {
+		n = multiscale_sample(densities[s], decim[s], X, Y, W, H);
+		diff = n - o;
+		o = n;
+		len = length(diff);
+
+		if (len < minlen) {
+			minlen = len;
+			*tgtsp = s;
+			*tgtvp = diff;
+		}
+	}
+
+	return (minlen);
+}
+/* ------------------------------------------------------------------ */
+
+/*
+ * The batched version: all of the blurs are done before this runs, and it
+ * looks at all of them at once.
+ */
+__kernel void
+multiscale(
+	const pix_t		Wparam,		/* in */
+	const pix_t		Hparam,		/* in */
+	__global boxstore	*d0,		/* in */
+	__global boxstore	*d1,		/* in */
+	__global boxstore	*d2,		/* in */
+	__global boxstore	*d3,		/* in */
+	__global boxstore	*d4,		/* in */
+	__global boxstore	*d5,		/* in */
+	__global boxstore	*d6,		/* in */
+	__global boxstore	*d7,		/* in */
+	__global boxstore	*d8,		/* in */
+	__constant ms_params_t	*params,	/* in */
+	const int		nsparam,	/* in */
+	__global datastore	*odata,		/* in */
+	__global datastore	*ndata,		/* out */
+	__global float		*recentscale,	/* in/out */
+	__write_only image2d_t	result)		/* out */
+{
+	const pix_t		W = SPEC_W(Wparam);
+	const pix_t		H = SPEC_H(Hparam);
+	const pix_t		X = get_global_id(0);
+	const pix_t		Y = get_global_id(1);
+	const pix_t		p = Y * W + X;
+	const int		nscales = SPEC_NSCALES(nsparam);
+	__global boxstore	*const	densities[9] =
+	    { d0, d1, d2, d3, d4, d5, d6, d7, d8 };
+
+	boxvector		tgtv;
+	float			minlen, rs;
+	int			tgts;
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+	params += MS_INSTANCE(X, Y, W);
+
+	minlen = multiscale_search(densities, params->ms_decim, nscales,
+	    X, Y, W, H, &tgts, &tgtv);
+	write_imagef(result, (int2)(X, Y),
+	    multiscale_update(p, minlen, tgts, tgtv, params, nscales,
+	    odata, ndata, recentscale, &rs));
+}
+
+/*
+ * The same as multiscale(), followed by render() (see render.cl) on the
+ * result, without a trip through memory in between.  "result" is only
+ * written if "exportdata" is set, i.e. if something other than the
+ * display wants the data too.
+ */
+__kernel void
+multiscale_render(
+	const pix_t		Wparam,		/* in */
+	const pix_t		Hparam,		/* in */
+	__global boxstore	*d0,		/* in */
+	__global boxstore	*d1,		/* in */
+	__global boxstore	*d2,		/* in */
+	__global boxstore	*d3,		/* in */
+	__global boxstore	*d4,		/* in */
+	__global boxstore	*d5,		/* in */
+	__global boxstore	*d6,		/* in */
+	__global boxstore	*d7,		/* in */
+	__global boxstore	*d8,		/* in */
+	__constant ms_params_t	*params,	/* in */
+	const int		nsparam,	/* in */
+	__global datastore	*odata,		/* in */
+	__global datastore	*ndata,		/* out */
+	__global float		*recentscale,	/* in/out */
+	const int		exportdata,	/* in */
+	__write_only image2d_t	result,		/* out, if exportdata */
+	__write_only image2d_t	image)		/* out */
+{
+	const pix_t		W = SPEC_W(Wparam);
+	const pix_t		H = SPEC_H(Hparam);
+	const pix_t		X = get_global_id(0);
+	const pix_t		Y = get_global_id(1);
+	const pix_t		p = Y * W + X;
+	const int		nscales = SPEC_NSCALES(nsparam);
+	__global boxstore	*const	densities[9] =
+	    { d0, d1, d2, d3, d4, d5, d6, d7, d8 };
+
+	boxvector		tgtv;
+	datavec			datum;
+	float			minlen, rs;
+	int			tgts;
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+	params += MS_INSTANCE(X, Y, W);
+
+	minlen = multiscale_search(densities, params->ms_decim, nscales,
+	    X, Y, W, H, &tgts, &tgtv);
+	datum = multiscale_update(p, minlen, tgts, tgtv, params, nscales,
+	    odata, ndata, recentscale, &rs);
+	if (exportdata) {
+		write_imagef(result, (int2)(X, Y), datum);
+	}
+	render_datum(X, Y, params->ms_rendertype, datum, rs, image);
+}
+
+/*
+ * Regenerate the data that multiscale_render() didn't write out, from the
+ * data before and after the step.
+ */
+__kernel void
+multiscale_export(
+	const pix_t		W,		/* in */
+	const pix_t		H,		/* in */
+	__global datastore	*odata,		/* in */
+	__global datastore	*ndata,		/* in */
+	__write_only image2d_t	result)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+	const pix_t	p = Y * W + X;
+
+	if (X < W && Y < H) {
+		write_imagef(result, (int2)(X, Y),
+		    (load_datavec(odata, p) + load_datavec(ndata, p)) / 2);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The streaming version, which only needs two blurs at a time.  After
+ * each new blur (of scale "s") is done, multiscale_fold() compares it to
+ * the previous one (of scale "s - 1"), and keeps track of the smallest
+ * difference seen so far.  The scales are done in increasing order, so
+ * ties go to the smaller scale, just like in multiscale().  After the last
+ * scale, multiscale_apply() does the update.
+ */
+__kernel void
+multiscale_fold(
+	const pix_t		Wparam,		/* in */
+	const pix_t		Hparam,		/* in */
+	__global boxstore	*prev,		/* in: blur of scale s - 1 */
+	__global boxstore	*cur,		/* in: blur of scale s */
+	const int		s,		/* in */
+	const int		prevf,		/* in: decimation of prev */
+	const int		curf,		/* in: decimation of cur */
+	__global float		*bestlen,	/* in/out */
+	__global boxstore	*bestvec,	/* in/out */
+	__global int		*bestscale)	/* in/out */
+{
+	const pix_t		W = SPEC_W(Wparam);
+	const pix_t		H = SPEC_H(Hparam);
+	const pix_t		X = get_global_id(0);
+	const pix_t		Y = get_global_id(1);
+	const pix_t		p = Y * W + X;
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+
+	const boxvector	diff = multiscale_sample(cur, curf, X, Y, W, H) -
+	    multiscale_sample(prev, prevf, X, Y, W, H);
+	const float	len = length(diff);
+
+	if (s == 1 || len < bestlen[p]) {
+		bestlen[p] = len;
+		store_boxvector(diff, bestvec, p);
+		bestscale[p] = s;
+	}
+}
+
+__kernel void
+multiscale_apply(
+	const pix_t		Wparam,		/* in */
+	const pix_t		Hparam,		/* in */
+	__global float		*bestlen,	/* in */
+	__global boxstore	*bestvec,	/* in */
+	__global int		*bestscale,	/* in */
+	__constant ms_params_t	*params,	/* in */
+	const int		nscales,	/* in */
+	__global datastore	*odata,		/* in */
+	__global datastore	*ndata,		/* out */
+	__global float		*recentscale,	/* in/out */
+	__write_only image2d_t	result)		/* out */
+{
+	const pix_t		W = SPEC_W(Wparam);
+	const pix_t		H = SPEC_H(Hparam);
+	const pix_t		X = get_global_id(0);
+	const pix_t		Y = get_global_id(1);
+	const pix_t		p = Y * W + X;
+	float			rs;
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+	params += MS_INSTANCE(X, Y, W);
+
+	write_imagef(result, (int2)(X, Y),
+	    multiscale_update(p, bestlen[p], bestscale[p],
+	    load_boxvector(bestvec, p), params, nscales,
+	    odata, ndata, recentscale, &rs));
 }
@@ -2,6 +2,7 @@
  * render.cl - computational kernels for rendering/unrendering the colorized
  * version of Multi-Scale Turing Patterns.
  */
+#include "msparams.h"
 
 /*
  * RGB  values are in the range [  0.0, 1.0 ]
@@ -54,51 +55,94 @@ import(
 	pix_t			W,		/* in */
 	pix_t			H,		/* in */
 	__read_only image2d_t	src,		/* in */
-	__global datavec	*dst)		/* out */
+	__global datastore	*dst)		/* out */
 {
 	const pix_t	X = get_global_id(0);
 	const pix_t	Y = get_global_id(1);
 
 	if (X < W && Y < H) {
-		dst[Y * W + X] = as_datavec(read_imagef(src, (int2)(X, Y)));
+		store_datavec(as_datavec(read_imagef(src, (int2)(X, Y))),
+		    dst, Y * W + X);
 	}
 }
 
 /*
- * XYZW values are in the range [ -1.0, 1.0 ]
- * RGB  values are in the range [  0.0, 1.0 ]
+ * acospi() and atan2pi() to within about 2e-5 and 7e-5 of a half-turn,
+ * respectively, without the range reduction that the built-in versions
+ * need for full precision.  The acos() approximation is from Abramowitz and
+ * Stegun, 4.4.45; the arctangent is a minimax polynomial on [0, 1], with
+ * the octant fixed up afterwards.
  */
-__kernel void
-render(
-	pix_t			W,		/* in */
-	pix_t			H,		/* in */
-	int			rendertype,	/* in */
-	__read_only image2d_t	data,		/* in */
-	__global float		*recentscale,	/* in */
-	__write_only image2d_t	image)		/* out */
+static float
+acospi_fast(const float x)
 {
-	const pix_t	X = get_global_id(0);
-	const pix_t	Y = get_global_id(1);
+	const float	a = fabs(x);
+	const float	r = sqrt(1.0f - a) * (0.4999785f + a * (-0.0675181f +
+	    a * (0.0236380f + a * -0.0059617f)));
 
-	if (X >= W || Y >= H) {
-		return;
+	return (x < 0.0f ? 1.0f - r : r);
+}
+
+static float
+atan2pi_fast(const float y, const float x)
+{
+	const float	ay = fabs(y);
+	const float	ax = fabs(x);
+	const float	hi = max(ax, ay);
+	const float	t = (hi != 0.0f ? min(ax, ay) / hi : 0.0f);
+	const float	t2 = t * t;
+	float		r;
+
+	r = (((-0.0464964749f * t2 + 0.15931422f) * t2 - 0.327622764f) *
+	    t2 * t + t) * M_1_PI_F;
+	if (ay > ax) {
+		r = 0.5f - r;
+	}
+	if (x < 0.0f) {
+		r = 1.0f - r;
 	}
+	return (y < 0.0f ? -r : r);
+}
 
-	const datavec	datum = as_datavec(read_imagef(data, (int2)(X, Y)));
+/*
+ * Turn one data point into its HSV color.  If "fast" is set, the angles
+ * come from the approximations above; the results are within
+ * RENDER_FAST_TOLERANCE of the precise ones (see render_check()).
+ *
+ * XYZW values are in the range [ -1.0, 1.0 ]
+ * HSV  values are in the range [  0.0, 1.0 ]
+ */
+static float3
+render_hsv(const datavec datum, const bool fast)
+{
+	float	theta1, theta2, phi;
 
 	/*
 	 * Take the 4-vector, and turn it into 4-spherical coordinates.
 	 *
 	 * (calculating rhox as sqrt(rho^2 - x^2) leads to too much FP error)
+	 *
+	 * theta1 and theta2 are in [ 0, 1 ].  phi is in [ -1, 1 ].
 	 */
-	const float	rho = min(length(datum), 1.0f);
-	const datavec	rx = (datavec)(0.0f, datum.y, datum.z, datum.w);
-	const float	rhox = min(length(rx), 1.0f);
+	if (fast) {
+		const float	dx = dot(datum.yzw, datum.yzw);
+		const float	d = dx + datum.x * datum.x;
 
-	/* theta1 and theta2 are in [ 0, 1 ].  phi is in [ -1, 1 ]. */
-	const float	theta1 = (rho  != 0.0f ? acospi(datum.x / rho)  : 0);
-	const float	theta2 = (rhox != 0.0f ? acospi(datum.y / rhox) : 0);
-	const float	phi = atan2pi(datum.w, datum.z);
+		/* rsqrt() of min(length, 1), as below */
+		theta1 = (d != 0.0f ? acospi_fast(clamp(datum.x *
+		    max(rsqrt(d), 1.0f), -1.0f, 1.0f)) : 0);
+		theta2 = (dx != 0.0f ? acospi_fast(clamp(datum.y *
+		    max(rsqrt(dx), 1.0f), -1.0f, 1.0f)) : 0);
+		phi = atan2pi_fast(datum.w, datum.z);
+	} else {
+		const float	rho = min(length(datum), 1.0f);
+		const datavec	rx = (datavec)(0.0f, datum.y, datum.z, datum.w);
+		const float	rhox = min(length(rx), 1.0f);
+
+		theta1 = (rho  != 0.0f ? acospi(datum.x / rho)  : 0);
+		theta2 = (rhox != 0.0f ? acospi(datum.y / rhox) : 0);
+		phi = atan2pi(datum.w, datum.z);
+	}
 
 	/*
 	 * Use the 4-spherical coordinates to get HSV values.
@@ -133,20 +177,97 @@ render(
 	const float	s = theta2;
 	const float	v = 1 - 1.01f * fabs(theta1 - 1 / 1.01f);
 
+	return ((float3)(h, s, v));
+}
+
+/*
+ * Render one data point, whose recentscale value is "rs".  This is also
+ * used by multiscale_render().
+ *
+ * The low bit of "rendertype" picks the coloring, and the next bit picks
+ * the fast path, which gets the angles and the RGB values without any
+ * transcendental functions or branches.
+ *
+ * XYZW values are in the range [ -1.0, 1.0 ]
+ * RGB  values are in the range [  0.0, 1.0 ]
+ */
+static void
+render_datum(
+	const pix_t		X,
+	const pix_t		Y,
+	const int		rendertype,
+	const datavec		datum,
+	const float		rs,
+	__write_only image2d_t	image)
+{
+	const bool	fast = ((rendertype & RENDER_FAST) != 0);
+	float3		hsv;
+
 	/*
 	 * This is mostly debugging code - it lets me explore different
 	 * ways of coloring the data. So far I haven't found anything that's
 	 * obviously more compelling than the default mode.
 	 */
-	float rs;
 	switch (rendertype & 1) {
 	case 0:	// Default.
-		hsv_to_image(X, Y, (float3)(h, s, v), image);
+		hsv = render_hsv(datum, fast);
 		break;
 
 	case 1:	// Recentscale.
-		rs = recentscale[Y * W + X];
-		hsv_to_image(X, Y, (float3)(rs, 1.0f, 1.0f), image);
+		hsv = (float3)(rs, 1.0f, 1.0f);
 		break;
 	}
+
+	write_imagef(image, (int2)(X, Y),
+	    (float4)(fast ? hsv_to_rgb_fast(hsv) : hsv_to_rgb(hsv), 0));
+}
+
+/*
+ * Compare the fast rendering path to the precise one for every pixel of
+ * "data", and keep the largest difference in any RGB channel in "maxerr".
+ * Non-negative floats sort the same way as their bit patterns, so that
+ * can be done with an integer atomic.
+ */
+__kernel void
+render_check(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	__global datastore	*data,		/* in */
+	__global int		*maxerr)	/* in/out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+
+	const datavec	datum = load_datavec(data, Y * W + X);
+	const float3	d = fabs(hsv_to_rgb(render_hsv(datum, false)) -
+	    hsv_to_rgb_fast(render_hsv(datum, true)));
+
+	atomic_max(maxerr, as_int(max(max(d.x, d.y), d.z)));
+}
+
+__kernel void
+render(
+	pix_t			W,		/* in */
+	pix_t			H,		/* in */
+	__constant ms_params_t	*params,	/* in */
+	__read_only image2d_t	data,		/* in */
+	__global float		*recentscale,	/* in */
+	__write_only image2d_t	image)		/* out */
+{
+	const pix_t	X = get_global_id(0);
+	const pix_t	Y = get_global_id(1);
+
+	if (X >= W || Y >= H) {
+		return;
+	}
+
+	const int	rendertype = params[MS_INSTANCE(X, Y, W)].ms_rendertype;
+
+	render_datum(X, Y, rendertype,
+	    as_datavec(read_imagef(data, (int2)(X, Y))),
+	    ((rendertype & 1) ? recentscale[Y * W + X] : 0.0f), image);
 }
@@ -11,6 +11,8 @@
 
 #include "common.h"
 #include "datasrc.h"
+#include "explore.h"
+#include "interp.h"
 #include "keyboard.h"
 #include "window.h"
 #include "param.h"
@@ -26,9 +28,10 @@ static const param_init_t Param_values[] = {
 	{ 2, NSCALES, NSCALES,      1, APF_LOW, APR_MED,  "NS", "nscales" },
 	// Number of scales to use.
 
-	{ 0,       4,       6,      1, APF_MED, APR_MED,  "SP", "speed" },
+	{ -1,      4,       6,      1, APF_MED, APR_MED,  "SP", "speed" },
 	// log2(scale factor) for multiscale adj[]
-	// -1 = stop updates (still lets the heatmap spin)
+	// -1 = stop updates (still lets the heatmap spin, and the core
+	// stops stepping; see ms_frozen()).  Only set by hand.
 
 	{ 1,       2,       3,      1, APF_LOW, APR_LOW,  "NB", "nbox" },
 	// Number of box blur passes to do.
@@ -39,7 +42,15 @@ static const param_init_t Param_values[] = {
 #undef	NADJ
 
 	{ 0,       0,     999,      1, APF_OFF, APR_HIGH, "RT", "rendertype" },
-	// Which style of rendering to use.
+	// Which style of rendering to use.  Bit 0 colors by the recent
+	// scale; bit 1 uses the fast approximations (see render.cl).
+
+	{ 0,       0, NSCALES,      1, APF_OFF, APR_LOW,  "LS", "lazyscales" },
+	// How many of the largest scales to blur only every "lazyperiod"
+	// steps, reusing the last blur in between (see ms_lazy_mask()).
+
+	{ 1,       4,      16,      1, APF_OFF, APR_LOW,  "LP", "lazyperiod" },
+	// How often to blur each of the "lazyscales" scales, in steps.
 };
 
 /* ------------------------------------------------------------------ */
@@ -53,6 +64,8 @@ static struct {
 	param_id_t	nbox;
 	param_id_t	adjtype;
 	param_id_t	rendertype;
+	param_id_t	lazyscales;
+	param_id_t	lazyperiod;
 } Params;
 
 static void
@@ -108,6 +121,7 @@ tweak_preinit(void)
 	param_key_register('-', KB_KEYPAD, Params.nscales,  1);
 
 	Params.speed = param_lookup("speed");
+	param_autopilot_min(Params.speed, 0);
 	param_key_register('-', KB_DEFAULT, Params.speed, -1);
 	param_key_register('_', KB_DEFAULT, Params.speed, -1);
 	param_key_register('+', KB_DEFAULT, Params.speed,  1);
@@ -127,6 +141,36 @@ tweak_preinit(void)
 	param_key_register('n', KB_DEFAULT, Params.rendertype, -1);
 	param_key_register('N', KB_DEFAULT, Params.rendertype,  1);
 
+	Params.lazyscales = param_lookup("lazyscales");
+	param_key_register('l', KB_DEFAULT, Params.lazyscales, -1);
+	param_key_register('L', KB_DEFAULT, Params.lazyscales,  1);
+
+	Params.lazyperiod = param_lookup("lazyperiod");
+	param_key_register('k', KB_DEFAULT, Params.lazyperiod, -1);
+	param_key_register('K', KB_DEFAULT, Params.lazyperiod,  1);
+
+	/*
+	 * These decide which blurs get done, so in exploration mode, every
+	 * instance has to agree on them.
+	 */
+	explore_share(Params.nscales);
+	explore_share(Params.nbox);
+	explore_share(Params.lazyscales);
+	explore_share(Params.lazyperiod);
+
+	/*
+	 * Each scale is another set of blurs, and each box pass another
+	 * blur per scale, so these are what make frames slow.
+	 */
+	param_costly(Params.nscales);
+	param_costly(Params.nbox);
+
+	/*
+	 * Each step only moves the data a little way, so the images in
+	 * between can just be blended.
+	 */
+	interp_enable(1, 8);
+
 	key_register_arg('7', KB_KEYPAD, "preset 1", key_preset, 1);
 	key_register_arg('8', KB_KEYPAD, "preset 2", key_preset, 2);
 	key_register_arg('4', KB_KEYPAD, "preset 3", key_preset, 3);
@@ -170,6 +214,18 @@ tweak_rendertype(void)
 	return (param_int(Params.rendertype));
 }
 
+int
+tweak_lazy_scales(void)
+{
+	return (param_int(Params.lazyscales));
+}
+
+int
+tweak_lazy_period(void)
+{
+	return (param_int(Params.lazyperiod));
+}
+
 /*
  * Given a scale in the range [0, NSCALES), return a radius for the box blur.
  */
@@ -185,6 +241,15 @@ tweak_box_radius(int scale)
 
 	assert(scale >= 0 && scale < NSCALES);
 
+	/*
+	 * In exploration mode, a blur can't wrap around an instance more than
+	 * once; see box.cl.
+	 */
+	if (explore_tile() != 0) {
+		return (MIN((pix_t)(window_getscale() * scales[scale]),
+		    explore_tile()));
+	}
+
 	return ((pix_t)(window_getscale() * scales[scale]));
 }
 
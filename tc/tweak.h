@@ -2,6 +2,7 @@
 #define	_TWEAK_H
 
 #include "types.h"
+#include "msparams.h"
 
 extern void	tweak_preinit(void);
 extern void	tweak_init(void);
@@ -10,6 +11,8 @@ extern void	tweak_fini(void);
 extern int	tweak_nscales(void);
 extern int	tweak_nbox(void);
 extern int	tweak_rendertype(void);
+extern int	tweak_lazy_scales(void);
+extern int	tweak_lazy_period(void);
 extern pix_t	tweak_box_radius(int scale);
 extern float	tweak_multiscale_adj(int scale);
 
@@ -17,9 +20,8 @@ extern float	tweak_multiscale_adj(int scale);
 extern void	multiscale_adjust(void);
 
 /*
- * Maximum values for some of the parameters.
+ * Maximum values for some of the parameters.  NSCALES is in msparams.h.
  */
-#define	NSCALES		9	/* number of scales to operate on */
 #define	NADJTYPE	7	/* number of adjustment arrays */
 
 #endif	/* _TWEAK_H */